@@ -0,0 +1,1024 @@
+/*
+ * idevicebench.c
+ * Microbenchmarks for the transport and protocol hot paths
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicebench"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#ifndef WIN32
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#else
+#include <winsock2.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/property_list_service.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/syslog_relay.h>
+#include <libimobiledevice/mobilebackup2.h>
+#include <plist/plist.h>
+
+#include "common/socket.h"
+#include "common/thread.h"
+#include "common/utils.h"
+#include "endianness.h"
+
+#define BENCH_UDID "00008030-0000BE7C4000002E"
+#define BENCH_DEVICE_ID 1
+
+/* service ports of the fake device, both bytes are the same so it does not
+   matter in which byte order libusbmuxd puts the port into the request */
+#define PORT_SINK   0x2121
+#define PORT_SOURCE 0x2222
+#define PORT_ECHO   0x2323
+#define PORT_PLIST  0x2424
+#define PORT_AFC    0x2525
+#define PORT_SYSLOG 0x2626
+#define PORT_MB2    0x2727
+
+#define MUX_PROTOCOL_PLIST 1
+#define MUX_MESSAGE_PLIST 8
+
+#define AFC_HEADER_SIZE 40
+#define AFC_OP_STATUS 0x01
+#define AFC_OP_DATA 0x02
+#define AFC_OP_GET_FILE_INFO 0x0A
+#define AFC_OP_FILE_OPEN 0x0D
+#define AFC_OP_FILE_OPEN_RES 0x0E
+#define AFC_OP_FILE_READ 0x0F
+#define AFC_OP_FILE_WRITE 0x10
+
+#define MB2_CODE_FILE_DATA 0x0C
+
+#define DEVICE_BUFFER_SIZE (8 * 1024 * 1024)
+#define DEFAULT_DURATION 1000
+
+struct mux_header {
+	uint32_t length;
+	uint32_t version;
+	uint32_t message;
+	uint32_t tag;
+};
+
+struct bench_result {
+	const char *name;
+	const char *variant;
+	uint32_t size;
+	uint64_t ops;
+	uint64_t bytes;
+	uint64_t usec;
+	uint64_t *latencies;
+	uint64_t num_latencies;
+	uint64_t max_latencies;
+	int error;
+};
+
+static uint64_t duration_usec = DEFAULT_DURATION * 1000;
+static const char *filter = NULL;
+static char *device_buffer = NULL;
+
+/* fake usbmuxd and device */
+
+static int recv_full(int fd, void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int r = socket_receive_timeout(fd, (char*)data + done, length - done, 0, 0);
+		if (r <= 0) {
+			return -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+static int send_full(int fd, const void *data, uint32_t length)
+{
+	uint32_t done = 0;
+	while (done < length) {
+		int r = socket_send(fd, (char*)data + done, length - done);
+		if (r <= 0) {
+			return -1;
+		}
+		done += r;
+	}
+	return 0;
+}
+
+static int send_plist_framed(int fd, plist_t plist)
+{
+	char *bin = NULL;
+	uint32_t len = 0;
+	plist_to_bin(plist, &bin, &len);
+	uint32_t nlen = htobe32(len);
+	int res = -1;
+	if (send_full(fd, &nlen, 4) == 0 && send_full(fd, bin, len) == 0) {
+		res = 0;
+	}
+	free(bin);
+	return res;
+}
+
+static plist_t receive_plist_framed(int fd)
+{
+	uint32_t nlen = 0;
+	plist_t plist = NULL;
+	if (recv_full(fd, &nlen, 4) < 0) {
+		return NULL;
+	}
+	nlen = be32toh(nlen);
+	char *buf = (char*)malloc(nlen);
+	if (buf && recv_full(fd, buf, nlen) == 0) {
+		plist_from_memory(buf, nlen, &plist);
+	}
+	free(buf);
+	return plist;
+}
+
+static void device_sink(int fd)
+{
+	char *buf = (char*)malloc(DEVICE_BUFFER_SIZE);
+	if (!buf)
+		return;
+	while (socket_receive_timeout(fd, buf, DEVICE_BUFFER_SIZE, 0, 0) > 0);
+	free(buf);
+}
+
+static void device_source(int fd)
+{
+	while (send_full(fd, device_buffer, 65536) == 0);
+}
+
+static void device_echo(int fd)
+{
+	char buf[65536];
+	int r;
+	while ((r = socket_receive_timeout(fd, buf, sizeof(buf), 0, 0)) > 0) {
+		if (send_full(fd, buf, r) < 0)
+			break;
+	}
+}
+
+static void device_plist_echo(int fd)
+{
+	uint32_t nlen = 0;
+	char *buf = NULL;
+	while (recv_full(fd, &nlen, 4) == 0) {
+		uint32_t len = be32toh(nlen);
+		char *nbuf = (char*)realloc(buf, len);
+		if (!nbuf)
+			break;
+		buf = nbuf;
+		if (recv_full(fd, buf, len) < 0)
+			break;
+		if (send_full(fd, &nlen, 4) < 0 || send_full(fd, buf, len) < 0)
+			break;
+	}
+	free(buf);
+}
+
+static int afc_reply(int fd, uint64_t packet_num, uint64_t operation, const void *data, uint64_t data_len, const void *payload, uint64_t payload_len)
+{
+	char header[AFC_HEADER_SIZE];
+	uint64_t v;
+	memcpy(header, "CFA6LPAA", 8);
+	v = htole64(AFC_HEADER_SIZE + data_len + payload_len);
+	memcpy(header + 8, &v, 8);
+	v = htole64(AFC_HEADER_SIZE + data_len);
+	memcpy(header + 16, &v, 8);
+	v = htole64(packet_num);
+	memcpy(header + 24, &v, 8);
+	v = htole64(operation);
+	memcpy(header + 32, &v, 8);
+	if (send_full(fd, header, AFC_HEADER_SIZE) < 0)
+		return -1;
+	if (data_len > 0 && send_full(fd, data, data_len) < 0)
+		return -1;
+	if (payload_len > 0 && send_full(fd, payload, payload_len) < 0)
+		return -1;
+	return 0;
+}
+
+static void device_afc(int fd)
+{
+	static const char file_info[] =
+		"st_size\0" "1073741824\0"
+		"st_blocks\0" "2097152\0"
+		"st_nlink\0" "1\0"
+		"st_ifmt\0" "S_IFREG\0"
+		"st_mtime\0" "1791936000000000000\0"
+		"st_birthtime\0" "1791936000000000000\0";
+	char header[AFC_HEADER_SIZE];
+	char *packet = (char*)malloc(DEVICE_BUFFER_SIZE);
+	if (!packet)
+		return;
+
+	while (recv_full(fd, header, AFC_HEADER_SIZE) == 0) {
+		uint64_t entire_length, packet_num, operation;
+		memcpy(&entire_length, header + 8, 8);
+		memcpy(&packet_num, header + 24, 8);
+		memcpy(&operation, header + 32, 8);
+		entire_length = le64toh(entire_length);
+		packet_num = le64toh(packet_num);
+		operation = le64toh(operation);
+		if (entire_length < AFC_HEADER_SIZE || entire_length - AFC_HEADER_SIZE > DEVICE_BUFFER_SIZE)
+			break;
+		if (recv_full(fd, packet, entire_length - AFC_HEADER_SIZE) < 0)
+			break;
+
+		uint64_t status = 0;
+		uint64_t value = 0;
+		int res;
+		switch (operation) {
+		case AFC_OP_FILE_OPEN:
+			value = htole64(1);
+			res = afc_reply(fd, packet_num, AFC_OP_FILE_OPEN_RES, &value, 8, NULL, 0);
+			break;
+		case AFC_OP_FILE_READ:
+			memcpy(&value, packet + 8, 8);
+			value = le64toh(value);
+			if (value > DEVICE_BUFFER_SIZE)
+				value = DEVICE_BUFFER_SIZE;
+			res = afc_reply(fd, packet_num, AFC_OP_DATA, NULL, 0, device_buffer, value);
+			break;
+		case AFC_OP_GET_FILE_INFO:
+			res = afc_reply(fd, packet_num, AFC_OP_DATA, NULL, 0, file_info, sizeof(file_info) - 1);
+			break;
+		default:
+			res = afc_reply(fd, packet_num, AFC_OP_STATUS, &status, 8, NULL, 0);
+			break;
+		}
+		if (res < 0)
+			break;
+	}
+	free(packet);
+}
+
+static void device_syslog(int fd)
+{
+	static const char line[] = "Oct 14 09:41:00 iPhone backboardd(CoreBrightness)[68] <Notice>: Brightness changed to 0.500000 by user\n";
+	char *buf = (char*)malloc(65536);
+	if (!buf)
+		return;
+	uint32_t len = 0;
+	while (len + sizeof(line) - 1 <= 65536) {
+		memcpy(buf + len, line, sizeof(line) - 1);
+		len += sizeof(line) - 1;
+	}
+	while (send_full(fd, buf, len) == 0);
+	free(buf);
+}
+
+static void device_mobilebackup2(int fd)
+{
+	plist_t msg = plist_new_array();
+	plist_array_append_item(msg, plist_new_string("DLMessageVersionExchange"));
+	plist_array_append_item(msg, plist_new_uint(400));
+	plist_array_append_item(msg, plist_new_uint(0));
+	int res = send_plist_framed(fd, msg);
+	plist_free(msg);
+	if (res < 0)
+		return;
+
+	msg = receive_plist_framed(fd);
+	if (!msg)
+		return;
+	plist_free(msg);
+
+	msg = plist_new_array();
+	plist_array_append_item(msg, plist_new_string("DLMessageDeviceReady"));
+	res = send_plist_framed(fd, msg);
+	plist_free(msg);
+	if (res < 0)
+		return;
+
+	/* an endless file transfer in blocks like the ones of DLMessageUploadFiles */
+	uint32_t payload = 65536;
+	char *block = (char*)malloc(payload + 5);
+	if (!block)
+		return;
+	uint32_t nlen = htobe32(payload + 1);
+	memcpy(block, &nlen, 4);
+	block[4] = MB2_CODE_FILE_DATA;
+	memcpy(block + 5, device_buffer, payload);
+	while (send_full(fd, block, payload + 5) == 0);
+	free(block);
+}
+
+static int mux_send_plist(int fd, uint32_t tag, plist_t plist)
+{
+	char *xml = NULL;
+	uint32_t len = 0;
+	plist_to_xml(plist, &xml, &len);
+	struct mux_header hdr;
+	hdr.length = htole32(sizeof(hdr) + len);
+	hdr.version = htole32(MUX_PROTOCOL_PLIST);
+	hdr.message = htole32(MUX_MESSAGE_PLIST);
+	hdr.tag = htole32(tag);
+	int res = -1;
+	if (send_full(fd, &hdr, sizeof(hdr)) == 0 && send_full(fd, xml, len) == 0) {
+		res = 0;
+	}
+	free(xml);
+	return res;
+}
+
+static int mux_send_result(int fd, uint32_t tag, uint64_t result)
+{
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "MessageType", plist_new_string("Result"));
+	plist_dict_set_item(reply, "Number", plist_new_uint(result));
+	int res = mux_send_plist(fd, tag, reply);
+	plist_free(reply);
+	return res;
+}
+
+static int mux_send_device_list(int fd, uint32_t tag)
+{
+	plist_t props = plist_new_dict();
+	plist_dict_set_item(props, "ConnectionType", plist_new_string("USB"));
+	plist_dict_set_item(props, "DeviceID", plist_new_uint(BENCH_DEVICE_ID));
+	plist_dict_set_item(props, "LocationID", plist_new_uint(0x14100000));
+	plist_dict_set_item(props, "ProductID", plist_new_uint(0x12a8));
+	plist_dict_set_item(props, "SerialNumber", plist_new_string(BENCH_UDID));
+	plist_t dev = plist_new_dict();
+	plist_dict_set_item(dev, "DeviceID", plist_new_uint(BENCH_DEVICE_ID));
+	plist_dict_set_item(dev, "MessageType", plist_new_string("Attached"));
+	plist_dict_set_item(dev, "Properties", props);
+	plist_t list = plist_new_array();
+	plist_array_append_item(list, dev);
+	plist_t reply = plist_new_dict();
+	plist_dict_set_item(reply, "DeviceList", list);
+	int res = mux_send_plist(fd, tag, reply);
+	plist_free(reply);
+	return res;
+}
+
+static void* mux_client_thread(void *data)
+{
+	int fd = (int)(long)data;
+	struct mux_header hdr;
+
+	while (recv_full(fd, &hdr, sizeof(hdr)) == 0) {
+		uint32_t length = le32toh(hdr.length);
+		uint32_t tag = le32toh(hdr.tag);
+		if (le32toh(hdr.version) != MUX_PROTOCOL_PLIST || length < sizeof(hdr)) {
+			/* only the plist protocol is implemented */
+			break;
+		}
+		char *payload = (char*)malloc(length - sizeof(hdr));
+		if (!payload || recv_full(fd, payload, length - sizeof(hdr)) < 0) {
+			free(payload);
+			break;
+		}
+		plist_t request = NULL;
+		plist_from_memory(payload, length - sizeof(hdr), &request);
+		free(payload);
+
+		char *type = NULL;
+		plist_get_string_val(plist_dict_get_item(request, "MessageType"), &type);
+		uint64_t port = 0;
+		plist_get_uint_val(plist_dict_get_item(request, "PortNumber"), &port);
+		plist_free(request);
+
+		if (type && !strcmp(type, "ListDevices")) {
+			free(type);
+			if (mux_send_device_list(fd, tag) < 0)
+				break;
+		} else if (type && !strcmp(type, "Connect")) {
+			free(type);
+			void (*handler)(int) = NULL;
+			switch (port) {
+			case PORT_SINK: handler = device_sink; break;
+			case PORT_SOURCE: handler = device_source; break;
+			case PORT_ECHO: handler = device_echo; break;
+			case PORT_PLIST: handler = device_plist_echo; break;
+			case PORT_AFC: handler = device_afc; break;
+			case PORT_SYSLOG: handler = device_syslog; break;
+			case PORT_MB2: handler = device_mobilebackup2; break;
+			default: break;
+			}
+			if (!handler) {
+				/* connection refused */
+				mux_send_result(fd, tag, 3);
+				break;
+			}
+			if (mux_send_result(fd, tag, 0) == 0) {
+				/* from here on the connection belongs to the service */
+				socket_set_nodelay(fd, 1);
+				handler(fd);
+			}
+			break;
+		} else {
+			free(type);
+			if (mux_send_result(fd, tag, 1) < 0)
+				break;
+		}
+	}
+	socket_close(fd);
+	return NULL;
+}
+
+static void* mux_server_thread(void *data)
+{
+	int sfd = (int)(long)data;
+	while (1) {
+		int fd = socket_accept(sfd, 0);
+		if (fd < 0)
+			break;
+		THREAD_T th;
+		if (thread_new(&th, mux_client_thread, (void*)(long)fd) == 0) {
+			thread_detach(th);
+		} else {
+			socket_close(fd);
+		}
+	}
+	return NULL;
+}
+
+static int fake_usbmuxd_start(void)
+{
+	int sfd = socket_create(0);
+	if (sfd < 0) {
+		return -1;
+	}
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	if (getsockname(sfd, (struct sockaddr*)&addr, &addr_len) < 0) {
+		socket_close(sfd);
+		return -1;
+	}
+	char address[32];
+	snprintf(address, sizeof(address), "127.0.0.1:%u", ntohs(addr.sin_port));
+#ifdef WIN32
+	_putenv_s("USBMUXD_SOCKET_ADDRESS", address);
+#else
+	setenv("USBMUXD_SOCKET_ADDRESS", address, 1);
+#endif
+
+	THREAD_T th;
+	if (thread_new(&th, mux_server_thread, (void*)(long)sfd) != 0) {
+		socket_close(sfd);
+		return -1;
+	}
+	thread_detach(th);
+	return 0;
+}
+
+/* measurement and output */
+
+static int bench_selected(const char *name)
+{
+	return !filter || strstr(name, filter);
+}
+
+static void bench_begin(struct bench_result *res, const char *name, const char *variant, uint32_t size)
+{
+	memset(res, 0, sizeof(*res));
+	res->name = name;
+	res->variant = variant;
+	res->size = size;
+}
+
+static void bench_add_latency(struct bench_result *res, uint64_t usec)
+{
+	if (res->num_latencies == res->max_latencies) {
+		uint64_t max = (res->max_latencies) ? res->max_latencies * 2 : 4096;
+		uint64_t *latencies = (uint64_t*)realloc(res->latencies, max * sizeof(uint64_t));
+		if (!latencies)
+			return;
+		res->latencies = latencies;
+		res->max_latencies = max;
+	}
+	res->latencies[res->num_latencies++] = usec;
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x > y) - (x < y);
+}
+
+static uint64_t percentile(const struct bench_result *res, unsigned int p)
+{
+	uint64_t idx = (res->num_latencies - 1) * p / 100;
+	return res->latencies[idx];
+}
+
+/* one JSON object per line so results of different releases can be diffed */
+static void bench_end(struct bench_result *res)
+{
+	double seconds = (double)res->usec / 1000000.0;
+	printf("{\"benchmark\":\"%s\",\"variant\":\"%s\",\"version\":\"%s\",\"size\":%u,\"ops\":%llu,\"bytes\":%llu,\"seconds\":%.6f",
+		res->name, (res->variant) ? res->variant : "", PACKAGE_VERSION, res->size,
+		(unsigned long long)res->ops, (unsigned long long)res->bytes, seconds);
+	if (res->usec > 0) {
+		printf(",\"ops_per_sec\":%.1f,\"mib_per_sec\":%.3f", (double)res->ops / seconds, (double)res->bytes / seconds / (1024.0 * 1024.0));
+	}
+	if (res->num_latencies > 0) {
+		qsort(res->latencies, res->num_latencies, sizeof(uint64_t), compare_uint64);
+		printf(",\"latency_usec\":{\"min\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}",
+			(unsigned long long)res->latencies[0],
+			(unsigned long long)percentile(res, 50),
+			(unsigned long long)percentile(res, 90),
+			(unsigned long long)percentile(res, 99),
+			(unsigned long long)res->latencies[res->num_latencies - 1]);
+	}
+	if (res->error) {
+		printf(",\"error\":%d", res->error);
+	}
+	printf("}\n");
+	fflush(stdout);
+	free(res->latencies);
+	res->latencies = NULL;
+}
+
+/* benchmarks */
+
+static void bench_connection_send(idevice_t device, uint32_t size)
+{
+	struct bench_result res;
+	idevice_connection_t conn = NULL;
+	bench_begin(&res, "connection_send", "raw", size);
+	res.error = idevice_connect(device, PORT_SINK, &conn);
+	if (res.error == IDEVICE_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			uint32_t sent = 0;
+			uint64_t t = now;
+			res.error = idevice_connection_send(conn, device_buffer, size, &sent);
+			if (res.error != IDEVICE_E_SUCCESS)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+			res.bytes += sent;
+		}
+		res.usec = now - start;
+		idevice_disconnect(conn);
+	}
+	bench_end(&res);
+}
+
+static void bench_connection_receive(idevice_t device, uint32_t size)
+{
+	struct bench_result res;
+	idevice_connection_t conn = NULL;
+	char *buf = (char*)malloc(size);
+	bench_begin(&res, "connection_receive", "raw", size);
+	res.error = idevice_connect(device, PORT_SOURCE, &conn);
+	if (res.error == IDEVICE_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			uint32_t recvd = 0;
+			uint64_t t = now;
+			res.error = idevice_connection_receive(conn, buf, size, &recvd);
+			if (res.error != IDEVICE_E_SUCCESS)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+			res.bytes += recvd;
+		}
+		res.usec = now - start;
+		idevice_disconnect(conn);
+	}
+	free(buf);
+	bench_end(&res);
+}
+
+static void bench_connection_roundtrip(idevice_t device, uint32_t size)
+{
+	struct bench_result res;
+	idevice_connection_t conn = NULL;
+	char *buf = (char*)malloc(size);
+	bench_begin(&res, "connection_roundtrip", "raw", size);
+	res.error = idevice_connect(device, PORT_ECHO, &conn);
+	if (res.error == IDEVICE_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			uint32_t sent = 0;
+			uint32_t recvd = 0;
+			uint64_t t = now;
+			res.error = idevice_connection_send(conn, device_buffer, size, &sent);
+			while (res.error == IDEVICE_E_SUCCESS && recvd < size) {
+				uint32_t r = 0;
+				res.error = idevice_connection_receive(conn, buf + recvd, size - recvd, &r);
+				recvd += r;
+			}
+			if (res.error != IDEVICE_E_SUCCESS)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+			res.bytes += sent + recvd;
+		}
+		res.usec = now - start;
+		idevice_disconnect(conn);
+	}
+	free(buf);
+	bench_end(&res);
+}
+
+static void bench_plist_roundtrip(idevice_t device, int binary, uint32_t entries)
+{
+	struct bench_result res;
+	struct lockdownd_service_descriptor service = { PORT_PLIST, 0 };
+	property_list_service_client_t plclient = NULL;
+	uint32_t i;
+
+	plist_t request = plist_new_dict();
+	plist_dict_set_item(request, "Request", plist_new_string("GetValue"));
+	plist_t items = plist_new_array();
+	for (i = 0; i < entries; i++) {
+		plist_t item = plist_new_dict();
+		plist_dict_set_item(item, "Key", plist_new_string("ProductVersion"));
+		plist_dict_set_item(item, "Value", plist_new_uint(i));
+		plist_array_append_item(items, item);
+	}
+	plist_dict_set_item(request, "Items", items);
+
+	bench_begin(&res, "plist_roundtrip", (binary) ? "binary" : "xml", entries);
+	res.error = property_list_service_client_new(device, &service, &plclient);
+	if (res.error == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			plist_t reply = NULL;
+			uint64_t t = now;
+			if (binary) {
+				res.error = property_list_service_send_binary_plist(plclient, request);
+			} else {
+				res.error = property_list_service_send_xml_plist(plclient, request);
+			}
+			if (res.error == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				res.error = property_list_service_receive_plist(plclient, &reply);
+			}
+			if (res.error != PROPERTY_LIST_SERVICE_E_SUCCESS)
+				break;
+			plist_free(reply);
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+		}
+		res.usec = now - start;
+		property_list_service_client_free(plclient);
+	}
+	plist_free(request);
+	bench_end(&res);
+}
+
+static void bench_afc_transfer(idevice_t device, int do_write, uint32_t size)
+{
+	struct bench_result res;
+	struct lockdownd_service_descriptor service = { PORT_AFC, 0 };
+	afc_client_t afc = NULL;
+	uint64_t handle = 0;
+	char *buf = (char*)malloc(size);
+
+	bench_begin(&res, (do_write) ? "afc_write" : "afc_read", "raw", size);
+	res.error = afc_client_new(device, &service, &afc);
+	if (res.error == AFC_E_SUCCESS) {
+		res.error = afc_file_open(afc, "/Benchmark/file.bin", (do_write) ? AFC_FOPEN_WRONLY : AFC_FOPEN_RDONLY, &handle);
+	}
+	if (res.error == AFC_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			uint32_t bytes = 0;
+			uint64_t t = now;
+			if (do_write) {
+				res.error = afc_file_write(afc, handle, device_buffer, size, &bytes);
+			} else {
+				res.error = afc_file_read(afc, handle, buf, size, &bytes);
+			}
+			if (res.error != AFC_E_SUCCESS)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+			res.bytes += bytes;
+		}
+		res.usec = now - start;
+		afc_file_close(afc, handle);
+	}
+	afc_client_free(afc);
+	free(buf);
+	bench_end(&res);
+}
+
+static void bench_afc_stat(idevice_t device, int use_struct)
+{
+	struct bench_result res;
+	struct lockdownd_service_descriptor service = { PORT_AFC, 0 };
+	afc_client_t afc = NULL;
+
+	bench_begin(&res, "afc_stat", (use_struct) ? "struct" : "dictionary", 0);
+	res.error = afc_client_new(device, &service, &afc);
+	if (res.error == AFC_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			uint64_t t = now;
+			if (use_struct) {
+				afc_file_info_t info;
+				res.error = afc_get_file_info_struct(afc, "/Benchmark/file.bin", &info);
+			} else {
+				char **info = NULL;
+				res.error = afc_get_file_info(afc, "/Benchmark/file.bin", &info);
+				afc_dictionary_free(info);
+			}
+			if (res.error != AFC_E_SUCCESS)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+		}
+		res.usec = now - start;
+	}
+	afc_client_free(afc);
+	bench_end(&res);
+}
+
+struct syslog_counter {
+	mutex_t mutex;
+	cond_t cond;
+	uint64_t lines;
+	uint64_t bytes;
+};
+
+static void syslog_line_cb(const char *line, uint32_t length, void *user_data)
+{
+	struct syslog_counter *counter = (struct syslog_counter*)user_data;
+	mutex_lock(&counter->mutex);
+	counter->lines++;
+	counter->bytes += length;
+	mutex_unlock(&counter->mutex);
+}
+
+static void bench_syslog_capture(idevice_t device)
+{
+	struct bench_result res;
+	struct lockdownd_service_descriptor service = { PORT_SYSLOG, 0 };
+	syslog_relay_client_t relay = NULL;
+	struct syslog_counter counter;
+
+	memset(&counter, 0, sizeof(counter));
+	mutex_init(&counter.mutex);
+	cond_init(&counter.cond);
+
+	bench_begin(&res, "syslog_capture", "lines", 0);
+	res.error = syslog_relay_client_new(device, &service, &relay);
+	if (res.error == SYSLOG_RELAY_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		res.error = syslog_relay_start_capture_lines(relay, syslog_line_cb, &counter);
+		if (res.error == SYSLOG_RELAY_E_SUCCESS) {
+			mutex_lock(&counter.mutex);
+			cond_wait_timeout(&counter.cond, &counter.mutex, duration_usec / 1000);
+			res.ops = counter.lines;
+			res.bytes = counter.bytes;
+			mutex_unlock(&counter.mutex);
+			res.usec = time_monotonic_usec() - start;
+			syslog_relay_stop_capture(relay);
+		}
+		syslog_relay_client_free(relay);
+	}
+	cond_destroy(&counter.cond);
+	mutex_destroy(&counter.mutex);
+	bench_end(&res);
+}
+
+static void bench_mobilebackup2_stream(idevice_t device, int own_buffer)
+{
+	struct bench_result res;
+	struct lockdownd_service_descriptor service = { PORT_MB2, 0 };
+	mobilebackup2_client_t mb2 = NULL;
+	uint32_t buffer_size = 65536 + 5;
+	char *buffer = (own_buffer) ? (char*)malloc(buffer_size) : NULL;
+
+	bench_begin(&res, "mobilebackup2_file_stream", (own_buffer) ? "caller_buffer" : "client_buffer", 65536);
+	res.error = mobilebackup2_client_new(device, &service, &mb2);
+	if (res.error == MOBILEBACKUP2_E_SUCCESS) {
+		uint64_t start = time_monotonic_usec();
+		uint64_t now = start;
+		while (now - start < duration_usec) {
+			char *data = NULL;
+			uint32_t length = 0;
+			char code = 0;
+			uint64_t t = now;
+			res.error = mobilebackup2_receive_block(mb2, buffer, buffer_size, &data, &length, &code);
+			if (res.error != MOBILEBACKUP2_E_SUCCESS || !data)
+				break;
+			now = time_monotonic_usec();
+			bench_add_latency(&res, now - t);
+			res.ops++;
+			res.bytes += length;
+		}
+		res.usec = now - start;
+		mobilebackup2_client_free(mb2);
+	}
+	free(buffer);
+	bench_end(&res);
+}
+
+#ifndef WIN32
+/* runs this program with --version, which costs little more than loading
+   the library, like the short-lived tools invoked from scripts */
+static void bench_tool_startup(const char *self)
+{
+	struct bench_result res;
+	bench_begin(&res, "tool_startup", "version", 0);
+	uint64_t start = time_monotonic_usec();
+	uint64_t now = start;
+	while (now - start < duration_usec) {
+		uint64_t t = now;
+		pid_t pid = fork();
+		if (pid == 0) {
+			int fd = open("/dev/null", O_WRONLY);
+			if (fd >= 0)
+				dup2(fd, STDOUT_FILENO);
+			execl(self, self, "--version", (char*)NULL);
+			_exit(127);
+		}
+		if (pid < 0) {
+			res.error = errno;
+			break;
+		}
+		int status = 0;
+		if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			res.error = -1;
+			break;
+		}
+		now = time_monotonic_usec();
+		bench_add_latency(&res, now - t);
+		res.ops++;
+	}
+	res.usec = now - start;
+	bench_end(&res);
+}
+#endif
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *name = strrchr(argv[0], '/');
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS]\n", (name ? name + 1: argv[0]));
+	fprintf(is_error ? stderr : stdout,
+		"\n"
+		"Run microbenchmarks of the transport and protocol code paths against a\n"
+		"fake device on the loopback interface. Results are printed as one JSON\n"
+		"object per line.\n"
+		"\n"
+		"OPTIONS:\n"
+		"  -t, --time MSEC       run each benchmark for MSEC milliseconds (default 1000)\n"
+		"  -f, --filter NAME     only run benchmarks whose name contains NAME\n"
+		"  -d, --debug           enable communication debugging\n"
+		"  -h, --help            prints usage information\n"
+		"  -v, --version         prints version information\n"
+		"\n"
+		"Homepage:    <" PACKAGE_URL ">\n"
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	static const uint32_t transfer_sizes[] = { 64, 4096, 65536, 1048576 };
+	unsigned int i;
+	int c = 0;
+	const struct option longopts[] = {
+		{ "time",    required_argument, NULL, 't' },
+		{ "filter",  required_argument, NULL, 'f' },
+		{ "debug",   no_argument,       NULL, 'd' },
+		{ "help",    no_argument,       NULL, 'h' },
+		{ "version", no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "t:f:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 't':
+			duration_usec = strtoull(optarg, NULL, 10) * 1000;
+			if (duration_usec == 0) {
+				fprintf(stderr, "ERROR: Invalid time '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+#ifndef WIN32
+	if (bench_selected("tool_startup"))
+		bench_tool_startup(argv[0]);
+#endif
+
+	device_buffer = (char*)malloc(DEVICE_BUFFER_SIZE);
+	if (!device_buffer) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < DEVICE_BUFFER_SIZE; i++) {
+		device_buffer[i] = (char)(i * 31);
+	}
+
+	if (fake_usbmuxd_start() < 0) {
+		fprintf(stderr, "ERROR: Could not start the fake usbmuxd\n");
+		return 1;
+	}
+
+	idevice_t device = NULL;
+	if (idevice_new(&device, BENCH_UDID) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not find the fake device\n");
+		return 1;
+	}
+
+	for (i = 0; i < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); i++) {
+		if (bench_selected("connection_send"))
+			bench_connection_send(device, transfer_sizes[i]);
+		if (bench_selected("connection_receive"))
+			bench_connection_receive(device, transfer_sizes[i]);
+		if (bench_selected("connection_roundtrip") && transfer_sizes[i] <= 65536)
+			bench_connection_roundtrip(device, transfer_sizes[i]);
+	}
+	if (bench_selected("plist_roundtrip")) {
+		bench_plist_roundtrip(device, 0, 1);
+		bench_plist_roundtrip(device, 1, 1);
+		bench_plist_roundtrip(device, 0, 1000);
+		bench_plist_roundtrip(device, 1, 1000);
+	}
+	for (i = 1; i < sizeof(transfer_sizes) / sizeof(transfer_sizes[0]); i++) {
+		if (bench_selected("afc_read"))
+			bench_afc_transfer(device, 0, transfer_sizes[i]);
+		if (bench_selected("afc_write"))
+			bench_afc_transfer(device, 1, transfer_sizes[i]);
+	}
+	if (bench_selected("afc_stat")) {
+		bench_afc_stat(device, 0);
+		bench_afc_stat(device, 1);
+	}
+	if (bench_selected("syslog_capture"))
+		bench_syslog_capture(device);
+	if (bench_selected("mobilebackup2_file_stream")) {
+		bench_mobilebackup2_stream(device, 0);
+		bench_mobilebackup2_stream(device, 1);
+	}
+
+	idevice_free(device);
+	free(device_buffer);
+
+	return 0;
+}
@@ -39,12 +39,12 @@
 #include "asprintf.h"
 #endif
 
-static int debug_level;
+int internal_debug_level = 0;
 static idevice_debug_cb_t cb = NULL;
 
 void internal_set_debug_level(int level)
 {
-	debug_level = level;
+	internal_debug_level = level;
 }
 
 void internal_set_debug_callback(idevice_debug_cb_t callback)
@@ -95,7 +95,7 @@ LIBIMOBILEDEVICE_API_MSC void debug_info_real(const char *func, const char *file
 	va_list args;
 	char *buffer = NULL;
 
-	if (!debug_level)
+	if (!internal_debug_level)
 		return;
 
 	/* run the real fprintf */
@@ -109,7 +109,7 @@ LIBIMOBILEDEVICE_API_MSC void debug_info_real(const char *func, const char *file
 #endif
 }
 
-void debug_buffer(const char *data, const int length)
+void debug_buffer_real(const char *data, const int length)
 {
 #ifndef STRIP_DEBUG_CODE
 	int i;
@@ -119,7 +119,7 @@ void debug_buffer(const char *data, const int length)
 	char line[80];
 	int pos;
 
-	if (debug_level > 1) {
+	if (internal_debug_level > 1) {
 		for (i = 0; i < length; i += 16) {
 			pos = 0;
 
@@ -170,7 +170,7 @@ void debug_buffer(const char *data, const int length)
 void debug_buffer_to_file(const char *file, const char *data, const int length)
 {
 #ifndef STRIP_DEBUG_CODE
-	if (debug_level > 1) {
+	if (internal_debug_level > 1) {
 		FILE *f = fopen(file, "wb");
 		fwrite(data, 1, length, f);
 		fflush(f);
@@ -182,7 +182,8 @@ void debug_buffer_to_file(const char *file, const char *data, const int length)
 void debug_plist_real(const char *func, const char *file, int line, plist_t plist)
 {
 #ifndef STRIP_DEBUG_CODE
-	if (!plist)
+	/* only serialize the plist if it is going to be printed */
+	if (!plist || !internal_debug_level)
 		return;
 
 	char *buffer = NULL;
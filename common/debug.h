@@ -30,15 +30,27 @@
 typedef void(*idevice_debug_cb_t) (char *message);
 void internal_set_debug_callback(idevice_debug_cb_t callback);
 
+/* checked at the call site so arguments are not evaluated when disabled */
+extern int internal_debug_level;
+
+#if defined(__GNUC__) && __GNUC__ >= 3
+#define debug_enabled(level) __builtin_expect(internal_debug_level >= (level), 0)
+#else
+#define debug_enabled(level) (internal_debug_level >= (level))
+#endif
+
 #if defined(__STDC_VERSION__) && __STDC_VERSION__ >= 199901L && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__func__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__func__, __FILE__, __LINE__, a)
+#define debug_info(...) do { if (debug_enabled(1)) debug_info_real (__func__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define debug_plist(a) do { if (debug_enabled(1)) debug_plist_real (__func__, __FILE__, __LINE__, a); } while (0)
+#define debug_buffer(data, length) do { if (debug_enabled(2)) debug_buffer_real (data, length); } while (0)
 #elif ((defined(__GNUC__) && __GNUC__ >= 3) || (defined(_MSC_VER))) && !defined(STRIP_DEBUG_CODE)
-#define debug_info(...) debug_info_real (__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__)
-#define debug_plist(a) debug_plist_real (__FUNCTION__, __FILE__, __LINE__, a)
+#define debug_info(...) do { if (debug_enabled(1)) debug_info_real (__FUNCTION__, __FILE__, __LINE__, __VA_ARGS__); } while (0)
+#define debug_plist(a) do { if (debug_enabled(1)) debug_plist_real (__FUNCTION__, __FILE__, __LINE__, a); } while (0)
+#define debug_buffer(data, length) do { if (debug_enabled(2)) debug_buffer_real (data, length); } while (0)
 #else
 #define debug_info(...)
 #define debug_plist(a)
+#define debug_buffer(data, length)
 #endif
 
 LIBIMOBILEDEVICE_API_MSC void debug_info_real(const char *func,
@@ -46,7 +58,7 @@ LIBIMOBILEDEVICE_API_MSC void debug_info_real(const char *func,
 											int	line,
 											const char *format, ...);
 
-void debug_buffer(const char *data, const int length);
+void debug_buffer_real(const char *data, const int length);
 void debug_buffer_to_file(const char *file, const char *data, const int length);
 void debug_plist_real(const char *func,
 											const char *file,
@@ -51,6 +51,7 @@ static int wsa_init = 0;
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <fcntl.h>
+#include <sys/uio.h>
 #ifdef AF_INET6
 #include <net/if.h>
 #include <ifaddrs.h>
@@ -838,3 +839,168 @@ int socket_send(int fd, void *data, size_t length)
 #endif
 	return send(fd, data, length, flags);
 }
+
+int socket_sendv(int fd, const struct socket_iovec *iov, int iovcnt)
+{
+	int i;
+#ifdef WIN32
+	WSABUF bufs[16];
+	DWORD sent = 0;
+	if (iovcnt <= 0 || iovcnt > 16) {
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].buf = (char*)iov[i].data;
+		bufs[i].len = (ULONG)iov[i].length;
+	}
+	if (WSASend(fd, bufs, (DWORD)iovcnt, &sent, 0, NULL, NULL) != 0) {
+		return -1;
+	}
+	return (int)sent;
+#else
+	struct iovec bufs[16];
+	struct msghdr msg;
+	int flags = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+	if (iovcnt <= 0 || iovcnt > 16) {
+		return -1;
+	}
+	for (i = 0; i < iovcnt; i++) {
+		bufs[i].iov_base = iov[i].data;
+		bufs[i].iov_len = iov[i].length;
+	}
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = iovcnt;
+	return (int)sendmsg(fd, &msg, flags);
+#endif
+}
+
+int socket_receive_try(int fd, void *data, size_t length, int flags,
+					 unsigned int timeout)
+{
+#ifdef MSG_DONTWAIT
+	int result = recv(fd, data, length, flags | MSG_DONTWAIT);
+	if (result > 0) {
+		return result;
+	}
+	if (result == 0) {
+		if (verbose >= 3)
+			fprintf(stderr, "%s: fd=%d recv returned 0\n", __func__, fd);
+		return -ECONNRESET;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+		return -errno;
+	}
+#endif
+	/* nothing pending, wait for it */
+	return socket_receive_timeout(fd, data, length, flags, timeout);
+}
+
+int socket_recv_into_ring(int fd, struct socket_ring *ring, unsigned int timeout)
+{
+	if (!ring || !ring->data || ring->size == 0) {
+		return -EINVAL;
+	}
+	if (ring->length >= ring->size) {
+		return -ENOBUFS;
+	}
+
+	/* the free space wraps around the end of the buffer at most once */
+	size_t tail = (ring->head + ring->length) % ring->size;
+	size_t first = (tail >= ring->head) ? ring->size - tail : ring->head - tail;
+	size_t second = (tail >= ring->head) ? ring->head : 0;
+	int result;
+
+#if defined(MSG_DONTWAIT) && !defined(WIN32)
+	struct iovec bufs[2];
+	struct msghdr msg;
+	bufs[0].iov_base = ring->data + tail;
+	bufs[0].iov_len = first;
+	bufs[1].iov_base = ring->data;
+	bufs[1].iov_len = second;
+	memset(&msg, '\0', sizeof(msg));
+	msg.msg_iov = bufs;
+	msg.msg_iovlen = (second > 0) ? 2 : 1;
+
+	result = (int)recvmsg(fd, &msg, MSG_DONTWAIT);
+	if (result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+		int res = socket_check_fd(fd, FDM_READ, timeout);
+		if (res <= 0) {
+			return res;
+		}
+		result = (int)recvmsg(fd, &msg, 0);
+	}
+	if (result == 0) {
+		return -ECONNRESET;
+	}
+	if (result < 0) {
+		return -errno;
+	}
+#else
+	/* the wrapped part is filled by the next call */
+	result = socket_receive_timeout(fd, ring->data + tail, first, 0, timeout);
+	if (result <= 0) {
+		return result;
+	}
+#endif
+	ring->length += result;
+	return result;
+}
+
+int socket_set_nodelay(int fd, int enable)
+{
+	int value = (enable) ? 1 : 0;
+	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&value, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set TCP_NODELAY: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int socket_set_buffer_sizes(int fd, int send_size, int receive_size)
+{
+	int res = 0;
+	if (send_size > 0 && setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (void*)&send_size, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set send buffer size: %s\n", __func__, strerror(errno));
+		res = -1;
+	}
+	if (receive_size > 0 && setsockopt(fd, SOL_SOCKET, SO_RCVBUF, (void*)&receive_size, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set receive buffer size: %s\n", __func__, strerror(errno));
+		res = -1;
+	}
+	return res;
+}
+
+int socket_set_keepalive(int fd, int idle, int interval, int count)
+{
+	int enable = (idle > 0) ? 1 : 0;
+	if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (void*)&enable, sizeof(int)) == -1) {
+		if (verbose >= 2)
+			fprintf(stderr, "%s: Could not set SO_KEEPALIVE: %s\n", __func__, strerror(errno));
+		return -1;
+	}
+	if (!enable) {
+		return 0;
+	}
+#if defined(TCP_KEEPIDLE)
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE, (void*)&idle, sizeof(int));
+#elif defined(TCP_KEEPALIVE)
+	/* macOS */
+	setsockopt(fd, IPPROTO_TCP, TCP_KEEPALIVE, (void*)&idle, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+	if (interval > 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL, (void*)&interval, sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+	if (count > 0)
+		setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT, (void*)&count, sizeof(int));
+#endif
+	return 0;
+}
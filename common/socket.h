@@ -32,6 +32,22 @@ enum fd_mode {
 };
 typedef enum fd_mode fd_mode;
 
+/* buffer description for socket_sendv() */
+struct socket_iovec {
+	void *data;
+	size_t length;
+};
+
+/* circular receive buffer for socket_recv_into_ring() */
+struct socket_ring {
+	char *data;
+	size_t size;
+	/* offset of the first byte stored */
+	size_t head;
+	/* number of bytes stored */
+	size_t length;
+};
+
 #ifdef WIN32
 #include <winsock2.h>
 #define SHUT_RD SD_READ
@@ -58,8 +74,18 @@ int socket_receive(int fd, void *data, size_t size);
 int socket_peek(int fd, void *data, size_t size);
 int socket_receive_timeout(int fd, void *data, size_t size, int flags,
 					 unsigned int timeout);
+/* like socket_receive_timeout() but only waits if no data is pending */
+int socket_receive_try(int fd, void *data, size_t size, int flags,
+					 unsigned int timeout);
+int socket_recv_into_ring(int fd, struct socket_ring *ring, unsigned int timeout);
 
 int socket_send(int fd, void *data, size_t size);
+int socket_sendv(int fd, const struct socket_iovec *iov, int iovcnt);
+
+int socket_set_nodelay(int fd, int enable);
+int socket_set_buffer_sizes(int fd, int send_size, int receive_size);
+/* idle is the number of seconds before probes are sent, 0 disables */
+int socket_set_keepalive(int fd, int idle, int interval, int count);
 
 void socket_set_verbose(int level);
 
@@ -22,8 +22,46 @@
 #ifdef HAVE_CONFIG_H
 #include <config.h>
 #endif
+#include <stdlib.h>
+
 #include "thread.h"
 
+#ifndef WIN32
+#include <time.h>
+#endif
+
+struct thread_future {
+	mutex_t mutex;
+	cond_t cond;
+	int done;
+	void* result;
+	/* held by the caller and by the queued task */
+	int refs;
+};
+
+struct threadpool_task {
+	thread_func_t func;
+	void* data;
+	thread_future_t future;
+	struct threadpool_task* next;
+};
+
+struct threadpool {
+	mutex_t mutex;
+	/* signalled when a task is queued or the pool is stopped */
+	cond_t work_cond;
+	/* signalled when the last worker exits */
+	cond_t exit_cond;
+	struct threadpool_task* head;
+	struct threadpool_task* tail;
+	unsigned int max_threads;
+	unsigned int idle_timeout;
+	unsigned int num_threads;
+	unsigned int num_idle;
+	unsigned int num_queued;
+	int stopping;
+};
+
 int thread_new(THREAD_T *thread, thread_func_t thread_func, void* data)
 {
 #ifdef WIN32
@@ -123,6 +161,122 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifdef WIN32
+	/* nothing to do */
+#else
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	return (SleepConditionVariableCS(cond, mutex, timeout_ms)) ? 0 : -1;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += timeout_ms / 1000;
+	ts.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
+	}
+	return (pthread_cond_timedwait(cond, mutex, &ts) == 0) ? 0 : -1;
+#endif
+}
+
+void rwlock_init(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	InitializeSRWLock(rwlock);
+#else
+	pthread_rwlock_init(rwlock, NULL);
+#endif
+}
+
+void rwlock_destroy(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	/* nothing to do */
+#else
+	pthread_rwlock_destroy(rwlock);
+#endif
+}
+
+void rwlock_rdlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	AcquireSRWLockShared(rwlock);
+#else
+	pthread_rwlock_rdlock(rwlock);
+#endif
+}
+
+void rwlock_wrlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	AcquireSRWLockExclusive(rwlock);
+#else
+	pthread_rwlock_wrlock(rwlock);
+#endif
+}
+
+void rwlock_rdunlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	ReleaseSRWLockShared(rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
+void rwlock_wrunlock(rwlock_t* rwlock)
+{
+#ifdef WIN32
+	ReleaseSRWLockExclusive(rwlock);
+#else
+	pthread_rwlock_unlock(rwlock);
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
@@ -138,3 +292,201 @@ void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 	pthread_once(once_control, init_routine);
 #endif
 }
+
+static void thread_future_release(thread_future_t future)
+{
+	mutex_lock(&future->mutex);
+	int refs = --future->refs;
+	mutex_unlock(&future->mutex);
+	if (refs == 0) {
+		cond_destroy(&future->cond);
+		mutex_destroy(&future->mutex);
+		free(future);
+	}
+}
+
+static void* threadpool_worker(void* arg)
+{
+	threadpool_t pool = (threadpool_t)arg;
+
+	mutex_lock(&pool->mutex);
+	while (1) {
+		struct threadpool_task* task = pool->head;
+		if (!task) {
+			if (pool->stopping) {
+				break;
+			}
+			pool->num_idle++;
+			int res = cond_wait_timeout(&pool->work_cond, &pool->mutex, pool->idle_timeout);
+			pool->num_idle--;
+			if (res < 0 && !pool->head) {
+				break;
+			}
+			continue;
+		}
+		pool->head = task->next;
+		pool->num_queued--;
+		if (!pool->head) {
+			pool->tail = NULL;
+		}
+		mutex_unlock(&pool->mutex);
+
+		void* result = task->func(task->data);
+
+		mutex_lock(&task->future->mutex);
+		task->future->result = result;
+		task->future->done = 1;
+		cond_broadcast(&task->future->cond);
+		mutex_unlock(&task->future->mutex);
+		thread_future_release(task->future);
+		free(task);
+
+		mutex_lock(&pool->mutex);
+	}
+	pool->num_threads--;
+	if (pool->num_threads == 0) {
+		cond_broadcast(&pool->exit_cond);
+	}
+	mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+int threadpool_new(threadpool_t *pool, unsigned int max_threads, unsigned int idle_timeout_ms)
+{
+	if (!pool) {
+		return -1;
+	}
+	threadpool_t pool_loc = (threadpool_t)calloc(1, sizeof(struct threadpool));
+	if (!pool_loc) {
+		return -1;
+	}
+	mutex_init(&pool_loc->mutex);
+	cond_init(&pool_loc->work_cond);
+	cond_init(&pool_loc->exit_cond);
+	pool_loc->max_threads = max_threads;
+	pool_loc->idle_timeout = idle_timeout_ms;
+	*pool = pool_loc;
+	return 0;
+}
+
+void threadpool_free(threadpool_t pool)
+{
+	if (!pool) {
+		return;
+	}
+	mutex_lock(&pool->mutex);
+	pool->stopping = 1;
+	cond_broadcast(&pool->work_cond);
+	while (pool->num_threads > 0) {
+		cond_wait(&pool->exit_cond, &pool->mutex);
+	}
+	mutex_unlock(&pool->mutex);
+
+	cond_destroy(&pool->exit_cond);
+	cond_destroy(&pool->work_cond);
+	mutex_destroy(&pool->mutex);
+	free(pool);
+}
+
+static threadpool_t shared_pool = NULL;
+static thread_once_t shared_pool_once = THREAD_ONCE_INIT;
+
+static void threadpool_shared_init(void)
+{
+	threadpool_new(&shared_pool, 0, THREADPOOL_DEFAULT_IDLE_TIMEOUT);
+}
+
+threadpool_t threadpool_shared(void)
+{
+	thread_once(&shared_pool_once, threadpool_shared_init);
+	return shared_pool;
+}
+
+thread_future_t threadpool_submit(threadpool_t pool, thread_func_t func, void* data)
+{
+	if (!pool || !func) {
+		return NULL;
+	}
+	struct threadpool_task* task = (struct threadpool_task*)malloc(sizeof(struct threadpool_task));
+	thread_future_t future = (thread_future_t)calloc(1, sizeof(struct thread_future));
+	if (!task || !future) {
+		free(task);
+		free(future);
+		return NULL;
+	}
+	mutex_init(&future->mutex);
+	cond_init(&future->cond);
+	future->refs = 2;
+	task->func = func;
+	task->data = data;
+	task->future = future;
+	task->next = NULL;
+
+	mutex_lock(&pool->mutex);
+	if (pool->stopping) {
+		mutex_unlock(&pool->mutex);
+		goto error;
+	}
+	/* reuse an idle worker if there is one not claimed by another task yet */
+	if (pool->num_queued >= pool->num_idle && (pool->max_threads == 0 || pool->num_threads < pool->max_threads)) {
+		THREAD_T thread;
+		if (thread_new(&thread, threadpool_worker, pool) == 0) {
+			thread_detach(thread);
+			pool->num_threads++;
+		} else if (pool->num_threads == 0) {
+			mutex_unlock(&pool->mutex);
+			goto error;
+		}
+	}
+	if (pool->tail) {
+		pool->tail->next = task;
+	} else {
+		pool->head = task;
+	}
+	pool->tail = task;
+	pool->num_queued++;
+	cond_signal(&pool->work_cond);
+	mutex_unlock(&pool->mutex);
+
+	return future;
+
+error:
+	cond_destroy(&future->cond);
+	mutex_destroy(&future->mutex);
+	free(future);
+	free(task);
+	return NULL;
+}
+
+void* thread_future_wait(thread_future_t future)
+{
+	if (!future) {
+		return NULL;
+	}
+	mutex_lock(&future->mutex);
+	while (!future->done) {
+		cond_wait(&future->cond, &future->mutex);
+	}
+	void* result = future->result;
+	mutex_unlock(&future->mutex);
+	return result;
+}
+
+int thread_future_done(thread_future_t future)
+{
+	if (!future) {
+		return 1;
+	}
+	mutex_lock(&future->mutex);
+	int done = future->done;
+	mutex_unlock(&future->mutex);
+	return done;
+}
+
+void thread_future_free(thread_future_t future)
+{
+	if (future) {
+		thread_future_release(future);
+	}
+}
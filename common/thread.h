@@ -28,6 +28,8 @@
 #include <windows.h>
 typedef HANDLE THREAD_T;
 typedef CRITICAL_SECTION mutex_t;
+typedef CONDITION_VARIABLE cond_t;
+typedef SRWLOCK rwlock_t;
 typedef volatile struct {
 	LONG lock;
 	int state;
@@ -40,6 +42,8 @@ typedef volatile struct {
 #include <signal.h>
 typedef pthread_t THREAD_T;
 typedef pthread_mutex_t mutex_t;
+typedef pthread_cond_t cond_t;
+typedef pthread_rwlock_t rwlock_t;
 typedef pthread_once_t thread_once_t;
 #define THREAD_ONCE_INIT PTHREAD_ONCE_INIT
 #define THREAD_ID pthread_self()
@@ -71,6 +75,44 @@ void mutex_destroy(mutex_t* mutex);
 void mutex_lock(mutex_t* mutex);
 void mutex_unlock(mutex_t* mutex);
 
+void cond_init(cond_t* cond);
+void cond_destroy(cond_t* cond);
+void cond_signal(cond_t* cond);
+void cond_broadcast(cond_t* cond);
+void cond_wait(cond_t* cond, mutex_t* mutex);
+/* returns 0 if signalled, -1 if the timeout expired */
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms);
+
+void rwlock_init(rwlock_t* rwlock);
+void rwlock_destroy(rwlock_t* rwlock);
+void rwlock_rdlock(rwlock_t* rwlock);
+void rwlock_wrlock(rwlock_t* rwlock);
+/* Win32 needs to know which kind of lock is released */
+void rwlock_rdunlock(rwlock_t* rwlock);
+void rwlock_wrunlock(rwlock_t* rwlock);
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void));
 
+/* pool of reusable worker threads, workers are started on demand and exit
+ * after being idle for idle_timeout_ms. max_threads 0 means no limit. */
+typedef struct threadpool* threadpool_t;
+/* result of a task submitted to a thread pool */
+typedef struct thread_future* thread_future_t;
+
+#define THREADPOOL_DEFAULT_IDLE_TIMEOUT 30000
+
+int threadpool_new(threadpool_t *pool, unsigned int max_threads, unsigned int idle_timeout_ms);
+/* waits for all submitted tasks to complete */
+void threadpool_free(threadpool_t pool);
+/* process wide pool without a thread limit, created on first use */
+threadpool_t threadpool_shared(void);
+/* returns NULL if the task could not be queued */
+thread_future_t threadpool_submit(threadpool_t pool, thread_func_t func, void* data);
+
+/* waits for the task to complete and returns the value it returned */
+void* thread_future_wait(thread_future_t future);
+int thread_future_done(thread_future_t future);
+/* the task keeps running if it has not completed yet */
+void thread_future_free(thread_future_t future);
+
 #endif
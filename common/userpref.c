@@ -33,6 +33,7 @@
 #endif
 #ifndef WIN32
 #include <pwd.h>
+#include <unistd.h>
 #endif
 
 #include <usbmuxd.h>
@@ -64,6 +65,7 @@
 // #include <libgen.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <time.h>
 
 #ifdef WIN32
 #include <shlobj.h>
@@ -72,6 +74,7 @@
 #include "userpref.h"
 #include "debug.h"
 #include "utils.h"
+#include "thread.h"
 
 #ifndef HAVE_OPENSSL
 const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
@@ -103,6 +106,125 @@ const ASN1_ARRAY_TYPE pkcs1_asn1_tab[] = {
 #define USERPREF_CONFIG_FILE "SystemConfiguration"USERPREF_CONFIG_EXTENSION
 
 static char *__config_dir = NULL;
+static userpref_pair_record_changed_cb_t __pair_record_changed_cb = NULL;
+static userpref_crypto_init_cb_t __crypto_init_cb = NULL;
+
+/* cache of parsed pair records and the SystemBUID, most recently used first */
+#define USERPREF_CACHE_SIZE 128
+#define USERPREF_CACHE_TTL 30
+
+struct userpref_cache_entry {
+	char *udid;
+	plist_t pair_record;
+	time_t fetched;
+	struct userpref_cache_entry *next;
+};
+
+static struct userpref_cache_entry *__pair_record_cache = NULL;
+static char *__system_buid = NULL;
+static time_t __system_buid_fetched = 0;
+static mutex_t __cache_mutex;
+static thread_once_t __cache_once = THREAD_ONCE_INIT;
+
+/* index of the pair record files in the config directory, protected by
+   the cache mutex and rebuilt when the directory's modification time changes */
+static char **__paired_udids = NULL;
+static unsigned int __paired_udids_count = 0;
+static time_t __paired_udids_mtime = 0;
+static time_t __paired_udids_scanned = 0;
+static int __paired_udids_valid = 0;
+
+/* handed out instead of asking usbmuxd, see userpref_set_fixed_records() */
+static plist_t __fixed_pair_record = NULL;
+static char *__fixed_system_buid = NULL;
+
+static void userpref_cache_init(void)
+{
+	mutex_init(&__cache_mutex);
+}
+
+static void userpref_cache_entry_free(struct userpref_cache_entry *entry)
+{
+	free(entry->udid);
+	plist_free(entry->pair_record);
+	free(entry);
+}
+
+/**
+ * Looks up a cached pair record and moves it to the front of the list.
+ * Must be called with the cache mutex held.
+ *
+ * @return A copy of the cached pair record, or NULL if it is not cached or
+ *    expired.
+ */
+static plist_t userpref_cache_lookup(const char *udid)
+{
+	struct userpref_cache_entry **pp = &__pair_record_cache;
+	time_t now = time(NULL);
+
+	while (*pp) {
+		struct userpref_cache_entry *entry = *pp;
+		if (!strcmp(entry->udid, udid)) {
+			*pp = entry->next;
+			if (now - entry->fetched >= USERPREF_CACHE_TTL || now < entry->fetched) {
+				/* expired, re-read from usbmuxd */
+				userpref_cache_entry_free(entry);
+				return NULL;
+			}
+			entry->next = __pair_record_cache;
+			__pair_record_cache = entry;
+			return plist_copy(entry->pair_record);
+		}
+		pp = &entry->next;
+	}
+	return NULL;
+}
+
+/**
+ * Adds a copy of a pair record to the cache, evicting the least recently
+ * used entry if the cache is full. Must be called with the cache mutex held.
+ */
+static void userpref_cache_insert(const char *udid, plist_t pair_record)
+{
+	struct userpref_cache_entry *entry = (struct userpref_cache_entry*)malloc(sizeof(struct userpref_cache_entry));
+	if (!entry)
+		return;
+	entry->udid = strdup(udid);
+	entry->pair_record = plist_copy(pair_record);
+	entry->fetched = time(NULL);
+	entry->next = __pair_record_cache;
+	__pair_record_cache = entry;
+
+	int count = 0;
+	struct userpref_cache_entry **pp = &__pair_record_cache;
+	while (*pp) {
+		if (++count > USERPREF_CACHE_SIZE) {
+			struct userpref_cache_entry *lru = *pp;
+			*pp = lru->next;
+			userpref_cache_entry_free(lru);
+			continue;
+		}
+		pp = &(*pp)->next;
+	}
+}
+
+/**
+ * Removes the cached pair record of a device. Must be called with the cache
+ * mutex held.
+ */
+static void userpref_cache_remove(const char *udid)
+{
+	struct userpref_cache_entry **pp = &__pair_record_cache;
+	while (*pp) {
+		struct userpref_cache_entry *entry = *pp;
+		if (!strcmp(entry->udid, udid)) {
+			*pp = entry->next;
+			userpref_cache_entry_free(entry);
+			return;
+		}
+		pp = &entry->next;
+	}
+}
 
 #ifdef WIN32
 static char *userpref_utf16_to_utf8(wchar_t *unistr, long len, long *items_read, long *items_written)
@@ -193,15 +315,183 @@ const char *userpref_get_config_dir()
  */
 int userpref_read_system_buid(char **system_buid)
 {
+	time_t now = time(NULL);
+
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	if (__fixed_system_buid) {
+		*system_buid = strdup(__fixed_system_buid);
+		mutex_unlock(&__cache_mutex);
+		return 0;
+	}
+	if (__system_buid && now - __system_buid_fetched < USERPREF_CACHE_TTL && now >= __system_buid_fetched) {
+		*system_buid = strdup(__system_buid);
+		mutex_unlock(&__cache_mutex);
+		return 0;
+	}
+	mutex_unlock(&__cache_mutex);
+
 	int res = usbmuxd_read_buid(system_buid);
 	if (res == 0) {
 		debug_info("using %s as %s", *system_buid, USERPREF_SYSTEM_BUID_KEY);
+		mutex_lock(&__cache_mutex);
+		free(__system_buid);
+		__system_buid = strdup(*system_buid);
+		__system_buid_fetched = now;
+		mutex_unlock(&__cache_mutex);
 	} else {
 		debug_info("could not read system buid, error %d", res);
 	}
 	return res;
 }
 
+static void userpref_paired_index_clear(void)
+{
+	unsigned int i;
+	for (i = 0; i < __paired_udids_count; i++) {
+		free(__paired_udids[i]);
+	}
+	free(__paired_udids);
+	__paired_udids = NULL;
+	__paired_udids_count = 0;
+	__paired_udids_valid = 0;
+}
+
+static int userpref_config_dir_mtime(time_t *mtime)
+{
+	struct stat st;
+	if (stat(userpref_get_config_dir(), &st) != 0) {
+		return -1;
+	}
+	*mtime = st.st_mtime;
+	return 0;
+}
+
+/**
+ * Checks whether the index of paired UDIDs still matches the config
+ * directory. A directory modified in the same second the index was built
+ * could have changed unnoticed afterwards, so such an index is not trusted.
+ * Must be called with the cache mutex held.
+ */
+static int userpref_paired_index_current(void)
+{
+	time_t mtime = 0;
+	if (!__paired_udids_valid || userpref_config_dir_mtime(&mtime) < 0) {
+		return 0;
+	}
+	return (mtime == __paired_udids_mtime && mtime < __paired_udids_scanned);
+}
+
+static int userpref_paired_index_add(const char *udid)
+{
+	unsigned int i;
+	for (i = 0; i < __paired_udids_count; i++) {
+		if (!strcmp(__paired_udids[i], udid)) {
+			return 0;
+		}
+	}
+	char **newlist = (char**)realloc(__paired_udids, sizeof(char*) * (__paired_udids_count + 1));
+	if (!newlist) {
+		return -1;
+	}
+	__paired_udids = newlist;
+	__paired_udids[__paired_udids_count] = strdup(udid);
+	if (!__paired_udids[__paired_udids_count]) {
+		return -1;
+	}
+	__paired_udids_count++;
+	return 0;
+}
+
+static void userpref_paired_index_remove(const char *udid)
+{
+	unsigned int i;
+	for (i = 0; i < __paired_udids_count; i++) {
+		if (!strcmp(__paired_udids[i], udid)) {
+			free(__paired_udids[i]);
+			__paired_udids[i] = __paired_udids[--__paired_udids_count];
+			return;
+		}
+	}
+}
+
+/**
+ * Rebuilds the index of paired UDIDs from the pair record files in the
+ * config directory. Must be called with the cache mutex held.
+ */
+static void userpref_paired_index_scan(void)
+{
+	userpref_paired_index_clear();
+
+	/* taken before reading so changes made meanwhile cause another scan */
+	time_t mtime = 0;
+	int have_mtime = (userpref_config_dir_mtime(&mtime) == 0);
+
+	DIR *config_dir = opendir(userpref_get_config_dir());
+	if (!config_dir) {
+		return;
+	}
+	struct dirent *entry;
+	while ((entry = readdir(config_dir))) {
+		if (strcmp(entry->d_name, USERPREF_CONFIG_FILE) == 0) {
+			/* ignore SystemConfiguration.plist */
+			continue;
+		}
+		char *ext = strrchr(entry->d_name, '.');
+		if (ext && (strcmp(ext, USERPREF_CONFIG_EXTENSION) == 0)) {
+			size_t len = strlen(entry->d_name) - strlen(USERPREF_CONFIG_EXTENSION);
+			char **newlist = (char**)realloc(__paired_udids, sizeof(char*) * (__paired_udids_count + 1));
+			if (!newlist) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
+			}
+			__paired_udids = newlist;
+			char *tmp = (char*)malloc(len+1);
+			if (!tmp) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
+			}
+			strncpy(tmp, entry->d_name, len);
+			tmp[len] = '\0';
+			__paired_udids[__paired_udids_count++] = tmp;
+		}
+	}
+	closedir(config_dir);
+
+	__paired_udids_mtime = mtime;
+	__paired_udids_scanned = time(NULL);
+	__paired_udids_valid = have_mtime;
+}
+
+/**
+ * Updates the index of paired UDIDs after a pair record was saved or
+ * deleted, instead of scanning the directory again. Must be called with the
+ * cache mutex held.
+ *
+ * @param udid The UDID of the changed pair record.
+ * @param was_current Whether the index matched the directory before the
+ *    change, otherwise it is discarded.
+ * @param saved Nonzero if the record was saved, zero if it was deleted.
+ */
+static void userpref_paired_index_update(const char *udid, int was_current, int saved)
+{
+	time_t mtime = 0;
+	if (!was_current || userpref_config_dir_mtime(&mtime) < 0) {
+		userpref_paired_index_clear();
+		return;
+	}
+	if (saved) {
+		if (userpref_paired_index_add(udid) < 0) {
+			userpref_paired_index_clear();
+			return;
+		}
+	} else {
+		userpref_paired_index_remove(udid);
+	}
+	__paired_udids_mtime = mtime;
+	__paired_udids_scanned = time(NULL);
+}
+
 /**
  * Fills a list with UDIDs of devices that have been connected to this
  * system before, i.e. for which a public key file exists.
@@ -219,8 +509,6 @@ int userpref_read_system_buid(char **system_buid)
  */
 userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 {
-	DIR *config_dir;
-	const char *config_path = NULL;
 	unsigned int found = 0;
 
 	if (!list || (list && *list)) {
@@ -231,42 +519,24 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	if (count) {
 		*count = 0;
 	}
-	*list = (char**)malloc(sizeof(char*));
 
-	config_path = userpref_get_config_dir();
-	config_dir = opendir(config_path);
-	if (config_dir) {
-		struct dirent *entry;
-		while ((entry = readdir(config_dir))) {
-			if (strcmp(entry->d_name, USERPREF_CONFIG_FILE) == 0) {
-				/* ignore SystemConfiguration.plist */
-				continue;
-			}
-			char *ext = strrchr(entry->d_name, '.');
-			if (ext && (strcmp(ext, USERPREF_CONFIG_EXTENSION) == 0)) {
-				size_t len = strlen(entry->d_name) - strlen(USERPREF_CONFIG_EXTENSION);
-				char **newlist = (char**)realloc(*list, sizeof(char*) * (found+2));
-				if (!newlist) {
-					fprintf(stderr, "ERROR: Out of memory\n");
-					break;
-				}
-				*list = newlist;
-				char *tmp = (char*)malloc(len+1);
-				if (tmp) {
-					strncpy(tmp, entry->d_name, len);
-					tmp[len] = '\0';
-				}
-				(*list)[found] = tmp;
-				if (!tmp) {
-					fprintf(stderr, "ERROR: Out of memory\n");
-					break;
-				}
-				found++;
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	if (!userpref_paired_index_current()) {
+		userpref_paired_index_scan();
+	}
+	*list = (char**)malloc(sizeof(char*) * (__paired_udids_count + 1));
+	if (*list) {
+		for (found = 0; found < __paired_udids_count; found++) {
+			(*list)[found] = strdup(__paired_udids[found]);
+			if (!(*list)[found]) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
 			}
 		}
-		closedir(config_dir);
+		(*list)[found] = NULL;
 	}
-	(*list)[found] = NULL;
+	mutex_unlock(&__cache_mutex);
 
 	if (count) {
 		*count = found;
@@ -275,6 +545,56 @@ userpref_error_t userpref_get_paired_udids(char ***list, unsigned int *count)
 	return USERPREF_E_SUCCESS;
 }
 
+/**
+ * Set a callback that is invoked whenever a pair record is saved or deleted,
+ * e.g. to invalidate data derived from it.
+ *
+ * @param callback The callback to invoke with the UDID of the changed pair
+ *    record, or NULL to remove the callback.
+ */
+void userpref_set_pair_record_changed_cb(userpref_pair_record_changed_cb_t callback)
+{
+	__pair_record_changed_cb = callback;
+}
+
+/**
+ * Set a callback that is invoked before keys or certificates are generated,
+ * so the SSL library only needs to be initialized when it is used.
+ *
+ * @param callback The callback to invoke, or NULL to remove the callback.
+ */
+void userpref_set_crypto_init_cb(userpref_crypto_init_cb_t callback)
+{
+	__crypto_init_cb = callback;
+}
+
+static void userpref_crypto_init(void)
+{
+	if (__crypto_init_cb) {
+		__crypto_init_cb();
+	}
+}
+
+/**
+ * Make userpref_read_pair_record() and userpref_read_system_buid() hand out
+ * copies of the given records for any device instead of asking usbmuxd,
+ * e.g. when the device traffic is replayed from a capture.
+ *
+ * @param pair_record The pair record to use, or NULL to ask usbmuxd again.
+ *    A copy is stored.
+ * @param system_buid The SystemBUID to use, or NULL to ask usbmuxd again.
+ */
+void userpref_set_fixed_records(plist_t pair_record, const char *system_buid)
+{
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	plist_free(__fixed_pair_record);
+	__fixed_pair_record = (pair_record) ? plist_copy(pair_record) : NULL;
+	free(__fixed_system_buid);
+	__fixed_system_buid = (system_buid) ? strdup(system_buid) : NULL;
+	mutex_unlock(&__cache_mutex);
+}
+
 /**
  * Save a pair record for a device.
  *
@@ -292,10 +612,24 @@ userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id,
 
 	plist_to_bin(pair_record, &record_data, &record_size);
 
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	int index_current = userpref_paired_index_current();
+	mutex_unlock(&__cache_mutex);
+
 	int res = usbmuxd_save_pair_record_with_device_id(udid, device_id, record_data, record_size);
 
 	free(record_data);
 
+	mutex_lock(&__cache_mutex);
+	userpref_cache_remove(udid);
+	userpref_paired_index_update(udid, index_current && res == 0, 1);
+	mutex_unlock(&__cache_mutex);
+
+	if (__pair_record_changed_cb) {
+		__pair_record_changed_cb(udid);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -313,6 +647,21 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 	char* record_data = NULL;
 	uint32_t record_size = 0;
 
+	if (!udid || !pair_record)
+		return USERPREF_E_INVALID_ARG;
+
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	if (__fixed_pair_record) {
+		*pair_record = plist_copy(__fixed_pair_record);
+	} else {
+		*pair_record = userpref_cache_lookup(udid);
+	}
+	mutex_unlock(&__cache_mutex);
+	if (*pair_record) {
+		return USERPREF_E_SUCCESS;
+	}
+
 	int res = usbmuxd_read_pair_record(udid, &record_data, &record_size);
 
 	if (res < 0) {
@@ -331,6 +680,12 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
 
 	free(record_data);
 
+	if (res == 0 && *pair_record) {
+		mutex_lock(&__cache_mutex);
+		userpref_cache_insert(udid, *pair_record);
+		mutex_unlock(&__cache_mutex);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
@@ -343,11 +698,254 @@ userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_recor
  */
 userpref_error_t userpref_delete_pair_record(const char *udid)
 {
+	thread_once(&__cache_once, userpref_cache_init);
+	mutex_lock(&__cache_mutex);
+	int index_current = userpref_paired_index_current();
+	mutex_unlock(&__cache_mutex);
+
 	int res = usbmuxd_delete_pair_record(udid);
 
+	mutex_lock(&__cache_mutex);
+	userpref_cache_remove(udid);
+	userpref_paired_index_update(udid, index_current && res == 0, 0);
+	mutex_unlock(&__cache_mutex);
+
+	if (__pair_record_changed_cb) {
+		__pair_record_changed_cb(udid);
+	}
+
 	return res == 0 ? USERPREF_E_SUCCESS: USERPREF_E_UNKNOWN_ERROR;
 }
 
+/* private keys generated in the background so pairing does not block on them */
+#define KEY_POOL_MAX_SIZE 64
+#define KEY_POOL_RSA_BITS 2048
+#define KEY_POOL_ENV "IMOBILEDEVICE_KEY_POOL"
+
+#ifdef HAVE_OPENSSL
+typedef EVP_PKEY* pool_key_t;
+#else
+typedef gnutls_x509_privkey_t pool_key_t;
+#endif
+
+static pool_key_t __key_pool[KEY_POOL_MAX_SIZE];
+static unsigned int __key_pool_count = 0;
+static unsigned int __key_pool_pending = 0;
+static unsigned int __key_pool_size = 0;
+static int __key_pool_refill = 0;
+static threadpool_t __key_pool_threads = NULL;
+static mutex_t __key_pool_mutex;
+static cond_t __key_pool_cond;
+static thread_once_t __key_pool_once = THREAD_ONCE_INIT;
+
+static unsigned int get_cpu_count(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? (unsigned int)info.dwNumberOfProcessors : 1;
+#elif defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? (unsigned int)n : 1;
+#else
+	return 1;
+#endif
+}
+
+static pool_key_t key_generate(void)
+{
+	userpref_crypto_init();
+#ifdef HAVE_OPENSSL
+	EVP_PKEY* pkey = NULL;
+	BIGNUM *e = BN_new();
+	RSA* keypair = RSA_new();
+
+	if (e && keypair && BN_set_word(e, 65537) && RSA_generate_key_ex(keypair, KEY_POOL_RSA_BITS, e, NULL) == 1) {
+		pkey = EVP_PKEY_new();
+		if (pkey && EVP_PKEY_assign_RSA(pkey, keypair)) {
+			keypair = NULL;
+		} else {
+			EVP_PKEY_free(pkey);
+			pkey = NULL;
+		}
+	}
+	RSA_free(keypair);
+	BN_free(e);
+
+	return pkey;
+#else
+	gnutls_x509_privkey_t key = NULL;
+
+	if (gnutls_x509_privkey_init(&key) < 0) {
+		return NULL;
+	}
+	if (gnutls_x509_privkey_generate(key, GNUTLS_PK_RSA, KEY_POOL_RSA_BITS, 0) < 0) {
+		gnutls_x509_privkey_deinit(key);
+		return NULL;
+	}
+
+	return key;
+#endif
+}
+
+static void key_free(pool_key_t key)
+{
+	if (!key)
+		return;
+#ifdef HAVE_OPENSSL
+	EVP_PKEY_free(key);
+#else
+	gnutls_x509_privkey_deinit(key);
+#endif
+}
+
+static void key_pool_init(void)
+{
+	mutex_init(&__key_pool_mutex);
+	cond_init(&__key_pool_cond);
+}
+
+static void* key_pool_worker(void* data)
+{
+	pool_key_t key = key_generate();
+
+	mutex_lock(&__key_pool_mutex);
+	__key_pool_pending--;
+	if (key && __key_pool_count < __key_pool_size) {
+		__key_pool[__key_pool_count++] = key;
+		key = NULL;
+	}
+	cond_broadcast(&__key_pool_cond);
+	mutex_unlock(&__key_pool_mutex);
+
+	/* the pool was shrunk or stopped meanwhile */
+	key_free(key);
+
+	return NULL;
+}
+
+/**
+ * Queues generation of as many keys as are missing from the pool.
+ * Must be called with the key pool mutex held.
+ */
+static void key_pool_fill(void)
+{
+	if (!__key_pool_threads && __key_pool_size > 0) {
+		if (threadpool_new(&__key_pool_threads, get_cpu_count(), THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+			__key_pool_threads = NULL;
+			return;
+		}
+	}
+	while (__key_pool_count + __key_pool_pending < __key_pool_size) {
+		thread_future_t future = threadpool_submit(__key_pool_threads, key_pool_worker, NULL);
+		if (!future) {
+			debug_info("ERROR: Could not queue key generation");
+			break;
+		}
+		/* nobody waits for the result, the worker adds it to the pool */
+		thread_future_free(future);
+		__key_pool_pending++;
+	}
+}
+
+/**
+ * Returns a private key from the pool or generates one if the pool is
+ * empty. Keys still being generated are waited for since they are ready
+ * sooner than a new one would be.
+ *
+ * @return a new private key the caller owns, or NULL on error
+ */
+static pool_key_t key_pool_take(void)
+{
+	pool_key_t key = NULL;
+
+	thread_once(&__key_pool_once, key_pool_init);
+	mutex_lock(&__key_pool_mutex);
+	while (__key_pool_count == 0 && __key_pool_pending > 0) {
+		cond_wait(&__key_pool_cond, &__key_pool_mutex);
+	}
+	if (__key_pool_count > 0) {
+		key = __key_pool[--__key_pool_count];
+		if (__key_pool_refill) {
+			key_pool_fill();
+		}
+	}
+	mutex_unlock(&__key_pool_mutex);
+
+	if (!key) {
+		key = key_generate();
+	}
+
+	return key;
+}
+
+/**
+ * Starts generating private keys for new pair records in the background,
+ * using at most one thread per CPU. Pairing takes two keys from the pool
+ * and only generates keys itself if the pool is empty.
+ *
+ * @param size The number of keys to keep ready, two are used per pairing.
+ * @param refill If nonzero, keys taken from the pool are replaced so that
+ *   size keys stay ready, otherwise only size keys are generated in total.
+ */
+void userpref_key_pool_start(unsigned int size, int refill)
+{
+	if (size > KEY_POOL_MAX_SIZE) {
+		size = KEY_POOL_MAX_SIZE;
+	}
+
+	thread_once(&__key_pool_once, key_pool_init);
+#ifndef HAVE_OPENSSL
+	/* use less secure random to speed up key generation */
+	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM);
+#endif
+	mutex_lock(&__key_pool_mutex);
+	__key_pool_size = size;
+	__key_pool_refill = refill;
+	key_pool_fill();
+	mutex_unlock(&__key_pool_mutex);
+}
+
+static void key_pool_start_from_env(void)
+{
+	const char *env = getenv(KEY_POOL_ENV);
+	if (env && *env) {
+		long size = strtol(env, NULL, 10);
+		if (size > 0) {
+			userpref_key_pool_start((unsigned int)size, 1);
+		}
+	}
+}
+
+/**
+ * Starts the key pool if the IMOBILEDEVICE_KEY_POOL environment variable
+ * holds the number of keys to keep ready. Only has an effect once.
+ */
+void userpref_key_pool_start_from_env(void)
+{
+	static thread_once_t env_once = THREAD_ONCE_INIT;
+	thread_once(&env_once, key_pool_start_from_env);
+}
+
+/**
+ * Stops the key pool. Waits for keys that are still being generated and
+ * releases all keys that were not used.
+ */
+void userpref_key_pool_stop(void)
+{
+	thread_once(&__key_pool_once, key_pool_init);
+	mutex_lock(&__key_pool_mutex);
+	__key_pool_size = 0;
+	__key_pool_refill = 0;
+	while (__key_pool_pending > 0) {
+		cond_wait(&__key_pool_cond, &__key_pool_mutex);
+	}
+	while (__key_pool_count > 0) {
+		key_free(__key_pool[--__key_pool_count]);
+	}
+	mutex_unlock(&__key_pool_mutex);
+}
+
 #ifdef HAVE_OPENSSL
 static int X509_add_ext_helper(X509 *cert, int nid, char *value)
 {
@@ -372,46 +970,213 @@ static int X509_add_ext_helper(X509 *cert, int nid, char *value)
 #endif
 
 /**
- * Private function to generate required private keys and certificates.
- *
- * @param pair_record a #PLIST_DICT that will be filled with the keys
- *   and certificates
- * @param public_key the public key to use (device public key)
+ * Private function to generate a device certificate for the given device
+ * public key, signed with the root private key.
  *
- * @return 1 if keys were successfully generated, 0 otherwise
+ * @return 1 if the certificate was generated, 0 otherwise
  */
-userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key)
+#ifdef HAVE_OPENSSL
+static int generate_device_certificate(EVP_PKEY* root_pkey, key_data_t public_key, key_data_t *dev_cert_pem)
 {
-	userpref_error_t ret = USERPREF_E_SSL_ERROR;
-
-	key_data_t dev_cert_pem = { NULL, 0 };
-	key_data_t root_key_pem = { NULL, 0 };
-	key_data_t root_cert_pem = { NULL, 0 };
-	key_data_t host_key_pem = { NULL, 0 };
-	key_data_t host_cert_pem = { NULL, 0 };
-
-	if (!pair_record || !public_key.data)
-		return USERPREF_E_INVALID_ARG;
-
-	debug_info("Generating keys and certificates...");
+	RSA *pubkey = NULL;
+	{
+		BIO *membp = BIO_new_mem_buf(public_key.data, public_key.size);
+		if (!PEM_read_bio_RSAPublicKey(membp, &pubkey, NULL, NULL)) {
+			debug_info("WARNING: Could not read public key");
+		}
+		BIO_free(membp);
+	}
 
-#ifdef HAVE_OPENSSL
-	BIGNUM *e = BN_new();
-	RSA* root_keypair = RSA_new();
-	RSA* host_keypair = RSA_new();
+	X509* dev_cert = X509_new();
+	if (pubkey && dev_cert) {
+		/* generate device certificate */
+		ASN1_INTEGER* sn = ASN1_INTEGER_new();
+		ASN1_INTEGER_set(sn, 0);
+		X509_set_serialNumber(dev_cert, sn);
+		ASN1_INTEGER_free(sn);
+		X509_set_version(dev_cert, 2);
 
-	BN_set_word(e, 65537);
+		X509_add_ext_helper(dev_cert, NID_basic_constraints, (char*)"critical,CA:FALSE");
 
-	RSA_generate_key_ex(root_keypair, 2048, e, NULL);
-	RSA_generate_key_ex(host_keypair, 2048, e, NULL);
+		ASN1_TIME* asn1time = ASN1_TIME_new();
+		ASN1_TIME_set(asn1time, time(NULL));
+		X509_set1_notBefore(dev_cert, asn1time);
+		ASN1_TIME_set(asn1time, time(NULL) + (60 * 60 * 24 * 365 * 10));
+		X509_set1_notAfter(dev_cert, asn1time);
+		ASN1_TIME_free(asn1time);
 
-	BN_free(e);
+		EVP_PKEY* pkey = EVP_PKEY_new();
+		EVP_PKEY_assign_RSA(pkey, pubkey);
+		X509_set_pubkey(dev_cert, pkey);
+		EVP_PKEY_free(pkey);
+
+		X509_add_ext_helper(dev_cert, NID_subject_key_identifier, (char*)"hash");
+		X509_add_ext_helper(dev_cert, NID_key_usage, (char*)"critical,digitalSignature,keyEncipherment");
+
+		/* sign device certificate with root private key */
+		if (X509_sign(dev_cert, root_pkey, EVP_sha1())) {
+			/* if signing succeeded, export in PEM format */
+			BIO* membp = BIO_new(BIO_s_mem());
+			if (PEM_write_bio_X509(membp, dev_cert) > 0) {
+				char *bdata = NULL;
+				dev_cert_pem->size = BIO_get_mem_data(membp, &bdata);
+				dev_cert_pem->data = (unsigned char*)malloc(dev_cert_pem->size);
+				if (dev_cert_pem->data) {
+					memcpy(dev_cert_pem->data, bdata, dev_cert_pem->size);
+				}
+				BIO_free(membp);
+				membp = NULL;
+			}
+		} else {
+			debug_info("ERROR: Signing device certificate with root private key failed!");
+		}
+	}
+	X509_free(dev_cert);
+
+	return (dev_cert_pem->data != NULL);
+}
+#else
+static int generate_device_certificate(gnutls_x509_privkey_t root_privkey, gnutls_x509_crt_t root_cert, key_data_t public_key, key_data_t *dev_cert_pem)
+{
+	gnutls_datum_t modulus = { NULL, 0 };
+	gnutls_datum_t exponent = { NULL, 0 };
+
+	/* now decode the PEM encoded key */
+	gnutls_datum_t der_pub_key = { NULL, 0 };
+	int gnutls_error = gnutls_pem_base64_decode_alloc("RSA PUBLIC KEY", &public_key, &der_pub_key);
+	if (GNUTLS_E_SUCCESS == gnutls_error) {
+		/* initalize asn.1 parser */
+		ASN1_TYPE pkcs1 = ASN1_TYPE_EMPTY;
+		if (ASN1_SUCCESS == asn1_array2tree(pkcs1_asn1_tab, &pkcs1, NULL)) {
+
+			ASN1_TYPE asn1_pub_key = ASN1_TYPE_EMPTY;
+			asn1_create_element(pkcs1, "PKCS1.RSAPublicKey", &asn1_pub_key);
+
+			if (ASN1_SUCCESS == asn1_der_decoding(&asn1_pub_key, der_pub_key.data, der_pub_key.size, NULL)) {
+
+				/* get size to read */
+				int ret1 = asn1_read_value(asn1_pub_key, "modulus", NULL, (int*)&modulus.size);
+				int ret2 = asn1_read_value(asn1_pub_key, "publicExponent", NULL, (int*)&exponent.size);
+
+				modulus.data = gnutls_malloc(modulus.size);
+				exponent.data = gnutls_malloc(exponent.size);
+
+				ret1 = asn1_read_value(asn1_pub_key, "modulus", modulus.data, (int*)&modulus.size);
+				ret2 = asn1_read_value(asn1_pub_key, "publicExponent", exponent.data, (int*)&exponent.size);
+				if (ret1 != ASN1_SUCCESS || ret2 != ASN1_SUCCESS) {
+					gnutls_free(modulus.data);
+					modulus.data = NULL;
+					modulus.size = 0;
+					gnutls_free(exponent.data);
+					exponent.data = NULL;
+					exponent.size = 0;
+				}
+			}
+			if (asn1_pub_key)
+				asn1_delete_structure(&asn1_pub_key);
+		}
+		if (pkcs1)
+			asn1_delete_structure(&pkcs1);
+	} else {
+		debug_info("ERROR: Could not parse public key: %s", gnutls_strerror(gnutls_error));
+	}
+
+	/* generate device certificate */
+	if (modulus.data && 0 != modulus.size && exponent.data && 0 != exponent.size) {
+
+		gnutls_datum_t prime_p = { (unsigned char*)"\x00\xca\x4a\x03\x13\xdf\x9d\x7a\xfd", 9 };
+		gnutls_datum_t prime_q = { (unsigned char*)"\x00\xf2\xff\xe0\x15\xd1\x60\x37\x63", 9 };
+		gnutls_datum_t coeff = { (unsigned char*)"\x32\x07\xf1\x68\x57\xdf\x9a\xf4", 8 };
+
+		gnutls_x509_privkey_t fake_privkey;
+		gnutls_x509_crt_t dev_cert;
+
+		gnutls_x509_privkey_init(&fake_privkey);
+		gnutls_x509_crt_init(&dev_cert);
+
+		gnutls_error = gnutls_x509_privkey_import_rsa_raw(fake_privkey, &modulus, &exponent, &exponent, &prime_p, &prime_q, &coeff);
+		if (GNUTLS_E_SUCCESS == gnutls_error) {
+			/* now generate device certificate */
+			gnutls_x509_crt_set_key(dev_cert, fake_privkey);
+			gnutls_x509_crt_set_serial(dev_cert, "\x01", 1);
+			gnutls_x509_crt_set_version(dev_cert, 3);
+			gnutls_x509_crt_set_ca_status(dev_cert, 0);
+			gnutls_x509_crt_set_activation_time(dev_cert, time(NULL));
+			gnutls_x509_crt_set_expiration_time(dev_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
+
+			/* use custom hash generation for compatibility with the "Apple ecosystem" */
+			const gnutls_digest_algorithm_t dig_sha1 = GNUTLS_DIG_SHA1;
+			size_t hash_size = gnutls_hash_get_len(dig_sha1);
+			unsigned char hash[hash_size];
+			if (gnutls_hash_fast(dig_sha1, der_pub_key.data, der_pub_key.size, (unsigned char*)&hash) < 0) {
+				debug_info("ERROR: Failed to generate SHA1 for public key");
+			} else {
+				gnutls_x509_crt_set_subject_key_id(dev_cert, hash, hash_size);
+			}
+
+			gnutls_x509_crt_set_key_usage(dev_cert, GNUTLS_KEY_DIGITAL_SIGNATURE | GNUTLS_KEY_KEY_ENCIPHERMENT);
+			gnutls_error = gnutls_x509_crt_sign2(dev_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
+			if (GNUTLS_E_SUCCESS == gnutls_error) {
+				/* if everything went well, export in PEM format */
+				size_t export_size = 0;
+				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
+				dev_cert_pem->data = gnutls_malloc(export_size);
+				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_cert_pem->data, &export_size);
+				dev_cert_pem->size = export_size;
+			} else {
+				debug_info("ERROR: Signing device certificate with root private key failed: %s", gnutls_strerror(gnutls_error));
+			}
+		} else {
+			debug_info("ERROR: Failed to import RSA key data: %s", gnutls_strerror(gnutls_error));
+		}
+		gnutls_x509_crt_deinit(dev_cert);
+		gnutls_x509_privkey_deinit(fake_privkey);
+	}
+
+	gnutls_free(modulus.data);
+	gnutls_free(exponent.data);
+
+	gnutls_free(der_pub_key.data);
+
+	return (dev_cert_pem->data != NULL);
+}
+#endif
+
+/**
+ * Private function to generate required private keys and certificates.
+ *
+ * @param pair_record a #PLIST_DICT that will be filled with the keys
+ *   and certificates
+ * @param public_key the public key to use (device public key)
+ *
+ * @return 1 if keys were successfully generated, 0 otherwise
+ */
+userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key)
+{
+	userpref_error_t ret = USERPREF_E_SSL_ERROR;
+
+	userpref_crypto_init();
+
+	key_data_t dev_cert_pem = { NULL, 0 };
+	key_data_t root_key_pem = { NULL, 0 };
+	key_data_t root_cert_pem = { NULL, 0 };
+	key_data_t host_key_pem = { NULL, 0 };
+	key_data_t host_cert_pem = { NULL, 0 };
+
+	if (!pair_record || !public_key.data)
+		return USERPREF_E_INVALID_ARG;
 
-	EVP_PKEY* root_pkey = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(root_pkey, root_keypair);
+	debug_info("Generating keys and certificates...");
 
-	EVP_PKEY* host_pkey = EVP_PKEY_new();
-	EVP_PKEY_assign_RSA(host_pkey, host_keypair);
+#ifdef HAVE_OPENSSL
+	EVP_PKEY* root_pkey = key_pool_take();
+	EVP_PKEY* host_pkey = key_pool_take();
+	if (!root_pkey || !host_pkey) {
+		debug_info("ERROR: Failed to generate private keys");
+		key_free(root_pkey);
+		key_free(host_pkey);
+		return ret;
+	}
 
 	/* generate root certificate */
 	X509* root_cert = X509_new();
@@ -522,62 +1287,9 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 		}
 	}
 
-	RSA *pubkey = NULL;
-	{
-		BIO *membp = BIO_new_mem_buf(public_key.data, public_key.size);
-		if (!PEM_read_bio_RSAPublicKey(membp, &pubkey, NULL, NULL)) {
-			debug_info("WARNING: Could not read public key");
-		}
-		BIO_free(membp);
-	}
-
-	X509* dev_cert = X509_new();
-	if (pubkey && dev_cert) {
-		/* generate device certificate */
-		ASN1_INTEGER* sn = ASN1_INTEGER_new();
-		ASN1_INTEGER_set(sn, 0);
-		X509_set_serialNumber(dev_cert, sn);
-		ASN1_INTEGER_free(sn);
-		X509_set_version(dev_cert, 2);
-
-		X509_add_ext_helper(dev_cert, NID_basic_constraints, (char*)"critical,CA:FALSE");
-
-		ASN1_TIME* asn1time = ASN1_TIME_new();
-		ASN1_TIME_set(asn1time, time(NULL));
-		X509_set1_notBefore(dev_cert, asn1time);
-		ASN1_TIME_set(asn1time, time(NULL) + (60 * 60 * 24 * 365 * 10));
-		X509_set1_notAfter(dev_cert, asn1time);
-		ASN1_TIME_free(asn1time);
-
-		EVP_PKEY* pkey = EVP_PKEY_new();
-		EVP_PKEY_assign_RSA(pkey, pubkey);
-		X509_set_pubkey(dev_cert, pkey);
-		EVP_PKEY_free(pkey);
-
-		X509_add_ext_helper(dev_cert, NID_subject_key_identifier, (char*)"hash");
-		X509_add_ext_helper(dev_cert, NID_key_usage, (char*)"critical,digitalSignature,keyEncipherment");
-
-		/* sign device certificate with root private key */
-		if (X509_sign(dev_cert, root_pkey, EVP_sha1())) {
-			/* if signing succeeded, export in PEM format */
-			BIO* membp = BIO_new(BIO_s_mem());
-			if (PEM_write_bio_X509(membp, dev_cert) > 0) {
-				char *bdata = NULL;
-				dev_cert_pem.size = BIO_get_mem_data(membp, &bdata);
-				dev_cert_pem.data = (unsigned char*)malloc(dev_cert_pem.size);
-				if (dev_cert_pem.data) {
-					memcpy(dev_cert_pem.data, bdata, dev_cert_pem.size);
-				}
-				BIO_free(membp);
-				membp = NULL;
-			}
-		} else {
-			debug_info("ERROR: Signing device certificate with root private key failed!");
-		}
-	}
+	generate_device_certificate(root_pkey, public_key, &dev_cert_pem);
 
 	X509V3_EXT_cleanup();
-	X509_free(dev_cert);
 
 	EVP_PKEY_free(root_pkey);
 	EVP_PKEY_free(host_pkey);
@@ -585,24 +1297,24 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	X509_free(host_cert);
 	X509_free(root_cert);
 #else
-	gnutls_x509_privkey_t root_privkey;
 	gnutls_x509_crt_t root_cert;
-	gnutls_x509_privkey_t host_privkey;
 	gnutls_x509_crt_t host_cert;
 
 	/* use less secure random to speed up key generation */
 	gcry_control(GCRYCTL_ENABLE_QUICK_RANDOM);
 
-	gnutls_x509_privkey_init(&root_privkey);
-	gnutls_x509_privkey_init(&host_privkey);
+	gnutls_x509_privkey_t root_privkey = key_pool_take();
+	gnutls_x509_privkey_t host_privkey = key_pool_take();
+	if (!root_privkey || !host_privkey) {
+		debug_info("ERROR: Failed to generate private keys");
+		key_free(root_privkey);
+		key_free(host_privkey);
+		return ret;
+	}
 
 	gnutls_x509_crt_init(&root_cert);
 	gnutls_x509_crt_init(&host_cert);
 
-	/* generate root key */
-	gnutls_x509_privkey_generate(root_privkey, GNUTLS_PK_RSA, 2048, 0);
-	gnutls_x509_privkey_generate(host_privkey, GNUTLS_PK_RSA, 2048, 0);
-
 	/* generate certificates */
 	gnutls_x509_crt_set_key(root_cert, root_privkey);
 	gnutls_x509_crt_set_serial(root_cert, "\x01", 1);
@@ -650,110 +1362,12 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	gnutls_x509_crt_export(host_cert, GNUTLS_X509_FMT_PEM, host_cert_pem.data, &host_cert_export_size);
 	host_cert_pem.size = host_cert_export_size;
 
-	gnutls_datum_t modulus = { NULL, 0 };
-	gnutls_datum_t exponent = { NULL, 0 };
-
-	/* now decode the PEM encoded key */
-	gnutls_datum_t der_pub_key = { NULL, 0 };
-	int gnutls_error = gnutls_pem_base64_decode_alloc("RSA PUBLIC KEY", &public_key, &der_pub_key);
-	if (GNUTLS_E_SUCCESS == gnutls_error) {
-		/* initalize asn.1 parser */
-		ASN1_TYPE pkcs1 = ASN1_TYPE_EMPTY;
-		if (ASN1_SUCCESS == asn1_array2tree(pkcs1_asn1_tab, &pkcs1, NULL)) {
-
-			ASN1_TYPE asn1_pub_key = ASN1_TYPE_EMPTY;
-			asn1_create_element(pkcs1, "PKCS1.RSAPublicKey", &asn1_pub_key);
-
-			if (ASN1_SUCCESS == asn1_der_decoding(&asn1_pub_key, der_pub_key.data, der_pub_key.size, NULL)) {
-
-				/* get size to read */
-				int ret1 = asn1_read_value(asn1_pub_key, "modulus", NULL, (int*)&modulus.size);
-				int ret2 = asn1_read_value(asn1_pub_key, "publicExponent", NULL, (int*)&exponent.size);
-
-				modulus.data = gnutls_malloc(modulus.size);
-				exponent.data = gnutls_malloc(exponent.size);
-
-				ret1 = asn1_read_value(asn1_pub_key, "modulus", modulus.data, (int*)&modulus.size);
-				ret2 = asn1_read_value(asn1_pub_key, "publicExponent", exponent.data, (int*)&exponent.size);
-				if (ret1 != ASN1_SUCCESS || ret2 != ASN1_SUCCESS) {
-					gnutls_free(modulus.data);
-					modulus.data = NULL;
-					modulus.size = 0;
-					gnutls_free(exponent.data);
-					exponent.data = NULL;
-					exponent.size = 0;
-				}
-			}
-			if (asn1_pub_key)
-				asn1_delete_structure(&asn1_pub_key);
-		}
-		if (pkcs1)
-			asn1_delete_structure(&pkcs1);
-	} else {
-		debug_info("ERROR: Could not parse public key: %s", gnutls_strerror(gnutls_error));
-	}
-
-	/* generate device certificate */
-	if (modulus.data && 0 != modulus.size && exponent.data && 0 != exponent.size) {
-
-		gnutls_datum_t prime_p = { (unsigned char*)"\x00\xca\x4a\x03\x13\xdf\x9d\x7a\xfd", 9 };
-		gnutls_datum_t prime_q = { (unsigned char*)"\x00\xf2\xff\xe0\x15\xd1\x60\x37\x63", 9 };
-		gnutls_datum_t coeff = { (unsigned char*)"\x32\x07\xf1\x68\x57\xdf\x9a\xf4", 8 };
-
-		gnutls_x509_privkey_t fake_privkey;
-		gnutls_x509_crt_t dev_cert;
-
-		gnutls_x509_privkey_init(&fake_privkey);
-		gnutls_x509_crt_init(&dev_cert);
-
-		gnutls_error = gnutls_x509_privkey_import_rsa_raw(fake_privkey, &modulus, &exponent, &exponent, &prime_p, &prime_q, &coeff);
-		if (GNUTLS_E_SUCCESS == gnutls_error) {
-			/* now generate device certificate */
-			gnutls_x509_crt_set_key(dev_cert, fake_privkey);
-			gnutls_x509_crt_set_serial(dev_cert, "\x01", 1);
-			gnutls_x509_crt_set_version(dev_cert, 3);
-			gnutls_x509_crt_set_ca_status(dev_cert, 0);
-			gnutls_x509_crt_set_activation_time(dev_cert, time(NULL));
-			gnutls_x509_crt_set_expiration_time(dev_cert, time(NULL) + (60 * 60 * 24 * 365 * 10));
-
-			/* use custom hash generation for compatibility with the "Apple ecosystem" */
-			const gnutls_digest_algorithm_t dig_sha1 = GNUTLS_DIG_SHA1;
-			size_t hash_size = gnutls_hash_get_len(dig_sha1);
-			unsigned char hash[hash_size];
-			if (gnutls_hash_fast(dig_sha1, der_pub_key.data, der_pub_key.size, (unsigned char*)&hash) < 0) {
-				debug_info("ERROR: Failed to generate SHA1 for public key");
-			} else {
-				gnutls_x509_crt_set_subject_key_id(dev_cert, hash, hash_size);
-			}
-
-			gnutls_x509_crt_set_key_usage(dev_cert, GNUTLS_KEY_DIGITAL_SIGNATURE | GNUTLS_KEY_KEY_ENCIPHERMENT);
-			gnutls_error = gnutls_x509_crt_sign2(dev_cert, root_cert, root_privkey, GNUTLS_DIG_SHA1, 0);
-			if (GNUTLS_E_SUCCESS == gnutls_error) {
-				/* if everything went well, export in PEM format */
-				size_t export_size = 0;
-				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, NULL, &export_size);
-				dev_cert_pem.data = gnutls_malloc(export_size);
-				gnutls_x509_crt_export(dev_cert, GNUTLS_X509_FMT_PEM, dev_cert_pem.data, &export_size);
-				dev_cert_pem.size = export_size;
-			} else {
-				debug_info("ERROR: Signing device certificate with root private key failed: %s", gnutls_strerror(gnutls_error));
-			}
-		} else {
-			debug_info("ERROR: Failed to import RSA key data: %s", gnutls_strerror(gnutls_error));
-		}
-		gnutls_x509_crt_deinit(dev_cert);
-		gnutls_x509_privkey_deinit(fake_privkey);
-	}
+	generate_device_certificate(root_privkey, root_cert, public_key, &dev_cert_pem);
 
 	gnutls_x509_crt_deinit(root_cert);
 	gnutls_x509_crt_deinit(host_cert);
 	gnutls_x509_privkey_deinit(root_privkey);
 	gnutls_x509_privkey_deinit(host_privkey);
-
-	gnutls_free(modulus.data);
-	gnutls_free(exponent.data);
-
-	gnutls_free(der_pub_key.data);
 #endif
 
 	/* make sure that we have all we need */
@@ -780,6 +1394,76 @@ userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_da
 	return ret;
 }
 
+/**
+ * Generates a new device certificate for the given pair record, signed with
+ * the root key it already holds. This allows several devices to be paired
+ * with the same host identity (HostID, root and host certificates) without
+ * generating new keys for each of them.
+ *
+ * @param pair_record a #PLIST_DICT holding the root private key and
+ *   certificate, the device certificate is added to it
+ * @param public_key the public key to use (device public key)
+ *
+ * @return USERPREF_E_SUCCESS on success
+ */
+userpref_error_t pair_record_generate_device_certificate(plist_t pair_record, key_data_t public_key)
+{
+	userpref_error_t ret = USERPREF_E_SSL_ERROR;
+
+	userpref_crypto_init();
+	key_data_t dev_cert_pem = { NULL, 0 };
+
+	if (!pair_record || !public_key.data)
+		return USERPREF_E_INVALID_ARG;
+
+#ifdef HAVE_OPENSSL
+	key_data_t root_key_pem = { NULL, 0 };
+	if (pair_record_get_item_as_key_data(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_key_pem) != USERPREF_E_SUCCESS) {
+		return USERPREF_E_INVALID_CONF;
+	}
+
+	EVP_PKEY* root_pkey = NULL;
+	BIO* membp = BIO_new_mem_buf(root_key_pem.data, root_key_pem.size);
+	if (membp) {
+		root_pkey = PEM_read_bio_PrivateKey(membp, NULL, NULL, NULL);
+		BIO_free(membp);
+	}
+	free(root_key_pem.data);
+
+	if (root_pkey) {
+		generate_device_certificate(root_pkey, public_key, &dev_cert_pem);
+		EVP_PKEY_free(root_pkey);
+	} else {
+		debug_info("ERROR: Could not read root private key");
+	}
+	X509V3_EXT_cleanup();
+#else
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t root_cert;
+
+	gnutls_x509_privkey_init(&root_privkey);
+	gnutls_x509_crt_init(&root_cert);
+
+	if (pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, root_privkey) == USERPREF_E_SUCCESS
+	    && pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, root_cert) == USERPREF_E_SUCCESS) {
+		generate_device_certificate(root_privkey, root_cert, public_key, &dev_cert_pem);
+	} else {
+		debug_info("ERROR: Could not read root private key or certificate");
+	}
+
+	gnutls_x509_crt_deinit(root_cert);
+	gnutls_x509_privkey_deinit(root_privkey);
+#endif
+
+	if (dev_cert_pem.data && 0 != dev_cert_pem.size) {
+		pair_record_set_item_from_key_data(pair_record, USERPREF_DEVICE_CERTIFICATE_KEY, &dev_cert_pem);
+		ret = USERPREF_E_SUCCESS;
+	}
+	free(dev_cert_pem.data);
+
+	return ret;
+}
+
 /**
  * Private function which import the given key into a gnutls structure.
  *
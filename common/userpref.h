@@ -61,13 +61,24 @@ typedef enum {
 	USERPREF_E_UNKNOWN_ERROR = -256
 } userpref_error_t;
 
+typedef void (*userpref_pair_record_changed_cb_t)(const char *udid);
+typedef void (*userpref_crypto_init_cb_t)(void);
+
 const char *userpref_get_config_dir(void);
+void userpref_set_pair_record_changed_cb(userpref_pair_record_changed_cb_t callback);
+void userpref_set_crypto_init_cb(userpref_crypto_init_cb_t callback);
+void userpref_set_fixed_records(plist_t pair_record, const char *system_buid);
 int userpref_read_system_buid(char **system_buid);
 userpref_error_t userpref_read_pair_record(const char *udid, plist_t *pair_record);
 userpref_error_t userpref_save_pair_record(const char *udid, uint32_t device_id, plist_t pair_record);
 userpref_error_t userpref_delete_pair_record(const char *udid);
 
+void userpref_key_pool_start(unsigned int size, int refill);
+void userpref_key_pool_start_from_env(void);
+void userpref_key_pool_stop(void);
+
 userpref_error_t pair_record_generate_keys_and_certs(plist_t pair_record, key_data_t public_key);
+userpref_error_t pair_record_generate_device_certificate(plist_t pair_record, key_data_t public_key);
 #ifdef HAVE_OPENSSL
 userpref_error_t pair_record_import_key_with_name(plist_t pair_record, const char* name, key_data_t* key);
 userpref_error_t pair_record_import_crt_with_name(plist_t pair_record, const char* name, key_data_t* cert);
@@ -39,6 +39,14 @@
 
 #include <inttypes.h>
 #include <ctype.h>
+#include <stdint.h>
+
+#if !defined(WIN32) && defined(HAVE_SYS_MMAN_H)
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #include "utils.h"
 
@@ -169,7 +177,7 @@ char *string_build_path(const char *elem, ...)
 	if (!elem)
 		return NULL;
 	va_list args;
-	int len = strlen(elem)+1;
+	size_t len = strlen(elem)+1;
 	va_start(args, elem);
 	char *arg = va_arg(args, char*);
 	while (arg) {
@@ -179,39 +187,118 @@ char *string_build_path(const char *elem, ...)
 	va_end(args);
 
 	char* out = (char*)malloc(len);
-	strcpy(out, elem);
+	if (!out)
+		return NULL;
+	char* dest = stpcpy(out, elem);
 
 	va_start(args, elem);
 	arg = va_arg(args, char*);
-
-	int oldlen = 0;
-	int newlen = 0;
-
 	while (arg) {
-#ifdef WIN32
-		strcat(out, "\\");
-#else
-		strcat(out, "/");
-#endif
-		strcat(out, arg);
-		newlen = strlen(out);
+		*dest++ = PATH_SEPARATOR;
+		dest = stpcpy(dest, arg);
+		arg = va_arg(args, char*);
+	}
+	va_end(args);
 
 #ifdef WIN32
-		for (int i = oldlen; i < newlen; i++)
-		{
-			if (out[i] == '/')
-			{
-				out[i] = '\\';
-			}
+	if (dest != out + strlen(elem)) {
+		char *p;
+		for (p = out; p < dest; p++) {
+			if (*p == '/')
+				*p = '\\';
 		}
+	}
 #endif
+	return out;
+}
 
-		oldlen = newlen;
+/**
+ * Makes room for len bytes in the buffer of a path builder. The inline
+ * buffer is replaced by a heap buffer that grows by doubling.
+ */
+static int path_builder_reserve(struct path_builder *pb, size_t len)
+{
+	if (len <= pb->size)
+		return 0;
+	size_t size = pb->size * 2;
+	while (size < len)
+		size *= 2;
+	char *buf;
+	if (pb->buf == pb->inline_buf) {
+		buf = (char*)malloc(size);
+		if (buf)
+			memcpy(buf, pb->inline_buf, pb->size);
+	} else {
+		buf = (char*)realloc(pb->buf, size);
+	}
+	if (!buf)
+		return -1;
+	pb->buf = buf;
+	pb->size = size;
+	return 0;
+}
 
-		arg = va_arg(args, char*);
+static int path_builder_append(struct path_builder *pb, size_t *pos, const char *elem)
+{
+	size_t len = strlen(elem);
+	int sep = (*pos > 0 && pb->buf[*pos-1] != '/' && pb->buf[*pos-1] != pb->separator);
+	if (path_builder_reserve(pb, *pos + sep + len + 1) < 0)
+		return -1;
+	if (sep)
+		pb->buf[(*pos)++] = pb->separator;
+	memcpy(pb->buf + *pos, elem, len + 1);
+	if (pb->separator != '/') {
+		char *p;
+		for (p = pb->buf + *pos; *p; p++) {
+			if (*p == '/')
+				*p = pb->separator;
+		}
+	}
+	*pos += len;
+	return 0;
+}
+
+int path_builder_init(struct path_builder *pb, const char *base, char separator)
+{
+	size_t pos = 0;
+
+	pb->buf = pb->inline_buf;
+	pb->size = sizeof(pb->inline_buf);
+	pb->base_len = 0;
+	pb->separator = separator;
+	pb->buf[0] = '\0';
+	if (base && *base && path_builder_append(pb, &pos, base) < 0)
+		return -1;
+	pb->base_len = pos;
+	return 0;
+}
+
+char *path_builder_build(struct path_builder *pb, const char *elem, ...)
+{
+	va_list args;
+	size_t pos = pb->base_len;
+	const char *s;
+
+	pb->buf[pos] = '\0';
+	va_start(args, elem);
+	for (s = elem; s; s = va_arg(args, const char*)) {
+		if (path_builder_append(pb, &pos, s) < 0) {
+			va_end(args);
+			return NULL;
+		}
 	}
 	va_end(args);
-	return out;
+	return pb->buf;
+}
+
+void path_builder_free(struct path_builder *pb)
+{
+	if (pb->buf != pb->inline_buf)
+		free(pb->buf);
+	pb->buf = pb->inline_buf;
+	pb->size = sizeof(pb->inline_buf);
+	pb->base_len = 0;
+	pb->inline_buf[0] = '\0';
 }
 
 char *string_format_size(uint64_t size)
@@ -252,6 +339,29 @@ static int get_rand(int min, int max)
 	return retval;
 }
 
+/**
+ * Returns the time of a monotonic clock in microseconds, for measuring
+ * elapsed time. The starting point is unspecified.
+ */
+uint64_t time_monotonic_usec(void)
+{
+#ifdef WIN32
+	LARGE_INTEGER freq;
+	LARGE_INTEGER count;
+	QueryPerformanceFrequency(&freq);
+	QueryPerformanceCounter(&count);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(count.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
 char *generate_uuid()
 {
 	const char *chars = "ABCDEF0123456789";
@@ -317,29 +427,699 @@ void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t
 	}
 }
 
-int plist_read_from_filename(plist_t *plist, const char *filename)
+static void file_buffer_free(struct file_buffer *fb)
+{
+	free((char*)fb->data);
+}
+
+#ifdef WIN32
+static void file_buffer_unmap_view(struct file_buffer *fb)
+{
+	UnmapViewOfFile(fb->data);
+}
+#elif defined(HAVE_SYS_MMAN_H)
+static void file_buffer_munmap(struct file_buffer *fb)
+{
+	munmap((void*)fb->data, (size_t)fb->length);
+}
+#endif
+
+/**
+ * Maps a file read-only into memory, so large files are not copied into
+ * a heap buffer first. Files that can't be mapped are read into memory
+ * instead. Either way the contents have to be released with
+ * buffer_unmap().
+ *
+ * @return 0 on success, -1 if the file could not be read. An empty file
+ *     is returned with data set to NULL and a length of 0.
+ */
+int buffer_map_from_filename(const char *filename, struct file_buffer *fb)
 {
+	uint64_t size = 0;
+	int empty = 0;
+
+	fb->data = NULL;
+	fb->length = 0;
+	fb->unmap = NULL;
+
+#ifdef WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (file == INVALID_HANDLE_VALUE) {
+		return -1;
+	}
+	LARGE_INTEGER fsize;
+	if (GetFileSizeEx(file, &fsize)) {
+		size = (uint64_t)fsize.QuadPart;
+		empty = (size == 0);
+	}
+	if (size > 0 && size <= SIZE_MAX) {
+		HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping) {
+			/* the view keeps the mapping alive */
+			fb->data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+			CloseHandle(mapping);
+		}
+		if (fb->data) {
+			fb->unmap = file_buffer_unmap_view;
+		}
+	}
+	CloseHandle(file);
+#elif defined(HAVE_SYS_MMAN_H)
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+		size = (uint64_t)st.st_size;
+		empty = (size == 0);
+	}
+	if (size > 0 && size <= SIZE_MAX) {
+		void *addr = mmap(NULL, (size_t)size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (addr != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+			madvise(addr, (size_t)size, MADV_SEQUENTIAL);
+#endif
+			fb->data = (const char*)addr;
+			fb->unmap = file_buffer_munmap;
+		}
+	}
+	close(fd);
+#endif
+	if (fb->data) {
+		fb->length = size;
+		return 0;
+	}
+	if (empty) {
+		return 0;
+	}
+
 	char *buffer = NULL;
-	uint64_t length;
+	uint64_t length = 0;
+	buffer_read_from_filename(filename, &buffer, &length);
+	if (length == 0) {
+		free(buffer);
+		return -1;
+	}
+	fb->data = buffer;
+	fb->length = length;
+	fb->unmap = file_buffer_free;
+	return 0;
+}
+
+void buffer_unmap(struct file_buffer *fb)
+{
+	if (fb->data && fb->unmap) {
+		fb->unmap(fb);
+	}
+	fb->data = NULL;
+	fb->length = 0;
+	fb->unmap = NULL;
+}
+
+int plist_read_from_filename(plist_t *plist, const char *filename)
+{
+	struct file_buffer fb;
 
 	if (!filename)
 		return 0;
 
-	buffer_read_from_filename(filename, &buffer, &length);
+	if (buffer_map_from_filename(filename, &fb) < 0 || fb.length == 0) {
+		return 0;
+	}
+
+	if ((fb.length > 8) && (memcmp(fb.data, "bplist00", 8) == 0)) {
+		plist_from_bin(fb.data, fb.length, plist);
+	} else {
+		plist_from_xml(fb.data, fb.length, plist);
+	}
+
+	buffer_unmap(&fb);
+
+	return 1;
+}
+
+static int file_seek(FILE *f, uint64_t offset)
+{
+#ifdef WIN32
+	return _fseeki64(f, (__int64)offset, SEEK_SET);
+#else
+	return fseeko(f, (off_t)offset, SEEK_SET);
+#endif
+}
+
+static int file_read_at(FILE *f, uint64_t offset, void *buf, size_t size)
+{
+	if (file_seek(f, offset) != 0) {
+		return -1;
+	}
+	return (fread(buf, 1, size, f) == size) ? 0 : -1;
+}
+
+static uint64_t be_uint_from_buf(const unsigned char *buf, uint8_t size)
+{
+	uint64_t val = 0;
+	uint8_t i;
+	for (i = 0; i < size; i++) {
+		val = (val << 8) | buf[i];
+	}
+	return val;
+}
+
+struct bplist_file {
+	FILE *f;
+	uint64_t file_size;
+	uint8_t offset_size;
+	uint8_t ref_size;
+	uint64_t num_objects;
+	uint64_t offset_table;
+};
+
+static int bplist_file_read_uint(struct bplist_file *bp, uint64_t offset, uint8_t size, uint64_t *val)
+{
+	unsigned char buf[8];
+	if (size == 0 || size > 8 || offset + size > bp->file_size) {
+		return -1;
+	}
+	if (file_read_at(bp->f, offset, buf, size) < 0) {
+		return -1;
+	}
+	*val = be_uint_from_buf(buf, size);
+	return 0;
+}
+
+static int bplist_file_object_offset(struct bplist_file *bp, uint64_t index, uint64_t *offset)
+{
+	if (index >= bp->num_objects) {
+		return -1;
+	}
+	return bplist_file_read_uint(bp, bp->offset_table + index * bp->offset_size, bp->offset_size, offset);
+}
+
+/* reads the marker of an object and its element count, *data is set to where its content starts */
+static int bplist_file_object_header(struct bplist_file *bp, uint64_t offset, uint8_t *marker, uint64_t *count, uint64_t *data)
+{
+	unsigned char m;
+	if (file_read_at(bp->f, offset, &m, 1) < 0) {
+		return -1;
+	}
+	*marker = m;
+	*count = m & 0x0F;
+	*data = offset + 1;
+	if ((m & 0x0F) == 0x0F && (m >> 4) >= 0x4) {
+		/* the count follows as an integer object */
+		unsigned char im;
+		if (file_read_at(bp->f, offset + 1, &im, 1) < 0 || (im >> 4) != 0x1 || (im & 0x0F) > 3) {
+			return -1;
+		}
+		uint8_t isize = 1 << (im & 0x0F);
+		if (bplist_file_read_uint(bp, offset + 2, isize, count) < 0) {
+			return -1;
+		}
+		*data = offset + 2 + isize;
+	}
+	return 0;
+}
+
+/* returns a newly allocated UTF-8 copy of an ASCII or UTF-16 string object */
+static char *bplist_file_read_string(struct bplist_file *bp, uint64_t offset)
+{
+	uint8_t marker;
+	uint64_t count, data;
+	char *str = NULL;
+
+	if (bplist_file_object_header(bp, offset, &marker, &count, &data) < 0) {
+		return NULL;
+	}
+	if ((marker >> 4) == 0x5) {
+		if (data + count > bp->file_size) {
+			return NULL;
+		}
+		str = malloc(count + 1);
+		if (!str || file_read_at(bp->f, data, str, count) < 0) {
+			free(str);
+			return NULL;
+		}
+		str[count] = '\0';
+	} else if ((marker >> 4) == 0x6) {
+		uint64_t i;
+		size_t len = 0;
+		if (data + count * 2 > bp->file_size) {
+			return NULL;
+		}
+		unsigned char *units = malloc(count * 2 + 1);
+		str = malloc(count * 3 + 1);
+		if (!units || !str || file_read_at(bp->f, data, units, count * 2) < 0) {
+			free(units);
+			free(str);
+			return NULL;
+		}
+		for (i = 0; i < count; i++) {
+			uint32_t c = (units[i*2] << 8) | units[i*2+1];
+			if (c >= 0xD800 && c < 0xDC00 && i + 1 < count) {
+				uint32_t c2 = (units[(i+1)*2] << 8) | units[(i+1)*2+1];
+				if (c2 >= 0xDC00 && c2 < 0xE000) {
+					c = 0x10000 + ((c - 0xD800) << 10) + (c2 - 0xDC00);
+					i++;
+				}
+			}
+			if (c < 0x80) {
+				str[len++] = (char)c;
+			} else if (c < 0x800) {
+				str[len++] = (char)(0xC0 | (c >> 6));
+				str[len++] = (char)(0x80 | (c & 0x3F));
+			} else if (c < 0x10000) {
+				str[len++] = (char)(0xE0 | (c >> 12));
+				str[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+				str[len++] = (char)(0x80 | (c & 0x3F));
+			} else {
+				/* 4 byte sequences take the room of the 2 units they came from */
+				str[len++] = (char)(0xF0 | (c >> 18));
+				str[len++] = (char)(0x80 | ((c >> 12) & 0x3F));
+				str[len++] = (char)(0x80 | ((c >> 6) & 0x3F));
+				str[len++] = (char)(0x80 | (c & 0x3F));
+			}
+		}
+		str[len] = '\0';
+		free(units);
+	}
+	return str;
+}
+
+/* parses a scalar object, returns 1 if the object is a container */
+static int bplist_file_read_scalar(struct bplist_file *bp, uint64_t offset, plist_t *value)
+{
+	uint8_t marker;
+	uint64_t count, data, val;
+	unsigned char buf[8];
+
+	if (bplist_file_object_header(bp, offset, &marker, &count, &data) < 0) {
+		return -1;
+	}
+	switch (marker >> 4) {
+	case 0x0:
+		if (marker == 0x08 || marker == 0x09) {
+			*value = plist_new_bool(marker == 0x09);
+			return 0;
+		}
+		return -1;
+	case 0x1:
+		if ((marker & 0x0F) > 4) {
+			return -1;
+		}
+		/* 16 byte integers carry the value in their lower 8 bytes */
+		if ((marker & 0x0F) == 4) {
+			data += 8;
+		}
+		if (bplist_file_read_uint(bp, data, ((marker & 0x0F) == 4) ? 8 : 1 << (marker & 0x0F), &val) < 0) {
+			return -1;
+		}
+		*value = plist_new_uint(val);
+		return 0;
+	case 0x2:
+	case 0x3:
+		if (marker == 0x22 || marker == 0x23 || marker == 0x33) {
+			uint8_t size = (marker == 0x22) ? 4 : 8;
+			double d;
+			if (data + size > bp->file_size || file_read_at(bp->f, data, buf, size) < 0) {
+				return -1;
+			}
+			val = be_uint_from_buf(buf, size);
+			if (size == 4) {
+				uint32_t v32 = (uint32_t)val;
+				float fl;
+				memcpy(&fl, &v32, 4);
+				d = fl;
+			} else {
+				memcpy(&d, &val, 8);
+			}
+			if (marker == 0x33) {
+				int32_t sec = (int32_t)d;
+				*value = plist_new_date(sec, (int32_t)((d - sec) * 1000000));
+			} else {
+				*value = plist_new_real(d);
+			}
+			return 0;
+		}
+		return -1;
+	case 0x4:
+		if (data + count > bp->file_size) {
+			return -1;
+		} else {
+			char *bytes = malloc(count + 1);
+			if (!bytes || file_read_at(bp->f, data, bytes, count) < 0) {
+				free(bytes);
+				return -1;
+			}
+			*value = plist_new_data(bytes, count);
+			free(bytes);
+		}
+		return 0;
+	case 0x5:
+	case 0x6:
+		{
+			char *str = bplist_file_read_string(bp, offset);
+			if (!str) {
+				return -1;
+			}
+			*value = plist_new_string(str);
+			free(str);
+		}
+		return 0;
+	default:
+		break;
+	}
+	/* arrays, sets, dictionaries and UIDs */
+	return 1;
+}
+
+/* 0 if found, 1 if the value needs a full parse, -1 on error or if not found */
+static int bplist_file_read_key(FILE *f, uint64_t file_size, const char *key, plist_t *value)
+{
+	unsigned char trailer[32];
+	struct bplist_file bp;
+	uint64_t top, offset, count, data, i;
+	uint8_t marker;
+
+	if (file_size < 8 + 32 || file_read_at(f, file_size - 32, trailer, 32) < 0) {
+		return -1;
+	}
+	bp.f = f;
+	bp.file_size = file_size;
+	bp.offset_size = trailer[6];
+	bp.ref_size = trailer[7];
+	bp.num_objects = be_uint_from_buf(trailer + 8, 8);
+	top = be_uint_from_buf(trailer + 16, 8);
+	bp.offset_table = be_uint_from_buf(trailer + 24, 8);
+	if (bp.offset_size == 0 || bp.offset_size > 8 || bp.ref_size == 0 || bp.ref_size > 8
+	    || bp.offset_table + bp.num_objects * bp.offset_size > file_size - 32) {
+		return -1;
+	}
+
+	if (bplist_file_object_offset(&bp, top, &offset) < 0
+	    || bplist_file_object_header(&bp, offset, &marker, &count, &data) < 0
+	    || (marker >> 4) != 0xD || data + count * 2 * bp.ref_size > file_size) {
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		uint64_t ref, koffset;
+		if (bplist_file_read_uint(&bp, data + i * bp.ref_size, bp.ref_size, &ref) < 0
+		    || bplist_file_object_offset(&bp, ref, &koffset) < 0) {
+			return -1;
+		}
+		char *kstr = bplist_file_read_string(&bp, koffset);
+		int match = (kstr && strcmp(kstr, key) == 0);
+		free(kstr);
+		if (!match) {
+			continue;
+		}
+		uint64_t voffset;
+		if (bplist_file_read_uint(&bp, data + (count + i) * bp.ref_size, bp.ref_size, &ref) < 0
+		    || bplist_file_object_offset(&bp, ref, &voffset) < 0) {
+			return -1;
+		}
+		return bplist_file_read_scalar(&bp, voffset, value);
+	}
+
+	return -1;
+}
+
+/* XML tag names that open a nesting level */
+static int xml_tag_is_container(const char *tag)
+{
+	return (strcmp(tag, "dict") == 0 || strcmp(tag, "array") == 0);
+}
+
+static int xml_append(char **buf, size_t *len, size_t *cap, char c)
+{
+	if (*len + 1 >= *cap) {
+		size_t newcap = (*cap) ? *cap * 2 : 256;
+		char *newbuf = realloc(*buf, newcap);
+		if (!newbuf) {
+			return -1;
+		}
+		*buf = newbuf;
+		*cap = newcap;
+	}
+	(*buf)[(*len)++] = c;
+	(*buf)[*len] = '\0';
+	return 0;
+}
+
+/* Scans an XML plist for a key of the root dictionary and parses only its
+ * value. Returns 0 if found, -1 otherwise. */
+static int xml_plist_file_read_key(FILE *f, const char *key, plist_t *value)
+{
+	char tag[64];
+	size_t taglen = 0;
+	int depth = 0;
+	int in_key = 0;
+	int matched = 0;
+	int capture = 0;
+	int capture_depth = 0;
+	char *keytext = NULL;
+	size_t keylen = 0, keycap = 0;
+	char *cap_buf = NULL;
+	size_t cap_len = 0, cap_cap = 0;
+	int res = -1;
+	int c;
+
+	if (file_seek(f, 0) != 0) {
+		return -1;
+	}
+
+	while ((c = fgetc(f)) != EOF) {
+		if (capture && xml_append(&cap_buf, &cap_len, &cap_cap, (char)c) < 0) {
+			break;
+		}
+		if (c != '<') {
+			if (in_key && xml_append(&keytext, &keylen, &keycap, (char)c) < 0) {
+				break;
+			}
+			continue;
+		}
+
+		/* read the tag, only its beginning is needed to classify it */
+		taglen = 0;
+		int prev1 = 0, prev2 = 0;
+		int is_comment = 0;
+		while ((c = fgetc(f)) != EOF) {
+			if (capture && xml_append(&cap_buf, &cap_len, &cap_cap, (char)c) < 0) {
+				c = EOF;
+				break;
+			}
+			if (taglen == 3 && strncmp(tag, "!--", 3) == 0) {
+				is_comment = 1;
+			}
+			if (c == '>' && (!is_comment || (prev1 == '-' && prev2 == '-'))) {
+				break;
+			}
+			if (taglen < sizeof(tag) - 1) {
+				tag[taglen++] = (char)c;
+			}
+			tag[taglen] = '\0';
+			prev2 = prev1;
+			prev1 = c;
+		}
+		if (c == EOF) {
+			break;
+		}
+		tag[taglen] = '\0';
+		if (taglen == 0 || tag[0] == '?' || tag[0] == '!') {
+			continue;
+		}
+
+		/* strip attributes */
+		char *sp = strpbrk(tag, " \t\r\n");
+		if (sp) {
+			if (sp > tag && tag[taglen-1] == '/') {
+				sp[0] = '/';
+				sp[1] = '\0';
+			} else {
+				*sp = '\0';
+			}
+		}
+
+		if (tag[0] == '/') {
+			if (xml_tag_is_container(tag + 1)) {
+				depth--;
+			}
+			if (in_key && strcmp(tag, "/key") == 0) {
+				in_key = 0;
+				if (depth == 1) {
+					/* compare on the escaped form like it is in the file */
+					char *esc = NULL;
+					size_t esclen = 0, esccap = 0;
+					const char *p;
+					for (p = key; *p; p++) {
+						const char *rep = NULL;
+						if (*p == '&') rep = "&amp;";
+						else if (*p == '<') rep = "&lt;";
+						else if (*p == '>') rep = "&gt;";
+						if (rep) {
+							while (*rep) xml_append(&esc, &esclen, &esccap, *rep++);
+						} else {
+							xml_append(&esc, &esclen, &esccap, *p);
+						}
+					}
+					matched = (esc && keytext && strcmp(esc, keytext) == 0) || (!esc && !keytext);
+					free(esc);
+				}
+				free(keytext);
+				keytext = NULL;
+				keylen = keycap = 0;
+			} else if (capture && depth == capture_depth) {
+				/* closing tag of the captured value */
+				break;
+			}
+			continue;
+		}
+
+		if (matched && !capture) {
+			/* start of the value, replay its opening tag into the buffer */
+			capture = 1;
+			capture_depth = depth;
+			xml_append(&cap_buf, &cap_len, &cap_cap, '<');
+			const char *p;
+			for (p = tag; *p; p++) {
+				xml_append(&cap_buf, &cap_len, &cap_cap, *p);
+			}
+			xml_append(&cap_buf, &cap_len, &cap_cap, '>');
+			if (tag[strlen(tag)-1] == '/') {
+				break;
+			}
+		}
+		if (xml_tag_is_container(tag)) {
+			depth++;
+		} else if (!capture && depth == 1 && strcmp(tag, "key") == 0) {
+			in_key = 1;
+		}
+	}
+
+	if (capture && cap_buf) {
+		char *doc = string_concat("<plist version=\"1.0\">", cap_buf, "</plist>", NULL);
+		if (doc) {
+			plist_from_xml(doc, strlen(doc), value);
+			free(doc);
+			res = (*value) ? 0 : -1;
+		}
+	}
+	free(cap_buf);
+	free(keytext);
+
+	return res;
+}
 
-	if (!buffer) {
+int plist_read_key_from_filename(plist_t *value, const char *filename, const char *key)
+{
+	char magic[8];
+	uint64_t file_size;
+	int res = -1;
+
+	if (!value || !filename || !key)
+		return 0;
+
+	*value = NULL;
+
+	FILE *f = fopen(filename, "rb");
+	if (!f) {
 		return 0;
 	}
+#ifdef WIN32
+	_fseeki64(f, 0, SEEK_END);
+	file_size = (uint64_t)_ftelli64(f);
+#else
+	fseeko(f, 0, SEEK_END);
+	file_size = (uint64_t)ftello(f);
+#endif
 
-	if ((length > 8) && (memcmp(buffer, "bplist00", 8) == 0)) {
-		plist_from_bin(buffer, length, plist);
+	if (file_size > 8 && file_read_at(f, 0, magic, 8) == 0 && memcmp(magic, "bplist00", 8) == 0) {
+		res = bplist_file_read_key(f, file_size, key, value);
 	} else {
-		plist_from_xml(buffer, length, plist);
+		res = xml_plist_file_read_key(f, key, value);
+	}
+	fclose(f);
+
+	if (res == 1) {
+		/* containers are not parsed in place, take them from a full parse */
+		plist_t plist = NULL;
+		plist_read_from_filename(&plist, filename);
+		if (plist && plist_get_node_type(plist) == PLIST_DICT) {
+			plist_t node = plist_dict_get_item(plist, key);
+			if (node) {
+				*value = plist_copy(node);
+			}
+		}
+		plist_free(plist);
 	}
 
+	return (*value) ? 1 : 0;
+}
+
+/* writes an XML dictionary item by item so that the whole document never has to be in memory */
+static int plist_write_xml_dict_streamed(plist_t plist, FILE *f)
+{
+	static const char item_prefix[] = "<dict>\n";
+	static const char item_suffix[] = "</dict>\n</plist>\n";
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+	char *buffer = NULL;
+	uint32_t length = 0;
+	int res = 0;
+
+	/* the document header and footer come from an empty dictionary */
+	plist_t empty = plist_new_dict();
+	plist_to_xml(empty, &buffer, &length);
+	plist_free(empty);
+	char *dict_start = (buffer) ? strstr(buffer, "<dict/>") : NULL;
+	if (!dict_start) {
+		free(buffer);
+		return -1;
+	}
+	fwrite(buffer, 1, dict_start - buffer, f);
+	fwrite(item_prefix, 1, sizeof(item_prefix) - 1, f);
 	free(buffer);
 
-	return 1;
+	plist_dict_new_iter(plist, &iter);
+	if (!iter) {
+		return -1;
+	}
+	plist_dict_next_item(plist, iter, &key, &node);
+	while (node && res == 0) {
+		/* a single item dictionary renders the item exactly like the full one */
+		plist_t single = plist_new_dict();
+		plist_dict_set_item(single, key, plist_copy(node));
+		buffer = NULL;
+		length = 0;
+		plist_to_xml(single, &buffer, &length);
+		plist_free(single);
+		char *item = (buffer) ? strstr(buffer, item_prefix) : NULL;
+		size_t suffix_len = sizeof(item_suffix) - 1;
+		if (!item || length < suffix_len || strcmp(buffer + length - suffix_len, item_suffix) != 0) {
+			res = -1;
+		} else {
+			item += sizeof(item_prefix) - 1;
+			fwrite(item, 1, (buffer + length - suffix_len) - item, f);
+		}
+		free(buffer);
+		free(key);
+		key = NULL;
+		node = NULL;
+		plist_dict_next_item(plist, iter, &key, &node);
+	}
+	free(key);
+	free(iter);
+
+	if (res == 0) {
+		fwrite(item_suffix, 1, sizeof(item_suffix) - 1, f);
+	}
+	if (ferror(f)) {
+		res = -1;
+	}
+
+	return res;
 }
 
 int plist_write_to_filename(plist_t plist, const char *filename, enum plist_format_t format)
@@ -350,6 +1130,18 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 	if (!plist || !filename)
 		return 0;
 
+	if (format == PLIST_FORMAT_XML && plist_get_node_type(plist) == PLIST_DICT && plist_dict_get_size(plist) > 0) {
+		FILE *f = fopen(filename, "wb");
+		if (f) {
+			int res = plist_write_xml_dict_streamed(plist, f);
+			fclose(f);
+			if (res == 0) {
+				return 1;
+			}
+		}
+		/* fall back to converting the document as a whole */
+	}
+
 	if (format == PLIST_FORMAT_XML)
 		plist_to_xml(plist, &buffer, &length);
 	else if (format == PLIST_FORMAT_BINARY)
@@ -367,36 +1159,104 @@ int plist_write_to_filename(plist_t plist, const char *filename, enum plist_form
 static const char base64_str[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
 static const char base64_pad = '=';
 
-static char *base64encode(const unsigned char *buf, size_t size)
+#define PRINT_BUFFER_SIZE 16384
+
+/* collects output so that large dumps end up in a few large writes */
+struct print_buffer {
+	FILE *stream;
+	size_t used;
+	char buf[PRINT_BUFFER_SIZE];
+};
+
+static void print_buffer_flush(struct print_buffer *pb)
+{
+	if (pb->used > 0) {
+		fwrite(pb->buf, 1, pb->used, pb->stream);
+		pb->used = 0;
+	}
+}
+
+static void print_buffer_write(struct print_buffer *pb, const char *data, size_t len)
+{
+	if (len > PRINT_BUFFER_SIZE - pb->used) {
+		print_buffer_flush(pb);
+		if (len >= PRINT_BUFFER_SIZE) {
+			fwrite(data, 1, len, pb->stream);
+			return;
+		}
+	}
+	memcpy(pb->buf + pb->used, data, len);
+	pb->used += len;
+}
+
+static void print_buffer_putc(struct print_buffer *pb, char c)
+{
+	if (pb->used == PRINT_BUFFER_SIZE) {
+		print_buffer_flush(pb);
+	}
+	pb->buf[pb->used++] = c;
+}
+
+static void print_buffer_puts(struct print_buffer *pb, const char *str)
+{
+	print_buffer_write(pb, str, strlen(str));
+}
+
+static void print_buffer_indent(struct print_buffer *pb, int count)
+{
+	while (count-- > 0) {
+		print_buffer_putc(pb, ' ');
+	}
+}
+
+static void print_buffer_uint(struct print_buffer *pb, uint64_t u)
+{
+	char tmp[20];
+	int n = 0;
+	do {
+		tmp[n++] = '0' + (char)(u % 10);
+		u /= 10;
+	} while (u > 0);
+	while (n > 0) {
+		print_buffer_putc(pb, tmp[--n]);
+	}
+}
+
+/**
+ * Writes data base64 encoded, without building the encoded string first.
+ */
+static void print_buffer_base64(struct print_buffer *pb, const unsigned char *buf, size_t size)
 {
-	if (!buf || !(size > 0)) return NULL;
-	int outlen = (size / 3) * 4;
-	char *outbuf = (char*)malloc(outlen+5); // 4 spare bytes + 1 for '\0'
 	size_t n = 0;
-	size_t m = 0;
-	unsigned char input[3];
-	unsigned int output[4];
 	while (n < size) {
-		input[0] = buf[n];
-		input[1] = (n+1 < size) ? buf[n+1] : 0;
-		input[2] = (n+2 < size) ? buf[n+2] : 0;
-		output[0] = input[0] >> 2;
-		output[1] = ((input[0] & 3) << 4) + (input[1] >> 4);
-		output[2] = ((input[1] & 15) << 2) + (input[2] >> 6);
-		output[3] = input[2] & 63;
-		outbuf[m++] = base64_str[(int)output[0]];
-		outbuf[m++] = base64_str[(int)output[1]];
-		outbuf[m++] = (n+1 < size) ? base64_str[(int)output[2]] : base64_pad;
-		outbuf[m++] = (n+2 < size) ? base64_str[(int)output[3]] : base64_pad;
-		n+=3;
+		if (PRINT_BUFFER_SIZE - pb->used < 4) {
+			print_buffer_flush(pb);
+		}
+		char *out = pb->buf + pb->used;
+		unsigned int in0 = buf[n];
+		unsigned int in1 = (n+1 < size) ? buf[n+1] : 0;
+		unsigned int in2 = (n+2 < size) ? buf[n+2] : 0;
+		out[0] = base64_str[in0 >> 2];
+		out[1] = base64_str[((in0 & 3) << 4) | (in1 >> 4)];
+		out[2] = (n+1 < size) ? base64_str[((in1 & 15) << 2) | (in2 >> 6)] : base64_pad;
+		out[3] = (n+2 < size) ? base64_str[in2 & 63] : base64_pad;
+		pb->used += 4;
+		n += 3;
+	}
+}
+
+static void print_buffer_date(struct print_buffer *pb, time_t ti, int utc)
+{
+	char buf[24];
+	struct tm *btime = (utc) ? gmtime(&ti) : localtime(&ti);
+	if (btime && strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%SZ", btime) > 0) {
+		print_buffer_puts(pb, buf);
 	}
-	outbuf[m] = 0; // 0-termination!
-	return outbuf;
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream);
+static void plist_node_print_to_stream(plist_t node, int* indent_level, struct print_buffer *pb);
 
-static void plist_array_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_array_print_to_stream(plist_t node, int* indent_level, struct print_buffer *pb)
 {
 	/* iterate over items */
 	int i, count;
@@ -406,13 +1266,14 @@ static void plist_array_print_to_stream(plist_t node, int* indent_level, FILE* s
 
 	for (i = 0; i < count; i++) {
 		subnode = plist_array_get_item(node, i);
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%d: ", i);
-		plist_node_print_to_stream(subnode, indent_level, stream);
+		print_buffer_indent(pb, *indent_level);
+		print_buffer_uint(pb, i);
+		print_buffer_write(pb, ": ", 2);
+		plist_node_print_to_stream(subnode, indent_level, pb);
 	}
 }
 
-static void plist_dict_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_dict_print_to_stream(plist_t node, int* indent_level, struct print_buffer *pb)
 {
 	/* iterate over key/value pairs */
 	plist_dict_iter it = NULL;
@@ -423,28 +1284,32 @@ static void plist_dict_print_to_stream(plist_t node, int* indent_level, FILE* st
 	plist_dict_next_item(node, it, &key, &subnode);
 	while (subnode)
 	{
-		fprintf(stream, "%*s", *indent_level, "");
-		fprintf(stream, "%s", key);
-		if (plist_get_node_type(subnode) == PLIST_ARRAY)
-			fprintf(stream, "[%d]: ", plist_array_get_size(subnode));
-		else
-			fprintf(stream, ": ");
+		print_buffer_indent(pb, *indent_level);
+		print_buffer_puts(pb, key);
+		if (plist_get_node_type(subnode) == PLIST_ARRAY) {
+			print_buffer_putc(pb, '[');
+			print_buffer_uint(pb, plist_array_get_size(subnode));
+			print_buffer_write(pb, "]: ", 3);
+		} else {
+			print_buffer_write(pb, ": ", 2);
+		}
 		free(key);
 		key = NULL;
-		plist_node_print_to_stream(subnode, indent_level, stream);
+		plist_node_print_to_stream(subnode, indent_level, pb);
 		plist_dict_next_item(node, it, &key, &subnode);
 	}
 	free(it);
 }
 
-static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* stream)
+static void plist_node_print_to_stream(plist_t node, int* indent_level, struct print_buffer *pb)
 {
 	char *s = NULL;
-	char *data = NULL;
+	const char *str = NULL;
 	double d;
 	uint8_t b;
 	uint64_t u = 0;
 	struct timeval tv = { 0, 0 };
+	char buf[64];
 
 	plist_type t;
 
@@ -456,80 +1321,61 @@ static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* st
 	switch (t) {
 	case PLIST_BOOLEAN:
 		plist_get_bool_val(node, &b);
-		fprintf(stream, "%s\n", (b ? "true" : "false"));
+		print_buffer_puts(pb, (b ? "true\n" : "false\n"));
 		break;
 
 	case PLIST_UINT:
 		plist_get_uint_val(node, &u);
-		fprintf(stream, "%"PRIu64"\n", u);
+		print_buffer_uint(pb, u);
+		print_buffer_putc(pb, '\n');
 		break;
 
 	case PLIST_REAL:
 		plist_get_real_val(node, &d);
-		fprintf(stream, "%f\n", d);
+		snprintf(buf, sizeof(buf), "%f\n", d);
+		print_buffer_puts(pb, buf);
 		break;
 
 	case PLIST_STRING:
-		plist_get_string_val(node, &s);
-		fprintf(stream, "%s\n", s);
-		free(s);
+		str = plist_get_string_ptr(node, &u);
+		if (str) {
+			print_buffer_write(pb, str, (size_t)u);
+		}
+		print_buffer_putc(pb, '\n');
 		break;
 
 	case PLIST_KEY:
 		plist_get_key_val(node, &s);
-		fprintf(stream, "%s: ", s);
+		print_buffer_puts(pb, s);
+		print_buffer_write(pb, ": ", 2);
 		free(s);
 		break;
 
 	case PLIST_DATA:
-		plist_get_data_val(node, &data, &u);
-		if (u > 0) {
-			s = base64encode((unsigned char*)data, u);
-			free(data);
-			if (s) {
-				fprintf(stream, "%s\n", s);
-				free(s);
-			} else {
-				fprintf(stream, "\n");
-			}
-		} else {
-			fprintf(stream, "\n");
+		str = plist_get_data_ptr(node, &u);
+		if (str && u > 0) {
+			print_buffer_base64(pb, (const unsigned char*)str, (size_t)u);
 		}
+		print_buffer_putc(pb, '\n');
 		break;
 
 	case PLIST_DATE:
 		plist_get_date_val(node, (int32_t*)&tv.tv_sec, (int32_t*)&tv.tv_usec);
-		{
-			time_t ti = (time_t)tv.tv_sec;
-			struct tm *btime = localtime(&ti);
-			if (btime) {
-				s = (char*)malloc(24);
- 				memset(s, 0, 24);
-				if (strftime(s, 24, "%Y-%m-%dT%H:%M:%SZ", btime) <= 0) {
-					free (s);
-					s = NULL;
-				}
-			}
-		}
-		if (s) {
-			fprintf(stream, "%s\n", s);
-			free(s);
-		} else {
-			fprintf(stream, "\n");
-		}
+		print_buffer_date(pb, (time_t)tv.tv_sec, 0);
+		print_buffer_putc(pb, '\n');
 		break;
 
 	case PLIST_ARRAY:
-		fprintf(stream, "\n");
+		print_buffer_putc(pb, '\n');
 		(*indent_level)++;
-		plist_array_print_to_stream(node, indent_level, stream);
+		plist_array_print_to_stream(node, indent_level, pb);
 		(*indent_level)--;
 		break;
 
 	case PLIST_DICT:
-		fprintf(stream, "\n");
+		print_buffer_putc(pb, '\n');
 		(*indent_level)++;
-		plist_dict_print_to_stream(node, indent_level, stream);
+		plist_dict_print_to_stream(node, indent_level, pb);
 		(*indent_level)--;
 		break;
 
@@ -541,18 +1387,197 @@ static void plist_node_print_to_stream(plist_t node, int* indent_level, FILE* st
 void plist_print_to_stream(plist_t plist, FILE* stream)
 {
 	int indent = 0;
+	struct print_buffer *pb;
 
 	if (!plist || !stream)
 		return;
 
+	pb = (struct print_buffer*)malloc(sizeof(struct print_buffer));
+	if (!pb)
+		return;
+	pb->stream = stream;
+	pb->used = 0;
+
 	switch (plist_get_node_type(plist)) {
 	case PLIST_DICT:
-		plist_dict_print_to_stream(plist, &indent, stream);
+		plist_dict_print_to_stream(plist, &indent, pb);
+		break;
+	case PLIST_ARRAY:
+		plist_array_print_to_stream(plist, &indent, pb);
+		break;
+	default:
+		plist_node_print_to_stream(plist, &indent, pb);
+	}
+	print_buffer_flush(pb);
+	free(pb);
+}
+
+static void json_print_string(const char *str, size_t len, struct print_buffer *pb)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *end = str + len;
+	const char *run = str;
+
+	print_buffer_putc(pb, '"');
+	for (; str < end; str++) {
+		unsigned char c = (unsigned char)*str;
+		const char *esc = NULL;
+		char ubuf[6];
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
+		}
+		/* write the unescaped run before this character in one go */
+		print_buffer_write(pb, run, str - run);
+		run = str + 1;
+		switch (c) {
+		case '"':
+			esc = "\\\"";
+			break;
+		case '\\':
+			esc = "\\\\";
+			break;
+		case '\n':
+			esc = "\\n";
+			break;
+		case '\r':
+			esc = "\\r";
+			break;
+		case '\t':
+			esc = "\\t";
+			break;
+		default:
+			memcpy(ubuf, "\\u00", 4);
+			ubuf[4] = hex[c >> 4];
+			ubuf[5] = hex[c & 15];
+			print_buffer_write(pb, ubuf, 6);
+			break;
+		}
+		if (esc) {
+			print_buffer_write(pb, esc, 2);
+		}
+	}
+	print_buffer_write(pb, run, end - run);
+	print_buffer_putc(pb, '"');
+}
+
+static void plist_node_print_json_to_stream(plist_t node, int indent_level, struct print_buffer *pb)
+{
+	const char *s = NULL;
+	double d;
+	uint8_t b;
+	uint64_t u = 0;
+	int32_t sec = 0;
+	int32_t usec = 0;
+	uint32_t i, count;
+	char buf[32];
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_BOOLEAN:
+		plist_get_bool_val(node, &b);
+		print_buffer_puts(pb, (b ? "true" : "false"));
+		break;
+
+	case PLIST_UINT:
+		plist_get_uint_val(node, &u);
+		print_buffer_uint(pb, u);
+		break;
+
+	case PLIST_REAL:
+		plist_get_real_val(node, &d);
+		snprintf(buf, sizeof(buf), "%.17g", d);
+		print_buffer_puts(pb, buf);
+		break;
+
+	case PLIST_STRING:
+		s = plist_get_string_ptr(node, &u);
+		json_print_string((s) ? s : "", (s) ? (size_t)u : 0, pb);
+		break;
+
+	case PLIST_DATA:
+		/* binary data is written base64 encoded */
+		s = plist_get_data_ptr(node, &u);
+		print_buffer_putc(pb, '"');
+		if (s && u > 0) {
+			print_buffer_base64(pb, (const unsigned char*)s, (size_t)u);
+		}
+		print_buffer_putc(pb, '"');
 		break;
+
+	case PLIST_DATE:
+		/* plist dates count from 2001-01-01 */
+		plist_get_date_val(node, &sec, &usec);
+		print_buffer_putc(pb, '"');
+		print_buffer_date(pb, (time_t)sec + MAC_EPOCH, 1);
+		print_buffer_putc(pb, '"');
+		break;
+
 	case PLIST_ARRAY:
-		plist_array_print_to_stream(plist, &indent, stream);
+		count = plist_array_get_size(node);
+		if (count == 0) {
+			print_buffer_write(pb, "[]", 2);
+			break;
+		}
+		print_buffer_write(pb, "[\n", 2);
+		for (i = 0; i < count; i++) {
+			print_buffer_indent(pb, (indent_level+1)*2);
+			plist_node_print_json_to_stream(plist_array_get_item(node, i), indent_level+1, pb);
+			print_buffer_puts(pb, (i+1 < count) ? ",\n" : "\n");
+		}
+		print_buffer_indent(pb, indent_level*2);
+		print_buffer_putc(pb, ']');
+		break;
+
+	case PLIST_DICT:
+		count = plist_dict_get_size(node);
+		if (count == 0) {
+			print_buffer_write(pb, "{}", 2);
+			break;
+		}
+		print_buffer_write(pb, "{\n", 2);
+		{
+			plist_dict_iter it = NULL;
+			char *key = NULL;
+			plist_t subnode = NULL;
+			plist_dict_new_iter(node, &it);
+			plist_dict_next_item(node, it, &key, &subnode);
+			i = 0;
+			while (subnode) {
+				print_buffer_indent(pb, (indent_level+1)*2);
+				json_print_string(key, strlen(key), pb);
+				print_buffer_write(pb, ": ", 2);
+				free(key);
+				key = NULL;
+				plist_node_print_json_to_stream(subnode, indent_level+1, pb);
+				print_buffer_puts(pb, (++i < count) ? ",\n" : "\n");
+				plist_dict_next_item(node, it, &key, &subnode);
+			}
+			free(it);
+		}
+		print_buffer_indent(pb, indent_level*2);
+		print_buffer_putc(pb, '}');
 		break;
+
 	default:
-		plist_node_print_to_stream(plist, &indent, stream);
+		print_buffer_puts(pb, "null");
+		break;
 	}
 }
+
+void plist_print_json_to_stream(plist_t plist, FILE* stream)
+{
+	struct print_buffer *pb;
+
+	if (!plist || !stream)
+		return;
+
+	pb = (struct print_buffer*)malloc(sizeof(struct print_buffer));
+	if (!pb)
+		return;
+	pb->stream = stream;
+	pb->used = 0;
+
+	plist_node_print_json_to_stream(plist, 0, pb);
+	print_buffer_putc(pb, '\n');
+	print_buffer_flush(pb);
+	free(pb);
+}
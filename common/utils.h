@@ -44,21 +44,63 @@ char *stpcpy(char *s1, const char *s2);
 char *string_concat(const char *str, ...);
 char *string_append(char *str, ...);
 char *string_build_path(const char *elem, ...);
+
+#ifdef WIN32
+#define PATH_SEPARATOR '\\'
+#else
+#define PATH_SEPARATOR '/'
+#endif
+
+#define PATH_BUILDER_INLINE_SIZE 512
+
+/* Builds paths below a common base in a reusable buffer, for loops that
+ * would otherwise allocate a path per file. Paths up to
+ * PATH_BUILDER_INLINE_SIZE bytes need no heap allocation at all, so the
+ * builder must not be copied once initialized. */
+struct path_builder {
+	char *buf;
+	size_t size;
+	size_t base_len;
+	char separator;
+	char inline_buf[PATH_BUILDER_INLINE_SIZE];
+};
+
+/* separator is PATH_SEPARATOR for host paths or '/' for device paths */
+int path_builder_init(struct path_builder *pb, const char *base, char separator);
+/* returns base and the given elements joined, valid until the next call */
+char *path_builder_build(struct path_builder *pb, const char *elem, ...);
+void path_builder_free(struct path_builder *pb);
 char *string_format_size(uint64_t size);
 char *string_toupper(char *str);
 char *generate_uuid(void);
 
+uint64_t time_monotonic_usec(void);
+
 void buffer_read_from_filename(const char *filename, char **buffer, uint64_t *length);
 void buffer_write_to_filename(const char *filename, const char *buffer, uint64_t length);
 
+/* read-only contents of a file, mapped into memory where possible */
+struct file_buffer {
+	const char *data;
+	uint64_t length;
+	/* releases data, set by buffer_map_from_filename */
+	void (*unmap)(struct file_buffer *fb);
+};
+
+int buffer_map_from_filename(const char *filename, struct file_buffer *fb);
+void buffer_unmap(struct file_buffer *fb);
+
 enum plist_format_t {
 	PLIST_FORMAT_XML,
 	PLIST_FORMAT_BINARY
 };
 
 int plist_read_from_filename(plist_t *plist, const char *filename);
+int plist_read_key_from_filename(plist_t *value, const char *filename, const char *key);
 int plist_write_to_filename(plist_t plist, const char *filename, enum plist_format_t format);
 
 void plist_print_to_stream(plist_t plist, FILE* stream);
+/* writes a plist as JSON, data is base64 encoded and dates are ISO 8601 */
+void plist_print_json_to_stream(plist_t plist, FILE* stream);
 
 #endif
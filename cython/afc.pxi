@@ -1,4 +1,6 @@
-cdef extern from "libimobiledevice/afc.h":
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_SIMPLE, PyBUF_WRITABLE
+
+cdef extern from "libimobiledevice/afc.h" nogil:
     cdef struct afc_client_private:
         pass
     ctypedef afc_client_private *afc_client_t
@@ -61,7 +63,7 @@ cdef extern from "libimobiledevice/afc.h":
     afc_error_t afc_file_open(afc_client_t client, char *filename, afc_file_mode_t file_mode, uint64_t *handle)
     afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
     afc_error_t afc_file_lock(afc_client_t client, uint64_t handle, afc_lock_op_t operation)
-    afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
+    afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read) nogil
     afc_error_t afc_file_write(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_written)
     afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
     afc_error_t afc_file_tell(afc_client_t client, uint64_t handle, uint64_t *position)
@@ -71,6 +73,9 @@ LOCK_SH = AFC_LOCK_SH
 LOCK_EX = AFC_LOCK_EX
 LOCK_UN = AFC_LOCK_UN
 
+# default chunk size of AfcFile.chunks()
+DEFAULT_CHUNK_SIZE = 1024 * 1024
+
 cdef class AfcError(BaseError):
     def __init__(self, *args, **kwargs):
         self._lookup_table = {
@@ -123,29 +128,50 @@ cdef class AfcFile(Base):
         self.close()
 
     cpdef close(self):
-        self.handle_error(afc_file_close(self._client._c_client, self._c_handle))
+        cdef afc_error_t err
+        with nogil:
+            err = afc_file_close(self._client._c_client, self._c_handle)
+        self.handle_error(err)
 
     cpdef lock(self, int operation):
-        self.handle_error(afc_file_lock(self._client._c_client, self._c_handle, <afc_lock_op_t>operation))
+        cdef afc_error_t err
+        with nogil:
+            err = afc_file_lock(self._client._c_client, self._c_handle, <afc_lock_op_t>operation)
+        self.handle_error(err)
 
     cpdef seek(self, int64_t offset, int whence):
-        self.handle_error(afc_file_seek(self._client._c_client, self._c_handle, offset, whence))
+        cdef afc_error_t err
+        with nogil:
+            err = afc_file_seek(self._client._c_client, self._c_handle, offset, whence)
+        self.handle_error(err)
 
     cpdef uint64_t tell(self):
-        cdef uint64_t position
-        self.handle_error(afc_file_tell(self._client._c_client, self._c_handle, &position))
+        cdef:
+            uint64_t position
+            afc_error_t err
+        with nogil:
+            err = afc_file_tell(self._client._c_client, self._c_handle, &position)
+        self.handle_error(err)
         return position
 
     cpdef truncate(self, uint64_t newsize):
-        self.handle_error(afc_file_truncate(self._client._c_client, self._c_handle, newsize))
+        cdef afc_error_t err
+        with nogil:
+            err = afc_file_truncate(self._client._c_client, self._c_handle, newsize)
+        self.handle_error(err)
 
     cpdef bytes read(self, uint32_t size):
         cdef:
             uint32_t bytes_read
             char* c_data = <char *>malloc(size)
+            afc_client_t c_client = self._client._c_client
+            uint64_t c_handle = self._c_handle
+            afc_error_t err
             bytes result
         try:
-            self.handle_error(afc_file_read(self._client._c_client, self._c_handle, c_data, size, &bytes_read))
+            with nogil:
+                err = afc_file_read(c_client, c_handle, c_data, size, &bytes_read)
+            self.handle_error(err)
             result = c_data[:bytes_read]
             return result
         except BaseError, e:
@@ -153,14 +179,58 @@ cdef class AfcFile(Base):
         finally:
             free(c_data)
 
+    cpdef uint32_t readinto(self, object buffer):
+        """Reads directly into a writable buffer (bytearray, memoryview, ...)
+        and returns the number of bytes read, 0 at the end of the file."""
+        cdef:
+            Py_buffer view
+            uint32_t bytes_read = 0
+            uint32_t length
+            afc_client_t c_client = self._client._c_client
+            uint64_t c_handle = self._c_handle
+            afc_error_t err
+        PyObject_GetBuffer(buffer, &view, PyBUF_SIMPLE | PyBUF_WRITABLE)
+        try:
+            length = <uint32_t>view.len if view.len < 0xFFFFFFFF else 0xFFFFFFFF
+            with nogil:
+                err = afc_file_read(c_client, c_handle, <char *>view.buf, length, &bytes_read)
+            self.handle_error(err)
+        finally:
+            PyBuffer_Release(&view)
+        return bytes_read
+
+    def chunks(self, uint32_t chunk_size = DEFAULT_CHUNK_SIZE):
+        """Iterates over the rest of the file in chunks of up to chunk_size
+        bytes. The GIL is released while each chunk is read."""
+        cdef:
+            uint32_t bytes_read
+            char* c_data = <char *>malloc(chunk_size)
+            afc_client_t c_client = self._client._c_client
+            uint64_t c_handle = self._c_handle
+            afc_error_t err
+        if c_data == NULL:
+            raise MemoryError()
+        try:
+            while True:
+                bytes_read = 0
+                with nogil:
+                    err = afc_file_read(c_client, c_handle, c_data, chunk_size, &bytes_read)
+                self.handle_error(err)
+                if bytes_read == 0:
+                    break
+                yield c_data[:bytes_read]
+        finally:
+            free(c_data)
+
     cpdef uint32_t write(self, bytes data):
         cdef:
             uint32_t bytes_written
             char* c_data = data
-        try:
-            self.handle_error(afc_file_write(self._client._c_client, self._c_handle, c_data, len(data), &bytes_written))
-        except BaseError, e:
-            raise
+            uint32_t length = len(data)
+            afc_error_t err
+        with nogil:
+            err = afc_file_write(self._client._c_client, self._c_handle, c_data, length, &bytes_written)
+        self.handle_error(err)
 
         return bytes_written
 
@@ -172,13 +242,17 @@ cdef class AfcClient(BaseService):
     cdef afc_client_t _c_client
 
     def __cinit__(self, iDevice device = None, LockdownServiceDescriptor descriptor = None, *args, **kwargs):
+        cdef afc_error_t err
         if (device is not None and descriptor is not None):
-            self.handle_error(afc_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client)))
+            with nogil:
+                err = afc_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client))
+            self.handle_error(err)
     
     def __dealloc__(self):
         cdef afc_error_t err
         if self._c_client is not NULL:
-            err = afc_client_free(self._c_client)
+            with nogil:
+                err = afc_client_free(self._c_client)
             self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -191,7 +265,8 @@ cdef class AfcClient(BaseService):
             bytes info
             int i = 0
             list result = []
-        err = afc_get_device_info(self._c_client, &infos)
+        with nogil:
+            err = afc_get_device_info(self._c_client, &infos)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -214,7 +289,9 @@ cdef class AfcClient(BaseService):
             bytes f
             int i = 0
             list result = []
-        err = afc_read_directory(self._c_client, directory, &dir_list)
+            char* c_directory = directory
+        with nogil:
+            err = afc_read_directory(self._c_client, c_directory, &dir_list)
         try:
             self.handle_error(err)
         except BaseError, e:
@@ -235,6 +312,8 @@ cdef class AfcClient(BaseService):
             afc_file_mode_t c_mode
             uint64_t handle
             AfcFile f
+            char* c_filename = filename
+            afc_error_t err
         if mode == <bytes>'r':
             c_mode = AFC_FOPEN_RDONLY
         elif mode == <bytes>'r+':
@@ -250,7 +329,9 @@ cdef class AfcClient(BaseService):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = self
@@ -264,8 +345,12 @@ cdef class AfcClient(BaseService):
             char** c_result = NULL
             int i = 0
             bytes info
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_get_file_info(self._c_client, c_path, &c_result)
         try:
-            self.handle_error(afc_get_file_info(self._c_client, path, &c_result))
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -280,25 +365,63 @@ cdef class AfcClient(BaseService):
         return result
 
     cpdef remove_path(self, bytes path):
-        self.handle_error(afc_remove_path(self._c_client, path))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_remove_path(self._c_client, c_path)
+        self.handle_error(err)
 
     cpdef rename_path(self, bytes f, bytes t):
-        self.handle_error(afc_rename_path(self._c_client, f, t))
+        cdef:
+            char* c_f = f
+            char* c_t = t
+            afc_error_t err
+        with nogil:
+            err = afc_rename_path(self._c_client, c_f, c_t)
+        self.handle_error(err)
 
     cpdef make_directory(self, bytes d):
-        self.handle_error(afc_make_directory(self._c_client, d))
+        cdef:
+            char* c_d = d
+            afc_error_t err
+        with nogil:
+            err = afc_make_directory(self._c_client, c_d)
+        self.handle_error(err)
 
     cpdef truncate(self, bytes path, uint64_t newsize):
-        self.handle_error(afc_truncate(self._c_client, path, newsize))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_truncate(self._c_client, c_path, newsize)
+        self.handle_error(err)
 
     cpdef link(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_HARDLINK, source, link_name))
+        cdef:
+            char* c_source = source
+            char* c_link_name = link_name
+            afc_error_t err
+        with nogil:
+            err = afc_make_link(self._c_client, AFC_HARDLINK, c_source, c_link_name)
+        self.handle_error(err)
 
     cpdef symlink(self, bytes source, bytes link_name):
-        self.handle_error(afc_make_link(self._c_client, AFC_SYMLINK, source, link_name))
+        cdef:
+            char* c_source = source
+            char* c_link_name = link_name
+            afc_error_t err
+        with nogil:
+            err = afc_make_link(self._c_client, AFC_SYMLINK, c_source, c_link_name)
+        self.handle_error(err)
 
     cpdef set_file_time(self, bytes path, uint64_t mtime):
-        self.handle_error(afc_set_file_time(self._c_client, path, mtime))
+        cdef:
+            char* c_path = path
+            afc_error_t err
+        with nogil:
+            err = afc_set_file_time(self._c_client, c_path, mtime)
+        self.handle_error(err)
 
 cdef class Afc2Client(AfcClient):
     __service_name__ = "com.apple.afc2"
@@ -308,6 +431,8 @@ cdef class Afc2Client(AfcClient):
             afc_file_mode_t c_mode
             uint64_t handle
             AfcFile f
+            char* c_filename = filename
+            afc_error_t err
         if mode == <bytes>'r':
             c_mode = AFC_FOPEN_RDONLY
         elif mode == <bytes>'r+':
@@ -323,7 +448,9 @@ cdef class Afc2Client(AfcClient):
         else:
             raise ValueError("mode string must be 'r', 'r+', 'w', 'w+', 'a', or 'a+'")
 
-        self.handle_error(afc_file_open(self._c_client, filename, c_mode, &handle))
+        with nogil:
+            err = afc_file_open(self._c_client, c_filename, c_mode, &handle)
+        self.handle_error(err)
         f = AfcFile.__new__(AfcFile)
         f._c_handle = handle
         f._client = <AfcClient>self
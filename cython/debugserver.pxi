@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/debugserver.h":
+cdef extern from "libimobiledevice/debugserver.h" nogil:
     cdef struct debugserver_client_private:
         pass
     ctypedef debugserver_client_private *debugserver_client_t
@@ -59,11 +59,14 @@ cdef class DebugServerCommand(Base):
 
     def __init__(self, bytes name, int argc = 0, argv = None, *args, **kwargs):
         cdef:
+            debugserver_error_t err
             char* c_name = name
             char** c_argv = to_cstring_array(argv)
 
         try:
-            self.handle_error(debugserver_command_new(c_name, argc, c_argv, &self._c_command))
+            with nogil:
+                err = debugserver_command_new(c_name, argc, c_argv, &self._c_command)
+            self.handle_error(err)
         except BaseError, e:
             raise
         finally:
@@ -78,7 +81,8 @@ cdef class DebugServerCommand(Base):
     cdef free(self):
         cdef debugserver_error_t err
         if self._c_command is not NULL:
-            err = debugserver_command_free(self._c_command)
+            with nogil:
+                err = debugserver_command_free(self._c_command)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
@@ -90,13 +94,17 @@ cdef class DebugServerClient(BaseService):
     cdef debugserver_client_t _c_client
 
     def __cinit__(self, iDevice device = None, LockdownServiceDescriptor descriptor = None, *args, **kwargs):
+        cdef debugserver_error_t err
         if (device is not None and descriptor is not None):
-            self.handle_error(debugserver_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client)))
+            with nogil:
+                err = debugserver_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client))
+            self.handle_error(err)
     
     def __dealloc__(self):
         cdef debugserver_error_t err
         if self._c_client is not NULL:
-            err = debugserver_client_free(self._c_client)
+            with nogil:
+                err = debugserver_client_free(self._c_client)
             self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -104,10 +112,14 @@ cdef class DebugServerClient(BaseService):
 
     cpdef uint32_t send(self, bytes data):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_send
             char* c_data = data
+            uint32_t c_length = len(data)
         try:
-            self.handle_error(debugserver_client_send(self._c_client, c_data, len(data), &bytes_send))
+            with nogil:
+                err = debugserver_client_send(self._c_client, c_data, c_length, &bytes_send)
+            self.handle_error(err)
         except BaseError, e:
             raise
 
@@ -115,11 +127,14 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes send_command(self, DebugServerCommand command):
         cdef:
+            debugserver_error_t err
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_send_command(self._c_client, command._c_command, &c_response, NULL))
+            with nogil:
+                err = debugserver_client_send_command(self._c_client, command._c_command, &c_response, NULL)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -132,12 +147,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive(self, uint32_t size):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_received
             char* c_data = <char *>malloc(size)
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive(self._c_client, c_data, size, &bytes_received))
+            with nogil:
+                err = debugserver_client_receive(self._c_client, c_data, size, &bytes_received)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -147,12 +165,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive_with_timeout(self, uint32_t size, unsigned int timeout):
         cdef:
+            debugserver_error_t err
             uint32_t bytes_received
             char* c_data = <char *>malloc(size)
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive_with_timeout(self._c_client, c_data, size, &bytes_received, timeout))
+            with nogil:
+                err = debugserver_client_receive_with_timeout(self._c_client, c_data, size, &bytes_received, timeout)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -162,11 +183,14 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes receive_response(self):
         cdef:
+            debugserver_error_t err
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_receive_response(self._c_client, &c_response, NULL))
+            with nogil:
+                err = debugserver_client_receive_response(self._c_client, &c_response, NULL)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -179,12 +203,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes set_argv(self, int argc, argv):
         cdef:
+            debugserver_error_t err
             char** c_argv = to_cstring_array(argv)
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_set_argv(self._c_client, argc, c_argv, &c_response))
+            with nogil:
+                err = debugserver_client_set_argv(self._c_client, argc, c_argv, &c_response)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -198,12 +225,15 @@ cdef class DebugServerClient(BaseService):
 
     cpdef bytes set_environment_hex_encoded(self, bytes env):
         cdef:
+            debugserver_error_t err
             char* c_env = env
             char* c_response = NULL
             bytes result
 
         try:
-            self.handle_error(debugserver_client_set_environment_hex_encoded(self._c_client, c_env, &c_response))
+            with nogil:
+                err = debugserver_client_set_environment_hex_encoded(self._c_client, c_env, &c_response)
+            self.handle_error(err)
             if c_response:
                 result = c_response
                 return result
@@ -3,7 +3,7 @@ REQUEST_TYPE_WIFI = "WiFi"
 REQUEST_TYPE_GAS_GAUGE = "GasGauge"
 REQUEST_TYPE_NAND = "NAND"
 
-cdef extern from "libimobiledevice/diagnostics_relay.h":
+cdef extern from "libimobiledevice/diagnostics_relay.h" nogil:
     cdef struct diagnostics_relay_client_private:
         pass
     ctypedef diagnostics_relay_client_private *diagnostics_relay_client_t
@@ -49,34 +49,52 @@ cdef class DiagnosticsRelayClient(PropertyListService):
     cdef diagnostics_relay_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(diagnostics_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef diagnostics_relay_error_t err
+        with nogil:
+            err = diagnostics_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef diagnostics_relay_error_t err
         if self._c_client is not NULL:
-            err = diagnostics_relay_client_free(self._c_client)
+            with nogil:
+                err = diagnostics_relay_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return DiagnosticsRelayError(ret)
 
     cpdef goodbye(self):
-        self.handle_error(diagnostics_relay_goodbye(self._c_client))
+        cdef diagnostics_relay_error_t err
+        with nogil:
+            err = diagnostics_relay_goodbye(self._c_client)
+        self.handle_error(err)
 
     cpdef sleep(self):
-        self.handle_error(diagnostics_relay_sleep(self._c_client))
+        cdef diagnostics_relay_error_t err
+        with nogil:
+            err = diagnostics_relay_sleep(self._c_client)
+        self.handle_error(err)
 
     cpdef restart(self, diagnostics_relay_action_t flags):
-        self.handle_error(diagnostics_relay_restart(self._c_client, flags))
+        cdef diagnostics_relay_error_t err
+        with nogil:
+            err = diagnostics_relay_restart(self._c_client, flags)
+        self.handle_error(err)
 
     cpdef shutdown(self, diagnostics_relay_action_t flags):
-        self.handle_error(diagnostics_relay_shutdown(self._c_client, flags))
+        cdef diagnostics_relay_error_t err
+        with nogil:
+            err = diagnostics_relay_shutdown(self._c_client, flags)
+        self.handle_error(err)
 
     cpdef plist.Node request_diagnostics(self, bytes type):
         cdef:
             plist.plist_t c_node = NULL
             diagnostics_relay_error_t err
-        err = diagnostics_relay_request_diagnostics(self._c_client, type, &c_node)
+            char* c_type = type
+        with nogil:
+            err = diagnostics_relay_request_diagnostics(self._c_client, c_type, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -92,7 +110,8 @@ cdef class DiagnosticsRelayClient(PropertyListService):
             plist.plist_t keys_c_node = NULL
         if keys is not None:
             keys_c_node = keys._c_node
-        err = diagnostics_relay_query_mobilegestalt(self._c_client, keys_c_node, &c_node)
+        with nogil:
+            err = diagnostics_relay_query_mobilegestalt(self._c_client, keys_c_node, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -105,7 +124,10 @@ cdef class DiagnosticsRelayClient(PropertyListService):
         cdef:
             plist.plist_t c_node = NULL
             diagnostics_relay_error_t err
-        err = diagnostics_relay_query_ioregistry_entry(self._c_client, name, class_name, &c_node)
+            char* c_name = name
+            char* c_class_name = class_name
+        with nogil:
+            err = diagnostics_relay_query_ioregistry_entry(self._c_client, c_name, c_class_name, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -118,7 +140,11 @@ cdef class DiagnosticsRelayClient(PropertyListService):
         cdef:
             plist.plist_t c_node = NULL
             diagnostics_relay_error_t err
-        err = diagnostics_relay_query_ioregistry_plane(self._c_client, plane, &c_node)
+            char* c_plane = NULL
+        if plane is not None:
+            c_plane = plane
+        with nogil:
+            err = diagnostics_relay_query_ioregistry_plane(self._c_client, c_plane, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
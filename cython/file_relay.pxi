@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/file_relay.h":
+cdef extern from "libimobiledevice/file_relay.h" nogil:
     cdef struct file_relay_client_private:
         pass
     ctypedef file_relay_client_private *file_relay_client_t
@@ -40,12 +40,16 @@ cdef class FileRelayClient(PropertyListService):
     cdef file_relay_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(file_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef file_relay_error_t err
+        with nogil:
+            err = file_relay_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef file_relay_error_t err
         if self._c_client is not NULL:
-            err = file_relay_client_free(self._c_client)
+            with nogil:
+                err = file_relay_client_free(self._c_client)
             self.handle_error(err)
 
     cpdef iDeviceConnection request_sources(self, list sources):
@@ -59,7 +63,8 @@ cdef class FileRelayClient(PropertyListService):
             c_sources[i] = value
         c_sources[count] = NULL
 
-        err = file_relay_request_sources(self._c_client, <const_sources_t>c_sources, &conn._c_connection)
+        with nogil:
+            err = file_relay_request_sources(self._c_client, <const_sources_t>c_sources, &conn._c_connection)
         free(c_sources)
         self.handle_error(err)
         return conn
@@ -16,7 +16,7 @@ cdef class Base:
 
 cdef class iDeviceError(BaseError): pass
 
-cdef extern from "libimobiledevice/libimobiledevice.h":
+cdef extern from "libimobiledevice/libimobiledevice.h" nogil:
     cdef struct idevice_private:
         pass
     ctypedef idevice_private* idevice_t
@@ -62,7 +62,7 @@ cdef class PropertyListService(BaseService):
     cdef int16_t _receive(self, plist.plist_t* c_node)
     cdef int16_t _receive_with_timeout(self, plist.plist_t* c_node, int timeout_ms)
 
-cdef extern from "libimobiledevice/lockdown.h":
+cdef extern from "libimobiledevice/lockdown.h" nogil:
     cdef struct lockdownd_client_private:
         pass
     ctypedef lockdownd_client_private *lockdownd_client_t
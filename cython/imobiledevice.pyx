@@ -31,7 +31,7 @@ cdef class Base:
 
     cdef BaseError _error(self, int16_t ret): pass
 
-cdef extern from "libimobiledevice/libimobiledevice.h":
+cdef extern from "libimobiledevice/libimobiledevice.h" nogil:
     ctypedef enum idevice_error_t:
         IDEVICE_E_SUCCESS = 0
         IDEVICE_E_INVALID_ARG = -1
@@ -113,8 +113,12 @@ def get_device_list():
         int count
         list result
         bytes device
-        iDeviceError err = iDeviceError(idevice_get_device_list(&devices, &count))
+        idevice_error_t ret
+        iDeviceError err
 
+    with nogil:
+        ret = idevice_get_device_list(&devices, &count)
+    err = iDeviceError(ret)
     if err:
         if devices != NULL:
             idevice_device_list_free(devices)
@@ -138,9 +142,12 @@ cdef class iDeviceConnection(Base):
             uint32_t bytes_received
             char* c_data = <char *>malloc(max_len)
             bytes result
+            idevice_error_t err
 
         try:
-            self.handle_error(idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout))
+            with nogil:
+                err = idevice_connection_receive_timeout(self._c_connection, c_data, max_len, &bytes_received, timeout)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -151,11 +158,15 @@ cdef class iDeviceConnection(Base):
     cpdef bytes receive(self, max_len):
         cdef:
             uint32_t bytes_received
-            char* c_data = <char *>malloc(max_len)
+            uint32_t c_max_len = max_len
+            char* c_data = <char *>malloc(c_max_len)
             bytes result
+            idevice_error_t err
 
         try:
-            self.handle_error(idevice_connection_receive(self._c_connection, c_data, max_len, &bytes_received))
+            with nogil:
+                err = idevice_connection_receive(self._c_connection, c_data, c_max_len, &bytes_received)
+            self.handle_error(err)
             result = c_data[:bytes_received]
             return result
         except BaseError, e:
@@ -165,7 +176,8 @@ cdef class iDeviceConnection(Base):
 
     cpdef disconnect(self):
         cdef idevice_error_t err
-        err = idevice_disconnect(self._c_connection)
+        with nogil:
+            err = idevice_disconnect(self._c_connection)
         self.handle_error(err)
 
     cdef BaseError _error(self, int16_t ret):
@@ -175,12 +187,16 @@ from libc.stdlib cimport *
 
 cdef class iDevice(Base):
     def __cinit__(self, object udid=None, *args, **kwargs):
-        cdef char* c_udid = NULL
+        cdef:
+            char* c_udid = NULL
+            idevice_error_t err
         if isinstance(udid, basestring):
             c_udid = <bytes>udid
         elif udid is not None:
             raise TypeError("iDevice's constructor takes a string or None as the udid argument")
-        self.handle_error(idevice_new(&self._c_dev, c_udid))
+        with nogil:
+            err = idevice_new(&self._c_dev, c_udid)
+        self.handle_error(err)
 
     def __dealloc__(self):
         if self._c_dev is not NULL:
@@ -194,7 +210,8 @@ cdef class iDevice(Base):
             idevice_error_t err
             idevice_connection_t c_conn = NULL
             iDeviceConnection conn
-        err = idevice_connect(self._c_dev, port, &c_conn)
+        with nogil:
+            err = idevice_connect(self._c_dev, port, &c_conn)
         try:
             self.handle_error(err)
 
@@ -274,6 +291,18 @@ cdef class PropertyListService(BaseService):
 cdef class DeviceLinkService(PropertyListService):
     pass
 
+def run_async(func, *args):
+    """Run a blocking call of these bindings in the default executor of the
+    current asyncio event loop and return an awaitable for its result.
+
+    The wrappers release the GIL while the library blocks on the device, so
+    calls on different clients progress in parallel, e.g.:
+
+        info = await imobiledevice.run_async(client.get_value)
+    """
+    import asyncio
+    return asyncio.get_event_loop().run_in_executor(None, func, *args)
+
 include "lockdown.pxi"
 include "mobilesync.pxi"
 include "notification_proxy.pxi"
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/installation_proxy.h":
+cdef extern from "libimobiledevice/installation_proxy.h" nogil:
     cdef struct instproxy_client_private:
         pass
     ctypedef instproxy_client_private *instproxy_client_t
@@ -51,23 +51,28 @@ cdef class InstallationProxyClient(PropertyListService):
         cdef:
             iDevice dev = device
             instproxy_error_t err
-        err = instproxy_client_new(dev._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        with nogil:
+            err = instproxy_client_new(dev._c_dev, descriptor._c_service_descriptor, &self._c_client)
         self.handle_error(err)
 
     def __dealloc__(self):
         cdef instproxy_error_t err
         if self._c_client is not NULL:
-            err = instproxy_client_free(self._c_client)
+            with nogil:
+                err = instproxy_client_free(self._c_client)
             self.handle_error(err)
 
     cpdef get_path_for_bundle_identifier(self, bytes bundle_id):
         cdef:
+            instproxy_error_t err
             char* c_bundle_id = bundle_id
             char* c_path = NULL
             bytes result
 
         try:
-            self.handle_error(instproxy_client_get_path_for_bundle_identifier(self._c_client, c_bundle_id, &c_path))
+            with nogil:
+                err = instproxy_client_get_path_for_bundle_identifier(self._c_client, c_bundle_id, &c_path)
+            self.handle_error(err)
             if c_path != NULL:
                 result = c_path
                 return result
@@ -93,7 +98,8 @@ cdef class InstallationProxyClient(PropertyListService):
             free_options = True
         else:
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
-        err = instproxy_browse(self._c_client, c_options, &c_result)
+        with nogil:
+            err = instproxy_browse(self._c_client, c_options, &c_result)
 
         try:
             self.handle_error(err)
@@ -112,6 +118,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             bint free_options = False
             instproxy_error_t err
+            char* c_pkg_path = pkg_path
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -121,9 +129,11 @@ cdef class InstallationProxyClient(PropertyListService):
         else:
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
         if callback is None:
-            err = instproxy_install(self._c_client, pkg_path, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_install(self._c_client, c_pkg_path, c_options, NULL, NULL)
         else:
-            err = instproxy_install(self._c_client, pkg_path, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_install(self._c_client, c_pkg_path, c_options, instproxy_notify_cb, c_callback)
 
         try:
             self.handle_error(err)
@@ -139,6 +149,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             bint free_options = False
             instproxy_error_t err
+            char* c_pkg_path = pkg_path
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -148,9 +160,11 @@ cdef class InstallationProxyClient(PropertyListService):
         else:
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
         if callback is None:
-            err = instproxy_upgrade(self._c_client, pkg_path, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_upgrade(self._c_client, c_pkg_path, c_options, NULL, NULL)
         else:
-            err = instproxy_upgrade(self._c_client, pkg_path, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_upgrade(self._c_client, c_pkg_path, c_options, instproxy_notify_cb, c_callback)
         try:
             self.handle_error(err)
         except Exception, e:
@@ -165,6 +179,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             instproxy_error_t err
             bint free_options = False
+            char* c_appid = appid
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -175,9 +191,11 @@ cdef class InstallationProxyClient(PropertyListService):
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
 
         if callback is None:
-            err = instproxy_uninstall(self._c_client, appid, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_uninstall(self._c_client, c_appid, c_options, NULL, NULL)
         else:
-            err = instproxy_uninstall(self._c_client, appid, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_uninstall(self._c_client, c_appid, c_options, instproxy_notify_cb, c_callback)
 
         try:
             self.handle_error(err)
@@ -203,7 +221,8 @@ cdef class InstallationProxyClient(PropertyListService):
         else:
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
 
-        err = instproxy_lookup_archives(self._c_client, c_options, &c_node)
+        with nogil:
+            err = instproxy_lookup_archives(self._c_client, c_options, &c_node)
 
         try:
             self.handle_error(err)
@@ -222,6 +241,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             bint free_options = False
             instproxy_error_t err
+            char* c_appid = appid
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -232,9 +253,11 @@ cdef class InstallationProxyClient(PropertyListService):
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
 
         if callback is None:
-            err = instproxy_archive(self._c_client, appid, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_archive(self._c_client, c_appid, c_options, NULL, NULL)
         else:
-            err = instproxy_archive(self._c_client, appid, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_archive(self._c_client, c_appid, c_options, instproxy_notify_cb, c_callback)
 
         try:
             self.handle_error(err)
@@ -250,6 +273,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             bint free_options = False
             instproxy_error_t err
+            char* c_appid = appid
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -260,9 +285,11 @@ cdef class InstallationProxyClient(PropertyListService):
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
 
         if callback is None:
-            err = instproxy_restore(self._c_client, appid, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_restore(self._c_client, c_appid, c_options, NULL, NULL)
         else:
-            err = instproxy_restore(self._c_client, appid, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_restore(self._c_client, c_appid, c_options, instproxy_notify_cb, c_callback)
 
         try:
             self.handle_error(err)
@@ -278,6 +305,8 @@ cdef class InstallationProxyClient(PropertyListService):
             plist.plist_t c_options
             bint free_options = False
             instproxy_error_t err
+            char* c_appid = appid
+            void* c_callback = <void*>callback
         if isinstance(client_options, plist.Dict):
             options = client_options
             c_options = options._c_node
@@ -288,9 +317,11 @@ cdef class InstallationProxyClient(PropertyListService):
             raise InstallationProxyError(INSTPROXY_E_INVALID_ARG)
 
         if callback is None:
-            err = instproxy_remove_archive(self._c_client, appid, c_options, NULL, NULL)
+            with nogil:
+                err = instproxy_remove_archive(self._c_client, c_appid, c_options, NULL, NULL)
         else:
-            err = instproxy_remove_archive(self._c_client, appid, c_options, instproxy_notify_cb, <void*>callback)
+            with nogil:
+                err = instproxy_remove_archive(self._c_client, c_appid, c_options, instproxy_notify_cb, c_callback)
 
         try:
             self.handle_error(err)
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/mobilesync.h":
+cdef extern from "libimobiledevice/mobilesync.h" nogil:
     cdef struct mobilesync_client_private:
         pass
     ctypedef mobilesync_client_private *mobilesync_client_t
@@ -78,12 +78,16 @@ cdef class MobileSyncClient(DeviceLinkService):
     cdef mobilesync_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(mobilesync_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client)))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_client_new(device._c_dev, descriptor._c_service_descriptor, &(self._c_client))
+        self.handle_error(err)
     
     def __dealloc__(self):
         cdef mobilesync_error_t err
         if self._c_client is not NULL:
-            err = mobilesync_client_free(self._c_client)
+            with nogil:
+                err = mobilesync_client_free(self._c_client)
             self.handle_error(err)
 
     cpdef tuple start(self, bytes data_class, bytes device_anchor, bytes host_anchor):
@@ -93,6 +97,8 @@ cdef class MobileSyncClient(DeviceLinkService):
             uint64_t computer_data_class_version = 1
             uint64_t device_data_class_version
             char* error_description = NULL
+            char* c_data_class = data_class
+            mobilesync_error_t err
 
         if device_anchor is None:
             anchors = mobilesync_anchors_new(NULL, host_anchor)
@@ -100,7 +106,9 @@ cdef class MobileSyncClient(DeviceLinkService):
             anchors = mobilesync_anchors_new(device_anchor, host_anchor)
 
         try:
-            self.handle_error(mobilesync_start(self._c_client, data_class, anchors, computer_data_class_version, &sync_type, &device_data_class_version, &error_description))
+            with nogil:
+                err = mobilesync_start(self._c_client, c_data_class, anchors, computer_data_class_version, &sync_type, &device_data_class_version, &error_description)
+            self.handle_error(err)
             return (sync_type, <bint>computer_data_class_version, <bint>device_data_class_version, <bytes>error_description)
         except Exception, e:
             raise
@@ -108,24 +116,41 @@ cdef class MobileSyncClient(DeviceLinkService):
             mobilesync_anchors_free(anchors)
 
     cpdef finish(self):
-        self.handle_error(mobilesync_finish(self._c_client))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_finish(self._c_client)
+        self.handle_error(err)
 
     cpdef cancel(self, bytes reason):
-        self.handle_error(mobilesync_cancel(self._c_client, reason))
+        cdef:
+            mobilesync_error_t err
+            char* c_reason = reason
+        with nogil:
+            err = mobilesync_cancel(self._c_client, c_reason)
+        self.handle_error(err)
 
     cpdef get_all_records_from_device(self):
-        self.handle_error(mobilesync_get_all_records_from_device(self._c_client))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_get_all_records_from_device(self._c_client)
+        self.handle_error(err)
 
     cpdef get_changes_from_device(self):
-        self.handle_error(mobilesync_get_changes_from_device(self._c_client))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_get_changes_from_device(self._c_client)
+        self.handle_error(err)
 
     cpdef tuple receive_changes(self):
         cdef:
+            mobilesync_error_t err
             plist.plist_t entities = NULL
             uint8_t is_last_record = 0
             plist.plist_t actions = NULL
         try:
-            self.handle_error(mobilesync_receive_changes(self._c_client, &entities, &is_last_record, &actions))
+            with nogil:
+                err = mobilesync_receive_changes(self._c_client, &entities, &is_last_record, &actions)
+            self.handle_error(err)
             return (plist.plist_t_to_node(entities), <bint>is_last_record, plist.plist_t_to_node(actions))
         except Exception, e:
             if entities != NULL:
@@ -135,19 +160,31 @@ cdef class MobileSyncClient(DeviceLinkService):
             raise
 
     cpdef acknowledge_changes_from_device(self):
-        self.handle_error(mobilesync_acknowledge_changes_from_device(self._c_client))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_acknowledge_changes_from_device(self._c_client)
+        self.handle_error(err)
 
     cpdef ready_to_send_changes_from_computer(self):
-        self.handle_error(mobilesync_ready_to_send_changes_from_computer(self._c_client))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_ready_to_send_changes_from_computer(self._c_client)
+        self.handle_error(err)
 
     cpdef send_changes(self, plist.Node changes, bint is_last_record, plist.Node actions):
-        self.handle_error(mobilesync_send_changes(self._c_client, changes._c_node, is_last_record, actions._c_node))
+        cdef mobilesync_error_t err
+        with nogil:
+            err = mobilesync_send_changes(self._c_client, changes._c_node, is_last_record, actions._c_node)
+        self.handle_error(err)
 
     cpdef remap_identifiers(self):
+        cdef mobilesync_error_t err
         cdef plist.plist_t remapping = NULL
 
         try:
-            self.handle_error(mobilesync_remap_identifiers(self._c_client, &remapping))
+            with nogil:
+                err = mobilesync_remap_identifiers(self._c_client, &remapping)
+            self.handle_error(err)
             return plist.plist_t_to_node(remapping)
         except Exception, e:
             if remapping != NULL:
@@ -155,10 +192,16 @@ cdef class MobileSyncClient(DeviceLinkService):
             raise
     
     cdef int16_t _send(self, plist.plist_t node):
-        return mobilesync_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilesync_send(self._c_client, node)
+        return err
 
     cdef int16_t _receive(self, plist.plist_t* node):
-        return mobilesync_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = mobilesync_receive(self._c_client, node)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return MobileSyncError(ret)
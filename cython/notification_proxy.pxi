@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/notification_proxy.h":
+cdef extern from "libimobiledevice/notification_proxy.h" nogil:
     cdef struct np_client_private:
         pass
     ctypedef np_client_private *np_client_t
@@ -70,7 +70,7 @@ NP_ITDBPREP_DID_END = C_NP_ITDBPREP_DID_END
 NP_LANGUAGE_CHANGED = C_NP_LANGUAGE_CHANGED
 NP_ADDRESS_BOOK_PREF_CHANGED = C_NP_ADDRESS_BOOK_PREF_CHANGED
 
-cdef void np_notify_cb(const_char_ptr notification, void *py_callback):
+cdef void np_notify_cb(const_char_ptr notification, void *py_callback) with gil:
     (<object>py_callback)(notification)
 
 cdef class NotificationProxyError(BaseError):
@@ -89,22 +89,41 @@ cdef class NotificationProxyClient(PropertyListService):
     cdef np_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(np_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef np_error_t err
+        with nogil:
+            err = np_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef np_error_t err
         if self._c_client is not NULL:
-            err = np_client_free(self._c_client)
+            with nogil:
+                err = np_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return NotificationProxyError(ret)
 
     cpdef set_notify_callback(self, object callback):
-        self.handle_error(np_set_notify_callback(self._c_client, np_notify_cb, <void*>callback))
+        cdef:
+            np_error_t err
+            void* c_callback = <void*>callback
+        with nogil:
+            err = np_set_notify_callback(self._c_client, np_notify_cb, c_callback)
+        self.handle_error(err)
 
     cpdef observe_notification(self, bytes notification):
-        self.handle_error(np_observe_notification(self._c_client, notification))
+        cdef:
+            np_error_t err
+            char* c_notification = notification
+        with nogil:
+            err = np_observe_notification(self._c_client, c_notification)
+        self.handle_error(err)
 
     cpdef post_notification(self, bytes notification):
-        self.handle_error(np_post_notification(self._c_client, notification))
+        cdef:
+            np_error_t err
+            char* c_notification = notification
+        with nogil:
+            err = np_post_notification(self._c_client, c_notification)
+        self.handle_error(err)
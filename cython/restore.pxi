@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/restore.h":
+cdef extern from "libimobiledevice/restore.h" nogil:
     cdef struct restored_client_private:
         pass
     ctypedef restored_client_private *restored_client_t
@@ -49,7 +49,8 @@ cdef class RestoreClient(PropertyListService):
             char* c_label = NULL
         if label:
             c_label = label
-        err = restored_client_new(device._c_dev, &self._c_client, c_label)
+        with nogil:
+            err = restored_client_new(device._c_dev, &self._c_client, c_label)
         self.handle_error(err)
 
         self.device = device
@@ -57,17 +58,24 @@ cdef class RestoreClient(PropertyListService):
     def __dealloc__(self):
         cdef restored_error_t err
         if self._c_client is not NULL:
-            err = restored_client_free(self._c_client)
+            with nogil:
+                err = restored_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline BaseError _error(self, int16_t ret):
         return RestoreError(ret)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return restored_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = restored_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return restored_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = restored_receive(self._c_client, node)
+        return err
 
     cpdef tuple query_type(self):
         cdef:
@@ -75,7 +83,8 @@ cdef class RestoreClient(PropertyListService):
             char* c_type = NULL
             uint64_t c_version = 0
             tuple result
-        err = restored_query_type(self._c_client, &c_type, &c_version)
+        with nogil:
+            err = restored_query_type(self._c_client, &c_type, &c_version)
         try:
             self.handle_error(err)
             result = (c_type, c_version)
@@ -93,7 +102,8 @@ cdef class RestoreClient(PropertyListService):
             char* c_key = NULL
         if key is not None:
             c_key = key
-        err = restored_query_value(self._c_client, c_key, &c_node)
+        with nogil:
+            err = restored_query_value(self._c_client, c_key, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -109,7 +119,8 @@ cdef class RestoreClient(PropertyListService):
             char* c_key = NULL
         if key is not None:
             c_key = key
-        err = restored_get_value(self._c_client, c_key, &c_node)
+        with nogil:
+            err = restored_get_value(self._c_client, c_key, &c_node)
         try:
             self.handle_error(err)
             return plist.plist_t_to_node(c_node)
@@ -119,13 +130,22 @@ cdef class RestoreClient(PropertyListService):
             raise
 
     cpdef goodbye(self):
-        self.handle_error(restored_goodbye(self._c_client))
+        cdef restored_error_t err
+        with nogil:
+            err = restored_goodbye(self._c_client)
+        self.handle_error(err)
 
     cpdef start_restore(self, plist.Node options, uint64_t version):
-        self.handle_error(restored_start_restore(self._c_client, options._c_node, version))
+        cdef restored_error_t err
+        with nogil:
+            err = restored_start_restore(self._c_client, options._c_node, version)
+        self.handle_error(err)
 
     cpdef reboot(self):
-        self.handle_error(restored_reboot(self._c_client))
+        cdef restored_error_t err
+        with nogil:
+            err = restored_reboot(self._c_client)
+        self.handle_error(err)
 
     cpdef set_label(self, bytes label):
         restored_client_set_label(self._c_client, label)
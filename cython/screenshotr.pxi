@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/screenshotr.h":
+cdef extern from "libimobiledevice/screenshotr.h" nogil:
     cdef struct screenshotr_client_private:
         pass
     ctypedef screenshotr_client_private *screenshotr_client_t
@@ -11,6 +11,7 @@ cdef extern from "libimobiledevice/screenshotr.h":
         SCREENSHOTR_E_SSL_ERROR = -4
         SCREENSHOTR_E_RECEIVE_TIMEOUT = 5
         SCREENSHOTR_E_BAD_VERSION = -6
+        SCREENSHOTR_E_IMAGE_ERROR = -7
         SCREENSHOTR_E_UNKNOWN_ERROR = -256
 
     screenshotr_error_t screenshotr_client_new(idevice_t device, lockdownd_service_descriptor_t descriptor, screenshotr_client_t * client)
@@ -27,6 +28,7 @@ cdef class ScreenshotrError(BaseError):
             SCREENSHOTR_E_SSL_ERROR: "SSL error",
             SCREENSHOTR_E_RECEIVE_TIMEOUT: "Receive timeout",
             SCREENSHOTR_E_BAD_VERSION: "Bad version",
+            SCREENSHOTR_E_IMAGE_ERROR: "Image error",
             SCREENSHOTR_E_UNKNOWN_ERROR: "Unknown error"
         }
         BaseError.__init__(self, *args, **kwargs)
@@ -36,12 +38,16 @@ cdef class ScreenshotrClient(DeviceLinkService):
     cdef screenshotr_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(screenshotr_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef screenshotr_error_t err
+        with nogil:
+            err = screenshotr_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef screenshotr_error_t err
         if self._c_client is not NULL:
-            err = screenshotr_client_free(self._c_client)
+            with nogil:
+                err = screenshotr_client_free(self._c_client)
             self.handle_error(err)
 
     cpdef bytes take_screenshot(self):
@@ -51,7 +57,8 @@ cdef class ScreenshotrClient(DeviceLinkService):
             bytes result
             screenshotr_error_t err
 
-        err = screenshotr_take_screenshot(self._c_client, &c_data, &data_size)
+        with nogil:
+            err = screenshotr_take_screenshot(self._c_client, &c_data, &data_size)
         try:
             self.handle_error(err)
 
@@ -1,4 +1,4 @@
-cdef extern from "libimobiledevice/webinspector.h":
+cdef extern from "libimobiledevice/webinspector.h" nogil:
     cdef struct webinspector_client_private:
         pass
     ctypedef webinspector_client_private *webinspector_client_t
@@ -39,22 +39,35 @@ cdef class WebinspectorClient(PropertyListService):
     cdef webinspector_client_t _c_client
 
     def __cinit__(self, iDevice device not None, LockdownServiceDescriptor descriptor, *args, **kwargs):
-        self.handle_error(webinspector_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client))
+        cdef webinspector_error_t err
+        with nogil:
+            err = webinspector_client_new(device._c_dev, descriptor._c_service_descriptor, &self._c_client)
+        self.handle_error(err)
 
     def __dealloc__(self):
         cdef webinspector_error_t err
         if self._c_client is not NULL:
-            err = webinspector_client_free(self._c_client)
+            with nogil:
+                err = webinspector_client_free(self._c_client)
             self.handle_error(err)
 
     cdef inline int16_t _send(self, plist.plist_t node):
-        return webinspector_send(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_send(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive(self, plist.plist_t* node):
-        return webinspector_receive(self._c_client, node)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_receive(self._c_client, node)
+        return err
 
     cdef inline int16_t _receive_with_timeout(self, plist.plist_t* node, int timeout_ms):
-        return webinspector_receive_with_timeout(self._c_client, node, timeout_ms)
+        cdef int16_t err
+        with nogil:
+            err = webinspector_receive_with_timeout(self._c_client, node, timeout_ms)
+        return err
 
     cdef inline BaseError _error(self, int16_t ret):
         return WebinspectorError(ret)
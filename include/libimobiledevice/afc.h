@@ -93,9 +93,76 @@ typedef enum {
 	AFC_LOCK_UN = 8 | 4  /**< unlock */
 } afc_lock_op_t;
 
+/** File types as reported in the st_ifmt file information key */
+typedef enum {
+	AFC_FILE_TYPE_UNKNOWN = 0,
+	AFC_FILE_TYPE_REGULAR,   /**< S_IFREG */
+	AFC_FILE_TYPE_DIRECTORY, /**< S_IFDIR */
+	AFC_FILE_TYPE_SYMLINK,   /**< S_IFLNK */
+	AFC_FILE_TYPE_CHARDEV,   /**< S_IFCHR */
+	AFC_FILE_TYPE_BLOCKDEV,  /**< S_IFBLK */
+	AFC_FILE_TYPE_FIFO,      /**< S_IFIFO */
+	AFC_FILE_TYPE_SOCKET     /**< S_IFSOCK */
+} afc_file_type_t;
+
+/** File information as returned by afc_get_file_info_struct() */
+typedef struct {
+	uint64_t size;           /**< file size in bytes (st_size) */
+	uint64_t blocks;         /**< number of allocated blocks (st_blocks) */
+	uint32_t nlink;          /**< number of hard links (st_nlink) */
+	afc_file_type_t type;    /**< file type (st_ifmt) */
+	uint64_t mtime;          /**< modification time in nanoseconds since the epoch (st_mtime) */
+	uint64_t birthtime;      /**< creation time in nanoseconds since the epoch (st_birthtime) */
+	char link_target[1024];  /**< target of a symlink (LinkTarget), empty string otherwise */
+} afc_file_info_t;
+
+/** Directory entry as returned by afc_read_directory_with_info() */
+typedef struct {
+	const char *name;        /**< name of the entry */
+	const char *link_target; /**< target of a symlink, or NULL */
+	uint64_t size;           /**< file size in bytes (st_size) */
+	uint64_t mtime;          /**< modification time in nanoseconds since the epoch (st_mtime) */
+	afc_file_type_t type;    /**< file type (st_ifmt), AFC_FILE_TYPE_UNKNOWN if the entry could not be queried */
+} afc_directory_entry_t;
+
 typedef struct afc_client_private afc_client_private;
 typedef afc_client_private *afc_client_t; /**< The client handle. */
 
+/**
+ * Callback receiving the data chunks of a pipelined file read.
+ *
+ * @param data Pointer to the chunk of file data
+ * @param length The number of bytes in data
+ * @param user_data Custom pointer passed to afc_file_read_pipelined()
+ *
+ * @return 0 to continue reading, any other value to abort the read.
+ */
+typedef int (*afc_file_read_cb_t)(const char *data, uint32_t length, void *user_data);
+
+/**
+ * Callback reporting the progress of afc_copy_tree(). Calls are serialized
+ * but happen on the worker threads.
+ *
+ * @param path The device path of the file being copied
+ * @param bytes_copied The number of bytes of the file copied so far
+ * @param file_size The size of the file
+ * @param user_data Custom pointer passed to afc_copy_tree()
+ */
+typedef void (*afc_copy_progress_cb_t)(const char *path, uint64_t bytes_copied, uint64_t file_size, void *user_data);
+
+/**
+ * Callback reporting an error during afc_copy_tree(). Calls are serialized
+ * but happen on the worker threads.
+ *
+ * @param path The device path of the file or directory that failed to copy
+ * @param error The AFC_E_* error value
+ * @param user_data Custom pointer passed to afc_copy_tree()
+ *
+ * @return 0 to skip the failed item and continue, any other value to
+ *    abort the copy.
+ */
+typedef int (*afc_copy_error_cb_t)(const char *path, afc_error_t error, void *user_data);
+
 /* Interface */
 
 /**
@@ -133,6 +200,85 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_start_service(idevice_t device,
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_free(afc_client_t client);
 
+/**
+ * Enables a cache of directory listings and file information of a client,
+ * for consumers like FUSE file systems that look up the same paths over and
+ * over. afc_read_directory(), afc_get_file_info() and
+ * afc_get_file_info_struct() are answered from the cache until an entry
+ * expires; lookups of missing paths are cached as well.
+ * afc_read_directory_with_info() fills the cache but always asks the device.
+ *
+ * Entries are invalidated by the modifying functions of the same client.
+ * Changes made by other clients or on the device only show up once the
+ * entries expired, or after afc_client_flush_cache().
+ *
+ * @param client The client to enable the cache for.
+ * @param ttl_ms How long entries are valid in milliseconds, or 0 to disable
+ *        the cache and drop all entries.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if client is invalid,
+ *         or AFC_E_NO_MEM if the cache could not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_set_cache_ttl(afc_client_t client, uint32_t ttl_ms);
+
+/**
+ * Drops all entries from the cache of a client, see
+ * afc_client_set_cache_ttl().
+ *
+ * @param client The client to flush the cache of.
+ *
+ * @return AFC_E_SUCCESS on success, or AFC_E_INVALID_ARG if client is invalid.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_flush_cache(afc_client_t client);
+
+/**
+ * Configures the sequential read-ahead of a client. Once a file handle is
+ * read from repeatedly without seeking, afc_file_read() calls smaller than
+ * chunk_size fetch window pipelined reads of chunk_size bytes at once and
+ * are then answered from the buffered data. The buffered data is dropped by
+ * afc_file_seek(), and before the handle is written to or truncated.
+ * afc_file_tell() reports the position the caller read up to.
+ *
+ * Read-ahead is enabled by default with a window of 4 reads of 64 KiB.
+ *
+ * @param client The client to configure.
+ * @param window Number of reads issued at once, or 0 to disable read-ahead.
+ * @param chunk_size Size of each read, or 0 for the default.
+ *
+ * @return AFC_E_SUCCESS on success, or AFC_E_INVALID_ARG if client is invalid.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_set_read_ahead(afc_client_t client, uint32_t window, uint32_t chunk_size);
+
+/**
+ * Enables caching of the device information of a client, for callers that
+ * check the free space before every upload. afc_get_device_info() and
+ * afc_get_device_info_key() are answered from the cache until it expires.
+ * In the meantime, FSFreeBytes is reduced by the data written through the
+ * client. Removing or truncating files makes the next call ask the device.
+ *
+ * @param client The client to enable the cache for.
+ * @param ttl_ms How long the device information is valid in milliseconds,
+ *        or 0 to always ask the device.
+ *
+ * @return AFC_E_SUCCESS on success, or AFC_E_INVALID_ARG if client is invalid.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_set_device_info_ttl(afc_client_t client, uint32_t ttl_ms);
+
+/**
+ * Reserves room in the buffer requests of a client are built in, for
+ * callers that know they will use long paths. The buffer starts with room
+ * for 1024 bytes and otherwise grows by doubling as needed. Data written to
+ * files is never copied into it.
+ *
+ * @param client The client to reserve room for.
+ * @param capacity Number of bytes of request data, excluding the header.
+ *        A capacity smaller than the current one is ignored.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if client is invalid,
+ *         or AFC_E_NO_MEM if the buffer could not be grown.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_set_packet_capacity(afc_client_t client, uint32_t capacity);
+
 /**
  * Get device information for a connected client. The device information
  * returned is the device model as well as the free space, the total capacity
@@ -160,6 +306,33 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_get_device_info(afc_client_t client, ch
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information);
 
+/**
+ * Gets a directory listing of the directory requested together with the
+ * file information of each entry. The file information requests are
+ * pipelined behind the directory listing, so this is much faster than
+ * calling afc_get_file_info() for each entry. The "." and ".." entries are
+ * not included.
+ *
+ * @param client The client to get a directory listing from.
+ * @param path The directory for listing. (must be a fully-qualified path)
+ * @param entries Pointer that will be set to an array of directory entries,
+ *        or NULL if the directory is empty or an error occurred. Free with
+ *        afc_directory_entries_free().
+ * @param count Pointer that will be set to the number of entries.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_read_directory_with_info(afc_client_t client, const char *path, afc_directory_entry_t **entries, uint32_t *count);
+
+/**
+ * Frees a directory entry array as returned by afc_read_directory_with_info().
+ *
+ * @param entries The directory entry array to free.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_directory_entries_free(afc_directory_entry_t *entries);
+
 /**
  * Gets information about a specific file.
  *
@@ -173,6 +346,20 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_read_directory(afc_client_t client, con
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_get_file_info(afc_client_t client, const char *path, char ***file_information);
 
+/**
+ * Gets information about a specific file as a struct. Unlike
+ * afc_get_file_info() this does not allocate any memory.
+ *
+ * @param client The client to use to get the information of the file.
+ * @param path The fully-qualified path to the file.
+ * @param info Pointer to an afc_file_info_t struct that will be filled with
+ *        the file information. Fields that are not reported by the device
+ *        are set to 0.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_get_file_info_struct(afc_client_t client, const char *path, afc_file_info_t *info);
+
 /**
  * Opens a file on the device.
  *
@@ -190,6 +377,9 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_open(afc_client_t client, const ch
  *
  * @param client The client to close the file with.
  * @param handle File handle of a previously opened file.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value. If a write
+ *    queued with afc_file_write_async() failed, its error is returned.
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_close(afc_client_t client, uint64_t handle);
 
@@ -220,6 +410,25 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_lock(afc_client_t client, uint64_t
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read);
 
+/**
+ * Reads a file from the current position until the end of file, keeping
+ * multiple read requests outstanding to hide the round trip latency.
+ * The read data is passed to the given callback in file order.
+ *
+ * @param client The relevant AFC client
+ * @param handle File handle of a previously opened file
+ * @param callback Callback function that receives the read data chunks
+ * @param user_data Custom pointer passed to the callback function
+ * @param window Maximum number of outstanding read requests, or 0 for the
+ *    default of 8
+ * @param chunk_size Number of bytes requested per read request, or 0 for
+ *    the default of 64 KiB
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_OP_INTERRUPTED if the callback
+ *    aborted the read, or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, afc_file_read_cb_t callback, void *user_data, uint32_t window, uint32_t chunk_size);
+
 /**
  * Writes a given number of bytes to a file.
  *
@@ -233,6 +442,56 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_read(afc_client_t client, uint64_t
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written);
 
+/**
+ * Queues a write of the given data to a file without waiting for the
+ * device to acknowledge it. Up to 8 writes are kept outstanding; their
+ * status replies are collected lazily. Errors of queued writes are reported
+ * by the next afc_file_write_async(), afc_file_flush() or afc_file_close()
+ * call on the same client.
+ *
+ * @param client The client to use to write to the file.
+ * @param handle File handle of previously opened file.
+ * @param data The data to write to the file.
+ * @param length How much data to write.
+ * @param bytes_queued The number of bytes queued for writing.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_write_async(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_queued);
+
+/**
+ * Waits for all outstanding writes queued with afc_file_write_async()
+ * to complete.
+ *
+ * @param client The client the writes were queued on.
+ *
+ * Data held in write-back buffers, see afc_file_set_write_buffer(), is
+ * written first.
+ *
+ * @return AFC_E_SUCCESS if all queued writes succeeded, or the AFC_E_*
+ *    error value of the first failed write.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_flush(afc_client_t client);
+
+/**
+ * Enables a write-back buffer for a file handle. afc_file_write() calls
+ * smaller than the buffer are then collected and sent as one large write.
+ * The buffer is written out when it is full, and before the handle is
+ * read, seeked, told, locked, truncated or closed, as well as by
+ * afc_file_flush(). Buffered writes are sent without waiting for the
+ * device, so like with afc_file_write_async() a failure is reported by the
+ * next afc_file_write(), afc_file_flush() or afc_file_close() call.
+ *
+ * @param client The client the file was opened with.
+ * @param handle File handle of a previously opened file.
+ * @param size Size of the buffer in bytes, or 0 to write out and remove
+ *    the buffer.
+ *
+ * @return AFC_E_SUCCESS on success, AFC_E_INVALID_ARG if an argument is
+ *    invalid, or AFC_E_NO_MEM if the buffer could not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_file_set_write_buffer(afc_client_t client, uint64_t handle, uint32_t size);
+
 /**
  * Seeks to a given position of a pre-opened file on the device.
  *
@@ -313,6 +572,21 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_make_directory(afc_client_t client, con
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_truncate(afc_client_t client, const char *path, uint64_t newsize);
 
+/**
+ * Asks the device for the hash of a file's contents. The device computes the
+ * hash itself; depending on the iOS version it is a SHA-1 (20 bytes) or a
+ * SHA-256 (32 bytes) digest.
+ *
+ * @param client The client to use.
+ * @param path The path of the file.
+ * @param hash Pointer that will be set to the binary hash on success. Free
+ *        with free().
+ * @param hash_len Pointer that will be set to the length of the hash.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len);
+
 /**
  * Creates a hard link or symbolic link on the device.
  *
@@ -348,6 +622,43 @@ LIBIMOBILEDEVICE_API_MSC afc_error_t afc_set_file_time(afc_client_t client, cons
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_remove_path_and_contents(afc_client_t client, const char *path);
 
+/**
+ * Deletes a file or directory including possible contents, also on devices
+ * that don't support afc_remove_path_and_contents(). There the tree is
+ * listed with afc_read_directory_with_info() and the files of each
+ * directory are removed with pipelined requests, instead of one round trip
+ * per file. Removal continues after entries that can't be removed.
+ *
+ * @param client The client to use.
+ * @param path The path to delete. (must be a fully-qualified path)
+ *
+ * @return AFC_E_SUCCESS on success, or the AFC_E_* error value of the
+ *     first entry that could not be listed or removed.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_remove_tree(afc_client_t client, const char *path);
+
+/**
+ * Recursively copies a directory tree from the device to the host. The
+ * work is spread over multiple AFC connections, each served by its own
+ * worker thread. Directories that already exist on the host are reused,
+ * existing files are overwritten. Symlinks are recreated on the host where
+ * supported, other special files are skipped.
+ *
+ * @param device The device to copy from.
+ * @param device_path The fully-qualified path of the directory on the device.
+ * @param host_path The path of the target directory on the host.
+ * @param num_connections Number of AFC connections to use, or 0 for the
+ *    default of 4.
+ * @param progress_cb Optional callback to report copy progress.
+ * @param error_cb Optional callback to report errors. If NULL, the copy is
+ *    aborted on the first error.
+ * @param user_data Custom pointer passed to the callbacks.
+ *
+ * @return AFC_E_SUCCESS if everything was copied, or the AFC_E_* error
+ *    value of the first failure.
+ */
+LIBIMOBILEDEVICE_API_MSC afc_error_t afc_copy_tree(idevice_t device, const char *device_path, const char *host_path, uint32_t num_connections, afc_copy_progress_cb_t progress_cb, afc_copy_error_cb_t error_cb, void *user_data);
+
 /* Helper functions */
 
 /**
@@ -122,6 +122,8 @@ companion_proxy_error_t companion_proxy_receive(companion_proxy_client_t client,
  * @param devices Point that will receive a PLIST_ARRAY with paired device UDIDs
  *
  * @note The device closes the connection after sending the reply.
+ * @note While a client for the same device is listening for events, the
+ *  registry is returned from a local copy once it has been retrieved.
  *
  * @return COMPANION_PROXY_E_SUCCESS on success,
  *  COMPANION_PROXY_E_NO_DEVICES if no devices are paired,
@@ -132,6 +134,12 @@ companion_proxy_error_t companion_proxy_get_device_registry(companion_proxy_clie
 /**
  * Starts listening for paired devices.
  *
+ * Events of all clients are received on one event loop shared within the
+ * process. While listening, the device registry and the values retrieved
+ * with companion_proxy_get_value_from_registry() are kept locally and
+ * subsequent lookups by any client of the same device are answered
+ * without a round trip until an event invalidates them.
+ *
  * @param client The companion_proxy client
  * @param callback Callback function that will be called when a new device is detected
  * @param userdata Pointer that that will be passed to the callback function
@@ -141,10 +149,29 @@ companion_proxy_error_t companion_proxy_get_device_registry(companion_proxy_clie
  *  to make a copy if required.
  *
  * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_OP_IN_PROGRESS if the client is already listening,
  *  or a COMPANION_PROXY_E_* error code otherwise.
  */
 companion_proxy_error_t companion_proxy_start_listening_for_devices(companion_proxy_client_t client, companion_proxy_device_event_cb_t callback, void* userdata);
 
+/**
+ * Starts listening for paired devices on the given event loop instead of
+ * the one shared within the process.
+ *
+ * @param client The companion_proxy client
+ * @param loop The event loop to receive the events on
+ * @param callback Callback function that will be called from a worker
+ *  thread of the loop when a new device is detected
+ * @param userdata Pointer that that will be passed to the callback function
+ *
+ * @note The client must stop listening before the loop is freed.
+ *
+ * @return COMPANION_PROXY_E_SUCCESS on success,
+ *  COMPANION_PROXY_E_OP_IN_PROGRESS if the client is already listening,
+ *  or a COMPANION_PROXY_E_* error code otherwise.
+ */
+companion_proxy_error_t companion_proxy_start_listening_for_devices_with_loop(companion_proxy_client_t client, idevice_event_loop_t loop, companion_proxy_device_event_cb_t callback, void* userdata);
+
 /**
  * Stops listening for paired devices
  *
@@ -163,6 +190,8 @@ companion_proxy_error_t companion_proxy_stop_listening_for_devices(companion_pro
  * @param key The key to retrieve the value for
  *
  * @note The device closes the connection after sending the reply.
+ * @note While a client for the same device is listening for events, values
+ *  that were retrieved before are returned from a local copy.
  *
  * @return COMPANION_PROXY_E_SUCCESS on success,
  *  COMPANION_PROXY_E_INVALID_ARG when client or paired_devices is invalid,
@@ -150,15 +150,42 @@ LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_receive(debugser
  */
 LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response, size_t* response_size);
 
+/**
+ * Sends several commands to the debugserver service and receives their
+ * responses in order.
+ *
+ * With ACK mode disabled all commands are written at once and the
+ * responses are collected afterwards, which avoids a round trip per
+ * command. With ACK mode enabled the commands are sent one by one.
+ *
+ * @param client The debugserver client
+ * @param commands Array of commands to process and send
+ * @param count Number of commands in the array
+ * @param responses Array of count pointers that will be set to the
+ *    responses of the commands. They have to be freed by the caller.
+ * @param response_sizes Array of count values that will be set to the
+ *    response sizes. Set to NULL to ignore.
+ *
+ * @return DEBUGSERVER_E_SUCCESS when all responses were received,
+ *  DEBUGSERVER_E_INVALID_ARG when client, commands or responses is NULL,
+ *  or an DEBUGSERVER_E_* error code otherwise, in which case no responses
+ *  are returned.
+ */
+LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, unsigned int count, char** responses, size_t* response_sizes);
+
 /**
  * Receives and parses response of debugserver service.
  *
  * @param client The debugserver client
- * @param response Response received for last command (can be NULL to ignore)
+ * @param response Response received for last command (can be NULL to ignore).
+ *    It is set to NULL if no packet arrived within one second.
  * @param response_size Pointer to receive response size. Set to NULL to ignore.
  *
  * @return DEBUGSERVER_E_SUCCESS on success,
- *  DEBUGSERVER_E_INVALID_ARG when client is NULL
+ *  DEBUGSERVER_E_INVALID_ARG when client is NULL,
+ *  DEBUGSERVER_E_RESPONSE_ERROR when the packet checksum is invalid,
+ *  DEBUGSERVER_E_TIMEOUT when a started packet was not completed in time,
+ *  or an DEBUGSERVER_E_* error code when receiving failed.
  */
 LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response, size_t* response_size);
 
@@ -201,6 +228,23 @@ LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_set_argv(debugse
  */
 LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_set_environment_hex_encoded(debugserver_client_t client, const char* env, char** response);
 
+/**
+ * Adds or sets several environment variables. With ACK mode disabled all
+ * packets are sent at once instead of waiting for the response to each of
+ * them, see debugserver_client_send_commands().
+ *
+ * @param client The debugserver client
+ * @param envc Number of environment variables
+ * @param envp Array of environment variables in "KEY=VALUE" notation
+ * @param response The first response that is not "OK", or the last response
+ *    if all variables were set (can be NULL to ignore)
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when client or envp is NULL or envc is not
+ *  positive
+ */
+LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_set_environment(debugserver_client_t client, int envc, const char* envp[], char** response);
+
 /**
  * Creates and initializes a new command object.
  *
@@ -242,6 +286,49 @@ LIBIMOBILEDEVICE_API_MSC void debugserver_encode_string(const char* buffer, char
  */
 LIBIMOBILEDEVICE_API_MSC void debugserver_decode_string(const char *encoded_buffer, size_t encoded_length, char** buffer);
 
+/**
+ * Encodes a buffer into hex notation.
+ *
+ * @param data The data to encode
+ * @param length Length of the data
+ * @param encoded Buffer that receives 2 * length hex digits. It is not
+ *    null terminated.
+ *
+ * @return The number of hex digits written
+ */
+LIBIMOBILEDEVICE_API_MSC size_t debugserver_encode_buffer(const char* data, size_t length, char* encoded);
+
+/**
+ * Decodes hex notation into a buffer.
+ *
+ * @param encoded The hex digits to decode
+ * @param encoded_length Number of hex digits
+ * @param data Buffer that receives encoded_length / 2 bytes
+ *
+ * @return The number of bytes written
+ */
+LIBIMOBILEDEVICE_API_MSC size_t debugserver_decode_buffer(const char* encoded, size_t encoded_length, char* data);
+
+/**
+ * Reads memory of the debugged process.
+ *
+ * The binary 'x' packet is used so the data is transferred without hex
+ * encoding. If debugserver does not support it, the 'm' packet is used.
+ *
+ * @param client The debugserver client
+ * @param address Start address of the memory to read
+ * @param length Number of bytes to read
+ * @param data Buffer of at least length bytes that receives the memory
+ * @param bytes_read Pointer that will be set to the number of bytes that
+ *    were read, which can be less than length.
+ *
+ * @return DEBUGSERVER_E_SUCCESS on success,
+ *  DEBUGSERVER_E_INVALID_ARG when one or more parameters are invalid,
+ *  DEBUGSERVER_E_RESPONSE_ERROR when the memory could not be read,
+ *  or an DEBUGSERVER_E_* error code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t length, char* data, uint32_t* bytes_read);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56,6 +56,25 @@ typedef enum {
 typedef struct diagnostics_relay_client_private diagnostics_relay_client_private;
 typedef diagnostics_relay_client_private *diagnostics_relay_client_t; /**< The client handle. */
 
+typedef struct diagnostics_relay_sampler_private diagnostics_relay_sampler_private;
+typedef diagnostics_relay_sampler_private *diagnostics_relay_sampler_t; /**< Handle of a periodic sampler. */
+
+/**
+ * Receives a value that changed since the previous sample.
+ *
+ * @param source The IORegistry entry name or class the value belongs to,
+ *     or "MobileGestalt" for MobileGestalt keys. NULL if sampling stopped
+ *     because of a connection error.
+ * @param key The name of the value, or NULL if the source could not be
+ *     queried.
+ * @param value The new value, or NULL if the value no longer exists. The
+ *     value is owned by the library; use plist_copy() to keep it.
+ * @param status DIAGNOSTICS_RELAY_E_SUCCESS, or the error that occurred
+ *     while querying the source.
+ * @param user_data The user data pointer passed to the sampler.
+ */
+typedef void (*diagnostics_relay_sample_cb_t)(const char *source, const char *key, plist_t value, diagnostics_relay_error_t status, void *user_data);
+
 /**
  * Connects to the diagnostics_relay service on the specified device.
  *
@@ -180,6 +199,99 @@ LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_query_ioreg
 
 LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_query_ioregistry_plane(diagnostics_relay_client_t client, const char* plane, plist_t* result);
 
+/**
+ * Creates a sampler that periodically queries a set of IORegistry entries
+ * and MobileGestalt keys over an open diagnostics_relay connection. The
+ * queries of each sample are pipelined and only values that changed are
+ * reported.
+ *
+ * @param client The diagnostics_relay client to use. It must not be used
+ *     for anything else while the sampler is running.
+ * @param sampler Pointer that will point to a newly allocated sampler upon
+ *     successful return. Must be freed with diagnostics_relay_sampler_free().
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when client or sampler is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_new(diagnostics_relay_client_t client, diagnostics_relay_sampler_t *sampler);
+
+/**
+ * Adds an IORegistry entry to query on every sample, like
+ * diagnostics_relay_query_ioregistry_entry().
+ *
+ * @param sampler The sampler
+ * @param entry_name The IORegistry entry name, or NULL
+ * @param entry_class The IORegistry entry class, or NULL
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when sampler is NULL, both entry_name
+ *  and entry_class are NULL, or the sampler is running
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_add_ioregistry_entry(diagnostics_relay_sampler_t sampler, const char* entry_name, const char* entry_class);
+
+/**
+ * Adds a MobileGestalt key to query on every sample. All keys are queried
+ * with a single request.
+ *
+ * @param sampler The sampler
+ * @param key The MobileGestalt key
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when sampler or key is NULL, or the
+ *  sampler is running
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_add_mobilegestalt_key(diagnostics_relay_sampler_t sampler, const char* key);
+
+/**
+ * Takes a single sample and reports the values that changed since the
+ * previous sample. The first sample reports all values.
+ *
+ * @param sampler The sampler
+ * @param callback Function that is called for every changed value
+ * @param user_data Pointer that will be passed to the callback
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when the sampler has no sources or is
+ *  running, or DIAGNOSTICS_RELAY_E_MUX_ERROR if the connection failed
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_sample(diagnostics_relay_sampler_t sampler, diagnostics_relay_sample_cb_t callback, void *user_data);
+
+/**
+ * Starts taking samples in a background thread.
+ *
+ * @param sampler The sampler
+ * @param interval Time between two samples in milliseconds
+ * @param callback Function that is called from the sampling thread for
+ *     every changed value
+ * @param user_data Pointer that will be passed to the callback
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when a parameter is invalid or the
+ *  sampler is already running
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_start(diagnostics_relay_sampler_t sampler, unsigned int interval, diagnostics_relay_sample_cb_t callback, void *user_data);
+
+/**
+ * Stops the background thread started with diagnostics_relay_sampler_start()
+ * and waits for it to finish.
+ *
+ * @param sampler The sampler
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when sampler is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_stop(diagnostics_relay_sampler_t sampler);
+
+/**
+ * Stops and frees a sampler. The diagnostics_relay client is not freed.
+ *
+ * @param sampler The sampler to free
+ *
+ * @return DIAGNOSTICS_RELAY_E_SUCCESS on success,
+ *  DIAGNOSTICS_RELAY_E_INVALID_ARG when sampler is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC diagnostics_relay_error_t diagnostics_relay_sampler_free(diagnostics_relay_sampler_t sampler);
+
 #ifdef __cplusplus
 }
 #endif
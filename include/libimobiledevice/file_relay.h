@@ -43,12 +43,37 @@ typedef enum {
 	FILE_RELAY_E_INVALID_SOURCE    = -4,
 	FILE_RELAY_E_STAGING_EMPTY     = -5,
 	FILE_RELAY_E_PERMISSION_DENIED = -6,
+	FILE_RELAY_E_ARCHIVE_ERROR     = -7,
 	FILE_RELAY_E_UNKNOWN_ERROR     = -256
 } file_relay_error_t;
 
 typedef struct file_relay_client_private file_relay_client_private;
 typedef file_relay_client_private *file_relay_client_t; /**< The client handle. */
 
+/** An entry of the archive sent by the device */
+typedef struct {
+	const char *path;  /**< Path of the entry inside of the archive */
+	uint32_t mode;     /**< File type and permissions */
+	uint64_t mtime;    /**< Modification time in seconds since the epoch */
+	uint64_t size;     /**< Size of the file data */
+	uint64_t offset;   /**< Offset of the data passed to the callback */
+} file_relay_entry_t;
+
+/**
+ * Callback receiving the entries of an archive while it is extracted.
+ * It is called for each chunk of file data in order, and once with a
+ * length of 0 for entries without data. The last chunk of an entry
+ * satisfies offset + length == size.
+ *
+ * @param entry The entry the data belongs to.
+ * @param data The file data, or NULL for entries without data.
+ * @param length Length of the data.
+ * @param user_data The user data pointer passed to file_relay_extract().
+ *
+ * @return 0 to continue, or a non-zero value to stop the extraction.
+ */
+typedef int (*file_relay_extract_cb_t)(const file_relay_entry_t *entry, const char *data, uint32_t length, void *user_data);
+
 /**
  * Connects to the file_relay service on the specified device.
  *
@@ -158,6 +183,64 @@ LIBIMOBILEDEVICE_API_MSC file_relay_error_t file_relay_request_sources(file_rela
  */
 LIBIMOBILEDEVICE_API_MSC file_relay_error_t file_relay_request_sources_timeout(file_relay_client_t client, const char **sources, idevice_connection_t *connection, unsigned int timeout);
 
+/**
+ * Extracts the gzip compressed cpio archive sent by the device while it is
+ * received. Only small fixed size buffers are used, regardless of the
+ * size of the archive.
+ *
+ * @param connection The connection returned by file_relay_request_sources().
+ * @param callback The function receiving the entries of the archive.
+ * @param user_data Pointer that will be passed to the callback.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return FILE_RELAY_E_SUCCESS when the whole archive was extracted or the
+ *     callback stopped the extraction, FILE_RELAY_E_INVALID_ARG when one or
+ *     more parameters are invalid, FILE_RELAY_E_MUX_ERROR when the data
+ *     ended early, FILE_RELAY_E_ARCHIVE_ERROR when the archive is malformed,
+ *     or FILE_RELAY_E_UNKNOWN_ERROR otherwise, including when built without
+ *     zlib.
+ */
+LIBIMOBILEDEVICE_API_MSC file_relay_error_t file_relay_extract(idevice_connection_t connection, file_relay_extract_cb_t callback, void *user_data, unsigned int timeout);
+
+/**
+ * Extracts the archive sent by the device into a directory while it is
+ * received. Directories and regular files are created, all other entries
+ * and entries with paths outside of the directory are skipped.
+ *
+ * @param connection The connection returned by file_relay_request_sources().
+ * @param path The directory to extract to. It is created if needed.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return FILE_RELAY_E_SUCCESS on success, or an error code as returned by
+ *     file_relay_extract(). FILE_RELAY_E_UNKNOWN_ERROR is also returned when
+ *     a file could not be written.
+ */
+LIBIMOBILEDEVICE_API_MSC file_relay_error_t file_relay_extract_to_directory(idevice_connection_t connection, const char *path, unsigned int timeout);
+
+/**
+ * Collects several sources over concurrent file_relay connections and
+ * extracts them into one directory. Each source is requested on its own
+ * connection, so the device compresses and sends several archives at once
+ * instead of one large archive. If the device refuses additional
+ * connections, the remaining sources are collected over the connections it
+ * accepted. A file contained in more than one source is extracted once.
+ *
+ * @param device The device to collect from.
+ * @param sources A NULL-terminated list of sources to retrieve.
+ * @param path The directory to extract to. It is created if needed.
+ * @param max_connections Maximum number of concurrent connections, or 0
+ *     for the default of 4.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return FILE_RELAY_E_SUCCESS when all sources were extracted, sources
+ *     without data are skipped, FILE_RELAY_E_INVALID_ARG when one or more
+ *     parameters are invalid, or the error of the first source that failed
+ *     as returned by file_relay_request_sources_timeout() or
+ *     file_relay_extract_to_directory(). The other sources are still
+ *     collected in that case.
+ */
+LIBIMOBILEDEVICE_API_MSC file_relay_error_t file_relay_extract_sources_to_directory(idevice_t device, const char **sources, const char *path, unsigned int max_connections, unsigned int timeout);
+
 #ifdef __cplusplus
 }
 #endif
@@ -36,17 +36,24 @@ extern "C" {
 
 /** Error Codes */
 typedef enum {
-	HOUSE_ARREST_E_SUCCESS       =  0,
-	HOUSE_ARREST_E_INVALID_ARG   = -1,
-	HOUSE_ARREST_E_PLIST_ERROR   = -2,
-	HOUSE_ARREST_E_CONN_FAILED   = -3,
-	HOUSE_ARREST_E_INVALID_MODE  = -4,
-	HOUSE_ARREST_E_UNKNOWN_ERROR = -256
+	HOUSE_ARREST_E_SUCCESS        =  0,
+	HOUSE_ARREST_E_INVALID_ARG    = -1,
+	HOUSE_ARREST_E_PLIST_ERROR    = -2,
+	HOUSE_ARREST_E_CONN_FAILED    = -3,
+	HOUSE_ARREST_E_INVALID_MODE   = -4,
+	HOUSE_ARREST_E_COMMAND_FAILED = -5,
+	HOUSE_ARREST_E_UNKNOWN_ERROR  = -256
 } house_arrest_error_t;
 
 typedef struct house_arrest_client_private house_arrest_client_private;
 typedef house_arrest_client_private *house_arrest_client_t; /**< The client handle. */
 
+typedef struct house_arrest_container_cache_private house_arrest_container_cache_private;
+typedef house_arrest_container_cache_private *house_arrest_container_cache_t; /**< A cache of container sessions. */
+
+/** Number of container sessions kept open by default */
+#define HOUSE_ARREST_CONTAINER_CACHE_DEFAULT_SIZE 8
+
 /* Interface */
 
 /**
@@ -172,6 +179,70 @@ LIBIMOBILEDEVICE_API_MSC house_arrest_error_t house_arrest_get_result(house_arre
  */
 LIBIMOBILEDEVICE_API_MSC afc_error_t afc_client_new_from_house_arrest_client(house_arrest_client_t client, afc_client_t *afc_client);
 
+/**
+ * Creates a cache of container sessions. Each session is an AFC connection
+ * to the container of one app, set up with a house_arrest command. Sessions
+ * are reused for the same app and command, and the least recently used ones
+ * are closed when there are too many of them. The house_arrest services are
+ * started through the pooled lockdownd session of the device.
+ *
+ * @param device The device to open container sessions on. It must stay
+ *     valid until the cache is freed.
+ * @param max_sessions Maximum number of sessions kept open, or 0 for
+ *     HOUSE_ARREST_CONTAINER_CACHE_DEFAULT_SIZE.
+ * @param label The label to use for communication with lockdownd, or NULL.
+ * @param cache Pointer that will be set to the newly allocated cache.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or a HOUSE_ARREST_E_* error
+ *     code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC house_arrest_error_t house_arrest_container_cache_new(idevice_t device, unsigned int max_sessions, const char *label, house_arrest_container_cache_t *cache);
+
+/**
+ * Closes all sessions of a container cache and frees it.
+ *
+ * @param cache The cache to free. No AFC client handed out by it may be
+ *     used anymore.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or HOUSE_ARREST_E_INVALID_ARG if
+ *     cache is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC house_arrest_error_t house_arrest_container_cache_free(house_arrest_container_cache_t cache);
+
+/**
+ * Gets an AFC client for the container of an app, reusing an open session
+ * if there is one.
+ *
+ * @param cache The container cache to use.
+ * @param command The house_arrest command to vend the container with,
+ *     "VendContainer" or "VendDocuments".
+ * @param appid The bundle identifier of the app.
+ * @param afc Pointer that will be set to the AFC client. It is owned by the
+ *     cache and must be handed back with house_arrest_container_cache_release().
+ *
+ * @note The same AFC client can be handed out to several users at once; AFC
+ *     clients serialize their operations internally.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success, HOUSE_ARREST_E_COMMAND_FAILED if
+ *     the device refused to vend the container, or another HOUSE_ARREST_E_*
+ *     error code.
+ */
+LIBIMOBILEDEVICE_API_MSC house_arrest_error_t house_arrest_container_cache_get(house_arrest_container_cache_t cache, const char *command, const char *appid, afc_client_t *afc);
+
+/**
+ * Hands an AFC client obtained with house_arrest_container_cache_get() back
+ * to the cache.
+ *
+ * @param cache The container cache the client was obtained from.
+ * @param afc The AFC client.
+ * @param discard Non-zero to close the session instead of keeping it for
+ *     reuse, e.g. after the connection failed.
+ *
+ * @return HOUSE_ARREST_E_SUCCESS on success or HOUSE_ARREST_E_INVALID_ARG if
+ *     afc was not handed out by the cache.
+ */
+LIBIMOBILEDEVICE_API_MSC house_arrest_error_t house_arrest_container_cache_release(house_arrest_container_cache_t cache, afc_client_t afc, int discard);
+
 #ifdef __cplusplus
 }
 #endif
@@ -32,6 +32,7 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
 
 #define INSTPROXY_SERVICE_NAME "com.apple.mobile.installation_proxy"
 
@@ -113,6 +114,15 @@ typedef instproxy_client_private *instproxy_client_t; /**< The client handle. */
 /** Reports the status response of the given command */
 typedef void (*instproxy_status_cb_t) (plist_t command, plist_t status, void *user_data);
 
+/** Reports the progress of an install on one of several devices, percent is -1 if unknown */
+typedef void (*instproxy_device_progress_cb_t) (const char *udid, const char *status, int percent, void *user_data);
+
+/** Reports a single application; the app dictionary is only valid during the callback */
+typedef void (*instproxy_browse_cb_t) (plist_t app, void *user_data);
+
+typedef struct instproxy_app_cache_private instproxy_app_cache_private;
+typedef instproxy_app_cache_private *instproxy_app_cache_t; /**< A cache of application information. */
+
 /* Interface */
 
 /**
@@ -154,6 +164,41 @@ LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_client_start_service(idevic
  */
 LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_client_free(instproxy_client_t client);
 
+/**
+ * Invokes the status callbacks of asynchronous commands (e.g.
+ * instproxy_install() or instproxy_browse_with_callback()) on a separate
+ * thread, so a slow callback does not stall receiving status updates.
+ * Received status updates are queued in a lock-free ring the callback
+ * thread takes them from. The status passed to the callback is freed after
+ * it returns, like before.
+ *
+ * @param client The connected installation_proxy client
+ * @param capacity Number of status updates the ring holds, rounded up to a
+ *        power of two. 0 invokes the callback on the receiving thread
+ *        again, which is the default.
+ * @param policy Whether to drop the oldest status update or stop receiving
+ *        while the ring is full.
+ *
+ * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_INVALID_ARG when
+ *         client is NULL or policy is invalid, INSTPROXY_E_OP_IN_PROGRESS
+ *         while an asynchronous command is running, or
+ *         INSTPROXY_E_UNKNOWN_ERROR when the ring could not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_set_delivery(instproxy_client_t client, uint32_t capacity, enum idevice_delivery_policy policy);
+
+/**
+ * Returns how many status updates were dropped because the ring set up with
+ * instproxy_set_delivery() was full. The counter is reset by
+ * instproxy_set_delivery().
+ *
+ * @param client The connected installation_proxy client
+ * @param dropped Set to the number of dropped status updates.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or INSTPROXY_E_INVALID_ARG when
+ *         client or dropped is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_get_dropped(instproxy_client_t client, uint64_t *dropped);
+
 /**
  * List installed applications. This function runs synchronously.
  *
@@ -191,6 +236,89 @@ LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_browse(instproxy_client_t c
  */
 LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_browse_with_callback(instproxy_client_t client, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * List installed applications one by one in a callback. This function runs
+ * synchronously. Unlike instproxy_browse() no copy of the application
+ * information is made.
+ *
+ * @param client The connected installation_proxy client
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        See instproxy_browse() for valid client options.
+ * @param app_cb Callback function invoked with the PLIST_DICT of each
+ *        application. The dictionary is owned by the library and only valid
+ *        during the callback. Passing a callback is required.
+ * @param user_data Callback data passed to app_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_browse_stream(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t app_cb, void *user_data);
+
+/**
+ * List installed applications one by one in a callback, only returning the
+ * requested attributes. "CFBundleIdentifier" is always returned.
+ *
+ * @param client The connected installation_proxy client
+ * @param application_type The "ApplicationType" to list, e.g. "User" or
+ *        "Any", or NULL for the device default.
+ * @param attributes An array of attribute names that MUST have a
+ *        terminating NULL entry.
+ * @param app_cb Callback function invoked with the PLIST_DICT of each
+ *        application, see instproxy_browse_stream().
+ * @param user_data Callback data passed to app_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_browse_attributes(instproxy_client_t client, const char* application_type, const char** attributes, instproxy_browse_cb_t app_cb, void *user_data);
+
+/**
+ * Creates a new, empty application cache for use with
+ * instproxy_browse_cached().
+ *
+ * @param cache Pointer that will be set to the newly allocated cache.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_app_cache_new(instproxy_app_cache_t *cache);
+
+/**
+ * Frees an application cache.
+ *
+ * @param cache The cache to free.
+ *
+ * @return INSTPROXY_E_SUCCESS on success
+ *         or INSTPROXY_E_INVALID_ARG if cache is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_app_cache_free(instproxy_app_cache_t cache);
+
+/**
+ * List installed applications one by one in a callback, using a cache to
+ * avoid transferring the information of unchanged applications again.
+ *
+ * Only the bundle identifiers and "CFBundleVersion" of all applications are
+ * browsed. Applications whose version matches the cached entry are reported
+ * from the cache, all others are looked up with the given client options
+ * and stored in the cache. Entries of removed applications are dropped.
+ * The cache is reset when it is used with a different device or different
+ * client options. Applications without "CFBundleVersion" are always looked
+ * up.
+ *
+ * @param client The connected installation_proxy client
+ * @param cache The cache to use, see instproxy_app_cache_new().
+ * @param client_options The client options to use, as PLIST_DICT, or NULL.
+ *        See instproxy_browse() for valid client options.
+ * @param app_cb Callback function invoked with the PLIST_DICT of each
+ *        application. The dictionary is owned by the cache and only valid
+ *        during the callback.
+ * @param user_data Callback data passed to app_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_browse_cached(instproxy_client_t client, instproxy_app_cache_t cache, plist_t client_options, instproxy_browse_cb_t app_cb, void *user_data);
+
 /**
  * Lookup information about specific applications from the device.
  *
@@ -233,6 +361,62 @@ LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_lookup(instproxy_client_t c
  */
 LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
 
+/**
+ * Stages a local installation package in the PublicStaging directory of the
+ * device and installs it.
+ *
+ * The package is uploaded with pipelined AFC writes. If a file with the same
+ * name, size and hash is already staged, the upload is skipped.
+ *
+ * @param client The connected installation_proxy client
+ * @param afc A connected AFC client used for staging the package, or NULL to
+ *        start a new AFC connection for the duration of the upload.
+ * @param local_path Path of the package (.ipa) on the host.
+ * @param client_options The client options to use, see instproxy_install().
+ * @param status_cb Callback function for progress and status information,
+ *        see instproxy_install().
+ * @param user_data Callback data passed to status_cb.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *         an error occurred.
+ *
+ * @note The install step behaves like instproxy_install(), so with a callback
+ *       this function returns as soon as the package is staged and the status
+ *       updater thread has been created.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_install_from_file(instproxy_client_t client, afc_client_t afc, const char *local_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data);
+
+/**
+ * Installs one package on several devices concurrently. This function runs
+ * synchronously until all installs finished.
+ *
+ * The package is mapped into memory once and staged on every device like
+ * instproxy_install_from_file() does, by up to max_concurrent workers.
+ *
+ * @param local_path Path of the package (.ipa) on the host.
+ * @param udids Array of the UDIDs of the devices to install on.
+ * @param groups Array with a group name for each device, e.g. the USB hub it
+ *        is attached to, or NULL. A NULL entry puts the device in a group of
+ *        its own.
+ * @param num_devices Number of entries in udids (and groups).
+ * @param client_options The client options to use, see instproxy_install().
+ * @param max_concurrent Maximum number of devices to install on at the same
+ *        time, or 0 for no limit.
+ * @param max_per_group Maximum number of devices of the same group to
+ *        install on at the same time, or 0 for no limit.
+ * @param progress_cb Callback function receiving the status and progress of
+ *        each device, or NULL. Calls are serialized but come from different
+ *        threads. Staging is reported as "StagingPackage", failures as
+ *        "Failed", everything else with the installation_proxy status names.
+ * @param user_data Callback data passed to progress_cb.
+ * @param results Array of num_devices entries that receives the result of
+ *        each install, or NULL.
+ *
+ * @return INSTPROXY_E_SUCCESS if the package was installed on all devices,
+ *         or the error of the first device that failed.
+ */
+LIBIMOBILEDEVICE_API_MSC instproxy_error_t instproxy_install_on_devices(const char *local_path, const char **udids, const char **groups, unsigned int num_devices, plist_t client_options, unsigned int max_concurrent, unsigned int max_per_group, instproxy_device_progress_cb_t progress_cb, void *user_data, instproxy_error_t *results);
+
 /**
  * Upgrade an application on the device. This function is nearly the same as
  * instproxy_install; the difference is that the installation progress on the
@@ -491,6 +675,10 @@ LIBIMOBILEDEVICE_API_MSC void instproxy_client_options_free(plist_t client_optio
  * @param path Pointer to store the device path for the application
  *        which is set to NULL if it could not be determined.
  *
+ * @note Paths are cached per client. The cache is dropped when apps are
+ *       installed, upgraded or removed through the client, or when the
+ *       device reports that apps were installed or uninstalled.
+ *
  * @return INSTPROXY_E_SUCCESS on success, INSTPROXY_E_OP_FAILED if
  *         the path could not be determined or an INSTPROXY_E_* error
  *         value if an error occurred.
@@ -68,7 +68,9 @@ typedef idevice_connection_private *idevice_connection_t; /**< The connection ha
 enum idevice_options {
 	IDEVICE_LOOKUP_USBMUX = 1 << 1,  /**< include USBMUX devices during lookup */
 	IDEVICE_LOOKUP_NETWORK = 1 << 2, /**< include network devices during lookup */
-	IDEVICE_LOOKUP_PREFER_NETWORK = 1 << 3 /**< prefer network connection if device is available via USBMUX *and* network */
+	IDEVICE_LOOKUP_PREFER_NETWORK = 1 << 3, /**< prefer network connection if device is available via USBMUX *and* network */
+	IDEVICE_HEARTBEAT = 1 << 4, /**< answer heartbeat requests of network devices in the background */
+	IDEVICE_LOOKUP_RACE = 1 << 5 /**< connect over USB and network at once if the device is available via both, see idevice_new_with_options() */
 };
 
 /** Type of connection a device is available on */
@@ -77,6 +79,20 @@ enum idevice_connection_type {
 	CONNECTION_NETWORK
 };
 
+/** Socket options that can be set on a connection */
+enum idevice_socket_option {
+	IDEVICE_SOCKET_NODELAY = 1,     /**< disable Nagle's algorithm, value 0 or 1 */
+	IDEVICE_SOCKET_SEND_BUFFER,     /**< send buffer size in bytes */
+	IDEVICE_SOCKET_RECEIVE_BUFFER,  /**< receive buffer size in bytes */
+	IDEVICE_SOCKET_KEEPALIVE        /**< seconds of idle time before keepalive probes are sent, 0 disables */
+};
+
+/** What a queue between a receiving thread and a callback thread does when it is full */
+enum idevice_delivery_policy {
+	IDEVICE_DELIVERY_DROP_OLDEST = 0, /**< discard the oldest queued entry and count it as dropped */
+	IDEVICE_DELIVERY_BLOCK           /**< stop receiving until the callback caught up */
+};
+
 struct idevice_info {
 	char *udid;
 	enum idevice_connection_type conn_type;
@@ -103,6 +119,51 @@ enum idevice_socket_type {
 	IDEVICE_SOCKET_TYPE_TCP = 2
 };
 
+/** Describes a single buffer of a vectored (scatter/gather) send operation. */
+typedef struct {
+	const char *data; /**< Pointer to the data to send. */
+	uint32_t length; /**< Number of bytes to send from data. */
+} idevice_iovec_t;
+
+/** Number of buckets of the latency histograms in idevice_connection_stats_t. */
+#define IDEVICE_STATS_LATENCY_BUCKETS 24
+
+/**
+ * I/O statistics of a connection.
+ * The latency histograms are log-bucketed: bucket 0 counts operations that
+ * took less than 2 microseconds, bucket N counts operations that took at
+ * least 2^N and less than 2^(N+1) microseconds, and the last bucket also
+ * counts everything slower.
+ */
+typedef struct {
+	uint64_t bytes_sent; /**< Total number of bytes sent. */
+	uint64_t bytes_received; /**< Total number of bytes received. */
+	uint64_t send_calls; /**< Number of send operations. */
+	uint64_t receive_calls; /**< Number of receive operations. */
+	uint64_t ssl_bytes_sent; /**< Part of bytes_sent that was sent while SSL was enabled. */
+	uint64_t ssl_bytes_received; /**< Part of bytes_received that was received while SSL was enabled. */
+	uint64_t wait_calls; /**< Number of times the connection waited for the socket to become ready. */
+	uint64_t wait_usec; /**< Total time in microseconds spent waiting for the socket. */
+	uint64_t send_latency[IDEVICE_STATS_LATENCY_BUCKETS]; /**< Latency histogram of service level send operations. */
+	uint64_t receive_latency[IDEVICE_STATS_LATENCY_BUCKETS]; /**< Latency histogram of service level receive operations. */
+	uint64_t receive_memory_peak; /**< Most memory reserved from the receive memory budget at once. */
+} idevice_connection_stats_t;
+
+/**
+ * Usage of the receive memory budget shared by all connections, see
+ * idevice_set_receive_memory_budget().
+ */
+typedef struct {
+	uint64_t budget; /**< Configured budget in bytes, 0 if unlimited. */
+	uint64_t max_message_size; /**< Configured per-message cap in bytes, 0 if none. */
+	uint64_t in_use; /**< Bytes currently reserved by receives in flight. */
+	uint64_t peak; /**< Most bytes that were reserved at once. */
+	uint64_t reservations; /**< Number of messages memory was reserved for. */
+	uint64_t throttled; /**< Number of receives that had to wait for memory. */
+	uint64_t wait_usec; /**< Total time in microseconds receives waited for memory. */
+	uint64_t rejected; /**< Number of messages rejected for exceeding the per-message cap or the whole budget. */
+} idevice_memory_stats_t;
+
 /* event data structure */
 /** Provides information about the occurred event. */
 typedef struct {
@@ -118,6 +179,36 @@ typedef void (*idevice_event_cb_t) (const idevice_event_t *event, void *user_dat
 /** Enables calling applications to capture debug messages from libimobiledevice */
 typedef void(*idevice_debug_cb_t) (char *message);
 
+typedef struct idevice_subscription_context* idevice_subscription_context_t; /**< A device event subscription handle. */
+
+typedef struct idevice_event_loop_private idevice_event_loop_private;
+typedef idevice_event_loop_private *idevice_event_loop_t; /**< The event loop handle. */
+
+/**
+ * Callback invoked by an event loop when data can be received on a
+ * registered connection. It should receive the available data using the
+ * usual receive functions of the connection or service client.
+ *
+ * @param connection The connection that became readable.
+ * @param user_data The user data pointer passed to idevice_event_loop_add().
+ *
+ * @return 0 to keep watching the connection, or a non-zero value to remove
+ *     it from the event loop.
+ */
+typedef int (*idevice_event_loop_cb_t) (idevice_connection_t connection, void *user_data);
+
+/**
+ * Callback invoked when a connection started with idevice_connect_async()
+ * has been established or failed.
+ *
+ * @param device The device passed to idevice_connect_async().
+ * @param connection The new connection, or NULL on error. The callback
+ *     takes ownership of it.
+ * @param error IDEVICE_E_SUCCESS on success, otherwise an error code.
+ * @param user_data The user data pointer passed to idevice_connect_async().
+ */
+typedef void (*idevice_connect_cb_t) (idevice_t device, idevice_connection_t connection, idevice_error_t error, void *user_data);
+
 /* functions */
 
 /**
@@ -157,6 +248,35 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_subscribe(idevice_event_c
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_unsubscribe(void);
 
+/**
+ * Subscribe a callback function that will be called when device add/remove
+ * events occur. Unlike idevice_event_subscribe(), any number of callbacks
+ * can be subscribed at the same time. All of them share a single usbmuxd
+ * subscription and are called in the order they were subscribed.
+ *
+ * @param context A pointer that will be set to a newly allocated
+ *    idevice_subscription_context_t on success.
+ * @param callback Callback function to call.
+ * @param user_data Application-specific data passed as parameter
+ *   to the registered callback function.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_events_subscribe(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data);
+
+/**
+ * Release a subscription created with idevice_events_subscribe().
+ * When called from another thread than the one delivering events, this
+ * function waits until a callback that is currently running has returned.
+ * It may also be called from within the callback itself.
+ *
+ * @param context The subscription context to release. It is freed and
+ *   must not be used afterwards.
+ *
+ * @return IDEVICE_E_SUCCESS on success or an error value when an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_events_unsubscribe(idevice_subscription_context_t context);
+
 /* discovery (synchronous) */
 
 /**
@@ -203,6 +323,24 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_get_device_list_extended(idevic
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_device_list_extended_free(idevice_info_t *devices);
 
+/**
+ * Enables or disables the in-process device cache. When enabled, the list
+ * of available devices is retrieved from usbmuxd once and then kept current
+ * through device events. idevice_get_device_list(),
+ * idevice_get_device_list_extended(), idevice_new() and
+ * idevice_new_with_options() then look up devices in the cache instead of
+ * querying usbmuxd each time. Disabled by default.
+ *
+ * @note The cache uses its own event subscription, so it can be used
+ *   together with idevice_event_subscribe().
+ *
+ * @param enable 1 to enable the device cache, 0 to disable it.
+ *
+ * @return IDEVICE_E_SUCCESS on success, or IDEVICE_E_UNKNOWN_ERROR if device
+ *   events could not be subscribed to.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_set_device_cache(uint8_t enable);
+
 /* device structure creation and destruction */
 
 /**
@@ -242,6 +380,17 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_new(idevice_t *device, const ch
  *   both via USBMUX *and* network, it will select the USB connection.
  *   This behavior can be changed by adding IDEVICE_LOOKUP_PREFER_NETWORK
  *   to the options in which case it will select the network connection.
+ *   With IDEVICE_LOOKUP_RACE a device available via both is not tied to one
+ *   of them: idevice_connect() starts connecting over USB and, if that did
+ *   not succeed within a short head start, over the network as well, and
+ *   keeps whichever connection is established first. If one path
+ *   disappears, new connections, e.g. of newly started services, go over
+ *   the other one. IDEVICE_LOOKUP_RACE implies IDEVICE_LOOKUP_USBMUX and
+ *   IDEVICE_LOOKUP_NETWORK and ignores IDEVICE_LOOKUP_PREFER_NETWORK.
+ *   If IDEVICE_HEARTBEAT is added and a network connection is selected,
+ *   the heartbeat service is started and its requests are answered in the
+ *   background until the device is freed. All devices share one thread for
+ *   this, so applications do not have to run their own heartbeat thread.
  *
  * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
  */
@@ -268,6 +417,26 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_free(idevice_t device);
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection);
 
+/**
+ * Set up a connection to the given device without blocking the caller.
+ * The connect runs on one of the worker threads of the given event loop,
+ * which also invokes the callback. Many connects can be in progress at the
+ * same time, limited by the number of worker threads of the loop.
+ *
+ * @param loop The event loop to run the connect on.
+ * @param device The device to connect to. It must stay valid until the
+ *   callback has been invoked.
+ * @param port The destination port to connect to.
+ * @param callback Function invoked with the result. If the event loop is
+ *   freed before the connect started, it is invoked with
+ *   IDEVICE_E_UNKNOWN_ERROR.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS if the connect was queued, otherwise an error
+ *   code. The callback is only invoked when the connect was queued.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connect_async(idevice_event_loop_t loop, idevice_t device, uint16_t port, idevice_connect_cb_t callback, void *user_data);
+
 /**
  * Disconnect from the device and clean up the connection structure.
  *
@@ -292,6 +461,43 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_disconnect(idevice_connection_t
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes);
 
+/**
+ * Send data from multiple buffers to a device via the given connection.
+ * The buffers are sent in order as if they were one contiguous buffer,
+ * but with as few underlying write operations as possible. On raw
+ * connections the buffers are passed to the socket in a single gather
+ * write, on SSL-enabled connections small buffers are coalesced so that
+ * they end up in the same SSL record.
+ *
+ * @param connection The connection to send data over.
+ * @param iov Array of buffers to send.
+ * @param iovcnt Number of elements in iov.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the total number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes);
+
+/**
+ * Send part of a file to a device via the given connection.
+ * On raw connections the data is passed from the file to the socket by
+ * the kernel where sendfile() is available, otherwise the file is mapped
+ * into memory or, as a last resort, read in chunks and sent.
+ *
+ * @param connection The connection to send data over.
+ * @param fd File descriptor of the file to send, opened for reading.
+ *   Its file position is not used and may change on some platforms.
+ * @param offset Position in the file to start sending from.
+ * @param length Number of bytes to send.
+ * @param sent_bytes Pointer to an uint32_t that will be filled
+ *   with the number of bytes actually sent.
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_NOT_ENOUGH_DATA if the file
+ *   ended early or not all data could be sent, otherwise an error code.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes);
+
 /**
  * Receive data from a device via the given connection.
  * This function will return after the given timeout even if no data has been
@@ -359,6 +565,19 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_disable_ssl(idevice_
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_disable_bypass_ssl(idevice_connection_t connection, uint8_t sslBypass);
 
+/**
+ * Enables or disables TLS session resumption. When enabled, the session of
+ * the last full handshake with a device is remembered and offered on
+ * subsequent SSL connections to the same device, which allows the device to
+ * skip the expensive part of the handshake. Disabled by default.
+ *
+ * @param enable 1 to enable session resumption, 0 to disable it and discard
+ *     all remembered sessions.
+ *
+ * @return IDEVICE_E_SUCCESS on success.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_set_ssl_session_resumption(uint8_t enable);
+
 
 /**
  * Get the underlying file descriptor for a connection
@@ -370,6 +589,140 @@ LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_disable_bypass_ssl(i
  */
 LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd);
 
+/**
+ * Set a socket option on the underlying socket of a connection.
+ *
+ * Connections to network devices get a larger send and receive buffer and,
+ * if the socket is a TCP socket, TCP_NODELAY and keepalive by default.
+ * IDEVICE_SOCKET_NODELAY and IDEVICE_SOCKET_KEEPALIVE only apply to TCP
+ * sockets; connections that are relayed through a local usbmuxd socket
+ * return an error for them.
+ *
+ * @param connection The connection to set the option on
+ * @param option The option to set
+ * @param value The value of the option
+ *
+ * @return IDEVICE_E_SUCCESS if ok, IDEVICE_E_INVALID_ARG for an unknown
+ *    option or an invalid value, or IDEVICE_E_UNKNOWN_ERROR if the option
+ *    could not be set.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_set_socket_option(idevice_connection_t connection, enum idevice_socket_option option, int value);
+
+/**
+ * Get the I/O statistics collected for a connection.
+ *
+ * If the environment variable IMOBILEDEVICE_STATS is set, the statistics
+ * of every connection are also written to stderr when it is disconnected.
+ *
+ * @param connection The connection to get the statistics of
+ * @param stats Pointer to a structure that will be filled with the statistics
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats);
+
+/**
+ * Limits the memory used by messages that are being received and parsed,
+ * summed up over all connections of the process. Before the body of a
+ * property list message is received, memory for it is reserved from the
+ * budget. A parsed message reserves twice its size to account for the
+ * plist created from it. When the budget is exhausted the receive waits,
+ * up to its timeout, until other receives release enough memory. Data not
+ * read yet stays in the socket buffers in the meantime, which throttles the
+ * sender.
+ *
+ * Messages larger than max_message_size, or than the whole budget, are
+ * rejected with PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE. This cap applies
+ * in addition to the per-client limit set with
+ * property_list_service_set_max_message_size().
+ *
+ * @param budget Maximum number of bytes reserved at once, or 0 for no limit.
+ * @param max_message_size Maximum reservation of a single message, or 0
+ *    for no cap.
+ *
+ * @return IDEVICE_E_SUCCESS.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_set_receive_memory_budget(uint64_t budget, uint64_t max_message_size);
+
+/**
+ * Get the usage of the receive memory budget.
+ *
+ * If the environment variable IMOBILEDEVICE_STATS is set, the usage is also
+ * written to stderr when the library is unloaded.
+ *
+ * @param stats Pointer to a structure that will be filled with the usage
+ *
+ * @return IDEVICE_E_SUCCESS if ok, otherwise an error code.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_get_receive_memory_stats(idevice_memory_stats_t *stats);
+
+/**
+ * Creates an event loop that dispatches receive callbacks for many
+ * connections from a small fixed pool of threads, instead of one thread per
+ * connection. Readiness is detected with epoll or kqueue where available,
+ * and with poll() otherwise. On Linux, setting the environment variable
+ * IMOBILEDEVICE_IO_URING selects an io_uring backend if libimobiledevice
+ * was built with liburing.
+ *
+ * @param loop Pointer that will be set to the new event loop.
+ * @param num_threads Number of worker threads, or 0 for the default of 4.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if loop is
+ *     NULL, or IDEVICE_E_UNKNOWN_ERROR if the loop could not be set up.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_loop_new(idevice_event_loop_t *loop, unsigned int num_threads);
+
+/**
+ * Stops all worker threads of an event loop and frees it. Callbacks that
+ * are running are allowed to finish first. Registered connections are not
+ * disconnected.
+ *
+ * @note Must not be called from within an event loop callback.
+ *
+ * @param loop The event loop to free.
+ *
+ * @return IDEVICE_E_SUCCESS on success, or IDEVICE_E_INVALID_ARG if loop is
+ *     NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_loop_free(idevice_event_loop_t loop);
+
+/**
+ * Registers a connection with an event loop. The callback is invoked by one
+ * of the worker threads whenever data can be received on the connection.
+ * A connection is never handed to more than one callback at a time, and the
+ * callback is invoked again right away while the SSL layer still holds
+ * decrypted data.
+ *
+ * @note The connection must be removed from the loop, either with
+ *     idevice_event_loop_remove() or by returning non-zero from the
+ *     callback, before it is disconnected.
+ *
+ * @param loop The event loop.
+ * @param connection The connection to watch.
+ * @param callback The function to invoke when data is available.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if an argument
+ *     is invalid or the connection is already registered, or
+ *     IDEVICE_E_UNKNOWN_ERROR if the connection could not be watched.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_loop_add(idevice_event_loop_t loop, idevice_connection_t connection, idevice_event_loop_cb_t callback, void *user_data);
+
+/**
+ * Removes a connection from an event loop. If the callback for the
+ * connection is running in a worker thread, this waits for it to return.
+ *
+ * @note Must not be called for the connection being dispatched from within
+ *     its own callback; return non-zero from the callback instead.
+ *
+ * @param loop The event loop.
+ * @param connection The connection to remove.
+ *
+ * @return IDEVICE_E_SUCCESS on success, or IDEVICE_E_INVALID_ARG if an
+ *     argument is invalid or the connection is not registered.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_event_loop_remove(idevice_event_loop_t loop, idevice_connection_t connection);
+
 /* misc */
 
 /**
@@ -109,6 +109,10 @@ typedef struct lockdownd_service_descriptor *lockdownd_service_descriptor_t;
  *  The device disconnects automatically if the lockdown connection idles
  *  for more than 10 seconds. Make sure to call lockdownd_client_free() as soon
  *  as the connection is no longer needed.
+ * @note A client can be used from several threads at once. Requests are
+ *  serialized since lockdownd answers them in order, so a slow request
+ *  delays the ones queued behind it. lockdownd_client_set_label() and
+ *  lockdownd_client_free() must not race with other calls.
  *
  * @param device The device to create a lockdownd client for
  * @param client The pointer to the location of the new lockdownd_client
@@ -137,6 +141,37 @@ LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_client_new(idevice_t device
  */
 LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t *client, const char *label);
 
+/**
+ * Acquires the pooled lockdownd session of a device, creating it with
+ * lockdownd_client_new_with_handshake() if required. The session stays
+ * open after lockdownd_client_release() and is handed out again by the next
+ * call, which avoids repeating the handshake and session setup. Concurrent
+ * callers share the pooled session and their requests are serialized; the
+ * label is only changed when nobody else holds the session. While the
+ * pooled session is being set up, further calls return a new, unpooled client.
+ * The pooled session is closed when the device is freed.
+ *
+ * @param device The device to get the pooled lockdownd session of.
+ * @param client Pointer that will be set to the lockdownd client.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when device
+ *  or client is NULL, or an error of lockdownd_client_new_with_handshake().
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_client_acquire(idevice_t device, lockdownd_client_t *client, const char *label);
+
+/**
+ * Releases a lockdownd client acquired with lockdownd_client_acquire().
+ * The pooled session is kept open for reuse; any other client is freed.
+ *
+ * @param client The lockdownd client to release.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client
+ *  is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_client_release(lockdownd_client_t client);
+
 /**
  * Closes the lockdownd client session if one is running and frees up the
  * lockdownd_client struct.
@@ -171,6 +206,49 @@ LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_query_type(lockdownd_client
  */
 LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value);
 
+/**
+ * Enables answering lockdownd_get_value() from snapshots of whole domains.
+ * The first lookup in a domain fetches all of its values, later lookups of
+ * the same device are served locally until the snapshot expires. Snapshots
+ * are shared by all clients of a device that enabled the cache and are
+ * only taken and used once a session is started.
+ *
+ * Snapshots of the global domain and other values fixed while the device
+ * is running live for minutes, those of battery and disk usage domains for
+ * seconds. lockdownd_set_value() and lockdownd_remove_value() drop the
+ * snapshot of the domain they change. Keys that are not part of the domain
+ * listing are always requested from the device.
+ *
+ * @param client An initialized lockdownd client.
+ * @param enabled 1 to use the cache, 0 to always ask the device.
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client
+ *  is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_client_set_value_cache(lockdownd_client_t client, int enabled);
+
+/**
+ * Retrieves multiple preference values at once. The GetValue requests are
+ * pipelined on the lockdownd connection, so this costs about one round trip
+ * instead of one per value.
+ *
+ * @param client An initialized lockdownd client.
+ * @param domains Array of count domains to query on, NULL entries for the
+ *    global domain, or NULL to use the global domain for all keys
+ * @param keys Array of count key names to request, NULL entries to query for
+ *    all keys of the domain
+ * @param count Number of values to retrieve
+ * @param results Array of count plist_t that will be set to the result value
+ *    nodes, or NULL for values that could not be retrieved. Free each with
+ *    plist_free().
+ *
+ * @return LOCKDOWN_E_SUCCESS if the requests were sent and the responses
+ *    received (individual values may still be NULL), LOCKDOWN_E_INVALID_ARG
+ *    when client or results is NULL, or an error code on communication
+ *    failure in which case all results are NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *results);
+
 /**
  * Sets a preferences value using a plist and optional by domain and/or key name.
  *
@@ -227,6 +305,25 @@ LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_start_service(lockdownd_cli
  */
 LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_start_service_with_escrow_bag(lockdownd_client_t client, const char *identifier, lockdownd_service_descriptor_t *service);
 
+/**
+ * Requests to start several services at once. The StartService requests
+ * are pipelined on the lockdownd connection, so this costs about one round
+ * trip instead of one per service.
+ *
+ * @param client The lockdownd client
+ * @param identifiers NULL terminated array of the identifiers of the
+ *    services to start
+ * @param services Array with one entry per identifier that will be set to
+ *    the service descriptors, or NULL for services that could not be
+ *    started. Free each with lockdownd_service_descriptor_free().
+ *
+ * @return LOCKDOWN_E_SUCCESS if all services were started, the error of the
+ *    first service that could not be started otherwise,
+ *    LOCKDOWN_E_INVALID_ARG if a parameter is NULL, or an error code on
+ *    communication failure in which case all descriptors are NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_start_services(lockdownd_client_t client, const char **identifiers, lockdownd_service_descriptor_t *services);
+
 /**
  * Opens a session with lockdownd and switches to SSL mode if device wants it.
  *
@@ -279,6 +376,26 @@ LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_send(lockdownd_client_t cli
  */
 LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_receive(lockdownd_client_t client, plist_t *plist);
 
+/**
+ * Gets the number and the latency histogram of the requests of a given type
+ * (e.g. "GetValue" or "StartService") that this client has completed,
+ * measured from sending the request until its reply was received.
+ * The histogram uses the buckets described for idevice_connection_stats_t.
+ *
+ * If the environment variable IMOBILEDEVICE_STATS is set, the statistics of
+ * all request types are also written to stderr when the client is freed.
+ *
+ * @param client The lockdownd client
+ * @param request The request type
+ * @param count Pointer that will be set to the number of completed requests
+ * @param latency Array of IDEVICE_STATS_LATENCY_BUCKETS elements that will be
+ *  filled with the latency histogram, or NULL
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG when client,
+ *  request or count is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC lockdownd_error_t lockdownd_get_request_stats(lockdownd_client_t client, const char *request, uint64_t *count, uint64_t *latency);
+
 /**
  * Pairs the device using the supplied pair record.
  *
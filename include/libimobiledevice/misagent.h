@@ -46,6 +46,12 @@ typedef enum {
 typedef struct misagent_client_private misagent_client_private;
 typedef misagent_client_private *misagent_client_t; /**< The client handle. */
 
+typedef struct misagent_profile_cache_private misagent_profile_cache_private;
+typedef misagent_profile_cache_private *misagent_profile_cache_t; /**< A cache of the profiles seen on one or more devices. */
+
+/** Number of Install requests kept in flight by misagent_install_many() */
+#define MISAGENT_INSTALL_PIPELINE_WINDOW 4
+
 /* Interface */
 
 /**
@@ -160,6 +166,82 @@ LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_remove(misagent_client_t clie
  */
 LIBIMOBILEDEVICE_API_MSC int misagent_get_status_code(misagent_client_t client);
 
+/**
+ * Installs several provisioning profiles. The Install requests are
+ * pipelined on the connection instead of waiting for each result.
+ *
+ * @param client The connected misagent to use for installation
+ * @param profiles A PLIST_ARRAY of PLIST_DATA nodes, each containing a
+ *     provisioning profile to install.
+ * @param status_codes Optional array with one entry per profile that will
+ *     be set to the status code returned by the device for that profile,
+ *     0 on success or -1 if no result was received. Pass NULL if not needed.
+ *
+ * @return MISAGENT_E_SUCCESS if all profiles were installed,
+ *     MISAGENT_E_INVALID_ARG when one of the parameters is invalid, or the
+ *     MISAGENT_E_* error code of the first profile that failed to install.
+ *     misagent_get_status_code() returns the status code of that profile.
+ */
+LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_install_many(misagent_client_t client, plist_t profiles, int *status_codes);
+
+/**
+ * Creates a new profile cache used by misagent_copy_all_changed().
+ *
+ * @param state A state previously returned by
+ *     misagent_profile_cache_get_state() to continue from, or NULL to
+ *     start with an empty cache.
+ * @param cache Pointer that will point to a newly allocated cache upon
+ *     successful return. Must be freed with misagent_profile_cache_free().
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when cache
+ *     is NULL or state is not a PLIST_DICT.
+ */
+LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_profile_cache_new(plist_t state, misagent_profile_cache_t *cache);
+
+/**
+ * Gets the contents of a profile cache, so it can be stored and passed to
+ * misagent_profile_cache_new() later.
+ *
+ * @param cache The profile cache.
+ * @param state Pointer that will be set to a newly allocated PLIST_DICT
+ *     upon successful return. It is up to the caller to free it.
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when cache
+ *     or state is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_profile_cache_get_state(misagent_profile_cache_t cache, plist_t *state);
+
+/**
+ * Frees a profile cache.
+ *
+ * @param cache The profile cache to free.
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when cache
+ *     is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_profile_cache_free(misagent_profile_cache_t cache);
+
+/**
+ * Retrieves the provisioning profiles that were installed or removed since
+ * the last call for the same device. The cache remembers the hash and UUID
+ * of every profile per device, so only new profiles are decoded. A cache
+ * can be shared by several clients and threads.
+ *
+ * @note This uses the CopyAll command, which requires iOS 9.3 or later.
+ *
+ * @param client The connected misagent to use.
+ * @param cache The profile cache to compare against and update.
+ * @param added Pointer that will be set to a PLIST_ARRAY with a PLIST_DICT
+ *     for every new profile, containing the "UUID" and "Name" of the
+ *     profile if it could be decoded and the "Profile" data itself.
+ * @param removed Pointer that will be set to a PLIST_ARRAY with the UUIDs
+ *     of the profiles that were removed from the device.
+ *
+ * @return MISAGENT_E_SUCCESS on success, MISAGENT_E_INVALID_ARG when one of
+ *     the parameters is invalid, or an MISAGENT_E_* error code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC misagent_error_t misagent_copy_all_changed(misagent_client_t client, misagent_profile_cache_t cache, plist_t *added, plist_t *removed);
+
 #ifdef __cplusplus
 }
 #endif
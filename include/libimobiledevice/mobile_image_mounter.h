@@ -55,6 +55,22 @@ typedef mobile_image_mounter_client_private *mobile_image_mounter_client_t; /**<
 /** callback for image upload */
 typedef ssize_t (*mobile_image_mounter_upload_cb_t) (void* buffer, size_t length, void *user_data);
 
+/** Digest that can be computed over the image data while it is uploaded */
+typedef enum {
+	MOBILE_IMAGE_MOUNTER_DIGEST_NONE   = 0, /**< no digest */
+	MOBILE_IMAGE_MOUNTER_DIGEST_SHA1   = 1, /**< SHA-1, 20 bytes */
+	MOBILE_IMAGE_MOUNTER_DIGEST_SHA384 = 2  /**< SHA-384, 48 bytes */
+} mobile_image_mounter_digest_t;
+
+/** Chunk size used for uploads when none is given */
+#define MOBILE_IMAGE_MOUNTER_DEFAULT_CHUNK_SIZE (1024*1024)
+
+/** Upper limit for the chunk size of uploads */
+#define MOBILE_IMAGE_MOUNTER_MAX_CHUNK_SIZE (16*1024*1024)
+
+/** Size of a buffer that can hold any of the digests */
+#define MOBILE_IMAGE_MOUNTER_DIGEST_MAX_LENGTH 48
+
 /* Interface */
 
 /**
@@ -133,6 +149,51 @@ LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_looku
  */
 LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata);
 
+/**
+ * Uploads an image with an optional signature to the device, reading the next
+ * chunk through upload_cb while the previous one is being sent and optionally
+ * computing a digest of the image data on the way.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of image that is being uploaded.
+ * @param image_size Total size of the image.
+ * @param signature Buffer with a signature of the image being uploaded. If
+ *    NULL, no signature will be used.
+ * @param signature_size Total size of the image signature buffer. If 0, no
+ *    signature will be used.
+ * @param upload_cb Callback function that gets the data chunks for uploading
+ *    the image. It is invoked from a separate thread.
+ * @param userdata User defined data for the upload callback function.
+ * @param chunk_size Maximum number of bytes requested from upload_cb at once.
+ *    If 0, MOBILE_IMAGE_MOUNTER_DEFAULT_CHUNK_SIZE is used. Values above
+ *    MOBILE_IMAGE_MOUNTER_MAX_CHUNK_SIZE are clamped.
+ * @param digest_type The digest to compute, or MOBILE_IMAGE_MOUNTER_DIGEST_NONE.
+ * @param digest Buffer of at least MOBILE_IMAGE_MOUNTER_DIGEST_MAX_LENGTH bytes
+ *    that receives the digest of the uploaded data. Can be NULL if digest_type
+ *    is MOBILE_IMAGE_MOUNTER_DIGEST_NONE.
+ * @param digest_len Pointer that receives the length of the digest, can be NULL.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on succes, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_upload_image_with_options(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata, size_t chunk_size, mobile_image_mounter_digest_t digest_type, unsigned char *digest, size_t *digest_len);
+
+/**
+ * Tells if an image of the given type with the given signature is already
+ * mounted on the device.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of the image to look up.
+ * @param signature Buffer with the signature of the image.
+ * @param signature_size Size of the signature buffer.
+ * @param mounted Pointer that will be set to 1 if a matching image is
+ *    mounted, or 0 otherwise.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS on success, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_is_image_mounted(mobile_image_mounter_client_t client, const char *image_type, const char *signature, uint16_t signature_size, int *mounted);
+
 /**
  * Mounts an image on the device.
  *
@@ -156,6 +217,28 @@ LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_uploa
  */
 LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mounter_client_t client, const char *image_path, const char *signature, uint16_t signature_size, const char *image_type, plist_t *result);
 
+/**
+ * Makes sure an image is mounted on the device. If an image of the given
+ * type with the same signature is already mounted, neither the upload nor
+ * the mount is performed. Otherwise the image is uploaded with
+ * mobile_image_mounter_upload_image() and mounted from the staging path.
+ *
+ * @param client The connected mobile_image_mounter client.
+ * @param image_type Type of image that is being mounted.
+ * @param image_size Total size of the image.
+ * @param signature Buffer with the signature of the image.
+ * @param signature_size Size of the signature buffer.
+ * @param upload_cb Callback function that gets the data chunks for uploading
+ *    the image.
+ * @param userdata User defined data for the upload callback function.
+ * @param already_mounted Pointer that will be set to 1 if the image was
+ *    already mounted and nothing had to be done, can be NULL.
+ *
+ * @return MOBILE_IMAGE_MOUNTER_E_SUCCESS if the image is mounted, or a
+ *    MOBILE_IMAGE_MOUNTER_E_* error code otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC mobile_image_mounter_error_t mobile_image_mounter_ensure_mounted(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata, int *already_mounted);
+
 /**
  * Hangs up the connection to the mobile_image_mounter service.
  * This functions has to be called before freeing up a mobile_image_mounter
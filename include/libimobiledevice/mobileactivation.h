@@ -46,6 +46,45 @@ typedef enum {
 typedef struct mobileactivation_client_private mobileactivation_client_private;
 typedef mobileactivation_client_private *mobileactivation_client_t; /**< The client handle. */
 
+/** Kind of request passed to a mobileactivation_transport_cb_t */
+typedef enum {
+	MOBILEACTIVATION_REQUEST_SESSION    = 1, /**< session info, answered with the handshake response */
+	MOBILEACTIVATION_REQUEST_ACTIVATION = 2  /**< activation info, answered with the activation record */
+} mobileactivation_request_t;
+
+/**
+ * Sends a request of one device to the activation server and returns the
+ * server's response, used by mobileactivation_activate_batch().
+ *
+ * Calls with the same slot never overlap, so a transport can keep one HTTP
+ * keep-alive connection per slot.
+ *
+ * @param slot Transfer slot, between 0 and max_transfers - 1.
+ * @param udid The UDID of the device the request belongs to.
+ * @param request The kind of request.
+ * @param body The session info or activation info created by the device.
+ * @param response Set by the transport to the handshake response or the
+ *     activation record. Freed by the caller.
+ * @param headers Set by the transport to a dictionary with the HTTP
+ *     response headers of an activation record in session mode, or NULL.
+ *     Freed by the caller.
+ * @param user_data The user data passed to mobileactivation_activate_batch().
+ *
+ * @return MOBILEACTIVATION_E_SUCCESS on success, or an MOBILEACTIVATION_E_*
+ *     error code that is reported for the device.
+ */
+typedef mobileactivation_error_t (*mobileactivation_transport_cb_t) (unsigned int slot, const char *udid, mobileactivation_request_t request, plist_t body, plist_t *response, plist_t *headers, void *user_data);
+
+/**
+ * Reports the outcome for one device of mobileactivation_activate_batch().
+ *
+ * @param udid The UDID of the device.
+ * @param error MOBILEACTIVATION_E_SUCCESS if the device is activated, or an
+ *     MOBILEACTIVATION_E_* error code otherwise.
+ * @param user_data The user data passed to mobileactivation_activate_batch().
+ */
+typedef void (*mobileactivation_batch_cb_t) (const char *udid, mobileactivation_error_t error, void *user_data);
+
 /**
  * Connects to the mobileactivation service on the specified device.
  *
@@ -184,6 +223,37 @@ LIBIMOBILEDEVICE_API_MSC mobileactivation_error_t mobileactivation_activate_with
  */
 LIBIMOBILEDEVICE_API_MSC mobileactivation_error_t mobileactivation_deactivate(mobileactivation_client_t client);
 
+/**
+ * Activates a number of devices, overlapping the work on the devices with
+ * the round trips to the activation server. While some devices wait for the
+ * server, others already create their activation info.
+ *
+ * Every device keeps one lockdownd session and one mobileactivation
+ * connection for the whole activation. Devices that are already activated
+ * are reported as successful without contacting the server.
+ *
+ * This function returns when all devices are done.
+ *
+ * @param udids The UDIDs of the devices.
+ * @param count Number of entries in udids.
+ * @param use_session Non-zero to activate in 'session' mode, which needs an
+ *     additional MOBILEACTIVATION_REQUEST_SESSION round trip per device.
+ * @param max_devices Maximum number of devices handled at the same time,
+ *     or 0 for the default of 16.
+ * @param max_transfers Maximum number of concurrent server requests, which
+ *     is also the number of transport slots, or 0 for the default of 4.
+ * @param transport Performs the requests to the activation server.
+ * @param callback Invoked once per device with its outcome, from a worker
+ *     thread. Callbacks of different devices can run concurrently.
+ * @param user_data User data for transport and callback or NULL.
+ *
+ * @return MOBILEACTIVATION_E_SUCCESS once all devices were handled,
+ *     regardless of their individual outcome, MOBILEACTIVATION_E_INVALID_ARG
+ *     when an argument is invalid, or MOBILEACTIVATION_E_UNKNOWN_ERROR if
+ *     the workers could not be created.
+ */
+LIBIMOBILEDEVICE_API_MSC mobileactivation_error_t mobileactivation_activate_batch(const char **udids, uint32_t count, int use_session, uint32_t max_devices, uint32_t max_transfers, mobileactivation_transport_cb_t transport, mobileactivation_batch_cb_t callback, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
@@ -44,6 +44,7 @@ typedef enum {
 	MOBILEBACKUP2_E_BAD_VERSION       = -6,
 	MOBILEBACKUP2_E_REPLY_NOT_OK      = -7,
 	MOBILEBACKUP2_E_NO_COMMON_VERSION = -8,
+	MOBILEBACKUP2_E_BLOCK_TOO_LARGE   = -9,
 	MOBILEBACKUP2_E_UNKNOWN_ERROR     = -256
 } mobilebackup2_error_t;
 
@@ -144,6 +145,47 @@ LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_receive_message(mob
  */
 LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, const char *data, uint32_t length, uint32_t *bytes);
 
+/**
+ * Send binary data from multiple buffers to the device.
+ * The buffers are sent in order with as few writes as possible, which
+ * allows e.g. a chunk header and the chunk data to go out together.
+ *
+ * @note This function returns MOBILEBACKUP2_E_SUCCESS even if less than the
+ *     requested length has been sent. The fourth parameter is required and
+ *     must be checked to ensure if the whole data has been sent.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param iov Array of buffers to send
+ * @param iovcnt Number of elements in iov
+ * @param bytes Total number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *bytes);
+
+/**
+ * Send part of a file to the device. Where the connection allows it the
+ * data goes from the file to the connection without being copied through
+ * a userspace buffer.
+ *
+ * @note This function returns MOBILEBACKUP2_E_SUCCESS even if less than the
+ *     requested length has been sent. The fifth parameter is required and
+ *     must be checked to ensure if the whole data has been sent.
+ *
+ * @param client The MobileBackup client to send to.
+ * @param fd File descriptor of the file to send, opened for reading.
+ * @param offset Position in the file to start sending from.
+ * @param length Number of bytes to send.
+ * @param bytes Number of bytes actually sent
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if any data was successfully sent,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     or MOBILEBACKUP2_E_MUX_ERROR if sending of the data failed.
+ */
+LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_send_file(mobilebackup2_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *bytes);
+
 /**
  * Receive binary from the device.
  *
@@ -164,6 +206,53 @@ LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_send_raw(mobileback
  */
 LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_receive_raw(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t *bytes);
 
+/**
+ * Receive one block of a file transfer from the device.
+ * A block consists of a 4 byte big endian length, a one byte code
+ * (e.g. file data, success, or a remote error) and the payload. The whole
+ * block is received with as few reads as possible, together with the
+ * length field of the block that follows it, which is handed out by the
+ * next call to mobilebackup2_receive_block() or mobilebackup2_receive_raw().
+ *
+ * @note Only use this function where the device is guaranteed to send
+ *     at least 4 more bytes after the block, like it does during a
+ *     file transfer.
+ *
+ * @param client The MobileBackup client to receive from.
+ * @param buffer Optional buffer to receive the block into. It is only used
+ *     if it can hold the payload plus 5 bytes, otherwise, or if NULL is
+ *     passed, a buffer owned by the client is used.
+ * @param buffer_size Size of buffer in bytes.
+ * @param data Set to the payload within buffer or the client owned buffer,
+ *     or to NULL if the device terminated the sequence of blocks.
+ *     Data in the client owned buffer is valid until the next call to this
+ *     function or until the client is freed.
+ * @param length Set to the length of the payload, which can be 0.
+ * @param code Set to the code of the block.
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if a block was received,
+ *     MOBILEBACKUP2_E_INVALID_ARG if one of the parameters is invalid,
+ *     MOBILEBACKUP2_E_BLOCK_TOO_LARGE if the device announced a block
+ *     larger than 64 MB, MOBILEBACKUP2_E_RECEIVE_TIMEOUT if the device
+ *     did not send the block in time, or MOBILEBACKUP2_E_MUX_ERROR if
+ *     receiving the data failed.
+ */
+LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_receive_block(mobilebackup2_client_t client, char *buffer, uint32_t buffer_size, char **data, uint32_t *length, char *code);
+
+/**
+ * Get the chunk size currently used for receiving from the device.
+ * It starts out larger for USB than for network connections and adapts
+ * to the rate data arrives with, which makes it a good size for chunks
+ * when sending files to the device as well.
+ *
+ * @param client The MobileBackup client to query.
+ * @param size Set to the chunk size in bytes.
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS on success, or MOBILEBACKUP2_E_INVALID_ARG
+ *     if client or size is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC mobilebackup2_error_t mobilebackup2_get_chunk_size(mobilebackup2_client_t client, uint32_t *size);
+
 /**
  * Performs the mobilebackup2 protocol version exchange.
  *
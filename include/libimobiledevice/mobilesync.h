@@ -59,6 +59,11 @@ typedef enum {
 	MOBILESYNC_SYNC_TYPE_RESET /**< Reset-sync signals that the computer should send all data again. */
 } mobilesync_sync_type_t;
 
+/** Flags for mobilesync_receive_changes_with_callback() */
+typedef enum {
+	MOBILESYNC_RECEIVE_ACK_EARLY = 1 << 0 /**< Acknowledge each batch before its records are processed */
+} mobilesync_receive_flags_t;
+
 typedef struct mobilesync_client_private mobilesync_client_private;
 typedef mobilesync_client_private *mobilesync_client_t; /**< The client handle */
 
@@ -68,6 +73,23 @@ typedef struct {
 } mobilesync_anchors;
 typedef mobilesync_anchors *mobilesync_anchors_t; /**< Anchors used by the device and computer. */
 
+typedef struct mobilesync_store_private mobilesync_store_private;
+typedef mobilesync_store_private *mobilesync_store_t; /**< Host-side anchors and record hashes of a data class */
+
+/**
+ * Callback for each record received by mobilesync_receive_changes_with_callback().
+ * The record and actions are only valid while the callback runs, use
+ * plist_copy() to keep them.
+ *
+ * @param record_id The identifier of the record
+ * @param record The record as a PLIST_DICT
+ * @param actions Additional flags the device sent with the batch, or NULL
+ * @param user_data The user data passed to mobilesync_receive_changes_with_callback()
+ *
+ * @return 0 to continue, any other value to stop receiving
+ */
+typedef int (*mobilesync_record_cb_t)(const char *record_id, plist_t record, plist_t actions, void *user_data);
+
 /* Interface */
 
 /**
@@ -236,6 +258,31 @@ LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_clear_all_records_on_devi
  */
 LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions);
 
+/**
+ * Receives all changed entities of the currently set data class from the
+ * device and passes each record to a callback as it is taken from the
+ * received batch, without copying the batch. Every batch is acknowledged to
+ * the device, so neither mobilesync_receive_changes() nor
+ * mobilesync_acknowledge_changes_from_device() are used with this function.
+ *
+ * By default a batch is acknowledged after all of its records went through
+ * the callback. With MOBILESYNC_RECEIVE_ACK_EARLY it is acknowledged right
+ * away, so the device prepares and sends the next batch while the host is
+ * still processing the current one.
+ *
+ * @param client The mobilesync client
+ * @param flags A combination of mobilesync_receive_flags_t values or 0
+ * @param callback The callback to call for each record
+ * @param user_data Data to pass to the callback
+ *
+ * @retval MOBILESYNC_E_SUCCESS if all changes have been received
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_CANCELLED if the device cancelled the session or the
+ * callback requested to stop, the session should be cancelled with
+ * mobilesync_cancel() in the latter case
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, uint32_t flags, mobilesync_record_cb_t callback, void *user_data);
+
 /**
  * Acknowledges to the device that the changes have been merged on the computer
  *
@@ -300,6 +347,131 @@ LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_send_changes(mobilesync_c
  */
 LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_remap_identifiers(mobilesync_client_t client, plist_t *mapping);
 
+/* Persistent sync store */
+
+/**
+ * Opens the host-side sync store of a data class. The store keeps the
+ * anchors of the last completed session together with a hash of every
+ * record, so later sessions are started as fast syncs and records that
+ * did not change since they were last seen are not processed again.
+ * Use one file per device, it can hold the stores of several data classes.
+ *
+ * @param filename The file the store is kept in. A missing file is created
+ *     when the store is committed.
+ * @param data_class The data class, e.g. "com.apple.Contacts".
+ * @param store Pointer that will be set to a newly allocated
+ *     #mobilesync_store_t. Must be freed using mobilesync_store_free().
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_open(const char *filename, const char *data_class, mobilesync_store_t *store);
+
+/**
+ * Frees a sync store without writing pending changes.
+ *
+ * @param store The store to free.
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if store is NULL
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_free(mobilesync_store_t store);
+
+/**
+ * Starts synchronization of the data class of the store with the anchors
+ * of the last committed session, see mobilesync_start(). If the device
+ * still requests a slow or reset sync, all records it sends are compared
+ * against the stored hashes and records it no longer has can be queried
+ * with mobilesync_store_get_removed().
+ *
+ * @param client The mobilesync client
+ * @param store The sync store of the data class to synchronize
+ * @param computer_data_class_version The version of the data class storage on the computer
+ * @param sync_type A pointer to store the sync type reported by the device or NULL
+ * @param device_data_class_version The version of the data class storage on the device or NULL
+ * @param error_description A pointer to store an error message if reported by the device
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ * @retval MOBILESYNC_E_SYNC_REFUSED if the device refused to sync
+ * @retval MOBILESYNC_E_CANCELLED if the device explicitly cancelled the
+ * sync request
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_start(mobilesync_client_t client, mobilesync_store_t store, uint64_t computer_data_class_version, mobilesync_sync_type_t *sync_type, uint64_t *device_data_class_version, char** error_description);
+
+/**
+ * Checks a record against the stored hash and records its new hash.
+ *
+ * @param store The sync store
+ * @param record_id The identifier of the record
+ * @param record The record as a PLIST_DICT
+ * @param changed Set to 1 if the record is new or changed, 0 otherwise
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_record_changed(mobilesync_store_t store, const char *record_id, plist_t record, uint8_t *changed);
+
+/**
+ * Removes a record from the store, e.g. after it was deleted on the device.
+ *
+ * @param store The sync store
+ * @param record_id The identifier of the record
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_remove_record(mobilesync_store_t store, const char *record_id);
+
+/**
+ * Lists the stored records the device did not send during a slow or reset
+ * sync, which means they were removed on the device. After a fast sync the
+ * list is always empty.
+ *
+ * @note Only complete once all changes have been received.
+ *
+ * @param store The sync store
+ * @param removed A pointer to store a PLIST_ARRAY of record identifiers,
+ *     to be freed with plist_free().
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_get_removed(mobilesync_store_t store, plist_t *removed);
+
+/**
+ * Receives all changed entities like mobilesync_receive_changes_with_callback()
+ * but only passes on records that are new or changed according to the
+ * store. Entries that are not a PLIST_DICT are deletions, they are always
+ * passed on and dropped from the store.
+ *
+ * @param client The mobilesync client
+ * @param store The sync store passed to mobilesync_store_start()
+ * @param flags A combination of mobilesync_receive_flags_t values or 0
+ * @param callback The callback to call for each changed record
+ * @param user_data Data to pass to the callback
+ *
+ * @retval MOBILESYNC_E_SUCCESS if all changes have been received
+ * @retval MOBILESYNC_E_INVALID_ARG if one of the parameters is invalid or
+ * the session was not started with mobilesync_store_start()
+ * @retval MOBILESYNC_E_CANCELLED if the device cancelled the session or the
+ * callback requested to stop
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_receive_changes_with_store(mobilesync_client_t client, mobilesync_store_t store, uint32_t flags, mobilesync_record_cb_t callback, void *user_data);
+
+/**
+ * Writes the anchors of the current session and the record hashes to the
+ * store file. Call this after mobilesync_finish() succeeded, otherwise the
+ * next session would start from anchors the device never confirmed.
+ *
+ * @param store The sync store
+ *
+ * @retval MOBILESYNC_E_SUCCESS on success
+ * @retval MOBILESYNC_E_INVALID_ARG if no session was started with the store
+ * @retval MOBILESYNC_E_UNKNOWN_ERROR if the file could not be written
+ */
+LIBIMOBILEDEVICE_API_MSC mobilesync_error_t mobilesync_store_commit(mobilesync_store_t store);
+
 /* Helper */
 
 /**
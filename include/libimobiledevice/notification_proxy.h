@@ -189,6 +189,41 @@ LIBIMOBILEDEVICE_API_MSC np_error_t np_observe_notifications(np_client_t client,
  */
 LIBIMOBILEDEVICE_API_MSC np_error_t np_set_notify_callback(np_client_t client, np_notify_cb_t notify_cb, void *userdata);
 
+/**
+ * Invokes the callback set with np_set_notify_callback() on a separate
+ * thread, so a slow callback does not stall receiving notifications.
+ * Received notifications are queued in a lock-free ring the callback thread
+ * takes them from.
+ *
+ * Must be called while no callback is set. Removing the callback delivers
+ * what is still queued first, so np_set_notify_callback() and
+ * np_client_free() must not be called from the callback in this mode.
+ *
+ * @param client the NP client
+ * @param capacity Number of notifications the ring holds, rounded up to a
+ *        power of two. 0 invokes the callback on the receiving thread
+ *        again, which is the default.
+ * @param policy Whether to drop the oldest notification or stop receiving
+ *        while the ring is full.
+ *
+ * @return NP_E_SUCCESS on success, NP_E_INVALID_ARG when client is NULL or
+ *         policy is invalid, or NP_E_UNKNOWN_ERROR when a callback is set
+ *         or the ring could not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC np_error_t np_set_delivery(np_client_t client, uint32_t capacity, enum idevice_delivery_policy policy);
+
+/**
+ * Returns how many notifications were dropped because the ring set up with
+ * np_set_delivery() was full. The counter is reset by np_set_delivery().
+ *
+ * @param client the NP client
+ * @param dropped Set to the number of dropped notifications.
+ *
+ * @return NP_E_SUCCESS on success or NP_E_INVALID_ARG when client or
+ *         dropped is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC np_error_t np_get_dropped(np_client_t client, uint64_t *dropped);
+
 #ifdef __cplusplus
 }
 #endif
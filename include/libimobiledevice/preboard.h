@@ -42,6 +42,7 @@ typedef enum {
 	PREBOARD_E_NOT_ENOUGH_DATA = -5,
 	PREBOARD_E_TIMEOUT         = -6,
 	PREBOARD_E_OP_IN_PROGRESS  = -10,
+	PREBOARD_E_OP_FAILED       = -11,
 	PREBOARD_E_UNKNOWN_ERROR   = -256
 } preboard_error_t;
 
@@ -51,6 +52,20 @@ typedef preboard_client_private *preboard_client_t; /**< The client handle. */
 /** Reports the status response of the given command */
 typedef void (*preboard_status_cb_t) (plist_t message, void *user_data);
 
+/**
+ * Reports the outcome for one device of preboard_create_stashbag_batch().
+ *
+ * @param udid The UDID of the device.
+ * @param error PREBOARD_E_SUCCESS if the stashbag was created,
+ *     PREBOARD_E_OP_FAILED if the device reported an error,
+ *     PREBOARD_E_TIMEOUT if the passcode was not entered in time,
+ *     or another PREBOARD_E_* error code if the device could not be reached.
+ * @param message The last status message that carried an error or
+ *     timeout, or NULL. Only valid during the callback.
+ * @param user_data The user data passed to preboard_create_stashbag_batch().
+ */
+typedef void (*preboard_batch_cb_t) (const char *udid, preboard_error_t error, plist_t message, void *user_data);
+
 /**
  * Connects to the preboard service on the specified device.
  *
@@ -151,8 +166,13 @@ LIBIMOBILEDEVICE_API_MSC preboard_error_t preboard_receive_with_timeout(preboard
  *     { Error: 1, ErrorString: <error string> }
  *     followed by { HideDialog: true }
  *
+ * Status messages are received on an event loop shared by all clients, so
+ * no thread is kept per client while waiting for the passcode.
+ *
  * @return PREBOARD_E_SUCCESS if the command was successfully submitted,
  *  PREBOARD_E_INVALID_ARG when client is invalid,
+ *  PREBOARD_E_OP_IN_PROGRESS if status messages of a previous command are
+ *  still delivered to a callback,
  *  or a PREBOARD_E_* error code on error.
  */
 LIBIMOBILEDEVICE_API_MSC preboard_error_t preboard_create_stashbag(preboard_client_t client, plist_t manifest, preboard_status_cb_t status_cb, void *user_data);
@@ -174,10 +194,33 @@ LIBIMOBILEDEVICE_API_MSC preboard_error_t preboard_create_stashbag(preboard_clie
  *
  * @return PREBOARD_E_SUCCESS if the command was successfully submitted,
  *  PREBOARD_E_INVALID_ARG when client is invalid,
+ *  PREBOARD_E_OP_IN_PROGRESS if status messages of a previous command are
+ *  still delivered to a callback,
  *  or a PREBOARD_E_* error code on error.
  */
 LIBIMOBILEDEVICE_API_MSC preboard_error_t preboard_commit_stashbag(preboard_client_t client, plist_t manifest, preboard_status_cb_t status_cb, void *user_data);
 
+/**
+ * Creates a stashbag on each of the given devices, e.g. to prepare a number
+ * of devices for an update at once. Every device is connected to, asked to
+ * create a stashbag, and followed until the passcode dialog is dismissed.
+ * This function returns when all devices are done.
+ *
+ * @param udids The UDIDs of the devices.
+ * @param count Number of entries in udids.
+ * @param manifest An optional manifest, sent to every device.
+ * @param max_concurrent Maximum number of devices handled at the same time,
+ *     or 0 for the default of 8.
+ * @param callback Invoked once per device with its outcome, from a worker
+ *     thread. Callbacks of different devices can run concurrently.
+ * @param user_data User data for the callback or NULL.
+ *
+ * @return PREBOARD_E_SUCCESS once all devices were handled, regardless of
+ *  their individual outcome, PREBOARD_E_INVALID_ARG when an argument is
+ *  invalid, or PREBOARD_E_UNKNOWN_ERROR if the workers could not be created.
+ */
+LIBIMOBILEDEVICE_API_MSC preboard_error_t preboard_create_stashbag_batch(const char **udids, uint32_t count, plist_t manifest, uint32_t max_concurrent, preboard_batch_cb_t callback, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
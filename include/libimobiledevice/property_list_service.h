@@ -39,12 +39,28 @@ typedef enum {
 	PROPERTY_LIST_SERVICE_E_SSL_ERROR       = -4,
 	PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT = -5,
 	PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA = -6,
+	PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE = -7,
 	PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR   = -256
 } property_list_service_error_t;
 
 typedef struct property_list_service_client_private property_list_service_private;
 typedef property_list_service_private* property_list_service_client_t; /**< The client handle. */
 
+/**
+ * Reports the completion of a single request submitted with
+ * property_list_service_send_receive_pipelined().
+ *
+ * @param index The index of the request in the submitted array.
+ * @param reply The reply received for the request, or NULL if the request
+ *     failed. The reply is owned by the library and is freed after the
+ *     callback returns; use plist_copy() to keep it.
+ * @param status PROPERTY_LIST_SERVICE_E_SUCCESS if a reply was received,
+ *     or the error that caused the request to fail.
+ * @param user_data The user data pointer passed to
+ *     property_list_service_send_receive_pipelined().
+ */
+typedef void (*property_list_service_reply_cb_t)(uint32_t index, plist_t reply, property_list_service_error_t status, void *user_data);
+
 /* Interface */
 
 /**
@@ -140,6 +156,66 @@ LIBIMOBILEDEVICE_API_MSC property_list_service_error_t property_list_service_rec
  */
 LIBIMOBILEDEVICE_API_MSC property_list_service_error_t property_list_service_receive_plist(property_list_service_client_t client, plist_t *plist);
 
+/**
+ * Receives the raw data of a plist message without parsing it, for callers
+ * that only forward or store the data.
+ *
+ * @param client The property list service client to use for receiving
+ * @param data Pointer that will be set to a newly allocated buffer holding
+ *     the message data (binary or XML plist) upon successful return. The
+ *     caller is responsible for freeing it.
+ * @param length Pointer that will be set to the length of the data.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more parameters are
+ *     invalid, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection
+ *     times out, PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE when the message
+ *     exceeds the maximum message size, PROPERTY_LIST_SERVICE_E_MUX_ERROR when
+ *     a communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
+ *     when an unspecified error occurs.
+ */
+LIBIMOBILEDEVICE_API_MSC property_list_service_error_t property_list_service_receive_raw_plist(property_list_service_client_t client, char **data, uint32_t *length, unsigned int timeout);
+
+/**
+ * Sets the maximum size of a single message the client will accept.
+ * A message with a larger announced length is rejected with
+ * PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE before any memory is allocated
+ * for it; the connection is out of sync afterwards and should be closed.
+ * The default limit is 64 MB.
+ *
+ * @param client The property list service client.
+ * @param max_size The maximum message size in bytes, or 0 for no limit.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success, or
+ *     PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t max_size);
+
+/**
+ * Sends a series of plists and receives their replies in order, keeping
+ * several requests in flight instead of waiting for each reply before
+ * sending the next request. This only works with services that answer each
+ * request with exactly one reply, in the order the requests were received.
+ *
+ * @param client The property list service client to use.
+ * @param requests Array of plists to send.
+ * @param count Number of plists in the requests array.
+ * @param binary 1 to send binary plists, 0 to send XML plists.
+ * @param window Maximum number of requests awaiting a reply at any time,
+ *     or 0 to send all requests before receiving the first reply.
+ * @param callback Function that is called with the reply for each request,
+ *     in request order. If the transfer fails, it is called with the error
+ *     for every request that did not receive a reply.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS when a reply was received for
+ *     every request, PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more
+ *     parameters are invalid, or the error of the first failed send or
+ *     receive operation.
+ */
+LIBIMOBILEDEVICE_API_MSC property_list_service_error_t property_list_service_send_receive_pipelined(property_list_service_client_t client, plist_t *requests, uint32_t count, int binary, uint32_t window, property_list_service_reply_cb_t callback, void *user_data);
+
 /**
  * Enable SSL for the given property list service client.
  *
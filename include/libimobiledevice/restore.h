@@ -45,6 +45,17 @@ typedef enum {
 typedef struct restored_client_private restored_client_private;
 typedef restored_client_private *restored_client_t; /**< The client handle. */
 
+typedef struct restored_subscription_context* restored_subscription_context_t; /**< A restore mode event subscription handle. */
+
+/**
+ * Callback to notify when a device running restored becomes available.
+ *
+ * @param udid The UDID of the device.
+ * @param version The restore protocol version reported by the device.
+ * @param user_data The user data pointer passed to restored_event_subscribe().
+ */
+typedef void (*restored_event_cb_t)(const char *udid, uint64_t version, void *user_data);
+
 /* Interface */
 
 /**
@@ -92,6 +103,25 @@ LIBIMOBILEDEVICE_API_MSC restored_error_t restored_query_type(restored_client_t
  */
 LIBIMOBILEDEVICE_API_MSC restored_error_t restored_query_value(restored_client_t client, const char *key, plist_t *value);
 
+/**
+ * Queries multiple values from the device at once. The QueryValue requests
+ * are pipelined on the restored connection, so this costs about one round
+ * trip instead of one per value.
+ *
+ * @param client An initialized restored client.
+ * @param keys Array of count key names to request
+ * @param count Number of values to query
+ * @param values Array of count plist_t that will be set to the result value
+ *    nodes, or NULL for values the device did not return. Free each with
+ *    plist_free().
+ *
+ * @return RESTORE_E_SUCCESS if the requests were sent and the responses
+ *    received (individual values may still be NULL), RESTORE_E_INVALID_ARG
+ *    when client, keys, values or one of the keys is NULL, or an error code
+ *    on communication failure in which case all values are NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC restored_error_t restored_query_values(restored_client_t client, const char **keys, uint32_t count, plist_t *values);
+
 /**
  * Retrieves a value from information plist specified by a key.
  *
@@ -161,6 +191,39 @@ LIBIMOBILEDEVICE_API_MSC restored_error_t restored_start_restore(restored_client
  */
 LIBIMOBILEDEVICE_API_MSC restored_error_t restored_reboot(restored_client_t client);
 
+/**
+ * Calls the given callback whenever a device in restore mode becomes
+ * available. Every device that is attached via USB is probed with
+ * restored_query_type() as soon as it appears, so a restore can be started
+ * without polling for devices. The probe is retried for a few seconds while
+ * restored is not yet accepting connections.
+ *
+ * @note The callback is called from a library worker thread and may connect
+ *    to the device right away.
+ *
+ * @param context A pointer to a restored_subscription_context_t that will
+ *    be set to the new subscription.
+ * @param callback The callback function to call.
+ * @param user_data Application-specific data passed to the callback.
+ *
+ * @return RESTORE_E_SUCCESS on success or RESTORE_E_INVALID_ARG when context
+ *    or callback is NULL, RESTORE_E_MUX_ERROR when device events could not
+ *    be subscribed to.
+ */
+LIBIMOBILEDEVICE_API_MSC restored_error_t restored_event_subscribe(restored_subscription_context_t *context, restored_event_cb_t callback, void *user_data);
+
+/**
+ * Ends a subscription created with restored_event_subscribe(). Waits for
+ * probes that are still running, the callback is not called anymore once
+ * this function returns.
+ *
+ * @param context The subscription to end.
+ *
+ * @return RESTORE_E_SUCCESS on success or RESTORE_E_INVALID_ARG when context
+ *    is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC restored_error_t restored_event_unsubscribe(restored_subscription_context_t context);
+
 /* Helper */
 
 /**
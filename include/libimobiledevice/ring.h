@@ -0,0 +1,161 @@
+/**
+ * @file libimobiledevice/ring.h
+ * @brief Submit operations on many connections and reap their completions.
+ * \internal
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IRING_H
+#define IRING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/afc.h>
+#include <libimobiledevice/property_list_service.h>
+
+typedef struct idevice_ring_private idevice_ring_private;
+typedef idevice_ring_private *idevice_ring_t; /**< The ring handle. */
+
+/** Operations that can be submitted to a ring */
+typedef enum {
+	IDEVICE_RING_OP_NOP = 0,           /**< completes right away, e.g. to wake the reaper */
+	IDEVICE_RING_OP_AFC_READ,          /**< afc_file_read() */
+	IDEVICE_RING_OP_AFC_WRITE,         /**< afc_file_write() */
+	IDEVICE_RING_OP_AFC_STAT,          /**< afc_get_file_info_struct() */
+	IDEVICE_RING_OP_LOCKDOWN_GET_VALUE,/**< lockdownd_get_value() */
+	IDEVICE_RING_OP_PLIST_REQUEST      /**< sends a plist and receives the reply */
+} idevice_ring_op_t;
+
+/**
+ * Describes an operation to submit. All buffers and strings must stay valid
+ * until the completion of the operation was reaped.
+ */
+typedef struct {
+	idevice_ring_op_t op;
+	/** afc_client_t, lockdownd_client_t or property_list_service_client_t */
+	void *client;
+	/** passed back unchanged in the completion */
+	uint64_t user_data;
+	union {
+		/** IDEVICE_RING_OP_AFC_READ and IDEVICE_RING_OP_AFC_WRITE */
+		struct {
+			uint64_t handle;
+			char *data;
+			uint32_t length;
+		} afc_rw;
+		/** IDEVICE_RING_OP_AFC_STAT */
+		struct {
+			const char *path;
+			afc_file_info_t *info; /**< filled on success */
+		} afc_stat;
+		/** IDEVICE_RING_OP_LOCKDOWN_GET_VALUE */
+		struct {
+			const char *domain;
+			const char *key;
+		} get_value;
+		/** IDEVICE_RING_OP_PLIST_REQUEST, the request is not freed */
+		struct {
+			plist_t request;
+		} plist;
+	} args;
+} idevice_ring_sqe_t;
+
+/** Result of a completed operation */
+typedef struct {
+	uint64_t user_data;
+	idevice_ring_op_t op;
+	/** the AFC_E_*, LOCKDOWN_E_* or PROPERTY_LIST_SERVICE_E_* result */
+	int32_t result;
+	/** bytes read or written by AFC operations */
+	uint32_t bytes;
+	/** the value or reply of lockdownd and plist operations, to be freed by the caller */
+	plist_t plist;
+} idevice_ring_cqe_t;
+
+/* Interface */
+
+/**
+ * Creates a ring that runs submitted operations on a pool of worker
+ * threads. Operations on the same client run one at a time in the order
+ * they were submitted, operations on different clients run concurrently.
+ * All submission and completion slots are allocated up front, so
+ * submitting and reaping operations does not allocate memory.
+ *
+ * @param ring Pointer that will be set to the new ring.
+ * @param entries Maximum number of operations submitted and not reaped yet.
+ * @param num_threads Number of worker threads, or 0 for the default of 4.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if ring is
+ *     NULL or entries is 0, or IDEVICE_E_UNKNOWN_ERROR if the ring could not
+ *     be set up.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_ring_new(idevice_ring_t *ring, uint32_t entries, unsigned int num_threads);
+
+/**
+ * Waits for running operations to finish and frees the ring. Operations
+ * that did not start yet are dropped, completions that were not reaped are
+ * released, including their plists.
+ *
+ * @param ring The ring to free.
+ *
+ * @return IDEVICE_E_SUCCESS on success, or IDEVICE_E_INVALID_ARG if ring is
+ *     NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_ring_free(idevice_ring_t ring);
+
+/**
+ * Submits operations. The descriptors are copied, so the array can be
+ * reused right away.
+ *
+ * @param ring The ring.
+ * @param sqes Array of operations to submit.
+ * @param count Number of entries in sqes.
+ * @param submitted Set to the number of operations submitted, which is less
+ *     than count when the ring is full.
+ *
+ * @return IDEVICE_E_SUCCESS on success, or IDEVICE_E_INVALID_ARG if an
+ *     argument is invalid or an operation lacks its client.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_ring_submit(idevice_ring_t ring, const idevice_ring_sqe_t *sqes, uint32_t count, uint32_t *submitted);
+
+/**
+ * Reaps completions in the order the operations completed.
+ *
+ * @param ring The ring.
+ * @param cqes Array that will be filled with completions.
+ * @param count Maximum number of completions to reap.
+ * @param min_complete Number of completions to wait for, at most count.
+ *     0 returns right away.
+ * @param timeout Maximum time in milliseconds to wait, 0 for no limit.
+ * @param reaped Set to the number of completions stored in cqes.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_TIMEOUT if fewer than
+ *     min_complete completions arrived in time, or IDEVICE_E_INVALID_ARG if
+ *     an argument is invalid.
+ */
+LIBIMOBILEDEVICE_API_MSC idevice_error_t idevice_ring_reap(idevice_ring_t ring, idevice_ring_cqe_t *cqes, uint32_t count, uint32_t min_complete, unsigned int timeout, uint32_t *reaped);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
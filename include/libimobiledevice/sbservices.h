@@ -56,6 +56,25 @@ typedef enum {
 typedef struct sbservices_client_private sbservices_client_private;
 typedef sbservices_client_private *sbservices_client_t; /**< The client handle. */
 
+/** Number of icon requests kept in flight by sbservices_get_icons_pngdata() */
+#define SBSERVICES_ICON_PIPELINE_WINDOW 8
+
+/**
+ * Receives the icon of a single app requested with
+ * sbservices_get_icons_pngdata().
+ *
+ * @param bundle_id The bundle identifier of the app.
+ * @param pngdata The PNG data of the icon, or NULL if status is not
+ *     SBSERVICES_E_SUCCESS. The buffer is owned by the library and is only
+ *     valid until the callback returns.
+ * @param pngsize The size of the PNG data.
+ * @param status SBSERVICES_E_SUCCESS if the icon was retrieved, or the
+ *     error that occurred for this app.
+ * @param user_data The user data pointer passed to
+ *     sbservices_get_icons_pngdata().
+ */
+typedef void (*sbservices_icon_cb_t)(const char *bundle_id, const char *pngdata, uint64_t pngsize, sbservices_error_t status, void *user_data);
+
 /* Interface */
 
 /**
@@ -142,6 +161,51 @@ LIBIMOBILEDEVICE_API_MSC sbservices_error_t sbservices_set_icon_state(sbservices
  */
 LIBIMOBILEDEVICE_API_MSC sbservices_error_t sbservices_get_icon_pngdata(sbservices_client_t client, const char *bundleId, char **pngdata, uint64_t *pngsize);
 
+/**
+ * Get the icons of several apps as PNG data. The requests are pipelined on
+ * the connection, so this is much faster than calling
+ * sbservices_get_icon_pngdata() for each app.
+ *
+ * @note The callback is invoked while the client is locked and must not use
+ *     the client.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundle_ids NULL-terminated array of the bundle identifiers of the
+ *     apps to retrieve the icons for.
+ * @param callback Function that is called with the icon of each app, in
+ *     the order of bundle_ids.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundle_ids, or callback are invalid, or an SBSERVICES_E_*
+ *     error code if the connection failed.
+ */
+LIBIMOBILEDEVICE_API_MSC sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundle_ids, sbservices_icon_cb_t callback, void *user_data);
+
+/**
+ * Get the icons of several apps as PNG data like
+ * sbservices_get_icons_pngdata(), using an on-disk cache. Icons are cached
+ * per bundle identifier and app version, so an icon is only fetched from
+ * the device again when the app was updated. Icons found in the cache are
+ * reported before the icons that have to be fetched from the device.
+ *
+ * @param client The connected sbservices client to use.
+ * @param bundle_ids NULL-terminated array of the bundle identifiers of the
+ *     apps to retrieve the icons for.
+ * @param versions Array with the version (e.g. CFBundleVersion) of each
+ *     app in bundle_ids. Icons of apps with a NULL version are not cached.
+ *     Pass NULL to disable the cache.
+ * @param cache_dir Existing directory to store the cached icons in, or NULL
+ *     to disable the cache.
+ * @param callback Function that is called with the icon of each app.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return SBSERVICES_E_SUCCESS on success, SBSERVICES_E_INVALID_ARG when
+ *     client, bundle_ids, or callback are invalid, or an SBSERVICES_E_*
+ *     error code if the connection failed.
+ */
+LIBIMOBILEDEVICE_API_MSC sbservices_error_t sbservices_get_icons_pngdata_cached(sbservices_client_t client, const char **bundle_ids, const char **versions, const char *cache_dir, sbservices_icon_cb_t callback, void *user_data);
+
 /**
  * Gets the interface orientation of the device.
  *
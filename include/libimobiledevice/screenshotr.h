@@ -43,12 +43,28 @@ typedef enum {
 	SCREENSHOTR_E_SSL_ERROR       = -4,
 	SCREENSHOTR_E_RECEIVE_TIMEOUT = -5,
 	SCREENSHOTR_E_BAD_VERSION     = -6,
+	SCREENSHOTR_E_IMAGE_ERROR     = -7,
 	SCREENSHOTR_E_UNKNOWN_ERROR   = -256
 } screenshotr_error_t;
 
 typedef struct screenshotr_client_private screenshotr_client_private;
 typedef screenshotr_client_private *screenshotr_client_t; /**< The client handle. */
 
+typedef struct screenshotr_png_encoder_private screenshotr_png_encoder_private;
+typedef screenshotr_png_encoder_private *screenshotr_png_encoder_t; /**< The PNG encoder handle. */
+
+/**
+ * Callback receiving the frames of a screenshot stream.
+ *
+ * @param imgdata The image data of the frame. It is only valid until the
+ *     callback returns.
+ * @param imgsize The size of the image data.
+ * @param user_data The user data pointer passed to screenshotr_start_stream().
+ *
+ * @return 0 to receive more frames, or a non-zero value to stop the stream.
+ */
+typedef int (*screenshotr_frame_cb_t)(const char *imgdata, uint64_t imgsize, void *user_data);
+
 
 /**
  * Connects to the screenshotr service on the specified device.
@@ -110,6 +126,73 @@ LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_client_free(screenshotr
  */
 LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize);
 
+/**
+ * Continuously gets screen shots from the connected device and passes them
+ * to a callback until it asks to stop. The request for the next frame is
+ * already sent while the callback handles the current one, and no copy of
+ * the image data is made.
+ *
+ * @param client The connection screenshotr service client.
+ * @param interval Minimum time in milliseconds between two requests, or 0
+ *     to receive frames as fast as the device delivers them.
+ * @param callback The function receiving the frames.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return SCREENSHOTR_E_SUCCESS when the callback stopped the stream,
+ *     SCREENSHOTR_E_INVALID_ARG if one or more parameters are invalid, or
+ *     another error code if an error occurred.
+ */
+LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_start_stream(screenshotr_client_t client, unsigned int interval, screenshotr_frame_cb_t callback, void *user_data);
+
+/**
+ * Creates an encoder that converts screenshots to PNG. The encoder keeps its
+ * buffers and compression state between images, so converting the frames of
+ * a stream does not allocate memory once the first frame was converted.
+ *
+ * @param level The zlib compression level from 0 to 9, or -1 for the
+ *     default of 1, which is fast enough to keep up with a stream.
+ * @param encoder Pointer that will be set to the new encoder. Must be freed
+ *     using screenshotr_png_encoder_free() after use.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     encoder is NULL or level is out of range, or
+ *     SCREENSHOTR_E_UNKNOWN_ERROR otherwise, including when built without
+ *     zlib.
+ */
+LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_png_encoder_new(int level, screenshotr_png_encoder_t *encoder);
+
+/**
+ * Frees a PNG encoder and its buffers.
+ *
+ * @param encoder The encoder to free.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, or SCREENSHOTR_E_INVALID_ARG
+ *     if encoder is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_png_encoder_free(screenshotr_png_encoder_t encoder);
+
+/**
+ * Converts a screenshot to PNG. Uncompressed 8 bit RGB and RGBA TIFF images,
+ * as returned by older devices, are read strip by strip and compressed
+ * right away without an intermediate copy of the image. PNG data is passed
+ * through unchanged.
+ *
+ * @param encoder The PNG encoder.
+ * @param imgdata The image data, e.g. as returned by
+ *     screenshotr_take_screenshot() or passed to a screenshotr_frame_cb_t.
+ * @param imgsize The size of the image data.
+ * @param pngdata Pointer that will be set to the PNG data. It is owned by
+ *     the encoder and only valid until the next conversion, or points into
+ *     imgdata if that already was a PNG image.
+ * @param pngsize Pointer that will be set to the size of the PNG data.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success, SCREENSHOTR_E_INVALID_ARG if
+ *     one or more parameters are invalid, SCREENSHOTR_E_IMAGE_ERROR if the
+ *     image is malformed or uses a TIFF layout that is not supported, or
+ *     SCREENSHOTR_E_UNKNOWN_ERROR otherwise.
+ */
+LIBIMOBILEDEVICE_API_MSC screenshotr_error_t screenshotr_convert_to_png(screenshotr_png_encoder_t encoder, const char *imgdata, uint64_t imgsize, const char **pngdata, uint64_t *pngsize);
+
 /**
  * Frees the memory used by a screen shot
  *
@@ -47,6 +47,22 @@ typedef service_client_private* service_client_t; /**< The client handle. */
 
 #define SERVICE_CONSTRUCTOR(x) (int32_t (*)(idevice_t, lockdownd_service_descriptor_t, void**))(x)
 
+/**
+ * @name Scheduling weights
+ *
+ * For use with service_set_priority() and service_client_set_priority().
+ * Connections of the same device share the link in proportion to their
+ * weight while several of them are sending.
+ */
+/*@{*/
+#define SERVICE_WEIGHT_BULK        1  /**< backup, AFC and image transfers */
+#define SERVICE_WEIGHT_NORMAL      4  /**< services not classified otherwise */
+#define SERVICE_WEIGHT_INTERACTIVE 16 /**< lockdownd, debugserver, syslog and notifications */
+/*@}*/
+
+/** Service specific client constructor as used by the client factory functions. */
+typedef int32_t (*service_constructor_func_t)(idevice_t, lockdownd_service_descriptor_t, void**);
+
 /* Interface */
 
 /**
@@ -80,6 +96,154 @@ LIBIMOBILEDEVICE_API_MSC service_error_t service_client_new(idevice_t device, lo
  */
 LIBIMOBILEDEVICE_API_MSC service_error_t service_client_factory_start_service(idevice_t device, const char* service_name, void **client, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), int32_t *error_code);
 
+/**
+ * Starts several services on the specified device and connects to them.
+ * The services are started with pipelined requests in one lockdownd
+ * session, then all of them are connected at the same time.
+ *
+ * @param device The device to connect to.
+ * @param service_names NULL terminated array of the names of the services
+ *     to start.
+ * @param clients Array with one entry per service that will be set to the
+ *     new clients as created by the constructor functions, or NULL for
+ *     services that could not be started or connected.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param constructor_funcs Array with the service specific client
+ *     constructor for each service, NULL entries to create a plain
+ *     service_client_t, or NULL to create plain clients for all services.
+ * @param error_codes Array that will be set to the error codes returned by
+ *     the constructor functions, or NULL.
+ *
+ * @return SERVICE_E_SUCCESS if all clients were created,
+ *     SERVICE_E_INVALID_ARG when an argument is invalid, or
+ *     SERVICE_E_START_SERVICE_ERROR if any service failed.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_client_factory_start_services(idevice_t device, const char **service_names, void **clients, const char* label, const service_constructor_func_t *constructor_funcs, int32_t *error_codes);
+
+/**
+ * Callback invoked when a service started with
+ * service_client_factory_start_service_async() is ready or failed.
+ *
+ * @param device The device passed to
+ *     service_client_factory_start_service_async().
+ * @param client The new client as created by the constructor function, or
+ *     NULL on error. The callback takes ownership of it.
+ * @param result SERVICE_E_SUCCESS on success, or a SERVICE_E_* error code.
+ * @param error_code The error code returned by the constructor function.
+ * @param user_data The user data pointer passed to
+ *     service_client_factory_start_service_async().
+ */
+typedef void (*service_client_factory_cb_t)(idevice_t device, void *client, service_error_t result, int32_t error_code, void *user_data);
+
+/**
+ * Starts a new service on the specified device and connects to it like
+ * service_client_factory_start_service(), but without blocking the caller.
+ * The lockdownd request and the connect run on one of the worker threads of
+ * the given event loop, which also invokes the callback.
+ *
+ * @param loop The event loop to run the operation on.
+ * @param device The device to connect to. It must stay valid until the
+ *     callback has been invoked.
+ * @param service_name The name of the service to start.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param constructor_func The service specific client constructor, or NULL
+ *     to create a plain service_client_t.
+ * @param callback Function invoked with the result. If the event loop is
+ *     freed before the operation started, it is invoked with
+ *     SERVICE_E_START_SERVICE_ERROR.
+ * @param user_data Pointer that will be passed to the callback.
+ *
+ * @return SERVICE_E_SUCCESS if the operation was queued,
+ *     SERVICE_E_INVALID_ARG when one of the arguments is invalid, or
+ *     SERVICE_E_UNKNOWN_ERROR otherwise. The callback is only invoked when
+ *     the operation was queued.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_client_factory_start_service_async(idevice_event_loop_t loop, idevice_t device, const char* service_name, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), service_client_factory_cb_t callback, void *user_data);
+
+typedef struct service_reconnect_private service_reconnect_private;
+typedef service_reconnect_private* service_reconnect_t; /**< Handle of a reconnecting service. */
+
+/**
+ * Callback invoked by a reconnecting service whenever a new client was
+ * created, to set it up like the previous one, e.g. start a capture or
+ * observe notifications.
+ *
+ * @param device The device the client is connected to. It stays valid
+ *     until the client is handed to the disconnect callback.
+ * @param client The new client as created by the constructor function.
+ * @param user_data The user data pointer passed to service_reconnect_new().
+ *
+ * @return 0 if the client is ready, any other value to drop it and retry
+ *     later.
+ */
+typedef int (*service_reconnect_connect_cb_t)(idevice_t device, void *client, void *user_data);
+
+/**
+ * Callback invoked by a reconnecting service when a client has to be
+ * dropped. It has to free the client with its service specific function.
+ *
+ * @param client The client that was passed to the connect callback before.
+ * @param user_data The user data pointer passed to service_reconnect_new().
+ */
+typedef void (*service_reconnect_disconnect_cb_t)(void *client, void *user_data);
+
+/**
+ * Keeps a long-lived service like syslog_relay or notification_proxy
+ * connected. A background thread starts the service with
+ * service_client_factory_start_service() and hands the client to
+ * connect_cb. When the device is removed or service_reconnect_lost() is
+ * called, the client is handed to disconnect_cb and the service is started
+ * again as soon as the device is back, driven by the device events of
+ * idevice_events_subscribe(). Failed attempts are retried with jittered
+ * exponential backoff. Callbacks registered on the client by connect_cb
+ * thus keep working across disconnects.
+ *
+ * @param udid The UDID of the device, or NULL to use the first device
+ *     found and stick to it.
+ * @param options The lookup options for idevice_new_with_options().
+ * @param service_name The name of the service to start.
+ * @param label The label to use for communication. Usually the program name.
+ *  Pass NULL to disable sending the label in requests to lockdownd.
+ * @param constructor_func The service specific client constructor, or NULL
+ *     to create a plain service_client_t.
+ * @param connect_cb Function invoked with each new client.
+ * @param disconnect_cb Function invoked to free a client.
+ * @param user_data Pointer that will be passed to the callbacks.
+ * @param reconnect Pointer that will be set to the new handle. Free it with
+ *     service_reconnect_free().
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG when one of
+ *     the arguments is invalid, or SERVICE_E_UNKNOWN_ERROR otherwise. The
+ *     first connection is made in the background.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_reconnect_new(const char *udid, enum idevice_options options, const char* service_name, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), service_reconnect_connect_cb_t connect_cb, service_reconnect_disconnect_cb_t disconnect_cb, void *user_data, service_reconnect_t *reconnect);
+
+/**
+ * Tells a reconnecting service that its current client lost the
+ * connection, e.g. when a capture callback reports an error. The client is
+ * dropped and the service started again by the background thread. This may
+ * be called from any thread including the callbacks of the client.
+ *
+ * @param reconnect The reconnecting service.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG when
+ *     reconnect is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_reconnect_lost(service_reconnect_t reconnect);
+
+/**
+ * Stops a reconnecting service and drops its current client with the
+ * disconnect callback. Must not be called from one of its callbacks.
+ *
+ * @param reconnect The reconnecting service to free.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG when
+ *     reconnect is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_reconnect_free(service_reconnect_t reconnect);
+
 /**
  * Frees a service instance.
  *
@@ -107,6 +271,39 @@ LIBIMOBILEDEVICE_API_MSC service_error_t service_client_free(service_client_t cl
  */
 LIBIMOBILEDEVICE_API_MSC service_error_t service_send(service_client_t client, const char *data, uint32_t size, uint32_t *sent);
 
+/**
+ * Sends data from multiple buffers using the given service client.
+ *
+ * @param client The service client to use for sending.
+ * @param iov Array of buffers to send, in order.
+ * @param iovcnt Number of elements in iov.
+ * @param sent Total number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, or SERVICE_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent);
+
+/**
+ * Sends part of a file using the given service client, without copying
+ * it through userspace where the connection allows it.
+ *
+ * @param client The service client to use for sending.
+ * @param fd File descriptor of the file to send, opened for reading.
+ * @param offset Position in the file to start sending from.
+ * @param length Number of bytes to send.
+ * @param sent Number of bytes sent (can be NULL to ignore)
+ *
+ * @return SERVICE_E_SUCCESS on success,
+ *      SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, SERVICE_E_NOT_ENOUGH_DATA when the file ended early or
+ *      not all data could be sent, or SERVICE_E_UNKNOWN_ERROR when an
+ *      unspecified error occurs.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_send_file(service_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *sent);
+
 /**
  * Receives data using the given service client with specified timeout.
  *
@@ -179,6 +376,43 @@ LIBIMOBILEDEVICE_API_MSC service_error_t service_disable_ssl(service_client_t cl
  */
 LIBIMOBILEDEVICE_API_MSC service_error_t service_disable_bypass_ssl(service_client_t client, uint8_t sslBypass);
 
+/**
+ * Sets the scheduling weight and rate cap for connections to the given
+ * service on a device, overriding the default classification. Only affects
+ * services started with lockdownd afterwards.
+ *
+ * By default bulk services like mobilebackup2, AFC and the image mounter
+ * get SERVICE_WEIGHT_BULK, lockdownd, debugserver, syslog_relay and
+ * notification_proxy get SERVICE_WEIGHT_INTERACTIVE and everything else
+ * gets SERVICE_WEIGHT_NORMAL.
+ *
+ * @param device The device the setting applies to.
+ * @param service_name The name of the service, also matching names that
+ *     continue with a dot, like the .shim.remote variants.
+ * @param weight The weight, see SERVICE_WEIGHT_BULK and friends. Pass 0 to
+ *     restore the default classification.
+ * @param rate_limit Maximum number of bytes per second the connections may
+ *     send, or 0 for no limit.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG when device
+ *     or service_name is NULL, or SERVICE_E_UNKNOWN_ERROR when memory could
+ *     not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_set_priority(idevice_t device, const char *service_name, uint32_t weight, uint64_t rate_limit);
+
+/**
+ * Changes the scheduling weight and rate cap of a connected service client.
+ *
+ * @param client The service client.
+ * @param weight The weight, see SERVICE_WEIGHT_BULK and friends.
+ * @param rate_limit Maximum number of bytes per second the client may send,
+ *     or 0 for no limit.
+ *
+ * @return SERVICE_E_SUCCESS on success, SERVICE_E_INVALID_ARG when client
+ *     is NULL or weight is 0.
+ */
+LIBIMOBILEDEVICE_API_MSC service_error_t service_client_set_priority(service_client_t client, uint32_t weight, uint64_t rate_limit);
+
 #ifdef __cplusplus
 }
 #endif
@@ -50,6 +50,10 @@ typedef syslog_relay_client_private *syslog_relay_client_t; /**< The client hand
 /** Receives each character received from the device. */
 typedef void (*syslog_relay_receive_cb_t)(char c, void *user_data);
 
+/** Receives each complete log line received from the device. The line is
+ *  NUL-terminated and length does not include the terminating NUL byte. */
+typedef void (*syslog_relay_receive_lines_cb_t)(const char *line, uint32_t length, void *user_data);
+
 /* Interface */
 
 /**
@@ -130,6 +134,54 @@ LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_start_capture(syslog_
  */
 LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data);
 
+/**
+ * Starts capturing the syslog of the device using a callback that is invoked
+ * once for each complete log line.
+ * This function is like syslog_relay_start_capture_raw with the difference
+ * that the received data is read in bulk and split at the NUL bytes the
+ * device uses to terminate each log message, instead of invoking the
+ * callback for every single character.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog.
+ *
+ * @param client The syslog_relay client to use
+ * @param callback Callback to receive each complete line from the syslog.
+ *    The line buffer is only valid for the duration of the callback.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_lines_cb_t callback, void* user_data);
+
+/**
+ * Starts capturing the syslog of the device on an event loop instead of a
+ * dedicated thread. The callback is invoked from a worker thread of the
+ * loop once for each complete log line, like with
+ * syslog_relay_start_capture_lines(). This allows to capture the syslog of
+ * many devices with a fixed number of threads.
+ *
+ * When the connection is interrupted the callback is invoked a last time
+ * with line set to NULL and the capture ends.
+ *
+ * Use syslog_relay_stop_capture() to stop receiving the syslog. This must
+ * happen before the loop is freed.
+ *
+ * @param client The syslog_relay client to use
+ * @param loop The event loop to receive the syslog on
+ * @param callback Callback to receive each complete line from the syslog.
+ *    The line buffer is only valid for the duration of the callback.
+ * @param user_data Custom pointer passed to the callback function.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when an unspecified
+ *      error occurs or a syslog capture has already been started.
+ */
+LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_start_capture_lines_with_loop(syslog_relay_client_t client, idevice_event_loop_t loop, syslog_relay_receive_lines_cb_t callback, void* user_data);
+
 /**
  * Stops capturing the syslog of the device.
  *
@@ -144,6 +196,45 @@ LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_start_capture_raw(sys
  */
 LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client);
 
+/**
+ * Invokes the capture callback on a separate thread, so a slow callback
+ * does not stall receiving and the device side buffer does not overflow.
+ * The receiving thread queues each line (with
+ * syslog_relay_start_capture_lines()) or each chunk of received data (with
+ * syslog_relay_start_capture() and syslog_relay_start_capture_raw()) in a
+ * lock-free ring the callback thread takes them from.
+ *
+ * Must be called while no capture is running. Captures on an event loop are
+ * not affected. syslog_relay_stop_capture() delivers what is still queued
+ * before it returns and must not be called from the callback.
+ *
+ * @param client The syslog_relay client to use
+ * @param capacity Number of entries the ring holds, rounded up to a power
+ *    of two. 0 invokes the callback on the receiving thread again, which is
+ *    the default.
+ * @param policy Whether to drop the oldest entry or stop receiving while
+ *    the ring is full.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success,
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are
+ *      invalid or SYSLOG_RELAY_E_UNKNOWN_ERROR when a capture is running
+ *      or the ring could not be allocated.
+ */
+LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_set_delivery(syslog_relay_client_t client, uint32_t capacity, enum idevice_delivery_policy policy);
+
+/**
+ * Returns how many entries were dropped because the ring set up with
+ * syslog_relay_set_delivery() was full. The counter is reset when
+ * syslog_relay_set_delivery() is called.
+ *
+ * @param client The syslog_relay client to use
+ * @param dropped Set to the number of dropped entries.
+ *
+ * @return SYSLOG_RELAY_E_SUCCESS on success or
+ *      SYSLOG_RELAY_E_INVALID_ARG when one or more parameters are invalid.
+ */
+LIBIMOBILEDEVICE_API_MSC syslog_relay_error_t syslog_relay_get_dropped(syslog_relay_client_t client, uint64_t *dropped);
+
 /* Receiving */
 
 /**
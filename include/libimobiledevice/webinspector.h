@@ -48,6 +48,18 @@ typedef enum {
 typedef struct webinspector_client_private webinspector_client_private;
 typedef webinspector_client_private *webinspector_client_t; /**< The client handle. */
 
+/**
+ * Receives the messages reassembled by the message pump started with
+ * webinspector_start_pump().
+ *
+ * @param client The webinspector client the message was received on.
+ * @param message The received message, or NULL if an error occurred. The
+ *     callback takes ownership of it and must free it with plist_free().
+ * @param error WEBINSPECTOR_E_SUCCESS, or the error that stopped the pump.
+ * @param user_data The user data pointer passed to webinspector_start_pump().
+ */
+typedef void (*webinspector_message_cb_t)(webinspector_client_t client, plist_t message, webinspector_error_t error, void *user_data);
+
 
 /**
  * Connects to the webinspector service on the specified device.
@@ -129,6 +141,41 @@ LIBIMOBILEDEVICE_API_MSC webinspector_error_t webinspector_receive(webinspector_
  */
 LIBIMOBILEDEVICE_API_MSC webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms);
 
+/**
+ * Starts receiving messages without blocking the caller. The connection is
+ * watched by the given event loop, partial messages are reassembled in a
+ * buffer that is reused for all messages, and each complete message is
+ * passed to the callback on a worker thread of the loop.
+ *
+ * @note While the pump is running, webinspector_receive() must not be used.
+ *     Sending messages with webinspector_send() is fine.
+ *
+ * @param client The webinspector client
+ * @param loop The event loop to run the pump on
+ * @param callback Function that is called for every received message. If
+ *     receiving fails, it is called once with the error and the pump stops.
+ * @param user_data Pointer that will be passed to the callback
+ *
+ * @return WEBINSPECTOR_E_SUCCESS on success, WEBINSPECTOR_E_INVALID_ARG when
+ *     a parameter is invalid or the pump is already running, or
+ *     WEBINSPECTOR_E_UNKNOWN_ERROR if the connection could not be watched.
+ */
+LIBIMOBILEDEVICE_API_MSC webinspector_error_t webinspector_start_pump(webinspector_client_t client, idevice_event_loop_t loop, webinspector_message_cb_t callback, void *user_data);
+
+/**
+ * Stops the message pump started with webinspector_start_pump(). If the
+ * callback is running, this waits for it to return. This is done
+ * automatically by webinspector_client_free().
+ *
+ * @note Must not be called from within the message callback.
+ *
+ * @param client The webinspector client
+ *
+ * @return WEBINSPECTOR_E_SUCCESS on success, or WEBINSPECTOR_E_INVALID_ARG
+ *     when client is NULL.
+ */
+LIBIMOBILEDEVICE_API_MSC webinspector_error_t webinspector_stop_pump(webinspector_client_t client);
+
 #ifdef __cplusplus
 }
 #endif
@@ -27,9 +27,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <direct.h>
+#else
+#include <unistd.h>
+#endif
 
 #include "afc.h"
 #include "idevice.h"
+#include "trace.h"
 #include "common/debug.h"
 #include "endianness.h"
 
@@ -55,6 +64,344 @@ static void afc_unlock(afc_client_t client)
 	mutex_unlock(&client->mutex);
 }
 
+/**
+ * Normalizes a path for use as a cache key. AFC paths are relative to the
+ * root of the service, so "a/b", "/a/b" and "/a//b/" denote the same path.
+ *
+ * @return A newly allocated path, or NULL if out of memory.
+ */
+static char *afc_cache_normalize(const char *path)
+{
+	size_t len = strlen(path);
+	char *norm = (char*)malloc(len + 2);
+	size_t pos = 0;
+	size_t i;
+
+	if (!norm)
+		return NULL;
+	for (i = 0; i < len; i++) {
+		if (path[i] == '/') {
+			continue;
+		}
+		if (i == 0 || path[i-1] == '/') {
+			norm[pos++] = '/';
+		}
+		norm[pos++] = path[i];
+	}
+	if (pos == 0) {
+		norm[pos++] = '/';
+	}
+	norm[pos] = '\0';
+	return norm;
+}
+
+static uint32_t afc_cache_hash(enum afc_cache_kind kind, const char *path)
+{
+	/* FNV-1a */
+	uint32_t hash = 2166136261u ^ (uint32_t)kind;
+	for (; *path; path++) {
+		hash ^= (unsigned char)*path;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void afc_cache_entry_free(struct afc_cache_entry *entry)
+{
+	free(entry->data);
+	free(entry->path);
+	free(entry);
+}
+
+/**
+ * Removes all entries for which match() returns non-zero.
+ */
+static void afc_cache_remove_matching(afc_client_t client, int (*match)(struct afc_cache_entry *entry, const void *arg), const void *arg)
+{
+	uint32_t i;
+
+	if (!client->cache_buckets)
+		return;
+	for (i = 0; i < AFC_CACHE_BUCKETS && client->cache_count > 0; i++) {
+		struct afc_cache_entry **pp = &client->cache_buckets[i];
+		while (*pp) {
+			struct afc_cache_entry *entry = *pp;
+			if (match(entry, arg)) {
+				*pp = entry->next;
+				afc_cache_entry_free(entry);
+				client->cache_count--;
+			} else {
+				pp = &entry->next;
+			}
+		}
+	}
+}
+
+static int afc_cache_match_all(struct afc_cache_entry *entry, const void *arg)
+{
+	return 1;
+}
+
+static int afc_cache_match_expired(struct afc_cache_entry *entry, const void *arg)
+{
+	return entry->expires <= *(const uint64_t*)arg;
+}
+
+/* the path itself and everything below it */
+static int afc_cache_match_tree(struct afc_cache_entry *entry, const void *arg)
+{
+	const char *path = (const char*)arg;
+	size_t len = strlen(path);
+	if (len == 1) {
+		/* root */
+		return 1;
+	}
+	return !strncmp(entry->path, path, len) && (entry->path[len] == '\0' || entry->path[len] == '/');
+}
+
+/**
+ * Looks up a cached response. The returned data stays valid until the
+ * client is unlocked.
+ *
+ * @return 1 if a valid entry was found, 0 otherwise.
+ */
+static int afc_cache_get(afc_client_t client, enum afc_cache_kind kind, const char *path, afc_error_t *result, char **data, uint32_t *length)
+{
+	if (!client->cache_ttl || client->cache_count == 0)
+		return 0;
+
+	char *norm = afc_cache_normalize(path);
+	if (!norm)
+		return 0;
+	uint32_t hash = afc_cache_hash(kind, norm);
+	struct afc_cache_entry **pp = &client->cache_buckets[hash % AFC_CACHE_BUCKETS];
+	int found = 0;
+	while (*pp) {
+		struct afc_cache_entry *entry = *pp;
+		if (entry->hash == hash && entry->kind == kind && !strcmp(entry->path, norm)) {
+			if (entry->expires <= time_monotonic_usec()) {
+				*pp = entry->next;
+				afc_cache_entry_free(entry);
+				client->cache_count--;
+			} else {
+				*result = entry->result;
+				*data = entry->data;
+				*length = entry->length;
+				found = 1;
+			}
+			break;
+		}
+		pp = &entry->next;
+	}
+	free(norm);
+	return found;
+}
+
+/**
+ * Stores a received response, replacing an existing entry for the path.
+ * Only successful lookups and lookups of missing paths are cached.
+ */
+static void afc_cache_put(afc_client_t client, enum afc_cache_kind kind, const char *path, afc_error_t result, const char *data, uint32_t length)
+{
+	if (!client->cache_ttl || (result != AFC_E_SUCCESS && result != AFC_E_OBJECT_NOT_FOUND))
+		return;
+
+	uint64_t now = time_monotonic_usec();
+	if (client->cache_count >= AFC_CACHE_MAX_ENTRIES) {
+		afc_cache_remove_matching(client, afc_cache_match_expired, &now);
+		if (client->cache_count >= AFC_CACHE_MAX_ENTRIES) {
+			afc_cache_remove_matching(client, afc_cache_match_all, NULL);
+		}
+	}
+
+	struct afc_cache_entry *entry = (struct afc_cache_entry*)calloc(1, sizeof(struct afc_cache_entry));
+	if (!entry)
+		return;
+	entry->path = afc_cache_normalize(path);
+	if (data && length > 0 && result == AFC_E_SUCCESS) {
+		entry->data = (char*)malloc(length);
+		if (entry->data) {
+			memcpy(entry->data, data, length);
+			entry->length = length;
+		}
+	}
+	if (!entry->path || (length > 0 && result == AFC_E_SUCCESS && !entry->data)) {
+		afc_cache_entry_free(entry);
+		return;
+	}
+	entry->kind = kind;
+	entry->result = result;
+	entry->expires = now + client->cache_ttl;
+	entry->hash = afc_cache_hash(kind, entry->path);
+
+	struct afc_cache_entry **pp = &client->cache_buckets[entry->hash % AFC_CACHE_BUCKETS];
+	while (*pp) {
+		struct afc_cache_entry *old = *pp;
+		if (old->hash == entry->hash && old->kind == kind && !strcmp(old->path, entry->path)) {
+			*pp = old->next;
+			afc_cache_entry_free(old);
+			client->cache_count--;
+			break;
+		}
+		pp = &old->next;
+	}
+	entry->next = client->cache_buckets[entry->hash % AFC_CACHE_BUCKETS];
+	client->cache_buckets[entry->hash % AFC_CACHE_BUCKETS] = entry;
+	client->cache_count++;
+}
+
+/**
+ * Drops the entries of a path that is modified, everything below it, and
+ * the listing of its parent directory.
+ */
+static void afc_cache_invalidate(afc_client_t client, const char *path)
+{
+	if (client->cache_count == 0)
+		return;
+
+	char *norm = afc_cache_normalize(path);
+	if (!norm) {
+		afc_cache_remove_matching(client, afc_cache_match_all, NULL);
+		return;
+	}
+	afc_cache_remove_matching(client, afc_cache_match_tree, norm);
+
+	char *slash = strrchr(norm, '/');
+	if (slash) {
+		/* the parent of "/name" is the root */
+		slash[(slash == norm) ? 1 : 0] = '\0';
+		uint32_t hash = afc_cache_hash(AFC_CACHE_DIRECTORY, norm);
+		struct afc_cache_entry **pp = &client->cache_buckets[hash % AFC_CACHE_BUCKETS];
+		while (*pp) {
+			struct afc_cache_entry *entry = *pp;
+			if (entry->hash == hash && entry->kind == AFC_CACHE_DIRECTORY && !strcmp(entry->path, norm)) {
+				*pp = entry->next;
+				afc_cache_entry_free(entry);
+				client->cache_count--;
+				break;
+			}
+			pp = &entry->next;
+		}
+	}
+	free(norm);
+}
+
+/**
+ * Remembers the path of a file opened while the cache is enabled.
+ */
+static void afc_cache_track_file(afc_client_t client, uint64_t handle, const char *path)
+{
+	if (!client->cache_ttl)
+		return;
+	struct afc_cache_file *file = (struct afc_cache_file*)malloc(sizeof(struct afc_cache_file));
+	if (!file)
+		return;
+	file->handle = handle;
+	file->path = strdup(path);
+	file->next = client->cache_files;
+	client->cache_files = file;
+}
+
+/**
+ * Forgets a closed file. Written files are invalidated once more, since
+ * the device updates their metadata on close.
+ */
+static void afc_cache_close_file(afc_client_t client, uint64_t handle)
+{
+	struct afc_cache_file **pp = &client->cache_files;
+	while (*pp) {
+		struct afc_cache_file *file = *pp;
+		if (file->handle == handle) {
+			*pp = file->next;
+			if (file->path) {
+				afc_cache_invalidate(client, file->path);
+			}
+			free(file->path);
+			free(file);
+			return;
+		}
+		pp = &file->next;
+	}
+}
+
+/**
+ * Drops the entries of the file behind a handle that is written to. If the
+ * file was opened before the cache was enabled, the whole cache is dropped.
+ */
+static void afc_cache_invalidate_file(afc_client_t client, uint64_t handle)
+{
+	if (client->cache_count == 0)
+		return;
+
+	struct afc_cache_file *file;
+	for (file = client->cache_files; file; file = file->next) {
+		if (file->handle == handle && file->path) {
+			afc_cache_invalidate(client, file->path);
+			return;
+		}
+	}
+	afc_cache_remove_matching(client, afc_cache_match_all, NULL);
+}
+
+static void afc_cache_free(afc_client_t client)
+{
+	afc_cache_remove_matching(client, afc_cache_match_all, NULL);
+	free(client->cache_buckets);
+	client->cache_buckets = NULL;
+	while (client->cache_files) {
+		struct afc_cache_file *file = client->cache_files;
+		client->cache_files = file->next;
+		free(file->path);
+		free(file);
+	}
+}
+
+/**
+ * Returns the read-ahead state of a handle, optionally creating it.
+ */
+static struct afc_read_ahead *afc_read_ahead_find(afc_client_t client, uint64_t handle, int create)
+{
+	struct afc_read_ahead *ra;
+	for (ra = client->read_aheads; ra; ra = ra->next) {
+		if (ra->handle == handle)
+			return ra;
+	}
+	if (!create)
+		return NULL;
+	ra = (struct afc_read_ahead*)calloc(1, sizeof(struct afc_read_ahead));
+	if (!ra)
+		return NULL;
+	ra->handle = handle;
+	ra->next = client->read_aheads;
+	client->read_aheads = ra;
+	return ra;
+}
+
+static void afc_read_ahead_forget(afc_client_t client, uint64_t handle)
+{
+	struct afc_read_ahead **pp = &client->read_aheads;
+	while (*pp) {
+		struct afc_read_ahead *ra = *pp;
+		if (ra->handle == handle) {
+			*pp = ra->next;
+			free(ra->buffer);
+			free(ra);
+			return;
+		}
+		pp = &ra->next;
+	}
+}
+
+static void afc_read_ahead_free(afc_client_t client)
+{
+	while (client->read_aheads) {
+		struct afc_read_ahead *ra = client->read_aheads;
+		client->read_aheads = ra->next;
+		free(ra->buffer);
+		free(ra);
+	}
+}
+
 /**
  * Makes a connection to the AFC service on the device using the given
  * connection.
@@ -77,18 +424,39 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_with_service_client(service_clie
 	client_loc->free_parent = 0;
 
 	/* allocate a packet */
-	client_loc->packet_extra = 1024;
+	client_loc->packet_extra = AFC_PACKET_DEFAULT_CAPACITY;
 	client_loc->afc_packet = (AFCPacket *) malloc(sizeof(AFCPacket) + client_loc->packet_extra);
 	if (!client_loc->afc_packet) {
 		free(client_loc);
 		return AFC_E_NO_MEM;
 	}
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_buffer_size = 0;
+	client_loc->write_pending = 0;
+	client_loc->write_error = AFC_E_SUCCESS;
+	client_loc->trace_start = 0;
+	client_loc->cache_ttl = 0;
+	client_loc->cache_buckets = NULL;
+	client_loc->cache_count = 0;
+	client_loc->cache_files = NULL;
+	client_loc->read_ahead_window = AFC_READ_AHEAD_DEFAULT_WINDOW;
+	client_loc->read_ahead_chunk = AFC_READ_AHEAD_DEFAULT_CHUNK_SIZE;
+	client_loc->read_aheads = NULL;
+	client_loc->write_buffers = NULL;
+	client_loc->devinfo_ttl = 0;
+	client_loc->devinfo_data = NULL;
+	client_loc->devinfo_length = 0;
+	client_loc->devinfo_expires = 0;
+	client_loc->devinfo_written = 0;
 	client_loc->afc_packet->packet_num = 0;
 	client_loc->afc_packet->entire_length = 0;
 	client_loc->afc_packet->this_length = 0;
 	memcpy(client_loc->afc_packet->magic, AFC_MAGIC, AFC_MAGIC_LEN);
 	mutex_init(&client_loc->mutex);
 
+	/* replies are read as header and payload, serve both from one receive */
+	idevice_connection_set_read_ahead(service_client->connection, IDEVICE_READ_AHEAD_DEFAULT_SIZE);
+
 	*client = client_loc;
 	return AFC_E_SUCCESS;
 }
@@ -128,14 +496,90 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
 		service_client_free(client->parent);
 		client->parent = NULL;
 	}
+	afc_cache_free(client);
+	afc_read_ahead_free(client);
+	free(client->devinfo_data);
+	while (client->write_buffers) {
+		struct afc_write_buffer *wb = client->write_buffers;
+		client->write_buffers = wb->next;
+		free(wb->buffer);
+		free(wb);
+	}
 	free(client->afc_packet);
+	free(client->recv_buffer);
 	mutex_destroy(&client->mutex);
 	free(client);
 	return AFC_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API afc_error_t afc_client_set_cache_ttl(afc_client_t client, uint32_t ttl_ms)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	if (ttl_ms == 0) {
+		afc_cache_free(client);
+	} else if (!client->cache_buckets) {
+		client->cache_buckets = (struct afc_cache_entry**)calloc(AFC_CACHE_BUCKETS, sizeof(struct afc_cache_entry*));
+		if (!client->cache_buckets) {
+			afc_unlock(client);
+			return AFC_E_NO_MEM;
+		}
+	}
+	client->cache_ttl = (uint64_t)ttl_ms * 1000;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_flush_cache(afc_client_t client)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	afc_cache_remove_matching(client, afc_cache_match_all, NULL);
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_set_read_ahead(afc_client_t client, uint32_t window, uint32_t chunk_size)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	/* data that was already read ahead is still handed out */
+	client->read_ahead_window = window;
+	client->read_ahead_chunk = (chunk_size) ? chunk_size : AFC_READ_AHEAD_DEFAULT_CHUNK_SIZE;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_client_set_device_info_ttl(afc_client_t client, uint32_t ttl_ms)
+{
+	if (!client)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+	client->devinfo_ttl = (uint64_t)ttl_ms * 1000;
+	if (ttl_ms == 0) {
+		free(client->devinfo_data);
+		client->devinfo_data = NULL;
+		client->devinfo_length = 0;
+	}
+	client->devinfo_expires = 0;
+	afc_unlock(client);
+
+	return AFC_E_SUCCESS;
+}
+
 /**
- * Dispatches an AFC packet over a client.
+ * Sends an AFC packet over a client without collecting the status of
+ * outstanding asynchronous writes first.
  *
  * @param client The client to send data through.
  * @param operation The operation to perform.
@@ -147,7 +591,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_free(afc_client_t client)
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+static afc_error_t afc_send_packet(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
 {
 	uint32_t sent = 0;
 
@@ -166,18 +610,19 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 
 	debug_info("packet length = %i", client->afc_packet->this_length);
 
-	/* send AFC packet header and data */
-	AFCPacket_to_LE(client->afc_packet);
-	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket) + data_length);
-	sent = 0;
-	service_send(client->parent, (void*)client->afc_packet, sizeof(AFCPacket) + data_length, &sent);
-	AFCPacket_from_LE(client->afc_packet);
-	*bytes_sent += sent;
-	if (sent < sizeof(AFCPacket) + data_length) {
-		return AFC_E_SUCCESS;
+	/* send AFC packet header, data and payload at once */
+	idevice_iovec_t iov[2];
+	uint32_t iovcnt = 1;
+	iov[0].data = (const char*)client->afc_packet;
+	iov[0].length = sizeof(AFCPacket) + data_length;
+	if (payload_length > 0) {
+		iov[1].data = payload;
+		iov[1].length = payload_length;
+		iovcnt++;
 	}
 
-	sent = 0;
+	AFCPacket_to_LE(client->afc_packet);
+	debug_buffer((char*)client->afc_packet, sizeof(AFCPacket) + data_length);
 	if (payload_length > 0) {
 		if (payload_length > 256) {
 			debug_info("packet payload follows (256/%u)", payload_length);
@@ -186,26 +631,55 @@ static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation,
 			debug_info("packet payload follows");
 			debug_buffer(payload, payload_length);
 		}
-		service_send(client->parent, payload, payload_length, &sent);
-	}
-	*bytes_sent += sent;
-	if (sent < payload_length) {
-		return AFC_E_SUCCESS;
 	}
 
+	client->trace_start = trace_begin();
+	service_sendv(client->parent, iov, iovcnt, &sent);
+	AFCPacket_from_LE(client->afc_packet);
+	*bytes_sent = sent;
+
 	return AFC_E_SUCCESS;
 }
 
+static int _afc_check_recv_buffer(afc_client_t client, uint32_t length)
+{
+	if (length > client->recv_buffer_size) {
+		uint32_t newsize = (client->recv_buffer_size) ? client->recv_buffer_size : 4096;
+		while (newsize < length && newsize < 0x80000000) {
+			newsize <<= 1;
+		}
+		if (newsize < length) {
+			newsize = length;
+		}
+		char* newbuf = (char*)realloc(client->recv_buffer, newsize);
+		if (!newbuf) {
+			return -1;
+		}
+		client->recv_buffer = newbuf;
+		client->recv_buffer_size = newsize;
+	}
+	return 0;
+}
+
 /**
- * Receives data through an AFC client and sets a variable to the received data.
+ * Receives the response to a specific AFC packet through an AFC client and
+ * sets a variable to the received data.
+ *
+ * The data is received into the receive buffer owned by the client, unless
+ * it is a data response that fits into the optional destination buffer, in
+ * which case it is received there directly. The returned data is 0-terminated
+ * and stays valid until the next packet is received on the client.
  *
  * @param client The client to receive data on.
+ * @param packet_num The packet number of the request the response belongs to.
+ * @param dest Optional buffer to receive the payload of a data response into.
+ * @param dest_size Size of the dest buffer.
  * @param bytes The char* to point to the newly-received data.
  * @param bytes_recv How much data was received.
  *
  * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
  */
-static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+static afc_error_t afc_do_receive_packet(afc_client_t client, uint64_t packet_num, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
 {
 	AFCPacket header;
 	uint32_t entire_len = 0;
@@ -238,9 +712,9 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	}
 
 	/* check if it has the correct packet number */
-	if (header.packet_num != client->afc_packet->packet_num) {
+	if (header.packet_num != packet_num) {
 		/* otherwise print a warning but do not abort */
-		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, client->afc_packet->packet_num);
+		debug_info("ERROR: Unexpected packet number (%lld != %lld) aborting.", header.packet_num, packet_num);
 		return AFC_E_OP_HEADER_INVALID;
 	}
 
@@ -264,15 +738,22 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 	entire_len = (uint32_t)header.entire_length - sizeof(AFCPacket);
 	this_len = (uint32_t)header.this_length - sizeof(AFCPacket);
 
-	dump_here = (char*)malloc(entire_len);
+	if (dest && header.operation == AFC_OP_DATA && this_len == 0 && entire_len <= dest_size) {
+		dump_here = dest;
+	} else {
+		if (_afc_check_recv_buffer(client, entire_len + 1) < 0) {
+			debug_info("Failed to realloc receive buffer");
+			return AFC_E_NO_MEM;
+		}
+		dump_here = client->recv_buffer;
+		dump_here[entire_len] = '\0';
+	}
 	if (this_len > 0) {
 		service_receive(client->parent, dump_here, this_len, bytes_recv);
 		if (*bytes_recv <= 0) {
-			free(dump_here);
 			debug_info("Did not get packet contents!");
 			return AFC_E_NOT_ENOUGH_DATA;
 		} else if (*bytes_recv < this_len) {
-			free(dump_here);
 			debug_info("Could not receive this_len=%d bytes", this_len);
 			return AFC_E_NOT_ENOUGH_DATA;
 		}
@@ -314,8 +795,6 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 		if (param1 != AFC_E_SUCCESS) {
 			/* error status */
-			/* free buffer */
-			free(dump_here);
 			return (afc_error_t)param1;
 		}
 	} else if (header.operation == AFC_OP_DATA) {
@@ -329,7 +808,6 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 		debug_info("got a tell response, position=%lld", param1);
 	} else {
 		/* unknown operation code received */
-		free(dump_here);
 		*bytes_recv = 0;
 
 		debug_info("WARNING: Unknown operation code received 0x%llx param1=%lld", header.operation, param1);
@@ -342,14 +820,127 @@ static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t
 
 	if (bytes) {
 		*bytes = dump_here;
-	} else {
-		free(dump_here);
 	}
 
 	*bytes_recv = current_count;
 	return AFC_E_SUCCESS;
 }
 
+static const char *afc_op_names[] = {
+	"Invalid", "Status", "Data", "ReadDir", "ReadFile", "WriteFile",
+	"WritePart", "TruncateFile", "RemovePath", "MakeDir", "GetFileInfo",
+	"GetDeviceInfo", "WriteFileAtomic", "FileRefOpen", "FileRefOpenResult",
+	"FileRefRead", "FileRefWrite", "FileRefSeek", "FileRefTell",
+	"FileRefTellResult", "FileRefClose", "FileRefSetFileSize",
+	"GetConnectionInfo", "SetConnectionOptions", "RenamePath",
+	"SetFSBlockSize", "SetSocketBlockSize", "FileRefLock", "MakeLink",
+	"GetFileHash", "SetModTime", "GetFileHashWithRange",
+	"FileRefSetImmutableHint", "GetSizeOfPathContents",
+	"RemovePathAndContents", "DirectoryEnumeratorRefOpen",
+	"DirectoryEnumeratorRefOpenResult", "DirectoryEnumeratorRefRead",
+	"DirectoryEnumeratorRefClose", "FileRefReadWithOffset",
+	"FileRefWriteWithOffset"
+};
+
+/**
+ * Receives an AFC response, see afc_do_receive_packet(). While tracing, the
+ * time from sending the most recent packet until its response arrived is
+ * recorded as a span named after the operation.
+ */
+static afc_error_t afc_receive_packet(afc_client_t client, uint64_t packet_num, char *dest, uint32_t dest_size, char **bytes, uint32_t *bytes_recv)
+{
+	afc_error_t ret = afc_do_receive_packet(client, packet_num, dest, dest_size, bytes, bytes_recv);
+	if (client->trace_start && packet_num == client->afc_packet->packet_num) {
+		uint64_t op = client->afc_packet->operation;
+		trace_end("afc", (op < sizeof(afc_op_names)/sizeof(afc_op_names[0])) ? afc_op_names[op] : "Unknown", client->trace_start);
+		client->trace_start = 0;
+	}
+	return ret;
+}
+
+/**
+ * Receives the response to the most recently dispatched AFC packet.
+ * See afc_receive_packet() for the lifetime of the received data.
+ *
+ * @param client The client to receive data on.
+ * @param bytes The char* to point to the newly-received data.
+ * @param bytes_recv How much data was received.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_receive_data(afc_client_t client, char **bytes, uint32_t *bytes_recv)
+{
+	return afc_receive_packet(client, client->afc_packet->packet_num, NULL, 0, bytes, bytes_recv);
+}
+
+/**
+ * Checks if an error returned by afc_receive_packet() means that the
+ * connection is out of sync, i.e. no further responses can be received.
+ */
+static int afc_error_is_fatal(afc_error_t err)
+{
+	switch (err) {
+		case AFC_E_EMPTY_RESPONSE:
+		case AFC_E_INCOMPLETE_HEADER:
+		case AFC_E_OP_HEADER_INVALID:
+		case AFC_E_NOT_ENOUGH_DATA:
+			return 1;
+		default:
+			break;
+	}
+	return 0;
+}
+
+/**
+ * Receives the status replies of outstanding asynchronous writes until at
+ * most the given number of writes remain outstanding. The first error is
+ * stored in the client and reported by afc_file_close() or afc_file_flush().
+ *
+ * @param client The client to receive the status replies on.
+ * @param keep The number of writes that may remain outstanding.
+ */
+static void afc_collect_write_status(afc_client_t client, uint32_t keep)
+{
+	while (client->write_pending > keep) {
+		uint32_t bytes_loc = 0;
+		uint64_t packet_num = client->afc_packet->packet_num - client->write_pending + 1;
+		afc_error_t err = afc_receive_packet(client, packet_num, NULL, 0, NULL, &bytes_loc);
+		client->write_pending--;
+		if (err != AFC_E_SUCCESS) {
+			debug_info("Deferred write %lld failed with error %d", packet_num, err);
+			if (client->write_error == AFC_E_SUCCESS) {
+				client->write_error = err;
+			}
+			if (afc_error_is_fatal(err)) {
+				/* the remaining replies can't be matched anymore */
+				client->write_pending = 0;
+			}
+		}
+	}
+}
+
+/**
+ * Dispatches an AFC packet over a client. Status replies of outstanding
+ * asynchronous writes are collected first so the reply to this packet is
+ * the next one to be received.
+ *
+ * @param client The client to send data through.
+ * @param operation The operation to perform.
+ * @param data_length The length of the data to send with the operation.
+ * @param payload The data to send after the operation data.
+ * @param payload_length The length of the payload.
+ * @param bytes_sent The total number of bytes actually sent.
+ *
+ * @return AFC_E_SUCCESS on success or an AFC_E_* error value.
+ */
+static afc_error_t afc_dispatch_packet(afc_client_t client, uint64_t operation, uint32_t data_length, const char* payload, uint32_t payload_length, uint32_t *bytes_sent)
+{
+	if (client && client->afc_packet) {
+		afc_collect_write_status(client, 0);
+	}
+	return afc_send_packet(client, operation, data_length, payload, payload_length, bytes_sent);
+}
+
 /**
  * Returns counts of null characters within a string.
  */
@@ -394,32 +985,136 @@ static char **make_strings_list(char *tokens, uint32_t length)
 	return list;
 }
 
-static int _afc_check_packet_buffer(afc_client_t client, uint32_t data_len)
+/**
+ * Resizes the AFC packet buffer to hold the given amount of request data.
+ */
+static int _afc_resize_packet_buffer(afc_client_t client, uint32_t capacity)
 {
-	if (data_len > client->packet_extra) {
-		client->packet_extra = (data_len & ~8) + 8;
-		AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + client->packet_extra);
-		if (!newpkt) {
-			return -1;
-		}
-		client->afc_packet = newpkt;
+	AFCPacket* newpkt = (AFCPacket*)realloc(client->afc_packet, sizeof(AFCPacket) + (size_t)capacity);
+	if (!newpkt) {
+		return -1;
 	}
+	client->afc_packet = newpkt;
+	client->packet_extra = capacity;
 	return 0;
 }
 
-#define AFC_PACKET_DATA_PTR ((char*)client->afc_packet + sizeof(AFCPacket))
-
-LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+/**
+ * Makes sure the AFC packet buffer can hold data_len bytes of request data.
+ * The buffer grows by doubling, so requests of alternating sizes don't
+ * cause a reallocation each.
+ */
+static int _afc_check_packet_buffer(afc_client_t client, uint32_t data_len)
 {
-	uint32_t bytes = 0;
-	char *data = NULL, **list_loc = NULL;
-	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+	if (data_len <= client->packet_extra) {
+		return 0;
+	}
+	uint64_t capacity = (client->packet_extra > 0) ? client->packet_extra : AFC_PACKET_DEFAULT_CAPACITY;
+	while (capacity < data_len) {
+		capacity *= 2;
+	}
+	if (capacity > UINT32_MAX) {
+		capacity = data_len;
+	}
+	return _afc_resize_packet_buffer(client, (uint32_t)capacity);
+}
 
-	if (!client || !path || !directory_information || (directory_information && *directory_information))
+LIBIMOBILEDEVICE_API afc_error_t afc_client_set_packet_capacity(afc_client_t client, uint32_t capacity)
+{
+	if (!client || !client->afc_packet)
+		return AFC_E_INVALID_ARG;
+
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_lock(client);
+	/* the buffer only grows, requests are built in it while locked */
+	if (capacity > client->packet_extra && _afc_resize_packet_buffer(client, capacity) < 0) {
+		ret = AFC_E_NO_MEM;
+	}
+	afc_unlock(client);
+
+	return ret;
+}
+
+#define AFC_PACKET_DATA_PTR ((char*)client->afc_packet + sizeof(AFCPacket))
+
+static struct afc_write_buffer *afc_write_buffer_find(afc_client_t client, uint64_t handle)
+{
+	struct afc_write_buffer *wb;
+	for (wb = client->write_buffers; wb; wb = wb->next) {
+		if (wb->handle == handle)
+			return wb;
+	}
+	return NULL;
+}
+
+/**
+ * Queues the buffered data of a handle as one write. Like with
+ * afc_file_write_async(), a failure is reported later through write_error.
+ */
+static void afc_write_buffer_flush(afc_client_t client, struct afc_write_buffer *wb)
+{
+	uint32_t bytes_loc = 0;
+
+	if (!wb || wb->length == 0)
+		return;
+
+	afc_collect_write_status(client, AFC_PIPELINE_DEFAULT_WINDOW - 1);
+	if (client->write_error == AFC_E_SUCCESS) {
+		*(uint64_t*)(AFC_PACKET_DATA_PTR) = wb->handle;
+		afc_error_t ret = afc_send_packet(client, AFC_OP_FILE_WRITE, 8, wb->buffer, wb->length, &bytes_loc);
+		if (ret == AFC_E_SUCCESS && bytes_loc == sizeof(AFCPacket) + 8 + wb->length) {
+			client->write_pending++;
+		} else {
+			/* a partially sent packet leaves the connection out of sync */
+			client->write_error = (ret == AFC_E_SUCCESS) ? AFC_E_NOT_ENOUGH_DATA : ret;
+		}
+	}
+	wb->length = 0;
+}
+
+static void afc_write_buffer_flush_handle(afc_client_t client, uint64_t handle)
+{
+	afc_write_buffer_flush(client, afc_write_buffer_find(client, handle));
+}
+
+/**
+ * Flushes and removes the write-back buffer of a handle.
+ */
+static void afc_write_buffer_remove(afc_client_t client, uint64_t handle)
+{
+	struct afc_write_buffer **pp = &client->write_buffers;
+	while (*pp) {
+		struct afc_write_buffer *wb = *pp;
+		if (wb->handle == handle) {
+			afc_write_buffer_flush(client, wb);
+			*pp = wb->next;
+			free(wb->buffer);
+			free(wb);
+			return;
+		}
+		pp = &wb->next;
+	}
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const char *path, char ***directory_information)
+{
+	uint32_t bytes = 0;
+	char *data = NULL, **list_loc = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !directory_information || (directory_information && *directory_information))
 		return AFC_E_INVALID_ARG;
 
 	afc_lock(client);
 
+	if (afc_cache_get(client, AFC_CACHE_DIRECTORY, path, &ret, &data, &bytes)) {
+		if (ret == AFC_E_SUCCESS) {
+			*directory_information = make_strings_list(data, bytes);
+		}
+		afc_unlock(client);
+		return ret;
+	}
+
 	uint32_t data_len = (uint32_t)strlen(path)+1;
 	if (_afc_check_packet_buffer(client, data_len) < 0) {
 		afc_unlock(client);
@@ -436,16 +1131,13 @@ LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const c
 	}
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
+	afc_cache_put(client, AFC_CACHE_DIRECTORY, path, ret, data, bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
 	/* Parse the data */
 	list_loc = make_strings_list(data, bytes);
-	if (data)
-		free(data);
 
 	afc_unlock(client);
 	*directory_information = list_loc;
@@ -453,35 +1145,402 @@ LIBIMOBILEDEVICE_API afc_error_t afc_read_directory(afc_client_t client, const c
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
+/**
+ * Converts the value of the st_ifmt file information key to a file type.
+ */
+static afc_file_type_t afc_file_type_from_string(const char *ifmt)
+{
+	if (!strcmp(ifmt, "S_IFREG")) {
+		return AFC_FILE_TYPE_REGULAR;
+	} else if (!strcmp(ifmt, "S_IFDIR")) {
+		return AFC_FILE_TYPE_DIRECTORY;
+	} else if (!strcmp(ifmt, "S_IFLNK")) {
+		return AFC_FILE_TYPE_SYMLINK;
+	} else if (!strcmp(ifmt, "S_IFCHR")) {
+		return AFC_FILE_TYPE_CHARDEV;
+	} else if (!strcmp(ifmt, "S_IFBLK")) {
+		return AFC_FILE_TYPE_BLOCKDEV;
+	} else if (!strcmp(ifmt, "S_IFIFO")) {
+		return AFC_FILE_TYPE_FIFO;
+	} else if (!strcmp(ifmt, "S_IFSOCK")) {
+		return AFC_FILE_TYPE_SOCKET;
+	}
+	return AFC_FILE_TYPE_UNKNOWN;
+}
+
+/**
+ * Parses a GET_FILE_INFO response in place without allocating memory.
+ * The link target is truncated to fit into the info struct if necessary.
+ */
+static void afc_parse_file_info(const char *data, uint32_t length, afc_file_info_t *info)
+{
+	uint32_t pos = 0;
+
+	memset(info, '\0', sizeof(afc_file_info_t));
+
+	while (pos < length) {
+		const char *key = data + pos;
+		pos += (uint32_t)strlen(key) + 1;
+		if (pos >= length) {
+			break;
+		}
+		const char *val = data + pos;
+		pos += (uint32_t)strlen(val) + 1;
+		if (!strcmp(key, "st_size")) {
+			info->size = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_blocks")) {
+			info->blocks = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_nlink")) {
+			info->nlink = (uint32_t)strtoul(val, NULL, 10);
+		} else if (!strcmp(key, "st_ifmt")) {
+			info->type = afc_file_type_from_string(val);
+		} else if (!strcmp(key, "st_mtime")) {
+			info->mtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "st_birthtime")) {
+			info->birthtime = strtoull(val, NULL, 10);
+		} else if (!strcmp(key, "LinkTarget")) {
+			strncpy(info->link_target, val, sizeof(info->link_target)-1);
+			info->link_target[sizeof(info->link_target)-1] = '\0';
+		}
+	}
+}
+
+/**
+ * Dispatches a request that takes the path of the given directory entry,
+ * like GET_FILE_INFO or REMOVE_PATH.
+ */
+static afc_error_t afc_dispatch_path_request(afc_client_t client, uint64_t operation, const char *dir, uint32_t dir_len, const char *name)
 {
 	uint32_t bytes = 0;
-	char *data = NULL, **list = NULL;
+	uint32_t name_len = (uint32_t)strlen(name);
+	uint32_t data_len = dir_len + 1 + name_len + 1;
+
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	memcpy(AFC_PACKET_DATA_PTR, dir, dir_len);
+	if (dir_len == 0 || dir[dir_len-1] != '/') {
+		AFC_PACKET_DATA_PTR[dir_len++] = '/';
+	} else {
+		data_len--;
+	}
+	memcpy(AFC_PACKET_DATA_PTR + dir_len, name, name_len + 1);
+
+	afc_error_t ret = afc_dispatch_packet(client, operation, data_len, NULL, 0, &bytes);
+	if (ret == AFC_E_SUCCESS && bytes != sizeof(AFCPacket) + data_len) {
+		ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_read_directory_with_info(afc_client_t client, const char *path, afc_directory_entry_t **entries, uint32_t *count)
+{
+	uint32_t bytes = 0;
+	char *data = NULL;
+	char *names = NULL;
+	char **link_targets = NULL;
+	afc_directory_entry_t *list = NULL;
+	uint32_t names_len = 0;
+	uint32_t num = 0;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t i = 0;
+	uint64_t next_packet = 0;
+	afc_file_info_t info;
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
-	if (!client || !device_information)
+	if (!client || !path || !entries || !count)
 		return AFC_E_INVALID_ARG;
 
+	*entries = NULL;
+	*count = 0;
+
 	afc_lock(client);
 
+	uint32_t data_len = (uint32_t)strlen(path)+1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
 	/* Send the command */
-	ret = afc_dispatch_packet(client, AFC_OP_GET_DEVINFO, 0, NULL, 0, &bytes);
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_READ_DIR, data_len, NULL, 0, &bytes);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive the data */
 	ret = afc_receive_data(client, &data, &bytes);
+	afc_cache_put(client, AFC_CACHE_DIRECTORY, path, ret, data, bytes);
 	if (ret != AFC_E_SUCCESS) {
-		if (data)
-			free(data);
 		afc_unlock(client);
 		return ret;
 	}
+
+	/* copy the names out of the receive buffer, skipping "." and ".." */
+	names = (char*)malloc(bytes + 1);
+	if (!names) {
+		afc_unlock(client);
+		return AFC_E_NO_MEM;
+	}
+	for (i = 0; i < bytes; ) {
+		const char *name = data + i;
+		uint32_t len = (uint32_t)strlen(name);
+		i += len + 1;
+		if (len == 0 || !strcmp(name, ".") || !strcmp(name, "..")) {
+			continue;
+		}
+		memcpy(names + names_len, name, len + 1);
+		names_len += len + 1;
+		num++;
+	}
+
+	if (num == 0) {
+		free(names);
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+
+	list = (afc_directory_entry_t*)calloc(num, sizeof(afc_directory_entry_t));
+	link_targets = (char**)calloc(num, sizeof(char*));
+	if (!list || !link_targets) {
+		free(list);
+		free(link_targets);
+		free(names);
+		afc_unlock(client);
+		return AFC_E_NO_MEM;
+	}
+
+	/* temporarily store name offsets until the final buffer is assembled */
+	for (i = 0, bytes = 0; i < num; i++) {
+		list[i].name = names + bytes;
+		bytes += (uint32_t)strlen(list[i].name) + 1;
+	}
+
+	uint32_t path_len = data_len - 1;
+	const char *next_name = names;
+	next_packet = client->afc_packet->packet_num + 1;
+	ret = AFC_E_SUCCESS;
+
+	while (received < sent || (ret == AFC_E_SUCCESS && sent < num)) {
+		/* keep the pipeline filled */
+		while (ret == AFC_E_SUCCESS && sent < num && sent - received < AFC_STAT_PIPELINE_WINDOW) {
+			ret = afc_dispatch_path_request(client, AFC_OP_GET_FILE_INFO, path, path_len, next_name);
+			if (ret != AFC_E_SUCCESS) {
+				break;
+			}
+			next_name += strlen(next_name) + 1;
+			sent++;
+		}
+		if (received == sent || afc_error_is_fatal(ret)) {
+			break;
+		}
+
+		afc_directory_entry_t *entry = &list[received];
+		afc_error_t err = afc_receive_packet(client, next_packet, NULL, 0, &data, &bytes);
+		next_packet++;
+		received++;
+		if (client->cache_ttl) {
+			/* a later stat of the entry can be answered from the cache */
+			size_t entry_path_len = path_len + 1 + strlen(entry->name) + 1;
+			char *entry_path = (char*)malloc(entry_path_len);
+			if (entry_path) {
+				snprintf(entry_path, entry_path_len, "%s/%s", path, entry->name);
+				afc_cache_put(client, AFC_CACHE_FILE_INFO, entry_path, err, data, bytes);
+				free(entry_path);
+			}
+		}
+		if (err != AFC_E_SUCCESS) {
+			debug_info("Failed to get file info for '%s' (%d)", entry->name, err);
+			if (afc_error_is_fatal(err)) {
+				ret = err;
+				break;
+			}
+			continue;
+		}
+
+		/* parse the key/value pairs in place */
+		afc_parse_file_info(data, bytes, &info);
+		entry->size = info.size;
+		entry->mtime = info.mtime;
+		entry->type = info.type;
+		if (info.link_target[0] != '\0') {
+			link_targets[received-1] = strdup(info.link_target);
+		}
+	}
+
+	afc_unlock(client);
+
+	if (ret == AFC_E_SUCCESS) {
+		/* assemble entries and strings into a single allocation */
+		uint32_t total = num * sizeof(afc_directory_entry_t) + names_len;
+		for (i = 0; i < num; i++) {
+			if (link_targets[i]) {
+				total += (uint32_t)strlen(link_targets[i]) + 1;
+			}
+		}
+		afc_directory_entry_t *result = (afc_directory_entry_t*)malloc(total);
+		if (result) {
+			char *strp = (char*)(result + num);
+			memcpy(result, list, num * sizeof(afc_directory_entry_t));
+			memcpy(strp, names, names_len);
+			for (i = 0; i < num; i++) {
+				result[i].name = strp + (list[i].name - names);
+			}
+			strp += names_len;
+			for (i = 0; i < num; i++) {
+				if (link_targets[i]) {
+					uint32_t len = (uint32_t)strlen(link_targets[i]) + 1;
+					memcpy(strp, link_targets[i], len);
+					result[i].link_target = strp;
+					strp += len;
+				}
+			}
+			*entries = result;
+			*count = num;
+		} else {
+			ret = AFC_E_NO_MEM;
+		}
+	}
+
+	for (i = 0; i < num; i++) {
+		free(link_targets[i]);
+	}
+	free(link_targets);
+	free(list);
+	free(names);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_directory_entries_free(afc_directory_entry_t *entries)
+{
+	if (!entries)
+		return AFC_E_INVALID_ARG;
+
+	free(entries);
+
+	return AFC_E_SUCCESS;
+}
+
+/**
+ * Gets the GET_DEVINFO response with the client locked, from the cache if
+ * it is still valid. The data stays valid until the client is unlocked.
+ */
+static afc_error_t afc_device_info_fetch(afc_client_t client, char **data, uint32_t *length)
+{
+	uint32_t bytes = 0;
+
+	if (client->devinfo_data && client->devinfo_expires > time_monotonic_usec()) {
+		*data = client->devinfo_data;
+		*length = client->devinfo_length;
+		return AFC_E_SUCCESS;
+	}
+
+	/* Send the command */
+	afc_error_t ret = afc_dispatch_packet(client, AFC_OP_GET_DEVINFO, 0, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive the data */
+	*data = NULL;
+	ret = afc_receive_data(client, data, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+	*length = (*data) ? bytes : 0;
+
+	if (client->devinfo_ttl && *length > 0) {
+		char *copy = (char*)malloc(*length);
+		if (copy) {
+			memcpy(copy, *data, *length);
+			free(client->devinfo_data);
+			client->devinfo_data = copy;
+			client->devinfo_length = *length;
+			client->devinfo_expires = time_monotonic_usec() + client->devinfo_ttl;
+			client->devinfo_written = 0;
+		}
+	}
+	return ret;
+}
+
+/**
+ * Returns a copy of a device info value. The free space of a cached
+ * response is reduced by what the client wrote since it was received.
+ */
+static char *afc_device_info_value(afc_client_t client, const char *key, const char *value)
+{
+	if (client->devinfo_written > 0 && client->devinfo_data && !strcmp(key, "FSFreeBytes")) {
+		char buf[24];
+		uint64_t free_bytes = strtoull(value, NULL, 10);
+		free_bytes = (free_bytes > client->devinfo_written) ? free_bytes - client->devinfo_written : 0;
+		snprintf(buf, sizeof(buf), "%" PRIu64, free_bytes);
+		return strdup(buf);
+	}
+	return strdup(value);
+}
+
+/**
+ * Accounts for data written through the client in the cached free space.
+ */
+static void afc_device_info_account(afc_client_t client, uint32_t length)
+{
+	if (client->devinfo_data) {
+		client->devinfo_written += length;
+	}
+}
+
+/**
+ * Makes the next device info request go to the device, after space was
+ * freed by an amount that is not known.
+ */
+static void afc_device_info_expire(afc_client_t client)
+{
+	client->devinfo_expires = 0;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char ***device_information)
+{
+	uint32_t bytes = 0;
+	uint32_t nulls = 0;
+	uint32_t i = 0;
+	uint32_t pos = 0;
+	char *data = NULL, **list = NULL;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !device_information)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	ret = afc_device_info_fetch(client, &data, &bytes);
+	if (ret != AFC_E_SUCCESS || !data || bytes == 0) {
+		afc_unlock(client);
+		*device_information = NULL;
+		return ret;
+	}
+
 	/* Parse the data */
-	list = make_strings_list(data, bytes);
-	if (data)
-		free(data);
+	nulls = count_nullspaces(data, bytes);
+	list = (char **) malloc(sizeof(char *) * (nulls + 1));
+	if (!list) {
+		afc_unlock(client);
+		return AFC_E_NO_MEM;
+	}
+	for (i = 0; i < nulls; i++) {
+		const char *token = data + pos;
+		if ((i & 1) && i > 0) {
+			list[i] = afc_device_info_value(client, list[i-1], token);
+		} else {
+			list[i] = strdup(token);
+		}
+		pos += (uint32_t)strlen(token) + 1;
+	}
+	list[i] = NULL;
 
 	afc_unlock(client);
 
@@ -492,27 +1551,36 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info(afc_client_t client, char *
 
 LIBIMOBILEDEVICE_API afc_error_t afc_get_device_info_key(afc_client_t client, const char *key, char **value)
 {
+	uint32_t bytes = 0;
+	uint32_t pos = 0;
+	char *data = NULL;
 	afc_error_t ret = AFC_E_INTERNAL_ERROR;
-	char **kvps, **ptr;
 
 	*value = NULL;
-	if (key == NULL)
+	if (!client || key == NULL)
 		return AFC_E_INVALID_ARG;
 
-	ret = afc_get_device_info(client, &kvps);
-	if (ret != AFC_E_SUCCESS)
-		return ret;
+	afc_lock(client);
 
-	for (ptr = kvps; *ptr; ptr++) {
-		if (!strcmp(*ptr, key)) {
-			*value = strdup(*(ptr+1));
-			break;
+	ret = afc_device_info_fetch(client, &data, &bytes);
+	if (ret == AFC_E_SUCCESS && data) {
+		/* look up the key in place instead of building the list */
+		while (pos < bytes) {
+			const char *k = data + pos;
+			pos += (uint32_t)strnlen(k, bytes - pos) + 1;
+			if (pos >= bytes) {
+				break;
+			}
+			const char *v = data + pos;
+			pos += (uint32_t)strnlen(v, bytes - pos) + 1;
+			if (!strcmp(k, key)) {
+				*value = afc_device_info_value(client, k, v);
+				break;
+			}
 		}
 	}
-	for (ptr = kvps; *ptr; ptr++) {
-		free(*ptr);
-	}
-	free(kvps);
+
+	afc_unlock(client);
 
 	return ret;
 }
@@ -543,6 +1611,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path(afc_client_t client, const char
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
+	afc_device_info_expire(client);
 
 	/* special case; unknown error actually means directory not empty */
 	if (ret == AFC_E_UNKNOWN_ERROR)
@@ -583,6 +1653,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_rename_path(afc_client_t client, const char
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, from);
+	afc_cache_invalidate(client, to);
 
 	afc_unlock(client);
 
@@ -615,6 +1687,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_directory(afc_client_t client, const c
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	afc_unlock(client);
 
@@ -632,6 +1705,14 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 
 	afc_lock(client);
 
+	if (afc_cache_get(client, AFC_CACHE_FILE_INFO, path, &ret, &received, &bytes)) {
+		if (received) {
+			*file_information = make_strings_list(received, bytes);
+		}
+		afc_unlock(client);
+		return ret;
+	}
+
 	uint32_t data_len = (uint32_t)strlen(path)+1;
 	if (_afc_check_packet_buffer(client, data_len) < 0) {
 		afc_unlock(client);
@@ -651,9 +1732,55 @@ LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info(afc_client_t client, const ch
 
 	/* Receive data */
 	ret = afc_receive_data(client, &received, &bytes);
+	afc_cache_put(client, AFC_CACHE_FILE_INFO, path, ret, received, bytes);
 	if (received) {
 		*file_information = make_strings_list(received, bytes);
-		free(received);
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_info_struct(afc_client_t client, const char *path, afc_file_info_t *info)
+{
+	char *received = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !info)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	if (afc_cache_get(client, AFC_CACHE_FILE_INFO, path, &ret, &received, &bytes)) {
+		if (ret == AFC_E_SUCCESS) {
+			afc_parse_file_info(received, (received) ? bytes : 0, info);
+		}
+		afc_unlock(client);
+		return ret;
+	}
+
+	uint32_t data_len = (uint32_t)strlen(path)+1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_INFO, data_len, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data and parse it in place */
+	ret = afc_receive_data(client, &received, &bytes);
+	afc_cache_put(client, AFC_CACHE_FILE_INFO, path, ret, received, bytes);
+	if (ret == AFC_E_SUCCESS) {
+		afc_parse_file_info(received, (received) ? bytes : 0, info);
 	}
 
 	afc_unlock(client);
@@ -695,16 +1822,20 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	/* Receive the data */
 	char* data = NULL;
 	ret = afc_receive_data(client, &data, &bytes);
+	if (file_mode != AFC_FOPEN_RDONLY) {
+		/* the file might have been created or truncated */
+		afc_cache_invalidate(client, filename);
+	}
 	if ((ret == AFC_E_SUCCESS) && (bytes > 0) && data) {
-		afc_unlock(client);
-
 		/* Get the file handle */
 		memcpy(handle, data, sizeof(uint64_t));
-		free(data);
+		if (file_mode != AFC_FOPEN_RDONLY) {
+			afc_cache_track_file(client, *handle, filename);
+		}
+		afc_unlock(client);
+
 		return ret;
 	}
-	/* in case memory was allocated but no data received or an error occurred */
-	free(data);
 
 	debug_info("Didn't get any further data");
 
@@ -713,6 +1844,151 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_open(afc_client_t client, const char *
 	return ret;
 }
 
+/**
+ * Seeks a file with the client locked.
+ */
+static afc_error_t afc_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
+{
+	uint32_t bytes = 0;
+	struct seekinfo {
+		uint64_t handle;
+		uint64_t whence;
+		int64_t offset;
+	};
+
+	/* Send the command */
+	struct seekinfo* seekinfo = (struct seekinfo*)(AFC_PACKET_DATA_PTR);
+	seekinfo->handle = handle;
+	seekinfo->whence = htole64(whence);
+	seekinfo->offset = (int64_t)htole64(offset);
+	afc_error_t ret = afc_dispatch_packet(client, AFC_OP_FILE_SEEK, sizeof(struct seekinfo), NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+	/* Receive response */
+	return afc_receive_data(client, NULL, &bytes);
+}
+
+/**
+ * Moves the device's file position back to where the caller is and drops
+ * the data read ahead, before the handle is used for anything but reads.
+ */
+static afc_error_t afc_read_ahead_sync(afc_client_t client, uint64_t handle)
+{
+	struct afc_read_ahead *ra = afc_read_ahead_find(client, handle, 0);
+	if (!ra) {
+		return AFC_E_SUCCESS;
+	}
+	uint32_t ahead = ra->length - ra->offset;
+	ra->offset = ra->length = 0;
+	ra->sequential = 0;
+	if (ahead == 0) {
+		return AFC_E_SUCCESS;
+	}
+	return afc_seek(client, handle, -(int64_t)ahead, SEEK_CUR);
+}
+
+/**
+ * Refills the read-ahead buffer of a handle with a window of pipelined
+ * reads. Only contiguous data is kept; the device is moved back if reads
+ * after a failed one returned data.
+ */
+static afc_error_t afc_read_ahead_fill(afc_client_t client, struct afc_read_ahead *ra)
+{
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	uint32_t window = client->read_ahead_window;
+	uint32_t chunk_size = client->read_ahead_chunk;
+	uint64_t total = (uint64_t)window * chunk_size;
+	uint64_t next_packet = 0;
+	uint32_t sent = 0;
+	uint32_t discarded = 0;
+	uint32_t i;
+	int done = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (total > UINT32_MAX) {
+		window = UINT32_MAX / chunk_size;
+		total = (uint64_t)window * chunk_size;
+	}
+	if (ra->size < total) {
+		char *buffer = (char*)realloc(ra->buffer, (size_t)total);
+		if (!buffer) {
+			return AFC_E_NO_MEM;
+		}
+		ra->buffer = buffer;
+		ra->size = (uint32_t)total;
+	}
+	ra->offset = ra->length = 0;
+
+	next_packet = client->afc_packet->packet_num + 1;
+	for (sent = 0; sent < window; sent++) {
+		uint32_t bytes_loc = 0;
+		struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+		readinfo->handle = ra->handle;
+		readinfo->size = htole64(chunk_size);
+		afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc);
+		if (bytes_loc != sizeof(AFCPacket) + sizeof(struct readinfo)) {
+			debug_info("Failed to send read request");
+			ret = AFC_E_NOT_ENOUGH_DATA;
+			break;
+		}
+	}
+
+	/* responses arrive in the order the requests were sent */
+	for (i = 0; i < sent; i++) {
+		char *input = NULL;
+		uint32_t bytes_loc = 0;
+		afc_error_t err = afc_receive_packet(client, next_packet++, ra->buffer + ra->length, chunk_size, &input, &bytes_loc);
+		if (err != AFC_E_SUCCESS) {
+			if (ret == AFC_E_SUCCESS) {
+				ret = err;
+			}
+			done = 1;
+			if (afc_error_is_fatal(err)) {
+				return err;
+			}
+			continue;
+		}
+		if (bytes_loc > chunk_size) {
+			bytes_loc = chunk_size;
+		}
+		if (done) {
+			discarded += (input) ? bytes_loc : 0;
+			continue;
+		}
+		if (input && bytes_loc > 0) {
+			if (input != ra->buffer + ra->length) {
+				memcpy(ra->buffer + ra->length, input, bytes_loc);
+			}
+			ra->length += bytes_loc;
+		}
+		/* a short read means we reached the end of the file */
+		if (bytes_loc < chunk_size) {
+			done = 1;
+		}
+	}
+
+	if (ret != AFC_E_SUCCESS) {
+		/* don't read ahead again until the next seek */
+		ra->sequential = 0;
+		if (discarded > 0) {
+			afc_error_t err = afc_seek(client, ra->handle, -(int64_t)discarded, SEEK_CUR);
+			if (err != AFC_E_SUCCESS) {
+				return err;
+			}
+		}
+		if (ra->length > 0) {
+			/* hand out what was read before the failure */
+			ret = AFC_E_SUCCESS;
+		}
+	}
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t handle, char *data, uint32_t length, uint32_t *bytes_read)
 {
 	char *input = NULL;
@@ -731,6 +2007,33 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 
 	afc_lock(client);
 
+	afc_write_buffer_flush_handle(client, handle);
+
+	struct afc_read_ahead *ra = afc_read_ahead_find(client, handle, client->read_ahead_window > 0);
+	if (ra) {
+		ra->sequential++;
+		if (ra->offset == ra->length && client->read_ahead_window > 0 && ra->sequential >= AFC_READ_AHEAD_TRIGGER && length < client->read_ahead_chunk) {
+			/* small sequential reads, fetch the next window at once */
+			ret = afc_read_ahead_fill(client, ra);
+			if (ret != AFC_E_SUCCESS || ra->length == 0) {
+				afc_unlock(client);
+				*bytes_read = 0;
+				return ret;
+			}
+		}
+		if (ra->offset < ra->length) {
+			current_count = ra->length - ra->offset;
+			if (current_count > length) {
+				current_count = length;
+			}
+			memcpy(data, ra->buffer + ra->offset, current_count);
+			ra->offset += current_count;
+			afc_unlock(client);
+			*bytes_read = current_count;
+			return AFC_E_SUCCESS;
+		}
+	}
+
 	/* Send the read command */
 	struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
 	readinfo->handle = handle;
@@ -741,15 +2044,13 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 		return AFC_E_NOT_ENOUGH_DATA;
 	}
 	/* Receive the data */
-	ret = afc_receive_data(client, &input, &bytes_loc);
+	ret = afc_receive_packet(client, client->afc_packet->packet_num, data, length, &input, &bytes_loc);
 	debug_info("afc_receive_data returned error: %d", ret);
 	debug_info("bytes returned: %i", bytes_loc);
 	if (ret != AFC_E_SUCCESS) {
 		afc_unlock(client);
 		return ret;
 	} else if (bytes_loc == 0) {
-		if (input)
-			free(input);
 		afc_unlock(client);
 		*bytes_read = current_count;
 		/* FIXME: check that's actually a success */
@@ -757,9 +2058,10 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 	} else {
 		if (input) {
 			debug_info("%d", bytes_loc);
-			memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
-			free(input);
-			input = NULL;
+			/* the data was received into the caller's buffer unless it didn't fit */
+			if (input != data) {
+				memcpy(data + current_count, input, (bytes_loc > length) ? length : bytes_loc);
+			}
 			current_count += (bytes_loc > length) ? length : bytes_loc;
 		}
 	}
@@ -768,6 +2070,96 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_read(afc_client_t client, uint64_t han
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API afc_error_t afc_file_read_pipelined(afc_client_t client, uint64_t handle, afc_file_read_cb_t callback, void *user_data, uint32_t window, uint32_t chunk_size)
+{
+	struct readinfo {
+		uint64_t handle;
+		uint64_t size;
+	};
+	afc_error_t ret = AFC_E_SUCCESS;
+	uint64_t next_packet = 0;
+	uint32_t in_flight = 0;
+	int stop = 0;
+
+	if (!client || !client->afc_packet || !client->parent || handle == 0 || !callback)
+		return AFC_E_INVALID_ARG;
+
+	if (window == 0)
+		window = AFC_PIPELINE_DEFAULT_WINDOW;
+	if (chunk_size == 0)
+		chunk_size = AFC_PIPELINE_DEFAULT_CHUNK_SIZE;
+
+	debug_info("reading with window %u, chunk size %u", window, chunk_size);
+
+	afc_lock(client);
+
+	afc_write_buffer_flush_handle(client, handle);
+	ret = afc_read_ahead_sync(client, handle);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return ret;
+	}
+
+	next_packet = client->afc_packet->packet_num + 1;
+
+	while (1) {
+		uint32_t bytes_loc = 0;
+		char *input = NULL;
+
+		/* keep the pipeline filled until end of file or an error occurs */
+		while (!stop && in_flight < window) {
+			struct readinfo* readinfo = (struct readinfo*)(AFC_PACKET_DATA_PTR);
+			readinfo->handle = handle;
+			readinfo->size = htole64(chunk_size);
+			afc_dispatch_packet(client, AFC_OP_FILE_READ, sizeof(struct readinfo), NULL, 0, &bytes_loc);
+			if (bytes_loc != sizeof(AFCPacket) + sizeof(struct readinfo)) {
+				debug_info("Failed to send read request");
+				ret = AFC_E_NOT_ENOUGH_DATA;
+				stop = 1;
+				break;
+			}
+			in_flight++;
+		}
+
+		if (in_flight == 0) {
+			break;
+		}
+
+		/* responses arrive in the order the requests were sent */
+		afc_error_t err = afc_receive_packet(client, next_packet, NULL, 0, &input, &bytes_loc);
+		next_packet++;
+		in_flight--;
+		if (err != AFC_E_SUCCESS) {
+			if (ret == AFC_E_SUCCESS) {
+				ret = err;
+			}
+			stop = 1;
+			if (afc_error_is_fatal(err)) {
+				/* the remaining responses can't be matched anymore */
+				break;
+			}
+			continue;
+		}
+
+		if (!stop && bytes_loc > 0 && input) {
+			if (callback(input, (bytes_loc > chunk_size) ? chunk_size : bytes_loc, user_data) != 0) {
+				debug_info("Read aborted by callback");
+				ret = AFC_E_OP_INTERRUPTED;
+				stop = 1;
+			}
+		}
+
+		/* a short read means we reached the end of the file */
+		if (bytes_loc < chunk_size) {
+			stop = 1;
+		}
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_written)
 {
 	uint32_t current_count = 0;
@@ -781,6 +2173,38 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 
 	afc_lock(client);
 
+	ret = afc_read_ahead_sync(client, handle);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		*bytes_written = 0;
+		return ret;
+	}
+
+	struct afc_write_buffer *wb = afc_write_buffer_find(client, handle);
+	if (wb) {
+		if (client->write_error != AFC_E_SUCCESS) {
+			/* don't buffer more data after a write failed */
+			ret = client->write_error;
+			client->write_error = AFC_E_SUCCESS;
+			afc_unlock(client);
+			*bytes_written = 0;
+			return ret;
+		}
+		if (wb->length + (uint64_t)length > wb->size) {
+			afc_write_buffer_flush(client, wb);
+		}
+		if (length < wb->size) {
+			memcpy(wb->buffer + wb->length, data, length);
+			wb->length += length;
+			afc_cache_invalidate_file(client, handle);
+			afc_device_info_account(client, length);
+			afc_unlock(client);
+			*bytes_written = length;
+			return AFC_E_SUCCESS;
+		}
+		/* large writes are sent right away, after the buffered data */
+	}
+
 	debug_info("Write length: %i", length);
 
 	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
@@ -789,18 +2213,133 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_write(afc_client_t client, uint64_t ha
 	current_count += bytes_loc - (sizeof(AFCPacket) + 8);
 
 	if (ret != AFC_E_SUCCESS) {
+		afc_cache_invalidate_file(client, handle);
 		afc_unlock(client);
 		*bytes_written = current_count;
 		return AFC_E_SUCCESS;
 	}
 
-	ret = afc_receive_data(client, NULL, &bytes_loc);
+	ret = afc_receive_data(client, NULL, &bytes_loc);
+	afc_cache_invalidate_file(client, handle);
+	afc_device_info_account(client, current_count);
+	afc_unlock(client);
+	if (ret != AFC_E_SUCCESS) {
+		debug_info("uh oh?");
+	}
+	*bytes_written = current_count;
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_write_async(afc_client_t client, uint64_t handle, const char *data, uint32_t length, uint32_t *bytes_queued)
+{
+	uint32_t bytes_loc = 0;
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet || !client->parent || !bytes_queued || (handle == 0))
+		return AFC_E_INVALID_ARG;
+
+	*bytes_queued = 0;
+
+	afc_lock(client);
+
+	/* keep the order with data buffered for the handle */
+	afc_write_buffer_flush_handle(client, handle);
+
+	/* make room in the window by collecting the oldest status replies */
+	afc_collect_write_status(client, AFC_PIPELINE_DEFAULT_WINDOW - 1);
+
+	if (client->write_error == AFC_E_SUCCESS) {
+		client->write_error = afc_read_ahead_sync(client, handle);
+	}
+
+	if (client->write_error != AFC_E_SUCCESS) {
+		/* don't queue more data after a write failed */
+		ret = client->write_error;
+		client->write_error = AFC_E_SUCCESS;
+		afc_unlock(client);
+		return ret;
+	}
+
+	debug_info("Write length: %i", length);
+
+	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
+	ret = afc_send_packet(client, AFC_OP_FILE_WRITE, 8, data, length, &bytes_loc);
+	afc_cache_invalidate_file(client, handle);
+	if (ret == AFC_E_SUCCESS && bytes_loc == sizeof(AFCPacket) + 8 + length) {
+		client->write_pending++;
+		*bytes_queued = length;
+		afc_device_info_account(client, length);
+	} else if (ret == AFC_E_SUCCESS) {
+		/* a partially sent packet leaves the connection out of sync */
+		ret = AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_flush(afc_client_t client)
+{
+	afc_error_t ret = AFC_E_SUCCESS;
+
+	if (!client || !client->afc_packet)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	struct afc_write_buffer *wb;
+	for (wb = client->write_buffers; wb; wb = wb->next) {
+		afc_write_buffer_flush(client, wb);
+	}
+	afc_collect_write_status(client, 0);
+	ret = client->write_error;
+	client->write_error = AFC_E_SUCCESS;
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_file_set_write_buffer(afc_client_t client, uint64_t handle, uint32_t size)
+{
+	if (!client || !client->afc_packet || handle == 0)
+		return AFC_E_INVALID_ARG;
+
+	afc_lock(client);
+
+	struct afc_write_buffer *wb = afc_write_buffer_find(client, handle);
+	if (size == 0) {
+		afc_write_buffer_remove(client, handle);
+		afc_unlock(client);
+		return AFC_E_SUCCESS;
+	}
+	if (!wb) {
+		wb = (struct afc_write_buffer*)calloc(1, sizeof(struct afc_write_buffer));
+		if (!wb) {
+			afc_unlock(client);
+			return AFC_E_NO_MEM;
+		}
+		wb->handle = handle;
+		wb->next = client->write_buffers;
+		client->write_buffers = wb;
+	} else {
+		afc_write_buffer_flush(client, wb);
+	}
+	if (wb->size != size) {
+		char *buffer = (char*)realloc(wb->buffer, size);
+		if (!buffer) {
+			afc_write_buffer_remove(client, handle);
+			afc_unlock(client);
+			return AFC_E_NO_MEM;
+		}
+		wb->buffer = buffer;
+		wb->size = size;
+	}
+
 	afc_unlock(client);
-	if (ret != AFC_E_SUCCESS) {
-		debug_info("uh oh?");
-	}
-	*bytes_written = current_count;
-	return ret;
+
+	return AFC_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t handle)
@@ -817,6 +2356,9 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t ha
 
 	debug_info("File handle %i", handle);
 
+	afc_read_ahead_forget(client, handle);
+	afc_write_buffer_remove(client, handle);
+
 	/* Send command */
 	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
 	ret = afc_dispatch_packet(client, AFC_OP_FILE_CLOSE, data_len, NULL, 0, &bytes);
@@ -828,6 +2370,13 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_close(afc_client_t client, uint64_t ha
 
 	/* Receive the response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_close_file(client, handle);
+
+	/* report errors of deferred writes */
+	if (ret == AFC_E_SUCCESS && client->write_error != AFC_E_SUCCESS) {
+		ret = client->write_error;
+	}
+	client->write_error = AFC_E_SUCCESS;
 
 	afc_unlock(client);
 
@@ -848,6 +2397,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_lock(afc_client_t client, uint64_t han
 
 	afc_lock(client);
 
+	afc_write_buffer_flush_handle(client, handle);
+
 	debug_info("file handle %i", handle);
 
 	/* Send command */
@@ -870,12 +2421,6 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_lock(afc_client_t client, uint64_t han
 
 LIBIMOBILEDEVICE_API afc_error_t afc_file_seek(afc_client_t client, uint64_t handle, int64_t offset, int whence)
 {
-	uint32_t bytes = 0;
-	struct seekinfo {
-		uint64_t handle;
-		uint64_t whence;
-		int64_t offset;
-	};
 	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
 
 	if (!client || (handle == 0))
@@ -883,19 +2428,18 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_seek(afc_client_t client, uint64_t han
 
 	afc_lock(client);
 
-	/* Send the command */
-	struct seekinfo* seekinfo = (struct seekinfo*)(AFC_PACKET_DATA_PTR);
-	seekinfo->handle = handle;
-	seekinfo->whence = htole64(whence);
-	seekinfo->offset = (int64_t)htole64(offset);
-	ret = afc_dispatch_packet(client, AFC_OP_FILE_SEEK, sizeof(struct seekinfo), NULL, 0, &bytes);
+	afc_write_buffer_flush_handle(client, handle);
 
-	if (ret != AFC_E_SUCCESS) {
-		afc_unlock(client);
-		return AFC_E_NOT_ENOUGH_DATA;
+	struct afc_read_ahead *ra = afc_read_ahead_find(client, handle, 0);
+	if (ra) {
+		/* the device is ahead by the data that was not handed out yet */
+		if (whence == SEEK_CUR) {
+			offset -= (int64_t)(ra->length - ra->offset);
+		}
+		ra->offset = ra->length = 0;
+		ra->sequential = 0;
 	}
-	/* Receive response */
-	ret = afc_receive_data(client, NULL, &bytes);
+	ret = afc_seek(client, handle, offset, whence);
 
 	afc_unlock(client);
 
@@ -915,6 +2459,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t han
 
 	afc_lock(client);
 
+	afc_write_buffer_flush_handle(client, handle);
+
 	/* Send the command */
 	*(uint64_t*)(AFC_PACKET_DATA_PTR) = handle;
 	ret = afc_dispatch_packet(client, AFC_OP_FILE_TELL, data_len, NULL, 0, &bytes);
@@ -929,8 +2475,12 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_tell(afc_client_t client, uint64_t han
 		/* Get the position */
 		memcpy(position, buffer, sizeof(uint64_t));
 		*position = le64toh(*position);
+		struct afc_read_ahead *ra = afc_read_ahead_find(client, handle, 0);
+		if (ra) {
+			/* report the position the caller read up to */
+			*position -= ra->length - ra->offset;
+		}
 	}
-	free(buffer);
 
 	afc_unlock(client);
 
@@ -951,6 +2501,14 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t
 
 	afc_lock(client);
 
+	afc_write_buffer_flush_handle(client, handle);
+
+	ret = afc_read_ahead_sync(client, handle);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return ret;
+	}
+
 	/* Send command */
 	struct truncinfo* truncinfo = (struct truncinfo*)(AFC_PACKET_DATA_PTR);
 	truncinfo->handle = handle;
@@ -963,6 +2521,8 @@ LIBIMOBILEDEVICE_API afc_error_t afc_file_truncate(afc_client_t client, uint64_t
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate_file(client, handle);
+	afc_device_info_expire(client);
 
 	afc_unlock(client);
 
@@ -996,6 +2556,57 @@ LIBIMOBILEDEVICE_API afc_error_t afc_truncate(afc_client_t client, const char *p
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
+	afc_device_info_expire(client);
+
+	afc_unlock(client);
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_get_file_hash(afc_client_t client, const char *path, char **hash, uint32_t *hash_len)
+{
+	char *received = NULL;
+	uint32_t bytes = 0;
+	afc_error_t ret = AFC_E_UNKNOWN_ERROR;
+
+	if (!client || !path || !hash || !hash_len || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	*hash = NULL;
+	*hash_len = 0;
+
+	afc_lock(client);
+
+	uint32_t data_len = (uint32_t)strlen(path)+1;
+	if (_afc_check_packet_buffer(client, data_len) < 0) {
+		afc_unlock(client);
+		debug_info("Failed to realloc packet buffer");
+		return AFC_E_NO_MEM;
+	}
+
+	/* Send command */
+	memcpy(AFC_PACKET_DATA_PTR, path, data_len);
+	ret = afc_dispatch_packet(client, AFC_OP_GET_FILE_HASH, data_len, NULL, 0, &bytes);
+	if (ret != AFC_E_SUCCESS) {
+		afc_unlock(client);
+		return AFC_E_NOT_ENOUGH_DATA;
+	}
+
+	/* Receive data */
+	ret = afc_receive_data(client, &received, &bytes);
+	if (ret == AFC_E_SUCCESS && received && bytes > 0) {
+		/* the received data belongs to the client, hand out a copy */
+		*hash = (char*)malloc(bytes);
+		if (*hash) {
+			memcpy(*hash, received, bytes);
+			*hash_len = bytes;
+		} else {
+			ret = AFC_E_NO_MEM;
+		}
+	} else if (ret == AFC_E_SUCCESS) {
+		ret = AFC_E_EMPTY_RESPONSE;
+	}
 
 	afc_unlock(client);
 
@@ -1038,6 +2649,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_make_link(afc_client_t client, afc_link_typ
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, linkname);
 
 	afc_unlock(client);
 
@@ -1071,6 +2683,7 @@ LIBIMOBILEDEVICE_API afc_error_t afc_set_file_time(afc_client_t client, const ch
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
 
 	afc_unlock(client);
 
@@ -1103,12 +2716,200 @@ LIBIMOBILEDEVICE_API afc_error_t afc_remove_path_and_contents(afc_client_t clien
 	}
 	/* Receive response */
 	ret = afc_receive_data(client, NULL, &bytes);
+	afc_cache_invalidate(client, path);
+	afc_device_info_expire(client);
 
 	afc_unlock(client);
 
 	return ret;
 }
 
+/**
+ * Removes the given entries of a directory with pipelined REMOVE_PATH
+ * requests.
+ *
+ * @return AFC_E_SUCCESS if all entries were removed, otherwise the error
+ *     of the first entry that could not be removed.
+ */
+static afc_error_t afc_remove_entries(afc_client_t client, const char *dir, const char **names, uint32_t count)
+{
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t dir_len = (uint32_t)strlen(dir);
+	afc_error_t ret = AFC_E_SUCCESS;
+	afc_error_t first_error = AFC_E_SUCCESS;
+
+	afc_lock(client);
+
+	/* replies to queued writes must not be taken for remove replies */
+	afc_collect_write_status(client, 0);
+	uint64_t next_packet = client->afc_packet->packet_num + 1;
+
+	while (received < sent || (ret == AFC_E_SUCCESS && sent < count)) {
+		/* keep the pipeline filled */
+		while (ret == AFC_E_SUCCESS && sent < count && sent - received < AFC_REMOVE_PIPELINE_WINDOW) {
+			ret = afc_dispatch_path_request(client, AFC_OP_REMOVE_PATH, dir, dir_len, names[sent]);
+			if (ret != AFC_E_SUCCESS) {
+				break;
+			}
+			sent++;
+		}
+		if (received == sent || afc_error_is_fatal(ret)) {
+			break;
+		}
+
+		uint32_t bytes = 0;
+		afc_error_t err = afc_receive_packet(client, next_packet, NULL, 0, NULL, &bytes);
+		next_packet++;
+		received++;
+		if (err != AFC_E_SUCCESS) {
+			/* unknown error actually means directory not empty */
+			if (err == AFC_E_UNKNOWN_ERROR)
+				err = AFC_E_DIR_NOT_EMPTY;
+			debug_info("Failed to remove %s/%s (%d)", dir, names[received-1], err);
+			if (first_error == AFC_E_SUCCESS)
+				first_error = err;
+			if (afc_error_is_fatal(err)) {
+				ret = err;
+				break;
+			}
+		}
+	}
+
+	afc_unlock(client);
+
+	return (ret != AFC_E_SUCCESS) ? ret : first_error;
+}
+
+struct afc_remove_dir {
+	char *path;
+	int listed;
+};
+
+LIBIMOBILEDEVICE_API afc_error_t afc_remove_tree(afc_client_t client, const char *path)
+{
+	afc_file_info_t info;
+	struct afc_remove_dir *stack = NULL;
+	uint32_t depth = 0;
+	uint32_t capacity = 0;
+	afc_error_t first_error = AFC_E_SUCCESS;
+
+	if (!client || !path || !client->afc_packet || !client->parent)
+		return AFC_E_INVALID_ARG;
+
+	afc_error_t ret = afc_remove_path_and_contents(client, path);
+	if (ret != AFC_E_UNKNOWN_PACKET_TYPE && ret != AFC_E_OP_NOT_SUPPORTED) {
+		return ret;
+	}
+	debug_info("RemovePathAndContents not supported, removing %s entry by entry", path);
+
+	ret = afc_get_file_info_struct(client, path, &info);
+	if (ret != AFC_E_SUCCESS) {
+		return ret;
+	}
+	if (info.type != AFC_FILE_TYPE_DIRECTORY) {
+		return afc_remove_path(client, path);
+	}
+
+	/* depth first, a directory is removed once its contents are gone */
+	capacity = 16;
+	stack = (struct afc_remove_dir*)malloc(capacity * sizeof(struct afc_remove_dir));
+	if (!stack) {
+		return AFC_E_NO_MEM;
+	}
+	stack[0].path = strdup(path);
+	stack[0].listed = 0;
+	depth = 1;
+
+	while (depth > 0 && !afc_error_is_fatal(ret)) {
+		struct afc_remove_dir *dir = &stack[depth-1];
+		if (!dir->path) {
+			ret = AFC_E_NO_MEM;
+			break;
+		}
+		if (dir->listed) {
+			ret = afc_remove_path(client, dir->path);
+			if (ret != AFC_E_SUCCESS && first_error == AFC_E_SUCCESS) {
+				first_error = ret;
+			}
+			free(dir->path);
+			depth--;
+			continue;
+		}
+		dir->listed = 1;
+
+		afc_directory_entry_t *entries = NULL;
+		uint32_t count = 0;
+		uint32_t i;
+		uint32_t num_files = 0;
+		ret = afc_read_directory_with_info(client, dir->path, &entries, &count);
+		if (ret != AFC_E_SUCCESS) {
+			if (first_error == AFC_E_SUCCESS)
+				first_error = ret;
+			continue;
+		}
+		if (count == 0) {
+			continue;
+		}
+
+		/* the path string stays put when the stack is reallocated */
+		const char *dir_path = dir->path;
+		const char **files = (const char**)malloc(count * sizeof(char*));
+		if (files && depth + count > capacity) {
+			while (depth + count > capacity) {
+				capacity *= 2;
+			}
+			struct afc_remove_dir *new_stack = (struct afc_remove_dir*)realloc(stack, capacity * sizeof(struct afc_remove_dir));
+			if (new_stack) {
+				stack = new_stack;
+			} else {
+				free(files);
+				files = NULL;
+			}
+		}
+		if (!files) {
+			afc_directory_entries_free(entries);
+			ret = AFC_E_NO_MEM;
+			break;
+		}
+		for (i = 0; i < count; i++) {
+			if (entries[i].type != AFC_FILE_TYPE_DIRECTORY) {
+				files[num_files++] = entries[i].name;
+			}
+		}
+		ret = (num_files > 0) ? afc_remove_entries(client, dir_path, files, num_files) : AFC_E_SUCCESS;
+		free(files);
+		for (i = 0; i < count && !afc_error_is_fatal(ret); i++) {
+			if (entries[i].type == AFC_FILE_TYPE_DIRECTORY) {
+				size_t len = strlen(dir_path) + 1 + strlen(entries[i].name) + 1;
+				char *child = (char*)malloc(len);
+				if (child) {
+					snprintf(child, len, "%s/%s", dir_path, entries[i].name);
+				}
+				stack[depth].path = child;
+				stack[depth].listed = 0;
+				depth++;
+			}
+		}
+		afc_directory_entries_free(entries);
+		if (ret != AFC_E_SUCCESS && first_error == AFC_E_SUCCESS) {
+			first_error = ret;
+		}
+	}
+
+	while (depth > 0) {
+		free(stack[--depth].path);
+	}
+	free(stack);
+
+	afc_lock(client);
+	afc_cache_invalidate(client, path);
+	afc_device_info_expire(client);
+	afc_unlock(client);
+
+	return (first_error != AFC_E_SUCCESS) ? first_error : ret;
+}
+
 LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 {
 	int i = 0;
@@ -1123,3 +2924,374 @@ LIBIMOBILEDEVICE_API afc_error_t afc_dictionary_free(char **dictionary)
 
 	return AFC_E_SUCCESS;
 }
+
+/* Tree copy engine */
+
+struct afc_copy_item {
+	char *device_path;
+	char *host_path;
+	afc_directory_entry_t entry;
+	char *link_target;
+	struct afc_copy_item *next;
+};
+
+struct afc_copy_engine {
+	mutex_t mutex;
+	cond_t cond;
+	struct afc_copy_item *head;
+	struct afc_copy_item *tail;
+	int active;
+	int abort;
+	afc_error_t result;
+	afc_copy_progress_cb_t progress_cb;
+	afc_copy_error_cb_t error_cb;
+	void *user_data;
+};
+
+struct afc_copy_worker {
+	struct afc_copy_engine *engine;
+	afc_client_t client;
+	THREAD_T thread;
+};
+
+struct afc_copy_file_ctx {
+	struct afc_copy_engine *engine;
+	const char *device_path;
+	FILE *output;
+	uint64_t bytes_copied;
+	uint64_t file_size;
+};
+
+static char *afc_copy_path_join(const char *dir, const char *name)
+{
+	size_t dir_len = strlen(dir);
+	size_t name_len = strlen(name);
+	char *path = (char*)malloc(dir_len + 1 + name_len + 1);
+	if (!path) {
+		return NULL;
+	}
+	memcpy(path, dir, dir_len);
+	if (dir_len == 0 || dir[dir_len-1] != '/') {
+		path[dir_len++] = '/';
+	}
+	memcpy(path + dir_len, name, name_len + 1);
+	return path;
+}
+
+static void afc_copy_item_free(struct afc_copy_item *item)
+{
+	if (!item)
+		return;
+	free(item->device_path);
+	free(item->host_path);
+	free(item->link_target);
+	free(item);
+}
+
+/**
+ * Queues an item for the worker threads. Must be called with the engine
+ * mutex held.
+ */
+static void afc_copy_enqueue(struct afc_copy_engine *engine, struct afc_copy_item *item)
+{
+	item->next = NULL;
+	if (engine->tail) {
+		engine->tail->next = item;
+	} else {
+		engine->head = item;
+	}
+	engine->tail = item;
+	cond_signal(&engine->cond);
+}
+
+/**
+ * Reports an error through the error callback and records it as the result
+ * of the copy operation.
+ */
+static void afc_copy_report_error(struct afc_copy_engine *engine, const char *path, afc_error_t err)
+{
+	debug_info("Failed to copy '%s' (%d)", path, err);
+	mutex_lock(&engine->mutex);
+	if (engine->result == AFC_E_SUCCESS) {
+		engine->result = err;
+	}
+	if (!engine->error_cb || engine->error_cb(path, err, engine->user_data) != 0) {
+		engine->abort = 1;
+		cond_broadcast(&engine->cond);
+	}
+	mutex_unlock(&engine->mutex);
+}
+
+static int afc_copy_file_chunk_cb(const char *data, uint32_t length, void *user_data)
+{
+	struct afc_copy_file_ctx *ctx = (struct afc_copy_file_ctx*)user_data;
+	int res = 0;
+
+	if (fwrite(data, 1, length, ctx->output) != length) {
+		return -1;
+	}
+	ctx->bytes_copied += length;
+
+	mutex_lock(&ctx->engine->mutex);
+	if (ctx->engine->abort) {
+		res = -1;
+	} else if (ctx->engine->progress_cb) {
+		ctx->engine->progress_cb(ctx->device_path, ctx->bytes_copied, ctx->file_size, ctx->engine->user_data);
+	}
+	mutex_unlock(&ctx->engine->mutex);
+
+	return res;
+}
+
+static void afc_copy_directory(struct afc_copy_worker *worker, struct afc_copy_item *item)
+{
+	struct afc_copy_engine *engine = worker->engine;
+	afc_directory_entry_t *entries = NULL;
+	uint32_t count = 0;
+	uint32_t i = 0;
+
+#ifdef WIN32
+	if (_mkdir(item->host_path) != 0 && errno != EEXIST) {
+#else
+	if (mkdir(item->host_path, 0755) != 0 && errno != EEXIST) {
+#endif
+		afc_copy_report_error(engine, item->device_path, AFC_E_PERM_DENIED);
+		return;
+	}
+
+	afc_error_t err = afc_read_directory_with_info(worker->client, item->device_path, &entries, &count);
+	if (err != AFC_E_SUCCESS) {
+		afc_copy_report_error(engine, item->device_path, err);
+		return;
+	}
+
+	mutex_lock(&engine->mutex);
+	for (i = 0; i < count && !engine->abort; i++) {
+		struct afc_copy_item *child = (struct afc_copy_item*)calloc(1, sizeof(struct afc_copy_item));
+		if (child) {
+			child->device_path = afc_copy_path_join(item->device_path, entries[i].name);
+			child->host_path = afc_copy_path_join(item->host_path, entries[i].name);
+			if (entries[i].link_target) {
+				child->link_target = strdup(entries[i].link_target);
+			}
+		}
+		if (!child || !child->device_path || !child->host_path) {
+			afc_copy_item_free(child);
+			if (engine->result == AFC_E_SUCCESS) {
+				engine->result = AFC_E_NO_MEM;
+			}
+			engine->abort = 1;
+			cond_broadcast(&engine->cond);
+			break;
+		}
+		child->entry = entries[i];
+		child->entry.name = NULL;
+		child->entry.link_target = child->link_target;
+		afc_copy_enqueue(engine, child);
+	}
+	mutex_unlock(&engine->mutex);
+
+	afc_directory_entries_free(entries);
+}
+
+static void afc_copy_file(struct afc_copy_worker *worker, struct afc_copy_item *item)
+{
+	struct afc_copy_engine *engine = worker->engine;
+	struct afc_copy_file_ctx ctx;
+	uint64_t handle = 0;
+
+	afc_error_t err = afc_file_open(worker->client, item->device_path, AFC_FOPEN_RDONLY, &handle);
+	if (err != AFC_E_SUCCESS) {
+		afc_copy_report_error(engine, item->device_path, err);
+		return;
+	}
+
+	ctx.engine = engine;
+	ctx.device_path = item->device_path;
+	ctx.output = fopen(item->host_path, "wb");
+	ctx.bytes_copied = 0;
+	ctx.file_size = item->entry.size;
+	if (!ctx.output) {
+		afc_file_close(worker->client, handle);
+		afc_copy_report_error(engine, item->device_path, AFC_E_PERM_DENIED);
+		return;
+	}
+
+	err = afc_file_read_pipelined(worker->client, handle, afc_copy_file_chunk_cb, &ctx, 0, 0);
+	afc_file_close(worker->client, handle);
+	fclose(ctx.output);
+
+	if (err == AFC_E_OP_INTERRUPTED && engine->abort) {
+		/* aborted because of an error elsewhere */
+		return;
+	}
+	if (err == AFC_E_SUCCESS && ctx.bytes_copied != ctx.file_size) {
+		err = AFC_E_NOT_ENOUGH_DATA;
+	}
+	if (err != AFC_E_SUCCESS) {
+		afc_copy_report_error(engine, item->device_path, err);
+	} else if (ctx.bytes_copied == 0 && engine->progress_cb) {
+		/* make sure empty files are reported, too */
+		mutex_lock(&engine->mutex);
+		engine->progress_cb(item->device_path, 0, 0, engine->user_data);
+		mutex_unlock(&engine->mutex);
+	}
+}
+
+static void* afc_copy_worker_thread(void *arg)
+{
+	struct afc_copy_worker *worker = (struct afc_copy_worker*)arg;
+	struct afc_copy_engine *engine = worker->engine;
+
+	while (1) {
+		mutex_lock(&engine->mutex);
+		while (!engine->head && engine->active > 0 && !engine->abort) {
+			cond_wait(&engine->cond, &engine->mutex);
+		}
+		if (!engine->head || engine->abort) {
+			/* either all work is done or the copy was aborted */
+			cond_broadcast(&engine->cond);
+			mutex_unlock(&engine->mutex);
+			break;
+		}
+		struct afc_copy_item *item = engine->head;
+		engine->head = item->next;
+		if (!engine->head) {
+			engine->tail = NULL;
+		}
+		engine->active++;
+		mutex_unlock(&engine->mutex);
+
+		switch (item->entry.type) {
+			case AFC_FILE_TYPE_DIRECTORY:
+				afc_copy_directory(worker, item);
+				break;
+			case AFC_FILE_TYPE_REGULAR:
+				afc_copy_file(worker, item);
+				break;
+			case AFC_FILE_TYPE_SYMLINK:
+#ifndef WIN32
+				if (item->link_target) {
+					remove(item->host_path);
+					if (symlink(item->link_target, item->host_path) != 0) {
+						afc_copy_report_error(engine, item->device_path, AFC_E_PERM_DENIED);
+					}
+				}
+#endif
+				break;
+			default:
+				debug_info("Skipping '%s' of type %d", item->device_path, item->entry.type);
+				break;
+		}
+		afc_copy_item_free(item);
+
+		mutex_lock(&engine->mutex);
+		engine->active--;
+		if (engine->active == 0 && !engine->head) {
+			cond_broadcast(&engine->cond);
+		}
+		mutex_unlock(&engine->mutex);
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API afc_error_t afc_copy_tree(idevice_t device, const char *device_path, const char *host_path, uint32_t num_connections, afc_copy_progress_cb_t progress_cb, afc_copy_error_cb_t error_cb, void *user_data)
+{
+	struct afc_copy_engine engine;
+	struct afc_copy_worker *workers = NULL;
+	struct afc_copy_item *item = NULL;
+	uint32_t num_workers = 0;
+	uint32_t i = 0;
+	afc_error_t err = AFC_E_SUCCESS;
+
+	if (!device || !device_path || !host_path)
+		return AFC_E_INVALID_ARG;
+
+	if (num_connections == 0)
+		num_connections = AFC_COPY_DEFAULT_CONNECTIONS;
+
+	workers = (struct afc_copy_worker*)calloc(num_connections, sizeof(struct afc_copy_worker));
+	item = (struct afc_copy_item*)calloc(1, sizeof(struct afc_copy_item));
+	if (!workers || !item) {
+		free(workers);
+		free(item);
+		return AFC_E_NO_MEM;
+	}
+	item->device_path = strdup(device_path);
+	item->host_path = strdup(host_path);
+	item->entry.type = AFC_FILE_TYPE_DIRECTORY;
+	if (!item->device_path || !item->host_path) {
+		afc_copy_item_free(item);
+		free(workers);
+		return AFC_E_NO_MEM;
+	}
+
+	memset(&engine, '\0', sizeof(engine));
+	mutex_init(&engine.mutex);
+	cond_init(&engine.cond);
+	engine.result = AFC_E_SUCCESS;
+	engine.progress_cb = progress_cb;
+	engine.error_cb = error_cb;
+	engine.user_data = user_data;
+	afc_copy_enqueue(&engine, item);
+
+	/* open the connection pool */
+	for (i = 0; i < num_connections; i++) {
+		err = afc_client_start_service(device, &workers[num_workers].client, "afc_copy_tree");
+		if (err != AFC_E_SUCCESS) {
+			debug_info("Could only open %u of %u AFC connections (%d)", num_workers, num_connections, err);
+			break;
+		}
+		workers[num_workers].engine = &engine;
+		num_workers++;
+	}
+
+	if (num_workers == 0) {
+		afc_copy_item_free(item);
+		cond_destroy(&engine.cond);
+		mutex_destroy(&engine.mutex);
+		free(workers);
+		return err;
+	}
+
+	uint32_t num_started = 0;
+	for (i = 0; i < num_workers; i++) {
+		if (thread_new(&workers[i].thread, afc_copy_worker_thread, &workers[i]) != 0) {
+			debug_info("Failed to start worker thread %u", i);
+			afc_client_free(workers[i].client);
+			workers[i].client = NULL;
+		} else {
+			num_started++;
+		}
+	}
+	if (num_started == 0) {
+		engine.result = AFC_E_NO_RESOURCES;
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		if (workers[i].client) {
+			thread_join(workers[i].thread);
+			thread_free(workers[i].thread);
+			afc_client_free(workers[i].client);
+		}
+	}
+
+	/* discard remaining work after an abort */
+	while (engine.head) {
+		item = engine.head;
+		engine.head = item->next;
+		afc_copy_item_free(item);
+	}
+
+	err = engine.result;
+	if (err == AFC_E_SUCCESS && engine.abort) {
+		err = AFC_E_OP_INTERRUPTED;
+	}
+
+	cond_destroy(&engine.cond);
+	mutex_destroy(&engine.mutex);
+	free(workers);
+
+	return err;
+}
@@ -33,6 +33,51 @@
 #define AFC_MAGIC "CFA6LPAA"
 #define AFC_MAGIC_LEN (8)
 
+/* initial size of the request data part of the send packet buffer */
+#define AFC_PACKET_DEFAULT_CAPACITY 1024
+
+#define AFC_PIPELINE_DEFAULT_WINDOW 8
+#define AFC_PIPELINE_DEFAULT_CHUNK_SIZE 65536
+#define AFC_STAT_PIPELINE_WINDOW 64
+#define AFC_REMOVE_PIPELINE_WINDOW 64
+#define AFC_COPY_DEFAULT_CONNECTIONS 4
+
+/* sequential read-ahead, see afc_client_set_read_ahead() */
+#define AFC_READ_AHEAD_DEFAULT_WINDOW 4
+#define AFC_READ_AHEAD_DEFAULT_CHUNK_SIZE 65536
+/* consecutive reads of a handle without a seek that start the read-ahead */
+#define AFC_READ_AHEAD_TRIGGER 2
+
+/* metadata cache, see afc_client_set_cache_ttl() */
+#define AFC_CACHE_BUCKETS 1024
+#define AFC_CACHE_MAX_ENTRIES 16384
+
+enum afc_cache_kind {
+	AFC_CACHE_FILE_INFO = 1,
+	AFC_CACHE_DIRECTORY = 2
+};
+
+/* raw GET_FILE_INFO or READ_DIR response of a path */
+struct afc_cache_entry {
+	struct afc_cache_entry *next;
+	uint32_t hash;
+	enum afc_cache_kind kind;
+	uint64_t expires;
+	/* AFC_E_SUCCESS or AFC_E_OBJECT_NOT_FOUND */
+	afc_error_t result;
+	char *data;
+	uint32_t length;
+	/* normalized, starting with a single '/' and without trailing '/' */
+	char *path;
+};
+
+/* file opened through the client, used to invalidate on writes */
+struct afc_cache_file {
+	struct afc_cache_file *next;
+	uint64_t handle;
+	char *path;
+};
+
 typedef struct {
 	char magic[AFC_MAGIC_LEN];
 	uint64_t entire_length, this_length, packet_num, operation;
@@ -50,12 +95,58 @@ typedef struct {
 	(x)->packet_num    = le64toh((x)->packet_num); \
 	(x)->operation     = le64toh((x)->operation);
 
+/* read-ahead state of a file handle */
+struct afc_read_ahead {
+	struct afc_read_ahead *next;
+	uint64_t handle;
+	/* reads since the handle was opened or seeked */
+	uint32_t sequential;
+	/* data read from the device that the caller did not get yet, the
+	   device's file position is ahead of the caller's by length - offset */
+	char *buffer;
+	uint32_t size;
+	uint32_t offset;
+	uint32_t length;
+};
+
+/* write-back buffer of a file handle, see afc_file_set_write_buffer() */
+struct afc_write_buffer {
+	struct afc_write_buffer *next;
+	uint64_t handle;
+	char *buffer;
+	uint32_t size;
+	uint32_t length;
+};
+
 struct afc_client_private {
 	service_client_t parent;
 	AFCPacket *afc_packet;
 	uint32_t packet_extra;
 	mutex_t mutex;
 	int free_parent;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	uint32_t write_pending;
+	afc_error_t write_error;
+	/* send time of the last packet while tracing */
+	uint64_t trace_start;
+	/* metadata cache, protected by mutex, disabled while cache_ttl is 0 */
+	uint64_t cache_ttl;
+	struct afc_cache_entry **cache_buckets;
+	uint32_t cache_count;
+	struct afc_cache_file *cache_files;
+	/* read-ahead, disabled while read_ahead_window is 0 */
+	uint32_t read_ahead_window;
+	uint32_t read_ahead_chunk;
+	struct afc_read_ahead *read_aheads;
+	struct afc_write_buffer *write_buffers;
+	/* cached GET_DEVINFO response, disabled while devinfo_ttl is 0 */
+	uint64_t devinfo_ttl;
+	char *devinfo_data;
+	uint32_t devinfo_length;
+	uint64_t devinfo_expires;
+	/* bytes written through the client since the response was received */
+	uint64_t devinfo_written;
 };
 
 /* AFC Operations */
@@ -63,6 +63,100 @@ static companion_proxy_error_t companion_proxy_error(property_list_service_error
 	return COMPANION_PROXY_E_UNKNOWN_ERROR;
 }
 
+static thread_once_t mirror_once = THREAD_ONCE_INIT;
+static mutex_t mirror_mutex;
+static struct companion_proxy_mirror *mirrors = NULL;
+static idevice_event_loop_t shared_loop = NULL;
+
+static void companion_proxy_mirror_init(void)
+{
+	mutex_init(&mirror_mutex);
+}
+
+static const char* companion_proxy_client_udid(companion_proxy_client_t client)
+{
+	return client->parent->parent->connection->device->udid;
+}
+
+/* must be called with mirror_mutex held */
+static struct companion_proxy_mirror* companion_proxy_mirror_find(const char* udid)
+{
+	struct companion_proxy_mirror *m;
+	for (m = mirrors; m; m = m->next) {
+		if (!strcmp(m->udid, udid))
+			return m;
+	}
+	return NULL;
+}
+
+/* must be called with mirror_mutex held */
+static struct companion_proxy_mirror* companion_proxy_mirror_acquire(const char* udid)
+{
+	struct companion_proxy_mirror *m = companion_proxy_mirror_find(udid);
+	if (!m) {
+		m = (struct companion_proxy_mirror*)calloc(1, sizeof(struct companion_proxy_mirror));
+		if (!m)
+			return NULL;
+		m->udid = strdup(udid);
+		m->values = plist_new_dict();
+		m->next = mirrors;
+		mirrors = m;
+	}
+	m->listeners++;
+	return m;
+}
+
+/* must be called with mirror_mutex held */
+static void companion_proxy_mirror_release(struct companion_proxy_mirror* mirror)
+{
+	struct companion_proxy_mirror **pm;
+	if (!mirror || --mirror->listeners > 0)
+		return;
+	for (pm = &mirrors; *pm; pm = &(*pm)->next) {
+		if (*pm == mirror) {
+			*pm = mirror->next;
+			break;
+		}
+	}
+	plist_free(mirror->registry);
+	plist_free(mirror->values);
+	free(mirror->udid);
+	free(mirror);
+}
+
+/* must be called with mirror_mutex held */
+static void companion_proxy_mirror_update(struct companion_proxy_mirror* mirror, plist_t event)
+{
+	plist_t devices = plist_dict_get_item(event, "PairedDevicesArray");
+
+	mirror->generation++;
+	if (!PLIST_IS_ARRAY(devices)) {
+		/* nothing we can apply locally, look everything up again */
+		plist_free(mirror->registry);
+		mirror->registry = NULL;
+		plist_free(mirror->values);
+		mirror->values = plist_new_dict();
+		return;
+	}
+
+	/* take over the new registry and keep the values of devices still paired */
+	plist_t values = plist_new_dict();
+	uint32_t i;
+	for (i = 0; i < plist_array_get_size(devices); i++) {
+		const char *companion_udid = plist_get_string_ptr(plist_array_get_item(devices, i), NULL);
+		if (!companion_udid)
+			continue;
+		plist_t node = plist_dict_get_item(mirror->values, companion_udid);
+		if (node) {
+			plist_dict_set_item(values, companion_udid, plist_copy(node));
+		}
+	}
+	plist_free(mirror->values);
+	mirror->values = values;
+	plist_free(mirror->registry);
+	mirror->registry = plist_copy(devices);
+}
+
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_client_new(idevice_t device, lockdownd_service_descriptor_t service, companion_proxy_client_t * client)
 {
 	*client = NULL;
@@ -83,7 +177,10 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_client_new(idevice_
 
 	companion_proxy_client_t client_loc = (companion_proxy_client_t) malloc(sizeof(struct companion_proxy_client_private));
 	client_loc->parent = plclient;
-	client_loc->event_thread = THREAD_T_NULL;
+	client_loc->loop = NULL;
+	client_loc->callback = NULL;
+	client_loc->user_data = NULL;
+	client_loc->mirror = NULL;
 
 	*client = client_loc;
 
@@ -103,15 +200,9 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_client_free(compani
 	if (!client)
 		return COMPANION_PROXY_E_INVALID_ARG;
 
-	property_list_service_client_t parent = client->parent;
-	client->parent = NULL;
-	if (client->event_thread) {
-		debug_info("joining event thread");
-		thread_join(client->event_thread);
-		thread_free(client->event_thread);
-		client->event_thread = THREAD_T_NULL;
-	}
-	companion_proxy_error_t err = companion_proxy_error(property_list_service_client_free(parent));
+	companion_proxy_stop_listening_for_devices(client);
+
+	companion_proxy_error_t err = companion_proxy_error(property_list_service_client_free(client->parent));
 	free(client);
 
 	return err;
@@ -146,10 +237,31 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_receive(companion_p
 
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_device_registry(companion_proxy_client_t client, plist_t* paired_devices)
 {
-	if (!client || !paired_devices) {
+	if (!client || !client->parent || !paired_devices) {
 		return COMPANION_PROXY_E_INVALID_ARG;
 	}
 
+	const char *udid = companion_proxy_client_udid(client);
+	struct companion_proxy_mirror *mirror = NULL;
+	uint32_t generation = 0;
+
+	thread_once(&mirror_once, companion_proxy_mirror_init);
+	mutex_lock(&mirror_mutex);
+	mirror = companion_proxy_mirror_find(udid);
+	if (mirror) {
+		if (mirror->registry) {
+			companion_proxy_error_t cached = COMPANION_PROXY_E_NO_DEVICES;
+			if (plist_array_get_size(mirror->registry) > 0) {
+				*paired_devices = plist_copy(mirror->registry);
+				cached = COMPANION_PROXY_E_SUCCESS;
+			}
+			mutex_unlock(&mirror_mutex);
+			return cached;
+		}
+		generation = mirror->generation;
+	}
+	mutex_unlock(&mirror_mutex);
+
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Command", plist_new_string("GetDeviceRegistry"));
 
@@ -167,9 +279,11 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_device_registry
 	if (!dict || !PLIST_IS_DICT(dict)) {
 		return COMPANION_PROXY_E_PLIST_ERROR;
 	}
+	plist_t registry = NULL;
 	plist_t val = plist_dict_get_item(dict, "PairedDevicesArray");
 	if (val) {
 		*paired_devices = plist_copy(val);
+		registry = val;
 		res = COMPANION_PROXY_E_SUCCESS;
 	} else {
 		res = COMPANION_PROXY_E_UNKNOWN_ERROR;
@@ -180,51 +294,96 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_device_registry
 			}
 		}
 	}
+
+	if (registry || res == COMPANION_PROXY_E_NO_DEVICES) {
+		/* only keep the result if no event arrived in the meantime */
+		mutex_lock(&mirror_mutex);
+		mirror = companion_proxy_mirror_find(udid);
+		if (mirror && mirror->generation == generation && !mirror->registry) {
+			mirror->registry = (registry) ? plist_copy(registry) : plist_new_array();
+		}
+		mutex_unlock(&mirror_mutex);
+	}
 	plist_free(dict);
 	return res;
 }
 
-struct companion_proxy_cb_data {
-	companion_proxy_client_t client;
-	companion_proxy_device_event_cb_t cbfunc;
-	void* user_data;
-};
+static int companion_proxy_event_cb(idevice_connection_t connection, void* user_data)
+{
+	companion_proxy_client_t client = (companion_proxy_client_t)user_data;
+	plist_t node = NULL;
 
-static void* companion_proxy_event_thread(void* arg)
+	companion_proxy_error_t res = companion_proxy_error(property_list_service_receive_plist_with_timeout(client->parent, &node, COMPANION_PROXY_EVENT_RECEIVE_TIMEOUT));
+	if (res == COMPANION_PROXY_E_TIMEOUT) {
+		return 0;
+	}
+	if (res != COMPANION_PROXY_E_SUCCESS) {
+		debug_info("could not receive plist, error %d", res);
+		/* the client is removed from the loop */
+		mutex_lock(&mirror_mutex);
+		companion_proxy_mirror_release(client->mirror);
+		client->mirror = NULL;
+		client->loop = NULL;
+		mutex_unlock(&mirror_mutex);
+		return 1;
+	}
+
+	if (PLIST_IS_DICT(node)) {
+		mutex_lock(&mirror_mutex);
+		companion_proxy_mirror_update(client->mirror, node);
+		mutex_unlock(&mirror_mutex);
+	}
+	client->callback(node, client->user_data);
+	plist_free(node);
+
+	return 0;
+}
+
+LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_listening_for_devices_with_loop(companion_proxy_client_t client, idevice_event_loop_t loop, companion_proxy_device_event_cb_t callback, void* userdata)
 {
-	struct companion_proxy_cb_data* data = (struct companion_proxy_cb_data*)arg;
-	companion_proxy_client_t client = data->client;
-	companion_proxy_error_t res;
+	if (!client || !client->parent || !loop || !callback) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	thread_once(&mirror_once, companion_proxy_mirror_init);
+	mutex_lock(&mirror_mutex);
+	int listening = (client->loop != NULL);
+	mutex_unlock(&mirror_mutex);
+	if (listening) {
+		return COMPANION_PROXY_E_OP_IN_PROGRESS;
+	}
 
 	plist_t command = plist_new_dict();
 	plist_dict_set_item(command, "Command", plist_new_string("StartListeningForDevices"));
-	res = companion_proxy_send(client, command);
+	companion_proxy_error_t res = companion_proxy_send(client, command);
 	plist_free(command);
-
 	if (res != COMPANION_PROXY_E_SUCCESS) {
-		free(data);
-		client->event_thread = THREAD_T_NULL;
-		return NULL;
+		return res;
 	}
 
-	while (client && client->parent) {
-		plist_t node = NULL;
-		res = companion_proxy_error(property_list_service_receive_plist_with_timeout(client->parent, &node, 1000));
-		if (res != COMPANION_PROXY_E_SUCCESS && res != COMPANION_PROXY_E_TIMEOUT) {
-			debug_info("could not receive plist, error %d", res);
-			break;
-		}
+	client->callback = callback;
+	client->user_data = userdata;
 
-		if (node) {
-			data->cbfunc(node, data->user_data);
-		}
-		plist_free(node);
+	mutex_lock(&mirror_mutex);
+	client->mirror = companion_proxy_mirror_acquire(companion_proxy_client_udid(client));
+	if (client->mirror) {
+		client->loop = loop;
+	}
+	mutex_unlock(&mirror_mutex);
+	if (!client->mirror) {
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
 	}
 
-	client->event_thread = THREAD_T_NULL;
-	free(data);
+	if (idevice_event_loop_add(loop, client->parent->parent->connection, companion_proxy_event_cb, client) != IDEVICE_E_SUCCESS) {
+		mutex_lock(&mirror_mutex);
+		companion_proxy_mirror_release(client->mirror);
+		client->mirror = NULL;
+		client->loop = NULL;
+		mutex_unlock(&mirror_mutex);
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
+	}
 
-	return NULL;
+	return COMPANION_PROXY_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_listening_for_devices(companion_proxy_client_t client, companion_proxy_device_event_cb_t callback, void* userdata)
@@ -233,46 +392,71 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_start_listening_for
 		return COMPANION_PROXY_E_INVALID_ARG;
 	}
 
-	if (client->event_thread) {
-		return COMPANION_PROXY_E_OP_IN_PROGRESS;
+	thread_once(&mirror_once, companion_proxy_mirror_init);
+	mutex_lock(&mirror_mutex);
+	if (!shared_loop && idevice_event_loop_new(&shared_loop, COMPANION_PROXY_EVENT_LOOP_THREADS) != IDEVICE_E_SUCCESS) {
+		shared_loop = NULL;
 	}
-
-	companion_proxy_error_t res = COMPANION_PROXY_E_UNKNOWN_ERROR;
-	struct companion_proxy_cb_data *data = (struct companion_proxy_cb_data*)malloc(sizeof(struct companion_proxy_cb_data));
-	if (data) {
-		data->client = client;
-		data->cbfunc = callback;
-		data->user_data = userdata;
-
-		if (thread_new(&client->event_thread, companion_proxy_event_thread, data) == 0) {
-			res = COMPANION_PROXY_E_SUCCESS;
-		} else {
-			free(data);
-		}
+	idevice_event_loop_t loop = shared_loop;
+	mutex_unlock(&mirror_mutex);
+	if (!loop) {
+		debug_info("could not create event loop");
+		return COMPANION_PROXY_E_UNKNOWN_ERROR;
 	}
-	return res;
+
+	return companion_proxy_start_listening_for_devices_with_loop(client, loop, callback, userdata);
 }
 
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_stop_listening_for_devices(companion_proxy_client_t client)
 {
-	property_list_service_client_t parent = client->parent;
-	client->parent = NULL;
-	if (client->event_thread) {
-		debug_info("joining event thread");
-		thread_join(client->event_thread);
-		thread_free(client->event_thread);
-		client->event_thread = THREAD_T_NULL;
-	}
-	client->parent = parent;
+	if (!client || !client->parent) {
+		return COMPANION_PROXY_E_INVALID_ARG;
+	}
+
+	thread_once(&mirror_once, companion_proxy_mirror_init);
+	mutex_lock(&mirror_mutex);
+	idevice_event_loop_t loop = client->loop;
+	mutex_unlock(&mirror_mutex);
+	if (!loop) {
+		return COMPANION_PROXY_E_SUCCESS;
+	}
+
+	/* waits for a running callback to return */
+	idevice_event_loop_remove(loop, client->parent->parent->connection);
+
+	mutex_lock(&mirror_mutex);
+	companion_proxy_mirror_release(client->mirror);
+	client->mirror = NULL;
+	client->loop = NULL;
+	mutex_unlock(&mirror_mutex);
+
 	return COMPANION_PROXY_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_value_from_registry(companion_proxy_client_t client, const char* companion_udid, const char* key, plist_t* value)
 {
-	if (!client || !companion_udid || !key || !value) {
+	if (!client || !client->parent || !companion_udid || !key || !value) {
 		return COMPANION_PROXY_E_INVALID_ARG;
 	}
 
+	const char *udid = companion_proxy_client_udid(client);
+	struct companion_proxy_mirror *mirror = NULL;
+	uint32_t generation = 0;
+
+	thread_once(&mirror_once, companion_proxy_mirror_init);
+	mutex_lock(&mirror_mutex);
+	mirror = companion_proxy_mirror_find(udid);
+	if (mirror) {
+		plist_t cached = plist_access_path(mirror->values, 2, companion_udid, key);
+		if (cached) {
+			*value = plist_copy(cached);
+			mutex_unlock(&mirror_mutex);
+			return COMPANION_PROXY_E_SUCCESS;
+		}
+		generation = mirror->generation;
+	}
+	mutex_unlock(&mirror_mutex);
+
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "Command", plist_new_string("GetValueFromRegistry"));
 	plist_dict_set_item(dict, "GetValueGizmoUDIDKey", plist_new_string(companion_udid));
@@ -296,6 +480,19 @@ LIBIMOBILEDEVICE_API companion_proxy_error_t companion_proxy_get_value_from_regi
 	if (val) {
 		*value = plist_copy(val);
 		res = COMPANION_PROXY_E_SUCCESS;
+
+		/* only keep the result if no event arrived in the meantime */
+		mutex_lock(&mirror_mutex);
+		mirror = companion_proxy_mirror_find(udid);
+		if (mirror && mirror->generation == generation) {
+			plist_t values = plist_dict_get_item(mirror->values, companion_udid);
+			if (!values) {
+				values = plist_new_dict();
+				plist_dict_set_item(mirror->values, companion_udid, values);
+			}
+			plist_dict_set_item(values, key, plist_copy(val));
+		}
+		mutex_unlock(&mirror_mutex);
 	} else {
 		res = COMPANION_PROXY_E_UNKNOWN_ERROR;
 		val = plist_dict_get_item(dict, "Error");
@@ -26,9 +26,30 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* events are received on a single shared loop thread for all clients */
+#define COMPANION_PROXY_EVENT_LOOP_THREADS 1
+#define COMPANION_PROXY_EVENT_RECEIVE_TIMEOUT 5000
+
+/* local copy of the device registry of one host device, valid while at
+ * least one client is listening for events of that device */
+struct companion_proxy_mirror {
+	char *udid;
+	unsigned int listeners;
+	/* bumped whenever an event invalidates the mirror */
+	uint32_t generation;
+	/* PLIST_ARRAY of paired companion UDIDs, NULL if unknown */
+	plist_t registry;
+	/* companion UDID -> key -> value */
+	plist_t values;
+	struct companion_proxy_mirror *next;
+};
+
 struct companion_proxy_client_private {
 	property_list_service_client_t parent;
-	THREAD_T event_thread;
+	idevice_event_loop_t loop;
+	companion_proxy_device_event_cb_t callback;
+	void *user_data;
+	struct companion_proxy_mirror *mirror;
 };
 
 #endif
@@ -28,12 +28,14 @@
 #define _GNU_SOURCE 1
 #define __USE_GNU 1
 #include <stdio.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "debugserver.h"
 #include "lockdown.h"
 #include "common/debug.h"
 #include "common/utils.h"
-#include "asprintf.h"
 
 /**
  * Convert a service_error_t value to a debugserver_error_t value.
@@ -74,17 +76,28 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_new(idevice_t device
 
 	debug_info("Creating debugserver_client, port = %d.", service->port);
 
+	/* only the handshake is encrypted, so SSL is enabled here instead of by
+	   service_client_new() which would let the kernel take over the socket */
+	struct lockdownd_service_descriptor plain_service = *service;
+	plain_service.ssl_enabled = 0;
+
 	service_client_t parent = NULL;
-	debugserver_error_t ret = debugserver_error(service_client_new(device, service, &parent));
+	debugserver_error_t ret = debugserver_error(service_client_new(device, &plain_service, &parent));
 	if (ret != DEBUGSERVER_E_SUCCESS) {
 		debug_info("Creating base service client failed. Error: %i", ret);
 		return ret;
 	}
+	if (service->ssl_enabled == 1) {
+		service_enable_ssl(parent);
+	}
 	service_disable_bypass_ssl(parent, 1);
 
 	debugserver_client_t client_loc = (debugserver_client_t) malloc(sizeof(struct debugserver_client_private));
 	client_loc->parent = parent;
 	client_loc->noack_mode = 0;
+	client_loc->no_binary_memory = 0;
+	client_loc->recv_offset = 0;
+	client_loc->recv_length = 0;
 
 	*client = client_loc;
 
@@ -141,6 +154,19 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_with_timeout
 		return DEBUGSERVER_E_INVALID_ARG;
 	}
 
+	/* hand out data that was already received by the packet parser first */
+	if (client->recv_offset < client->recv_length) {
+		uint32_t avail = client->recv_length - client->recv_offset;
+		if (avail > size)
+			avail = size;
+		memcpy(data, client->recv_buffer + client->recv_offset, avail);
+		client->recv_offset += avail;
+		if (received) {
+			*received = avail;
+		}
+		return DEBUGSERVER_E_SUCCESS;
+	}
+
 	res = debugserver_error(service_receive_with_timeout(client->parent, data, size, (uint32_t*)&bytes, timeout));
 	if (bytes <= 0) {
 		debug_info("Could not read data, error %d", res);
@@ -206,16 +232,30 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_command_free(debugserver_co
 	return res;
 }
 
+/* nibble value of each hex digit, 0xFF for all other characters */
+static const unsigned char debugserver_hex_table[256] = {
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+	0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF
+};
+
 static int debugserver_hex2int(char c)
 {
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	else if (c >= 'a' && c <= 'f')
-		return 10 + c - 'a';
-	else if (c >= 'A' && c <= 'F')
-		return 10 + c - 'A';
-	else
-		return c;
+	unsigned char value = debugserver_hex_table[(unsigned char)c];
+	return (value == 0xFF) ? c : value;
 }
 
 static char debugserver_int2hex(int x)
@@ -229,98 +269,224 @@ static char debugserver_int2hex(int x)
 #define DEBUGSERVER_HEX_DECODE_FIRST_BYTE(byte) ((byte >> 0x4) & 0xf)
 #define DEBUGSERVER_HEX_DECODE_SECOND_BYTE(byte) (byte & 0xf)
 
-static uint32_t debugserver_get_checksum_for_buffer(const char* buffer, uint32_t size)
+#ifdef __SSE2__
+/* encodes 16 bytes into 32 hex digits, returns the sum of the digits */
+static uint32_t debugserver_encode_block_sse2(const char* data, char* encoded)
 {
-	uint32_t checksum = 0;
-	uint32_t i;
-
-	for (i = 0; i < size; i++) {
-		checksum += buffer[i];
-	}
-
-	return checksum;
+	const __m128i mask = _mm_set1_epi8(0x0F);
+	const __m128i nine = _mm_set1_epi8(9);
+	const __m128i digit = _mm_set1_epi8('0');
+	const __m128i alpha = _mm_set1_epi8('A' - '0' - 10);
+	__m128i v = _mm_loadu_si128((const __m128i*)data);
+	__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+	__m128i lo = _mm_and_si128(v, mask);
+
+	hi = _mm_add_epi8(_mm_add_epi8(hi, digit), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, digit), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+
+	__m128i first = _mm_unpacklo_epi8(hi, lo);
+	__m128i second = _mm_unpackhi_epi8(hi, lo);
+	_mm_storeu_si128((__m128i*)encoded, first);
+	_mm_storeu_si128((__m128i*)(encoded + 16), second);
+
+	__m128i sum = _mm_add_epi64(_mm_sad_epu8(first, _mm_setzero_si128()), _mm_sad_epu8(second, _mm_setzero_si128()));
+	return (uint32_t)_mm_cvtsi128_si32(sum) + (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
 }
 
-static int debugserver_response_is_checksum_valid(const char* response, uint32_t size)
+/* converts 16 hex digits to nibble values, returns 0 if one of them is invalid */
+static int debugserver_decode_nibbles_sse2(const char* encoded, __m128i* nibbles)
 {
-	uint32_t checksum = 0;
-	if ((size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1) > 0)
-		checksum = debugserver_get_checksum_for_buffer(&response[1], size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-
-	debug_info("checksum: 0x%x", checksum);
+	__m128i v = _mm_loadu_si128((const __m128i*)encoded);
+	__m128i l = _mm_or_si128(v, _mm_set1_epi8(0x20));
+	__m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)), _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+	__m128i is_alpha = _mm_and_si128(_mm_cmpgt_epi8(l, _mm_set1_epi8('a' - 1)), _mm_cmplt_epi8(l, _mm_set1_epi8('f' + 1)));
 
-	if ((unsigned)debugserver_hex2int(response[size - 2]) != DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum))
+	if (_mm_movemask_epi8(_mm_or_si128(is_digit, is_alpha)) != 0xFFFF)
 		return 0;
 
-	if ((unsigned)debugserver_hex2int(response[size - 1]) != DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum))
+	*nibbles = _mm_or_si128(_mm_and_si128(is_digit, _mm_sub_epi8(v, _mm_set1_epi8('0'))),
+		_mm_and_si128(is_alpha, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+
+	return 1;
+}
+
+/* decodes 32 hex digits into 16 bytes, returns 0 if one of them is invalid */
+static int debugserver_decode_block_sse2(const char* encoded, char* data)
+{
+	const __m128i low_byte = _mm_set1_epi16(0x00FF);
+	__m128i n1, n2;
+
+	if (!debugserver_decode_nibbles_sse2(encoded, &n1) || !debugserver_decode_nibbles_sse2(encoded + 16, &n2))
 		return 0;
 
-	debug_info("valid checksum");
+	/* first digit of each pair is in the low byte of each 16 bit lane */
+	n1 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n1, low_byte), 4), _mm_srli_epi16(n1, 8));
+	n2 = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(n2, low_byte), 4), _mm_srli_epi16(n2, 8));
+	_mm_storeu_si128((__m128i*)data, _mm_packus_epi16(n1, n2));
 
 	return 1;
 }
+#endif
+
+LIBIMOBILEDEVICE_API size_t debugserver_encode_buffer(const char* data, size_t length, char* encoded)
+{
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= length; i += 16) {
+		debugserver_encode_block_sse2(data + i, encoded + 2 * i);
+	}
+#endif
+	for (; i < length; i++) {
+		encoded[2 * i] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(data[i]);
+		encoded[2 * i + 1] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(data[i]);
+	}
+
+	return 2 * length;
+}
+
+LIBIMOBILEDEVICE_API size_t debugserver_decode_buffer(const char* encoded, size_t encoded_length, char* data)
+{
+	size_t length = encoded_length / 2;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= length; i += 16) {
+		if (!debugserver_decode_block_sse2(encoded + 2 * i, data + i))
+			break;
+	}
+#endif
+	for (; i < length; i++) {
+		data[i] = debugserver_hex2int(encoded[2 * i]) << 4 | debugserver_hex2int(encoded[2 * i + 1]);
+	}
+
+	return length;
+}
 
 LIBIMOBILEDEVICE_API void debugserver_encode_string(const char* buffer, char** encoded_buffer, uint32_t* encoded_length)
 {
-	uint32_t position;
-	uint32_t index;
 	uint32_t length = strlen(buffer);
 	*encoded_length = (2 * length) + DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1;
 
 	*encoded_buffer = malloc(sizeof(char) * (*encoded_length));
-	memset(*encoded_buffer, '\0', *encoded_length);
-	for (position = 0, index = 0; index < length; index++) {
-		position = (index * (2 * sizeof(char)));
-		(*encoded_buffer)[position] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(buffer[index]);
-		(*encoded_buffer)[position + 1] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(buffer[index]);
-	}
+	memset(*encoded_buffer + 2 * length, '\0', *encoded_length - 2 * length);
+	debugserver_encode_buffer(buffer, length, *encoded_buffer);
 }
 
 LIBIMOBILEDEVICE_API void debugserver_decode_string(const char *encoded_buffer, size_t encoded_length, char** buffer)
 {
 	*buffer = malloc(sizeof(char) * ((encoded_length / 2)+1));
-	char* t = *buffer;
-	const char *f = encoded_buffer;
-	const char *fend = f + encoded_length;
-	while (f < fend) {
-		*t++ = debugserver_hex2int(*f) << 4 | debugserver_hex2int(f[1]);
-		f += 2;
+	(*buffer)[debugserver_decode_buffer(encoded_buffer, encoded_length, *buffer)] = '\0';
+}
+
+/**
+ * Hex encodes a buffer and sums up the encoded digits for the packet
+ * checksum in the same pass.
+ *
+ * @return The sum of the encoded digits
+ */
+static uint32_t debugserver_encode_with_checksum(const char* data, size_t length, char* encoded)
+{
+	uint32_t checksum = 0;
+	size_t i = 0;
+
+#ifdef __SSE2__
+	for (; i + 16 <= length; i += 16) {
+		checksum += debugserver_encode_block_sse2(data + i, encoded + 2 * i);
+	}
+#endif
+	for (; i < length; i++) {
+		char first = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(data[i]);
+		char second = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(data[i]);
+		encoded[2 * i] = first;
+		encoded[2 * i + 1] = second;
+		checksum += (unsigned char)first + (unsigned char)second;
 	}
-	*t = '\0';
+
+	return checksum;
 }
 
-static void debugserver_format_command(const char* prefix, const char* command, const char* arguments, int calculate_checksum, char** buffer, uint32_t* size)
+/* copies plain packet data and returns the sum of the copied bytes */
+static uint32_t debugserver_copy_with_checksum(const char* data, size_t length, char* dst)
 {
-	char checksum_hash[DEBUGSERVER_CHECKSUM_HASH_LENGTH + 1] = {'#', '0', '0', '\0'};
-	char* encoded = NULL;
-	uint32_t encoded_length = 0;
+	uint32_t checksum = 0;
+	size_t i;
 
-	if (arguments) {
-		/* arguments must be hex encoded */
-		debugserver_encode_string(arguments, &encoded, &encoded_length);
-	} else {
-		encoded = NULL;
+	for (i = 0; i < length; i++) {
+		dst[i] = data[i];
+		checksum += (unsigned char)data[i];
 	}
 
-	char* encoded_command = string_concat(command, encoded, NULL);
-	encoded_length = strlen(encoded_command);
+	return checksum;
+}
 
-	if (calculate_checksum) {
-		uint32_t checksum = debugserver_get_checksum_for_buffer(encoded_command, encoded_length);
-		checksum_hash[1] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(checksum);
-		checksum_hash[2] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(checksum);
+static size_t debugserver_decimal_length(uint32_t value)
+{
+	size_t length = 1;
+	while (value >= 10) {
+		value /= 10;
+		length++;
 	}
+	return length;
+}
 
-	*buffer = string_concat(prefix, encoded_command, checksum_hash, NULL);
-	*size = strlen(prefix) + strlen(encoded_command) + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
+/* writes a decimal number and returns the sum of its digits */
+static uint32_t debugserver_put_decimal(uint32_t value, char* dst)
+{
+	size_t length = debugserver_decimal_length(value);
+	uint32_t checksum = 0;
 
-	debug_info("formatted command: %s size: %d checksum: 0x%s", *buffer, *size, checksum_hash);
+	while (length > 0) {
+		char digit = '0' + (value % 10);
+		dst[--length] = digit;
+		checksum += (unsigned char)digit;
+		value /= 10;
+	}
 
-	if (encoded_command)
-		free(encoded_command);
+	return checksum;
+}
 
-	if (encoded)
-		free(encoded);
+/* appends "#" and the two checksum digits and terminates the packet */
+static void debugserver_finish_packet(char* dst, uint32_t checksum)
+{
+	dst[0] = '#';
+	dst[1] = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(checksum);
+	dst[2] = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(checksum);
+	dst[3] = '\0';
+}
+
+/**
+ * Builds the packet of a command with its hex encoded arguments in a single
+ * pass into a buffer of the final size, summing up the checksum on the way.
+ */
+static void debugserver_format_command(const char* command, int argc, char** argv, char** buffer, uint32_t* size)
+{
+	size_t name_length = strlen(command);
+	size_t length = 1 + name_length + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
+	uint32_t checksum = 0;
+	int i;
+
+	for (i = 0; i < argc; i++) {
+		length += 2 * strlen(argv[i]);
+	}
+
+	char* packet = (char*)malloc(length + 1);
+	char* p = packet;
+
+	*p++ = '$';
+	checksum += debugserver_copy_with_checksum(command, name_length, p);
+	p += name_length;
+	for (i = 0; i < argc; i++) {
+		size_t arg_length = strlen(argv[i]);
+		checksum += debugserver_encode_with_checksum(argv[i], arg_length, p);
+		p += 2 * arg_length;
+	}
+	debugserver_finish_packet(p, checksum);
+
+	*buffer = packet;
+	*size = (uint32_t)length;
+
+	debug_info("formatted command: %s size: %d", packet, *size);
 }
 
 static debugserver_error_t debugserver_client_send_ack(debugserver_client_t client)
@@ -347,115 +513,150 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_ack_mode(debugse
 	return DEBUGSERVER_E_SUCCESS;
 }
 
-static int debugserver_client_receive_internal_check(debugserver_client_t client, char* received_char)
+/**
+ * Makes sure the receive buffer of the client contains unparsed data.
+ *
+ * @param client The debugserver client
+ * @param timeout Maximum time in milliseconds to wait for data
+ *
+ * @return DEBUGSERVER_E_SUCCESS when data is available, DEBUGSERVER_E_TIMEOUT
+ *     if no data arrived in time, or an DEBUGSERVER_E_* error code otherwise.
+ */
+static debugserver_error_t debugserver_client_fill_buffer(debugserver_client_t client, unsigned int timeout)
 {
-	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int did_receive_char = 0;
-	char buffer = 0;
+	debugserver_error_t res;
 	uint32_t bytes = 0;
 
-	/* we loop here as we expect an answer */
-	res = debugserver_client_receive_with_timeout(client, &buffer, sizeof(char), &bytes, 1000);
-	if (res == DEBUGSERVER_E_SUCCESS && received_char[0] != 0) {
-		if (memcmp(&buffer, received_char, sizeof(char)) == 0) {
-			did_receive_char = 1;
-		}
-	} else {
-		did_receive_char = 0;
-	}
+	if (client->recv_offset < client->recv_length)
+		return DEBUGSERVER_E_SUCCESS;
 
-	if (!did_receive_char) {
-		memcpy(received_char, &buffer, sizeof(char));
+	client->recv_offset = 0;
+	client->recv_length = 0;
+
+	res = debugserver_error(service_receive_with_timeout(client->parent, client->recv_buffer, DEBUGSERVER_RECV_BUFFER_SIZE, &bytes, timeout));
+	if (bytes == 0) {
+		return (res == DEBUGSERVER_E_SUCCESS) ? DEBUGSERVER_E_TIMEOUT : res;
 	}
+	client->recv_length = bytes;
 
-	return did_receive_char;
+	return DEBUGSERVER_E_SUCCESS;
 }
 
+enum debugserver_packet_state {
+	DEBUGSERVER_PACKET_START,
+	DEBUGSERVER_PACKET_PAYLOAD,
+	DEBUGSERVER_PACKET_CHECKSUM
+};
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(debugserver_client_t client, char** response, size_t* response_size)
 {
 	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-
-	int should_receive = 1;
-	int skip_prefix = 0;
-	char* command_prefix = strdup("$");
-
+	enum debugserver_packet_state state = DEBUGSERVER_PACKET_START;
 	char* buffer = NULL;
 	uint32_t buffer_size = 0;
 	uint32_t buffer_capacity = 0;
+	unsigned char checksum = 0;
+	char checksum_hash[DEBUGSERVER_CHECKSUM_HASH_LENGTH] = { 0, };
+	uint32_t checksum_length = 0;
+	int retries = 0;
+
+	if (!client)
+		return DEBUGSERVER_E_INVALID_ARG;
 
 	if (response)
 		*response = NULL;
-
-	if (!client->noack_mode) {
-		char ack[2] = {'+', '\0'};
-		debug_info("attempting to receive ACK %c", *ack);
-		should_receive = debugserver_client_receive_internal_check(client, ack);
-		debug_info("received char: %c", *ack);
-		if (strncmp(ack, command_prefix, sizeof(char)) == 0) {
-			should_receive = 1;
-			skip_prefix = 1;
-			buffer = malloc(1024);
-			buffer_capacity = 1024;
-			strcpy(buffer, command_prefix);
-			buffer_size += sizeof(char);
-			debug_info("received ACK");
+	if (response_size)
+		*response_size = 0;
+
+	while (1) {
+		res = debugserver_client_fill_buffer(client, 1000);
+		if (res == DEBUGSERVER_E_TIMEOUT) {
+			if (state == DEBUGSERVER_PACKET_START) {
+				/* nothing to receive right now */
+				res = DEBUGSERVER_E_SUCCESS;
+				break;
+			}
+			if (++retries < DEBUGSERVER_PACKET_RECEIVE_RETRIES) {
+				continue;
+			}
+			debug_info("ERROR: timeout while receiving packet after %d bytes", buffer_size);
+			break;
 		}
-	}
-
-	debug_info("should_receive: %d, skip_prefix: %d", should_receive, skip_prefix);
-
-	if (should_receive && !skip_prefix) {
-		debug_info("attempting to receive prefix");
-		should_receive = debugserver_client_receive_internal_check(client, command_prefix);
-		debug_info("received command_prefix: %c", *command_prefix);
-		if (should_receive) {
-			if (buffer) {
-				strcpy(buffer, command_prefix);
-			} else {
-				buffer = malloc(1024);
-				buffer_capacity = 1024;
-				strcpy(buffer, command_prefix);
-				buffer_size += sizeof(char);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			debug_info("ERROR: receiving from device failed (%d)", res);
+			break;
+		}
+		retries = 0;
+
+		char* data = client->recv_buffer + client->recv_offset;
+		uint32_t avail = client->recv_length - client->recv_offset;
+
+		if (state == DEBUGSERVER_PACKET_START) {
+			/* skip acks and anything else in front of the packet start */
+			char* start = memchr(data, '$', avail);
+			if (!start) {
+				debug_info("skipping %d bytes before packet start", avail);
+				client->recv_offset = client->recv_length;
+				continue;
 			}
+			client->recv_offset += (start - data) + 1;
+			state = DEBUGSERVER_PACKET_PAYLOAD;
+			continue;
 		}
-	}
-
-	debug_info("buffer: %*s, should_receive: %d, skip_prefix: %d", buffer_size, buffer, should_receive, skip_prefix);
 
-	if (should_receive) {
-		uint32_t checksum_length = DEBUGSERVER_CHECKSUM_HASH_LENGTH;
-		int receiving_checksum_response = 0;
-		debug_info("attempting to read up response until checksum");
+		if (state == DEBUGSERVER_PACKET_PAYLOAD) {
+			char* end = memchr(data, '#', avail);
+			uint32_t chunk = (end) ? (uint32_t)(end - data) : avail;
+			uint32_t i;
 
-		while ((checksum_length > 0)) {
-			char data[2] = {'#', '\0'};
-			if (debugserver_client_receive_internal_check(client, data)) {
-				receiving_checksum_response = 1;
-			}
-			if (receiving_checksum_response) {
-				checksum_length--;
-			}
-			if (buffer_size + 1 >= buffer_capacity) {
-				char* newbuffer = realloc(buffer, buffer_capacity+1024);
+			if (buffer_size + chunk + 1 > buffer_capacity) {
+				uint32_t newcapacity = (buffer_capacity) ? buffer_capacity : 1024;
+				while (buffer_size + chunk + 1 > newcapacity) {
+					newcapacity <<= 1;
+				}
+				char* newbuffer = realloc(buffer, newcapacity);
 				if (!newbuffer) {
-					return DEBUGSERVER_E_UNKNOWN_ERROR;
+					res = DEBUGSERVER_E_UNKNOWN_ERROR;
+					break;
 				}
 				buffer = newbuffer;
-				buffer[buffer_capacity] = '\0';
-				buffer_capacity += 1024;
+				buffer_capacity = newcapacity;
+			}
+			memcpy(buffer + buffer_size, data, chunk);
+			buffer_size += chunk;
+			for (i = 0; i < chunk; i++) {
+				checksum += (unsigned char)data[i];
+			}
+			client->recv_offset += chunk;
+			if (end) {
+				client->recv_offset++;
+				state = DEBUGSERVER_PACKET_CHECKSUM;
 			}
-			strcat(buffer, data);
-			buffer_size += sizeof(char);
+			continue;
+		}
+
+		/* two hex digits of checksum following the '#' */
+		while (checksum_length < DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1 && client->recv_offset < client->recv_length) {
+			checksum_hash[checksum_length++] = client->recv_buffer[client->recv_offset++];
+		}
+		if (checksum_length == DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1) {
+			break;
 		}
-		debug_info("validating response checksum...");
-		if (client->noack_mode || debugserver_response_is_checksum_valid(buffer, buffer_size)) {
+	}
+
+	if (res == DEBUGSERVER_E_SUCCESS && state == DEBUGSERVER_PACKET_CHECKSUM) {
+		debug_info("validating response checksum 0x%x...", checksum);
+		if (client->noack_mode
+		    || (((unsigned)debugserver_hex2int(checksum_hash[0]) == DEBUGSERVER_HEX_DECODE_FIRST_BYTE(checksum))
+		        && ((unsigned)debugserver_hex2int(checksum_hash[1]) == DEBUGSERVER_HEX_DECODE_SECOND_BYTE(checksum)))) {
+			if (!buffer) {
+				buffer = malloc(1);
+			}
+			buffer[buffer_size] = '\0';
 			if (response) {
-				/* assemble response string */
-				uint32_t resp_size = sizeof(char) * (buffer_size - DEBUGSERVER_CHECKSUM_HASH_LENGTH - 1);
-				*response = (char*)malloc(resp_size + 1);
-				memcpy(*response, buffer + 1, resp_size);
-				(*response)[resp_size] = '\0';
-				if (response_size) *response_size = resp_size;
+				*response = buffer;
+				buffer = NULL;
+				if (response_size) *response_size = buffer_size;
 			}
 			if (!client->noack_mode) {
 				/* confirm valid command */
@@ -471,15 +672,47 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(deb
 		}
 	}
 
-	if (response) {
+	if (response && *response) {
 		debug_info("response: %s", *response);
 	}
 
 	if (buffer)
 		free(buffer);
 
-	if (command_prefix)
-		free(command_prefix);
+	return res;
+}
+
+static void debugserver_command_encode(debugserver_command_t command, char** buffer, uint32_t* size)
+{
+	debugserver_format_command(command->name, command->argc, command->argv, buffer, size);
+}
+
+/**
+ * Sends a formatted packet and receives the response to it.
+ */
+static debugserver_error_t debugserver_client_send_packet(debugserver_client_t client, const char* packet, uint32_t packet_size, char** response, size_t* response_size)
+{
+	debugserver_error_t res;
+	uint32_t bytes = 0;
+
+	debug_info("sending encoded command: %s", packet);
+
+	res = debugserver_client_send(client, packet, packet_size, &bytes);
+	debug_info("command result: %d", res);
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		return res;
+	}
+
+	/* receive response */
+	res = debugserver_client_receive_response(client, response, response_size);
+	debug_info("response result: %d", res);
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		return res;
+	}
+
+	if (response) {
+		debug_info("received response: %s", *response);
+	}
 
 	return res;
 }
@@ -487,55 +720,120 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_receive_response(deb
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_command(debugserver_client_t client, debugserver_command_t command, char** response, size_t* response_size)
 {
 	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
-	int i;
+
+	char* send_buffer = NULL;
+	uint32_t send_buffer_size = 0;
+
+	debugserver_command_encode(command, &send_buffer, &send_buffer_size);
+
+	res = debugserver_client_send_packet(client, send_buffer, send_buffer_size, response, response_size);
+
+	/* disable sending ack on the client */
+	if (res == DEBUGSERVER_E_SUCCESS && !strncmp(command->name, "QStartNoAckMode", 16)) {
+		debugserver_client_set_ack_mode(client, 0);
+	}
+
+	free(send_buffer);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_send_commands(debugserver_client_t client, debugserver_command_t* commands, unsigned int count, char** responses, size_t* response_sizes)
+{
+	debugserver_error_t res = DEBUGSERVER_E_SUCCESS;
+	unsigned int i;
 	uint32_t bytes = 0;
 
 	char* send_buffer = NULL;
 	uint32_t send_buffer_size = 0;
+	uint32_t send_buffer_capacity = 0;
 
-	char* command_arguments = NULL;
+	if (!client || !commands || count == 0 || !responses)
+		return DEBUGSERVER_E_INVALID_ARG;
 
-	/* concat all arguments */
-	for (i = 0; i < command->argc; i++) {
-		debug_info("argv[%d]: %s", i, command->argv[i]);
-		command_arguments = string_append(command_arguments, command->argv[i], NULL);
+	for (i = 0; i < count; i++) {
+		if (!commands[i])
+			return DEBUGSERVER_E_INVALID_ARG;
+		responses[i] = NULL;
+		if (response_sizes)
+			response_sizes[i] = 0;
 	}
 
-	debug_info("command_arguments(%d): %s", command->argc, command_arguments);
+	if (!client->noack_mode) {
+		/* each packet has to be acknowledged before the next one is sent */
+		for (i = 0; i < count; i++) {
+			res = debugserver_client_send_command(client, commands[i], &responses[i], (response_sizes) ? &response_sizes[i] : NULL);
+			if (res != DEBUGSERVER_E_SUCCESS)
+				goto error;
+		}
+		return res;
+	}
 
-	/* encode command arguments, add checksum if required and assemble entire command */
-	debugserver_format_command("$", command->name, command_arguments, 1, &send_buffer, &send_buffer_size);
+	/* put all packets into a single write */
+	for (i = 0; i < count; i++) {
+		char* packet = NULL;
+		uint32_t packet_size = 0;
 
-	debug_info("sending encoded command: %s", send_buffer);
+		debugserver_command_encode(commands[i], &packet, &packet_size);
+		if (send_buffer_size + packet_size > send_buffer_capacity) {
+			uint32_t newcapacity = (send_buffer_capacity) ? send_buffer_capacity : 1024;
+			while (send_buffer_size + packet_size > newcapacity) {
+				newcapacity <<= 1;
+			}
+			char* newbuffer = realloc(send_buffer, newcapacity);
+			if (!newbuffer) {
+				free(packet);
+				res = DEBUGSERVER_E_UNKNOWN_ERROR;
+				goto error;
+			}
+			send_buffer = newbuffer;
+			send_buffer_capacity = newcapacity;
+		}
+		memcpy(send_buffer + send_buffer_size, packet, packet_size);
+		send_buffer_size += packet_size;
+		free(packet);
+	}
+
+	debug_info("sending %d pipelined commands (%d bytes)", count, send_buffer_size);
 
 	res = debugserver_client_send(client, send_buffer, send_buffer_size, &bytes);
-	debug_info("command result: %d", res);
 	if (res != DEBUGSERVER_E_SUCCESS) {
-		goto cleanup;
+		goto error;
 	}
-
-	/* receive response */
-	res = debugserver_client_receive_response(client, response, response_size);
-	debug_info("response result: %d", res);
-	if (res != DEBUGSERVER_E_SUCCESS) {
-		goto cleanup;
+	if (bytes != send_buffer_size) {
+		debug_info("ERROR: Could not send all data (%d of %d)!", bytes, send_buffer_size);
+		res = DEBUGSERVER_E_MUX_ERROR;
+		goto error;
 	}
 
-	if (response) {
-		debug_info("received response: %s", *response);
+	/* responses arrive in the order the commands were sent */
+	for (i = 0; i < count; i++) {
+		int retries = 0;
+		do {
+			res = debugserver_client_receive_response(client, &responses[i], (response_sizes) ? &response_sizes[i] : NULL);
+		} while (res == DEBUGSERVER_E_SUCCESS && !responses[i] && ++retries < DEBUGSERVER_PACKET_RECEIVE_RETRIES);
+		if (res == DEBUGSERVER_E_SUCCESS && !responses[i]) {
+			debug_info("ERROR: timeout while waiting for response %d of %d", i + 1, count);
+			res = DEBUGSERVER_E_TIMEOUT;
+		}
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			goto error;
+		}
 	}
 
-	/* disable sending ack on the client */
-	if (!strncmp(command->name, "QStartNoAckMode", 16)) {
-		debugserver_client_set_ack_mode(client, 0);
-	}
+	free(send_buffer);
 
-cleanup:
-	if (command_arguments)
-		free(command_arguments);
+	return res;
+
+error:
+	for (i = 0; i < count; i++) {
+		free(responses[i]);
+		responses[i] = NULL;
+		if (response_sizes)
+			response_sizes[i] = 0;
+	}
 
-	if (send_buffer)
-		free(send_buffer);
+	free(send_buffer);
 
 	return res;
 }
@@ -559,72 +857,183 @@ LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_environment_hex_
 	return result;
 }
 
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_environment(debugserver_client_t client, int envc, const char* envp[], char** response)
+{
+	if (!client || envc <= 0 || !envp)
+		return DEBUGSERVER_E_INVALID_ARG;
+
+	debugserver_error_t result = DEBUGSERVER_E_SUCCESS;
+	debugserver_command_t* commands = (debugserver_command_t*)calloc(envc, sizeof(debugserver_command_t));
+	char** responses = (char**)calloc(envc, sizeof(char*));
+	int i;
+
+	if (!commands || !responses) {
+		free(commands);
+		free(responses);
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+	}
+
+	for (i = 0; i < envc; i++) {
+		char* env_arg[2] = { (char*)envp[i], NULL };
+		debug_info("envp[%d] = \"%s\"", i, envp[i]);
+		debugserver_command_new("QEnvironmentHexEncoded:", 1, env_arg, &commands[i]);
+	}
+
+	/* all packets go out at once, the responses are collected afterwards */
+	result = debugserver_client_send_commands(client, commands, envc, responses, NULL);
+
+	if (response)
+		*response = NULL;
+	for (i = 0; i < envc; i++) {
+		if (response && !*response && responses[i] && (strcmp(responses[i], "OK") != 0 || i == envc - 1)) {
+			/* first failure, or the last OK if all succeeded */
+			*response = responses[i];
+			responses[i] = NULL;
+		}
+		free(responses[i]);
+		debugserver_command_free(commands[i]);
+	}
+	free(responses);
+	free(commands);
+
+	return result;
+}
+
 LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_set_argv(debugserver_client_t client, int argc, const char* argv[], char** response)
 {
 	if (!client || !argc)
 		return DEBUGSERVER_E_INVALID_ARG;
 
 	debugserver_error_t result = DEBUGSERVER_E_UNKNOWN_ERROR;
-	char *pkt = NULL;
-	int pkt_len = 0;
-	int i = 0;
+	size_t pkt_len = 2 + DEBUGSERVER_CHECKSUM_HASH_LENGTH;
+	uint32_t checksum = 0;
+	int count = 0;
+	int i;
 
-	/* calculate total length */
-	while (i < argc && argv && argv[i]) {
-		char *prefix = NULL;
-		asprintf(&prefix, ",%d,%d,", (int)strlen(argv[i]) * 2, i);
-		pkt_len += (int)strlen(prefix) + (int)strlen(argv[i]) * 2;
-		free(prefix);
-		i++;
+	/* the packet is "A" followed by "hexlen,index,hexarg" for each argument, separated by "," */
+	while (count < argc && argv && argv[count]) {
+		size_t arg_hexlen = 2 * strlen(argv[count]);
+		pkt_len += ((count > 0) ? 1 : 0) + debugserver_decimal_length((uint32_t)arg_hexlen) + 1 + debugserver_decimal_length((uint32_t)count) + 1 + arg_hexlen;
+		count++;
 	}
 
-	/* allocate packet and initialize it */
-	pkt = (char *) malloc(pkt_len + 1);
-	memset(pkt, 0, pkt_len + 1);
+	char* pkt = (char*)malloc(pkt_len + 1);
+	if (!pkt)
+		return DEBUGSERVER_E_UNKNOWN_ERROR;
+	char* pktp = pkt;
 
-	char *pktp = pkt;
+	*pktp++ = '$';
+	*pktp++ = 'A';
+	checksum += 'A';
+	for (i = 0; i < count; i++) {
+		size_t arg_len = strlen(argv[i]);
 
-	i = 0;
-	while (i < argc && argv && argv[i]) {
 		debug_info("argv[%d] = \"%s\"", i, argv[i]);
 
-		char *prefix = NULL;
-		char *m = NULL;
-		int arg_len = strlen(argv[i]);
-		int arg_hexlen = arg_len * 2;
+		if (i > 0) {
+			*pktp++ = ',';
+			checksum += ',';
+		}
+		checksum += debugserver_put_decimal((uint32_t)(arg_len * 2), pktp);
+		pktp += debugserver_decimal_length((uint32_t)(arg_len * 2));
+		*pktp++ = ',';
+		checksum += debugserver_put_decimal((uint32_t)i, pktp);
+		pktp += debugserver_decimal_length((uint32_t)i);
+		*pktp++ = ',';
+		checksum += 2 * ',';
+		checksum += debugserver_encode_with_checksum(argv[i], arg_len, pktp);
+		pktp += arg_len * 2;
+	}
+	debugserver_finish_packet(pktp, checksum);
+
+	result = debugserver_client_send_packet(client, pkt, (uint32_t)pkt_len, response, NULL);
 
-		asprintf(&prefix, ",%d,%d,", arg_hexlen, i);
+	free(pkt);
 
-		m = (char *) malloc(arg_hexlen);
-		char *p = m;
-		char *q = (char*)argv[i];
-		while (*q) {
-			*p++ = DEBUGSERVER_HEX_ENCODE_FIRST_BYTE(*q);
-			*p++ = DEBUGSERVER_HEX_ENCODE_SECOND_BYTE(*q);
-			q++;
-		}
+	return result;
+}
 
-		memcpy(pktp, prefix, strlen(prefix));
-		pktp += strlen(prefix);
+static int debugserver_response_is_error(const char* response, size_t response_size)
+{
+	return (response_size == 3 && response[0] == 'E'
+		&& debugserver_hex_table[(unsigned char)response[1]] != 0xFF
+		&& debugserver_hex_table[(unsigned char)response[2]] != 0xFF);
+}
 
-		memcpy(pktp, m, arg_hexlen);
-		pktp += arg_hexlen;
+LIBIMOBILEDEVICE_API debugserver_error_t debugserver_client_read_memory(debugserver_client_t client, uint64_t address, uint32_t length, char* data, uint32_t* bytes_read)
+{
+	debugserver_error_t res;
+	debugserver_command_t command = NULL;
+	char packet[48];
+	char* response = NULL;
+	size_t response_size = 0;
+	size_t i = 0;
+	uint32_t count = 0;
 
-		free(prefix);
-		free(m);
+	if (!client || !data || length == 0 || !bytes_read)
+		return DEBUGSERVER_E_INVALID_ARG;
 
-		i++;
-	}
+	*bytes_read = 0;
 
-	pkt[0] = 'A';
+	if (!client->no_binary_memory) {
+		snprintf(packet, sizeof(packet), "x%llx,%x", (unsigned long long)address, length);
+		debugserver_command_new(packet, 0, NULL, &command);
+		res = debugserver_client_send_command(client, command, &response, &response_size);
+		debugserver_command_free(command);
+		if (res != DEBUGSERVER_E_SUCCESS) {
+			free(response);
+			return res;
+		}
+		if (!response) {
+			return DEBUGSERVER_E_TIMEOUT;
+		}
+		if (response_size > 0) {
+			if (debugserver_response_is_error(response, response_size) && length != 3) {
+				debug_info("reading memory at 0x%llx failed: %s", (unsigned long long)address, response);
+				free(response);
+				return DEBUGSERVER_E_RESPONSE_ERROR;
+			}
+			/* binary data with '}' escaping the following byte xor 0x20 */
+			while (i < response_size && count < length) {
+				if (response[i] == '}' && i + 1 < response_size) {
+					data[count++] = response[i + 1] ^ 0x20;
+					i += 2;
+				} else {
+					data[count++] = response[i++];
+				}
+			}
+			free(response);
+			*bytes_read = count;
+			return DEBUGSERVER_E_SUCCESS;
+		}
+		/* an empty response means the packet is not supported */
+		debug_info("binary memory read not supported, using hex encoded reads");
+		free(response);
+		response = NULL;
+		client->no_binary_memory = 1;
+	}
 
-	debugserver_command_t command = NULL;
-	debugserver_command_new(pkt, 0, NULL, &command);
-	result = debugserver_client_send_command(client, command, response, NULL);
+	snprintf(packet, sizeof(packet), "m%llx,%x", (unsigned long long)address, length);
+	debugserver_command_new(packet, 0, NULL, &command);
+	res = debugserver_client_send_command(client, command, &response, &response_size);
 	debugserver_command_free(command);
+	if (res != DEBUGSERVER_E_SUCCESS) {
+		free(response);
+		return res;
+	}
+	if (!response) {
+		return DEBUGSERVER_E_TIMEOUT;
+	}
+	if (response_size == 0 || debugserver_response_is_error(response, response_size)) {
+		debug_info("reading memory at 0x%llx failed: %s", (unsigned long long)address, response);
+		free(response);
+		return DEBUGSERVER_E_RESPONSE_ERROR;
+	}
+	if (response_size > (size_t)length * 2) {
+		response_size = (size_t)length * 2;
+	}
+	*bytes_read = (uint32_t)debugserver_decode_buffer(response, response_size, data);
+	free(response);
 
-	if (pkt)
-		free(pkt);
-
-	return result;
+	return DEBUGSERVER_E_SUCCESS;
 }
@@ -26,10 +26,20 @@
 #include "service.h"
 
 #define DEBUGSERVER_CHECKSUM_HASH_LENGTH 0x3
+#define DEBUGSERVER_RECV_BUFFER_SIZE 16384
+
+/* consecutive receive timeouts tolerated inside of a partially received packet */
+#define DEBUGSERVER_PACKET_RECEIVE_RETRIES 10
 
 struct debugserver_client_private {
 	service_client_t parent;
 	int noack_mode;
+	/* set when the binary memory read packet is not supported */
+	int no_binary_memory;
+	/* data received from the device that was not consumed yet */
+	char recv_buffer[DEBUGSERVER_RECV_BUFFER_SIZE];
+	uint32_t recv_offset;
+	uint32_t recv_length;
 };
 
 struct debugserver_command_private {
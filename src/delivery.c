@@ -0,0 +1,261 @@
+/*
+ * delivery.c
+ * Decoupled delivery of received data to user callbacks
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+
+#include "delivery.h"
+#include "common/thread.h"
+#include "common/debug.h"
+
+/* larger rings are refused, entries are pointers so this is 128 MB on 64 bit */
+#define DELIVERY_MAX_CAPACITY (1 << 24)
+/* keeps head and tail on separate cache lines */
+#define DELIVERY_CACHE_LINE 64
+
+#if defined(__GNUC__)
+#define delivery_load(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define delivery_store(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define delivery_load_relaxed(p) __atomic_load_n(p, __ATOMIC_RELAXED)
+#define delivery_store_relaxed(p, v) __atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define delivery_cas(p, expected, desired) delivery_cas_real(p, expected, desired)
+#define delivery_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+static int delivery_cas_real(volatile uint32_t *p, uint32_t expected, uint32_t desired)
+{
+	return __atomic_compare_exchange_n(p, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+#else
+#define delivery_load(p) delivery_load_real((volatile void*)(p), sizeof(*(p)))
+#define delivery_store(p, v) do { MemoryBarrier(); *(p) = (v); } while (0)
+#define delivery_load_relaxed(p) (*(p))
+#define delivery_store_relaxed(p, v) do { *(p) = (v); } while (0)
+#define delivery_cas(p, expected, desired) (InterlockedCompareExchange((volatile LONG*)(p), (LONG)(desired), (LONG)(expected)) == (LONG)(expected))
+#define delivery_fence() MemoryBarrier()
+static uint64_t delivery_load_real(volatile void *p, size_t size)
+{
+	uint64_t v = (size == sizeof(uint32_t)) ? *(volatile uint32_t*)p : *(volatile uint64_t*)p;
+	MemoryBarrier();
+	return v;
+}
+#endif
+
+struct delivery_queue {
+	void * volatile *entries;
+	uint32_t mask;
+	enum idevice_delivery_policy policy;
+	delivery_free_func_t free_func;
+	delivery_func_t deliver;
+	void *user_data;
+	thread_future_t consumer;
+	/* next slot to write, only advanced by the producer */
+	volatile uint32_t head;
+	char pad1[DELIVERY_CACHE_LINE];
+	/* next slot to read, advanced by the consumer and, to drop the oldest
+	 * entry, by the producer. Whoever advances it owns the entry. */
+	volatile uint32_t tail;
+	char pad2[DELIVERY_CACHE_LINE];
+	volatile uint64_t dropped;
+	/* set while a side sleeps, so the other only takes the mutex then */
+	volatile uint32_t consumer_waiting;
+	volatile uint32_t producer_waiting;
+	volatile uint32_t stopping;
+	mutex_t mutex;
+	cond_t not_empty;
+	cond_t not_full;
+};
+
+int delivery_queue_new(delivery_queue_t *queue, uint32_t capacity, enum idevice_delivery_policy policy, delivery_free_func_t free_func)
+{
+	uint32_t size = 1;
+
+	if (!queue || capacity == 0 || capacity > DELIVERY_MAX_CAPACITY) {
+		return -1;
+	}
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	delivery_queue_t q = (delivery_queue_t)calloc(1, sizeof(struct delivery_queue));
+	if (!q) {
+		return -1;
+	}
+	q->entries = (void * volatile *)calloc(size, sizeof(void*));
+	if (!q->entries) {
+		free(q);
+		return -1;
+	}
+	q->mask = size - 1;
+	q->policy = policy;
+	q->free_func = free_func;
+	mutex_init(&q->mutex);
+	cond_init(&q->not_empty);
+	cond_init(&q->not_full);
+
+	*queue = q;
+	return 0;
+}
+
+void delivery_queue_free(delivery_queue_t queue)
+{
+	if (!queue) {
+		return;
+	}
+	delivery_queue_stop(queue);
+	/* entries are left over if the consumer was never started */
+	while (queue->tail != queue->head) {
+		if (queue->free_func) {
+			queue->free_func(queue->entries[queue->tail & queue->mask]);
+		}
+		queue->tail++;
+	}
+	cond_destroy(&queue->not_full);
+	cond_destroy(&queue->not_empty);
+	mutex_destroy(&queue->mutex);
+	free((void*)queue->entries);
+	free(queue);
+}
+
+/**
+ * Wakes the other side if it is sleeping. Called after publishing a new
+ * head or tail, the fence pairs with the one in the waiting side so either
+ * the waiter sees the update or we see the waiter.
+ */
+static void delivery_queue_wake(delivery_queue_t queue, volatile uint32_t *waiting, cond_t *cond)
+{
+	delivery_fence();
+	if (delivery_load_relaxed(waiting)) {
+		mutex_lock(&queue->mutex);
+		cond_signal(cond);
+		mutex_unlock(&queue->mutex);
+	}
+}
+
+static void* delivery_queue_consumer(void *arg)
+{
+	delivery_queue_t queue = (delivery_queue_t)arg;
+
+	while (1) {
+		/* read stopping first, everything pushed before the stop is visible then */
+		uint32_t stopping = delivery_load(&queue->stopping);
+		uint32_t tail = delivery_load(&queue->tail);
+		if (tail == delivery_load(&queue->head)) {
+			if (stopping) {
+				break;
+			}
+			mutex_lock(&queue->mutex);
+			delivery_store_relaxed(&queue->consumer_waiting, 1);
+			delivery_fence();
+			if (delivery_load(&queue->head) == delivery_load(&queue->tail) && !delivery_load(&queue->stopping)) {
+				cond_wait(&queue->not_empty, &queue->mutex);
+			}
+			delivery_store_relaxed(&queue->consumer_waiting, 0);
+			mutex_unlock(&queue->mutex);
+			continue;
+		}
+		void *entry = delivery_load_relaxed(&queue->entries[tail & queue->mask]);
+		if (!delivery_cas(&queue->tail, tail, tail + 1)) {
+			/* the producer dropped this entry in the meantime */
+			continue;
+		}
+		if (queue->policy == IDEVICE_DELIVERY_BLOCK) {
+			delivery_queue_wake(queue, &queue->producer_waiting, &queue->not_full);
+		}
+		queue->deliver(entry, queue->user_data);
+		if (queue->free_func) {
+			queue->free_func(entry);
+		}
+	}
+
+	return NULL;
+}
+
+int delivery_queue_start(delivery_queue_t queue, delivery_func_t deliver, void *user_data)
+{
+	if (!queue || !deliver || queue->consumer) {
+		return -1;
+	}
+	queue->deliver = deliver;
+	queue->user_data = user_data;
+	delivery_store(&queue->stopping, 0);
+	queue->consumer = threadpool_submit(threadpool_shared(), delivery_queue_consumer, queue);
+	return (queue->consumer) ? 0 : -1;
+}
+
+void delivery_queue_push(delivery_queue_t queue, void *entry)
+{
+	uint32_t head = delivery_load_relaxed(&queue->head);
+
+	while (1) {
+		uint32_t tail = delivery_load(&queue->tail);
+		if (head - tail <= queue->mask) {
+			break;
+		}
+		if (queue->policy == IDEVICE_DELIVERY_DROP_OLDEST) {
+			void *oldest = delivery_load_relaxed(&queue->entries[tail & queue->mask]);
+			if (delivery_cas(&queue->tail, tail, tail + 1)) {
+				if (queue->free_func) {
+					queue->free_func(oldest);
+				}
+				delivery_store_relaxed(&queue->dropped, queue->dropped + 1);
+			}
+			continue;
+		}
+		mutex_lock(&queue->mutex);
+		delivery_store_relaxed(&queue->producer_waiting, 1);
+		delivery_fence();
+		if (head - delivery_load(&queue->tail) > queue->mask) {
+			cond_wait(&queue->not_full, &queue->mutex);
+		}
+		delivery_store_relaxed(&queue->producer_waiting, 0);
+		mutex_unlock(&queue->mutex);
+	}
+
+	delivery_store_relaxed(&queue->entries[head & queue->mask], entry);
+	delivery_store(&queue->head, head + 1);
+	delivery_queue_wake(queue, &queue->consumer_waiting, &queue->not_empty);
+}
+
+void delivery_queue_stop(delivery_queue_t queue)
+{
+	if (!queue || !queue->consumer) {
+		return;
+	}
+	delivery_store(&queue->stopping, 1);
+	delivery_fence();
+	mutex_lock(&queue->mutex);
+	cond_broadcast(&queue->not_empty);
+	mutex_unlock(&queue->mutex);
+
+	thread_future_wait(queue->consumer);
+	thread_future_free(queue->consumer);
+	queue->consumer = NULL;
+	debug_info("delivery queue stopped, %llu entries dropped so far", (unsigned long long)queue->dropped);
+}
+
+uint64_t delivery_queue_get_dropped(delivery_queue_t queue)
+{
+	if (!queue) {
+		return 0;
+	}
+	return delivery_load(&queue->dropped);
+}
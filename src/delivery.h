@@ -0,0 +1,57 @@
+/*
+ * delivery.h
+ * Definitions for decoupled delivery of received data to user callbacks
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __DELIVERY_H
+#define __DELIVERY_H
+
+#include <stdint.h>
+
+#include "libimobiledevice/libimobiledevice.h"
+
+/* hands an entry to the user callback, the entry is freed afterwards */
+typedef void (*delivery_func_t)(void *entry, void *user_data);
+/* frees an entry that was delivered or dropped */
+typedef void (*delivery_free_func_t)(void *entry);
+
+/*
+ * Single-producer/single-consumer ring between a receiving thread and a
+ * consumer thread that invokes the user callback. Queueing and dequeueing
+ * don't take a lock, the mutex is only used to sleep while the ring is
+ * empty (consumer) or full with IDEVICE_DELIVERY_BLOCK (producer).
+ */
+typedef struct delivery_queue* delivery_queue_t;
+
+/* capacity is rounded up to a power of two */
+int delivery_queue_new(delivery_queue_t *queue, uint32_t capacity, enum idevice_delivery_policy policy, delivery_free_func_t free_func);
+void delivery_queue_free(delivery_queue_t queue);
+
+/* starts the consumer thread, returns -1 if it could not be started */
+int delivery_queue_start(delivery_queue_t queue, delivery_func_t deliver, void *user_data);
+/* producer side, takes ownership of entry. Only one thread may push. */
+void delivery_queue_push(delivery_queue_t queue, void *entry);
+/* delivers what is still queued and waits for the consumer thread to exit.
+ * Must be called after the producer stopped pushing, never from deliver. */
+void delivery_queue_stop(delivery_queue_t queue);
+
+/* number of entries dropped with IDEVICE_DELIVERY_DROP_OLDEST so far */
+uint64_t delivery_queue_get_dropped(delivery_queue_t queue);
+
+#endif
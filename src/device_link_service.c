@@ -24,6 +24,7 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include "device_link_service.h"
 #include "property_list_service.h"
 #include "common/debug.h"
@@ -49,6 +50,175 @@ static device_link_service_error_t device_link_error(property_list_service_error
 	return DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR;
 }
 
+#define DL_PROCESS_MESSAGE "DLMessageProcessMessage"
+#define DL_PROCESS_MESSAGE_LEN 23
+#define BPLIST_TRAILER_SIZE 32
+
+static uint64_t bplist_read_uint(const unsigned char *p, uint8_t size)
+{
+	uint64_t value = 0;
+	while (size--) {
+		value = (value << 8) | *p++;
+	}
+	return value;
+}
+
+static void bplist_write_uint(unsigned char *p, uint64_t value, uint8_t size)
+{
+	while (size--) {
+		p[size] = (unsigned char)(value & 0xFF);
+		value >>= 8;
+	}
+}
+
+/**
+ * Internally used function to validate the trailer of a binary plist.
+ *
+ * @return 1 if the trailer and offset table fit into the buffer, 0 otherwise.
+ */
+static int bplist_get_trailer(const unsigned char *bplist, uint64_t length, uint8_t *offset_size, uint8_t *ref_size, uint64_t *num_objects, uint64_t *top_object, uint64_t *offset_table)
+{
+	const unsigned char *trailer;
+
+	if (length < 8 + BPLIST_TRAILER_SIZE || memcmp(bplist, "bplist00", 8) != 0)
+		return 0;
+
+	trailer = bplist + length - BPLIST_TRAILER_SIZE;
+	*offset_size = trailer[6];
+	*ref_size = trailer[7];
+	*num_objects = bplist_read_uint(trailer + 8, 8);
+	*top_object = bplist_read_uint(trailer + 16, 8);
+	*offset_table = bplist_read_uint(trailer + 24, 8);
+
+	if (*offset_size < 1 || *offset_size > 8 || *ref_size < 1 || *ref_size > 8)
+		return 0;
+	if (*num_objects == 0 || *top_object >= *num_objects)
+		return 0;
+	if (*offset_table < 8 || *offset_table > length - BPLIST_TRAILER_SIZE)
+		return 0;
+	if (*num_objects > (length - BPLIST_TRAILER_SIZE - *offset_table) / *offset_size)
+		return 0;
+
+	return 1;
+}
+
+/**
+ * Internally used function to wrap a binary plist into a
+ * DLMessageProcessMessage array without converting it to a plist again.
+ * The envelope string and array are appended as two new objects and the
+ * offset table is rewritten behind them.
+ *
+ * @param bplist The binary plist of the message, reallocated as needed.
+ * @param length Length of the binary plist, updated on success.
+ *
+ * @return 1 on success, 0 if the message can't be wrapped this way.
+ */
+static int bplist_wrap_process_message(char **bplist, uint32_t *length)
+{
+	unsigned char *buf = (unsigned char*)*bplist;
+	unsigned char *newbuf;
+	uint8_t offset_size, ref_size, new_offset_size;
+	uint64_t num_objects, top_object, offset_table;
+	uint64_t str_offset, arr_offset, new_table, new_length, i;
+
+	if (!bplist_get_trailer(buf, *length, &offset_size, &ref_size, &num_objects, &top_object, &offset_table))
+		return 0;
+
+	/* the references to both new objects must fit into the reference size */
+	if (ref_size < 8 && (num_objects + 1) >> (ref_size * 8))
+		return 0;
+
+	str_offset = offset_table;
+	arr_offset = str_offset + 3 + DL_PROCESS_MESSAGE_LEN;
+	new_table = arr_offset + 1 + 2 * ref_size;
+	new_offset_size = offset_size;
+	while (new_offset_size < 8 && arr_offset >> (new_offset_size * 8))
+		new_offset_size++;
+	new_length = new_table + (num_objects + 2) * new_offset_size + BPLIST_TRAILER_SIZE;
+	if (new_length > UINT32_MAX)
+		return 0;
+
+	newbuf = (unsigned char*)malloc(new_length);
+	if (!newbuf)
+		return 0;
+
+	memcpy(newbuf, buf, str_offset);
+
+	/* ASCII string with the length as a following one byte integer */
+	newbuf[str_offset] = 0x5F;
+	newbuf[str_offset + 1] = 0x10;
+	newbuf[str_offset + 2] = DL_PROCESS_MESSAGE_LEN;
+	memcpy(newbuf + str_offset + 3, DL_PROCESS_MESSAGE, DL_PROCESS_MESSAGE_LEN);
+
+	/* array with two elements */
+	newbuf[arr_offset] = 0xA2;
+	bplist_write_uint(newbuf + arr_offset + 1, num_objects, ref_size);
+	bplist_write_uint(newbuf + arr_offset + 1 + ref_size, top_object, ref_size);
+
+	for (i = 0; i < num_objects; i++) {
+		uint64_t offset = bplist_read_uint(buf + offset_table + i * offset_size, offset_size);
+		bplist_write_uint(newbuf + new_table + i * new_offset_size, offset, new_offset_size);
+	}
+	bplist_write_uint(newbuf + new_table + num_objects * new_offset_size, str_offset, new_offset_size);
+	bplist_write_uint(newbuf + new_table + (num_objects + 1) * new_offset_size, arr_offset, new_offset_size);
+
+	unsigned char *trailer = newbuf + new_length - BPLIST_TRAILER_SIZE;
+	memset(trailer, 0, 6);
+	trailer[6] = new_offset_size;
+	trailer[7] = ref_size;
+	bplist_write_uint(trailer + 8, num_objects + 2, 8);
+	bplist_write_uint(trailer + 16, num_objects + 1, 8);
+	bplist_write_uint(trailer + 24, new_table, 8);
+
+	free(*bplist);
+	*bplist = (char*)newbuf;
+	*length = (uint32_t)new_length;
+
+	return 1;
+}
+
+/**
+ * Internally used function to check if a binary plist is a
+ * DLMessageProcessMessage array without parsing it. On success the top
+ * object of the binary plist is changed to the message dictionary so it
+ * can be parsed directly.
+ *
+ * @param bplist The received binary plist.
+ * @param length Length of the binary plist.
+ *
+ * @return 1 if the top object was changed, 0 otherwise.
+ */
+static int bplist_unwrap_process_message(char *bplist, uint32_t length)
+{
+	unsigned char *buf = (unsigned char*)bplist;
+	uint8_t offset_size, ref_size;
+	uint64_t num_objects, top_object, offset_table;
+	uint64_t arr_offset, str_ref, str_offset, msg_ref;
+
+	if (!bplist_get_trailer(buf, length, &offset_size, &ref_size, &num_objects, &top_object, &offset_table))
+		return 0;
+
+	arr_offset = bplist_read_uint(buf + offset_table + top_object * offset_size, offset_size);
+	if (arr_offset < 8 || arr_offset + 1 + 2 * ref_size > offset_table || buf[arr_offset] != 0xA2)
+		return 0;
+
+	str_ref = bplist_read_uint(buf + arr_offset + 1, ref_size);
+	msg_ref = bplist_read_uint(buf + arr_offset + 1 + ref_size, ref_size);
+	if (str_ref >= num_objects || msg_ref >= num_objects)
+		return 0;
+
+	str_offset = bplist_read_uint(buf + offset_table + str_ref * offset_size, offset_size);
+	if (str_offset < 8 || str_offset + 3 + DL_PROCESS_MESSAGE_LEN > offset_table)
+		return 0;
+	if (buf[str_offset] != 0x5F || buf[str_offset + 1] != 0x10 || buf[str_offset + 2] != DL_PROCESS_MESSAGE_LEN
+	    || memcmp(buf + str_offset + 3, DL_PROCESS_MESSAGE, DL_PROCESS_MESSAGE_LEN) != 0)
+		return 0;
+
+	bplist_write_uint(buf + length - BPLIST_TRAILER_SIZE + 16, msg_ref, 8);
+
+	return 1;
+}
+
 /**
  * Internally used function to extract the message string from a DL* message
  * plist.
@@ -330,11 +500,24 @@ device_link_service_error_t device_link_service_send_process_message(device_link
 	if (plist_get_node_type(message) != PLIST_DICT)
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
+	device_link_service_error_t err;
+	char *content = NULL;
+	uint32_t length = 0;
+
+	/* serialize the message once and put the envelope around the binary data */
+	plist_to_bin(message, &content, &length);
+	if (content && bplist_wrap_process_message(&content, &length)) {
+		err = device_link_error(property_list_service_send_message(client->parent, content, length));
+		free(content);
+		return err;
+	}
+	free(content);
+
 	plist_t array = plist_new_array();
-	plist_array_append_item(array, plist_new_string("DLMessageProcessMessage"));
+	plist_array_append_item(array, plist_new_string(DL_PROCESS_MESSAGE));
 	plist_array_append_item(array, plist_copy(message));
 
-	device_link_service_error_t err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
+	err = device_link_error(property_list_service_send_binary_plist(client->parent, array));
 	plist_free(array);
 
 	return err;
@@ -394,11 +577,32 @@ device_link_service_error_t device_link_service_receive_process_message(device_l
 		return DEVICE_LINK_SERVICE_E_INVALID_ARG;
 
 	plist_t pmsg = NULL;
-	device_link_service_error_t err = device_link_error(property_list_service_receive_plist(client->parent, &pmsg));
+	char *content = NULL;
+	uint32_t length = 0;
+	*message = NULL;
+	device_link_service_error_t err = device_link_error(property_list_service_receive_message(client->parent, &content, &length, 30000));
 	if (err != DEVICE_LINK_SERVICE_E_SUCCESS) {
 		return err;
 	}
 
+	/* parse only the message dictionary instead of copying it out of the envelope */
+	if (bplist_unwrap_process_message(content, length)) {
+		plist_from_bin(content, length, message);
+		property_list_service_message_done(client->parent);
+		if (!*message) {
+			debug_info("Malformed plist received for DLMessageProcessMessage");
+			return DEVICE_LINK_SERVICE_E_PLIST_ERROR;
+		}
+		debug_plist(*message);
+		return DEVICE_LINK_SERVICE_E_SUCCESS;
+	}
+
+	property_list_service_message_to_plist(content, length, &pmsg);
+	property_list_service_message_done(client->parent);
+	if (!pmsg) {
+		return DEVICE_LINK_SERVICE_E_PLIST_ERROR;
+	}
+
 	err = DEVICE_LINK_SERVICE_E_UNKNOWN_ERROR;
 
 	char *msg = NULL;
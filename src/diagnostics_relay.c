@@ -456,3 +456,316 @@ LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_query_ioregistr
 	plist_free(dict);
 	return ret;
 }
+
+#define SAMPLER_SOURCE_MOBILEGESTALT "MobileGestalt"
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_new(diagnostics_relay_client_t client, diagnostics_relay_sampler_t *sampler)
+{
+	if (!client || !client->parent || !sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_sampler_t sampler_loc = (diagnostics_relay_sampler_t)calloc(1, sizeof(struct diagnostics_relay_sampler_private));
+	if (!sampler_loc)
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	sampler_loc->client = client;
+	mutex_init(&sampler_loc->mutex);
+	cond_init(&sampler_loc->cond);
+
+	*sampler = sampler_loc;
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+static diagnostics_relay_error_t diagnostics_relay_sampler_add_source(diagnostics_relay_sampler_t sampler, const char *name, int is_gestalt, plist_t request)
+{
+	struct diagnostics_relay_sample_source *sources = (struct diagnostics_relay_sample_source*)realloc(sampler->sources, sizeof(struct diagnostics_relay_sample_source) * (sampler->num_sources + 1));
+	if (!sources) {
+		plist_free(request);
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	}
+	sampler->sources = sources;
+	struct diagnostics_relay_sample_source *source = &sources[sampler->num_sources++];
+	source->name = strdup(name);
+	source->is_gestalt = is_gestalt;
+	source->request = request;
+	source->last = NULL;
+	source->current = NULL;
+	source->status = DIAGNOSTICS_RELAY_E_SUCCESS;
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_add_ioregistry_entry(diagnostics_relay_sampler_t sampler, const char* entry_name, const char* entry_class)
+{
+	if (!sampler || (entry_name == NULL && entry_class == NULL))
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_error_t res = DIAGNOSTICS_RELAY_E_INVALID_ARG;
+	mutex_lock(&sampler->mutex);
+	if (!sampler->running) {
+		plist_t dict = plist_new_dict();
+		if (entry_name)
+			plist_dict_set_item(dict,"EntryName", plist_new_string(entry_name));
+		if (entry_class)
+			plist_dict_set_item(dict,"EntryClass", plist_new_string(entry_class));
+		plist_dict_set_item(dict,"Request", plist_new_string("IORegistry"));
+		res = diagnostics_relay_sampler_add_source(sampler, (entry_name) ? entry_name : entry_class, 0, dict);
+	}
+	mutex_unlock(&sampler->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_add_mobilegestalt_key(diagnostics_relay_sampler_t sampler, const char* key)
+{
+	if (!sampler || !key)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_error_t res = DIAGNOSTICS_RELAY_E_INVALID_ARG;
+	mutex_lock(&sampler->mutex);
+	if (!sampler->running) {
+		struct diagnostics_relay_sample_source *source = NULL;
+		unsigned int i;
+		for (i = 0; i < sampler->num_sources; i++) {
+			if (sampler->sources[i].is_gestalt) {
+				source = &sampler->sources[i];
+				break;
+			}
+		}
+		res = DIAGNOSTICS_RELAY_E_SUCCESS;
+		if (!source) {
+			/* all keys are queried with a single request */
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict,"MobileGestaltKeys", plist_new_array());
+			plist_dict_set_item(dict,"Request", plist_new_string("MobileGestalt"));
+			res = diagnostics_relay_sampler_add_source(sampler, SAMPLER_SOURCE_MOBILEGESTALT, 1, dict);
+			source = &sampler->sources[sampler->num_sources - 1];
+		}
+		if (res == DIAGNOSTICS_RELAY_E_SUCCESS) {
+			plist_array_append_item(plist_dict_get_item(source->request, "MobileGestaltKeys"), plist_new_string(key));
+		}
+	}
+	mutex_unlock(&sampler->mutex);
+
+	return res;
+}
+
+static void diagnostics_relay_sampler_reply_cb(uint32_t index, plist_t reply, property_list_service_error_t status, void *user_data)
+{
+	diagnostics_relay_sampler_t sampler = (diagnostics_relay_sampler_t)user_data;
+	struct diagnostics_relay_sample_source *source = &sampler->sources[index];
+
+	if (status != PROPERTY_LIST_SERVICE_E_SUCCESS || !reply) {
+		source->status = DIAGNOSTICS_RELAY_E_MUX_ERROR;
+		return;
+	}
+
+	int check = diagnostics_relay_check_result(reply);
+	if (check == RESULT_SUCCESS) {
+		source->status = DIAGNOSTICS_RELAY_E_SUCCESS;
+	} else if (check == RESULT_UNKNOWN_REQUEST) {
+		source->status = DIAGNOSTICS_RELAY_E_UNKNOWN_REQUEST;
+	} else {
+		source->status = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	}
+	if (source->status != DIAGNOSTICS_RELAY_E_SUCCESS)
+		return;
+
+	/* Diagnostics contains a single dictionary named after the request */
+	plist_t node = plist_dict_get_item(reply, "Diagnostics");
+	if (node && plist_get_node_type(node) == PLIST_DICT) {
+		plist_t values = plist_dict_get_item(node, plist_get_string_ptr(plist_dict_get_item(source->request, "Request"), NULL));
+		if (values && plist_get_node_type(values) == PLIST_DICT) {
+			source->current = plist_copy(values);
+		}
+	}
+	if (!source->current) {
+		source->status = DIAGNOSTICS_RELAY_E_PLIST_ERROR;
+	}
+}
+
+/**
+ * Reports the values of a source that differ from the previous tick.
+ */
+static void diagnostics_relay_sampler_report(struct diagnostics_relay_sample_source *source, diagnostics_relay_sample_cb_t callback, void *user_data)
+{
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t value = NULL;
+
+	plist_dict_new_iter(source->current, &iter);
+	if (iter) {
+		do {
+			key = NULL;
+			value = NULL;
+			plist_dict_next_item(source->current, iter, &key, &value);
+			if (key && !(source->is_gestalt && !strcmp(key, "Status"))) {
+				plist_t old = (source->last) ? plist_dict_get_item(source->last, key) : NULL;
+				if (!old || plist_get_node_type(old) != plist_get_node_type(value) || !plist_compare_node_value(old, value)) {
+					callback(source->name, key, value, DIAGNOSTICS_RELAY_E_SUCCESS, user_data);
+				}
+			}
+			free(key);
+		} while (value);
+		free(iter);
+	}
+
+	/* values that disappeared are reported as NULL */
+	if (source->last) {
+		iter = NULL;
+		plist_dict_new_iter(source->last, &iter);
+		if (iter) {
+			do {
+				key = NULL;
+				value = NULL;
+				plist_dict_next_item(source->last, iter, &key, &value);
+				if (key && !plist_dict_get_item(source->current, key)) {
+					callback(source->name, key, NULL, DIAGNOSTICS_RELAY_E_SUCCESS, user_data);
+				}
+				free(key);
+			} while (value);
+			free(iter);
+		}
+	}
+}
+
+static diagnostics_relay_error_t diagnostics_relay_sampler_tick(diagnostics_relay_sampler_t sampler, diagnostics_relay_sample_cb_t callback, void *user_data)
+{
+	plist_t *requests = (plist_t*)malloc(sizeof(plist_t) * sampler->num_sources);
+	if (!requests)
+		return DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+	unsigned int i;
+	for (i = 0; i < sampler->num_sources; i++) {
+		requests[i] = sampler->sources[i].request;
+		sampler->sources[i].current = NULL;
+		sampler->sources[i].status = DIAGNOSTICS_RELAY_E_MUX_ERROR;
+	}
+
+	diagnostics_relay_error_t res = DIAGNOSTICS_RELAY_E_SUCCESS;
+	if (property_list_service_send_receive_pipelined(sampler->client->parent, requests, sampler->num_sources, 0, 0, diagnostics_relay_sampler_reply_cb, sampler) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		debug_info("could not query diagnostics sources");
+		res = DIAGNOSTICS_RELAY_E_MUX_ERROR;
+	}
+	free(requests);
+
+	for (i = 0; i < sampler->num_sources; i++) {
+		struct diagnostics_relay_sample_source *source = &sampler->sources[i];
+		if (source->current) {
+			diagnostics_relay_sampler_report(source, callback, user_data);
+			plist_free(source->last);
+			source->last = source->current;
+			source->current = NULL;
+		} else if (res == DIAGNOSTICS_RELAY_E_SUCCESS) {
+			/* keep the previous values, the source is reported again once it recovers */
+			callback(source->name, NULL, NULL, source->status, user_data);
+		}
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_sample(diagnostics_relay_sampler_t sampler, diagnostics_relay_sample_cb_t callback, void *user_data)
+{
+	if (!sampler || !callback || sampler->num_sources == 0)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	mutex_lock(&sampler->mutex);
+	int running = sampler->running;
+	mutex_unlock(&sampler->mutex);
+	if (running)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	return diagnostics_relay_sampler_tick(sampler, callback, user_data);
+}
+
+static void* diagnostics_relay_sampler_thread(void *arg)
+{
+	diagnostics_relay_sampler_t sampler = (diagnostics_relay_sampler_t)arg;
+
+	mutex_lock(&sampler->mutex);
+	while (!sampler->stop) {
+		mutex_unlock(&sampler->mutex);
+		diagnostics_relay_error_t res = diagnostics_relay_sampler_tick(sampler, sampler->callback, sampler->user_data);
+		mutex_lock(&sampler->mutex);
+		if (res != DIAGNOSTICS_RELAY_E_SUCCESS) {
+			/* the connection is gone, there is no point in retrying */
+			sampler->callback(NULL, NULL, NULL, res, sampler->user_data);
+			break;
+		}
+		if (!sampler->stop) {
+			cond_wait_timeout(&sampler->cond, &sampler->mutex, sampler->interval);
+		}
+	}
+	mutex_unlock(&sampler->mutex);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_start(diagnostics_relay_sampler_t sampler, unsigned int interval, diagnostics_relay_sample_cb_t callback, void *user_data)
+{
+	if (!sampler || !callback || interval == 0 || sampler->num_sources == 0)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_error_t res = DIAGNOSTICS_RELAY_E_SUCCESS;
+	mutex_lock(&sampler->mutex);
+	if (sampler->running) {
+		res = DIAGNOSTICS_RELAY_E_INVALID_ARG;
+	} else {
+		sampler->interval = interval;
+		sampler->callback = callback;
+		sampler->user_data = user_data;
+		sampler->stop = 0;
+		if (thread_new(&sampler->thread, diagnostics_relay_sampler_thread, sampler) != 0) {
+			res = DIAGNOSTICS_RELAY_E_UNKNOWN_ERROR;
+		} else {
+			sampler->running = 1;
+		}
+	}
+	mutex_unlock(&sampler->mutex);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_stop(diagnostics_relay_sampler_t sampler)
+{
+	if (!sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	mutex_lock(&sampler->mutex);
+	if (!sampler->running) {
+		mutex_unlock(&sampler->mutex);
+		return DIAGNOSTICS_RELAY_E_SUCCESS;
+	}
+	sampler->stop = 1;
+	cond_signal(&sampler->cond);
+	mutex_unlock(&sampler->mutex);
+
+	thread_join(sampler->thread);
+	thread_free(sampler->thread);
+
+	mutex_lock(&sampler->mutex);
+	sampler->running = 0;
+	mutex_unlock(&sampler->mutex);
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API diagnostics_relay_error_t diagnostics_relay_sampler_free(diagnostics_relay_sampler_t sampler)
+{
+	if (!sampler)
+		return DIAGNOSTICS_RELAY_E_INVALID_ARG;
+
+	diagnostics_relay_sampler_stop(sampler);
+
+	unsigned int i;
+	for (i = 0; i < sampler->num_sources; i++) {
+		free(sampler->sources[i].name);
+		plist_free(sampler->sources[i].request);
+		plist_free(sampler->sources[i].last);
+	}
+	free(sampler->sources);
+	cond_destroy(&sampler->cond);
+	mutex_destroy(&sampler->mutex);
+	free(sampler);
+
+	return DIAGNOSTICS_RELAY_E_SUCCESS;
+}
@@ -24,9 +24,37 @@
 
 #include "libimobiledevice/diagnostics_relay.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 struct diagnostics_relay_client_private {
 	property_list_service_client_t parent;
 };
 
+struct diagnostics_relay_sample_source {
+	char *name;
+	int is_gestalt;
+	/* the request sent on every tick */
+	plist_t request;
+	/* values of the previous tick, NULL before the first one */
+	plist_t last;
+	/* reply of the current tick */
+	plist_t current;
+	diagnostics_relay_error_t status;
+};
+
+struct diagnostics_relay_sampler_private {
+	diagnostics_relay_client_t client;
+	struct diagnostics_relay_sample_source *sources;
+	unsigned int num_sources;
+	/* background sampling */
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int running;
+	int stop;
+	unsigned int interval;
+	diagnostics_relay_sample_cb_t callback;
+	void *user_data;
+};
+
 #endif
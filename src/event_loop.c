@@ -0,0 +1,833 @@
+/*
+ * event_loop.c
+ * Connection event loop implementation.
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef WIN32
+#include <winsock2.h>
+#include <windows.h>
+#define poll WSAPoll
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#if defined(HAVE_SYS_EPOLL_H)
+#include <sys/epoll.h>
+#define EVENT_LOOP_USE_EPOLL 1
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#define EVENT_LOOP_USE_URING 1
+#endif
+#elif defined(HAVE_SYS_EVENT_H)
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#define EVENT_LOOP_USE_KQUEUE 1
+#endif
+#endif
+
+#include "event_loop.h"
+#include "common/debug.h"
+
+#if defined(EVENT_LOOP_USE_URING)
+/**
+ * Queues a one-shot poll for readability of fd, or the removal of the poll
+ * for id if fd is -1. The request is submitted right away if a worker is
+ * waiting for completions, otherwise the next worker that starts waiting
+ * submits it together with all others queued in the meantime.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int event_loop_uring_queue(idevice_event_loop_t loop, int fd, uint64_t id)
+{
+	int res = 0;
+
+	mutex_lock(&loop->uring_mutex);
+	struct io_uring_sqe *sqe = io_uring_get_sqe(loop->uring);
+	if (!sqe) {
+		/* the submission queue is full */
+		io_uring_submit(loop->uring);
+		sqe = io_uring_get_sqe(loop->uring);
+	}
+	if (!sqe) {
+		res = -1;
+	} else if (fd < 0) {
+		io_uring_prep_poll_remove(sqe, id);
+		io_uring_sqe_set_data64(sqe, EVENT_LOOP_ID_IGNORE);
+	} else {
+		io_uring_prep_poll_add(sqe, fd, POLLIN);
+		io_uring_sqe_set_data64(sqe, id);
+	}
+	if (res == 0 && loop->uring_waiting) {
+		int err = io_uring_submit(loop->uring);
+		if (err < 0) {
+			debug_info("ERROR: could not submit to io_uring: %s", strerror(-err));
+			res = -1;
+		}
+	}
+	mutex_unlock(&loop->uring_mutex);
+
+	return res;
+}
+#endif
+
+/**
+ * Starts watching the socket of an entry for the next readiness event.
+ * The entry is disarmed again automatically when the event is delivered,
+ * so that only one worker at a time handles a connection.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int event_loop_arm(idevice_event_loop_t loop, struct event_loop_entry *entry, int add)
+{
+#if defined(EVENT_LOOP_USE_URING)
+	if (loop->uring) {
+		return event_loop_uring_queue(loop, entry->fd, entry->id);
+	}
+#endif
+#if defined(EVENT_LOOP_USE_EPOLL)
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = entry->id;
+	return (epoll_ctl(loop->backend_fd, (add) ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, entry->fd, &ev) < 0) ? -1 : 0;
+#elif defined(EVENT_LOOP_USE_KQUEUE)
+	struct kevent kev;
+	EV_SET(&kev, entry->fd, EVFILT_READ, EV_ADD | EV_ONESHOT, 0, 0, (void*)(uintptr_t)entry->id);
+	return (kevent(loop->backend_fd, &kev, 1, NULL, 0, NULL) < 0) ? -1 : 0;
+#else
+	/* the poll() backend picks up all idle entries on every iteration */
+	return 0;
+#endif
+}
+
+/**
+ * Stops watching the socket of an entry.
+ */
+static void event_loop_disarm(idevice_event_loop_t loop, struct event_loop_entry *entry)
+{
+#if defined(EVENT_LOOP_USE_URING)
+	if (loop->uring) {
+		/* a poll that completes anyway is dropped as its id is gone */
+		event_loop_uring_queue(loop, -1, entry->id);
+		return;
+	}
+#endif
+#if defined(EVENT_LOOP_USE_EPOLL)
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	epoll_ctl(loop->backend_fd, EPOLL_CTL_DEL, entry->fd, &ev);
+#elif defined(EVENT_LOOP_USE_KQUEUE)
+	struct kevent kev;
+	EV_SET(&kev, entry->fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	/* fails if the one-shot event already fired, which is fine */
+	kevent(loop->backend_fd, &kev, 1, NULL, 0, NULL);
+#endif
+}
+
+/**
+ * Unlinks an entry from the list of registered connections.
+ * Must be called with the loop mutex held.
+ */
+static void event_loop_unlink(idevice_event_loop_t loop, struct event_loop_entry *entry)
+{
+	struct event_loop_entry **pp = &loop->entries;
+	while (*pp) {
+		if (*pp == entry) {
+			*pp = entry->next;
+			entry->next = NULL;
+			return;
+		}
+		pp = &(*pp)->next;
+	}
+}
+
+/**
+ * Looks up the entry for a readiness event and marks it busy.
+ * Entries are looked up by id instead of by pointer, so that an event
+ * delivered for a connection that has been removed in the meantime is
+ * simply dropped.
+ *
+ * @return The claimed entry, or NULL if it is gone or already being handled.
+ */
+static struct event_loop_entry* event_loop_claim(idevice_event_loop_t loop, uint64_t id)
+{
+	struct event_loop_entry *entry = NULL;
+
+	mutex_lock(&loop->mutex);
+	if (!loop->stopping) {
+		entry = loop->entries;
+		while (entry && entry->id != id) {
+			entry = entry->next;
+		}
+		if (entry && entry->busy) {
+			entry = NULL;
+		}
+		if (entry) {
+			entry->busy = 1;
+		}
+	}
+	mutex_unlock(&loop->mutex);
+
+	return entry;
+}
+
+/**
+ * Invokes the callback of a claimed entry and re-arms it afterwards, unless
+ * the callback asked for it to be removed.
+ */
+static void event_loop_dispatch(idevice_event_loop_t loop, struct event_loop_entry *entry)
+{
+	int res;
+
+	do {
+		res = entry->callback(entry->connection, entry->user_data);
+		/* the socket won't signal data the SSL layer has already decrypted */
+	} while (res == 0 && !loop->stopping && !entry->removed && idevice_connection_has_pending_data(entry->connection));
+
+	mutex_lock(&loop->mutex);
+	entry->busy = 0;
+	if (entry->removed) {
+		/* idevice_event_loop_remove() is waiting to free the entry */
+		cond_broadcast(&loop->cond);
+		entry = NULL;
+	} else if (res != 0) {
+		event_loop_unlink(loop, entry);
+		event_loop_disarm(loop, entry);
+	} else if (event_loop_arm(loop, entry, 0) < 0) {
+		debug_info("ERROR: could not re-arm connection %p, removing it", entry->connection);
+		event_loop_unlink(loop, entry);
+		event_loop_disarm(loop, entry);
+	} else {
+		entry = NULL;
+	}
+	mutex_unlock(&loop->mutex);
+
+	if (entry) {
+		free(entry);
+	}
+}
+
+/**
+ * Takes the oldest job off the queue of an event loop.
+ *
+ * @return The job, or NULL if the queue is empty.
+ */
+static struct event_loop_job* event_loop_pop_job(idevice_event_loop_t loop)
+{
+	struct event_loop_job *job;
+
+	mutex_lock(&loop->mutex);
+	job = loop->jobs;
+	if (job) {
+		loop->jobs = job->next;
+		if (!loop->jobs) {
+			loop->jobs_tail = NULL;
+		}
+	}
+#ifndef WIN32
+	if (!loop->jobs && loop->job_pipe[0] >= 0) {
+		/* the queue is empty, so the job pipe must not signal anymore */
+		char buf[64];
+		while (read(loop->job_pipe[0], buf, sizeof(buf)) > 0);
+	}
+#endif
+	mutex_unlock(&loop->mutex);
+
+	return job;
+}
+
+/**
+ * Runs the next queued job, if any.
+ *
+ * @return 1 if a job was run, 0 if the queue was empty.
+ */
+static int event_loop_run_job(idevice_event_loop_t loop)
+{
+	struct event_loop_job *job = event_loop_pop_job(loop);
+	if (!job) {
+		return 0;
+	}
+	job->func(job->data, 0);
+	free(job);
+	return 1;
+}
+
+/**
+ * Queues a function to be run by one of the worker threads of an event
+ * loop. Used to run blocking operations like connects off the thread of
+ * the caller.
+ *
+ * @return 0 on success, -1 if the loop is being stopped or out of memory.
+ */
+int event_loop_submit(idevice_event_loop_t loop, event_loop_job_func_t func, void *data)
+{
+	struct event_loop_job *job = (struct event_loop_job*)malloc(sizeof(struct event_loop_job));
+	if (!job) {
+		return -1;
+	}
+	job->func = func;
+	job->data = data;
+	job->next = NULL;
+
+	mutex_lock(&loop->mutex);
+	if (loop->stopping) {
+		mutex_unlock(&loop->mutex);
+		free(job);
+		return -1;
+	}
+	if (loop->jobs_tail) {
+		loop->jobs_tail->next = job;
+	} else {
+		loop->jobs = job;
+	}
+	loop->jobs_tail = job;
+#ifndef WIN32
+	if (loop->job_pipe[1] >= 0) {
+		/* a full pipe is readable already, so EAGAIN can be ignored */
+		char c = 0;
+		if (write(loop->job_pipe[1], &c, 1) != 1 && errno != EAGAIN) {
+			debug_info("ERROR: could not signal queued job");
+		}
+	}
+#endif
+	mutex_unlock(&loop->mutex);
+
+	return 0;
+}
+
+#if defined(EVENT_LOOP_USE_EPOLL) || defined(EVENT_LOOP_USE_KQUEUE)
+static void* event_loop_worker(void *arg)
+{
+	idevice_event_loop_t loop = (idevice_event_loop_t)arg;
+
+	while (!loop->stopping) {
+		uint64_t id = 0;
+#if defined(EVENT_LOOP_USE_EPOLL)
+		struct epoll_event ev;
+		int n = epoll_wait(loop->backend_fd, &ev, 1, -1);
+		if (n > 0) {
+			id = ev.data.u64;
+		}
+#else
+		struct kevent kev;
+		int n = kevent(loop->backend_fd, NULL, 0, &kev, 1, NULL);
+		if (n > 0) {
+			id = (uint64_t)(uintptr_t)kev.udata;
+		}
+#endif
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			debug_info("ERROR: waiting for events failed: %s", strerror(errno));
+			break;
+		}
+		if (n == 0) {
+			continue;
+		}
+		if (id == EVENT_LOOP_ID_WAKEUP) {
+			/* wakeup pipe, the loop is being stopped */
+			break;
+		}
+		if (id == EVENT_LOOP_ID_JOBS) {
+			event_loop_run_job(loop);
+			continue;
+		}
+		struct event_loop_entry *entry = event_loop_claim(loop, id);
+		if (entry) {
+			event_loop_dispatch(loop, entry);
+		}
+	}
+
+	return NULL;
+}
+
+#if defined(EVENT_LOOP_USE_URING)
+/**
+ * Submits the queued requests, waits for at least one completion and moves
+ * up to EVENT_LOOP_URING_BATCH completions to the ready list, so that one
+ * system call serves many connections. Must be called with poll_mutex held.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int event_loop_uring_reap(idevice_event_loop_t loop)
+{
+	struct io_uring_cqe *cqes[EVENT_LOOP_URING_BATCH];
+	struct io_uring_cqe *cqe = NULL;
+	unsigned int i, n;
+	int res;
+
+	do {
+		mutex_lock(&loop->uring_mutex);
+		if (io_uring_sq_ready(loop->uring) > 0) {
+			/* polls re-armed while no worker was waiting */
+			res = io_uring_submit(loop->uring);
+			if (res < 0) {
+				debug_info("ERROR: could not submit to io_uring: %s", strerror(-res));
+			}
+		}
+		loop->uring_waiting = 1;
+		mutex_unlock(&loop->uring_mutex);
+
+		res = io_uring_wait_cqe(loop->uring, &cqe);
+
+		mutex_lock(&loop->uring_mutex);
+		loop->uring_waiting = 0;
+		mutex_unlock(&loop->uring_mutex);
+	} while (res == -EINTR && !loop->stopping);
+
+	if (res < 0) {
+		debug_info("ERROR: waiting for completions failed: %s", strerror(-res));
+		return -1;
+	}
+
+	n = io_uring_peek_batch_cqe(loop->uring, cqes, EVENT_LOOP_URING_BATCH);
+	for (i = 0; i < n; i++) {
+		loop->uring_ready[i] = io_uring_cqe_get_data64(cqes[i]);
+	}
+	io_uring_cq_advance(loop->uring, n);
+	loop->uring_ready_count = n;
+
+	return 0;
+}
+
+static void* event_loop_uring_worker(void *arg)
+{
+	idevice_event_loop_t loop = (idevice_event_loop_t)arg;
+
+	while (!loop->stopping) {
+		uint64_t id;
+
+		/* one worker waits for completions, the others take what it reaped */
+		mutex_lock(&loop->poll_mutex);
+		if (loop->stopping || (loop->uring_ready_count == 0 && event_loop_uring_reap(loop) < 0)) {
+			mutex_unlock(&loop->poll_mutex);
+			break;
+		}
+		id = loop->uring_ready[--loop->uring_ready_count];
+		mutex_unlock(&loop->poll_mutex);
+
+		if (id == EVENT_LOOP_ID_WAKEUP) {
+			/* the loop is being stopped */
+			break;
+		}
+		if (id == EVENT_LOOP_ID_IGNORE) {
+			continue;
+		}
+		if (id == EVENT_LOOP_ID_JOBS) {
+			/* re-armed first, so other workers can run further jobs meanwhile */
+			if (event_loop_uring_queue(loop, loop->job_pipe[0], EVENT_LOOP_ID_JOBS) < 0) {
+				debug_info("ERROR: could not re-arm job pipe");
+			}
+			event_loop_run_job(loop);
+			continue;
+		}
+		struct event_loop_entry *entry = event_loop_claim(loop, id);
+		if (entry) {
+			event_loop_dispatch(loop, entry);
+		}
+	}
+
+	return NULL;
+}
+#endif
+#else
+/**
+ * Makes sure the poll set of a worker has room for one more descriptor.
+ *
+ * @return 0 on success, -1 if out of memory.
+ */
+static int event_loop_poll_reserve(struct pollfd **fds, uint64_t **ids, unsigned int *capacity, unsigned int nfds)
+{
+	if (nfds < *capacity) {
+		return 0;
+	}
+	unsigned int newcap = (*capacity) ? *capacity * 2 : 16;
+	struct pollfd *newfds = (struct pollfd*)realloc(*fds, newcap * sizeof(struct pollfd));
+	if (newfds) {
+		*fds = newfds;
+	}
+	uint64_t *newids = (uint64_t*)realloc(*ids, newcap * sizeof(uint64_t));
+	if (newids) {
+		*ids = newids;
+	}
+	if (!newfds || !newids) {
+		return -1;
+	}
+	*capacity = newcap;
+	return 0;
+}
+
+static void* event_loop_worker(void *arg)
+{
+	idevice_event_loop_t loop = (idevice_event_loop_t)arg;
+	struct pollfd *fds = NULL;
+	uint64_t *ids = NULL;
+	unsigned int capacity = 0;
+
+	while (!loop->stopping) {
+		unsigned int nfds = 0;
+		struct event_loop_entry *entry;
+
+		if (event_loop_run_job(loop)) {
+			continue;
+		}
+
+		/* only one worker polls at a time, the others wait here */
+		mutex_lock(&loop->poll_mutex);
+
+		mutex_lock(&loop->mutex);
+#ifndef WIN32
+		/* wake up when a job gets queued */
+		if (loop->job_pipe[0] >= 0) {
+			if (event_loop_poll_reserve(&fds, &ids, &capacity, nfds) == 0) {
+				fds[0].fd = loop->job_pipe[0];
+				fds[0].events = POLLIN;
+				fds[0].revents = 0;
+				ids[0] = EVENT_LOOP_ID_JOBS;
+				nfds++;
+			}
+		}
+#endif
+		for (entry = loop->entries; entry; entry = entry->next) {
+			if (entry->busy) {
+				continue;
+			}
+			if (event_loop_poll_reserve(&fds, &ids, &capacity, nfds) < 0) {
+				break;
+			}
+			fds[nfds].fd = entry->fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			ids[nfds] = entry->id;
+			nfds++;
+		}
+		mutex_unlock(&loop->mutex);
+
+		if (nfds == 0) {
+			mutex_unlock(&loop->poll_mutex);
+#ifdef WIN32
+			Sleep(EVENT_LOOP_POLL_INTERVAL);
+#else
+			poll(NULL, 0, EVENT_LOOP_POLL_INTERVAL);
+#endif
+			continue;
+		}
+
+		/* new registrations are picked up on the next iteration */
+		int n = poll(fds, nfds, EVENT_LOOP_POLL_INTERVAL);
+		entry = NULL;
+		if (n > 0) {
+			unsigned int i;
+			for (i = 0; i < nfds && !entry; i++) {
+				if (fds[i].revents && ids[i] != EVENT_LOOP_ID_JOBS) {
+					entry = event_loop_claim(loop, ids[i]);
+				}
+			}
+		}
+		mutex_unlock(&loop->poll_mutex);
+
+		if (entry) {
+			event_loop_dispatch(loop, entry);
+		}
+	}
+
+	free(fds);
+	free(ids);
+
+	return NULL;
+}
+#endif
+
+/**
+ * Stops the worker threads of an event loop and releases its resources.
+ */
+static void event_loop_shutdown(idevice_event_loop_t loop)
+{
+	unsigned int i;
+
+	mutex_lock(&loop->mutex);
+	loop->stopping = 1;
+	mutex_unlock(&loop->mutex);
+
+#if defined(EVENT_LOOP_USE_EPOLL) || defined(EVENT_LOOP_USE_KQUEUE)
+	if (loop->wakeup_pipe[1] >= 0) {
+		/* the pipe is never drained, so every worker sees it readable */
+		char c = 0;
+		if (write(loop->wakeup_pipe[1], &c, 1) != 1) {
+			debug_info("ERROR: could not wake up event loop workers");
+		}
+	}
+#endif
+
+	for (i = 0; i < loop->num_workers; i++) {
+		thread_join(loop->workers[i]);
+		thread_free(loop->workers[i]);
+	}
+	free(loop->workers);
+
+	while (loop->entries) {
+		struct event_loop_entry *entry = loop->entries;
+		loop->entries = entry->next;
+		free(entry);
+	}
+
+	/* let the submitters of jobs that never ran clean up */
+	while (loop->jobs) {
+		struct event_loop_job *job = loop->jobs;
+		loop->jobs = job->next;
+		job->func(job->data, 1);
+		free(job);
+	}
+	loop->jobs_tail = NULL;
+
+#ifndef WIN32
+	if (loop->job_pipe[0] >= 0)
+		close(loop->job_pipe[0]);
+	if (loop->job_pipe[1] >= 0)
+		close(loop->job_pipe[1]);
+	if (loop->wakeup_pipe[0] >= 0)
+		close(loop->wakeup_pipe[0]);
+	if (loop->wakeup_pipe[1] >= 0)
+		close(loop->wakeup_pipe[1]);
+	if (loop->backend_fd >= 0)
+		close(loop->backend_fd);
+#endif
+
+#if defined(EVENT_LOOP_USE_URING)
+	if (loop->uring) {
+		io_uring_queue_exit(loop->uring);
+		free(loop->uring);
+	}
+#endif
+
+	mutex_destroy(&loop->uring_mutex);
+	mutex_destroy(&loop->poll_mutex);
+	cond_destroy(&loop->cond);
+	mutex_destroy(&loop->mutex);
+	free(loop);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_loop_new(idevice_event_loop_t *loop, unsigned int num_threads)
+{
+	if (!loop)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (num_threads == 0)
+		num_threads = EVENT_LOOP_DEFAULT_THREADS;
+
+	idevice_event_loop_t loop_loc = (idevice_event_loop_t)calloc(1, sizeof(struct idevice_event_loop_private));
+	if (!loop_loc)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	mutex_init(&loop_loc->mutex);
+	cond_init(&loop_loc->cond);
+	mutex_init(&loop_loc->poll_mutex);
+	mutex_init(&loop_loc->uring_mutex);
+	loop_loc->backend_fd = -1;
+	loop_loc->wakeup_pipe[0] = -1;
+	loop_loc->wakeup_pipe[1] = -1;
+	loop_loc->job_pipe[0] = -1;
+	loop_loc->job_pipe[1] = -1;
+	loop_loc->next_id = EVENT_LOOP_ID_IGNORE + 1;
+
+#ifndef WIN32
+	if (pipe(loop_loc->job_pipe) < 0 || fcntl(loop_loc->job_pipe[0], F_SETFL, O_NONBLOCK) < 0 || fcntl(loop_loc->job_pipe[1], F_SETFL, O_NONBLOCK) < 0) {
+		debug_info("ERROR: could not create job pipe: %s", strerror(errno));
+		event_loop_shutdown(loop_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+#endif
+
+#if defined(EVENT_LOOP_USE_URING)
+	if (getenv(EVENT_LOOP_URING_ENV)) {
+		loop_loc->uring = (struct io_uring*)calloc(1, sizeof(struct io_uring));
+		int res = (loop_loc->uring) ? io_uring_queue_init(EVENT_LOOP_URING_ENTRIES, loop_loc->uring, 0) : -ENOMEM;
+		if (res < 0) {
+			debug_info("io_uring is not available (%s), using epoll", strerror(-res));
+			free(loop_loc->uring);
+			loop_loc->uring = NULL;
+		}
+	}
+	if (loop_loc->uring) {
+		if (pipe(loop_loc->wakeup_pipe) < 0
+		    || event_loop_uring_queue(loop_loc, loop_loc->wakeup_pipe[0], EVENT_LOOP_ID_WAKEUP) < 0
+		    || event_loop_uring_queue(loop_loc, loop_loc->job_pipe[0], EVENT_LOOP_ID_JOBS) < 0) {
+			debug_info("ERROR: could not set up event loop");
+			event_loop_shutdown(loop_loc);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	} else {
+#endif
+#if defined(EVENT_LOOP_USE_EPOLL) || defined(EVENT_LOOP_USE_KQUEUE)
+#if defined(EVENT_LOOP_USE_EPOLL)
+	loop_loc->backend_fd = epoll_create(1);
+#else
+	loop_loc->backend_fd = kqueue();
+#endif
+	if (loop_loc->backend_fd < 0 || pipe(loop_loc->wakeup_pipe) < 0) {
+		debug_info("ERROR: could not set up event loop: %s", strerror(errno));
+		event_loop_shutdown(loop_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	int res;
+#if defined(EVENT_LOOP_USE_EPOLL)
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u64 = EVENT_LOOP_ID_WAKEUP;
+	res = epoll_ctl(loop_loc->backend_fd, EPOLL_CTL_ADD, loop_loc->wakeup_pipe[0], &ev);
+	if (res == 0) {
+		ev.data.u64 = EVENT_LOOP_ID_JOBS;
+		res = epoll_ctl(loop_loc->backend_fd, EPOLL_CTL_ADD, loop_loc->job_pipe[0], &ev);
+	}
+#else
+	struct kevent kev[2];
+	EV_SET(&kev[0], loop_loc->wakeup_pipe[0], EVFILT_READ, EV_ADD, 0, 0, (void*)(uintptr_t)EVENT_LOOP_ID_WAKEUP);
+	EV_SET(&kev[1], loop_loc->job_pipe[0], EVFILT_READ, EV_ADD, 0, 0, (void*)(uintptr_t)EVENT_LOOP_ID_JOBS);
+	res = kevent(loop_loc->backend_fd, kev, 2, NULL, 0, NULL);
+#endif
+	if (res < 0) {
+		debug_info("ERROR: could not watch wakeup pipe: %s", strerror(errno));
+		event_loop_shutdown(loop_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+#endif
+#if defined(EVENT_LOOP_USE_URING)
+	}
+#endif
+
+	loop_loc->workers = (THREAD_T*)calloc(num_threads, sizeof(THREAD_T));
+	if (!loop_loc->workers) {
+		event_loop_shutdown(loop_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	thread_func_t worker = event_loop_worker;
+#if defined(EVENT_LOOP_USE_URING)
+	if (loop_loc->uring) {
+		worker = event_loop_uring_worker;
+	}
+#endif
+	while (loop_loc->num_workers < num_threads) {
+		if (thread_new(&loop_loc->workers[loop_loc->num_workers], worker, loop_loc) != 0) {
+			debug_info("ERROR: could not start event loop worker");
+			event_loop_shutdown(loop_loc);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		loop_loc->num_workers++;
+	}
+
+	*loop = loop_loc;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_loop_free(idevice_event_loop_t loop)
+{
+	if (!loop)
+		return IDEVICE_E_INVALID_ARG;
+
+	event_loop_shutdown(loop);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_loop_add(idevice_event_loop_t loop, idevice_connection_t connection, idevice_event_loop_cb_t callback, void *user_data)
+{
+	struct event_loop_entry *entry;
+	int fd = -1;
+
+	if (!loop || !connection || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (idevice_connection_get_fd(connection, &fd) != IDEVICE_E_SUCCESS)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	mutex_lock(&loop->mutex);
+	for (entry = loop->entries; entry; entry = entry->next) {
+		if (entry->connection == connection) {
+			mutex_unlock(&loop->mutex);
+			debug_info("connection %p is already registered", connection);
+			return IDEVICE_E_INVALID_ARG;
+		}
+	}
+
+	entry = (struct event_loop_entry*)calloc(1, sizeof(struct event_loop_entry));
+	if (!entry) {
+		mutex_unlock(&loop->mutex);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	entry->id = loop->next_id++;
+	entry->connection = connection;
+	entry->fd = fd;
+	entry->callback = callback;
+	entry->user_data = user_data;
+	entry->next = loop->entries;
+	loop->entries = entry;
+
+	if (event_loop_arm(loop, entry, 1) < 0) {
+		debug_info("ERROR: could not watch connection %p: %s", connection, strerror(errno));
+		event_loop_unlink(loop, entry);
+		mutex_unlock(&loop->mutex);
+		free(entry);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	mutex_unlock(&loop->mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_loop_remove(idevice_event_loop_t loop, idevice_connection_t connection)
+{
+	struct event_loop_entry *entry;
+
+	if (!loop || !connection)
+		return IDEVICE_E_INVALID_ARG;
+
+	mutex_lock(&loop->mutex);
+	for (entry = loop->entries; entry; entry = entry->next) {
+		if (entry->connection == connection) {
+			break;
+		}
+	}
+	if (!entry) {
+		mutex_unlock(&loop->mutex);
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	event_loop_unlink(loop, entry);
+	event_loop_disarm(loop, entry);
+	entry->removed = 1;
+	while (entry->busy) {
+		cond_wait(&loop->cond, &loop->mutex);
+	}
+	mutex_unlock(&loop->mutex);
+
+	free(entry);
+
+	return IDEVICE_E_SUCCESS;
+}
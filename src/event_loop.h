@@ -0,0 +1,99 @@
+/*
+ * event_loop.h
+ * Definitions for the connection event loop
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __EVENT_LOOP_H
+#define __EVENT_LOOP_H
+
+#include <stdint.h>
+
+#include "idevice.h"
+#include "common/thread.h"
+
+#define EVENT_LOOP_DEFAULT_THREADS 4
+
+/* how often workers of the poll() backend look for new registrations */
+#define EVENT_LOOP_POLL_INTERVAL 100
+
+/* selects the io_uring backend on Linux if it was built with liburing */
+#define EVENT_LOOP_URING_ENV "IMOBILEDEVICE_IO_URING"
+#define EVENT_LOOP_URING_ENTRIES 256
+/* completions a waiting worker reaps at once */
+#define EVENT_LOOP_URING_BATCH 64
+
+/* reserved event ids, connection entries start after these */
+#define EVENT_LOOP_ID_WAKEUP 0
+#define EVENT_LOOP_ID_JOBS 1
+/* completions of io_uring poll removals */
+#define EVENT_LOOP_ID_IGNORE 2
+
+/* cancelled is set when the loop is freed before the job could run */
+typedef void (*event_loop_job_func_t)(void *data, int cancelled);
+
+struct event_loop_job {
+	event_loop_job_func_t func;
+	void *data;
+	struct event_loop_job *next;
+};
+
+struct event_loop_entry {
+	uint64_t id;
+	idevice_connection_t connection;
+	int fd;
+	idevice_event_loop_cb_t callback;
+	void *user_data;
+	int busy;
+	int removed;
+	struct event_loop_entry *next;
+};
+
+struct idevice_event_loop_private {
+	mutex_t mutex;
+	cond_t cond;
+	/* epoll or kqueue descriptor, -1 when the poll() or io_uring backend is used */
+	int backend_fd;
+	/* set when the io_uring backend is used */
+	struct io_uring *uring;
+	/* protects the submission queue of uring and uring_waiting */
+	mutex_t uring_mutex;
+	/* set while a worker waits for completions, requests are submitted
+	 * right away then instead of with the next wait */
+	int uring_waiting;
+	/* reaped completions not handled yet, protected by poll_mutex */
+	uint64_t uring_ready[EVENT_LOOP_URING_BATCH];
+	unsigned int uring_ready_count;
+	/* made readable to wake up all workers when the loop is stopped */
+	int wakeup_pipe[2];
+	/* readable while jobs are queued, unused on WIN32 */
+	int job_pipe[2];
+	struct event_loop_job *jobs;
+	struct event_loop_job *jobs_tail;
+	/* serializes the workers of the poll() and io_uring backends */
+	mutex_t poll_mutex;
+	THREAD_T *workers;
+	unsigned int num_workers;
+	int stopping;
+	uint64_t next_id;
+	struct event_loop_entry *entries;
+};
+
+int event_loop_submit(idevice_event_loop_t loop, event_loop_job_func_t func, void *data);
+
+#endif
@@ -24,9 +24,20 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef WIN32
+#include <io.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
 #include "file_relay.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
+#include "common/thread.h"
 
 LIBIMOBILEDEVICE_API file_relay_error_t file_relay_client_new(idevice_t device, lockdownd_service_descriptor_t service, file_relay_client_t *client)
 {
@@ -163,3 +174,586 @@ LIBIMOBILEDEVICE_API file_relay_error_t file_relay_request_sources(file_relay_cl
 {
 	return file_relay_request_sources_timeout(client, sources, connection, 60000);
 }
+
+#ifdef HAVE_ZLIB
+#define CPIO_ODC_HEADER_SIZE 76
+#define CPIO_NEWC_HEADER_SIZE 110
+#define CPIO_MAX_NAME_SIZE 4096
+#define FILE_RELAY_EXTRACT_BUFFER_SIZE 65536
+
+enum cpio_state {
+	CPIO_STATE_MAGIC,
+	CPIO_STATE_HEADER,
+	CPIO_STATE_NAME,
+	CPIO_STATE_NAME_PAD,
+	CPIO_STATE_DATA,
+	CPIO_STATE_DATA_PAD,
+	CPIO_STATE_DONE
+};
+
+struct cpio_parser {
+	enum cpio_state state;
+	int newc;
+	char header[CPIO_NEWC_HEADER_SIZE];
+	uint32_t header_len;
+	char name[CPIO_MAX_NAME_SIZE];
+	uint32_t name_size;
+	uint32_t name_len;
+	uint32_t pad;
+	file_relay_entry_t entry;
+	file_relay_extract_cb_t callback;
+	void *user_data;
+};
+
+static uint64_t cpio_parse_number(const char *str, int len, int base)
+{
+	uint64_t value = 0;
+	int i;
+	for (i = 0; i < len; i++) {
+		char c = str[i];
+		int digit;
+		if (c >= '0' && c <= '9') {
+			digit = c - '0';
+		} else if (base == 16 && c >= 'a' && c <= 'f') {
+			digit = c - 'a' + 10;
+		} else if (base == 16 && c >= 'A' && c <= 'F') {
+			digit = c - 'A' + 10;
+		} else {
+			digit = base;
+		}
+		if (digit >= base) {
+			return (uint64_t)-1;
+		}
+		value = value * base + digit;
+	}
+	return value;
+}
+
+static int cpio_parse_header(struct cpio_parser *cp)
+{
+	uint64_t mode, mtime, namesize, filesize;
+
+	if (cp->newc) {
+		mode = cpio_parse_number(cp->header + 14, 8, 16);
+		mtime = cpio_parse_number(cp->header + 46, 8, 16);
+		filesize = cpio_parse_number(cp->header + 54, 8, 16);
+		namesize = cpio_parse_number(cp->header + 94, 8, 16);
+	} else {
+		mode = cpio_parse_number(cp->header + 18, 6, 8);
+		mtime = cpio_parse_number(cp->header + 48, 11, 8);
+		namesize = cpio_parse_number(cp->header + 59, 6, 8);
+		filesize = cpio_parse_number(cp->header + 65, 11, 8);
+	}
+	if (mode == (uint64_t)-1 || mtime == (uint64_t)-1 || filesize == (uint64_t)-1 || namesize == 0 || namesize > CPIO_MAX_NAME_SIZE) {
+		debug_info("ERROR: invalid cpio header");
+		return -1;
+	}
+
+	memset(&cp->entry, '\0', sizeof(file_relay_entry_t));
+	cp->entry.mode = (uint32_t)mode;
+	cp->entry.mtime = mtime;
+	cp->entry.size = filesize;
+	cp->name_size = (uint32_t)namesize;
+	cp->name_len = 0;
+	/* newc pads header and name to a multiple of 4 */
+	cp->pad = (cp->newc) ? (4 - ((CPIO_NEWC_HEADER_SIZE + cp->name_size) & 3)) & 3 : 0;
+
+	return 0;
+}
+
+/**
+ * Feeds decompressed archive data to the cpio parser.
+ *
+ * @return 0 on success, 1 if the callback stopped the extraction, or -1 if
+ *     the archive is malformed.
+ */
+static int cpio_parser_feed(struct cpio_parser *cp, const char *data, uint32_t length)
+{
+	while (length > 0 && cp->state != CPIO_STATE_DONE) {
+		uint32_t n;
+		switch (cp->state) {
+		case CPIO_STATE_MAGIC:
+		case CPIO_STATE_HEADER:
+			n = ((cp->state == CPIO_STATE_MAGIC) ? 6 : ((cp->newc) ? CPIO_NEWC_HEADER_SIZE : CPIO_ODC_HEADER_SIZE)) - cp->header_len;
+			if (n > length)
+				n = length;
+			memcpy(cp->header + cp->header_len, data, n);
+			cp->header_len += n;
+			data += n;
+			length -= n;
+			if (cp->state == CPIO_STATE_MAGIC) {
+				if (cp->header_len < 6)
+					break;
+				if (!memcmp(cp->header, "070707", 6)) {
+					cp->newc = 0;
+				} else if (!memcmp(cp->header, "070701", 6) || !memcmp(cp->header, "070702", 6)) {
+					cp->newc = 1;
+				} else {
+					debug_info("ERROR: invalid cpio magic");
+					return -1;
+				}
+				cp->state = CPIO_STATE_HEADER;
+			} else if (cp->header_len == ((cp->newc) ? CPIO_NEWC_HEADER_SIZE : CPIO_ODC_HEADER_SIZE)) {
+				if (cpio_parse_header(cp) < 0)
+					return -1;
+				cp->state = CPIO_STATE_NAME;
+			}
+			break;
+		case CPIO_STATE_NAME:
+			n = cp->name_size - cp->name_len;
+			if (n > length)
+				n = length;
+			memcpy(cp->name + cp->name_len, data, n);
+			cp->name_len += n;
+			data += n;
+			length -= n;
+			if (cp->name_len == cp->name_size) {
+				cp->name[cp->name_size - 1] = '\0';
+				cp->entry.path = cp->name;
+				cp->state = CPIO_STATE_NAME_PAD;
+			}
+			break;
+		case CPIO_STATE_NAME_PAD:
+			n = (cp->pad > length) ? length : cp->pad;
+			cp->pad -= n;
+			data += n;
+			length -= n;
+			if (cp->pad > 0)
+				break;
+			if (!strcmp(cp->name, "TRAILER!!!")) {
+				cp->state = CPIO_STATE_DONE;
+				break;
+			}
+			cp->state = CPIO_STATE_DATA;
+			cp->pad = (cp->newc) ? (4 - (cp->entry.size & 3)) & 3 : 0;
+			if (cp->entry.size == 0) {
+				if (cp->callback(&cp->entry, NULL, 0, cp->user_data) != 0)
+					return 1;
+				cp->state = CPIO_STATE_DATA_PAD;
+			}
+			break;
+		case CPIO_STATE_DATA:
+			n = (cp->entry.size - cp->entry.offset > length) ? length : (uint32_t)(cp->entry.size - cp->entry.offset);
+			if (cp->callback(&cp->entry, data, n, cp->user_data) != 0)
+				return 1;
+			cp->entry.offset += n;
+			data += n;
+			length -= n;
+			if (cp->entry.offset == cp->entry.size) {
+				cp->state = CPIO_STATE_DATA_PAD;
+			}
+			break;
+		case CPIO_STATE_DATA_PAD:
+			n = (cp->pad > length) ? length : cp->pad;
+			cp->pad -= n;
+			data += n;
+			length -= n;
+			if (cp->pad == 0) {
+				cp->header_len = 0;
+				cp->state = CPIO_STATE_MAGIC;
+			}
+			break;
+		default:
+			break;
+		}
+	}
+	/* a file without padding ends exactly at the end of the data */
+	if (cp->state == CPIO_STATE_DATA_PAD && cp->pad == 0) {
+		cp->header_len = 0;
+		cp->state = CPIO_STATE_MAGIC;
+	}
+	return 0;
+}
+#endif
+
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_extract(idevice_connection_t connection, file_relay_extract_cb_t callback, void *user_data, unsigned int timeout)
+{
+	if (!connection || !callback) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+#ifdef HAVE_ZLIB
+	file_relay_error_t err = FILE_RELAY_E_SUCCESS;
+	struct cpio_parser *cp = NULL;
+	char *inbuf = NULL;
+	char *outbuf = NULL;
+	z_stream zs;
+	int zres = Z_OK;
+
+	memset(&zs, '\0', sizeof(zs));
+	/* gzip wrapped deflate stream */
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK) {
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	cp = (struct cpio_parser*)calloc(1, sizeof(struct cpio_parser));
+	inbuf = (char*)malloc(FILE_RELAY_EXTRACT_BUFFER_SIZE);
+	outbuf = (char*)malloc(FILE_RELAY_EXTRACT_BUFFER_SIZE);
+	if (!cp || !inbuf || !outbuf) {
+		err = FILE_RELAY_E_UNKNOWN_ERROR;
+		goto leave;
+	}
+	cp->state = CPIO_STATE_MAGIC;
+	cp->callback = callback;
+	cp->user_data = user_data;
+
+	while (zres != Z_STREAM_END) {
+		uint32_t len = 0;
+		idevice_error_t ierr = idevice_connection_receive_timeout(connection, inbuf, FILE_RELAY_EXTRACT_BUFFER_SIZE, &len, timeout);
+		if (len == 0) {
+			debug_info("ERROR: connection ended before the end of the archive (%d)", ierr);
+			err = FILE_RELAY_E_MUX_ERROR;
+			break;
+		}
+
+		zs.next_in = (Bytef*)inbuf;
+		zs.avail_in = len;
+		while (zs.avail_in > 0 && zres != Z_STREAM_END) {
+			zs.next_out = (Bytef*)outbuf;
+			zs.avail_out = FILE_RELAY_EXTRACT_BUFFER_SIZE;
+			zres = inflate(&zs, Z_NO_FLUSH);
+			if (zres != Z_OK && zres != Z_STREAM_END) {
+				debug_info("ERROR: inflate failed (%d)", zres);
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				goto leave;
+			}
+			int res = cpio_parser_feed(cp, outbuf, FILE_RELAY_EXTRACT_BUFFER_SIZE - zs.avail_out);
+			if (res < 0) {
+				err = FILE_RELAY_E_ARCHIVE_ERROR;
+				goto leave;
+			}
+			if (res > 0) {
+				debug_info("extraction stopped by callback");
+				goto leave;
+			}
+		}
+	}
+
+	if (err == FILE_RELAY_E_SUCCESS && cp->state != CPIO_STATE_DONE) {
+		debug_info("ERROR: archive ended without trailer");
+		err = FILE_RELAY_E_ARCHIVE_ERROR;
+	}
+
+leave:
+	inflateEnd(&zs);
+	free(cp);
+	free(inbuf);
+	free(outbuf);
+
+	return err;
+#else
+	debug_info("ERROR: built without zlib support");
+	return FILE_RELAY_E_UNKNOWN_ERROR;
+#endif
+}
+
+#define CPIO_MODE_TYPE_MASK 0170000
+#define CPIO_MODE_DIR       0040000
+#define CPIO_MODE_REG       0100000
+
+#define FILE_RELAY_DEFAULT_CONNECTIONS 4
+
+struct file_relay_extract_dir {
+	const char *path;
+	FILE *f;
+	int failed;
+	/* files already written by other streams into the same directory */
+	mutex_t *claim_mutex;
+	plist_t claimed;
+};
+
+static int file_relay_mkdir_with_parents(const char *dir, int mode)
+{
+	char *path = strdup(dir);
+	char *p = path;
+	int res = 0;
+
+	if (!path)
+		return -1;
+
+	/* create each parent in turn, existing ones are fine */
+	do {
+		p = strchr(p + 1, '/');
+		if (p)
+			*p = '\0';
+#ifdef WIN32
+		if (mkdir(path) < 0 && errno != EEXIST) {
+#else
+		if (mkdir(path, mode) < 0 && errno != EEXIST) {
+#endif
+			res = -1;
+		}
+		if (p)
+			*p = '/';
+	} while (p);
+	free(path);
+
+	return res;
+}
+
+/* skips leading slashes and rejects paths that leave the target directory */
+static const char *file_relay_sanitize_path(const char *path)
+{
+	const char *p;
+
+	while (*path == '/' || (path[0] == '.' && path[1] == '/')) {
+		path += (*path == '/') ? 1 : 2;
+	}
+	for (p = path; *p; ) {
+		if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == '\0')) {
+			return NULL;
+		}
+		p = strchr(p, '/');
+		if (!p)
+			break;
+		p++;
+	}
+	return (*path && strcmp(path, ".")) ? path : NULL;
+}
+
+static int file_relay_extract_to_directory_cb(const file_relay_entry_t *entry, const char *data, uint32_t length, void *user_data)
+{
+	struct file_relay_extract_dir *ed = (struct file_relay_extract_dir*)user_data;
+
+	if (entry->offset == 0) {
+		const char *relpath = file_relay_sanitize_path(entry->path);
+		uint32_t type = entry->mode & CPIO_MODE_TYPE_MASK;
+		if (!relpath || (type != CPIO_MODE_DIR && type != CPIO_MODE_REG)) {
+			/* this also skips symlinks and device nodes */
+			debug_info("skipping %s", entry->path);
+			return 0;
+		}
+		char *fullpath = string_build_path(ed->path, relpath, NULL);
+		if (type == CPIO_MODE_DIR) {
+			file_relay_mkdir_with_parents(fullpath, 0755);
+			free(fullpath);
+			return 0;
+		}
+		if (ed->claimed) {
+			int taken = 0;
+			mutex_lock(ed->claim_mutex);
+			if (plist_dict_get_item(ed->claimed, relpath)) {
+				taken = 1;
+			} else {
+				plist_dict_set_item(ed->claimed, relpath, plist_new_bool(1));
+			}
+			mutex_unlock(ed->claim_mutex);
+			if (taken) {
+				debug_info("skipping %s, already extracted from another source", entry->path);
+				free(fullpath);
+				return 0;
+			}
+		}
+		char *sep = strrchr(fullpath, '/');
+		if (sep) {
+			*sep = '\0';
+			file_relay_mkdir_with_parents(fullpath, 0755);
+			*sep = '/';
+		}
+		ed->f = fopen(fullpath, "wb");
+		if (!ed->f) {
+			debug_info("ERROR: could not create %s: %s", fullpath, strerror(errno));
+			free(fullpath);
+			ed->failed = 1;
+			return 1;
+		}
+		free(fullpath);
+	}
+
+	if (!ed->f) {
+		return 0;
+	}
+	if (length > 0 && fwrite(data, 1, length, ed->f) != length) {
+		debug_info("ERROR: could not write %s: %s", entry->path, strerror(errno));
+		fclose(ed->f);
+		ed->f = NULL;
+		ed->failed = 1;
+		return 1;
+	}
+	if (entry->offset + length == entry->size) {
+		fclose(ed->f);
+		ed->f = NULL;
+	}
+	return 0;
+}
+
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_extract_to_directory(idevice_connection_t connection, const char *path, unsigned int timeout)
+{
+	struct file_relay_extract_dir ed;
+	file_relay_error_t err;
+
+	if (!connection || !path) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	ed.path = path;
+	ed.f = NULL;
+	ed.failed = 0;
+	ed.claim_mutex = NULL;
+	ed.claimed = NULL;
+
+	if (file_relay_mkdir_with_parents(path, 0755) < 0) {
+		debug_info("ERROR: could not create directory %s", path);
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	err = file_relay_extract(connection, file_relay_extract_to_directory_cb, &ed, timeout);
+	if (ed.f) {
+		fclose(ed.f);
+	}
+	if (err == FILE_RELAY_E_SUCCESS && ed.failed) {
+		err = FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	return err;
+}
+
+struct file_relay_collect {
+	idevice_t device;
+	const char **sources;
+	unsigned int count;
+	unsigned int next;
+	unsigned int active;
+	const char *path;
+	unsigned int timeout;
+	mutex_t mutex;
+	plist_t claimed;
+	file_relay_error_t err;
+};
+
+static void* file_relay_collect_worker(void *data)
+{
+	struct file_relay_collect *fc = (struct file_relay_collect*)data;
+
+	while (1) {
+		file_relay_client_t client = NULL;
+		file_relay_error_t err = file_relay_client_start_service(fc->device, &client, "file_relay");
+
+		mutex_lock(&fc->mutex);
+		if (fc->next >= fc->count) {
+			fc->active--;
+			mutex_unlock(&fc->mutex);
+			if (client)
+				file_relay_client_free(client);
+			break;
+		}
+		if (err != FILE_RELAY_E_SUCCESS) {
+			/* the device limits concurrent connections, leave the rest to the other workers */
+			if (fc->active == 1) {
+				debug_info("ERROR: could not connect to file_relay (%d)", err);
+				fc->err = err;
+			}
+			fc->active--;
+			mutex_unlock(&fc->mutex);
+			break;
+		}
+		unsigned int idx = fc->next++;
+		mutex_unlock(&fc->mutex);
+
+		const char *sources[2] = { fc->sources[idx], NULL };
+		idevice_connection_t connection = NULL;
+
+		debug_info("collecting %s", sources[0]);
+		err = file_relay_request_sources_timeout(client, sources, &connection, fc->timeout);
+		if (err == FILE_RELAY_E_SUCCESS) {
+			struct file_relay_extract_dir ed;
+			ed.path = fc->path;
+			ed.f = NULL;
+			ed.failed = 0;
+			ed.claim_mutex = &fc->mutex;
+			ed.claimed = fc->claimed;
+			err = file_relay_extract(connection, file_relay_extract_to_directory_cb, &ed, fc->timeout);
+			if (ed.f) {
+				fclose(ed.f);
+			}
+			if (err == FILE_RELAY_E_SUCCESS && ed.failed) {
+				err = FILE_RELAY_E_UNKNOWN_ERROR;
+			}
+		} else if (err == FILE_RELAY_E_STAGING_EMPTY) {
+			/* nothing to collect for this source */
+			err = FILE_RELAY_E_SUCCESS;
+		}
+		file_relay_client_free(client);
+
+		if (err != FILE_RELAY_E_SUCCESS) {
+			debug_info("ERROR: collecting %s failed (%d)", sources[0], err);
+			mutex_lock(&fc->mutex);
+			if (fc->err == FILE_RELAY_E_SUCCESS) {
+				fc->err = err;
+			}
+			mutex_unlock(&fc->mutex);
+		}
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API file_relay_error_t file_relay_extract_sources_to_directory(idevice_t device, const char **sources, const char *path, unsigned int max_connections, unsigned int timeout)
+{
+	struct file_relay_collect fc;
+	THREAD_T *threads = NULL;
+	unsigned int num_threads = 0;
+	unsigned int i;
+
+	if (!device || !sources || !sources[0] || !path) {
+		return FILE_RELAY_E_INVALID_ARG;
+	}
+
+	memset(&fc, '\0', sizeof(fc));
+	fc.device = device;
+	fc.sources = sources;
+	while (sources[fc.count]) {
+		fc.count++;
+	}
+	fc.path = path;
+	fc.timeout = timeout;
+	fc.err = FILE_RELAY_E_SUCCESS;
+
+	if (max_connections == 0) {
+		max_connections = FILE_RELAY_DEFAULT_CONNECTIONS;
+	}
+	if (max_connections > fc.count) {
+		max_connections = fc.count;
+	}
+
+	if (file_relay_mkdir_with_parents(path, 0755) < 0) {
+		debug_info("ERROR: could not create directory %s", path);
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	threads = (THREAD_T*)calloc(max_connections, sizeof(THREAD_T));
+	if (!threads) {
+		return FILE_RELAY_E_UNKNOWN_ERROR;
+	}
+	mutex_init(&fc.mutex);
+	fc.claimed = plist_new_dict();
+
+	/* set before any worker runs so an early failure is not mistaken for the last worker */
+	fc.active = max_connections;
+	for (i = 0; i < max_connections; i++) {
+		if (thread_new(&threads[num_threads], file_relay_collect_worker, &fc) != 0) {
+			debug_info("ERROR: could not start file_relay worker thread");
+			mutex_lock(&fc.mutex);
+			fc.active -= max_connections - i;
+			mutex_unlock(&fc.mutex);
+			break;
+		}
+		num_threads++;
+	}
+	if (num_threads == 0) {
+		/* collect on this thread instead */
+		fc.active = 1;
+		file_relay_collect_worker(&fc);
+	}
+
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+
+	plist_free(fc.claimed);
+	mutex_destroy(&fc.mutex);
+	free(threads);
+
+	return fc.err;
+}
@@ -29,6 +29,8 @@
 #include "heartbeat.h"
 #include "lockdown.h"
 #include "common/debug.h"
+#include "common/thread.h"
+#include "common/utils.h"
 
 /**
  * Convert a property_list_service_error_t value to a heartbeat_error_t value.
@@ -145,3 +147,276 @@ LIBIMOBILEDEVICE_API heartbeat_error_t heartbeat_receive_with_timeout(heartbeat_
 
 	return res;
 }
+
+/*
+ * Built-in heartbeat responder. All network devices created with
+ * IDEVICE_HEARTBEAT share a single thread that drives a timer wheel. Every
+ * device is checked for pending Marco requests at half the interval the
+ * device announced, and answered with Polo.
+ */
+
+struct heartbeat_entry {
+	idevice_t device;
+	heartbeat_client_t client;
+	/* interval announced by the device in milliseconds */
+	uint32_t interval;
+	/* delay until the next check, -1 to stop checking */
+	int64_t delay;
+	unsigned int slot;
+	unsigned int rounds;
+	int scheduled;
+	int busy;
+	/* next entry in the same wheel slot or in the due list */
+	struct heartbeat_entry *next;
+	/* list of all registered entries */
+	struct heartbeat_entry *next_entry;
+};
+
+static struct {
+	mutex_t mutex;
+	cond_t cond;
+	/* signalled when an entry is no longer busy */
+	cond_t idle_cond;
+	THREAD_T thread;
+	int running;
+	/* a thread exits once the generation it was started with is over */
+	uintptr_t generation;
+	unsigned int current;
+	struct heartbeat_entry *entries;
+	struct heartbeat_entry *slots[HEARTBEAT_WHEEL_SLOTS];
+} responder;
+
+static thread_once_t responder_once = THREAD_ONCE_INIT;
+
+static void heartbeat_responder_init(void)
+{
+	mutex_init(&responder.mutex);
+	cond_init(&responder.cond);
+	cond_init(&responder.idle_cond);
+}
+
+/* must be called with the responder mutex held */
+static void heartbeat_responder_schedule(struct heartbeat_entry *entry, uint32_t delay)
+{
+	unsigned int ticks = (delay + HEARTBEAT_WHEEL_TICK - 1) / HEARTBEAT_WHEEL_TICK;
+	if (ticks == 0)
+		ticks = 1;
+	entry->slot = (responder.current + ticks) % HEARTBEAT_WHEEL_SLOTS;
+	entry->rounds = (ticks - 1) / HEARTBEAT_WHEEL_SLOTS;
+	entry->next = responder.slots[entry->slot];
+	responder.slots[entry->slot] = entry;
+	entry->scheduled = 1;
+}
+
+/* must be called with the responder mutex held */
+static void heartbeat_responder_unschedule(struct heartbeat_entry *entry)
+{
+	if (!entry->scheduled)
+		return;
+	struct heartbeat_entry **pp = &responder.slots[entry->slot];
+	while (*pp) {
+		if (*pp == entry) {
+			*pp = entry->next;
+			break;
+		}
+		pp = &(*pp)->next;
+	}
+	entry->next = NULL;
+	entry->scheduled = 0;
+}
+
+/**
+ * Answers all pending heartbeat requests of a device.
+ *
+ * @return The delay in milliseconds until the device should be checked
+ *     again, or -1 if the device went to sleep.
+ */
+static int64_t heartbeat_responder_service(struct heartbeat_entry *entry)
+{
+	if (!entry->client) {
+		if (heartbeat_client_start_service(entry->device, &entry->client, "libimobiledevice") != HEARTBEAT_E_SUCCESS) {
+			debug_info("could not start heartbeat service for %s", entry->device->udid);
+			entry->client = NULL;
+			return HEARTBEAT_DEFAULT_INTERVAL;
+		}
+	}
+
+	while (property_list_service_wait_readable(entry->client->parent, 1) == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		plist_t message = NULL;
+		if (heartbeat_receive_with_timeout(entry->client, &message, 1000) != HEARTBEAT_E_SUCCESS) {
+			/* connect again on the next tick */
+			heartbeat_client_free(entry->client);
+			entry->client = NULL;
+			return HEARTBEAT_DEFAULT_INTERVAL;
+		}
+
+		const char *command = plist_get_string_ptr(plist_dict_get_item(message, "Command"), NULL);
+		if (command && !strcmp(command, "Marco")) {
+			uint64_t interval = 0;
+			plist_t node = plist_dict_get_item(message, "Interval");
+			if (node && plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &interval);
+			}
+			if (interval > 0) {
+				entry->interval = (uint32_t)interval * 1000;
+			}
+			plist_t reply = plist_new_dict();
+			plist_dict_set_item(reply, "Command", plist_new_string("Polo"));
+			heartbeat_error_t err = heartbeat_send(entry->client, reply);
+			plist_free(reply);
+			if (err != HEARTBEAT_E_SUCCESS) {
+				plist_free(message);
+				heartbeat_client_free(entry->client);
+				entry->client = NULL;
+				return HEARTBEAT_DEFAULT_INTERVAL;
+			}
+		} else if (command && !strcmp(command, "SleepyTime")) {
+			debug_info("%s is going to sleep, stopping heartbeat", entry->device->udid);
+			plist_free(message);
+			return -1;
+		}
+		plist_free(message);
+	}
+
+	return entry->interval / 2;
+}
+
+static void* heartbeat_responder_thread(void *arg)
+{
+	uintptr_t generation = (uintptr_t)arg;
+	uint64_t next_tick = time_monotonic_usec();
+
+	mutex_lock(&responder.mutex);
+	while (responder.generation == generation) {
+		uint64_t now = time_monotonic_usec();
+		if (now < next_tick) {
+			cond_wait_timeout(&responder.cond, &responder.mutex, (unsigned int)((next_tick - now + 999) / 1000));
+			continue;
+		}
+		next_tick += HEARTBEAT_WHEEL_TICK * 1000;
+		responder.current = (responder.current + 1) % HEARTBEAT_WHEEL_SLOTS;
+
+		/* take the due entries out of the wheel */
+		struct heartbeat_entry *due = NULL;
+		struct heartbeat_entry **pp = &responder.slots[responder.current];
+		while (*pp) {
+			struct heartbeat_entry *entry = *pp;
+			if (entry->rounds > 0) {
+				entry->rounds--;
+				pp = &entry->next;
+				continue;
+			}
+			*pp = entry->next;
+			entry->next = due;
+			entry->scheduled = 0;
+			entry->busy = 1;
+			due = entry;
+		}
+		if (!due)
+			continue;
+		mutex_unlock(&responder.mutex);
+
+		struct heartbeat_entry *entry;
+		struct heartbeat_entry *next;
+		for (entry = due; entry; entry = entry->next) {
+			entry->delay = heartbeat_responder_service(entry);
+		}
+
+		mutex_lock(&responder.mutex);
+		for (entry = due; entry; entry = next) {
+			next = entry->next;
+			entry->busy = 0;
+			entry->next = NULL;
+			if (entry->delay >= 0) {
+				heartbeat_responder_schedule(entry, (uint32_t)entry->delay);
+			}
+		}
+		cond_broadcast(&responder.idle_cond);
+	}
+	mutex_unlock(&responder.mutex);
+
+	return NULL;
+}
+
+/**
+ * Registers a device with the heartbeat responder. The heartbeat service
+ * is started by the responder thread, so this does not block.
+ *
+ * @return 0 on success, -1 on error.
+ */
+int heartbeat_responder_add(idevice_t device)
+{
+	struct heartbeat_entry *entry = (struct heartbeat_entry*)calloc(1, sizeof(struct heartbeat_entry));
+	if (!entry)
+		return -1;
+	entry->device = device;
+	entry->interval = HEARTBEAT_DEFAULT_INTERVAL;
+
+	thread_once(&responder_once, heartbeat_responder_init);
+
+	mutex_lock(&responder.mutex);
+	if (!responder.running) {
+		responder.generation++;
+		if (thread_new(&responder.thread, heartbeat_responder_thread, (void*)responder.generation) != 0) {
+			mutex_unlock(&responder.mutex);
+			free(entry);
+			return -1;
+		}
+		responder.running = 1;
+	}
+	entry->next_entry = responder.entries;
+	responder.entries = entry;
+	heartbeat_responder_schedule(entry, 0);
+	mutex_unlock(&responder.mutex);
+
+	return 0;
+}
+
+/**
+ * Unregisters a device from the heartbeat responder and closes its
+ * heartbeat connection. The responder thread exits with the last device.
+ */
+void heartbeat_responder_remove(idevice_t device)
+{
+	struct heartbeat_entry *entry = NULL;
+	struct heartbeat_entry **pp;
+
+	thread_once(&responder_once, heartbeat_responder_init);
+
+	mutex_lock(&responder.mutex);
+	for (pp = &responder.entries; *pp; pp = &(*pp)->next_entry) {
+		if ((*pp)->device == device) {
+			entry = *pp;
+			*pp = entry->next_entry;
+			break;
+		}
+	}
+	if (!entry) {
+		mutex_unlock(&responder.mutex);
+		return;
+	}
+	/* wait until the responder thread is done with the entry */
+	while (entry->busy) {
+		cond_wait(&responder.idle_cond, &responder.mutex);
+	}
+	heartbeat_responder_unschedule(entry);
+
+	THREAD_T thread = responder.thread;
+	int stop_thread = (responder.entries == NULL);
+	if (stop_thread) {
+		responder.generation++;
+		responder.running = 0;
+		cond_broadcast(&responder.cond);
+	}
+	mutex_unlock(&responder.mutex);
+
+	if (entry->client) {
+		heartbeat_client_free(entry->client);
+	}
+	free(entry);
+
+	if (stop_thread) {
+		thread_join(thread);
+		thread_free(thread);
+	}
+}
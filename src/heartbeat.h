@@ -24,9 +24,20 @@
 
 #include "libimobiledevice/heartbeat.h"
 #include "property_list_service.h"
+#include "idevice.h"
+
+/* resolution and size of the timer wheel of the heartbeat responder */
+#define HEARTBEAT_WHEEL_TICK 250
+#define HEARTBEAT_WHEEL_SLOTS 64
+
+/* interval assumed until the device announced one, in milliseconds */
+#define HEARTBEAT_DEFAULT_INTERVAL 10000
 
 struct heartbeat_client_private {
 	property_list_service_client_t parent;
 };
 
+int heartbeat_responder_add(idevice_t device);
+void heartbeat_responder_remove(idevice_t device);
+
 #endif
@@ -160,3 +160,203 @@ LIBIMOBILEDEVICE_API afc_error_t afc_client_new_from_house_arrest_client(house_a
 	}
 	return err;
 }
+
+/**
+ * Internally used function that opens a house_arrest connection, vends the
+ * container of appid and turns the connection into an AFC client.
+ */
+static house_arrest_error_t house_arrest_vend(idevice_t device, const char *label, const char *command, const char *appid, house_arrest_client_t *client, afc_client_t *afc)
+{
+	house_arrest_client_t ha = NULL;
+	plist_t dict = NULL;
+
+	house_arrest_error_t res = house_arrest_client_start_service(device, &ha, label);
+	if (res != HOUSE_ARREST_E_SUCCESS) {
+		debug_info("could not start house_arrest service, error %d", res);
+		return res;
+	}
+
+	res = house_arrest_send_command(ha, command, appid);
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		res = house_arrest_get_result(ha, &dict);
+	}
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		plist_t node = plist_dict_get_item(dict, "Error");
+		if (node) {
+			char *str = NULL;
+			plist_get_string_val(node, &str);
+			debug_info("%s for %s failed: %s", command, appid, (str) ? str : "(unknown)");
+			free(str);
+			res = HOUSE_ARREST_E_COMMAND_FAILED;
+		}
+		plist_free(dict);
+	}
+	if (res == HOUSE_ARREST_E_SUCCESS && afc_client_new_from_house_arrest_client(ha, afc) != AFC_E_SUCCESS) {
+		res = HOUSE_ARREST_E_CONN_FAILED;
+	}
+
+	if (res != HOUSE_ARREST_E_SUCCESS) {
+		house_arrest_client_free(ha);
+		return res;
+	}
+
+	*client = ha;
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+static void house_arrest_container_entry_free(struct house_arrest_container_entry *entry)
+{
+	afc_client_free(entry->afc);
+	house_arrest_client_free(entry->client);
+	free(entry->appid);
+	free(entry->command);
+	free(entry);
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_container_cache_new(idevice_t device, unsigned int max_sessions, const char *label, house_arrest_container_cache_t *cache)
+{
+	if (!device || !cache)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	house_arrest_container_cache_t cache_loc = (house_arrest_container_cache_t)calloc(1, sizeof(struct house_arrest_container_cache_private));
+	if (!cache_loc)
+		return HOUSE_ARREST_E_UNKNOWN_ERROR;
+
+	cache_loc->device = device;
+	cache_loc->label = (label) ? strdup(label) : NULL;
+	cache_loc->max_sessions = (max_sessions > 0) ? max_sessions : HOUSE_ARREST_CONTAINER_CACHE_DEFAULT_SIZE;
+	mutex_init(&cache_loc->mutex);
+
+	*cache = cache_loc;
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_container_cache_free(house_arrest_container_cache_t cache)
+{
+	if (!cache)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	struct house_arrest_container_entry *entry = cache->entries;
+	while (entry) {
+		struct house_arrest_container_entry *next = entry->next;
+		house_arrest_container_entry_free(entry);
+		entry = next;
+	}
+	mutex_destroy(&cache->mutex);
+	free(cache->label);
+	free(cache);
+
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+/**
+ * Internally used function that closes the least recently used sessions that
+ * are not in use until at most keep sessions are left. Must be called with
+ * the cache locked.
+ */
+static void house_arrest_container_cache_evict(house_arrest_container_cache_t cache, unsigned int keep)
+{
+	while (cache->num_sessions > keep) {
+		struct house_arrest_container_entry **lru = NULL;
+		struct house_arrest_container_entry **pp;
+		for (pp = &cache->entries; *pp; pp = &(*pp)->next) {
+			if ((*pp)->refs == 0 && (!lru || (*pp)->last_used < (*lru)->last_used)) {
+				lru = pp;
+			}
+		}
+		if (!lru) {
+			/* all sessions are in use */
+			return;
+		}
+		struct house_arrest_container_entry *entry = *lru;
+		*lru = entry->next;
+		cache->num_sessions--;
+		debug_info("closing container session of %s", entry->appid);
+		house_arrest_container_entry_free(entry);
+	}
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_container_cache_get(house_arrest_container_cache_t cache, const char *command, const char *appid, afc_client_t *afc)
+{
+	if (!cache || !command || !appid || !afc)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	struct house_arrest_container_entry *entry;
+
+	mutex_lock(&cache->mutex);
+	for (entry = cache->entries; entry; entry = entry->next) {
+		if (!entry->discarded && !strcmp(entry->appid, appid) && !strcmp(entry->command, command)) {
+			entry->refs++;
+			entry->last_used = ++cache->tick;
+			*afc = entry->afc;
+			mutex_unlock(&cache->mutex);
+			return HOUSE_ARREST_E_SUCCESS;
+		}
+	}
+	mutex_unlock(&cache->mutex);
+
+	/* the service start takes a while, don't block other users meanwhile */
+	house_arrest_client_t client = NULL;
+	afc_client_t afc_loc = NULL;
+	house_arrest_error_t res = house_arrest_vend(cache->device, cache->label, command, appid, &client, &afc_loc);
+	if (res != HOUSE_ARREST_E_SUCCESS) {
+		return res;
+	}
+
+	entry = (struct house_arrest_container_entry*)calloc(1, sizeof(struct house_arrest_container_entry));
+	if (!entry) {
+		afc_client_free(afc_loc);
+		house_arrest_client_free(client);
+		return HOUSE_ARREST_E_UNKNOWN_ERROR;
+	}
+	entry->appid = strdup(appid);
+	entry->command = strdup(command);
+	entry->client = client;
+	entry->afc = afc_loc;
+	entry->refs = 1;
+
+	mutex_lock(&cache->mutex);
+	house_arrest_container_cache_evict(cache, cache->max_sessions - 1);
+	entry->last_used = ++cache->tick;
+	entry->next = cache->entries;
+	cache->entries = entry;
+	cache->num_sessions++;
+	mutex_unlock(&cache->mutex);
+
+	*afc = afc_loc;
+	return HOUSE_ARREST_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API house_arrest_error_t house_arrest_container_cache_release(house_arrest_container_cache_t cache, afc_client_t afc, int discard)
+{
+	if (!cache || !afc)
+		return HOUSE_ARREST_E_INVALID_ARG;
+
+	house_arrest_error_t res = HOUSE_ARREST_E_INVALID_ARG;
+	struct house_arrest_container_entry **pp;
+
+	mutex_lock(&cache->mutex);
+	for (pp = &cache->entries; *pp; pp = &(*pp)->next) {
+		struct house_arrest_container_entry *entry = *pp;
+		if (entry->afc != afc)
+			continue;
+		if (entry->refs > 0)
+			entry->refs--;
+		if (discard)
+			entry->discarded = 1;
+		if (entry->discarded && entry->refs == 0) {
+			*pp = entry->next;
+			cache->num_sessions--;
+			house_arrest_container_entry_free(entry);
+		}
+		res = HOUSE_ARREST_E_SUCCESS;
+		break;
+	}
+	if (res == HOUSE_ARREST_E_SUCCESS) {
+		/* sessions kept open while in use can be closed now */
+		house_arrest_container_cache_evict(cache, cache->max_sessions);
+	}
+	mutex_unlock(&cache->mutex);
+
+	return res;
+}
@@ -24,6 +24,7 @@
 
 #include "libimobiledevice/house_arrest.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 enum house_arrest_client_mode {
 	HOUSE_ARREST_CLIENT_MODE_NORMAL = 0,
@@ -35,4 +36,28 @@ struct house_arrest_client_private {
 	enum house_arrest_client_mode mode;
 };
 
+struct house_arrest_container_entry {
+	char *appid;
+	char *command;
+	house_arrest_client_t client;
+	afc_client_t afc;
+	/* number of users that got the AFC client and did not release it yet */
+	unsigned int refs;
+	/* set when a user reported the connection as broken */
+	int discarded;
+	/* cache tick of the last use, for the LRU eviction */
+	uint64_t last_used;
+	struct house_arrest_container_entry *next;
+};
+
+struct house_arrest_container_cache_private {
+	idevice_t device;
+	char *label;
+	unsigned int max_sessions;
+	unsigned int num_sessions;
+	uint64_t tick;
+	mutex_t mutex;
+	struct house_arrest_container_entry *entries;
+};
+
 #endif
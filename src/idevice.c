@@ -29,6 +29,20 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <inttypes.h>
+#ifndef WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#ifndef _MSC_VER
+#include <unistd.h>
+#endif
 
 #include <usbmuxd.h>
 #ifdef HAVE_OPENSSL
@@ -40,10 +54,17 @@
 #endif
 
 #include "idevice.h"
+#include "event_loop.h"
+#include "lockdown.h"
+#include "heartbeat.h"
+#include "service.h"
+#include "replay.h"
+#include "trace.h"
 #include "common/userpref.h"
 #include "common/socket.h"
 #include "common/thread.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 #ifdef WIN32
 #include <windows.h>
@@ -60,6 +81,11 @@
 #define TLS_method TLSv1_method
 #endif
 
+/* OpenSSL 3 can hand the record layer to the Linux kernel (kTLS) */
+#if defined(__linux__) && defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send)
+#define IDEVICE_KTLS 1
+#endif
+
 #if OPENSSL_VERSION_NUMBER < 0x10002000L || defined(LIBRESSL_VERSION_NUMBER)
 static void SSL_COMP_free_compression_methods(void)
 {
@@ -104,8 +130,35 @@ static void id_function(CRYPTO_THREADID *thread)
 #endif
 #endif /* HAVE_OPENSSL */
 
-static void internal_idevice_init(void)
+static mutex_t ssl_ctx_cache_mutex;
+static struct ssl_ctx_cache_entry *ssl_ctx_cache = NULL;
+static int ssl_session_resumption = 0;
+static void ssl_ctx_cache_invalidate(const char *udid);
+
+static int stats_enabled = 0;
+#ifdef IDEVICE_KTLS
+static int ktls_disabled = 0;
+#endif
+
+static rwlock_t device_cache_lock;
+static mutex_t event_mutex;
+static cond_t event_cond;
+
+/* see idevice_set_receive_memory_budget() */
+static mutex_t recv_budget_mutex;
+static cond_t recv_budget_cond;
+static idevice_memory_stats_t recv_budget;
+/* the first waiting receive, later ones have to leave room for it */
+static int recv_budget_head = 0;
+static uint64_t recv_budget_head_size = 0;
+
+/* the SSL library is set up on first use, most tools never need it */
+static thread_once_t ssl_init_once = THREAD_ONCE_INIT;
+static int ssl_initialized = 0;
+
+static void internal_ssl_init(void)
 {
+	ssl_initialized = 1;
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 	int i;
@@ -129,8 +182,47 @@ static void internal_idevice_init(void)
 #endif
 }
 
+/**
+ * Initializes the SSL library if that did not happen yet. Called before
+ * the first SSL handshake and before keys or certificates are generated.
+ */
+void idevice_ssl_init(void)
+{
+	thread_once(&ssl_init_once, internal_ssl_init);
+}
+
+static void internal_idevice_init(void)
+{
+	stats_enabled = (getenv("IMOBILEDEVICE_STATS") != NULL);
+#ifdef IDEVICE_KTLS
+	ktls_disabled = (getenv("IMOBILEDEVICE_NO_KTLS") != NULL);
+#endif
+	mutex_init(&ssl_ctx_cache_mutex);
+	rwlock_init(&device_cache_lock);
+	mutex_init(&event_mutex);
+	cond_init(&event_cond);
+	mutex_init(&recv_budget_mutex);
+	cond_init(&recv_budget_cond);
+	userpref_set_pair_record_changed_cb(ssl_ctx_cache_invalidate);
+	userpref_set_crypto_init_cb(idevice_ssl_init);
+	replay_init();
+	trace_init();
+}
+
 static void internal_idevice_deinit(void)
 {
+	if (stats_enabled && recv_budget.reservations > 0) {
+		fprintf(stderr, "[stats] receive memory: peak %" PRIu64 " bytes over %" PRIu64 " messages, %" PRIu64 " throttled for %" PRIu64 " us, %" PRIu64 " rejected\n",
+			recv_budget.peak, recv_budget.reservations, recv_budget.throttled, recv_budget.wait_usec, recv_budget.rejected);
+	}
+	trace_deinit();
+	replay_deinit();
+	userpref_set_pair_record_changed_cb(NULL);
+	userpref_set_crypto_init_cb(NULL);
+	ssl_ctx_cache_invalidate(NULL);
+	mutex_destroy(&ssl_ctx_cache_mutex);
+	if (!ssl_initialized)
+		return;
 #ifdef HAVE_OPENSSL
 #if OPENSSL_VERSION_NUMBER < 0x10100000L || defined(LIBRESSL_VERSION_NUMBER)
 	int i;
@@ -187,11 +279,85 @@ static void __attribute__((destructor)) libimobiledevice_deinitialize(void)
 }
 #endif
 
-static idevice_event_cb_t event_cb = NULL;
+struct idevice_subscription_context {
+	idevice_event_cb_t callback;
+	void *user_data;
+	int removed;
+	/* number of subscriber lists that reference this context */
+	unsigned int refs;
+};
+
+/* immutable list of subscribers, replaced on every (un)subscribe so events
+ * can be dispatched without holding event_mutex */
+struct event_subscribers {
+	unsigned int refcount;
+	unsigned int count;
+	idevice_subscription_context_t contexts[];
+};
+
+static struct event_subscribers *event_subscribers = NULL;
+static usbmuxd_subscription_context_t event_usbmux_context = NULL;
+static int event_usbmux_subscribed = 0;
+/* set while the usbmuxd subscription is being set up */
+static int event_usbmux_pending = 0;
+static int event_dispatching = 0;
+static unsigned long event_dispatch_thread = 0;
+static idevice_subscription_context_t event_legacy_context = NULL;
+
+/* must be called with event_mutex held */
+static void event_subscribers_release(struct event_subscribers *subscribers)
+{
+	unsigned int i;
+	if (!subscribers || --subscribers->refcount > 0)
+		return;
+	for (i = 0; i < subscribers->count; i++) {
+		idevice_subscription_context_t context = subscribers->contexts[i];
+		if (--context->refs == 0 && context->removed) {
+			free(context);
+		}
+	}
+	free(subscribers);
+}
+
+/**
+ * Replaces the subscriber list with a copy that has context added, or
+ * removed if remove is set. Must be called with event_mutex held.
+ *
+ * @return The number of subscribers left, or -1 if out of memory.
+ */
+static int event_subscribers_update(idevice_subscription_context_t context, int remove)
+{
+	struct event_subscribers *old = event_subscribers;
+	unsigned int old_count = (old) ? old->count : 0;
+	unsigned int i;
+	struct event_subscribers *subscribers = (struct event_subscribers*)malloc(sizeof(struct event_subscribers) + sizeof(idevice_subscription_context_t) * (old_count + 1));
+	if (!subscribers) {
+		return -1;
+	}
+	subscribers->refcount = 1;
+	subscribers->count = 0;
+	for (i = 0; i < old_count; i++) {
+		/* also drops contexts a failed update had to leave behind */
+		if (old->contexts[i] != context && !old->contexts[i]->removed) {
+			subscribers->contexts[subscribers->count++] = old->contexts[i];
+		}
+	}
+	if (!remove) {
+		subscribers->contexts[subscribers->count++] = context;
+	}
+	for (i = 0; i < subscribers->count; i++) {
+		subscribers->contexts[i]->refs++;
+	}
+	event_subscribers = subscribers;
+	event_subscribers_release(old);
+	return (int)subscribers->count;
+}
 
 static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 {
 	idevice_event_t ev;
+	struct event_subscribers *subscribers;
+	unsigned int i;
 
 	ev.event = event->event;
 	ev.udid = event->device.udid;
@@ -204,34 +370,403 @@ static void usbmux_event_cb(const usbmuxd_event_t *event, void *user_data)
 		debug_info("Unknown connection type %d", event->device.conn_type);
 	}
 
-	if (event_cb) {
-		event_cb(&ev, user_data);
+	mutex_lock(&event_mutex);
+	subscribers = event_subscribers;
+	if (subscribers) {
+		subscribers->refcount++;
+	}
+	event_dispatching = 1;
+	event_dispatch_thread = (unsigned long)THREAD_ID;
+	mutex_unlock(&event_mutex);
+
+	if (subscribers) {
+		for (i = 0; i < subscribers->count; i++) {
+			idevice_subscription_context_t context = subscribers->contexts[i];
+			/* unsubscribed from within an earlier callback of this event */
+			if (context->removed)
+				continue;
+			context->callback(&ev, context->user_data);
+		}
 	}
+
+	mutex_lock(&event_mutex);
+	event_subscribers_release(subscribers);
+	event_dispatching = 0;
+	cond_broadcast(&event_cond);
+	mutex_unlock(&event_mutex);
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_subscribe(idevice_subscription_context_t *context, idevice_event_cb_t callback, void *user_data)
 {
-	event_cb = callback;
-	int res = usbmuxd_subscribe(usbmux_event_cb, user_data);
-	if (res != 0) {
-		event_cb = NULL;
-		debug_info("ERROR: usbmuxd_subscribe() returned %d!", res);
+	if (!context || !callback)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_subscription_context_t ctx = (idevice_subscription_context_t)calloc(1, sizeof(struct idevice_subscription_context));
+	if (!ctx)
+		return IDEVICE_E_UNKNOWN_ERROR;
+	ctx->callback = callback;
+	ctx->user_data = user_data;
+
+	int need_subscribe = 0;
+	mutex_lock(&event_mutex);
+	/* wait for the outcome of a subscription attempt by another caller,
+	 * the list only ever holds this context while the attempt runs */
+	while (event_usbmux_pending) {
+		cond_wait(&event_cond, &event_mutex);
+	}
+	if (event_subscribers_update(ctx, 0) < 0) {
+		mutex_unlock(&event_mutex);
+		free(ctx);
 		return IDEVICE_E_UNKNOWN_ERROR;
 	}
+	if (!event_usbmux_subscribed) {
+		event_usbmux_pending = 1;
+		need_subscribe = 1;
+	}
+	mutex_unlock(&event_mutex);
+
+	/* all subscribers share a single usbmuxd subscription */
+	if (need_subscribe) {
+		int res = usbmuxd_events_subscribe(&event_usbmux_context, usbmux_event_cb, NULL);
+		mutex_lock(&event_mutex);
+		event_usbmux_pending = 0;
+		if (res == 0) {
+			event_usbmux_subscribed = 1;
+		} else {
+			debug_info("ERROR: usbmuxd_events_subscribe() returned %d!", res);
+			event_usbmux_context = NULL;
+			ctx->removed = 1;
+			if (event_subscribers_update(ctx, 1) < 0) {
+				/* not called anymore, freed with the next update of the list */
+				debug_info("ERROR: Out of memory");
+			}
+		}
+		cond_broadcast(&event_cond);
+		mutex_unlock(&event_mutex);
+		if (res != 0) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	}
+
+	*context = ctx;
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_events_unsubscribe(idevice_subscription_context_t context)
+{
+	if (!context)
+		return IDEVICE_E_INVALID_ARG;
+
+	int need_unsubscribe = 0;
+	mutex_lock(&event_mutex);
+	if (context->removed) {
+		mutex_unlock(&event_mutex);
+		return IDEVICE_E_INVALID_ARG;
+	}
+	context->removed = 1;
+	/* keep a reference so the context outlives the list update */
+	context->refs++;
+	int left = event_subscribers_update(context, 1);
+	if (left < 0) {
+		/* still in the list but never called again, dropped with the next update */
+		left = 1;
+	}
+	if (left == 0 && event_usbmux_subscribed) {
+		event_usbmux_subscribed = 0;
+		need_unsubscribe = 1;
+	}
+	/* make sure the callback has returned, unless it is the caller */
+	while (event_dispatching && event_dispatch_thread != (unsigned long)THREAD_ID) {
+		cond_wait(&event_cond, &event_mutex);
+	}
+	if (--context->refs == 0) {
+		free(context);
+	}
+	mutex_unlock(&event_mutex);
+
+	if (need_unsubscribe) {
+		int res = usbmuxd_events_unsubscribe(event_usbmux_context);
+		event_usbmux_context = NULL;
+		if (res != 0) {
+			debug_info("ERROR: usbmuxd_events_unsubscribe() returned %d!", res);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	}
 	return IDEVICE_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void *user_data)
+{
+	/* a new callback replaces the previous one */
+	if (event_legacy_context) {
+		idevice_events_unsubscribe(event_legacy_context);
+		event_legacy_context = NULL;
+	}
+	return idevice_events_subscribe(&event_legacy_context, callback, user_data);
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_event_unsubscribe(void)
 {
-	event_cb = NULL;
-	int res = usbmuxd_unsubscribe();
-	if (res != 0) {
-		debug_info("ERROR: usbmuxd_unsubscribe() returned %d!", res);
-		return IDEVICE_E_UNKNOWN_ERROR;
+	idevice_subscription_context_t context = event_legacy_context;
+	event_legacy_context = NULL;
+	if (!context) {
+		return IDEVICE_E_SUCCESS;
+	}
+	return idevice_events_unsubscribe(context);
+}
+
+#define DEVICE_CACHE_BUCKETS 64
+
+struct device_cache_entry {
+	usbmuxd_device_info_t info;
+	/* all entries in the order the devices appeared */
+	struct device_cache_entry *next;
+	struct device_cache_entry *prev;
+	/* entries with the same UDID hash */
+	struct device_cache_entry *bucket_next;
+};
+
+static int device_cache_enabled = 0;
+static usbmuxd_subscription_context_t device_cache_context = NULL;
+static struct device_cache_entry *device_cache_head = NULL;
+static struct device_cache_entry *device_cache_tail = NULL;
+static struct device_cache_entry *device_cache_buckets[DEVICE_CACHE_BUCKETS];
+
+static unsigned int device_cache_hash(const char *udid)
+{
+	unsigned int hash = 2166136261u;
+	while (*udid) {
+		hash = (hash ^ (unsigned char)*udid++) * 16777619u;
+	}
+	return hash % DEVICE_CACHE_BUCKETS;
+}
+
+/* must be called with device_cache_lock held for writing */
+static void device_cache_add(const usbmuxd_device_info_t *info)
+{
+	unsigned int bucket = device_cache_hash(info->udid);
+	struct device_cache_entry *entry;
+
+	for (entry = device_cache_buckets[bucket]; entry; entry = entry->bucket_next) {
+		if (entry->info.handle == info->handle) {
+			/* already known, e.g. from the initial device list */
+			return;
+		}
+	}
+
+	entry = (struct device_cache_entry*)malloc(sizeof(struct device_cache_entry));
+	if (!entry) {
+		return;
+	}
+	memcpy(&entry->info, info, sizeof(usbmuxd_device_info_t));
+	entry->bucket_next = device_cache_buckets[bucket];
+	device_cache_buckets[bucket] = entry;
+	entry->next = NULL;
+	entry->prev = device_cache_tail;
+	if (device_cache_tail) {
+		device_cache_tail->next = entry;
+	} else {
+		device_cache_head = entry;
+	}
+	device_cache_tail = entry;
+}
+
+/* must be called with device_cache_lock held for writing */
+static void device_cache_remove(uint32_t handle)
+{
+	struct device_cache_entry *entry;
+	struct device_cache_entry **pentry;
+	unsigned int bucket;
+
+	for (entry = device_cache_head; entry; entry = entry->next) {
+		if (entry->info.handle == handle) {
+			break;
+		}
+	}
+	if (!entry) {
+		return;
+	}
+
+	bucket = device_cache_hash(entry->info.udid);
+	for (pentry = &device_cache_buckets[bucket]; *pentry; pentry = &(*pentry)->bucket_next) {
+		if (*pentry == entry) {
+			*pentry = entry->bucket_next;
+			break;
+		}
+	}
+	if (entry->prev) {
+		entry->prev->next = entry->next;
+	} else {
+		device_cache_head = entry->next;
+	}
+	if (entry->next) {
+		entry->next->prev = entry->prev;
+	} else {
+		device_cache_tail = entry->prev;
+	}
+	free(entry);
+}
+
+/* must be called with device_cache_lock held for writing */
+static void device_cache_clear(void)
+{
+	while (device_cache_head) {
+		struct device_cache_entry *entry = device_cache_head;
+		device_cache_head = entry->next;
+		free(entry);
+	}
+	device_cache_tail = NULL;
+	memset(device_cache_buckets, 0, sizeof(device_cache_buckets));
+}
+
+/**
+ * Looks up a device in the cache the same way usbmuxd_get_device() does.
+ * Must be called with device_cache_lock held.
+ *
+ * @return 1 if a device was found and copied to info, 0 otherwise.
+ */
+static int device_cache_lookup(const char *udid, int usbmux_options, usbmuxd_device_info_t *info)
+{
+	struct device_cache_entry *entry;
+	struct device_cache_entry *usb = NULL;
+	struct device_cache_entry *network = NULL;
+
+	if (!(usbmux_options & (DEVICE_LOOKUP_USBMUX | DEVICE_LOOKUP_NETWORK))) {
+		usbmux_options |= DEVICE_LOOKUP_USBMUX;
+	}
+
+	if (udid && *udid) {
+		for (entry = device_cache_buckets[device_cache_hash(udid)]; entry; entry = entry->bucket_next) {
+			if (strcmp(entry->info.udid, udid) != 0) {
+				continue;
+			}
+			if (entry->info.conn_type == CONNECTION_TYPE_USB && !usb) {
+				usb = entry;
+			} else if (entry->info.conn_type == CONNECTION_TYPE_NETWORK && !network) {
+				network = entry;
+			}
+		}
+	} else {
+		for (entry = device_cache_head; entry; entry = entry->next) {
+			if (entry->info.conn_type == CONNECTION_TYPE_USB && !usb) {
+				usb = entry;
+			} else if (entry->info.conn_type == CONNECTION_TYPE_NETWORK && !network) {
+				network = entry;
+			}
+		}
+	}
+	if (!(usbmux_options & DEVICE_LOOKUP_USBMUX)) {
+		usb = NULL;
+	}
+	if (!(usbmux_options & DEVICE_LOOKUP_NETWORK)) {
+		network = NULL;
+	}
+
+	entry = (network && (usbmux_options & DEVICE_LOOKUP_PREFER_NETWORK)) ? network : (usb) ? usb : network;
+	if (!entry) {
+		return 0;
+	}
+	memcpy(info, &entry->info, sizeof(usbmuxd_device_info_t));
+	return 1;
+}
+
+static void device_cache_event_cb(const usbmuxd_event_t *event, void *user_data)
+{
+	rwlock_wrlock(&device_cache_lock);
+	if (device_cache_enabled) {
+		if (event->event == UE_DEVICE_ADD) {
+			device_cache_add(&event->device);
+		} else if (event->event == UE_DEVICE_REMOVE) {
+			device_cache_remove(event->device.handle);
+		}
+	}
+	rwlock_wrunlock(&device_cache_lock);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_device_cache(uint8_t enable)
+{
+	usbmuxd_device_info_t *dev_list = NULL;
+	usbmuxd_subscription_context_t context = NULL;
+	int i;
+
+	rwlock_wrlock(&device_cache_lock);
+	if (enable) {
+		if (device_cache_enabled) {
+			rwlock_wrunlock(&device_cache_lock);
+			return IDEVICE_E_SUCCESS;
+		}
+		/* events are held off by the lock until the initial list is in */
+		if (usbmuxd_events_subscribe(&device_cache_context, device_cache_event_cb, NULL) != 0) {
+			debug_info("ERROR: could not subscribe to device events");
+			device_cache_context = NULL;
+			rwlock_wrunlock(&device_cache_lock);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		if (usbmuxd_get_device_list(&dev_list) >= 0) {
+			for (i = 0; dev_list[i].handle > 0; i++) {
+				device_cache_add(&dev_list[i]);
+			}
+			usbmuxd_device_list_free(&dev_list);
+		}
+		device_cache_enabled = 1;
+		rwlock_wrunlock(&device_cache_lock);
+		return IDEVICE_E_SUCCESS;
+	}
+
+	context = device_cache_context;
+	device_cache_context = NULL;
+	device_cache_enabled = 0;
+	rwlock_wrunlock(&device_cache_lock);
+
+	/* must not hold the lock, this waits for a running event callback */
+	if (context) {
+		usbmuxd_events_unsubscribe(context);
+	}
+
+	rwlock_wrlock(&device_cache_lock);
+	if (!device_cache_enabled) {
+		device_cache_clear();
 	}
+	rwlock_wrunlock(&device_cache_lock);
+
 	return IDEVICE_E_SUCCESS;
 }
 
+/**
+ * Gets the device list from the device cache if it is enabled, otherwise
+ * from usbmuxd. The result must be freed with usbmuxd_device_list_free().
+ */
+static int internal_get_device_list(usbmuxd_device_info_t **dev_list)
+{
+	if (replay_is_replaying()) {
+		return replay_get_device_list(dev_list);
+	}
+	rwlock_rdlock(&device_cache_lock);
+	if (device_cache_enabled) {
+		struct device_cache_entry *entry;
+		int count = 0;
+		for (entry = device_cache_head; entry; entry = entry->next) {
+			count++;
+		}
+		/* usbmuxd_device_list_free() frees the array with free() */
+		usbmuxd_device_info_t *list = (usbmuxd_device_info_t*)calloc(count + 1, sizeof(usbmuxd_device_info_t));
+		if (!list) {
+			rwlock_rdunlock(&device_cache_lock);
+			return -1;
+		}
+		count = 0;
+		for (entry = device_cache_head; entry; entry = entry->next) {
+			memcpy(&list[count++], &entry->info, sizeof(usbmuxd_device_info_t));
+		}
+		rwlock_rdunlock(&device_cache_lock);
+		*dev_list = list;
+		return count;
+	}
+	rwlock_rdunlock(&device_cache_lock);
+
+	return usbmuxd_get_device_list(dev_list);
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list_extended(idevice_info_t **devices, int *count)
 {
 	usbmuxd_device_info_t *dev_list;
@@ -239,7 +774,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list_extended(idevice_in
 	*devices = NULL;
 	*count = 0;
 
-	if (usbmuxd_get_device_list(&dev_list) < 0) {
+	if (internal_get_device_list(&dev_list) < 0) {
 		debug_info("ERROR: usbmuxd is not running!", __func__);
 		return IDEVICE_E_NO_DEVICE;
 	}
@@ -295,7 +830,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_device_list(char ***devices, in
 	*devices = NULL;
 	*count = 0;
 
-	if (usbmuxd_get_device_list(&dev_list) < 0) {
+	if (internal_get_device_list(&dev_list) < 0) {
 		debug_info("ERROR: usbmuxd is not running!", __func__);
 		return IDEVICE_E_NO_DEVICE;
 	}
@@ -355,6 +890,14 @@ static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
 	device->udid = strdup(muxdev->udid);
 	device->mux_id = muxdev->handle;
 	device->version = 0;
+	mutex_init(&device->lockdown_mutex);
+	device->lockdown_client = NULL;
+	device->lockdown_client_pending = 0;
+	device->heartbeat = 0;
+	device->race = 0;
+	device->race_mux_id = 0;
+	mutex_init(&device->race_mutex);
+	device->scheduler = NULL;
 	switch (muxdev->conn_type) {
 	case CONNECTION_TYPE_USB:
 		device->conn_type = CONNECTION_USBMUXD;
@@ -374,10 +917,34 @@ static idevice_t idevice_from_mux_device(usbmuxd_device_info_t *muxdev)
 	return device;
 }
 
+/**
+ * Looks up the device record of a device on one transport only.
+ *
+ * @return 1 if found, 0 otherwise.
+ */
+static int internal_lookup_device_path(const char *udid, int usbmux_options, usbmuxd_device_info_t *info)
+{
+	int res = 0;
+	rwlock_rdlock(&device_cache_lock);
+	if (device_cache_enabled) {
+		res = device_cache_lookup(udid, usbmux_options, info);
+		rwlock_rdunlock(&device_cache_lock);
+	} else {
+		rwlock_rdunlock(&device_cache_lock);
+		res = usbmuxd_get_device(udid, info, usbmux_options);
+	}
+	return (res > 0);
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device, const char *udid, enum idevice_options options)
 {
 	usbmuxd_device_info_t muxdev;
 	int usbmux_options = 0;
+	if (options & IDEVICE_LOOKUP_RACE) {
+		/* the USB record is the primary one, the network path is raced against it */
+		options |= IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK;
+		options &= ~IDEVICE_LOOKUP_PREFER_NETWORK;
+	}
 	if (options & IDEVICE_LOOKUP_USBMUX) {
 		usbmux_options |= DEVICE_LOOKUP_USBMUX;
 	}
@@ -387,12 +954,33 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_new_with_options(idevice_t * device
 	if (options & IDEVICE_LOOKUP_PREFER_NETWORK) {
 		usbmux_options |= DEVICE_LOOKUP_PREFER_NETWORK;
 	}
-	int res = usbmuxd_get_device(udid, &muxdev, usbmux_options);
+	int res = 0;
+	if (replay_is_replaying()) {
+		res = replay_lookup_device(udid, &muxdev);
+	} else {
+		res = internal_lookup_device_path(udid, usbmux_options, &muxdev);
+		if (res > 0 && replay_is_recording()) {
+			replay_record_device(&muxdev);
+		}
+	}
 	if (res > 0) {
 		*device = idevice_from_mux_device(&muxdev);
 		if (!*device) {
 			return IDEVICE_E_UNKNOWN_ERROR;
 		}
+		if ((options & IDEVICE_LOOKUP_RACE) && !replay_is_replaying() && (*device)->conn_type == CONNECTION_USBMUXD) {
+			usbmuxd_device_info_t netdev;
+			if (internal_lookup_device_path((*device)->udid, DEVICE_LOOKUP_NETWORK, &netdev) && netdev.conn_type == CONNECTION_TYPE_NETWORK) {
+				debug_info("device %s is also available via network, racing both paths", (*device)->udid);
+				(*device)->race = 1;
+				(*device)->race_mux_id = netdev.handle;
+			}
+		}
+		if ((options & IDEVICE_HEARTBEAT) && (*device)->conn_type == CONNECTION_NETWORK) {
+			if (heartbeat_responder_add(*device) == 0) {
+				(*device)->heartbeat = 1;
+			}
+		}
 		return IDEVICE_E_SUCCESS;
 	}
 	return IDEVICE_E_NO_DEVICE;
@@ -411,6 +999,20 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
 
 	ret = IDEVICE_E_SUCCESS;
 
+	if (device->heartbeat) {
+		heartbeat_responder_remove(device);
+	}
+
+	if (device->lockdown_client) {
+		/* end the pooled lockdownd session */
+		device->lockdown_client->pool_device = NULL;
+		lockdownd_client_free(device->lockdown_client);
+		device->lockdown_client = NULL;
+	}
+	mutex_destroy(&device->lockdown_mutex);
+	mutex_destroy(&device->race_mutex);
+	service_scheduler_release(device->scheduler);
+
 	free(device->udid);
 
 	if (device->conn_data) {
@@ -420,63 +1022,405 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_free(idevice_t device)
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+/**
+ * Applies the default socket options for connections to network devices.
+ * usbmuxd may hand out a local socket it relays through, in that case only
+ * the buffer sizes apply.
+ */
+static void internal_connection_tune_network(idevice_connection_t connection)
 {
-	if (!device) {
-		return IDEVICE_E_INVALID_ARG;
-	}
+	int fd = (int)(long)connection->data;
+	struct sockaddr_storage addr;
+#ifdef WIN32
+	int addrlen = sizeof(addr);
+#else
+	socklen_t addrlen = sizeof(addr);
+#endif
 
-	if (device->conn_type == CONNECTION_USBMUXD || device->conn_type == CONNECTION_NETWORK) {
-		int sfd = usbmuxd_connect(device->mux_id, port);
-		if (sfd < 0) {
-			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
-			return IDEVICE_E_UNKNOWN_ERROR;
-		}
-		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
-		new_connection->type = CONNECTION_USBMUXD;
-		new_connection->data = (void*)(long)sfd;
-		new_connection->ssl_data = NULL;
-		new_connection->device = device;
-		*connection = new_connection;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", device->conn_type);
+	socket_set_buffer_sizes(fd, NETWORK_SOCKET_BUFFER_SIZE, NETWORK_SOCKET_BUFFER_SIZE);
+	if (getsockname(fd, (struct sockaddr*)&addr, &addrlen) != 0) {
+		return;
+	}
+	if (addr.ss_family == AF_INET
+#ifdef AF_INET6
+	    || addr.ss_family == AF_INET6
+#endif
+	) {
+		socket_set_nodelay(fd, 1);
+		socket_set_keepalive(fd, NETWORK_KEEPALIVE_IDLE, NETWORK_KEEPALIVE_INTERVAL, NETWORK_KEEPALIVE_COUNT);
 	}
-
-	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t connection)
+struct idevice_race;
+
+struct idevice_race_path {
+	struct idevice_race *race;
+	int index;
+	uint32_t handle;
+	int fd;
+	int done;
+};
+
+/* state shared by the attempts of one internal_connect_race() */
+struct idevice_race {
+	mutex_t mutex;
+	cond_t cond;
+	uint16_t port;
+	struct idevice_race_path path[2];
+	int winner;
+	int refs;
+};
+
+/* must be called with race->mutex held, unlocks it */
+static void internal_race_release(struct idevice_race *race)
 {
-	if (!connection) {
-		return IDEVICE_E_INVALID_ARG;
-	}
-	/* shut down ssl if enabled */
-	if (connection->ssl_data) {
-		idevice_connection_disable_ssl(connection);
+	if (--race->refs > 0) {
+		mutex_unlock(&race->mutex);
+		return;
 	}
-	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
-	if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
-		usbmuxd_disconnect((int)(long)connection->data);
-		connection->data = NULL;
-		result = IDEVICE_E_SUCCESS;
-	} else {
-		debug_info("Unknown connection type %d", connection->type);
+	mutex_unlock(&race->mutex);
+	cond_destroy(&race->cond);
+	mutex_destroy(&race->mutex);
+	free(race);
+}
+
+/**
+ * Connects one path of a race. Connections that lose are closed here, so
+ * the caller does not wait for a slow path once the other one succeeded.
+ */
+static void* internal_race_attempt(void *data)
+{
+	struct idevice_race_path *path = (struct idevice_race_path*)data;
+	struct idevice_race *race = path->race;
+
+	int sfd = usbmuxd_connect(path->handle, race->port);
+
+	mutex_lock(&race->mutex);
+	path->fd = sfd;
+	path->done = 1;
+	if (sfd >= 0) {
+		if (race->winner < 0) {
+			race->winner = path->index;
+		} else {
+			debug_info("closing %s connection that lost the race", (path->index) ? "network" : "USB");
+			usbmuxd_disconnect(sfd);
+			path->fd = -1;
+		}
 	}
+	cond_broadcast(&race->cond);
+	internal_race_release(race);
+	return NULL;
+}
 
-	free(connection);
-	connection = NULL;
+/* must be called with race->mutex held */
+static void internal_race_start(struct idevice_race *race, int index)
+{
+	struct idevice_race_path *path = &race->path[index];
+	THREAD_T thread;
 
-	return result;
+	race->refs++;
+	if (thread_new(&thread, internal_race_attempt, path) != 0) {
+		race->refs--;
+		path->done = 1;
+		return;
+	}
+	thread_detach(thread);
 }
 
 /**
- * Internally used function to send raw data over the given connection.
+ * Looks up the record of one path of a raced device again, e.g. after the
+ * device was reconnected and got a new handle.
  */
-static idevice_error_t internal_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+static void internal_race_refresh(idevice_t device, int index)
 {
-	if (!connection || !data) {
-		return IDEVICE_E_INVALID_ARG;
+	usbmuxd_device_info_t info;
+	if (!internal_lookup_device_path(device->udid, (index) ? DEVICE_LOOKUP_NETWORK : DEVICE_LOOKUP_USBMUX, &info)) {
+		return;
+	}
+	if (info.conn_type != ((index) ? CONNECTION_TYPE_NETWORK : CONNECTION_TYPE_USB)) {
+		return;
+	}
+	mutex_lock(&device->race_mutex);
+	if (index) {
+		device->race_mux_id = info.handle;
+	} else {
+		device->mux_id = info.handle;
+	}
+	mutex_unlock(&device->race_mutex);
+}
+
+/**
+ * Connects to a port over USB and network at once, happy eyeballs style.
+ * USB gets a head start of IDEVICE_RACE_DELAY ms and the network attempt
+ * only begins if USB failed or did not finish in that time.
+ *
+ * @return The socket of the first successful connection or a negative
+ *  error, network is set to 1 if the network path won.
+ */
+static int internal_connect_race(idevice_t device, uint16_t port, int *network)
+{
+	struct idevice_race *race = (struct idevice_race*)calloc(1, sizeof(struct idevice_race));
+	if (!race) {
+		return -ENOMEM;
+	}
+	int i;
+	mutex_init(&race->mutex);
+	cond_init(&race->cond);
+	race->port = port;
+	mutex_lock(&device->race_mutex);
+	race->path[0].handle = device->mux_id;
+	race->path[1].handle = device->race_mux_id;
+	mutex_unlock(&device->race_mutex);
+	for (i = 0; i < 2; i++) {
+		race->path[i].race = race;
+		race->path[i].index = i;
+		race->path[i].fd = -1;
+	}
+	race->winner = -1;
+	race->refs = 1;
+
+	mutex_lock(&race->mutex);
+	internal_race_start(race, 0);
+	uint64_t deadline = time_monotonic_usec() + IDEVICE_RACE_DELAY * 1000;
+	while (!race->path[0].done) {
+		uint64_t now = time_monotonic_usec();
+		if (now >= deadline) {
+			break;
+		}
+		cond_wait_timeout(&race->cond, &race->mutex, (unsigned int)((deadline - now + 999) / 1000));
+	}
+	if (race->winner != 0) {
+		internal_race_start(race, 1);
+	}
+	while (race->winner < 0 && !(race->path[0].done && race->path[1].done)) {
+		cond_wait(&race->cond, &race->mutex);
+	}
+	int winner = race->winner;
+	int sfd = (winner >= 0) ? race->path[winner].fd : -ECONNREFUSED;
+	int failed[2];
+	for (i = 0; i < 2; i++) {
+		failed[i] = (race->path[i].done && race->path[i].fd < 0);
+	}
+	internal_race_release(race);
+
+	if (winner >= 0) {
+		debug_info("connected to port %d via %s", port, (winner) ? "network" : "USB");
+		*network = winner;
+	}
+	/* pick up a new handle for the next connect if a path went away */
+	for (i = 0; i < 2; i++) {
+		if (failed[i]) {
+			internal_race_refresh(device, i);
+		}
+	}
+
+	return sfd;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t *connection)
+{
+	if (!device) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (replay_is_replaying()) {
+		idevice_connection_t new_connection = (idevice_connection_t)calloc(1, sizeof(struct idevice_connection_private));
+		if (!new_connection) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		new_connection->type = CONNECTION_USBMUXD;
+		new_connection->data = (void*)(long)-1;
+		new_connection->device = device;
+		new_connection->port = port;
+		if (replay_connect(new_connection, port) != IDEVICE_E_SUCCESS) {
+			free(new_connection);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		*connection = new_connection;
+		return IDEVICE_E_SUCCESS;
+	}
+
+	if (device->conn_type == CONNECTION_USBMUXD || device->conn_type == CONNECTION_NETWORK) {
+		int network = (device->conn_type == CONNECTION_NETWORK);
+		int sfd;
+		if (device->race) {
+			sfd = internal_connect_race(device, port, &network);
+		} else {
+			sfd = usbmuxd_connect(device->mux_id, port);
+		}
+		if (sfd < 0) {
+			debug_info("ERROR: Connecting to usbmuxd failed: %d (%s)", sfd, strerror(-sfd));
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		idevice_connection_t new_connection = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
+		new_connection->type = CONNECTION_USBMUXD;
+		new_connection->data = (void*)(long)sfd;
+		new_connection->ssl_data = NULL;
+		new_connection->device = device;
+		new_connection->port = port;
+		memset(&new_connection->stats, 0, sizeof(idevice_connection_stats_t));
+		new_connection->record_id = 0;
+		new_connection->replay = NULL;
+		new_connection->read_ahead = NULL;
+		new_connection->read_ahead_size = 0;
+		new_connection->read_ahead_pos = 0;
+		new_connection->read_ahead_len = 0;
+		new_connection->ktls_allowed = 0;
+		new_connection->receive_memory = 0;
+		if (network) {
+			internal_connection_tune_network(new_connection);
+		}
+		if (replay_is_recording()) {
+			replay_record_connect(new_connection);
+		}
+		TRACE_PROBE2(connect, device->udid, port);
+		*connection = new_connection;
+		return IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", device->conn_type);
+	}
+
+	return IDEVICE_E_UNKNOWN_ERROR;
+}
+
+struct idevice_connect_job {
+	idevice_t device;
+	uint16_t port;
+	idevice_connect_cb_t callback;
+	void *user_data;
+};
+
+/**
+ * Internally used event loop job for idevice_connect_async().
+ */
+static void idevice_connect_job_run(void *data, int cancelled)
+{
+	struct idevice_connect_job *job = (struct idevice_connect_job*)data;
+	idevice_connection_t connection = NULL;
+	idevice_error_t err = IDEVICE_E_UNKNOWN_ERROR;
+
+	if (!cancelled) {
+		err = idevice_connect(job->device, job->port, &connection);
+	}
+	job->callback(job->device, (err == IDEVICE_E_SUCCESS) ? connection : NULL, err, job->user_data);
+	free(job);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connect_async(idevice_event_loop_t loop, idevice_t device, uint16_t port, idevice_connect_cb_t callback, void *user_data)
+{
+	if (!loop || !device || !callback) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	struct idevice_connect_job *job = (struct idevice_connect_job*)malloc(sizeof(struct idevice_connect_job));
+	if (!job) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	job->device = device;
+	job->port = port;
+	job->callback = callback;
+	job->user_data = user_data;
+
+	if (event_loop_submit(loop, idevice_connect_job_run, job) < 0) {
+		free(job);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Writes the statistics of a connection to stderr.
+ */
+static void internal_connection_print_stats(idevice_connection_t connection)
+{
+	const idevice_connection_stats_t *st = &connection->stats;
+
+	fprintf(stderr, "[stats] %s port %u: sent %" PRIu64 " bytes in %" PRIu64 " calls (%" PRIu64 " over SSL), received %" PRIu64 " bytes in %" PRIu64 " calls (%" PRIu64 " over SSL), waited %" PRIu64 " us in %" PRIu64 " calls\n",
+		(connection->device && connection->device->udid) ? connection->device->udid : "(unknown)", connection->port,
+		st->bytes_sent, st->send_calls, st->ssl_bytes_sent,
+		st->bytes_received, st->receive_calls, st->ssl_bytes_received,
+		st->wait_usec, st->wait_calls);
+	idevice_stats_print_histogram(stderr, "send latency", st->send_latency);
+	idevice_stats_print_histogram(stderr, "receive latency", st->receive_latency);
+	if (st->receive_memory_peak > 0) {
+		fprintf(stderr, "[stats]   receive memory peak: %" PRIu64 " bytes\n", st->receive_memory_peak);
+	}
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_disconnect(idevice_connection_t connection)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (stats_enabled) {
+		internal_connection_print_stats(connection);
+	}
+	/* shut down ssl if enabled */
+	if (connection->ssl_data) {
+		idevice_connection_disable_ssl(connection);
+	}
+	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
+	if (connection->replay) {
+		replay_disconnect(connection);
+		result = IDEVICE_E_SUCCESS;
+	} else if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
+		replay_record_disconnect(connection);
+		usbmuxd_disconnect((int)(long)connection->data);
+		connection->data = NULL;
+		result = IDEVICE_E_SUCCESS;
+	} else {
+		debug_info("Unknown connection type %d", connection->type);
+	}
+
+	free(connection->read_ahead);
+	free(connection);
+	connection = NULL;
+
+	return result;
+}
+
+/**
+ * Internally used wrapper around socket_check_fd() that accounts the time
+ * spent waiting in the statistics of the connection.
+ */
+static int internal_connection_check_fd(idevice_connection_t connection, fd_mode fdm, unsigned int timeout)
+{
+	uint64_t start = time_monotonic_usec();
+	int res = socket_check_fd((int)(long)connection->data, fdm, timeout);
+	connection->stats.wait_usec += time_monotonic_usec() - start;
+	connection->stats.wait_calls++;
+	return res;
+}
+
+/**
+ * Accounts a finished send or receive operation in the statistics of the
+ * connection.
+ */
+static void internal_connection_count(idevice_connection_t connection, int is_send, uint32_t bytes)
+{
+	if (is_send) {
+		TRACE_PROBE2(send, connection->port, bytes);
+		connection->stats.send_calls++;
+		connection->stats.bytes_sent += bytes;
+		if (connection->ssl_data)
+			connection->stats.ssl_bytes_sent += bytes;
+	} else {
+		TRACE_PROBE2(receive, connection->port, bytes);
+		connection->stats.receive_calls++;
+		connection->stats.bytes_received += bytes;
+		if (connection->ssl_data)
+			connection->stats.ssl_bytes_received += bytes;
+	}
+}
+
+/**
+ * Internally used function to send raw data over the given connection.
+ */
+static idevice_error_t internal_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data) {
+		return IDEVICE_E_INVALID_ARG;
 	}
 
 	if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
@@ -493,63 +1437,454 @@ static idevice_error_t internal_connection_send(idevice_connection_t connection,
 
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+/**
+ * Internally used function to send data over an SSL-enabled connection.
+ */
+static idevice_error_t internal_ssl_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	uint32_t sent = 0;
+	while (sent < len) {
+#ifdef HAVE_OPENSSL
+		int c = internal_connection_check_fd(connection, FDM_WRITE, 100);
+		if (c == 0 || c == -ETIMEDOUT || c == -EAGAIN) {
+			continue;
+		} else if (c < 0) {
+			break;
+		}
+		int s = SSL_write(connection->ssl_data->session, (const void*)(data+sent), (int)(len-sent));
+		if (s <= 0) {
+			int sslerr = SSL_get_error(connection->ssl_data->session, s);
+			if (sslerr == SSL_ERROR_WANT_WRITE) {
+				continue;
+			}
+			break;
+		}
+#else
+		ssize_t s = gnutls_record_send(connection->ssl_data->session, (void*)(data+sent), (size_t)(len-sent));
+#endif
+		if (s < 0) {
+			break;
+		}
+		sent += s;
+	}
+	debug_info("SSL_write %d, sent %d", len, sent);
+	if (sent < len) {
+		*sent_bytes = 0;
+		return IDEVICE_E_SSL_ERROR;
+	}
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to send all of the given raw data over the
+ * given connection.
+ */
+static idevice_error_t internal_connection_send_all(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	uint32_t sent = 0;
+	while (sent < len) {
+		uint32_t bytes = 0;
+		int s = internal_connection_send(connection, data+sent, len-sent, &bytes);
+		if (s < 0) {
+			break;
+		}
+		sent += bytes;
+	}
+	debug_info("internal_connection_send %d, sent %d", len, sent);
+	if (sent < len) {
+		*sent_bytes = 0;
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+
+static idevice_error_t internal_connection_do_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->ssl_data) {
+		return internal_ssl_send(connection, data, len, sent_bytes);
+	}
+	return internal_connection_send_all(connection, data, len, sent_bytes);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send(idevice_connection_t connection, const char *data, uint32_t len, uint32_t *sent_bytes)
+{
+	idevice_error_t res;
+	if (connection && connection->replay) {
+		if (!data || !sent_bytes) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		res = replay_send(connection, len, sent_bytes);
+	} else {
+		res = internal_connection_do_send(connection, data, len, sent_bytes);
+	}
+	if (connection && sent_bytes && res != IDEVICE_E_INVALID_ARG) {
+		uint32_t sent = (res == IDEVICE_E_SUCCESS || res == IDEVICE_E_TIMEOUT || res == IDEVICE_E_NOT_ENOUGH_DATA) ? *sent_bytes : 0;
+		internal_connection_count(connection, 1, sent);
+		replay_record_send(connection, sent);
+	}
+	return res;
+}
+
+#ifndef WIN32
+#define IDEVICE_SENDV_MAX_IOV 16
+
+/**
+ * Internally used function to send a vector of buffers over a raw
+ * connection with as few system calls as possible.
+ */
+static idevice_error_t internal_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t total, uint32_t *sent_bytes)
+{
+	struct iovec vec[IDEVICE_SENDV_MAX_IOV];
+	struct msghdr msg;
+	int flags = 0;
+	uint32_t sent = 0;
+	uint32_t idx = 0;
+	uint32_t offset = 0;
+#ifdef MSG_NOSIGNAL
+	flags |= MSG_NOSIGNAL;
+#endif
+
+	while (sent < total) {
+		int n = 0;
+		uint32_t i;
+		for (i = idx; i < iovcnt && n < IDEVICE_SENDV_MAX_IOV; i++) {
+			if (iov[i].length == 0) {
+				continue;
+			}
+			vec[n].iov_base = (void*)(iov[i].data + ((i == idx) ? offset : 0));
+			vec[n].iov_len = iov[i].length - ((i == idx) ? offset : 0);
+			n++;
+		}
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = vec;
+		msg.msg_iovlen = n;
+		ssize_t s = sendmsg((int)(long)connection->data, &msg, flags);
+		if (s < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			debug_info("ERROR: sendmsg returned %d (%s)", errno, strerror(errno));
+			break;
+		} else if (s == 0) {
+			break;
+		}
+		sent += (uint32_t)s;
+		/* advance to the first buffer that has not been sent completely */
+		while (s > 0 && idx < iovcnt) {
+			uint32_t left = iov[idx].length - offset;
+			if ((size_t)s >= left) {
+				s -= left;
+				idx++;
+				offset = 0;
+			} else {
+				offset += (uint32_t)s;
+				s = 0;
+			}
+		}
+	}
+	debug_info("sendmsg %d, sent %d", total, sent);
+	if (sent < total) {
+		*sent_bytes = 0;
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+#endif
+
+#define IDEVICE_SENDV_STAGING_SIZE 16384
+
+static idevice_error_t internal_connection_do_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes)
+{
+	uint32_t total = 0;
+	uint32_t i;
+
+	if (!connection || !iov || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	*sent_bytes = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].length > 0 && !iov[i].data) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		total += iov[i].length;
+	}
+	if (total == 0) {
+		return IDEVICE_E_SUCCESS;
+	}
+
+#ifndef WIN32
+	if (!connection->ssl_data && (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK)) {
+		return internal_connection_sendv(connection, iov, iovcnt, total, sent_bytes);
+	}
+#endif
+
+	/* Coalesce small buffers into one staging buffer so that e.g. a packet
+	 * header and its payload end up in the same write (or SSL record).
+	 * Buffers that are at least as large as the staging buffer are sent
+	 * directly without copying. */
+	char staging[IDEVICE_SENDV_STAGING_SIZE];
+	uint32_t staged = 0;
+	uint32_t sent = 0;
+	uint32_t bytes = 0;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+
+	for (i = 0; i < iovcnt && res == IDEVICE_E_SUCCESS; i++) {
+		const char *p = iov[i].data;
+		uint32_t left = iov[i].length;
+		while (left > 0) {
+			if (staged == 0 && left >= sizeof(staging)) {
+				res = (connection->ssl_data) ? internal_ssl_send(connection, p, left, &bytes) : internal_connection_send_all(connection, p, left, &bytes);
+				sent += bytes;
+				break;
+			}
+			uint32_t chunk = sizeof(staging) - staged;
+			if (chunk > left) {
+				chunk = left;
+			}
+			memcpy(staging + staged, p, chunk);
+			staged += chunk;
+			p += chunk;
+			left -= chunk;
+			if (staged == sizeof(staging)) {
+				res = (connection->ssl_data) ? internal_ssl_send(connection, staging, staged, &bytes) : internal_connection_send_all(connection, staging, staged, &bytes);
+				sent += bytes;
+				staged = 0;
+				if (res != IDEVICE_E_SUCCESS) {
+					break;
+				}
+			}
+		}
+	}
+	if (res == IDEVICE_E_SUCCESS && staged > 0) {
+		res = (connection->ssl_data) ? internal_ssl_send(connection, staging, staged, &bytes) : internal_connection_send_all(connection, staging, staged, &bytes);
+		sent += bytes;
+	}
+	if (res != IDEVICE_E_SUCCESS) {
+		return res;
+	}
+
+	*sent_bytes = sent;
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_sendv(idevice_connection_t connection, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent_bytes)
+{
+	idevice_error_t res;
+	if (connection && connection->replay) {
+		uint32_t total = 0;
+		uint32_t i;
+		if (!iov || !sent_bytes) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		for (i = 0; i < iovcnt; i++) {
+			total += iov[i].length;
+		}
+		res = replay_send(connection, total, sent_bytes);
+	} else {
+		res = internal_connection_do_sendv(connection, iov, iovcnt, sent_bytes);
+	}
+	if (connection && sent_bytes && res != IDEVICE_E_INVALID_ARG) {
+		uint32_t sent = (res == IDEVICE_E_SUCCESS || res == IDEVICE_E_TIMEOUT || res == IDEVICE_E_NOT_ENOUGH_DATA) ? *sent_bytes : 0;
+		internal_connection_count(connection, 1, sent);
+		replay_record_send(connection, sent);
+	}
+	return res;
+}
+
+/* largest part of a file mapped or buffered at once when it can't be sent zero-copy */
+#define IDEVICE_SEND_FILE_WINDOW (4*1024*1024)
+#define IDEVICE_SEND_FILE_BUFFER_SIZE 65536
+
+#ifdef HAVE_SYS_SENDFILE_H
+/**
+ * Internally used function to send part of a file over a raw connection
+ * without copying it through userspace.
+ *
+ * @return IDEVICE_E_SUCCESS when everything was sent, IDEVICE_E_NOT_ENOUGH_DATA
+ *     when sending stopped early, or IDEVICE_E_UNKNOWN_ERROR when the kernel
+ *     can't sendfile() between the descriptors and nothing was sent.
+ */
+static idevice_error_t internal_connection_sendfile(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
+{
+	off_t off = (off_t)offset;
+	uint32_t sent = 0;
+
+	while (sent < length) {
+		ssize_t s = sendfile((int)(long)connection->data, fd, &off, length - sent);
+		if (s < 0) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			debug_info("ERROR: sendfile returned %d (%s)", errno, strerror(errno));
+			if (sent == 0 && (errno == EINVAL || errno == ENOSYS)) {
+				return IDEVICE_E_UNKNOWN_ERROR;
+			}
+			break;
+		} else if (s == 0) {
+			/* end of file */
+			break;
+		}
+		sent += (uint32_t)s;
+	}
+	debug_info("sendfile %d, sent %d", length, sent);
+	*sent_bytes = sent;
+	if (sent < length) {
+		return IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+#endif
+
+#ifdef IDEVICE_KTLS
+/**
+ * Internally used function to send part of a file over an SSL connection
+ * whose records are encrypted by the kernel, without copying the file
+ * through userspace.
+ */
+static idevice_error_t internal_ssl_sendfile(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
+{
+	uint32_t sent = 0;
+
+	while (sent < length) {
+		ossl_ssize_t s = SSL_sendfile(connection->ssl_data->session, fd, (off_t)(offset + sent), length - sent, 0);
+		if (s < 0) {
+			int sslerr = SSL_get_error(connection->ssl_data->session, (int)s);
+			if (sslerr == SSL_ERROR_WANT_WRITE) {
+				continue;
+			}
+			debug_info("ERROR: SSL_sendfile failed, SSL error %d", sslerr);
+			break;
+		} else if (s == 0) {
+			break;
+		}
+		sent += (uint32_t)s;
+	}
+	debug_info("SSL_sendfile %d, sent %d", length, sent);
+	*sent_bytes = sent;
+	if (sent < length) {
+		return (sent == 0) ? IDEVICE_E_SSL_ERROR : IDEVICE_E_NOT_ENOUGH_DATA;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+#endif
+
+static idevice_error_t internal_connection_do_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
 {
-	if (!connection || !data || (connection->ssl_data && !connection->ssl_data->session)) {
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	uint32_t sent = 0;
+	uint32_t bytes = 0;
+
+	if (!connection || fd < 0 || !sent_bytes || (connection->ssl_data && !connection->ssl_data->session)) {
 		return IDEVICE_E_INVALID_ARG;
 	}
 
-	if (connection->ssl_data) {
-		uint32_t sent = 0;
-		while (sent < len) {
-#ifdef HAVE_OPENSSL
-			int c = socket_check_fd((int)(long)connection->data, FDM_WRITE, 100);
-			if (c == 0 || c == -ETIMEDOUT || c == -EAGAIN) {
-				continue;
-			} else if (c < 0) {
-				break;
-			}
-			int s = SSL_write(connection->ssl_data->session, (const void*)(data+sent), (int)(len-sent));
-			if (s <= 0) {
-				int sslerr = SSL_get_error(connection->ssl_data->session, s);
-				if (sslerr == SSL_ERROR_WANT_WRITE) {
-					continue;
-				}
-				break;
-			}
-#else
-			ssize_t s = gnutls_record_send(connection->ssl_data->session, (void*)(data+sent), (size_t)(len-sent));
+	*sent_bytes = 0;
+	if (length == 0) {
+		return IDEVICE_E_SUCCESS;
+	}
+
+#ifdef HAVE_SYS_SENDFILE_H
+	if (!connection->ssl_data && (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK)) {
+		res = internal_connection_sendfile(connection, fd, offset, length, sent_bytes);
+		if (res != IDEVICE_E_UNKNOWN_ERROR) {
+			return res;
+		}
+		/* not supported for this pair of descriptors, send it the regular way */
+		res = IDEVICE_E_SUCCESS;
+	}
 #endif
-			if (s < 0) {
-				break;
-			}
-			sent += s;
+#ifdef IDEVICE_KTLS
+	if (connection->ssl_data && connection->ssl_data->ktls_send) {
+		return internal_ssl_sendfile(connection, fd, offset, length, sent_bytes);
+	}
+#endif
+
+#ifdef HAVE_SYS_MMAN_H
+	/* map the file window by window, this still saves the copy into a read buffer */
+	long page_size = sysconf(_SC_PAGESIZE);
+	while (sent < length && res == IDEVICE_E_SUCCESS) {
+		uint64_t pos = offset + sent;
+		uint64_t map_start = pos - (pos % (uint64_t)page_size);
+		uint32_t chunk = length - sent;
+		if (chunk > IDEVICE_SEND_FILE_WINDOW) {
+			chunk = IDEVICE_SEND_FILE_WINDOW;
 		}
-		debug_info("SSL_write %d, sent %d", len, sent);
-		if (sent < len) {
-			*sent_bytes = 0;
-			return IDEVICE_E_SSL_ERROR;
+		size_t map_len = (size_t)(pos - map_start) + chunk;
+		void *map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, (off_t)map_start);
+		if (map == MAP_FAILED) {
+			debug_info("mmap failed (%s), reading the file instead", strerror(errno));
+			break;
 		}
+		bytes = 0;
+		res = internal_connection_do_send(connection, (const char*)map + (pos - map_start), chunk, &bytes);
+		munmap(map, map_len);
+		sent += bytes;
+	}
+	if (sent == length || res != IDEVICE_E_SUCCESS) {
 		*sent_bytes = sent;
-		return IDEVICE_E_SUCCESS;
-	} else {
-		uint32_t sent = 0;
-		while (sent < len) {
-			uint32_t bytes = 0;
-			int s = internal_connection_send(connection, data+sent, len-sent, &bytes);
-			if (s < 0) {
-				break;
-			}
-			sent += bytes;
+		return res;
+	}
+#endif
+
+	char *buf = (char*)malloc(IDEVICE_SEND_FILE_BUFFER_SIZE);
+	if (!buf) {
+		*sent_bytes = sent;
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	while (sent < length && res == IDEVICE_E_SUCCESS) {
+		uint32_t chunk = length - sent;
+		if (chunk > IDEVICE_SEND_FILE_BUFFER_SIZE) {
+			chunk = IDEVICE_SEND_FILE_BUFFER_SIZE;
+		}
+#ifdef WIN32
+		/* no pread() here, seek to the position instead */
+		if (_lseeki64(fd, (__int64)(offset + sent), SEEK_SET) < 0) {
+			res = IDEVICE_E_UNKNOWN_ERROR;
+			break;
 		}
-		debug_info("internal_connection_send %d, sent %d", len, sent);
-		if (sent < len) {
-			*sent_bytes = 0;
-			return IDEVICE_E_NOT_ENOUGH_DATA;
+		int r = _read(fd, buf, chunk);
+#else
+		ssize_t r = pread(fd, buf, chunk, (off_t)(offset + sent));
+#endif
+		if (r <= 0) {
+			debug_info("ERROR: could not read from file (%s)", (r < 0) ? strerror(errno) : "end of file");
+			res = IDEVICE_E_NOT_ENOUGH_DATA;
+			break;
 		}
-		*sent_bytes = sent;
-		return IDEVICE_E_SUCCESS;
+		bytes = 0;
+		res = internal_connection_do_send(connection, buf, (uint32_t)r, &bytes);
+		sent += bytes;
+	}
+	free(buf);
+
+	*sent_bytes = sent;
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_send_file(idevice_connection_t connection, int fd, uint64_t offset, uint32_t length, uint32_t *sent_bytes)
+{
+	idevice_error_t res;
+	if (connection && connection->replay) {
+		if (fd < 0 || !sent_bytes) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		res = replay_send(connection, length, sent_bytes);
+	} else {
+		res = internal_connection_do_send_file(connection, fd, offset, length, sent_bytes);
+	}
+	if (connection && sent_bytes && res != IDEVICE_E_INVALID_ARG) {
+		internal_connection_count(connection, 1, *sent_bytes);
+		replay_record_send(connection, *sent_bytes);
 	}
+	return res;
 }
 
 static idevice_error_t socket_recv_to_idevice_error(int conn_error, uint32_t len, uint32_t received)
@@ -580,7 +1915,11 @@ static idevice_error_t internal_connection_receive_timeout(idevice_connection_t
 	}
 
 	if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
+		/* usbmuxd_recv_timeout() blocks in select() until data arrives */
+		uint64_t start = time_monotonic_usec();
 		int conn_error = usbmuxd_recv_timeout((int)(long)connection->data, data, len, recv_bytes, timeout);
+		connection->stats.wait_usec += time_monotonic_usec() - start;
+		connection->stats.wait_calls++;
 		idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, *recv_bytes);
 
 		if (error == IDEVICE_E_UNKNOWN_ERROR) {
@@ -594,12 +1933,8 @@ static idevice_error_t internal_connection_receive_timeout(idevice_connection_t
 	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+static idevice_error_t internal_connection_direct_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || len == 0) {
-		return IDEVICE_E_INVALID_ARG;
-	}
-
 	if (connection->ssl_data) {
 		uint32_t received = 0;
 		int do_select = 1;
@@ -609,7 +1944,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_
 			do_select = (SSL_pending(connection->ssl_data->session) == 0);
 #endif
 			if (do_select) {
-				int conn_error = socket_check_fd((int)(long)connection->data, FDM_READ, timeout);
+				int conn_error = internal_connection_check_fd(connection, FDM_READ, timeout);
 				idevice_error_t error = socket_recv_to_idevice_error(conn_error, len, received);
 
 				switch (error) {
@@ -618,6 +1953,8 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_
 					case IDEVICE_E_UNKNOWN_ERROR:
 					default:
 						debug_info("ERROR: socket_check_fd returned %d (%s)", conn_error, strerror(-conn_error));
+						/* report data already decrypted so it doesn't get lost */
+						*recv_bytes = received;
 						return error;
 				}
 			}
@@ -655,6 +1992,39 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_
 	return internal_connection_receive_timeout(connection, data, len, recv_bytes, timeout);
 }
 
+static idevice_error_t internal_connection_read_ahead_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout, int use_timeout);
+
+static idevice_error_t internal_connection_do_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session) || len == 0) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->read_ahead) {
+		return internal_connection_read_ahead_receive(connection, data, len, recv_bytes, timeout, 1);
+	}
+	return internal_connection_direct_receive_timeout(connection, data, len, recv_bytes, timeout);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	idevice_error_t res;
+	if (connection && connection->replay) {
+		if (!data || !recv_bytes || len == 0) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		res = replay_receive(connection, data, len, recv_bytes, timeout);
+	} else {
+		res = internal_connection_do_receive_timeout(connection, data, len, recv_bytes, timeout);
+	}
+	if (connection && recv_bytes && res != IDEVICE_E_INVALID_ARG) {
+		uint32_t received = (res == IDEVICE_E_SUCCESS || res == IDEVICE_E_TIMEOUT || res == IDEVICE_E_NOT_ENOUGH_DATA) ? *recv_bytes : 0;
+		internal_connection_count(connection, 0, received);
+		replay_record_receive(connection, res, data, received);
+	}
+	return res;
+}
+
 /**
  * Internally used function for receiving raw data over the given connection.
  */
@@ -678,12 +2048,8 @@ static idevice_error_t internal_connection_receive(idevice_connection_t connecti
 	return IDEVICE_E_UNKNOWN_ERROR;
 }
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+static idevice_error_t internal_connection_direct_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
 {
-	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
-		return IDEVICE_E_INVALID_ARG;
-	}
-
 	if (connection->ssl_data) {
 #ifdef HAVE_OPENSSL
 		int received = SSL_read(connection->ssl_data->session, (void*)data, (int)len);
@@ -698,7 +2064,414 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connecti
 		*recv_bytes = 0;
 		return IDEVICE_E_SSL_ERROR;
 	}
-	return internal_connection_receive(connection, data, len, recv_bytes);
+	return internal_connection_receive(connection, data, len, recv_bytes);
+}
+
+static int internal_ssl_pending(idevice_connection_t connection)
+{
+	if (!connection->ssl_data || !connection->ssl_data->session) {
+		return 0;
+	}
+#ifdef HAVE_OPENSSL
+	return (SSL_pending(connection->ssl_data->session) > 0);
+#else
+	return (gnutls_record_check_pending(connection->ssl_data->session) > 0);
+#endif
+}
+
+/**
+ * Internally used function to refill the read-ahead buffer of a connection
+ * with whatever a single receive from the socket or the SSL layer returns.
+ */
+static idevice_error_t internal_connection_fill_read_ahead(idevice_connection_t connection, unsigned int timeout, int use_timeout)
+{
+	uint32_t bytes = 0;
+	idevice_error_t res;
+
+	connection->read_ahead_pos = 0;
+	connection->read_ahead_len = 0;
+	if (connection->ssl_data && use_timeout && !internal_ssl_pending(connection)) {
+		int conn_error = internal_connection_check_fd(connection, FDM_READ, timeout);
+		res = socket_recv_to_idevice_error(conn_error, 0, 0);
+		if (res != IDEVICE_E_SUCCESS) {
+			return res;
+		}
+	}
+	if (connection->ssl_data || !use_timeout) {
+		res = internal_connection_direct_receive(connection, connection->read_ahead, connection->read_ahead_size, &bytes);
+	} else {
+		res = internal_connection_receive_timeout(connection, connection->read_ahead, connection->read_ahead_size, &bytes, timeout);
+	}
+	if (res == IDEVICE_E_SUCCESS && bytes == 0) {
+		return (use_timeout) ? IDEVICE_E_TIMEOUT : IDEVICE_E_UNKNOWN_ERROR;
+	}
+	connection->read_ahead_len = bytes;
+	return res;
+}
+
+/**
+ * Internally used function to serve receives from the read-ahead buffer,
+ * so that a series of small reads like a packet header followed by its
+ * payload costs a single receive from the socket. Reads at least as large
+ * as the buffer go straight into the caller's buffer.
+ */
+static idevice_error_t internal_connection_read_ahead_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout, int use_timeout)
+{
+	uint32_t received = 0;
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	/* SSL receives with a timeout return all requested bytes, keep it that way */
+	int want_all = (use_timeout && connection->ssl_data);
+
+	while (received < len) {
+		uint32_t avail = connection->read_ahead_len - connection->read_ahead_pos;
+		if (avail == 0) {
+			if (received > 0 && !want_all) {
+				break;
+			}
+			if (len - received >= connection->read_ahead_size) {
+				uint32_t bytes = 0;
+				if (use_timeout) {
+					res = internal_connection_direct_receive_timeout(connection, data + received, len - received, &bytes, timeout);
+				} else {
+					res = internal_connection_direct_receive(connection, data + received, len - received, &bytes);
+				}
+				received += bytes;
+				break;
+			}
+			res = internal_connection_fill_read_ahead(connection, timeout, use_timeout);
+			if (res != IDEVICE_E_SUCCESS) {
+				break;
+			}
+			continue;
+		}
+		if (avail > len - received) {
+			avail = len - received;
+		}
+		memcpy(data + received, connection->read_ahead + connection->read_ahead_pos, avail);
+		connection->read_ahead_pos += avail;
+		received += avail;
+	}
+
+	*recv_bytes = received;
+	if (res != IDEVICE_E_SUCCESS && received > 0 && !want_all) {
+		/* the buffered part has been consumed, hand it out */
+		res = IDEVICE_E_SUCCESS;
+	}
+	return res;
+}
+
+static idevice_error_t internal_connection_do_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	if (!connection || (connection->ssl_data && !connection->ssl_data->session)) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	if (connection->read_ahead && len > 0) {
+		return internal_connection_read_ahead_receive(connection, data, len, recv_bytes, 0, 0);
+	}
+	return internal_connection_direct_receive(connection, data, len, recv_bytes);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes)
+{
+	idevice_error_t res;
+	if (connection && connection->replay) {
+		if (!data || !recv_bytes || len == 0) {
+			return IDEVICE_E_INVALID_ARG;
+		}
+		res = replay_receive(connection, data, len, recv_bytes, 0);
+	} else {
+		res = internal_connection_do_receive(connection, data, len, recv_bytes);
+	}
+	if (connection && recv_bytes && res != IDEVICE_E_INVALID_ARG) {
+		uint32_t received = (res == IDEVICE_E_SUCCESS || res == IDEVICE_E_TIMEOUT || res == IDEVICE_E_NOT_ENOUGH_DATA) ? *recv_bytes : 0;
+		internal_connection_count(connection, 0, received);
+		replay_record_receive(connection, res, data, received);
+	}
+	return res;
+}
+
+/**
+ * Checks whether the SSL layer of the given connection holds data that has
+ * already been received and decrypted, and which therefore won't make the
+ * socket readable again.
+ *
+ * @param connection The connection to check.
+ *
+ * @return 1 if data is pending, 0 otherwise.
+ */
+int idevice_connection_has_pending_data(idevice_connection_t connection)
+{
+	if (connection && connection->replay) {
+		return replay_has_pending_data(connection);
+	}
+	if (!connection) {
+		return 0;
+	}
+	if (connection->read_ahead_pos < connection->read_ahead_len) {
+		return 1;
+	}
+	return internal_ssl_pending(connection);
+}
+
+/**
+ * Enables or resizes the read-ahead buffer of a connection. Small receives
+ * are then served from data that was received in larger chunks, which
+ * saves system calls for protocols that read a header and then a payload.
+ *
+ * @param connection The connection to configure.
+ * @param size Size of the buffer in bytes, 0 disables read-ahead.
+ *
+ * @return IDEVICE_E_SUCCESS on success, IDEVICE_E_INVALID_ARG if the buffer
+ *     still holds data that has not been read, or IDEVICE_E_UNKNOWN_ERROR
+ *     if the buffer could not be allocated.
+ */
+idevice_error_t idevice_connection_set_read_ahead(idevice_connection_t connection, uint32_t size)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (connection->read_ahead_pos < connection->read_ahead_len) {
+		debug_info("ERROR: read-ahead buffer still holds %u bytes", connection->read_ahead_len - connection->read_ahead_pos);
+		return IDEVICE_E_INVALID_ARG;
+	}
+	char *buf = NULL;
+	if (size > 0) {
+		buf = (char*)malloc(size);
+		if (!buf) {
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+	}
+	free(connection->read_ahead);
+	connection->read_ahead = buf;
+	connection->read_ahead_size = size;
+	connection->read_ahead_pos = 0;
+	connection->read_ahead_len = 0;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Lets the next SSL handshake on the connection hand encryption over to
+ * the kernel (kTLS) where it is available. Once that happened the socket
+ * can't carry plain text anymore, so this is only for connections that
+ * stay encrypted until they are closed. Setting IMOBILEDEVICE_NO_KTLS in
+ * the environment turns the offload off.
+ *
+ * @param connection The connection to allow kTLS for.
+ */
+void idevice_connection_allow_ktls(idevice_connection_t connection)
+{
+	if (connection) {
+		connection->ktls_allowed = 1;
+	}
+}
+
+/**
+ * Waits until data can be read from the given connection without holding
+ * any locks the caller might need to keep free while idle.
+ * Data that has already been decrypted by the SSL layer counts as readable.
+ *
+ * @param connection The connection to wait on.
+ * @param timeout Maximum time in milliseconds to wait.
+ *
+ * @return IDEVICE_E_SUCCESS when data is available, IDEVICE_E_TIMEOUT when
+ *     the timeout expired, or IDEVICE_E_UNKNOWN_ERROR on error.
+ */
+idevice_error_t idevice_connection_wait_readable(idevice_connection_t connection, unsigned int timeout)
+{
+	if (!connection || timeout == 0) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (connection->replay) {
+		return replay_wait_readable(connection, timeout);
+	}
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	if (idevice_connection_has_pending_data(connection)) {
+		return IDEVICE_E_SUCCESS;
+	}
+
+	int conn_error = internal_connection_check_fd(connection, FDM_READ, timeout);
+	return socket_recv_to_idevice_error(conn_error, 0, 0);
+}
+
+/**
+ * Checks whether dumping of connection statistics was requested with the
+ * IMOBILEDEVICE_STATS environment variable.
+ */
+int idevice_stats_enabled(void)
+{
+	return stats_enabled;
+}
+
+/**
+ * Adds a measured latency to a log-bucketed histogram with
+ * IDEVICE_STATS_LATENCY_BUCKETS buckets.
+ */
+void idevice_stats_record_latency(uint64_t *histogram, uint64_t usec)
+{
+	int bucket = 0;
+	while (usec > 1 && bucket < IDEVICE_STATS_LATENCY_BUCKETS-1) {
+		usec >>= 1;
+		bucket++;
+	}
+	histogram[bucket]++;
+}
+
+/**
+ * Writes the non-empty buckets of a latency histogram on a single line.
+ */
+void idevice_stats_print_histogram(FILE *stream, const char *label, const uint64_t *histogram)
+{
+	int i;
+	int empty = 1;
+
+	for (i = 0; i < IDEVICE_STATS_LATENCY_BUCKETS; i++) {
+		if (histogram[i] == 0) {
+			continue;
+		}
+		if (empty) {
+			fprintf(stream, "[stats]   %s:", label);
+			empty = 0;
+		}
+		if (i == IDEVICE_STATS_LATENCY_BUCKETS-1) {
+			fprintf(stream, " >=%" PRIu64 "us:%" PRIu64, (uint64_t)1 << i, histogram[i]);
+		} else {
+			fprintf(stream, " <%" PRIu64 "us:%" PRIu64, (uint64_t)1 << (i+1), histogram[i]);
+		}
+	}
+	if (!empty) {
+		fprintf(stream, "\n");
+	}
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_stats(idevice_connection_t connection, idevice_connection_stats_t *stats)
+{
+	if (!connection || !stats) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	memcpy(stats, &connection->stats, sizeof(idevice_connection_stats_t));
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Reserves memory for a message about to be received on a connection from
+ * the receive memory budget, waiting for other receives to release memory
+ * if the budget is exhausted. Must be paired with
+ * idevice_receive_memory_release().
+ *
+ * @param connection The connection the message is received on.
+ * @param size Number of bytes to reserve.
+ * @param timeout Maximum time in milliseconds to wait, 0 for no limit.
+ *
+ * @return 0 on success, -1 if the message exceeds the per-message cap or the
+ *     whole budget, or -2 if not enough memory became available in time.
+ */
+int idevice_receive_memory_reserve(idevice_connection_t connection, uint64_t size, unsigned int timeout)
+{
+	int is_head = 0;
+	int res = 0;
+
+	mutex_lock(&recv_budget_mutex);
+	if ((recv_budget.max_message_size > 0 && size > recv_budget.max_message_size) || (recv_budget.budget > 0 && size > recv_budget.budget)) {
+		debug_info("ERROR: message needs %" PRIu64 " bytes which exceeds the receive memory budget", size);
+		recv_budget.rejected++;
+		mutex_unlock(&recv_budget_mutex);
+		return -1;
+	}
+
+	uint64_t start = 0;
+	uint64_t deadline = 0;
+	while (recv_budget.budget > 0) {
+		uint64_t avail = (recv_budget.in_use < recv_budget.budget) ? recv_budget.budget - recv_budget.in_use : 0;
+		uint64_t ahead = (recv_budget_head && !is_head) ? recv_budget_head_size : 0;
+		if (size + ahead <= avail) {
+			break;
+		}
+		if (start == 0) {
+			start = time_monotonic_usec();
+			deadline = (timeout > 0) ? start + (uint64_t)timeout * 1000 : 0;
+			recv_budget.throttled++;
+			debug_info("receive memory budget exhausted, waiting for %" PRIu64 " bytes", size);
+		}
+		if (!recv_budget_head) {
+			recv_budget_head = 1;
+			recv_budget_head_size = size;
+			is_head = 1;
+		}
+		if (deadline == 0) {
+			cond_wait(&recv_budget_cond, &recv_budget_mutex);
+			continue;
+		}
+		uint64_t now = time_monotonic_usec();
+		if (now >= deadline) {
+			res = -2;
+			break;
+		}
+		cond_wait_timeout(&recv_budget_cond, &recv_budget_mutex, (unsigned int)((deadline - now + 999) / 1000));
+	}
+	if (is_head) {
+		/* let the others fill the room that was kept for this receive */
+		recv_budget_head = 0;
+		recv_budget_head_size = 0;
+		cond_broadcast(&recv_budget_cond);
+	}
+	if (start > 0) {
+		recv_budget.wait_usec += time_monotonic_usec() - start;
+	}
+	if (res == 0) {
+		recv_budget.in_use += size;
+		recv_budget.reservations++;
+		if (recv_budget.in_use > recv_budget.peak)
+			recv_budget.peak = recv_budget.in_use;
+		connection->receive_memory += size;
+		if (connection->receive_memory > connection->stats.receive_memory_peak)
+			connection->stats.receive_memory_peak = connection->receive_memory;
+	}
+	mutex_unlock(&recv_budget_mutex);
+
+	return res;
+}
+
+/**
+ * Returns memory reserved with idevice_receive_memory_reserve() to the
+ * receive memory budget.
+ */
+void idevice_receive_memory_release(idevice_connection_t connection, uint64_t size)
+{
+	mutex_lock(&recv_budget_mutex);
+	recv_budget.in_use = (recv_budget.in_use > size) ? recv_budget.in_use - size : 0;
+	connection->receive_memory = (connection->receive_memory > size) ? connection->receive_memory - size : 0;
+	if (recv_budget.budget > 0) {
+		cond_broadcast(&recv_budget_cond);
+	}
+	mutex_unlock(&recv_budget_mutex);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_receive_memory_budget(uint64_t budget, uint64_t max_message_size)
+{
+	mutex_lock(&recv_budget_mutex);
+	recv_budget.budget = budget;
+	recv_budget.max_message_size = max_message_size;
+	/* waiting receives may fit now */
+	cond_broadcast(&recv_budget_cond);
+	mutex_unlock(&recv_budget_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_get_receive_memory_stats(idevice_memory_stats_t *stats)
+{
+	if (!stats) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	mutex_lock(&recv_budget_mutex);
+	memcpy(stats, &recv_budget, sizeof(idevice_memory_stats_t));
+	mutex_unlock(&recv_budget_mutex);
+	return IDEVICE_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connection_t connection, int *fd)
@@ -708,7 +2481,9 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connectio
 	}
 
 	idevice_error_t result = IDEVICE_E_UNKNOWN_ERROR;
-	if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
+	if (connection->replay) {
+		debug_info("Replayed connections have no file descriptor");
+	} else if (connection->type == CONNECTION_USBMUXD || connection->type == CONNECTION_NETWORK) {
 		*fd = (int)(long)connection->data;
 		result = IDEVICE_E_SUCCESS;
 	} else {
@@ -717,6 +2492,44 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_get_fd(idevice_connectio
 	return result;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_set_socket_option(idevice_connection_t connection, enum idevice_socket_option option, int value)
+{
+	if (!connection || value < 0) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (connection->replay) {
+		return IDEVICE_E_SUCCESS;
+	}
+	if (connection->type != CONNECTION_USBMUXD && connection->type != CONNECTION_NETWORK) {
+		debug_info("Unknown connection type %d", connection->type);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	int fd = (int)(long)connection->data;
+	int res = -1;
+	switch (option) {
+	case IDEVICE_SOCKET_NODELAY:
+		res = socket_set_nodelay(fd, value);
+		break;
+	case IDEVICE_SOCKET_SEND_BUFFER:
+		res = socket_set_buffer_sizes(fd, value, 0);
+		break;
+	case IDEVICE_SOCKET_RECEIVE_BUFFER:
+		res = socket_set_buffer_sizes(fd, 0, value);
+		break;
+	case IDEVICE_SOCKET_KEEPALIVE:
+		res = socket_set_keepalive(fd, value, NETWORK_KEEPALIVE_INTERVAL, NETWORK_KEEPALIVE_COUNT);
+		break;
+	default:
+		return IDEVICE_E_INVALID_ARG;
+	}
+	if (res < 0) {
+		debug_info("ERROR: Could not set socket option %d: %s", option, strerror(errno));
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_get_handle(idevice_t device, uint32_t *handle)
 {
 	if (!device || !handle)
@@ -738,46 +2551,33 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_get_udid(idevice_t device, char **u
 #ifndef HAVE_OPENSSL
 /**
  * Internally used gnutls callback function for receiving encrypted data.
+ * The data is received straight into the buffer provided by gnutls.
  */
 static ssize_t internal_ssl_read(gnutls_transport_ptr_t transport, char *buffer, size_t length)
 {
-	int bytes = 0, pos_start_fill = 0;
+	uint32_t bytes = 0;
 	size_t tbytes = 0;
-	int this_len = length;
 	idevice_error_t res;
 	idevice_connection_t connection = (idevice_connection_t)transport;
-	char *recv_buffer;
 
 	debug_info("pre-read client wants %zi bytes", length);
 
-	recv_buffer = (char *)malloc(sizeof(char) * this_len);
-
 	/* repeat until we have the full data or an error occurs */
-	do {
-		if ((res = internal_connection_receive(connection, recv_buffer, this_len, (uint32_t*)&bytes)) != IDEVICE_E_SUCCESS) {
+	while (tbytes < length) {
+		bytes = 0;
+		if ((res = internal_connection_receive(connection, buffer + tbytes, (uint32_t)(length - tbytes), &bytes)) != IDEVICE_E_SUCCESS) {
 			debug_info("ERROR: idevice_connection_receive returned %d", res);
-			return res;
+			if (tbytes > 0) {
+				break;
+			}
+			gnutls_transport_set_errno(connection->ssl_data->session, (res == IDEVICE_E_TIMEOUT) ? EAGAIN : EIO);
+			return -1;
 		}
 		debug_info("post-read we got %i bytes", bytes);
 
-		/* increase read count */
 		tbytes += bytes;
-
-		/* fill the buffer with what we got right now */
-		memcpy(buffer + pos_start_fill, recv_buffer, bytes);
-		pos_start_fill += bytes;
-
-		if (tbytes >= length) {
-			break;
-		}
-
-		this_len = length - tbytes;
-		debug_info("re-read trying to read missing %i bytes", this_len);
-	} while (tbytes < length);
-
-	if (recv_buffer) {
-		free(recv_buffer);
 	}
+
 	return tbytes;
 }
 
@@ -797,8 +2597,53 @@ static ssize_t internal_ssl_write(gnutls_transport_ptr_t transport, char *buffer
 	debug_info("post-send sent %i bytes", bytes);
 	return bytes;
 }
+
+#ifndef WIN32
+#define IDEVICE_SSL_WRITEV_MAX_IOV 32
+
+/**
+ * Internally used gnutls callback function for sending encrypted data
+ * from several buffers, so that queued records go out in a single
+ * sendmsg() instead of being copied together first.
+ */
+static ssize_t internal_ssl_writev(gnutls_transport_ptr_t transport, const giovec_t *iov, int iovcnt)
+{
+	idevice_iovec_t vec[IDEVICE_SSL_WRITEV_MAX_IOV];
+	idevice_connection_t connection = (idevice_connection_t)transport;
+	ssize_t sent = 0;
+	int i = 0;
+
+	while (i < iovcnt) {
+		uint32_t n = 0;
+		uint32_t total = 0;
+		uint32_t bytes = 0;
+		for (; i < iovcnt && n < IDEVICE_SSL_WRITEV_MAX_IOV; i++) {
+			vec[n].data = (const char*)iov[i].iov_base;
+			vec[n].length = (uint32_t)iov[i].iov_len;
+			total += vec[n].length;
+			n++;
+		}
+		if (total == 0) {
+			continue;
+		}
+		if (internal_connection_sendv(connection, vec, n, total, &bytes) != IDEVICE_E_SUCCESS) {
+			debug_info("ERROR: internal_connection_sendv failed after %zi bytes", sent);
+			if (sent > 0) {
+				break;
+			}
+			gnutls_transport_set_errno(connection->ssl_data->session, EIO);
+			return -1;
+		}
+		sent += bytes;
+	}
+	debug_info("post-sendv sent %zi bytes", sent);
+	return sent;
+}
+#endif
 #endif
 
+static void ssl_ctx_cache_entry_release(struct ssl_ctx_cache_entry *entry);
+
 /**
  * Internally used function for cleaning up SSL stuff.
  */
@@ -811,29 +2656,13 @@ static void internal_ssl_cleanup(ssl_data_t ssl_data)
 	if (ssl_data->session) {
 		SSL_free(ssl_data->session);
 	}
-	if (ssl_data->ctx) {
-		SSL_CTX_free(ssl_data->ctx);
-	}
 #else
 	if (ssl_data->session) {
 		gnutls_deinit(ssl_data->session);
 	}
-	if (ssl_data->certificate) {
-		gnutls_certificate_free_credentials(ssl_data->certificate);
-	}
-	if (ssl_data->root_cert) {
-		gnutls_x509_crt_deinit(ssl_data->root_cert);
-	}
-	if (ssl_data->host_cert) {
-		gnutls_x509_crt_deinit(ssl_data->host_cert);
-	}
-	if (ssl_data->root_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->root_privkey);
-	}
-	if (ssl_data->host_privkey) {
-		gnutls_x509_privkey_deinit(ssl_data->host_privkey);
-	}
 #endif
+	/* the context and credentials are owned by the cache entry */
+	ssl_ctx_cache_entry_release(ssl_data->ctx_entry);
 }
 
 #ifdef HAVE_OPENSSL
@@ -904,42 +2733,129 @@ static int internal_cert_callback(gnutls_session_t session, const gnutls_datum_t
 }
 #endif
 
-LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
-{
-	if (!connection || connection->ssl_data)
-		return IDEVICE_E_INVALID_ARG;
+/**
+ * Prepared SSL context for a pair record, shared by all connections to the
+ * device. Entries are reference counted; the cache holds one reference and
+ * each connection using the context holds another one.
+ */
+struct ssl_ctx_cache_entry {
+	char *udid;
+	char *host_id;
+	key_data_t root_cert_data;
+	int tls1_only;
+	unsigned int refcount;
+#ifdef HAVE_OPENSSL
+	SSL_CTX *ctx;
+	SSL_SESSION *session;
+#else
+	gnutls_datum_t session_data;
+	gnutls_certificate_credentials_t certificate;
+	gnutls_x509_privkey_t root_privkey;
+	gnutls_x509_crt_t root_cert;
+	gnutls_x509_privkey_t host_privkey;
+	gnutls_x509_crt_t host_cert;
+#endif
+	struct ssl_ctx_cache_entry *next;
+};
 
-	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
-	plist_t pair_record = NULL;
+static void ssl_ctx_cache_entry_free(struct ssl_ctx_cache_entry *entry)
+{
+	if (!entry)
+		return;
 
-	userpref_read_pair_record(connection->device->udid, &pair_record);
-	if (!pair_record) {
-		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
-		return ret;
+#ifdef HAVE_OPENSSL
+	if (entry->session) {
+		SSL_SESSION_free(entry->session);
+	}
+	if (entry->ctx) {
+		SSL_CTX_free(entry->ctx);
+	}
+#else
+	if (entry->session_data.data) {
+		gnutls_free(entry->session_data.data);
 	}
+	if (entry->certificate) {
+		gnutls_certificate_free_credentials(entry->certificate);
+	}
+	if (entry->root_cert) {
+		gnutls_x509_crt_deinit(entry->root_cert);
+	}
+	if (entry->host_cert) {
+		gnutls_x509_crt_deinit(entry->host_cert);
+	}
+	if (entry->root_privkey) {
+		gnutls_x509_privkey_deinit(entry->root_privkey);
+	}
+	if (entry->host_privkey) {
+		gnutls_x509_privkey_deinit(entry->host_privkey);
+	}
+#endif
+	free(entry->root_cert_data.data);
+	free(entry->host_id);
+	free(entry->udid);
+	free(entry);
+}
 
-#ifdef HAVE_OPENSSL
-	key_data_t root_cert = { NULL, 0 };
-	key_data_t root_privkey = { NULL, 0 };
+static void ssl_ctx_cache_entry_release(struct ssl_ctx_cache_entry *entry)
+{
+	unsigned int refcount = 0;
 
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
+	if (!entry)
+		return;
 
-	if (pair_record)
-		plist_free(pair_record);
+	mutex_lock(&ssl_ctx_cache_mutex);
+	refcount = --entry->refcount;
+	mutex_unlock(&ssl_ctx_cache_mutex);
 
-	BIO *ssl_bio = BIO_new(BIO_s_socket());
-	if (!ssl_bio) {
-		debug_info("ERROR: Could not create SSL bio.");
-		return ret;
+	if (refcount == 0) {
+		ssl_ctx_cache_entry_free(entry);
 	}
-	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+}
+
+/**
+ * Removes the cached SSL context of the given device, or of all devices if
+ * udid is NULL. Connections still using a removed context keep it alive
+ * until they are closed. This is registered as pair record change callback.
+ */
+static void ssl_ctx_cache_invalidate(const char *udid)
+{
+	struct ssl_ctx_cache_entry *released = NULL;
+	struct ssl_ctx_cache_entry **pp = NULL;
+
+	mutex_lock(&ssl_ctx_cache_mutex);
+	pp = &ssl_ctx_cache;
+	while (*pp) {
+		struct ssl_ctx_cache_entry *entry = *pp;
+		if (!udid || !strcmp(entry->udid, udid)) {
+			*pp = entry->next;
+			if (--entry->refcount == 0) {
+				entry->next = released;
+				released = entry;
+			}
+		} else {
+			pp = &entry->next;
+		}
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
+
+	while (released) {
+		struct ssl_ctx_cache_entry *next = released->next;
+		debug_info("Releasing SSL context for %s", released->udid);
+		ssl_ctx_cache_entry_free(released);
+		released = next;
+	}
+}
+
+#ifdef HAVE_OPENSSL
+static SSL_CTX* internal_ssl_ctx_new(plist_t pair_record, int tls1_only)
+{
+	key_data_t root_cert = { NULL, 0 };
+	key_data_t root_privkey = { NULL, 0 };
 
 	SSL_CTX *ssl_ctx = SSL_CTX_new(TLS_method());
 	if (ssl_ctx == NULL) {
 		debug_info("ERROR: Could not create SSL context.");
-		BIO_free(ssl_bio);
-		return ret;
+		return NULL;
 	}
 
 #if OPENSSL_VERSION_NUMBER >= 0x10100000L && !defined(LIBRESSL_VERSION_NUMBER)
@@ -949,7 +2865,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 #if OPENSSL_VERSION_NUMBER < 0x10100002L || \
 	(defined(LIBRESSL_VERSION_NUMBER) && (LIBRESSL_VERSION_NUMBER < 0x2060000fL))
 	/* force use of TLSv1 for older devices */
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (tls1_only) {
 #ifdef SSL_OP_NO_TLSv1_1
 		long opts = SSL_CTX_get_options(ssl_ctx);
 		opts |= SSL_OP_NO_TLSv1_1;
@@ -964,11 +2880,14 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	}
 #else
 	SSL_CTX_set_min_proto_version(ssl_ctx, TLS1_VERSION);
-	if (connection->device->version < DEVICE_VERSION(10,0,0)) {
+	if (tls1_only) {
 		SSL_CTX_set_max_proto_version(ssl_ctx, TLS1_VERSION);
 	}
 #endif
 
+	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert);
+	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, &root_privkey);
+
 	BIO* membp;
 	X509* rootCert = NULL;
 	membp = BIO_new_mem_buf(root_cert.data, root_cert.size);
@@ -990,79 +2909,335 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	RSA_free(rootPrivKey);
 	free(root_privkey.data);
 
+	return ssl_ctx;
+}
+#endif
+
+/**
+ * Checks if a cache entry was created from a pair record with the given
+ * host ID and root certificate.
+ */
+static int ssl_ctx_cache_entry_matches(struct ssl_ctx_cache_entry *e, const char *host_id, const key_data_t *root_cert_data)
+{
+	return !strcmp(e->host_id, host_id)
+	    && e->root_cert_data.size == root_cert_data->size
+	    && !memcmp(e->root_cert_data.data, root_cert_data->data, root_cert_data->size);
+}
+
+/**
+ * Gets the prepared SSL context for the given pair record, creating and
+ * caching it if required. A cached context is only reused if host ID and
+ * root certificate of the pair record still match, so changes made to the
+ * pair record by other processes are picked up, too.
+ *
+ * @return A referenced cache entry that must be released with
+ *    ssl_ctx_cache_entry_release(), or NULL on error.
+ */
+static struct ssl_ctx_cache_entry* ssl_ctx_cache_get(const char *udid, plist_t pair_record, int tls1_only)
+{
+	struct ssl_ctx_cache_entry *entry = NULL;
+	struct ssl_ctx_cache_entry *stale = NULL;
+	struct ssl_ctx_cache_entry **pp = NULL;
+	char *host_id = NULL;
+	key_data_t root_cert_data = { NULL, 0 };
+
+	pair_record_get_host_id(pair_record, &host_id);
+	pair_record_get_item_as_key_data(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, &root_cert_data);
+	if (!host_id || !root_cert_data.data) {
+		debug_info("ERROR: Pair record for udid %s lacks host ID or root certificate.", udid);
+		free(host_id);
+		free(root_cert_data.data);
+		return NULL;
+	}
+
+	mutex_lock(&ssl_ctx_cache_mutex);
+	pp = &ssl_ctx_cache;
+	while (*pp) {
+		struct ssl_ctx_cache_entry *e = *pp;
+		if (!strcmp(e->udid, udid) && e->tls1_only == tls1_only) {
+			if (ssl_ctx_cache_entry_matches(e, host_id, &root_cert_data)) {
+				e->refcount++;
+				entry = e;
+				break;
+			}
+			/* pair record changed, drop the outdated context */
+			*pp = e->next;
+			if (--e->refcount == 0) {
+				e->next = stale;
+				stale = e;
+			}
+			continue;
+		}
+		pp = &e->next;
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
+
+	while (stale) {
+		struct ssl_ctx_cache_entry *next = stale->next;
+		ssl_ctx_cache_entry_free(stale);
+		stale = next;
+	}
+
+	if (entry) {
+		debug_info("Using cached SSL context for %s", udid);
+		free(host_id);
+		free(root_cert_data.data);
+		return entry;
+	}
+
+	entry = (struct ssl_ctx_cache_entry*)calloc(1, sizeof(struct ssl_ctx_cache_entry));
+	if (!entry) {
+		free(host_id);
+		free(root_cert_data.data);
+		return NULL;
+	}
+	entry->udid = strdup(udid);
+	entry->host_id = host_id;
+	entry->root_cert_data = root_cert_data;
+	entry->tls1_only = tls1_only;
+
+#ifdef HAVE_OPENSSL
+	entry->ctx = internal_ssl_ctx_new(pair_record, tls1_only);
+	if (!entry->ctx) {
+		ssl_ctx_cache_entry_free(entry);
+		return NULL;
+	}
+#else
+	gnutls_certificate_allocate_credentials(&entry->certificate);
+#if GNUTLS_VERSION_NUMBER >= 0x020b07
+	gnutls_certificate_set_retrieve_function(entry->certificate, internal_cert_callback);
+#else
+	gnutls_certificate_client_set_retrieve_function(entry->certificate, internal_cert_callback);
+#endif
+	gnutls_x509_crt_init(&entry->root_cert);
+	gnutls_x509_crt_init(&entry->host_cert);
+	gnutls_x509_privkey_init(&entry->root_privkey);
+	gnutls_x509_privkey_init(&entry->host_privkey);
+
+	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, entry->root_cert);
+	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, entry->host_cert);
+	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, entry->root_privkey);
+	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, entry->host_privkey);
+#endif
+
+	/* another connection may have created the same context meanwhile */
+	struct ssl_ctx_cache_entry *existing = NULL;
+	mutex_lock(&ssl_ctx_cache_mutex);
+	for (existing = ssl_ctx_cache; existing; existing = existing->next) {
+		if (!strcmp(existing->udid, udid) && existing->tls1_only == tls1_only
+		    && ssl_ctx_cache_entry_matches(existing, entry->host_id, &entry->root_cert_data)) {
+			existing->refcount++;
+			break;
+		}
+	}
+	if (!existing) {
+		/* one reference for the cache, one for the caller */
+		entry->refcount = 2;
+		entry->next = ssl_ctx_cache;
+		ssl_ctx_cache = entry;
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
+
+	if (existing) {
+		debug_info("Using SSL context for %s created concurrently", udid);
+		ssl_ctx_cache_entry_free(entry);
+		return existing;
+	}
+
+	debug_info("Created SSL context for %s", udid);
+
+	return entry;
+}
+
+/**
+ * Discards the remembered TLS session of a cache entry. Must be called with
+ * the cache mutex held.
+ */
+static void ssl_ctx_cache_entry_clear_session(struct ssl_ctx_cache_entry *entry)
+{
+#ifdef HAVE_OPENSSL
+	if (entry->session) {
+		SSL_SESSION_free(entry->session);
+		entry->session = NULL;
+	}
+#else
+	if (entry->session_data.data) {
+		gnutls_free(entry->session_data.data);
+		entry->session_data.data = NULL;
+		entry->session_data.size = 0;
+	}
+#endif
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_set_ssl_session_resumption(uint8_t enable)
+{
+	struct ssl_ctx_cache_entry *entry = NULL;
+
+	mutex_lock(&ssl_ctx_cache_mutex);
+	ssl_session_resumption = (enable) ? 1 : 0;
+	if (!enable) {
+		for (entry = ssl_ctx_cache; entry; entry = entry->next) {
+			ssl_ctx_cache_entry_clear_session(entry);
+		}
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Internally used function to perform the SSL handshake of a connection.
+ */
+static idevice_error_t internal_connection_enable_ssl(idevice_connection_t connection)
+{
+	if (!connection || connection->ssl_data)
+		return IDEVICE_E_INVALID_ARG;
+
+	/* the capture holds the plaintext, there is nothing to decrypt */
+	if (connection->replay)
+		return IDEVICE_E_SUCCESS;
+
+	/* buffered raw bytes would be part of the handshake */
+	if (connection->read_ahead_pos < connection->read_ahead_len) {
+		debug_info("ERROR: Failed enabling SSL. Data was received before the handshake.");
+		return IDEVICE_E_SSL_ERROR;
+	}
+
+	idevice_error_t ret = IDEVICE_E_SSL_ERROR;
+	plist_t pair_record = NULL;
+
+	userpref_read_pair_record(connection->device->udid, &pair_record);
+	if (!pair_record) {
+		debug_info("ERROR: Failed enabling SSL. Unable to read pair record for udid %s.", connection->device->udid);
+		return ret;
+	}
+
+	struct ssl_ctx_cache_entry *ctx_entry = ssl_ctx_cache_get(connection->device->udid, pair_record, (connection->device->version < DEVICE_VERSION(10,0,0)));
+	plist_free(pair_record);
+	if (!ctx_entry) {
+		debug_info("ERROR: Failed enabling SSL. Unable to set up SSL context.");
+		return ret;
+	}
+
+#ifdef HAVE_OPENSSL
+	BIO *ssl_bio = BIO_new(BIO_s_socket());
+	if (!ssl_bio) {
+		debug_info("ERROR: Could not create SSL bio.");
+		ssl_ctx_cache_entry_release(ctx_entry);
+		return ret;
+	}
+	BIO_set_fd(ssl_bio, (int)(long)connection->data, BIO_NOCLOSE);
+
+	SSL_CTX *ssl_ctx = ctx_entry->ctx;
+
 	SSL *ssl = SSL_new(ssl_ctx);
 	if (!ssl) {
 		debug_info("ERROR: Could not create SSL object");
 		BIO_free(ssl_bio);
-		SSL_CTX_free(ssl_ctx);
+		ssl_ctx_cache_entry_release(ctx_entry);
 		return ret;
 	}
 	SSL_set_connect_state(ssl);
 	SSL_set_verify(ssl, 0, ssl_verify_callback);
 	SSL_set_bio(ssl, ssl_bio, ssl_bio);
+#ifdef IDEVICE_KTLS
+	/* the kernel takes over if it supports the negotiated cipher */
+	if (connection->ktls_allowed && !ktls_disabled) {
+		SSL_set_options(ssl, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
+	mutex_lock(&ssl_ctx_cache_mutex);
+	if (ssl_session_resumption && ctx_entry->session) {
+		debug_info("Offering previous SSL session for resumption");
+		SSL_set_session(ssl, ctx_entry->session);
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
 
 	debug_info("Performing SSL handshake");
 	int ssl_error = 0;
 	do {
 		ssl_error = SSL_get_error(ssl, SSL_do_handshake(ssl));
-		if (ssl_error == 0 || ssl_error != SSL_ERROR_WANT_READ) {
+		if (ssl_error != SSL_ERROR_WANT_READ && ssl_error != SSL_ERROR_WANT_WRITE) {
+			break;
+		}
+		/* wait until the socket is ready instead of polling */
+		int res = internal_connection_check_fd(connection, (ssl_error == SSL_ERROR_WANT_READ) ? FDM_READ : FDM_WRITE, 100);
+		if (res < 0 && res != -ETIMEDOUT) {
+			debug_info("ERROR: Socket error during SSL handshake");
 			break;
 		}
-#ifdef WIN32
-		Sleep(100);
-#else
-		struct timespec ts = { 0, 100000000 };
-		nanosleep(&ts, NULL);
-#endif
 	} while (1);
 	if (ssl_error != 0) {
 		debug_info("ERROR during SSL handshake: %s", ssl_error_to_string(ssl_error));
 		SSL_free(ssl);
-		SSL_CTX_free(ssl_ctx);
+		ssl_ctx_cache_entry_release(ctx_entry);
 	} else {
 		ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
 		ssl_data_loc->session = ssl;
 		ssl_data_loc->ctx = ssl_ctx;
+		ssl_data_loc->ctx_entry = ctx_entry;
+		ssl_data_loc->ktls_send = 0;
+		ssl_data_loc->ktls_recv = 0;
+#ifdef IDEVICE_KTLS
+		ssl_data_loc->ktls_send = BIO_get_ktls_send(SSL_get_wbio(ssl));
+		ssl_data_loc->ktls_recv = BIO_get_ktls_recv(SSL_get_rbio(ssl));
+		if (ssl_data_loc->ktls_send || ssl_data_loc->ktls_recv) {
+			debug_info("kTLS offload enabled for%s%s", (ssl_data_loc->ktls_send) ? " send" : "", (ssl_data_loc->ktls_recv) ? " receive" : "");
+		}
+#endif
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled, %s, cipher: %s", SSL_get_version(ssl), SSL_get_cipher(ssl));
+		debug_info("SSL mode enabled, %s, cipher: %s%s", SSL_get_version(ssl), SSL_get_cipher(ssl), (SSL_session_reused(ssl)) ? " (resumed)" : "");
+		replay_record_ssl(connection, 1);
+
+		mutex_lock(&ssl_ctx_cache_mutex);
+		if (ssl_session_resumption && !SSL_session_reused(ssl)) {
+			/* remember the session of the full handshake */
+			ssl_ctx_cache_entry_clear_session(ctx_entry);
+			ctx_entry->session = SSL_get1_session(ssl);
+		}
+		mutex_unlock(&ssl_ctx_cache_mutex);
 	}
 	/* required for proper multi-thread clean up to prevent leaks */
 	openssl_remove_thread_state();
 #else
-	ssl_data_t ssl_data_loc = (ssl_data_t)malloc(sizeof(struct ssl_data_private));
+	ssl_data_t ssl_data_loc = (ssl_data_t)calloc(1, sizeof(struct ssl_data_private));
+	if (!ssl_data_loc) {
+		ssl_ctx_cache_entry_release(ctx_entry);
+		return ret;
+	}
+
+	/* the credentials are shared with other connections to the device */
+	ssl_data_loc->ctx_entry = ctx_entry;
+	ssl_data_loc->certificate = ctx_entry->certificate;
+	ssl_data_loc->root_cert = ctx_entry->root_cert;
+	ssl_data_loc->host_cert = ctx_entry->host_cert;
+	ssl_data_loc->root_privkey = ctx_entry->root_privkey;
+	ssl_data_loc->host_privkey = ctx_entry->host_privkey;
 
 	/* Set up GnuTLS... */
 	debug_info("enabling SSL mode");
 	errno = 0;
-	gnutls_certificate_allocate_credentials(&ssl_data_loc->certificate);
-#if GNUTLS_VERSION_NUMBER >= 0x020b07
-	gnutls_certificate_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
-#else
-	gnutls_certificate_client_set_retrieve_function(ssl_data_loc->certificate, internal_cert_callback);
-#endif
 	gnutls_init(&ssl_data_loc->session, GNUTLS_CLIENT);
 	gnutls_priority_set_direct(ssl_data_loc->session, "NONE:+VERS-TLS1.0:+ANON-DH:+RSA:+AES-128-CBC:+AES-256-CBC:+SHA1:+MD5:+COMP-NULL", NULL);
 	gnutls_credentials_set(ssl_data_loc->session, GNUTLS_CRD_CERTIFICATE, ssl_data_loc->certificate);
 	gnutls_session_set_ptr(ssl_data_loc->session, ssl_data_loc);
 
-	gnutls_x509_crt_init(&ssl_data_loc->root_cert);
-	gnutls_x509_crt_init(&ssl_data_loc->host_cert);
-	gnutls_x509_privkey_init(&ssl_data_loc->root_privkey);
-	gnutls_x509_privkey_init(&ssl_data_loc->host_privkey);
-
-	pair_record_import_crt_with_name(pair_record, USERPREF_ROOT_CERTIFICATE_KEY, ssl_data_loc->root_cert);
-	pair_record_import_crt_with_name(pair_record, USERPREF_HOST_CERTIFICATE_KEY, ssl_data_loc->host_cert);
-	pair_record_import_key_with_name(pair_record, USERPREF_ROOT_PRIVATE_KEY_KEY, ssl_data_loc->root_privkey);
-	pair_record_import_key_with_name(pair_record, USERPREF_HOST_PRIVATE_KEY_KEY, ssl_data_loc->host_privkey);
-
-	if (pair_record)
-		plist_free(pair_record);
+	mutex_lock(&ssl_ctx_cache_mutex);
+	if (ssl_session_resumption && ctx_entry->session_data.data) {
+		debug_info("Offering previous SSL session for resumption");
+		gnutls_session_set_data(ssl_data_loc->session, ctx_entry->session_data.data, ctx_entry->session_data.size);
+	}
+	mutex_unlock(&ssl_ctx_cache_mutex);
 
 	debug_info("GnuTLS step 1...");
 	gnutls_transport_set_ptr(ssl_data_loc->session, (gnutls_transport_ptr_t)connection);
 	debug_info("GnuTLS step 2...");
 	gnutls_transport_set_push_function(ssl_data_loc->session, (gnutls_push_func) & internal_ssl_write);
+#ifndef WIN32
+	gnutls_transport_set_vec_push_function(ssl_data_loc->session, internal_ssl_writev);
+#endif
 	debug_info("GnuTLS step 3...");
 	gnutls_transport_set_pull_function(ssl_data_loc->session, (gnutls_pull_func) & internal_ssl_read);
 	debug_info("GnuTLS step 4 -- now handshaking...");
@@ -1085,12 +3260,36 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_conne
 	} else {
 		connection->ssl_data = ssl_data_loc;
 		ret = IDEVICE_E_SUCCESS;
-		debug_info("SSL mode enabled");
+		debug_info("SSL mode enabled%s", (gnutls_session_is_resumed(ssl_data_loc->session)) ? " (resumed)" : "");
+		replay_record_ssl(connection, 1);
+
+		mutex_lock(&ssl_ctx_cache_mutex);
+		if (ssl_session_resumption && !gnutls_session_is_resumed(ssl_data_loc->session)) {
+			/* remember the session of the full handshake */
+			ssl_ctx_cache_entry_clear_session(ctx_entry);
+			if (gnutls_session_get_data2(ssl_data_loc->session, &ctx_entry->session_data) != GNUTLS_E_SUCCESS) {
+				ctx_entry->session_data.data = NULL;
+				ctx_entry->session_data.size = 0;
+			}
+		}
+		mutex_unlock(&ssl_ctx_cache_mutex);
 	}
 #endif
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_enable_ssl(idevice_connection_t connection)
+{
+	uint64_t trace_start = trace_begin();
+	idevice_ssl_init();
+	idevice_error_t ret = internal_connection_enable_ssl(connection);
+	if (connection) {
+		TRACE_PROBE3(ssl__handshake, connection->device->udid, connection->port, ret);
+		trace_end("ssl", "SSL handshake", trace_start);
+	}
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_ssl(idevice_connection_t connection)
 {
 	return idevice_connection_disable_bypass_ssl(connection, 0);
@@ -1133,6 +3332,7 @@ LIBIMOBILEDEVICE_API idevice_error_t idevice_connection_disable_bypass_ssl(idevi
 	connection->ssl_data = NULL;
 
 	debug_info("SSL mode disabled");
+	replay_record_ssl(connection, 0);
 
 	return IDEVICE_E_SUCCESS;
 }
@@ -52,11 +52,25 @@
 #endif
 #endif
 
+#include <stdio.h>
+
 #include "common/userpref.h"
+#include "common/thread.h"
 #include "libimobiledevice/libimobiledevice.h"
 
 #define DEVICE_VERSION(maj, min, patch) (((maj & 0xFF) << 16) | ((min & 0xFF) << 8) | (patch & 0xFF))
 
+/* head start of the USB path when racing it against the network path */
+#define IDEVICE_RACE_DELAY 250
+
+/* socket defaults for connections to network devices */
+#define NETWORK_SOCKET_BUFFER_SIZE (256 * 1024)
+#define NETWORK_KEEPALIVE_IDLE 30
+#define NETWORK_KEEPALIVE_INTERVAL 10
+#define NETWORK_KEEPALIVE_COUNT 3
+
+struct ssl_ctx_cache_entry;
+
 struct ssl_data_private {
 #ifdef HAVE_OPENSSL
 	SSL *session;
@@ -68,6 +82,13 @@ struct ssl_data_private {
 	gnutls_x509_crt_t root_cert;
 	gnutls_x509_privkey_t host_privkey;
 	gnutls_x509_crt_t host_cert;
+#endif
+	/* shared context the above credentials are borrowed from */
+	struct ssl_ctx_cache_entry *ctx_entry;
+#ifdef HAVE_OPENSSL
+	/* records are encrypted or decrypted by the kernel */
+	int ktls_send;
+	int ktls_recv;
 #endif
 };
 typedef struct ssl_data_private *ssl_data_t;
@@ -77,14 +98,61 @@ struct idevice_connection_private {
 	enum idevice_connection_type type;
 	void *data;
 	ssl_data_t ssl_data;
+	uint16_t port;
+	idevice_connection_stats_t stats;
+	/* set while recording or replaying, see replay.c */
+	uint32_t record_id;
+	struct replay_connection *replay;
+	/* optional read-ahead buffer, see idevice_connection_set_read_ahead() */
+	char *read_ahead;
+	uint32_t read_ahead_size;
+	uint32_t read_ahead_pos;
+	uint32_t read_ahead_len;
+	/* see idevice_connection_allow_ktls() */
+	int ktls_allowed;
+	/* memory currently reserved from the receive memory budget */
+	uint64_t receive_memory;
 };
 
+struct lockdownd_client_private;
+struct service_scheduler;
+
 struct idevice_private {
 	char *udid;
 	uint32_t mux_id;
 	enum idevice_connection_type conn_type;
 	void *conn_data;
 	int version;
+	/* pooled lockdownd session, see lockdownd_client_acquire() */
+	mutex_t lockdown_mutex;
+	struct lockdownd_client_private *lockdown_client;
+	/* set while the pooled session is being set up */
+	int lockdown_client_pending;
+	/* registered with the heartbeat responder */
+	int heartbeat;
+	/* network path raced against mux_id, see IDEVICE_LOOKUP_RACE */
+	int race;
+	uint32_t race_mux_id;
+	mutex_t race_mutex;
+	/* shares the link between service connections, see service.c */
+	struct service_scheduler *scheduler;
 };
 
+/* large enough for a whole SSL record */
+#define IDEVICE_READ_AHEAD_DEFAULT_SIZE 16384
+
+idevice_error_t idevice_connection_wait_readable(idevice_connection_t connection, unsigned int timeout);
+int idevice_connection_has_pending_data(idevice_connection_t connection);
+idevice_error_t idevice_connection_set_read_ahead(idevice_connection_t connection, uint32_t size);
+void idevice_connection_allow_ktls(idevice_connection_t connection);
+
+void idevice_ssl_init(void);
+
+int idevice_receive_memory_reserve(idevice_connection_t connection, uint64_t size, unsigned int timeout);
+void idevice_receive_memory_release(idevice_connection_t connection, uint64_t size);
+
+int idevice_stats_enabled(void);
+void idevice_stats_record_latency(uint64_t *histogram, uint64_t usec);
+void idevice_stats_print_histogram(FILE *stream, const char *label, const uint64_t *histogram);
+
 #endif
@@ -26,7 +26,18 @@
 #include <string.h>
 #include <stdlib.h>
 #include <inttypes.h>
+#include <stdio.h>
+#include <errno.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
 #include <plist/plist.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include "installation_proxy.h"
 #include "property_list_service.h"
@@ -37,10 +48,20 @@ typedef enum {
 	INSTPROXY_COMMAND_TYPE_SYNC
 } instproxy_command_type_t;
 
+/**
+ * Internally used status callback that may take over a received status.
+ *
+ * @return 1 if the callback took ownership of the status node, which then
+ *     must be freed by the callback's owner, or 0 to let the receive loop
+ *     free it.
+ */
+typedef int (*instproxy_status_take_cb_t) (plist_t command, plist_t status, void *user_data);
+
 struct instproxy_status_data {
 	instproxy_client_t client;
 	plist_t command;
 	instproxy_status_cb_t cbfunc;
+	instproxy_status_take_cb_t takefunc;
 	void *user_data;
 };
 
@@ -203,6 +224,82 @@ static void instproxy_unlock(instproxy_client_t client)
 	mutex_unlock(&client->mutex);
 }
 
+enum {
+	INSTPROXY_NP_FAILED = -1,
+	INSTPROXY_NP_NOT_STARTED = 0,
+	INSTPROXY_NP_RUNNING = 1
+};
+
+/**
+ * Drops cached bundle paths, all of them if appid is NULL.
+ *
+ * @param client The installation_proxy client
+ * @param appid The bundle identifier to forget or NULL
+ */
+static void instproxy_path_cache_invalidate(instproxy_client_t client, const char *appid)
+{
+	mutex_lock(&client->cache_mutex);
+	client->cache_generation++;
+	if (client->path_cache) {
+		if (appid) {
+			plist_dict_remove_item(client->path_cache, appid);
+		} else {
+			plist_free(client->path_cache);
+			client->path_cache = NULL;
+		}
+	}
+	mutex_unlock(&client->cache_mutex);
+}
+
+static void instproxy_path_cache_notify_cb(const char *notification, void *user_data)
+{
+	instproxy_client_t client = (instproxy_client_t)user_data;
+
+	mutex_lock(&client->cache_mutex);
+	if (!notification || !*notification) {
+		/* the connection is gone, without it the cache could go stale unnoticed */
+		debug_info("notification proxy connection lost, not caching bundle paths");
+		client->np_state = INSTPROXY_NP_FAILED;
+	}
+	client->cache_generation++;
+	plist_free(client->path_cache);
+	client->path_cache = NULL;
+	mutex_unlock(&client->cache_mutex);
+}
+
+/**
+ * Starts watching for app changes made by other clients, once.
+ * Must be called with the cache mutex held.
+ *
+ * @return 1 if the path cache can be used, 0 otherwise.
+ */
+static int instproxy_path_cache_usable(instproxy_client_t client)
+{
+	const char *spec[] = { NP_APP_INSTALLED, NP_APP_UNINSTALLED, NULL };
+
+	if (client->np_state != INSTPROXY_NP_NOT_STARTED) {
+		return (client->np_state == INSTPROXY_NP_RUNNING);
+	}
+	client->np_state = INSTPROXY_NP_FAILED;
+	if (!client->device || np_client_start_service(client->device, &client->np, "instproxy-path-cache") != NP_E_SUCCESS) {
+		debug_info("could not start notification proxy, not caching bundle paths");
+		return 0;
+	}
+	if (np_observe_notifications(client->np, spec) != NP_E_SUCCESS) {
+		np_client_free(client->np);
+		client->np = NULL;
+		return 0;
+	}
+	client->np_state = INSTPROXY_NP_RUNNING;
+	if (np_set_notify_callback(client->np, instproxy_path_cache_notify_cb, client) != NP_E_SUCCESS) {
+		client->np_state = INSTPROXY_NP_FAILED;
+		np_client_free(client->np);
+		client->np = NULL;
+		return 0;
+	}
+	return 1;
+}
+
 /**
  * Converts a property_list_service_error_t value to an instproxy_error_t value.
  * Used internally to get correct error codes.
@@ -242,7 +339,14 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_new(idevice_t device, lo
 	instproxy_client_t client_loc = (instproxy_client_t) malloc(sizeof(struct instproxy_client_private));
 	client_loc->parent = plistclient;
 	mutex_init(&client_loc->mutex);
-	client_loc->receive_status_thread = THREAD_T_NULL;
+	client_loc->receive_status_thread = NULL;
+	client_loc->delivery = NULL;
+	client_loc->device = device;
+	mutex_init(&client_loc->cache_mutex);
+	client_loc->path_cache = NULL;
+	client_loc->cache_generation = 0;
+	client_loc->np = NULL;
+	client_loc->np_state = INSTPROXY_NP_NOT_STARTED;
 
 	*client = client_loc;
 	return INSTPROXY_E_SUCCESS;
@@ -262,19 +366,61 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_free(instproxy_client_t
 
 	property_list_service_client_t parent = client->parent;
 	client->parent = NULL;
+	if (client->np) {
+		/* stops the notification thread before the cache goes away */
+		np_client_free(client->np);
+		client->np = NULL;
+	}
 	if (client->receive_status_thread) {
 		debug_info("joining receive_status_thread");
-		thread_join(client->receive_status_thread);
-		thread_free(client->receive_status_thread);
-		client->receive_status_thread = THREAD_T_NULL;
+		thread_future_wait(client->receive_status_thread);
+		thread_future_free(client->receive_status_thread);
+		client->receive_status_thread = NULL;
 	}
 	property_list_service_client_free(parent);
+	plist_free(client->path_cache);
+	delivery_queue_free(client->delivery);
+	mutex_destroy(&client->cache_mutex);
 	mutex_destroy(&client->mutex);
 	free(client);
 
 	return INSTPROXY_E_SUCCESS;
 }
 
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_set_delivery(instproxy_client_t client, uint32_t capacity, enum idevice_delivery_policy policy)
+{
+	delivery_queue_t queue = NULL;
+
+	if (!client || (policy != IDEVICE_DELIVERY_DROP_OLDEST && policy != IDEVICE_DELIVERY_BLOCK))
+		return INSTPROXY_E_INVALID_ARG;
+
+	if (client->receive_status_thread) {
+		if (!thread_future_done(client->receive_status_thread)) {
+			return INSTPROXY_E_OP_IN_PROGRESS;
+		}
+		thread_future_free(client->receive_status_thread);
+		client->receive_status_thread = NULL;
+	}
+
+	if (capacity > 0 && delivery_queue_new(&queue, capacity, policy, plist_free) < 0) {
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+	delivery_queue_free(client->delivery);
+	client->delivery = queue;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_get_dropped(instproxy_client_t client, uint64_t *dropped)
+{
+	if (!client || !dropped)
+		return INSTPROXY_E_INVALID_ARG;
+
+	*dropped = delivery_queue_get_dropped(client->delivery);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
 /**
  * Sends a command to the device.
  * Only used internally.
@@ -308,15 +454,19 @@ static instproxy_error_t instproxy_send_command(instproxy_client_t client, plist
  * the specified installation_proxy until it completes or an error occurs.
  *
  * If status_cb is not NULL, the callback function will be called each time
- * a status update or error message is received.
+ * a status update or error message is received. If take_cb is not NULL it is
+ * called after status_cb and may take over the status node instead of
+ * copying parts of it.
  *
  * @param client The connected installation proxy client
  * @param status_cb Pointer to a callback function or NULL
  * @param command Operation specificiation in plist. Will be passed to the
  *        status_cb callback.
- * @param user_data Callback data passed to status_cb.
+ * @param take_cb Pointer to a callback function that may take ownership of
+ *        the status, or NULL
+ * @param user_data Callback data passed to status_cb and take_cb.
  */
-static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client, plist_t command, instproxy_status_cb_t status_cb, void *user_data)
+static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client, plist_t command, instproxy_status_cb_t status_cb, instproxy_status_take_cb_t take_cb, void *user_data)
 {
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
 	int complete = 0;
@@ -332,6 +482,13 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 
 	instproxy_command_get_name(command, &command_name);
 
+	/* keep the receive buffer for the whole command, e.g. for large lookups */
+	instproxy_lock(client);
+	if (client->parent) {
+		property_list_service_hold_recv_buffer(client->parent, 1);
+	}
+	instproxy_unlock(client);
+
 	do {
 		/* receive status response */
 		instproxy_lock(client);
@@ -395,17 +552,44 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 				status_cb(command, node, user_data);
 			}
 
-			plist_free(node);
+			if (!take_cb || !take_cb(command, node, user_data)) {
+				plist_free(node);
+			}
 			node = NULL;
 		}
 	} while (!complete && client->parent);
 
+	instproxy_lock(client);
+	if (client->parent) {
+		property_list_service_hold_recv_buffer(client->parent, 0);
+	}
+	instproxy_unlock(client);
+
 	if (command_name)
 		free(command_name);
 
 	return res;
 }
 
+/**
+ * Moves a received status into the delivery queue of the client instead of
+ * invoking the status callback on the receiving thread.
+ */
+static int instproxy_queue_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	delivery_queue_push((delivery_queue_t)user_data, status);
+	return 1;
+}
+
+/**
+ * Invokes the status callback with a queued status, on the callback thread.
+ */
+static void instproxy_deliver_status(void *entry, void *user_data)
+{
+	struct instproxy_status_data *data = (struct instproxy_status_data*)user_data;
+	data->cbfunc(data->command, (plist_t)entry, data->user_data);
+}
+
 /**
  * Internally used "receive status" thread function that will call the specified
  * callback function when status update messages (or error messages) are
@@ -419,9 +603,16 @@ static instproxy_error_t instproxy_receive_status_loop(instproxy_client_t client
 static void* instproxy_receive_status_loop_thread(void* arg)
 {
 	struct instproxy_status_data *data = (struct instproxy_status_data*)arg;
+	delivery_queue_t queue = (data->cbfunc && !data->takefunc) ? data->client->delivery : NULL;
 
 	/* run until the command is complete or an error occurs */
-	(void)instproxy_receive_status_loop(data->client, data->command, data->cbfunc, data->user_data);
+	if (queue) {
+		(void)instproxy_receive_status_loop(data->client, data->command, NULL, instproxy_queue_status_cb, queue);
+		/* the callback thread uses data until everything queued is delivered */
+		delivery_queue_stop(queue);
+	} else {
+		(void)instproxy_receive_status_loop(data->client, data->command, data->cbfunc, data->takefunc, data->user_data);
+	}
 
 	/* cleanup */
 	instproxy_lock(data->client);
@@ -432,11 +623,6 @@ static void* instproxy_receive_status_loop_thread(void* arg)
 		plist_free(data->command);
 	}
 
-	if (data->client->receive_status_thread) {
-		thread_free(data->client->receive_status_thread);
-		data->client->receive_status_thread = THREAD_T_NULL;
-	}
-
 	instproxy_unlock(data->client);
 	free(data);
 
@@ -456,20 +642,27 @@ static void* instproxy_receive_status_loop_thread(void* arg)
  * @param async A boolean indicating if receive loop should be run
  *        asynchronously or block.
  * @param status_cb Pointer to a callback function or NULL.
- * @param user_data Callback data passed to status_cb.
+ * @param take_cb Pointer to a callback function that may take ownership of
+ *        received status nodes, or NULL.
+ * @param user_data Callback data passed to status_cb and take_cb.
  *
  * @return INSTPROXY_E_SUCCESS when the thread was created (async mode), or
  *         when the command completed successfully (sync).
  *         An INSTPROXY_E_* error value is returned if an error occurred.
  */
-static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
+static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, instproxy_status_take_cb_t take_cb, void *user_data)
 {
 	if (!client || !client->parent || !command) {
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
 	if (client->receive_status_thread) {
-		return INSTPROXY_E_OP_IN_PROGRESS;
+		if (!thread_future_done(client->receive_status_thread)) {
+			return INSTPROXY_E_OP_IN_PROGRESS;
+		}
+		/* previous async command has completed */
+		thread_future_free(client->receive_status_thread);
+		client->receive_status_thread = NULL;
 	}
 
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
@@ -480,20 +673,48 @@ static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_c
 			data->client = client;
 			data->command = plist_copy(command);
 			data->cbfunc = status_cb;
+			data->takefunc = take_cb;
 			data->user_data = user_data;
 
-			if (thread_new(&client->receive_status_thread, instproxy_receive_status_loop_thread, data) == 0) {
+			int queued = (client->delivery && status_cb && !take_cb);
+			if (queued && delivery_queue_start(client->delivery, instproxy_deliver_status, data) < 0) {
+				debug_info("could not start the callback thread");
+				plist_free(data->command);
+				free(data);
+				return res;
+			}
+
+			client->receive_status_thread = threadpool_submit(threadpool_shared(), instproxy_receive_status_loop_thread, data);
+			if (client->receive_status_thread) {
 				res = INSTPROXY_E_SUCCESS;
+			} else {
+				if (queued) {
+					delivery_queue_stop(client->delivery);
+				}
+				plist_free(data->command);
+				free(data);
 			}
 		}
 	} else {
 		/* sync mode as a fallback */
-		res = instproxy_receive_status_loop(client, command, status_cb, user_data);
+		res = instproxy_receive_status_loop(client, command, status_cb, take_cb, user_data);
 	}
 
 	return res;
 }
 
+static int instproxy_take_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	plist_t *last_status = (plist_t*)user_data;
+
+	if (*last_status) {
+		plist_free(*last_status);
+	}
+	*last_status = status;
+
+	return 1;
+}
+
 /**
  * Internal core function to send a command and process the response.
  *
@@ -502,18 +723,20 @@ static instproxy_error_t instproxy_receive_status_loop_with_callback(instproxy_c
  * @param async A boolean indicating whether the receive loop should be run
  *        asynchronously or block until completing the command.
  * @param status_cb Callback function to call if a command status is received.
- * @param user_data Callback data passed to status_cb.
+ * @param take_cb Callback function that may take ownership of a received
+ *        status, or NULL.
+ * @param user_data Callback data passed to status_cb and take_cb.
  *
  * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
  *     an error occurred.
  */
-static instproxy_error_t instproxy_perform_command(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
+static instproxy_error_t instproxy_perform_command_internal(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, instproxy_status_take_cb_t take_cb, void *user_data)
 {
 	if (!client || !client->parent || !command) {
 		return INSTPROXY_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
+	if (client->receive_status_thread && !thread_future_done(client->receive_status_thread)) {
 		return INSTPROXY_E_OP_IN_PROGRESS;
 	}
 
@@ -525,8 +748,36 @@ static instproxy_error_t instproxy_perform_command(instproxy_client_t client, pl
 	instproxy_unlock(client);
 
 	/* loop until status or error is received */
-	res = instproxy_receive_status_loop_with_callback(client, command, async, status_cb, user_data);
+	res = instproxy_receive_status_loop_with_callback(client, command, async, status_cb, take_cb, user_data);
+
+	return res;
+}
 
+static instproxy_error_t instproxy_perform_command(instproxy_client_t client, plist_t command, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
+{
+	return instproxy_perform_command_internal(client, command, async, status_cb, NULL, user_data);
+}
+
+/**
+ * Internally used function to send a command and take over the last received
+ * status message instead of copying parts of it in a callback.
+ *
+ * @param client The connected installation_proxy client
+ * @param command The command specification dictionary.
+ * @param status Pointer that will be set to the last status message received,
+ *        which must be freed with plist_free() by the caller.
+ *
+ * @return INSTPROXY_E_SUCCESS on success or an INSTPROXY_E_* error value if
+ *     an error occurred.
+ */
+static instproxy_error_t instproxy_perform_command_take_status(instproxy_client_t client, plist_t command, plist_t *status)
+{
+	*status = NULL;
+	instproxy_error_t res = instproxy_perform_command_internal(client, command, INSTPROXY_COMMAND_TYPE_SYNC, NULL, instproxy_take_status_cb, (void*)status);
+	if (res != INSTPROXY_E_SUCCESS && *status) {
+		plist_free(*status);
+		*status = NULL;
+	}
 	return res;
 }
 
@@ -552,23 +803,22 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_with_callback(instproxy_
 static void instproxy_append_current_list_to_result_cb(plist_t command, plist_t status, void *user_data)
 {
 	plist_t *result_array = (plist_t*)user_data;
-	uint64_t current_amount = 0;
+	uint32_t current_amount = 0;
 	plist_t current_list = NULL;
-	uint64_t i;
+	uint32_t i;
 
-	instproxy_status_get_current_list(status, NULL, NULL, &current_amount, &current_list);
+	/* use the list of the status directly instead of a copy of it */
+	current_list = plist_dict_get_item(status, "CurrentList");
+	if (current_list && plist_get_node_type(current_list) == PLIST_ARRAY) {
+		current_amount = plist_array_get_size(current_list);
+	}
 
 	debug_info("current_amount: %d", current_amount);
 
-	if (current_amount > 0) {
-		for (i = 0; current_list && (i < current_amount); i++) {
-			plist_t item = plist_array_get_item(current_list, i);
-			plist_array_append_item(*result_array, plist_copy(item));
-		}
+	for (i = 0; i < current_amount; i++) {
+		plist_t item = plist_array_get_item(current_list, i);
+		plist_array_append_item(*result_array, plist_copy(item));
 	}
-
-	if (current_list)
-		plist_free(current_list);
 }
 
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t client, plist_t client_options, plist_t *result)
@@ -598,14 +848,323 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse(instproxy_client_t clien
 	return res;
 }
 
-static void instproxy_copy_lookup_result_cb(plist_t command, plist_t status, void *user_data)
+struct instproxy_browse_stream_data {
+	instproxy_browse_cb_t app_cb;
+	void *user_data;
+};
+
+static void instproxy_browse_stream_cb(plist_t command, plist_t status, void *user_data)
 {
-	plist_t* result = (plist_t*)user_data;
+	struct instproxy_browse_stream_data *data = (struct instproxy_browse_stream_data*)user_data;
+	uint32_t i;
 
-	plist_t node = plist_dict_get_item(status, "LookupResult");
-	if (node) {
-		*result = plist_copy(node);
+	plist_t current_list = plist_dict_get_item(status, "CurrentList");
+	if (!current_list || plist_get_node_type(current_list) != PLIST_ARRAY) {
+		return;
+	}
+	for (i = 0; i < plist_array_get_size(current_list); i++) {
+		plist_t item = plist_array_get_item(current_list, i);
+		if (plist_get_node_type(item) == PLIST_DICT) {
+			data->app_cb(item, data->user_data);
+		}
+	}
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_stream(instproxy_client_t client, plist_t client_options, instproxy_browse_cb_t app_cb, void *user_data)
+{
+	if (!client || !client->parent || !app_cb)
+		return INSTPROXY_E_INVALID_ARG;
+
+	struct instproxy_browse_stream_data data = { app_cb, user_data };
+
+	plist_t command = plist_new_dict();
+	plist_dict_set_item(command, "Command", plist_new_string("Browse"));
+	if (client_options)
+		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
+
+	instproxy_error_t res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_browse_stream_cb, (void*)&data);
+
+	plist_free(command);
+
+	return res;
+}
+
+/**
+ * Internally used function that returns a new ReturnAttributes array with the
+ * given attributes and the required ones if they are missing.
+ */
+static plist_t instproxy_return_attributes_new(plist_t attributes, const char** required)
+{
+	plist_t result = plist_new_array();
+	uint32_t i;
+
+	if (attributes && plist_get_node_type(attributes) == PLIST_ARRAY) {
+		for (i = 0; i < plist_array_get_size(attributes); i++) {
+			plist_array_append_item(result, plist_copy(plist_array_get_item(attributes, i)));
+		}
+	}
+	for (i = 0; required && required[i]; i++) {
+		uint32_t j;
+		int found = 0;
+		for (j = 0; j < plist_array_get_size(result); j++) {
+			if (plist_string_val_compare(plist_array_get_item(result, j), required[i]) == 0) {
+				found = 1;
+				break;
+			}
+		}
+		if (!found) {
+			plist_array_append_item(result, plist_new_string(required[i]));
+		}
+	}
+
+	return result;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_attributes(instproxy_client_t client, const char* application_type, const char** attributes, instproxy_browse_cb_t app_cb, void *user_data)
+{
+	if (!client || !client->parent || !attributes || !app_cb)
+		return INSTPROXY_E_INVALID_ARG;
+
+	static const char* required[] = { "CFBundleIdentifier", NULL };
+	plist_t requested = plist_new_array();
+	int i;
+	for (i = 0; attributes[i]; i++) {
+		plist_array_append_item(requested, plist_new_string(attributes[i]));
+	}
+
+	plist_t client_options = instproxy_client_options_new();
+	if (application_type) {
+		plist_dict_set_item(client_options, "ApplicationType", plist_new_string(application_type));
+	}
+	plist_dict_set_item(client_options, "ReturnAttributes", instproxy_return_attributes_new(requested, required));
+	plist_free(requested);
+
+	instproxy_error_t res = instproxy_browse_stream(client, client_options, app_cb, user_data);
+
+	instproxy_client_options_free(client_options);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_new(instproxy_app_cache_t *cache)
+{
+	if (!cache)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_app_cache_t cache_loc = (instproxy_app_cache_t)calloc(1, sizeof(struct instproxy_app_cache_private));
+	if (!cache_loc)
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	cache_loc->apps = plist_new_dict();
+
+	*cache = cache_loc;
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_app_cache_free(instproxy_app_cache_t cache)
+{
+	if (!cache)
+		return INSTPROXY_E_INVALID_ARG;
+
+	free(cache->udid);
+	free(cache->options_xml);
+	plist_free(cache->apps);
+	free(cache);
+
+	return INSTPROXY_E_SUCCESS;
+}
+
+static void instproxy_app_cache_clear(instproxy_app_cache_t cache)
+{
+	plist_free(cache->apps);
+	cache->apps = plist_new_dict();
+}
+
+struct instproxy_browse_cached_data {
+	instproxy_app_cache_t cache;
+	instproxy_browse_cb_t app_cb;
+	void *user_data;
+	/* bundle identifiers reported by the device */
+	plist_t seen;
+	/* bundle identifiers that need to be looked up, NULL terminated */
+	char **stale;
+	uint32_t num_stale;
+	uint32_t stale_capacity;
+};
+
+static void instproxy_browse_cached_version_cb(plist_t app, void *user_data)
+{
+	struct instproxy_browse_cached_data *data = (struct instproxy_browse_cached_data*)user_data;
+
+	plist_t node = plist_dict_get_item(app, "CFBundleIdentifier");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		return;
+	}
+	const char *bundle_id = plist_get_string_ptr(node, NULL);
+	plist_dict_set_item(data->seen, bundle_id, plist_new_bool(1));
+
+	/* entries without a bundle version are always looked up again */
+	plist_t version = plist_dict_get_item(app, "CFBundleVersion");
+	plist_t cached = plist_dict_get_item(data->cache->apps, bundle_id);
+	if (version && cached) {
+		plist_t cached_version = plist_dict_get_item(cached, "CFBundleVersion");
+		if (cached_version && plist_compare_node_value(version, cached_version)) {
+			data->app_cb(cached, data->user_data);
+			return;
+		}
+	}
+
+	if (data->num_stale + 1 >= data->stale_capacity) {
+		uint32_t capacity = (data->stale_capacity) ? data->stale_capacity * 2 : 64;
+		char **stale = (char**)realloc(data->stale, capacity * sizeof(char*));
+		if (!stale) {
+			return;
+		}
+		data->stale = stale;
+		data->stale_capacity = capacity;
+	}
+	data->stale[data->num_stale++] = strdup(bundle_id);
+	data->stale[data->num_stale] = NULL;
+}
+
+static void instproxy_browse_cached_lookup_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct instproxy_browse_cached_data *data = (struct instproxy_browse_cached_data*)user_data;
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t app = NULL;
+
+	plist_t lookup_result = plist_dict_get_item(status, "LookupResult");
+	if (!lookup_result || plist_get_node_type(lookup_result) != PLIST_DICT) {
+		return;
+	}
+
+	plist_dict_new_iter(lookup_result, &iter);
+	if (!iter) {
+		return;
 	}
+	do {
+		key = NULL;
+		app = NULL;
+		plist_dict_next_item(lookup_result, iter, &key, &app);
+		if (key && app) {
+			plist_dict_set_item(data->cache->apps, key, plist_copy(app));
+			data->app_cb(plist_dict_get_item(data->cache->apps, key), data->user_data);
+		}
+		free(key);
+	} while (app);
+	free(iter);
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_browse_cached(instproxy_client_t client, instproxy_app_cache_t cache, plist_t client_options, instproxy_browse_cb_t app_cb, void *user_data)
+{
+	if (!client || !client->parent || !cache || !app_cb)
+		return INSTPROXY_E_INVALID_ARG;
+
+	static const char* version_attributes[] = { "CFBundleIdentifier", "CFBundleVersion", NULL };
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	struct instproxy_browse_cached_data data;
+	uint32_t i;
+
+	/* options for the lookup of changed applications */
+	plist_t lookup_options = (client_options) ? plist_copy(client_options) : instproxy_client_options_new();
+	plist_t attributes = plist_dict_get_item(lookup_options, "ReturnAttributes");
+	if (attributes) {
+		plist_dict_set_item(lookup_options, "ReturnAttributes", instproxy_return_attributes_new(attributes, version_attributes));
+	}
+
+	/* the cached entries are only valid for the same device and options */
+	const char *udid = client->parent->parent->connection->device->udid;
+	char *options_xml = NULL;
+	uint32_t options_xml_len = 0;
+	plist_to_xml(lookup_options, &options_xml, &options_xml_len);
+	if (!cache->udid || !udid || strcmp(cache->udid, udid) != 0 || !cache->options_xml || !options_xml || strcmp(cache->options_xml, options_xml) != 0) {
+		debug_info("application cache does not match, starting over");
+		instproxy_app_cache_clear(cache);
+		free(cache->udid);
+		cache->udid = (udid) ? strdup(udid) : NULL;
+		free(cache->options_xml);
+		cache->options_xml = options_xml;
+	} else {
+		free(options_xml);
+	}
+
+	/* only fetch the bundle identifiers and versions in the browse */
+	plist_t browse_options = (client_options) ? plist_copy(client_options) : instproxy_client_options_new();
+	plist_dict_set_item(browse_options, "ReturnAttributes", instproxy_return_attributes_new(NULL, version_attributes));
+
+	memset(&data, '\0', sizeof(data));
+	data.cache = cache;
+	data.app_cb = app_cb;
+	data.user_data = user_data;
+	data.seen = plist_new_dict();
+
+	res = instproxy_browse_stream(client, browse_options, instproxy_browse_cached_version_cb, &data);
+	instproxy_client_options_free(browse_options);
+
+	if (res == INSTPROXY_E_SUCCESS && data.num_stale > 0) {
+		debug_info("%u of %u applications changed", data.num_stale, plist_dict_get_size(data.seen));
+
+		plist_t appid_array = plist_new_array();
+		for (i = 0; i < data.num_stale; i++) {
+			plist_array_append_item(appid_array, plist_new_string(data.stale[i]));
+		}
+		plist_dict_set_item(lookup_options, "BundleIDs", appid_array);
+
+		plist_t command = plist_new_dict();
+		plist_dict_set_item(command, "Command", plist_new_string("Lookup"));
+		plist_dict_set_item(command, "ClientOptions", plist_copy(lookup_options));
+
+		res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_browse_cached_lookup_cb, (void*)&data);
+
+		plist_free(command);
+	}
+
+	if (res == INSTPROXY_E_SUCCESS) {
+		/* drop entries of applications that are gone */
+		plist_t removed = plist_new_array();
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(cache->apps, &iter);
+		if (iter) {
+			char *key = NULL;
+			plist_t app = NULL;
+			do {
+				key = NULL;
+				app = NULL;
+				plist_dict_next_item(cache->apps, iter, &key, &app);
+				if (key && !plist_dict_get_item(data.seen, key)) {
+					plist_array_append_item(removed, plist_new_string(key));
+				}
+				free(key);
+			} while (app);
+			free(iter);
+		}
+		for (i = 0; i < plist_array_get_size(removed); i++) {
+			plist_dict_remove_item(cache->apps, plist_get_string_ptr(plist_array_get_item(removed, i), NULL));
+		}
+		plist_free(removed);
+	} else {
+		instproxy_app_cache_clear(cache);
+	}
+
+	for (i = 0; i < data.num_stale; i++) {
+		free(data.stale[i]);
+	}
+	free(data.stale);
+	plist_free(data.seen);
+	plist_free(lookup_options);
+
+	return res;
+}
+
+/**
+ * Internally used function to get the "LookupResult" of a status message.
+ * libplist can't detach a node from its parent so this is the one copy made.
+ */
+static plist_t instproxy_status_get_lookup_result(plist_t status)
+{
+	plist_t node = (status) ? plist_dict_get_item(status, "LookupResult") : NULL;
+	return (node) ? plist_copy(node) : NULL;
 }
 
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t client, const char** appids, plist_t client_options, plist_t *result)
@@ -642,12 +1201,13 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t clien
 		plist_dict_set_item(command, "ClientOptions", node);
 	}
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result);
+	plist_t status = NULL;
+	res = instproxy_perform_command_take_status(client, command, &status);
 
 	if (res == INSTPROXY_E_SUCCESS) {
+		lookup_result = instproxy_status_get_lookup_result(status);
+		plist_free(status);
 		*result = lookup_result;
-	} else {
-		plist_free(lookup_result);
 	}
 
 	plist_free(command);
@@ -655,7 +1215,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup(instproxy_client_t clien
 	return res;
 }
 
-LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data)
+static instproxy_error_t instproxy_install_internal(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_command_type_t async, instproxy_status_cb_t status_cb, void *user_data)
 {
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
 
@@ -665,13 +1225,538 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "PackagePath", plist_new_string(pkg_path));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+	/* the bundle identifier is only known to the device */
+	instproxy_path_cache_invalidate(client, NULL);
+	res = instproxy_perform_command(client, command, async, status_cb, user_data);
 
 	plist_free(command);
 
 	return res;
 }
 
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data)
+{
+	return instproxy_install_internal(client, pkg_path, client_options, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
+}
+
+/**
+ * Internally used function that maps a local package into memory, or reads
+ * it if mapping is not available.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int instproxy_package_open(struct instproxy_package *package, const char *local_path)
+{
+	struct stat st;
+
+	memset(package, '\0', sizeof(struct instproxy_package));
+
+	FILE *f = fopen(local_path, "rb");
+	if (!f) {
+		debug_info("could not open %s", local_path);
+		return -1;
+	}
+	if (fstat(fileno(f), &st) != 0 || st.st_size <= 0 || (uint64_t)st.st_size > (uint64_t)(size_t)-1) {
+		debug_info("could not get a usable size for %s", local_path);
+		fclose(f);
+		return -1;
+	}
+	package->size = (size_t)st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+	void *map = mmap(NULL, package->size, PROT_READ, MAP_SHARED, fileno(f), 0);
+	if (map != MAP_FAILED) {
+		package->data = (const char*)map;
+		package->mapped = 1;
+		fclose(f);
+		mutex_init(&package->mutex);
+		return 0;
+	}
+	debug_info("mmap failed (%s), reading the file instead", strerror(errno));
+#endif
+
+	char *buf = (char*)malloc(package->size);
+	if (!buf || fread(buf, 1, package->size, f) != package->size) {
+		debug_info("could not read %s", local_path);
+		free(buf);
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	package->data = buf;
+	mutex_init(&package->mutex);
+
+	return 0;
+}
+
+static void instproxy_package_close(struct instproxy_package *package)
+{
+	if (!package->data)
+		return;
+#ifdef HAVE_SYS_MMAN_H
+	if (package->mapped) {
+		munmap((void*)package->data, package->size);
+	} else
+#endif
+	free((void*)package->data);
+	package->data = NULL;
+	mutex_destroy(&package->mutex);
+}
+
+/**
+ * Internally used function that returns the SHA-1 (hash_len 20) or SHA-256
+ * (hash_len 32) digest of a package. It is computed once and shared by all
+ * users of the package.
+ *
+ * @return Pointer to the digest or NULL if hash_len is not supported.
+ */
+static const unsigned char* instproxy_package_get_hash(struct instproxy_package *package, uint32_t hash_len)
+{
+	const unsigned char *hash = NULL;
+
+	if (hash_len != 20 && hash_len != 32) {
+		return NULL;
+	}
+
+	mutex_lock(&package->mutex);
+	if (hash_len == 20 && package->have_sha1) {
+		hash = package->sha1;
+	} else if (hash_len == 32 && package->have_sha256) {
+		hash = package->sha256;
+	} else {
+		unsigned char *out = (hash_len == 20) ? package->sha1 : package->sha256;
+#ifdef HAVE_OPENSSL
+		if (hash_len == 20) {
+			SHA1((const unsigned char*)package->data, package->size, out);
+		} else {
+			SHA256((const unsigned char*)package->data, package->size, out);
+		}
+		hash = out;
+#else
+		gcry_md_hash_buffer((hash_len == 20) ? GCRY_MD_SHA1 : GCRY_MD_SHA256, out, package->data, package->size);
+		hash = out;
+#endif
+		if (hash_len == 20) {
+			package->have_sha1 = 1;
+		} else {
+			package->have_sha256 = 1;
+		}
+	}
+	mutex_unlock(&package->mutex);
+
+	return hash;
+}
+
+/**
+ * Internally used function that checks if the file at remote_path on the
+ * device has the same size and contents as the package.
+ *
+ * @return 1 if the files match, 0 otherwise.
+ */
+static int instproxy_staged_file_matches(afc_client_t afc, const char *remote_path, struct instproxy_package *package)
+{
+	afc_file_info_t info;
+	char *remote_hash = NULL;
+	uint32_t remote_hash_len = 0;
+	int match = 0;
+
+	if (afc_get_file_info_struct(afc, remote_path, &info) != AFC_E_SUCCESS || info.type != AFC_FILE_TYPE_REGULAR || info.size != package->size) {
+		return 0;
+	}
+	if (afc_get_file_hash(afc, remote_path, &remote_hash, &remote_hash_len) != AFC_E_SUCCESS) {
+		debug_info("device can't hash %s, uploading it again", remote_path);
+		return 0;
+	}
+	const unsigned char *local_hash = instproxy_package_get_hash(package, remote_hash_len);
+	if (local_hash) {
+		match = (memcmp(local_hash, remote_hash, remote_hash_len) == 0);
+	}
+	free(remote_hash);
+
+	return match;
+}
+
+/**
+ * Internally used function that uploads a package to the device through
+ * pipelined AFC writes.
+ *
+ * @param progress_cb Called after each queued chunk, or NULL.
+ */
+static instproxy_error_t instproxy_upload_package(afc_client_t afc, const char *remote_path, struct instproxy_package *package, void (*progress_cb)(uint64_t done, uint64_t total, void *user_data), void *user_data)
+{
+	uint64_t handle = 0;
+	instproxy_error_t res = INSTPROXY_E_SUCCESS;
+	size_t done = 0;
+
+	if (afc_file_open(afc, remote_path, AFC_FOPEN_WRONLY, &handle) != AFC_E_SUCCESS || !handle) {
+		debug_info("could not open %s on the device", remote_path);
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	while (done < package->size) {
+		size_t chunk = package->size - done;
+		if (chunk > INSTPROXY_UPLOAD_CHUNK_SIZE)
+			chunk = INSTPROXY_UPLOAD_CHUNK_SIZE;
+		uint32_t queued = 0;
+		if (afc_file_write_async(afc, handle, package->data + done, (uint32_t)chunk, &queued) != AFC_E_SUCCESS || queued != chunk) {
+			debug_info("write to %s failed", remote_path);
+			res = INSTPROXY_E_UNKNOWN_ERROR;
+			break;
+		}
+		done += chunk;
+		if (progress_cb) {
+			progress_cb(done, package->size, user_data);
+		}
+	}
+
+	if (afc_file_flush(afc) != AFC_E_SUCCESS) {
+		res = INSTPROXY_E_UNKNOWN_ERROR;
+	}
+	if (afc_file_close(afc, handle) != AFC_E_SUCCESS) {
+		res = INSTPROXY_E_UNKNOWN_ERROR;
+	}
+
+	return res;
+}
+
+/**
+ * Internally used function that stages a package in PublicStaging unless an
+ * identical copy is already there.
+ *
+ * @param remote_path Pointer that will be set to the AFC path of the staged
+ *        package on success. Free with free().
+ */
+static instproxy_error_t instproxy_stage_package(afc_client_t afc, const char *local_path, struct instproxy_package *package, char **remote_path, void (*progress_cb)(uint64_t done, uint64_t total, void *user_data), void *user_data)
+{
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+
+	const char *filename = strrchr(local_path, '/');
+#ifdef WIN32
+	const char *bs = strrchr(local_path, '\\');
+	if (bs && (!filename || bs > filename))
+		filename = bs;
+#endif
+	filename = (filename) ? filename + 1 : local_path;
+
+	char *path = (char*)malloc(strlen(INSTPROXY_STAGING_PATH) + 1 + strlen(filename) + 1);
+	if (!path) {
+		return INSTPROXY_E_UNKNOWN_ERROR;
+	}
+	strcpy(path, INSTPROXY_STAGING_PATH);
+	strcat(path, "/");
+	strcat(path, filename);
+
+	/* the directory usually exists already */
+	afc_make_directory(afc, INSTPROXY_STAGING_PATH);
+
+	if (instproxy_staged_file_matches(afc, path, package)) {
+		debug_info("%s is already staged, skipping upload", path);
+		if (progress_cb) {
+			progress_cb(package->size, package->size, user_data);
+		}
+		res = INSTPROXY_E_SUCCESS;
+	} else {
+		debug_info("uploading %s to %s", local_path, path);
+		res = instproxy_upload_package(afc, path, package, progress_cb, user_data);
+	}
+
+	if (res == INSTPROXY_E_SUCCESS) {
+		*remote_path = path;
+	} else {
+		free(path);
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install_from_file(instproxy_client_t client, afc_client_t afc, const char *local_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data)
+{
+	if (!client || !client->parent || !local_path)
+		return INSTPROXY_E_INVALID_ARG;
+
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	afc_client_t own_afc = NULL;
+	char *remote_path = NULL;
+	struct instproxy_package package;
+
+	if (instproxy_package_open(&package, local_path) < 0) {
+		return INSTPROXY_E_INVALID_ARG;
+	}
+
+	if (!afc) {
+		idevice_t device = client->parent->parent->connection->device;
+		if (afc_client_start_service(device, &own_afc, "instproxy") != AFC_E_SUCCESS) {
+			debug_info("could not start the afc service");
+			instproxy_package_close(&package);
+			return INSTPROXY_E_CONN_FAILED;
+		}
+		afc = own_afc;
+	}
+
+	res = instproxy_stage_package(afc, local_path, &package, &remote_path, NULL, NULL);
+
+	if (own_afc) {
+		afc_client_free(own_afc);
+	}
+	instproxy_package_close(&package);
+
+	if (res == INSTPROXY_E_SUCCESS) {
+		res = instproxy_install(client, remote_path, client_options, status_cb, user_data);
+	}
+	free(remote_path);
+
+	return res;
+}
+
+struct instproxy_multi_install {
+	const char *local_path;
+	struct instproxy_package package;
+	const char **udids;
+	unsigned int num_devices;
+	plist_t client_options;
+	unsigned int max_per_group;
+	/* group index of each device and number of active installs per group */
+	unsigned int *group_of;
+	unsigned int *group_active;
+	/* 0 = pending, 1 = running, 2 = done */
+	int *state;
+	instproxy_error_t *results;
+	instproxy_device_progress_cb_t progress_cb;
+	void *user_data;
+	mutex_t mutex;
+	cond_t cond;
+	/* serializes the progress callbacks */
+	mutex_t progress_mutex;
+};
+
+struct instproxy_multi_device {
+	struct instproxy_multi_install *job;
+	const char *udid;
+	int last_percent;
+};
+
+static void instproxy_multi_report(struct instproxy_multi_device *dev, const char *status, int percent)
+{
+	struct instproxy_multi_install *job = dev->job;
+
+	if (!job->progress_cb)
+		return;
+	mutex_lock(&job->progress_mutex);
+	job->progress_cb(dev->udid, status, percent, job->user_data);
+	mutex_unlock(&job->progress_mutex);
+}
+
+static void instproxy_multi_upload_progress_cb(uint64_t done, uint64_t total, void *user_data)
+{
+	struct instproxy_multi_device *dev = (struct instproxy_multi_device*)user_data;
+	int percent = (int)((done * 100) / total);
+
+	if (percent != dev->last_percent) {
+		dev->last_percent = percent;
+		instproxy_multi_report(dev, "StagingPackage", percent);
+	}
+}
+
+static void instproxy_multi_status_cb(plist_t command, plist_t status, void *user_data)
+{
+	struct instproxy_multi_device *dev = (struct instproxy_multi_device*)user_data;
+	char *name = NULL;
+	int percent = -1;
+
+	instproxy_status_get_name(status, &name);
+	instproxy_status_get_percent_complete(status, &percent);
+	if (name) {
+		if (!strcmp(name, "Complete")) {
+			percent = 100;
+		}
+		instproxy_multi_report(dev, name, percent);
+		free(name);
+	}
+}
+
+static instproxy_error_t instproxy_multi_install_device(struct instproxy_multi_install *job, const char *udid)
+{
+	struct instproxy_multi_device dev = { job, udid, -1 };
+	idevice_t device = NULL;
+	instproxy_client_t client = NULL;
+	afc_client_t afc = NULL;
+	char *remote_path = NULL;
+	instproxy_error_t res = INSTPROXY_E_CONN_FAILED;
+
+	instproxy_multi_report(&dev, "Connecting", -1);
+
+	if (idevice_new_with_options(&device, udid, IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK) != IDEVICE_E_SUCCESS) {
+		debug_info("device %s not found", udid);
+		goto leave;
+	}
+	if (afc_client_start_service(device, &afc, "instproxy") != AFC_E_SUCCESS) {
+		debug_info("could not start the afc service on %s", udid);
+		goto leave;
+	}
+
+	res = instproxy_stage_package(afc, job->local_path, &job->package, &remote_path, instproxy_multi_upload_progress_cb, &dev);
+	afc_client_free(afc);
+	afc = NULL;
+	if (res != INSTPROXY_E_SUCCESS) {
+		goto leave;
+	}
+
+	res = instproxy_client_start_service(device, &client, "instproxy");
+	if (res != INSTPROXY_E_SUCCESS) {
+		debug_info("could not start the installation_proxy service on %s", udid);
+		goto leave;
+	}
+	res = instproxy_install_internal(client, remote_path, job->client_options, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_multi_status_cb, &dev);
+
+leave:
+	if (res != INSTPROXY_E_SUCCESS) {
+		instproxy_multi_report(&dev, "Failed", -1);
+	}
+	free(remote_path);
+	if (client)
+		instproxy_client_free(client);
+	if (afc)
+		afc_client_free(afc);
+	if (device)
+		idevice_free(device);
+
+	return res;
+}
+
+static void* instproxy_multi_install_worker(void *arg)
+{
+	struct instproxy_multi_install *job = (struct instproxy_multi_install*)arg;
+
+	mutex_lock(&job->mutex);
+	while (1) {
+		unsigned int i;
+		int pending = 0;
+		int next = -1;
+		for (i = 0; i < job->num_devices; i++) {
+			if (job->state[i] != 0)
+				continue;
+			pending = 1;
+			if (job->max_per_group == 0 || job->group_active[job->group_of[i]] < job->max_per_group) {
+				next = (int)i;
+				break;
+			}
+		}
+		if (!pending) {
+			break;
+		}
+		if (next < 0) {
+			/* all pending devices are in busy groups */
+			cond_wait(&job->cond, &job->mutex);
+			continue;
+		}
+		job->state[next] = 1;
+		job->group_active[job->group_of[next]]++;
+		mutex_unlock(&job->mutex);
+
+		instproxy_error_t res = instproxy_multi_install_device(job, job->udids[next]);
+
+		mutex_lock(&job->mutex);
+		job->results[next] = res;
+		job->state[next] = 2;
+		job->group_active[job->group_of[next]]--;
+		cond_broadcast(&job->cond);
+	}
+	mutex_unlock(&job->mutex);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API instproxy_error_t instproxy_install_on_devices(const char *local_path, const char **udids, const char **groups, unsigned int num_devices, plist_t client_options, unsigned int max_concurrent, unsigned int max_per_group, instproxy_device_progress_cb_t progress_cb, void *user_data, instproxy_error_t *results)
+{
+	if (!local_path || !udids || num_devices == 0)
+		return INSTPROXY_E_INVALID_ARG;
+
+	struct instproxy_multi_install job;
+	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
+	thread_future_t *workers = NULL;
+	unsigned int num_workers = 0;
+	unsigned int i, j;
+
+	memset(&job, '\0', sizeof(job));
+	if (instproxy_package_open(&job.package, local_path) < 0) {
+		return INSTPROXY_E_INVALID_ARG;
+	}
+	job.local_path = local_path;
+	job.udids = udids;
+	job.num_devices = num_devices;
+	job.client_options = client_options;
+	job.max_per_group = (groups) ? max_per_group : 0;
+	job.progress_cb = progress_cb;
+	job.user_data = user_data;
+	job.group_of = (unsigned int*)calloc(num_devices, sizeof(unsigned int));
+	job.group_active = (unsigned int*)calloc(num_devices, sizeof(unsigned int));
+	job.state = (int*)calloc(num_devices, sizeof(int));
+	job.results = (instproxy_error_t*)calloc(num_devices, sizeof(instproxy_error_t));
+	if (max_concurrent == 0 || max_concurrent > num_devices)
+		max_concurrent = num_devices;
+	workers = (thread_future_t*)calloc(max_concurrent, sizeof(thread_future_t));
+	if (!job.group_of || !job.group_active || !job.state || !job.results || !workers) {
+		goto leave;
+	}
+
+	/* devices without a group each get one of their own */
+	for (i = 0; i < num_devices; i++) {
+		job.group_of[i] = i;
+		job.results[i] = INSTPROXY_E_UNKNOWN_ERROR;
+		if (!groups || !groups[i])
+			continue;
+		for (j = 0; j < i; j++) {
+			if (groups[j] && !strcmp(groups[i], groups[j])) {
+				job.group_of[i] = job.group_of[j];
+				break;
+			}
+		}
+	}
+
+	mutex_init(&job.mutex);
+	cond_init(&job.cond);
+	mutex_init(&job.progress_mutex);
+
+	for (i = 0; i < max_concurrent; i++) {
+		workers[num_workers] = threadpool_submit(threadpool_shared(), instproxy_multi_install_worker, &job);
+		if (!workers[num_workers]) {
+			debug_info("could not start worker %u", i);
+			break;
+		}
+		num_workers++;
+	}
+	if (num_workers == 0) {
+		/* do it without threads then */
+		instproxy_multi_install_worker(&job);
+	}
+	for (i = 0; i < num_workers; i++) {
+		thread_future_wait(workers[i]);
+		thread_future_free(workers[i]);
+	}
+
+	mutex_destroy(&job.progress_mutex);
+	cond_destroy(&job.cond);
+	mutex_destroy(&job.mutex);
+
+	res = INSTPROXY_E_SUCCESS;
+	for (i = 0; i < num_devices; i++) {
+		if (job.results[i] != INSTPROXY_E_SUCCESS && res == INSTPROXY_E_SUCCESS)
+			res = job.results[i];
+		if (results)
+			results[i] = job.results[i];
+	}
+
+leave:
+	free(workers);
+	free(job.results);
+	free(job.state);
+	free(job.group_active);
+	free(job.group_of);
+	instproxy_package_close(&job.package);
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API instproxy_error_t instproxy_upgrade(instproxy_client_t client, const char *pkg_path, plist_t client_options, instproxy_status_cb_t status_cb, void *user_data)
 {
 	instproxy_error_t res = INSTPROXY_E_UNKNOWN_ERROR;
@@ -682,6 +1767,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_upgrade(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "PackagePath", plist_new_string(pkg_path));
 
+	instproxy_path_cache_invalidate(client, NULL);
 	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
 
 	plist_free(command);
@@ -699,6 +1785,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_uninstall(instproxy_client_t cl
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
+	instproxy_path_cache_invalidate(client, appid);
 	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
 
 	plist_free(command);
@@ -715,7 +1802,13 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_lookup_archives(instproxy_clien
 	if (client_options)
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)result);
+	plist_t status = NULL;
+	res = instproxy_perform_command_take_status(client, command, &status);
+
+	if (res == INSTPROXY_E_SUCCESS) {
+		*result = instproxy_status_get_lookup_result(status);
+		plist_free(status);
+	}
 
 	plist_free(command);
 
@@ -749,6 +1842,7 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_restore(instproxy_client_t clie
 		plist_dict_set_item(command, "ClientOptions", plist_copy(client_options));
 	plist_dict_set_item(command, "ApplicationIdentifier", plist_new_string(appid));
 
+	instproxy_path_cache_invalidate(client, appid);
 	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_ASYNC, status_cb, user_data);
 
 	plist_free(command);
@@ -797,12 +1891,13 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_check_capabilities_match(instpr
 		plist_dict_set_item(command, "Capabilities", capabilities_array);
 	}
 
-	res = instproxy_perform_command(client, command, INSTPROXY_COMMAND_TYPE_SYNC, instproxy_copy_lookup_result_cb, (void*)&lookup_result);
+	plist_t status = NULL;
+	res = instproxy_perform_command_take_status(client, command, &status);
 
 	if (res == INSTPROXY_E_SUCCESS) {
+		lookup_result = instproxy_status_get_lookup_result(status);
+		plist_free(status);
 		*result = lookup_result;
-	} else {
-		plist_free(lookup_result);
 	}
 
 	plist_free(command);
@@ -994,6 +2089,25 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_iden
 		return INSTPROXY_E_INVALID_ARG;
 
 	plist_t apps = NULL;
+	int use_cache = 0;
+	uint32_t generation = 0;
+
+	mutex_lock(&client->cache_mutex);
+	use_cache = instproxy_path_cache_usable(client);
+	generation = client->cache_generation;
+	if (use_cache && client->path_cache) {
+		char *cached = NULL;
+		plist_t node = plist_dict_get_item(client->path_cache, appid);
+		if (node) {
+			plist_get_string_val(node, &cached);
+		}
+		if (cached) {
+			mutex_unlock(&client->cache_mutex);
+			*path = cached;
+			return INSTPROXY_E_SUCCESS;
+		}
+	}
+	mutex_unlock(&client->cache_mutex);
 
 	// create client options for any application types
 	plist_t client_opts = instproxy_client_options_new();
@@ -1053,6 +2167,17 @@ LIBIMOBILEDEVICE_API instproxy_error_t instproxy_client_get_path_for_bundle_iden
 
 	*path = ret;
 
+	if (use_cache) {
+		mutex_lock(&client->cache_mutex);
+		if (client->np_state == INSTPROXY_NP_RUNNING && client->cache_generation == generation) {
+			if (!client->path_cache) {
+				client->path_cache = plist_new_dict();
+			}
+			plist_dict_set_item(client->path_cache, appid, plist_new_string(ret));
+		}
+		mutex_unlock(&client->cache_mutex);
+	}
+
 	if (path_str) {
 		free(path_str);
 	}
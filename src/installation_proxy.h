@@ -24,13 +24,54 @@
 #define __INSTALLATION_PROXY_H
 
 #include "libimobiledevice/installation_proxy.h"
+#include "libimobiledevice/notification_proxy.h"
 #include "property_list_service.h"
+#include "delivery.h"
 #include "common/thread.h"
 
+/* AFC directory install packages are staged in */
+#define INSTPROXY_STAGING_PATH "PublicStaging"
+
+/* size of the pipelined AFC writes used to stage packages */
+#define INSTPROXY_UPLOAD_CHUNK_SIZE (1024*1024)
+
+/* a package to stage, mapped read-only and shared by all upload workers */
+struct instproxy_package {
+	const char *data;
+	size_t size;
+	int mapped;
+	/* protects the lazily computed digests */
+	mutex_t mutex;
+	int have_sha1;
+	int have_sha256;
+	unsigned char sha1[20];
+	unsigned char sha256[32];
+};
+
 struct instproxy_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
-	THREAD_T receive_status_thread;
+	thread_future_t receive_status_thread;
+	/* set with instproxy_set_delivery() to call back on another thread */
+	delivery_queue_t delivery;
+	idevice_t device;
+	/* bundle identifier -> executable path, protected by cache_mutex */
+	mutex_t cache_mutex;
+	plist_t path_cache;
+	/* bumped on every invalidation, so a lookup racing with one isn't cached */
+	uint32_t cache_generation;
+	/* reports apps installed or removed by others, the cache is only used while it runs */
+	np_client_t np;
+	int np_state;
+};
+
+struct instproxy_app_cache_private {
+	/* device the cached entries belong to */
+	char *udid;
+	/* client options (as XML) the cached entries were looked up with */
+	char *options_xml;
+	/* bundle identifier -> application info */
+	plist_t apps;
 };
 
 #endif
@@ -32,11 +32,13 @@
 #define __USE_GNU 1
 #include <stdio.h>
 #include <ctype.h>
+#include <inttypes.h>
 #include <plist/plist.h>
 
 #include "property_list_service.h"
 #include "lockdown.h"
 #include "idevice.h"
+#include "trace.h"
 #include "common/debug.h"
 #include "common/userpref.h"
 #include "common/utils.h"
@@ -233,6 +235,9 @@ static lockdownd_error_t lockdown_check_result(plist_t dict, const char *query_m
  * @param label The value for the label key
  *
  */
+static lockdownd_error_t lockdownd_receive_locked(lockdownd_client_t client, plist_t *plist);
+static lockdownd_error_t lockdownd_send_locked(lockdownd_client_t client, plist_t plist);
+
 static void plist_dict_add_label(plist_t plist, const char *label)
 {
 	if (plist && label) {
@@ -260,14 +265,17 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_stop_session(lockdownd_client_t
 
 	debug_info("stopping session %s", session_id);
 
-	ret = lockdownd_send(client, dict);
-
+	/* nothing else may be sent until SSL is off again */
+	mutex_lock(&client->mutex);
+	ret = lockdownd_send_locked(client, dict);
 	plist_free(dict);
 	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		ret = lockdownd_receive_locked(client, &dict);
+	}
 
 	if (!dict) {
+		mutex_unlock(&client->mutex);
 		debug_info("LOCKDOWN_E_PLIST_ERROR");
 		return LOCKDOWN_E_PLIST_ERROR;
 	}
@@ -289,10 +297,111 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_stop_session(lockdownd_client_t
 		property_list_service_disable_ssl(client->parent);
 		client->ssl_enabled = 0;
 	}
+	mutex_unlock(&client->mutex);
 
 	return ret;
 }
 
+/**
+ * Returns the statistics entry for a request type, creating it if needed.
+ */
+static struct lockdownd_request_stats* lockdownd_request_stats_get(lockdownd_client_t client, const char *request)
+{
+	struct lockdownd_request_stats *stats = client->request_stats;
+	while (stats) {
+		if (!strcmp(stats->request, request)) {
+			return stats;
+		}
+		stats = stats->next;
+	}
+	stats = (struct lockdownd_request_stats*)calloc(1, sizeof(struct lockdownd_request_stats));
+	if (!stats) {
+		return NULL;
+	}
+	stats->request = strdup(request);
+	if (!stats->request) {
+		free(stats);
+		return NULL;
+	}
+	stats->next = client->request_stats;
+	client->request_stats = stats;
+	return stats;
+}
+
+/**
+ * Remembers the start time of a request that was just sent.
+ */
+static void lockdownd_request_stats_sent(lockdownd_client_t client, plist_t plist)
+{
+	plist_t node = plist_dict_get_item(plist, "Request");
+	const char *request = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	if (!request || client->num_pending >= LOCKDOWN_STATS_MAX_PENDING) {
+		return;
+	}
+	struct lockdownd_request_stats *stats = lockdownd_request_stats_get(client, request);
+	if (!stats) {
+		return;
+	}
+	TRACE_PROBE2(lockdown__request, client->udid, request);
+	client->pending[client->num_pending].stats = stats;
+	client->pending[client->num_pending].start = time_monotonic_usec();
+	client->num_pending++;
+}
+
+/**
+ * Accounts the latency of the request a received reply belongs to. Replies
+ * echo the request type, so the oldest pending request of the same type is
+ * used; replies without it are matched with the oldest pending request.
+ */
+static void lockdownd_request_stats_received(lockdownd_client_t client, plist_t plist)
+{
+	unsigned int i;
+
+	if (client->num_pending == 0) {
+		return;
+	}
+	plist_t node = plist_dict_get_item(plist, "Request");
+	const char *request = (node && plist_get_node_type(node) == PLIST_STRING) ? plist_get_string_ptr(node, NULL) : NULL;
+	for (i = 0; request && i < client->num_pending; i++) {
+		if (!strcmp(client->pending[i].stats->request, request)) {
+			break;
+		}
+	}
+	if (!request || i == client->num_pending) {
+		i = 0;
+	}
+	struct lockdownd_request_stats *stats = client->pending[i].stats;
+	uint64_t now = time_monotonic_usec();
+	stats->count++;
+	idevice_stats_record_latency(stats->latency, now - client->pending[i].start);
+	TRACE_PROBE3(lockdown__reply, client->udid, stats->request, now - client->pending[i].start);
+	if (trace_enabled()) {
+		trace_span_real("lockdownd", stats->request, client->pending[i].start, now);
+	}
+	client->num_pending--;
+	memmove(&client->pending[i], &client->pending[i+1], (client->num_pending - i) * sizeof(struct lockdownd_pending_request));
+}
+
+/**
+ * Frees the request statistics of a client, writing them to stderr first if
+ * IMOBILEDEVICE_STATS is set.
+ */
+static void lockdownd_request_stats_free(lockdownd_client_t client)
+{
+	while (client->request_stats) {
+		struct lockdownd_request_stats *stats = client->request_stats;
+		client->request_stats = stats->next;
+		if (idevice_stats_enabled()) {
+			char label[64];
+			snprintf(label, sizeof(label), "lockdownd %s (%" PRIu64 ")", stats->request, stats->count);
+			idevice_stats_print_histogram(stderr, label, stats->latency);
+		}
+		free(stats->request);
+		free(stats);
+	}
+	client->num_pending = 0;
+}
+
 static lockdownd_error_t lockdownd_client_free_simple(lockdownd_client_t client)
 {
 	if (!client)
@@ -300,6 +409,8 @@ static lockdownd_error_t lockdownd_client_free_simple(lockdownd_client_t client)
 
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
+	lockdownd_request_stats_free(client);
+
 	if (client->parent) {
 		if (property_list_service_client_free(client->parent) == PROPERTY_LIST_SERVICE_E_SUCCESS) {
 			ret = LOCKDOWN_E_SUCCESS;
@@ -316,6 +427,7 @@ static lockdownd_error_t lockdownd_client_free_simple(lockdownd_client_t client)
 	if (client->label) {
 		free(client->label);
 	}
+	mutex_destroy(&client->mutex);
 
 	free(client);
 	client = NULL;
@@ -328,6 +440,11 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_free(lockdownd_client_t
 	if (!client)
 		return LOCKDOWN_E_INVALID_ARG;
 
+	if (client->pool_device) {
+		/* pooled sessions are owned by the device */
+		return lockdownd_client_release(client);
+	}
+
 	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
 
 	if (client->session_id) {
@@ -349,12 +466,39 @@ LIBIMOBILEDEVICE_API void lockdownd_client_set_label(lockdownd_client_t client,
 	}
 }
 
+/**
+ * Receives a plist, the caller has to hold the client lock.
+ */
+static lockdownd_error_t lockdownd_receive_locked(lockdownd_client_t client, plist_t *plist)
+{
+	lockdownd_error_t ret = lockdownd_error(property_list_service_receive_plist(client->parent, plist));
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		lockdownd_request_stats_received(client, *plist);
+	}
+	return ret;
+}
+
+/**
+ * Sends a plist, the caller has to hold the client lock.
+ */
+static lockdownd_error_t lockdownd_send_locked(lockdownd_client_t client, plist_t plist)
+{
+	lockdownd_error_t ret = lockdownd_error(property_list_service_send_xml_plist(client->parent, plist));
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		lockdownd_request_stats_sent(client, plist);
+	}
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_receive(lockdownd_client_t client, plist_t *plist)
 {
 	if (!client || !plist || (plist && *plist))
 		return LOCKDOWN_E_INVALID_ARG;
 
-	return lockdownd_error(property_list_service_receive_plist(client->parent, plist));
+	mutex_lock(&client->mutex);
+	lockdownd_error_t ret = lockdownd_receive_locked(client, plist);
+	mutex_unlock(&client->mutex);
+	return ret;
 }
 
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_send(lockdownd_client_t client, plist_t plist)
@@ -362,7 +506,51 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_send(lockdownd_client_t client,
 	if (!client || !plist)
 		return LOCKDOWN_E_INVALID_ARG;
 
-	return lockdownd_error(property_list_service_send_xml_plist(client->parent, plist));
+	mutex_lock(&client->mutex);
+	lockdownd_error_t ret = lockdownd_send_locked(client, plist);
+	mutex_unlock(&client->mutex);
+	return ret;
+}
+
+/**
+ * Sends the request in *dict, frees it and receives the response into
+ * *dict. Requests of concurrent callers are serialized, so each of them
+ * gets the response to its own request.
+ */
+static lockdownd_error_t lockdownd_exchange(lockdownd_client_t client, plist_t *dict)
+{
+	mutex_lock(&client->mutex);
+	lockdownd_error_t ret = lockdownd_send_locked(client, *dict);
+	plist_free(*dict);
+	*dict = NULL;
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		ret = lockdownd_receive_locked(client, dict);
+	}
+	mutex_unlock(&client->mutex);
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_request_stats(lockdownd_client_t client, const char *request, uint64_t *count, uint64_t *latency)
+{
+	if (!client || !request || !count)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	mutex_lock(&client->mutex);
+	struct lockdownd_request_stats *stats = client->request_stats;
+	while (stats && strcmp(stats->request, request) != 0) {
+		stats = stats->next;
+	}
+	*count = (stats) ? stats->count : 0;
+	if (latency) {
+		if (stats) {
+			memcpy(latency, stats->latency, sizeof(stats->latency));
+		} else {
+			memset(latency, 0, sizeof(uint64_t) * IDEVICE_STATS_LATENCY_BUCKETS);
+		}
+	}
+	mutex_unlock(&client->mutex);
+
+	return LOCKDOWN_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char **type)
@@ -377,12 +565,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t c
 	plist_dict_set_item(dict,"Request", plist_new_string("QueryType"));
 
 	debug_info("called");
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 
 	if (LOCKDOWN_E_SUCCESS != ret)
 		return ret;
@@ -410,16 +593,12 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_query_type(lockdownd_client_t c
 	return ret;
 }
 
-LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+/**
+ * Builds a GetValue request for the given domain and key.
+ */
+static plist_t lockdownd_get_value_request(lockdownd_client_t client, const char *domain, const char *key)
 {
-	if (!client)
-		return LOCKDOWN_E_INVALID_ARG;
-
-	plist_t dict = NULL;
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	/* setup request plist */
-	dict = plist_new_dict();
+	plist_t dict = plist_new_dict();
 	plist_dict_add_label(dict, client->label);
 	if (domain) {
 		plist_dict_set_item(dict,"Domain", plist_new_string(domain));
@@ -428,31 +607,229 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 		plist_dict_set_item(dict,"Key", plist_new_string(key));
 	}
 	plist_dict_set_item(dict,"Request", plist_new_string("GetValue"));
+	return dict;
+}
 
-	/* send to device */
-	ret = lockdownd_send(client, dict);
+static thread_once_t value_cache_once = THREAD_ONCE_INIT;
+static mutex_t value_cache_mutex;
+static struct lockdownd_value_snapshot *value_snapshots = NULL;
 
-	plist_free(dict);
-	dict = NULL;
+static void lockdownd_value_cache_init(void)
+{
+	mutex_init(&value_cache_mutex);
+}
 
-	if (ret != LOCKDOWN_E_SUCCESS)
-		return ret;
+static int lockdownd_value_cache_domain_equal(const char *a, const char *b)
+{
+	if (!a || !b)
+		return (a == b);
+	return (strcmp(a, b) == 0);
+}
 
-	/* Now get device's answer */
-	ret = lockdownd_receive(client, &dict);
+/**
+ * Returns how long a snapshot of the given domain stays valid. Most values
+ * do not change while the device is running, battery and disk usage do.
+ */
+static uint64_t lockdownd_value_cache_ttl(const char *domain)
+{
+	if (!domain || !strcmp(domain, "com.apple.mobile.iTunes")
+	    || !strcmp(domain, "com.apple.mobile.internal")
+	    || !strcmp(domain, "com.apple.mobile.sync_data_class")
+	    || !strcmp(domain, "com.apple.international")) {
+		return LOCKDOWN_VALUE_CACHE_TTL_STATIC;
+	}
+	if (!strcmp(domain, "com.apple.mobile.battery")
+	    || !strncmp(domain, "com.apple.disk_usage", 20)
+	    || !strcmp(domain, "com.apple.mobile.wireless_lockdown")) {
+		return LOCKDOWN_VALUE_CACHE_TTL_VOLATILE;
+	}
+	return LOCKDOWN_VALUE_CACHE_TTL_DEFAULT;
+}
+
+static void lockdownd_value_snapshot_free(struct lockdownd_value_snapshot *snapshot)
+{
+	free(snapshot->udid);
+	free(snapshot->domain);
+	plist_free(snapshot->values);
+	free(snapshot);
+}
+
+/* must be called with value_cache_mutex held, drops expired snapshots on the way */
+static struct lockdownd_value_snapshot* lockdownd_value_cache_find(const char *udid, const char *domain)
+{
+	uint64_t now = time_monotonic_usec();
+	struct lockdownd_value_snapshot **prev = &value_snapshots;
+	while (*prev) {
+		struct lockdownd_value_snapshot *snapshot = *prev;
+		if (snapshot->expires <= now) {
+			*prev = snapshot->next;
+			lockdownd_value_snapshot_free(snapshot);
+			continue;
+		}
+		if (!strcmp(snapshot->udid, udid) && lockdownd_value_cache_domain_equal(snapshot->domain, domain)) {
+			return snapshot;
+		}
+		prev = &snapshot->next;
+	}
+	return NULL;
+}
+
+/**
+ * Looks up a value in the snapshot of a domain.
+ *
+ * @return 1 and a copy of the value in *value if found, 0 if the snapshot
+ *  does not contain the key, or -1 if there is no valid snapshot.
+ */
+static int lockdownd_value_cache_lookup(const char *udid, const char *domain, const char *key, plist_t *value)
+{
+	int res = -1;
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+	mutex_lock(&value_cache_mutex);
+	struct lockdownd_value_snapshot *snapshot = lockdownd_value_cache_find(udid, domain);
+	if (snapshot) {
+		plist_t node = (key) ? plist_dict_get_item(snapshot->values, key) : snapshot->values;
+		if (node) {
+			*value = plist_copy(node);
+			res = 1;
+		} else {
+			res = 0;
+		}
+	}
+	mutex_unlock(&value_cache_mutex);
+	return res;
+}
+
+/* takes ownership of values */
+static void lockdownd_value_cache_store(const char *udid, const char *domain, plist_t values)
+{
+	struct lockdownd_value_snapshot *snapshot = (struct lockdownd_value_snapshot*)calloc(1, sizeof(struct lockdownd_value_snapshot));
+	if (!snapshot) {
+		plist_free(values);
+		return;
+	}
+	snapshot->udid = strdup(udid);
+	snapshot->domain = (domain) ? strdup(domain) : NULL;
+	snapshot->values = values;
+	snapshot->expires = time_monotonic_usec() + lockdownd_value_cache_ttl(domain);
+
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+	mutex_lock(&value_cache_mutex);
+	struct lockdownd_value_snapshot *old = lockdownd_value_cache_find(udid, domain);
+	if (old) {
+		/* a concurrent lookup got there first, keep the newer snapshot */
+		plist_free(old->values);
+		old->values = snapshot->values;
+		old->expires = snapshot->expires;
+		snapshot->values = NULL;
+		lockdownd_value_snapshot_free(snapshot);
+	} else {
+		snapshot->next = value_snapshots;
+		value_snapshots = snapshot;
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+static void lockdownd_value_cache_invalidate(lockdownd_client_t client, const char *domain)
+{
+	if (!client->udid)
+		return;
+
+	thread_once(&value_cache_once, lockdownd_value_cache_init);
+	mutex_lock(&value_cache_mutex);
+	struct lockdownd_value_snapshot *snapshot = lockdownd_value_cache_find(client->udid, domain);
+	if (snapshot) {
+		/* expired snapshots are dropped by the next lookup */
+		snapshot->expires = 0;
+	}
+	mutex_unlock(&value_cache_mutex);
+}
+
+/**
+ * Sends a single GetValue request and returns the whole response.
+ */
+static lockdownd_error_t lockdownd_get_value_response(lockdownd_client_t client, const char *domain, const char *key, plist_t *response)
+{
+	plist_t dict = lockdownd_get_value_request(client, domain, key);
+
+	lockdownd_error_t ret = lockdownd_exchange(client, &dict);
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
 	ret = lockdown_check_result(dict, "GetValue");
-	if (ret == LOCKDOWN_E_SUCCESS) {
-		debug_info("success");
-	}
-
 	if (ret != LOCKDOWN_E_SUCCESS) {
 		plist_free(dict);
 		return ret;
 	}
 
+	*response = dict;
+	return ret;
+}
+
+/**
+ * Answers a GetValue from the snapshot of the domain, fetching the snapshot
+ * first if needed. Keys that are not part of the domain listing are left to
+ * a regular request.
+ *
+ * @return 1 if *value was set, 0 otherwise.
+ */
+static int lockdownd_get_value_cached(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+{
+	int res = lockdownd_value_cache_lookup(client->udid, domain, key, value);
+	if (res >= 0) {
+		return res;
+	}
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = lockdownd_get_value_response(client, domain, NULL, &dict);
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		plist_t values = plist_dict_get_item(dict, "Value");
+		if (values && plist_get_node_type(values) == PLIST_DICT) {
+			lockdownd_value_cache_store(client->udid, domain, plist_copy(values));
+		} else {
+			lockdownd_value_cache_store(client->udid, domain, plist_new_dict());
+		}
+		plist_free(dict);
+	} else if (ret != LOCKDOWN_E_MUX_ERROR && ret != LOCKDOWN_E_SSL_ERROR && ret != LOCKDOWN_E_PLIST_ERROR && ret != LOCKDOWN_E_RECEIVE_TIMEOUT) {
+		/* the domain can't be listed, remember that so keys are asked for directly */
+		debug_info("could not fetch snapshot of domain %s", (domain) ? domain : "(global)");
+		lockdownd_value_cache_store(client->udid, domain, plist_new_dict());
+	} else {
+		return 0;
+	}
+
+	return (lockdownd_value_cache_lookup(client->udid, domain, key, value) > 0);
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_set_value_cache(lockdownd_client_t client, int enabled)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	client->value_cache = (enabled != 0);
+	return LOCKDOWN_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char *domain, const char *key, plist_t *value)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	/* without a session lockdownd only hands out a subset, so don't cache that */
+	if (client->value_cache && client->session_id && client->udid) {
+		if (lockdownd_get_value_cached(client, domain, key, value)) {
+			return LOCKDOWN_E_SUCCESS;
+		}
+	}
+
+	ret = lockdownd_get_value_response(client, domain, key, &dict);
+	if (ret != LOCKDOWN_E_SUCCESS)
+		return ret;
+
+	debug_info("success");
+
 	plist_t value_node = plist_dict_get_item(dict, "Value");
 
 	if (value_node) {
@@ -464,6 +841,79 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_value(lockdownd_client_t cl
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_get_values(lockdownd_client_t client, const char **domains, const char **keys, uint32_t count, plist_t *results)
+{
+	if (!client || !results || (count > 0 && !keys))
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t i = 0;
+
+	for (i = 0; i < count; i++) {
+		results[i] = NULL;
+	}
+
+	/* the whole batch has to stay in order on the connection */
+	mutex_lock(&client->mutex);
+	while (received < count) {
+		/* keep a window of requests outstanding */
+		while (sent < count && sent - received < LOCKDOWN_GET_VALUES_WINDOW) {
+			plist_t dict = lockdownd_get_value_request(client, (domains) ? domains[sent] : NULL, keys[sent]);
+			ret = lockdownd_send_locked(client, dict);
+			plist_free(dict);
+			if (ret != LOCKDOWN_E_SUCCESS) {
+				break;
+			}
+			sent++;
+		}
+		if (ret != LOCKDOWN_E_SUCCESS || received == sent) {
+			break;
+		}
+
+		/* responses arrive in request order */
+		plist_t dict = NULL;
+		ret = lockdownd_receive_locked(client, &dict);
+		if (ret != LOCKDOWN_E_SUCCESS) {
+			break;
+		}
+
+		const char *key = keys[received];
+		plist_t key_node = plist_dict_get_item(dict, "Key");
+		if (key && key_node && plist_get_node_type(key_node) == PLIST_STRING) {
+			char *resp_key = NULL;
+			plist_get_string_val(key_node, &resp_key);
+			if (resp_key && strcmp(resp_key, key) != 0) {
+				debug_info("WARNING: response for key %s does not match request for key %s", resp_key, key);
+			}
+			free(resp_key);
+		}
+
+		if (lockdown_check_result(dict, "GetValue") == LOCKDOWN_E_SUCCESS) {
+			plist_t value_node = plist_dict_get_item(dict, "Value");
+			if (value_node) {
+				results[received] = plist_copy(value_node);
+			}
+		} else {
+			debug_info("GetValue for %s/%s failed", (domains && domains[received]) ? domains[received] : "(global)", (key) ? key : "(all)");
+		}
+		plist_free(dict);
+		received++;
+	}
+	mutex_unlock(&client->mutex);
+
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		/* the connection is out of sync, don't return partial results */
+		for (i = 0; i < count; i++) {
+			plist_free(results[i]);
+			results[i] = NULL;
+		}
+	}
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t client, const char *domain, const char *key, plist_t value)
 {
 	if (!client || !value)
@@ -485,16 +935,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t cl
 	plist_dict_set_item(dict,"Value", value);
 
 	/* send to device */
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
-
-	if (ret != LOCKDOWN_E_SUCCESS)
-		return ret;
-
-	/* Now get device's answer */
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
@@ -502,6 +943,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_set_value(lockdownd_client_t cl
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
 	}
+	lockdownd_value_cache_invalidate(client, domain);
 
 	if (ret != LOCKDOWN_E_SUCCESS) {
 		plist_free(dict);
@@ -532,16 +974,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_remove_value(lockdownd_client_t
 	plist_dict_set_item(dict,"Request", plist_new_string("RemoveValue"));
 
 	/* send to device */
-	ret = lockdownd_send(client, dict);
-
-	plist_free(dict);
-	dict = NULL;
-
-	if (ret != LOCKDOWN_E_SUCCESS)
-		return ret;
-
-	/* Now get device's answer */
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 	if (ret != LOCKDOWN_E_SUCCESS)
 		return ret;
 
@@ -549,6 +982,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_remove_value(lockdownd_client_t
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
 	}
+	lockdownd_value_cache_invalidate(client, domain);
 
 	if (ret != LOCKDOWN_E_SUCCESS) {
 		plist_free(dict);
@@ -632,6 +1066,11 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 		.ssl_enabled = 0
 	};
 
+	/* let keys for a possible pairing generate while we talk to lockdownd */
+	userpref_key_pool_start_from_env();
+
+	service_scheduler_hint(device, "com.apple.mobile.lockdown", service.port);
+
 	property_list_service_client_t plistclient = NULL;
 	if (property_list_service_client_new(device, (lockdownd_service_descriptor_t)&service, &plistclient) != PROPERTY_LIST_SERVICE_E_SUCCESS) {
 		debug_info("could not connect to lockdownd (device %s)", device->udid);
@@ -643,6 +1082,13 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new(idevice_t device, lo
 	client_loc->ssl_enabled = 0;
 	client_loc->session_id = NULL;
 	client_loc->mux_id = device->mux_id;
+	mutex_init(&client_loc->mutex);
+	client_loc->pool_device = NULL;
+	client_loc->pool_invalid = 0;
+	client_loc->pool_users = 0;
+	client_loc->value_cache = 0;
+	client_loc->request_stats = NULL;
+	client_loc->num_pending = 0;
 
 	if (idevice_get_udid(device, &client_loc->udid) != IDEVICE_E_SUCCESS) {
 		debug_info("failed to get device udid.");
@@ -752,6 +1198,111 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_new_with_handshake(idevi
 	return ret;
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_acquire(idevice_t device, lockdownd_client_t *client, const char *label)
+{
+	if (!device || !client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	lockdownd_client_t client_loc = NULL;
+	int create_pooled = 0;
+	int shared = 0;
+
+	mutex_lock(&device->lockdown_mutex);
+	if (device->lockdown_client && device->lockdown_client->pool_invalid) {
+		/* the last caller still using the stale session frees it */
+		device->lockdown_client = NULL;
+	}
+	if (device->lockdown_client) {
+		/* requests are serialized per client, so callers can share the session */
+		client_loc = device->lockdown_client;
+		shared = (client_loc->pool_users > 0);
+		client_loc->pool_users++;
+	} else if (!device->lockdown_client_pending) {
+		/* reserve the pool slot while the session is set up */
+		device->lockdown_client_pending = 1;
+		create_pooled = 1;
+	}
+	mutex_unlock(&device->lockdown_mutex);
+
+	if (client_loc) {
+		debug_info("reusing pooled lockdownd session %s", client_loc->session_id);
+		if (!shared) {
+			/* others might be building requests with the current label */
+			lockdownd_client_set_label(client_loc, label);
+		}
+		*client = client_loc;
+		return LOCKDOWN_E_SUCCESS;
+	}
+
+	/* the pooled session is being created by another caller or needs to be created */
+	ret = lockdownd_client_new_with_handshake(device, &client_loc, label);
+
+	if (create_pooled) {
+		mutex_lock(&device->lockdown_mutex);
+		if (ret == LOCKDOWN_E_SUCCESS) {
+			client_loc->pool_device = device;
+			client_loc->pool_users = 1;
+			device->lockdown_client = client_loc;
+		}
+		device->lockdown_client_pending = 0;
+		mutex_unlock(&device->lockdown_mutex);
+	}
+
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		*client = client_loc;
+	}
+
+	return ret;
+}
+
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_client_release(lockdownd_client_t client)
+{
+	if (!client)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	idevice_t device = client->pool_device;
+	if (!device) {
+		/* not the pooled session */
+		return lockdownd_client_free(client);
+	}
+
+	int drop = 0;
+	mutex_lock(&device->lockdown_mutex);
+	if (client->pool_users > 0) {
+		client->pool_users--;
+	}
+	if (client->pool_invalid) {
+		if (device->lockdown_client == client) {
+			device->lockdown_client = NULL;
+		}
+		drop = (client->pool_users == 0);
+	}
+	mutex_unlock(&device->lockdown_mutex);
+
+	if (drop) {
+		debug_info("dropping stale pooled lockdownd session");
+		client->pool_device = NULL;
+		return lockdownd_client_free(client);
+	}
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Marks a lockdownd client as unusable, e.g. after the device closed the
+ * connection. A pooled session is discarded on release instead of being
+ * handed out again.
+ *
+ * @param client The lockdownd client to invalidate.
+ */
+void lockdownd_client_invalidate(lockdownd_client_t client)
+{
+	if (client) {
+		client->pool_invalid = 1;
+	}
+}
+
 /**
  * Returns a new plist from the supplied lockdownd pair record. The caller is
  * responsible for freeing the plist.
@@ -918,19 +1469,7 @@ static lockdownd_error_t lockdownd_do_pair(lockdownd_client_t client, lockdownd_
 	}
 
 	/* send to device */
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	if (ret != LOCKDOWN_E_SUCCESS) {
-		plist_free(pair_record_plist);
-		if (wifi_node)
-			plist_free(wifi_node);
-		return ret;
-	}
-
-	/* Now get device's answer */
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 
 	if (ret != LOCKDOWN_E_SUCCESS) {
 		plist_free(pair_record_plist);
@@ -1059,11 +1598,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_enter_recovery(lockdownd_client
 
 	debug_info("telling device to enter recovery mode");
 
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 
 	ret = lockdown_check_result(dict, "EnterRecovery");
 	if (ret == LOCKDOWN_E_SUCCESS) {
@@ -1089,11 +1624,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_goodbye(lockdownd_client_t clie
 
 	debug_info("called");
 
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 	if (!dict) {
 		debug_info("did not get goodbye response back");
 		return LOCKDOWN_E_PLIST_ERROR;
@@ -1144,17 +1675,19 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_session(lockdownd_client_
 		}
 	}
 
-	ret = lockdownd_send(client, dict);
+	/* nothing else may be sent until SSL is set up */
+	mutex_lock(&client->mutex);
+	ret = lockdownd_send_locked(client, dict);
 	plist_free(dict);
 	dict = NULL;
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		ret = lockdownd_receive_locked(client, &dict);
+	}
 
-	if (ret != LOCKDOWN_E_SUCCESS)
-		return ret;
-
-	ret = lockdownd_receive(client, &dict);
-
-	if (!dict)
-		return LOCKDOWN_E_PLIST_ERROR;
+	if (!dict) {
+		mutex_unlock(&client->mutex);
+		return (ret != LOCKDOWN_E_SUCCESS) ? ret : LOCKDOWN_E_PLIST_ERROR;
+	}
 
 	ret = lockdown_check_result(dict, "StartSession");
 	if (ret == LOCKDOWN_E_SUCCESS) {
@@ -1193,6 +1726,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_session(lockdownd_client_
 			client->ssl_enabled = 0;
 		}
 	}
+	mutex_unlock(&client->mutex);
 
 	plist_free(dict);
 	dict = NULL;
@@ -1251,56 +1785,18 @@ static lockdownd_error_t lockdownd_build_start_service_request(lockdownd_client_
 }
 
 /**
- * Function used internally by lockdownd_start_service and lockdownd_start_service_with_escrow_bag.
+ * Internal function that reads the service descriptor from a StartService
+ * response.
  *
- * @param client The lockdownd client
- * @param identifier The identifier of the service to start
- * @param send_escrow_bag Should we send the device's escrow bag with the request
- * @param descriptor The service descriptor on success or NULL on failure
+ * @param dict The StartService response
+ * @param service Service descriptor to fill in, allocated if NULL
  *
- * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG if a parameter
- *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
- *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
- *  started by the device, LOCKDOWN_E_INVALID_CONF if the host id or escrow bag (when
- *  used) are missing from the device record.
+ * @return LOCKDOWN_E_SUCCESS on success, or the error the device reported.
  */
-static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, const char *identifier, int send_escrow_bag, lockdownd_service_descriptor_t *service)
+static lockdownd_error_t lockdownd_parse_start_service_response(plist_t dict, lockdownd_service_descriptor_t *service)
 {
-	if (!client || !identifier || !service)
-		return LOCKDOWN_E_INVALID_ARG;
-
-	if (*service) {
-		// reset fields if service descriptor is reused
-		(*service)->port = 0;
-		(*service)->ssl_enabled = 0;
-	}
-
-	plist_t dict = NULL;
 	uint16_t port_loc = 0;
-	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
-
-	/* create StartService request */
-	ret = lockdownd_build_start_service_request(client, identifier, send_escrow_bag, &dict);
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
-	/* send to device */
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
-	ret = lockdownd_receive(client, &dict);
-
-	if (LOCKDOWN_E_SUCCESS != ret)
-		return ret;
-
-	if (!dict)
-		return LOCKDOWN_E_PLIST_ERROR;
-
-	ret = lockdown_check_result(dict, "StartService");
+	lockdownd_error_t ret = lockdown_check_result(dict, "StartService");
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		if (*service == NULL)
 			*service = (lockdownd_service_descriptor_t)malloc(sizeof(struct lockdownd_service_descriptor));
@@ -1338,10 +1834,62 @@ static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, c
 			free(error);
 		}
 	}
+	return ret;
+}
+
+/**
+ * Function used internally by lockdownd_start_service and lockdownd_start_service_with_escrow_bag.
+ *
+ * @param client The lockdownd client
+ * @param identifier The identifier of the service to start
+ * @param send_escrow_bag Should we send the device's escrow bag with the request
+ * @param descriptor The service descriptor on success or NULL on failure
+ *
+ * @return LOCKDOWN_E_SUCCESS on success, LOCKDOWN_E_INVALID_ARG if a parameter
+ *  is NULL, LOCKDOWN_E_INVALID_SERVICE if the requested service is not known
+ *  by the device, LOCKDOWN_E_START_SERVICE_FAILED if the service could not because
+ *  started by the device, LOCKDOWN_E_INVALID_CONF if the host id or escrow bag (when
+ *  used) are missing from the device record.
+ */
+static lockdownd_error_t lockdownd_do_start_service(lockdownd_client_t client, const char *identifier, int send_escrow_bag, lockdownd_service_descriptor_t *service)
+{
+	if (!client || !identifier || !service)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	if (*service) {
+		// reset fields if service descriptor is reused
+		(*service)->port = 0;
+		(*service)->ssl_enabled = 0;
+	}
+
+	plist_t dict = NULL;
+	lockdownd_error_t ret = LOCKDOWN_E_UNKNOWN_ERROR;
+
+	/* create StartService request */
+	ret = lockdownd_build_start_service_request(client, identifier, send_escrow_bag, &dict);
+	if (LOCKDOWN_E_SUCCESS != ret)
+		return ret;
+
+	/* send to device */
+	ret = lockdownd_exchange(client, &dict);
+
+	if (LOCKDOWN_E_SUCCESS != ret)
+		return ret;
+
+	if (!dict)
+		return LOCKDOWN_E_PLIST_ERROR;
+
+	ret = lockdownd_parse_start_service_response(dict, service);
 
 	plist_free(dict);
 	dict = NULL;
 
+	if (ret == LOCKDOWN_E_SUCCESS) {
+		service_scheduler_hint(client->parent->parent->connection->device, identifier, (*service)->port);
+	}
+
+	TRACE_PROBE3(lockdown__start__service, client->udid, identifier, (ret == LOCKDOWN_E_SUCCESS) ? (*service)->port : 0);
+
 	return ret;
 }
 
@@ -1355,6 +1903,83 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_service_with_escrow_bag(l
 	return lockdownd_do_start_service(client, identifier, 1, service);
 }
 
+LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_start_services(lockdownd_client_t client, const char **identifiers, lockdownd_service_descriptor_t *services)
+{
+	if (!client || !identifiers || !services)
+		return LOCKDOWN_E_INVALID_ARG;
+
+	lockdownd_error_t ret = LOCKDOWN_E_SUCCESS;
+	lockdownd_error_t first_err = LOCKDOWN_E_SUCCESS;
+	uint32_t count = 0;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+	uint32_t i = 0;
+
+	while (identifiers[count]) {
+		services[count] = NULL;
+		count++;
+	}
+
+	/* the whole batch has to stay in order on the connection */
+	mutex_lock(&client->mutex);
+	while (received < count) {
+		/* keep a window of requests outstanding */
+		while (sent < count && sent - received < LOCKDOWN_START_SERVICES_WINDOW) {
+			plist_t dict = NULL;
+			ret = lockdownd_build_start_service_request(client, identifiers[sent], 0, &dict);
+			if (ret == LOCKDOWN_E_SUCCESS) {
+				ret = lockdownd_send_locked(client, dict);
+				plist_free(dict);
+			}
+			if (ret != LOCKDOWN_E_SUCCESS) {
+				break;
+			}
+			sent++;
+		}
+		if (ret != LOCKDOWN_E_SUCCESS || received == sent) {
+			break;
+		}
+
+		/* responses arrive in request order */
+		plist_t dict = NULL;
+		ret = lockdownd_receive_locked(client, &dict);
+		if (ret != LOCKDOWN_E_SUCCESS) {
+			break;
+		}
+		if (!dict) {
+			ret = LOCKDOWN_E_PLIST_ERROR;
+			break;
+		}
+
+		lockdownd_error_t serr = lockdownd_parse_start_service_response(dict, &services[received]);
+		plist_free(dict);
+		if (serr != LOCKDOWN_E_SUCCESS) {
+			debug_info("Could not start service %s: %d", identifiers[received], serr);
+			lockdownd_service_descriptor_free(services[received]);
+			services[received] = NULL;
+			if (first_err == LOCKDOWN_E_SUCCESS) {
+				first_err = serr;
+			}
+		} else {
+			service_scheduler_hint(client->parent->parent->connection->device, identifiers[received], services[received]->port);
+		}
+		TRACE_PROBE3(lockdown__start__service, client->udid, identifiers[received], (services[received]) ? services[received]->port : 0);
+		received++;
+	}
+	mutex_unlock(&client->mutex);
+
+	if (ret != LOCKDOWN_E_SUCCESS) {
+		/* the connection is out of sync, don't return partial results */
+		for (i = 0; i < count; i++) {
+			lockdownd_service_descriptor_free(services[i]);
+			services[i] = NULL;
+		}
+		return ret;
+	}
+
+	return first_err;
+}
+
 LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_activate(lockdownd_client_t client, plist_t activation_record)
 {
 	if (!client)
@@ -1373,11 +1998,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_activate(lockdownd_client_t cli
 	plist_dict_set_item(dict,"Request", plist_new_string("Activate"));
 	plist_dict_set_item(dict,"ActivationRecord", plist_copy(activation_record));
 
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 	if (!dict) {
 		debug_info("LOCKDOWN_E_PLIST_ERROR");
 		return LOCKDOWN_E_PLIST_ERROR;
@@ -1387,6 +2008,8 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_activate(lockdownd_client_t cli
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
 	}
+	/* ActivationState and friends change */
+	lockdownd_value_cache_invalidate(client, NULL);
 
 	plist_free(dict);
 	dict = NULL;
@@ -1408,11 +2031,7 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_deactivate(lockdownd_client_t c
 	plist_dict_add_label(dict, client->label);
 	plist_dict_set_item(dict,"Request", plist_new_string("Deactivate"));
 
-	ret = lockdownd_send(client, dict);
-	plist_free(dict);
-	dict = NULL;
-
-	ret = lockdownd_receive(client, &dict);
+	ret = lockdownd_exchange(client, &dict);
 	if (!dict) {
 		debug_info("LOCKDOWN_E_PLIST_ERROR");
 		return LOCKDOWN_E_PLIST_ERROR;
@@ -1422,6 +2041,8 @@ LIBIMOBILEDEVICE_API lockdownd_error_t lockdownd_deactivate(lockdownd_client_t c
 	if (ret == LOCKDOWN_E_SUCCESS) {
 		debug_info("success");
 	}
+	/* ActivationState and friends change */
+	lockdownd_value_cache_invalidate(client, NULL);
 
 	plist_free(dict);
 	dict = NULL;
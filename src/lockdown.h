@@ -25,9 +25,42 @@
 
 #include "libimobiledevice/lockdown.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 #define LOCKDOWN_PROTOCOL_VERSION "2"
 
+#define LOCKDOWN_GET_VALUES_WINDOW 16
+/* StartService requests outstanding at once in lockdownd_start_services() */
+#define LOCKDOWN_START_SERVICES_WINDOW 16
+
+/* lifetime of domain snapshots, see lockdownd_client_set_value_cache() */
+#define LOCKDOWN_VALUE_CACHE_TTL_STATIC (300 * 1000000ULL)
+#define LOCKDOWN_VALUE_CACHE_TTL_VOLATILE (5 * 1000000ULL)
+#define LOCKDOWN_VALUE_CACHE_TTL_DEFAULT (30 * 1000000ULL)
+
+struct lockdownd_value_snapshot {
+	char *udid;
+	char *domain; /* NULL for the global domain */
+	plist_t values;
+	uint64_t expires;
+	struct lockdownd_value_snapshot *next;
+};
+
+/* number of requests awaiting a reply that are timed for the statistics */
+#define LOCKDOWN_STATS_MAX_PENDING 32
+
+struct lockdownd_request_stats {
+	char *request;
+	uint64_t count;
+	uint64_t latency[IDEVICE_STATS_LATENCY_BUCKETS];
+	struct lockdownd_request_stats *next;
+};
+
+struct lockdownd_pending_request {
+	struct lockdownd_request_stats *stats;
+	uint64_t start;
+};
+
 struct lockdownd_client_private {
 	property_list_service_client_t parent;
 	int ssl_enabled;
@@ -35,6 +68,18 @@ struct lockdownd_client_private {
 	char *udid;
 	char *label;
 	uint32_t mux_id;
+	/* serializes requests, see lockdownd_exchange() */
+	mutex_t mutex;
+	idevice_t pool_device;
+	int pool_invalid;
+	/* callers currently sharing the pooled session, protected by the device's lockdown_mutex */
+	unsigned int pool_users;
+	int value_cache;
+	struct lockdownd_request_stats *request_stats;
+	struct lockdownd_pending_request pending[LOCKDOWN_STATS_MAX_PENDING];
+	unsigned int num_pending;
 };
 
+void lockdownd_client_invalidate(lockdownd_client_t client);
+
 #endif
@@ -26,9 +26,15 @@
 #include <stdlib.h>
 #include <plist/plist.h>
 #include <stdio.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include "misagent.h"
 #include "property_list_service.h"
+#include "idevice.h"
 #include "common/debug.h"
 
 /**
@@ -288,3 +294,317 @@ LIBIMOBILEDEVICE_API int misagent_get_status_code(misagent_client_t client)
 	}
 	return client->last_error;
 }
+
+struct misagent_install_batch {
+	misagent_client_t client;
+	int *status_codes;
+	misagent_error_t res;
+};
+
+static void misagent_install_reply_cb(uint32_t index, plist_t reply, property_list_service_error_t status, void *user_data)
+{
+	struct misagent_install_batch *batch = (struct misagent_install_batch*)user_data;
+	int status_code = -1;
+	misagent_error_t res;
+
+	if (status != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		res = misagent_error(status);
+	} else if (!reply) {
+		res = MISAGENT_E_UNKNOWN_ERROR;
+	} else {
+		res = misagent_check_result(reply, &status_code);
+	}
+	if (res != MISAGENT_E_SUCCESS) {
+		debug_info("could not install profile %u, error %d status code 0x%x", index, res, status_code);
+		if (batch->res == MISAGENT_E_SUCCESS) {
+			batch->res = res;
+			batch->client->last_error = status_code;
+		}
+	}
+	if (batch->status_codes) {
+		batch->status_codes[index] = status_code;
+	}
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_install_many(misagent_client_t client, plist_t profiles, int *status_codes)
+{
+	if (!client || !client->parent || !profiles || (plist_get_node_type(profiles) != PLIST_ARRAY))
+		return MISAGENT_E_INVALID_ARG;
+
+	uint32_t count = plist_array_get_size(profiles);
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		if (plist_get_node_type(plist_array_get_item(profiles, i)) != PLIST_DATA)
+			return MISAGENT_E_INVALID_ARG;
+	}
+
+	client->last_error = 0;
+	if (count == 0)
+		return MISAGENT_E_SUCCESS;
+
+	plist_t *requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!requests)
+		return MISAGENT_E_UNKNOWN_ERROR;
+	for (i = 0; i < count; i++) {
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "MessageType", plist_new_string("Install"));
+		plist_dict_set_item(dict, "Profile", plist_copy(plist_array_get_item(profiles, i)));
+		plist_dict_set_item(dict, "ProfileType", plist_new_string("Provisioning"));
+		requests[i] = dict;
+	}
+
+	struct misagent_install_batch batch = { client, status_codes, MISAGENT_E_SUCCESS };
+	misagent_error_t res = misagent_error(property_list_service_send_receive_pipelined(client->parent, requests, count, 0, MISAGENT_INSTALL_PIPELINE_WINDOW, misagent_install_reply_cb, &batch));
+	if (res == MISAGENT_E_SUCCESS) {
+		res = batch.res;
+	} else {
+		client->last_error = MISAGENT_E_UNKNOWN_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
+
+	return res;
+}
+
+#define ASN1_SEQUENCE 0x30
+#define ASN1_CONTAINER 0xA0
+#define ASN1_OBJECT_IDENTIFIER 0x06
+#define ASN1_OCTET_STRING 0x04
+
+/**
+ * Reads the header of the DER item at *p and advances *p to its contents.
+ *
+ * @return The tag of the item, or -1 if the item does not fit into the
+ *     buffer ending at end.
+ */
+static int asn1_enter_item(const unsigned char **p, const unsigned char *end, size_t *size)
+{
+	const unsigned char *pp = *p;
+	if (end - pp < 2)
+		return -1;
+	int tag = pp[0];
+	size_t len = pp[1];
+	pp += 2;
+	if (len & 0x80) {
+		unsigned int nbytes = len & 0x7F;
+		if (nbytes == 0 || nbytes > 4 || (size_t)(end - pp) < nbytes)
+			return -1;
+		len = 0;
+		while (nbytes--) {
+			len = (len << 8) | *pp++;
+		}
+	}
+	if ((size_t)(end - pp) < len)
+		return -1;
+	*p = pp;
+	*size = len;
+	return tag;
+}
+
+/**
+ * Extracts the property list embedded in the CMS envelope of a provisioning
+ * profile.
+ *
+ * @return The embedded plist or NULL if the profile could not be parsed.
+ */
+static plist_t misagent_profile_get_embedded_plist(const char *data, uint64_t length)
+{
+	const unsigned char *p = (const unsigned char*)data;
+	const unsigned char *end = p + length;
+	size_t size = 0;
+	int k;
+
+	/* ContentInfo */
+	if (asn1_enter_item(&p, end, &size) != ASN1_SEQUENCE)
+		return NULL;
+	end = p + size;
+	if (asn1_enter_item(&p, end, &size) != ASN1_OBJECT_IDENTIFIER)
+		return NULL;
+	p += size;
+	if (asn1_enter_item(&p, end, &size) != ASN1_CONTAINER)
+		return NULL;
+	/* SignedData: skip version and digestAlgorithms */
+	if (asn1_enter_item(&p, end, &size) != ASN1_SEQUENCE)
+		return NULL;
+	end = p + size;
+	for (k = 0; k < 2; k++) {
+		if (asn1_enter_item(&p, end, &size) < 0)
+			return NULL;
+		p += size;
+	}
+	/* EncapsulatedContentInfo */
+	if (asn1_enter_item(&p, end, &size) != ASN1_SEQUENCE)
+		return NULL;
+	end = p + size;
+	if (asn1_enter_item(&p, end, &size) != ASN1_OBJECT_IDENTIFIER)
+		return NULL;
+	p += size;
+	if (asn1_enter_item(&p, end, &size) != ASN1_CONTAINER)
+		return NULL;
+	if (asn1_enter_item(&p, end, &size) != ASN1_OCTET_STRING)
+		return NULL;
+
+	plist_t pl = NULL;
+	plist_from_xml((const char*)p, size, &pl);
+	return pl;
+}
+
+static char *misagent_profile_hash(const char *data, uint64_t length)
+{
+	unsigned char hash[20];
+	char *hex = (char*)malloc(sizeof(hash) * 2 + 1);
+	unsigned int i;
+
+#ifdef HAVE_OPENSSL
+	SHA1((const unsigned char*)data, length, hash);
+#else
+	gcry_md_hash_buffer(GCRY_MD_SHA1, hash, data, length);
+#endif
+	for (i = 0; i < sizeof(hash); i++) {
+		sprintf(hex + i * 2, "%02x", hash[i]);
+	}
+	return hex;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_profile_cache_new(plist_t state, misagent_profile_cache_t *cache)
+{
+	if (!cache || (state && plist_get_node_type(state) != PLIST_DICT))
+		return MISAGENT_E_INVALID_ARG;
+
+	misagent_profile_cache_t cache_loc = (misagent_profile_cache_t)malloc(sizeof(struct misagent_profile_cache_private));
+	if (!cache_loc)
+		return MISAGENT_E_UNKNOWN_ERROR;
+	mutex_init(&cache_loc->mutex);
+	cache_loc->devices = (state) ? plist_copy(state) : plist_new_dict();
+
+	*cache = cache_loc;
+	return MISAGENT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_profile_cache_get_state(misagent_profile_cache_t cache, plist_t *state)
+{
+	if (!cache || !state)
+		return MISAGENT_E_INVALID_ARG;
+
+	mutex_lock(&cache->mutex);
+	*state = plist_copy(cache->devices);
+	mutex_unlock(&cache->mutex);
+
+	return MISAGENT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_profile_cache_free(misagent_profile_cache_t cache)
+{
+	if (!cache)
+		return MISAGENT_E_INVALID_ARG;
+
+	plist_free(cache->devices);
+	mutex_destroy(&cache->mutex);
+	free(cache);
+
+	return MISAGENT_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API misagent_error_t misagent_copy_all_changed(misagent_client_t client, misagent_profile_cache_t cache, plist_t *added, plist_t *removed)
+{
+	if (!client || !client->parent || !cache || !added || !removed)
+		return MISAGENT_E_INVALID_ARG;
+
+	const char *udid = client->parent->parent->connection->device->udid;
+	if (!udid)
+		return MISAGENT_E_INVALID_ARG;
+
+	plist_t profiles = NULL;
+	misagent_error_t res = misagent_copy_all(client, &profiles);
+	if (res != MISAGENT_E_SUCCESS)
+		return res;
+	if (plist_get_node_type(profiles) != PLIST_ARRAY) {
+		plist_free(profiles);
+		return MISAGENT_E_PLIST_ERROR;
+	}
+
+	mutex_lock(&cache->mutex);
+	plist_t known = plist_copy(plist_dict_get_item(cache->devices, udid));
+	mutex_unlock(&cache->mutex);
+
+	plist_t current = plist_new_dict();
+	plist_t added_loc = plist_new_array();
+	plist_t removed_loc = plist_new_array();
+	uint32_t num_profiles = plist_array_get_size(profiles);
+	uint32_t i;
+
+	for (i = 0; i < num_profiles; i++) {
+		plist_t profile = plist_array_get_item(profiles, i);
+		if (plist_get_node_type(profile) != PLIST_DATA)
+			continue;
+		uint64_t length = 0;
+		const char *data = plist_get_data_ptr(profile, &length);
+		char *hash = misagent_profile_hash(data, length);
+
+		plist_t entry = (known) ? plist_dict_get_item(known, hash) : NULL;
+		if (entry) {
+			plist_dict_set_item(current, hash, plist_copy(entry));
+			free(hash);
+			continue;
+		}
+
+		/* only profiles we have not seen before are decoded */
+		entry = plist_new_dict();
+		plist_t pl = misagent_profile_get_embedded_plist(data, length);
+		if (pl && plist_get_node_type(pl) == PLIST_DICT) {
+			plist_t node = plist_dict_get_item(pl, "UUID");
+			if (node && plist_get_node_type(node) == PLIST_STRING) {
+				plist_dict_set_item(entry, "UUID", plist_copy(node));
+			}
+			node = plist_dict_get_item(pl, "Name");
+			if (node && plist_get_node_type(node) == PLIST_STRING) {
+				plist_dict_set_item(entry, "Name", plist_copy(node));
+			}
+		} else {
+			debug_info("could not decode profile %s", hash);
+		}
+		plist_free(pl);
+
+		plist_t item = plist_copy(entry);
+		plist_dict_set_item(item, "Profile", plist_copy(profile));
+		plist_array_append_item(added_loc, item);
+		plist_dict_set_item(current, hash, entry);
+		free(hash);
+	}
+	plist_free(profiles);
+
+	if (known) {
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(known, &iter);
+		if (iter) {
+			char *key = NULL;
+			plist_t entry = NULL;
+			do {
+				key = NULL;
+				entry = NULL;
+				plist_dict_next_item(known, iter, &key, &entry);
+				if (key && !plist_dict_get_item(current, key)) {
+					plist_t node = plist_dict_get_item(entry, "UUID");
+					if (node) {
+						plist_array_append_item(removed_loc, plist_copy(node));
+					}
+				}
+				free(key);
+			} while (entry);
+			free(iter);
+		}
+		plist_free(known);
+	}
+
+	mutex_lock(&cache->mutex);
+	plist_dict_set_item(cache->devices, udid, current);
+	mutex_unlock(&cache->mutex);
+
+	*added = added_loc;
+	*removed = removed_loc;
+
+	return MISAGENT_E_SUCCESS;
+}
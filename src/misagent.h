@@ -24,10 +24,17 @@
 
 #include "libimobiledevice/misagent.h"
 #include "property_list_service.h"
+#include "common/thread.h"
 
 struct misagent_client_private {
 	property_list_service_client_t parent;
 	int last_error;
 };
 
+struct misagent_profile_cache_private {
+	mutex_t mutex;
+	/* UDID -> profile hash -> { UUID, Name } */
+	plist_t devices;
+};
+
 #endif
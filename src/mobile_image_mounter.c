@@ -25,11 +25,19 @@
 #include <string.h>
 #include <stdlib.h>
 #include <plist/plist.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
 
 #include "mobile_image_mounter.h"
 #include "property_list_service.h"
 #include "common/debug.h"
 
+/* where mobile_image_mounter_upload_image() stores the image on the device */
+#define MIM_STAGING_IMAGE_PATH "/private/var/mobile/Media/PublicStaging/staging.dimage"
+
 /**
  * Locks a mobile_image_mounter client, used for thread safety.
  *
@@ -180,11 +188,151 @@ static mobile_image_mounter_error_t process_result(plist_t result, const char *e
 	return res;
 }
 
-LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+struct mim_upload_digest {
+	mobile_image_mounter_digest_t type;
+#ifdef HAVE_OPENSSL
+	SHA_CTX sha1;
+	SHA512_CTX sha384;
+#else
+	gcry_md_hd_t hd;
+#endif
+};
+
+static int mim_upload_digest_init(struct mim_upload_digest *d, mobile_image_mounter_digest_t type)
+{
+	d->type = type;
+#ifdef HAVE_OPENSSL
+	if (type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA1) {
+		SHA1_Init(&d->sha1);
+	} else if (type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA384) {
+		SHA384_Init(&d->sha384);
+	}
+#else
+	d->hd = NULL;
+	if (type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA1) {
+		gcry_md_open(&d->hd, GCRY_MD_SHA1, 0);
+	} else if (type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA384) {
+		gcry_md_open(&d->hd, GCRY_MD_SHA384, 0);
+	}
+	if (type != MOBILE_IMAGE_MOUNTER_DIGEST_NONE && !d->hd) {
+		return -1;
+	}
+#endif
+	return 0;
+}
+
+static void mim_upload_digest_update(struct mim_upload_digest *d, const unsigned char *data, size_t length)
+{
+#ifdef HAVE_OPENSSL
+	if (d->type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA1) {
+		SHA1_Update(&d->sha1, data, length);
+	} else if (d->type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA384) {
+		SHA384_Update(&d->sha384, data, length);
+	}
+#else
+	if (d->hd) {
+		gcry_md_write(d->hd, data, length);
+	}
+#endif
+}
+
+static void mim_upload_digest_final(struct mim_upload_digest *d, unsigned char *digest, size_t *digest_len)
+{
+	size_t len = (d->type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA1) ? 20 : 48;
+#ifdef HAVE_OPENSSL
+	if (d->type == MOBILE_IMAGE_MOUNTER_DIGEST_SHA1) {
+		SHA1_Final(digest, &d->sha1);
+	} else {
+		SHA384_Final(digest, &d->sha384);
+	}
+#else
+	memcpy(digest, gcry_md_read(d->hd, 0), len);
+#endif
+	if (digest_len)
+		*digest_len = len;
+}
+
+static void mim_upload_digest_free(struct mim_upload_digest *d)
+{
+#ifndef HAVE_OPENSSL
+	if (d->hd) {
+		gcry_md_close(d->hd);
+		d->hd = NULL;
+	}
+#endif
+}
+
+/* two buffers, one is filled by the reader thread while the other is sent */
+struct mim_upload_reader {
+	mutex_t mutex;
+	cond_t cond;
+	unsigned char *buf[2];
+	ssize_t len[2];
+	int filled[2];
+	int stop;
+	size_t image_size;
+	size_t chunk_size;
+	mobile_image_mounter_upload_cb_t upload_cb;
+	void *userdata;
+	struct mim_upload_digest digest;
+};
+
+static void* mim_upload_reader_thread(void *arg)
+{
+	struct mim_upload_reader *rd = (struct mim_upload_reader*)arg;
+	size_t rx = 0;
+	int idx = 0;
+
+	while (rx < rd->image_size) {
+		mutex_lock(&rd->mutex);
+		while (rd->filled[idx] && !rd->stop) {
+			cond_wait(&rd->cond, &rd->mutex);
+		}
+		int stop = rd->stop;
+		mutex_unlock(&rd->mutex);
+		if (stop) {
+			break;
+		}
+
+		size_t remaining = rd->image_size - rx;
+		size_t amount = (remaining < rd->chunk_size) ? remaining : rd->chunk_size;
+		ssize_t r = rd->upload_cb(rd->buf[idx], amount, rd->userdata);
+		if (r <= 0) {
+			debug_info("upload_cb returned %d", (int)r);
+			r = -1;
+		} else {
+			mim_upload_digest_update(&rd->digest, rd->buf[idx], r);
+			rx += r;
+		}
+
+		mutex_lock(&rd->mutex);
+		rd->len[idx] = r;
+		rd->filled[idx] = 1;
+		cond_signal(&rd->cond);
+		mutex_unlock(&rd->mutex);
+		if (r < 0) {
+			break;
+		}
+		idx ^= 1;
+	}
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image_with_options(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata, size_t chunk_size, mobile_image_mounter_digest_t digest_type, unsigned char *digest, size_t *digest_len)
 {
 	if (!client || !image_type || (image_size == 0) || !upload_cb) {
 		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
 	}
+	if (digest_type != MOBILE_IMAGE_MOUNTER_DIGEST_NONE && !digest) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	if (chunk_size == 0) {
+		chunk_size = MOBILE_IMAGE_MOUNTER_DEFAULT_CHUNK_SIZE;
+	}
+	if (chunk_size > MOBILE_IMAGE_MOUNTER_MAX_CHUNK_SIZE) {
+		chunk_size = MOBILE_IMAGE_MOUNTER_MAX_CHUNK_SIZE;
+	}
 	mobile_image_mounter_lock(client);
 	plist_t result = NULL;
 
@@ -212,34 +360,82 @@ LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_im
 	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 		goto leave_unlock;
 	}
+	plist_free(result);
+	result = NULL;
 
+	struct mim_upload_reader rd;
+	THREAD_T reader;
 	size_t tx = 0;
-	size_t bufsize = 65536;
-	unsigned char *buf = (unsigned char*)malloc(bufsize);
-	if (!buf) {
+	int idx = 0;
+
+	memset(&rd, '\0', sizeof(rd));
+	rd.image_size = image_size;
+	rd.chunk_size = chunk_size;
+	rd.upload_cb = upload_cb;
+	rd.userdata = userdata;
+	rd.buf[0] = (unsigned char*)malloc(chunk_size);
+	rd.buf[1] = (unsigned char*)malloc(chunk_size);
+	if (!rd.buf[0] || !rd.buf[1] || mim_upload_digest_init(&rd.digest, digest_type) < 0) {
 		debug_info("Out of memory");
+		free(rd.buf[0]);
+		free(rd.buf[1]);
 		res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
 		goto leave_unlock;
 	}
-	debug_info("uploading image (%d bytes)", (int)image_size);
-	while (tx < image_size) {
-		size_t remaining = image_size - tx;
-		size_t amount = (remaining < bufsize) ? remaining : bufsize;
-		ssize_t r = upload_cb(buf, amount, userdata);
-		if (r < 0) {
-			debug_info("upload_cb returned %d", (int)r);
-			break;
-		}
-		uint32_t sent = 0;
-		if (service_send(client->parent->parent, (const char*)buf, (uint32_t)r, &sent) != SERVICE_E_SUCCESS) {
-			debug_info("service_send failed");
-			break;
+	mutex_init(&rd.mutex);
+	cond_init(&rd.cond);
+
+	debug_info("uploading image (%d bytes, chunk size %d)", (int)image_size, (int)chunk_size);
+	if (thread_new(&reader, mim_upload_reader_thread, &rd) != 0) {
+		debug_info("Could not start reader thread");
+		res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
+	} else {
+		while (tx < image_size) {
+			mutex_lock(&rd.mutex);
+			while (!rd.filled[idx]) {
+				cond_wait(&rd.cond, &rd.mutex);
+			}
+			ssize_t r = rd.len[idx];
+			mutex_unlock(&rd.mutex);
+			if (r < 0) {
+				break;
+			}
+
+			uint32_t sent = 0;
+			if (service_send(client->parent->parent, (const char*)rd.buf[idx], (uint32_t)r, &sent) != SERVICE_E_SUCCESS) {
+				debug_info("service_send failed");
+				break;
+			}
+			tx += r;
+
+			mutex_lock(&rd.mutex);
+			rd.filled[idx] = 0;
+			cond_signal(&rd.cond);
+			mutex_unlock(&rd.mutex);
+			idx ^= 1;
 		}
-		tx += r;
+
+		mutex_lock(&rd.mutex);
+		rd.stop = 1;
+		cond_signal(&rd.cond);
+		mutex_unlock(&rd.mutex);
+		thread_join(reader);
+		thread_free(reader);
+	}
+
+	if (tx == image_size && digest_type != MOBILE_IMAGE_MOUNTER_DIGEST_NONE) {
+		mim_upload_digest_final(&rd.digest, digest, digest_len);
 	}
-	free(buf);
+	mim_upload_digest_free(&rd.digest);
+	cond_destroy(&rd.cond);
+	mutex_destroy(&rd.mutex);
+	free(rd.buf[0]);
+	free(rd.buf[1]);
+
 	if (tx < image_size) {
 		debug_info("Error: failed to upload image");
+		if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS)
+			res = MOBILE_IMAGE_MOUNTER_E_UNKNOWN_ERROR;
 		goto leave_unlock;
 	}
 	debug_info("image uploaded");
@@ -256,7 +452,58 @@ leave_unlock:
 	if (result)
 		plist_free(result);
 	return res;
+}
 
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_upload_image(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata)
+{
+	return mobile_image_mounter_upload_image_with_options(client, image_type, image_size, signature, signature_size, upload_cb, userdata, 0, MOBILE_IMAGE_MOUNTER_DIGEST_NONE, NULL, NULL);
+}
+
+static int mim_signature_matches(plist_t node, const char *signature, uint16_t signature_size)
+{
+	char *data = NULL;
+	uint64_t data_len = 0;
+
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		return 0;
+	}
+	plist_get_data_val(node, &data, &data_len);
+	int match = (data && data_len == signature_size && memcmp(data, signature, signature_size) == 0);
+	free(data);
+	return match;
+}
+
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_is_image_mounted(mobile_image_mounter_client_t client, const char *image_type, const char *signature, uint16_t signature_size, int *mounted)
+{
+	if (!client || !image_type || !signature || signature_size == 0 || !mounted) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	*mounted = 0;
+
+	plist_t result = NULL;
+	mobile_image_mounter_error_t res = mobile_image_mounter_lookup_image(client, image_type, &result);
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		return res;
+	}
+
+	/* iOS 7 and later answer with an array of the signatures of all mounted
+	 * images of that type, older versions with a single data node */
+	plist_t node = plist_dict_get_item(result, "ImageSignature");
+	if (node && plist_get_node_type(node) == PLIST_ARRAY) {
+		uint32_t i;
+		for (i = 0; i < plist_array_get_size(node); i++) {
+			if (mim_signature_matches(plist_array_get_item(node, i), signature, signature_size)) {
+				*mounted = 1;
+				break;
+			}
+		}
+	} else if (node) {
+		*mounted = mim_signature_matches(node, signature, signature_size);
+	}
+	debug_info("image of type %s with the given signature is %smounted", image_type, (*mounted) ? "" : "not ");
+
+	plist_free(result);
+	return res;
 }
 
 LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_mount_image(mobile_image_mounter_client_t client, const char *image_path, const char *signature, uint16_t signature_size, const char *image_type, plist_t *result)
@@ -291,6 +538,44 @@ leave_unlock:
 	return res;
 }
 
+LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_ensure_mounted(mobile_image_mounter_client_t client, const char *image_type, size_t image_size, const char *signature, uint16_t signature_size, mobile_image_mounter_upload_cb_t upload_cb, void* userdata, int *already_mounted)
+{
+	if (!client || !image_type || (image_size == 0) || !signature || signature_size == 0 || !upload_cb) {
+		return MOBILE_IMAGE_MOUNTER_E_INVALID_ARG;
+	}
+	if (already_mounted) {
+		*already_mounted = 0;
+	}
+
+	int mounted = 0;
+	mobile_image_mounter_error_t res = mobile_image_mounter_is_image_mounted(client, image_type, signature, signature_size, &mounted);
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		return res;
+	}
+	if (mounted) {
+		debug_info("image is already mounted, skipping upload");
+		if (already_mounted) {
+			*already_mounted = 1;
+		}
+		return MOBILE_IMAGE_MOUNTER_E_SUCCESS;
+	}
+
+	res = mobile_image_mounter_upload_image(client, image_type, image_size, signature, signature_size, upload_cb, userdata);
+	if (res != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		return res;
+	}
+
+	plist_t result = NULL;
+	res = mobile_image_mounter_mount_image(client, MIM_STAGING_IMAGE_PATH, signature, signature_size, image_type, &result);
+	if (res == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		res = process_result(result, "Complete");
+	}
+	if (result) {
+		plist_free(result);
+	}
+	return res;
+}
+
 LIBIMOBILEDEVICE_API mobile_image_mounter_error_t mobile_image_mounter_hangup(mobile_image_mounter_client_t client)
 {
 	if (!client) {
@@ -217,6 +217,8 @@ LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_create_activation
 			*blob = plist_copy(node);
 		}
 	}
+	plist_free(result);
+	result = NULL;
 
 	return ret;
 }
@@ -315,3 +317,197 @@ LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_deactivate(mobile
 
 	return ret;
 }
+
+struct mobileactivation_batch_job {
+	struct mobileactivation_batch *batch;
+	const char *udid;
+};
+
+/**
+ * Performs one server round trip through a free transport slot, waiting for
+ * a slot if all of them are in use.
+ */
+static mobileactivation_error_t mobileactivation_batch_transfer(struct mobileactivation_batch *batch, const char *udid, mobileactivation_request_t request, plist_t body, plist_t *response, plist_t *headers)
+{
+	unsigned int slot = 0;
+
+	mutex_lock(&batch->mutex);
+	while (1) {
+		for (slot = 0; slot < batch->num_slots; slot++) {
+			if (!batch->slots[slot])
+				break;
+		}
+		if (slot < batch->num_slots)
+			break;
+		cond_wait(&batch->cond, &batch->mutex);
+	}
+	batch->slots[slot] = 1;
+	mutex_unlock(&batch->mutex);
+
+	*response = NULL;
+	*headers = NULL;
+	mobileactivation_error_t ret = batch->transport(slot, udid, request, body, response, headers, batch->user_data);
+	if (ret == MOBILEACTIVATION_E_SUCCESS && !*response) {
+		debug_info("ERROR: transport returned no response for %s", udid);
+		ret = MOBILEACTIVATION_E_REQUEST_FAILED;
+	}
+
+	mutex_lock(&batch->mutex);
+	batch->slots[slot] = 0;
+	cond_signal(&batch->cond);
+	mutex_unlock(&batch->mutex);
+
+	return ret;
+}
+
+static mobileactivation_error_t mobileactivation_batch_activate(struct mobileactivation_batch *batch, const char *udid, mobileactivation_client_t client)
+{
+	mobileactivation_error_t ret = MOBILEACTIVATION_E_SUCCESS;
+	plist_t handshake = NULL;
+	plist_t info = NULL;
+	plist_t record = NULL;
+	plist_t headers = NULL;
+
+	if (batch->use_session) {
+		plist_t session_info = NULL;
+		plist_t handshake_headers = NULL;
+		ret = mobileactivation_create_activation_session_info(client, &session_info);
+		if (ret == MOBILEACTIVATION_E_SUCCESS) {
+			ret = mobileactivation_batch_transfer(batch, udid, MOBILEACTIVATION_REQUEST_SESSION, session_info, &handshake, &handshake_headers);
+		}
+		plist_free(session_info);
+		plist_free(handshake_headers);
+		if (ret == MOBILEACTIVATION_E_SUCCESS) {
+			ret = mobileactivation_create_activation_info_with_session(client, handshake, &info);
+		}
+		plist_free(handshake);
+	} else {
+		ret = mobileactivation_create_activation_info(client, &info);
+	}
+	if (ret != MOBILEACTIVATION_E_SUCCESS) {
+		plist_free(info);
+		return ret;
+	}
+
+	ret = mobileactivation_batch_transfer(batch, udid, MOBILEACTIVATION_REQUEST_ACTIVATION, info, &record, &headers);
+	plist_free(info);
+	if (ret == MOBILEACTIVATION_E_SUCCESS) {
+		if (batch->use_session) {
+			ret = mobileactivation_activate_with_session(client, record, headers);
+		} else {
+			ret = mobileactivation_activate(client, record);
+		}
+	}
+	plist_free(record);
+	plist_free(headers);
+
+	return ret;
+}
+
+static void* mobileactivation_batch_job_run(void *arg)
+{
+	struct mobileactivation_batch_job *job = (struct mobileactivation_batch_job*)arg;
+	struct mobileactivation_batch *batch = job->batch;
+	mobileactivation_error_t ret = MOBILEACTIVATION_E_MUX_ERROR;
+	idevice_t device = NULL;
+	lockdownd_client_t lockdown = NULL;
+
+	if (idevice_new_with_options(&device, job->udid, IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK) != IDEVICE_E_SUCCESS) {
+		debug_info("ERROR: could not connect to device %s", job->udid);
+	} else if (lockdownd_client_acquire(device, &lockdown, "libimobiledevice") != LOCKDOWN_E_SUCCESS) {
+		debug_info("ERROR: could not connect to lockdownd of %s", job->udid);
+	} else {
+		/* the same session answers the state query and starts the service */
+		plist_t state = NULL;
+		lockdownd_get_value(lockdown, NULL, "ActivationState", &state);
+		if (state && plist_string_val_compare(state, "Activated") == 0) {
+			debug_info("%s is already activated", job->udid);
+			ret = MOBILEACTIVATION_E_SUCCESS;
+		} else {
+			lockdownd_service_descriptor_t service = NULL;
+			mobileactivation_client_t client = NULL;
+			if (lockdownd_start_service(lockdown, MOBILEACTIVATION_SERVICE_NAME, &service) == LOCKDOWN_E_SUCCESS) {
+				ret = mobileactivation_client_new(device, service, &client);
+				lockdownd_service_descriptor_free(service);
+			}
+			if (client) {
+				ret = mobileactivation_batch_activate(batch, job->udid, client);
+				mobileactivation_client_free(client);
+			}
+		}
+		plist_free(state);
+		lockdownd_client_release(lockdown);
+	}
+	idevice_free(device);
+
+	batch->callback(job->udid, ret, batch->user_data);
+	free(job);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API mobileactivation_error_t mobileactivation_activate_batch(const char **udids, uint32_t count, int use_session, uint32_t max_devices, uint32_t max_transfers, mobileactivation_transport_cb_t transport, mobileactivation_batch_cb_t callback, void *user_data)
+{
+	struct mobileactivation_batch batch;
+	threadpool_t pool = NULL;
+	uint32_t i;
+
+	if ((count > 0 && !udids) || !transport || !callback)
+		return MOBILEACTIVATION_E_INVALID_ARG;
+	for (i = 0; i < count; i++) {
+		if (!udids[i])
+			return MOBILEACTIVATION_E_INVALID_ARG;
+	}
+	if (count == 0)
+		return MOBILEACTIVATION_E_SUCCESS;
+
+	if (max_devices == 0)
+		max_devices = MOBILEACTIVATION_BATCH_DEFAULT_DEVICES;
+	if (max_transfers == 0)
+		max_transfers = MOBILEACTIVATION_BATCH_DEFAULT_TRANSFERS;
+
+	memset(&batch, 0, sizeof(batch));
+	batch.slots = (char*)calloc(max_transfers, 1);
+	if (!batch.slots)
+		return MOBILEACTIVATION_E_UNKNOWN_ERROR;
+	batch.num_slots = max_transfers;
+	batch.use_session = use_session;
+	batch.transport = transport;
+	batch.callback = callback;
+	batch.user_data = user_data;
+
+	/* more devices than transfers, so devices prepare their activation info
+	   while others wait for the server */
+	if (threadpool_new(&pool, (max_devices < count) ? max_devices : count, THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+		debug_info("ERROR: could not create thread pool");
+		free(batch.slots);
+		return MOBILEACTIVATION_E_UNKNOWN_ERROR;
+	}
+	mutex_init(&batch.mutex);
+	cond_init(&batch.cond);
+
+	for (i = 0; i < count; i++) {
+		struct mobileactivation_batch_job *job = (struct mobileactivation_batch_job*)malloc(sizeof(struct mobileactivation_batch_job));
+		thread_future_t future = NULL;
+		if (job) {
+			job->batch = &batch;
+			job->udid = udids[i];
+			future = threadpool_submit(pool, mobileactivation_batch_job_run, job);
+		}
+		if (!future) {
+			free(job);
+			callback(udids[i], MOBILEACTIVATION_E_UNKNOWN_ERROR, user_data);
+			continue;
+		}
+		thread_future_free(future);
+	}
+
+	/* waits for all devices to complete */
+	threadpool_free(pool);
+
+	cond_destroy(&batch.cond);
+	mutex_destroy(&batch.mutex);
+	free(batch.slots);
+
+	return MOBILEACTIVATION_E_SUCCESS;
+}
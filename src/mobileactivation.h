@@ -24,9 +24,27 @@
 
 #include "libimobiledevice/mobileactivation.h"
 #include "property_list_service.h"
+#include "common/thread.h"
+
+/* defaults of mobileactivation_activate_batch() */
+#define MOBILEACTIVATION_BATCH_DEFAULT_DEVICES 16
+#define MOBILEACTIVATION_BATCH_DEFAULT_TRANSFERS 4
 
 struct mobileactivation_client_private {
 	property_list_service_client_t parent;
 };
 
+/* hands out the transport slots of a batch */
+struct mobileactivation_batch {
+	mutex_t mutex;
+	cond_t cond;
+	/* non-zero for slots in use */
+	char *slots;
+	unsigned int num_slots;
+	int use_session;
+	mobileactivation_transport_cb_t transport;
+	mobileactivation_batch_cb_t callback;
+	void *user_data;
+};
+
 #endif
@@ -28,11 +28,22 @@
 
 #include "mobilebackup2.h"
 #include "device_link_service.h"
+#include "endianness.h"
+#include "trace.h"
 #include "common/debug.h"
 
 #define MBACKUP2_VERSION_INT1 400
 #define MBACKUP2_VERSION_INT2 0
 
+/* bounds and initial values for the size of a single raw receive */
+#define MBACKUP2_CHUNK_SIZE_MIN (16*1024)
+#define MBACKUP2_CHUNK_SIZE_MAX (4*1024*1024)
+#define MBACKUP2_CHUNK_SIZE_USB (1024*1024)
+#define MBACKUP2_CHUNK_SIZE_NETWORK (128*1024)
+
+/* largest file data block accepted from the device */
+#define MBACKUP2_BLOCK_SIZE_MAX (64*1024*1024)
+
 #define IS_FLAG_SET(x, y) ((x & y) == y)
 
 /**
@@ -82,6 +93,14 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_client_new(idevice_t de
 
 	mobilebackup2_client_t client_loc = (mobilebackup2_client_t) malloc(sizeof(struct mobilebackup2_client_private));
 	client_loc->parent = dlclient;
+	client_loc->next_length_avail = 0;
+	client_loc->block_buffer = NULL;
+	client_loc->block_buffer_size = 0;
+	if (dlclient->parent->parent->connection->type == CONNECTION_NETWORK) {
+		client_loc->chunk_size = MBACKUP2_CHUNK_SIZE_NETWORK;
+	} else {
+		client_loc->chunk_size = MBACKUP2_CHUNK_SIZE_USB;
+	}
 
 	/* perform handshake */
 	ret = mobilebackup2_error(device_link_service_version_exchange(dlclient, MBACKUP2_VERSION_INT1, MBACKUP2_VERSION_INT2));
@@ -112,6 +131,7 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_client_free(mobilebacku
 		device_link_service_disconnect(client->parent, NULL);
 		err = mobilebackup2_error(device_link_service_client_free(client->parent));
 	}
+	free(client->block_buffer);
 	free(client);
 	return err;
 }
@@ -221,22 +241,48 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_message(mobileb
 
 LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_raw(mobilebackup2_client_t client, const char *data, uint32_t length, uint32_t *bytes)
 {
-	if (!client || !client->parent || !data || (length == 0) || !bytes)
+	if (!data || (length == 0))
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	idevice_iovec_t iov;
+	iov.data = data;
+	iov.length = length;
+
+	return mobilebackup2_send_rawv(client, &iov, 1, bytes);
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_rawv(mobilebackup2_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *bytes)
+{
+	if (!client || !client->parent || !iov || (iovcnt == 0) || !bytes)
 		return MOBILEBACKUP2_E_INVALID_ARG;
 
 	*bytes = 0;
 
 	service_client_t raw = client->parent->parent->parent;
 
-	int bytes_loc = 0;
 	uint32_t sent = 0;
-	do {
-		bytes_loc = 0;
-		service_send(raw, data+sent, length-sent, (uint32_t*)&bytes_loc);
-		if (bytes_loc <= 0)
-			break;
-		sent += bytes_loc;
-	} while (sent < length);
+	service_sendv(raw, iov, iovcnt, &sent);
+	if (sent > 0) {
+		*bytes = sent;
+		return MOBILEBACKUP2_E_SUCCESS;
+	} else {
+		return MOBILEBACKUP2_E_MUX_ERROR;
+	}
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_send_file(mobilebackup2_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *bytes)
+{
+	if (!client || !client->parent || fd < 0 || (length == 0) || !bytes)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	*bytes = 0;
+
+	service_client_t raw = client->parent->parent->parent;
+
+	uint32_t sent = 0;
+	uint64_t trace_start = trace_begin();
+	service_send_file(raw, fd, offset, length, &sent);
+	trace_end("mobilebackup2", "SendFile", trace_start);
 	if (sent > 0) {
 		*bytes = sent;
 		return MOBILEBACKUP2_E_SUCCESS;
@@ -256,6 +302,19 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_raw(mobilebacku
 
 	int bytes_loc = 0;
 	uint32_t received = 0;
+
+	/* hand out what mobilebackup2_receive_block() has read ahead first */
+	if (client->next_length_avail > 0) {
+		received = (length < client->next_length_avail) ? length : client->next_length_avail;
+		memcpy(data, client->next_length, received);
+		client->next_length_avail -= received;
+		memmove(client->next_length, client->next_length + received, client->next_length_avail);
+		if (received == length) {
+			*bytes = received;
+			return MOBILEBACKUP2_E_SUCCESS;
+		}
+	}
+
 	do {
 		bytes_loc = 0;
 		service_receive(raw, data+received, length-received, (uint32_t*)&bytes_loc);
@@ -272,6 +331,128 @@ LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_raw(mobilebacku
 	}
 }
 
+/**
+ * Receives length bytes into data, picking up to extra additional bytes
+ * when they arrive together with the requested data. Single receives are
+ * bounded by the client's chunk size, which is adapted on the way: reads
+ * that fill a whole chunk let it grow, reads far below it let it shrink.
+ *
+ * @param client The MobileBackup client to receive from.
+ * @param data Buffer large enough to hold length + extra bytes.
+ * @param length Number of bytes that have to be received.
+ * @param extra Number of bytes that may additionally be received.
+ * @param received Number of bytes actually received.
+ *
+ * @return MOBILEBACKUP2_E_SUCCESS if at least length bytes were received,
+ *     MOBILEBACKUP2_E_RECEIVE_TIMEOUT or MOBILEBACKUP2_E_MUX_ERROR otherwise.
+ */
+static mobilebackup2_error_t internal_mobilebackup2_receive_full(mobilebackup2_client_t client, char *data, uint32_t length, uint32_t extra, uint32_t *received)
+{
+	service_client_t raw = client->parent->parent->parent;
+	uint32_t total = 0;
+
+	while (total < length) {
+		uint32_t want = length + extra - total;
+		if (want > client->chunk_size) {
+			want = client->chunk_size;
+		}
+		uint32_t r = 0;
+		service_error_t serr = service_receive(raw, data + total, want, &r);
+		if (r == 0) {
+			*received = total;
+			return (serr == SERVICE_E_TIMEOUT) ? MOBILEBACKUP2_E_RECEIVE_TIMEOUT : MOBILEBACKUP2_E_MUX_ERROR;
+		}
+		if (want == client->chunk_size) {
+			if (r == want && client->chunk_size < MBACKUP2_CHUNK_SIZE_MAX) {
+				client->chunk_size *= 2;
+				debug_info("chunk size raised to %u", client->chunk_size);
+			} else if (r < want / 8 && client->chunk_size > MBACKUP2_CHUNK_SIZE_MIN) {
+				client->chunk_size /= 2;
+				debug_info("chunk size lowered to %u", client->chunk_size);
+			}
+		}
+		total += r;
+	}
+	*received = total;
+
+	return MOBILEBACKUP2_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_receive_block(mobilebackup2_client_t client, char *buffer, uint32_t buffer_size, char **data, uint32_t *length, char *code)
+{
+	if (!client || !client->parent || !data || !length || !code)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	mobilebackup2_error_t err;
+	uint32_t received = 0;
+	uint32_t blen = 0;
+
+	*data = NULL;
+	*length = 0;
+	*code = 0;
+
+	/* block length, unless it arrived with the previous block */
+	if (client->next_length_avail < 4) {
+		err = internal_mobilebackup2_receive_full(client, client->next_length + client->next_length_avail, 4 - client->next_length_avail, 0, &received);
+		client->next_length_avail += received;
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			return err;
+		}
+	}
+	memcpy(&blen, client->next_length, 4);
+	client->next_length_avail = 0;
+	blen = be32toh(blen);
+
+	/* a zero length terminates the sequence of blocks */
+	if (blen == 0) {
+		return MOBILEBACKUP2_E_SUCCESS;
+	}
+	if (blen - 1 > MBACKUP2_BLOCK_SIZE_MAX) {
+		debug_info("ERROR: block of %u bytes exceeds the maximum of %u bytes", blen - 1, MBACKUP2_BLOCK_SIZE_MAX);
+		return MOBILEBACKUP2_E_BLOCK_TOO_LARGE;
+	}
+
+	/* code, payload and the length field of the following block */
+	char *dest = buffer;
+	if (!dest || buffer_size < blen + 4) {
+		if (client->block_buffer_size < blen + 4) {
+			char *newbuf = (char*)realloc(client->block_buffer, blen + 4);
+			if (!newbuf) {
+				return MOBILEBACKUP2_E_UNKNOWN_ERROR;
+			}
+			client->block_buffer = newbuf;
+			client->block_buffer_size = blen + 4;
+		}
+		dest = client->block_buffer;
+	}
+
+	uint64_t trace_start = trace_begin();
+	err = internal_mobilebackup2_receive_full(client, dest, blen, 4, &received);
+	trace_end("mobilebackup2", "ReceiveBlock", trace_start);
+	if (err != MOBILEBACKUP2_E_SUCCESS) {
+		debug_info("ERROR: received only %u of %u bytes of block", received, blen);
+		return err;
+	}
+	client->next_length_avail = received - blen;
+	memcpy(client->next_length, dest + blen, client->next_length_avail);
+
+	*code = dest[0];
+	*data = dest + 1;
+	*length = blen - 1;
+
+	return MOBILEBACKUP2_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_get_chunk_size(mobilebackup2_client_t client, uint32_t *size)
+{
+	if (!client || !size)
+		return MOBILEBACKUP2_E_INVALID_ARG;
+
+	*size = client->chunk_size;
+
+	return MOBILEBACKUP2_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API mobilebackup2_error_t mobilebackup2_version_exchange(mobilebackup2_client_t client, double local_versions[], char count, double *remote_version)
 {
 	int i;
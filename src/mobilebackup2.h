@@ -27,6 +27,14 @@
 
 struct mobilebackup2_client_private {
 	device_link_service_client_t parent;
+	/* length field of the next block, read ahead with the previous block */
+	char next_length[4];
+	uint32_t next_length_avail;
+	/* receive buffer used by mobilebackup2_receive_block() */
+	char *block_buffer;
+	uint32_t block_buffer_size;
+	/* upper bound for a single receive, adapted to the link */
+	uint32_t chunk_size;
 };
 
 #endif
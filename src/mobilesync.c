@@ -30,10 +30,12 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "mobilesync.h"
 #include "device_link_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 #define MSYNC_VERSION_INT1 300
 #define MSYNC_VERSION_INT2 100
@@ -88,6 +90,7 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_client_new(idevice_t device,
 	client_loc->parent = dlclient;
 	client_loc->direction = MOBILESYNC_SYNC_DIR_DEVICE_TO_COMPUTER;
 	client_loc->data_class = NULL;
+	client_loc->device_anchor = NULL;
 
 	/* perform handshake */
 	ret = mobilesync_error(device_link_service_version_exchange(dlclient, MSYNC_VERSION_INT1, MSYNC_VERSION_INT2));
@@ -115,6 +118,7 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_client_free(mobilesync_client
 		return MOBILESYNC_E_INVALID_ARG;
 	device_link_service_disconnect(client->parent, "All done, thanks for the memories");
 	mobilesync_error_t err = mobilesync_error(device_link_service_client_free(client->parent));
+	free(client->device_anchor);
 	free(client);
 	return err;
 }
@@ -239,6 +243,17 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_start(mobilesync_client_t cli
 		plist_get_uint_val(device_data_class_version_node, device_data_class_version);
 	}
 
+	/* the anchor the device will expect next time */
+	free(client->device_anchor);
+	client->device_anchor = NULL;
+	plist_t device_anchor_node = plist_array_get_item(msg, 3);
+	if (plist_get_node_type(device_anchor_node) != PLIST_STRING) {
+		device_anchor_node = plist_array_get_item(msg, 2);
+	}
+	if (plist_get_node_type(device_anchor_node) == PLIST_STRING) {
+		plist_get_string_val(device_anchor_node, &client->device_anchor);
+	}
+
 	err = MOBILESYNC_E_SUCCESS;
 
 	out:
@@ -355,24 +370,20 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_get_changes_from_device(mobil
 	return mobilesync_get_records(client, "SDMessageGetChangesFromDevice");
 }
 
-LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
+/* receives a batch of changes, *msg is only set if it is one */
+static mobilesync_error_t mobilesync_receive_changes_message(mobilesync_client_t client, plist_t *msg)
 {
-	if (!client || !client->data_class) {
-		return MOBILESYNC_E_INVALID_ARG;
-	}
-
-	plist_t msg = NULL;
 	plist_t response_type_node = NULL;
-	plist_t actions_node = NULL;
 	char *response_type = NULL;
-	uint8_t has_more_changes = 0;
 
-	mobilesync_error_t err = mobilesync_receive(client, &msg);
+	*msg = NULL;
+
+	mobilesync_error_t err = mobilesync_receive(client, msg);
 	if (err != MOBILESYNC_E_SUCCESS) {
 		goto out;
 	}
 
-	response_type_node = plist_array_get_item(msg, 0);
+	response_type_node = plist_array_get_item(*msg, 0);
 	if (!response_type_node) {
 		err = MOBILESYNC_E_PLIST_ERROR;
 		goto out;
@@ -387,12 +398,39 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes(mobilesync_cl
 	if (!strcmp(response_type, "SDMessageCancelSession")) {
 		char *reason = NULL;
 		err = MOBILESYNC_E_CANCELLED;
-		plist_get_string_val(plist_array_get_item(msg, 2), &reason);
+		plist_get_string_val(plist_array_get_item(*msg, 2), &reason);
 		debug_info("Device cancelled: %s", reason);
 		free(reason);
 		goto out;
 	}
 
+	out:
+	if (response_type) {
+		free(response_type);
+		response_type = NULL;
+	}
+	if (err != MOBILESYNC_E_SUCCESS && *msg) {
+		plist_free(*msg);
+		*msg = NULL;
+	}
+	return err;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes(mobilesync_client_t client, plist_t *entities, uint8_t *is_last_record, plist_t *actions)
+{
+	if (!client || !client->data_class) {
+		return MOBILESYNC_E_INVALID_ARG;
+	}
+
+	plist_t msg = NULL;
+	plist_t actions_node = NULL;
+	uint8_t has_more_changes = 0;
+
+	mobilesync_error_t err = mobilesync_receive_changes_message(client, &msg);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		return err;
+	}
+
 	if (entities != NULL) {
 		*entities = plist_copy(plist_array_get_item(msg, 2));
 	}
@@ -410,15 +448,74 @@ LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes(mobilesync_cl
 			*actions = NULL;
 	}
 
-	out:
-	if (response_type) {
-		free(response_type);
-		response_type = NULL;
+	plist_free(msg);
+
+	return err;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes_with_callback(mobilesync_client_t client, uint32_t flags, mobilesync_record_cb_t callback, void *user_data)
+{
+	if (!client || !client->data_class || !callback) {
+		return MOBILESYNC_E_INVALID_ARG;
 	}
-	if (msg) {
+
+	mobilesync_error_t err = MOBILESYNC_E_SUCCESS;
+	uint8_t has_more_changes = 1;
+
+	while (has_more_changes && err == MOBILESYNC_E_SUCCESS) {
+		plist_t msg = NULL;
+		err = mobilesync_receive_changes_message(client, &msg);
+		if (err != MOBILESYNC_E_SUCCESS) {
+			break;
+		}
+
+		has_more_changes = 0;
+		plist_get_bool_val(plist_array_get_item(msg, 3), &has_more_changes);
+
+		plist_t actions = plist_array_get_item(msg, 4);
+		if (plist_get_node_type(actions) != PLIST_DICT) {
+			actions = NULL;
+		}
+
+		/* the device prepares the next batch while this one is processed */
+		if (flags & MOBILESYNC_RECEIVE_ACK_EARLY) {
+			err = mobilesync_acknowledge_changes_from_device(client);
+		}
+
+		/* hand out the records in place instead of copying the batch */
+		plist_t entities = plist_array_get_item(msg, 2);
+		if (err == MOBILESYNC_E_SUCCESS && entities && plist_get_node_type(entities) == PLIST_DICT) {
+			plist_dict_iter iter = NULL;
+			char *record_id = NULL;
+			plist_t record = NULL;
+
+			plist_dict_new_iter(entities, &iter);
+			if (iter) {
+				plist_dict_next_item(entities, iter, &record_id, &record);
+				while (record) {
+					int stop = callback(record_id, record, actions, user_data);
+					free(record_id);
+					record_id = NULL;
+					if (stop) {
+						debug_info("Record callback requested to stop");
+						err = MOBILESYNC_E_CANCELLED;
+						break;
+					}
+					record = NULL;
+					plist_dict_next_item(entities, iter, &record_id, &record);
+				}
+				free(record_id);
+				free(iter);
+			}
+		}
+
+		if (err == MOBILESYNC_E_SUCCESS && !(flags & MOBILESYNC_RECEIVE_ACK_EARLY)) {
+			err = mobilesync_acknowledge_changes_from_device(client);
+		}
+
 		plist_free(msg);
-		msg = NULL;
 	}
+
 	return err;
 }
 
@@ -793,3 +890,302 @@ LIBIMOBILEDEVICE_API void mobilesync_actions_free(plist_t actions)
 		actions = NULL;
 	}
 }
+
+static void mobilesync_store_reset(mobilesync_store_t store)
+{
+	plist_free(store->seen);
+	store->seen = NULL;
+	free(store->new_device_anchor);
+	store->new_device_anchor = NULL;
+	free(store->new_computer_anchor);
+	store->new_computer_anchor = NULL;
+	store->started = 0;
+}
+
+/**
+ * Hashes a record with 64-bit FNV-1a over its binary plist representation.
+ */
+static uint64_t mobilesync_record_hash(plist_t record)
+{
+	char *bin = NULL;
+	uint32_t length = 0;
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	uint32_t i;
+
+	plist_to_bin(record, &bin, &length);
+	for (i = 0; i < length; i++) {
+		hash ^= (unsigned char)bin[i];
+		hash *= 0x100000001b3ULL;
+	}
+	free(bin);
+
+	return hash;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_open(const char *filename, const char *data_class, mobilesync_store_t *store)
+{
+	if (!filename || !data_class || !store)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	mobilesync_store_t store_loc = (mobilesync_store_t)calloc(1, sizeof(struct mobilesync_store_private));
+	if (!store_loc)
+		return MOBILESYNC_E_UNKNOWN_ERROR;
+
+	store_loc->filename = strdup(filename);
+	store_loc->data_class = strdup(data_class);
+
+	plist_read_from_filename(&store_loc->root, filename);
+	if (plist_get_node_type(store_loc->root) != PLIST_DICT) {
+		if (store_loc->root) {
+			debug_info("ignoring invalid sync store %s", filename);
+		}
+		plist_free(store_loc->root);
+		store_loc->root = plist_new_dict();
+	}
+
+	plist_t entry = plist_dict_get_item(store_loc->root, data_class);
+	if (plist_get_node_type(entry) == PLIST_DICT) {
+		plist_t node = plist_dict_get_item(entry, "DeviceAnchor");
+		if (plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &store_loc->device_anchor);
+		}
+		node = plist_dict_get_item(entry, "ComputerAnchor");
+		if (plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &store_loc->computer_anchor);
+		}
+		node = plist_dict_get_item(entry, "Records");
+		if (plist_get_node_type(node) == PLIST_DICT) {
+			store_loc->records = plist_copy(node);
+		}
+	}
+	if (!store_loc->records) {
+		store_loc->records = plist_new_dict();
+	}
+
+	*store = store_loc;
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_free(mobilesync_store_t store)
+{
+	if (!store)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	mobilesync_store_reset(store);
+	plist_free(store->records);
+	plist_free(store->root);
+	free(store->device_anchor);
+	free(store->computer_anchor);
+	free(store->data_class);
+	free(store->filename);
+	free(store);
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_start(mobilesync_client_t client, mobilesync_store_t store, uint64_t computer_data_class_version, mobilesync_sync_type_t *sync_type, uint64_t *device_data_class_version, char** error_description)
+{
+	if (!client || !store)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	mobilesync_store_reset(store);
+
+	/* a new computer anchor for every session, the device hands it back next time */
+	char computer_anchor[32];
+	snprintf(computer_anchor, sizeof(computer_anchor), "%llu", (unsigned long long)time(NULL));
+
+	mobilesync_anchors_t anchors = NULL;
+	mobilesync_anchors_new(store->device_anchor, computer_anchor, &anchors);
+
+	mobilesync_sync_type_t type = MOBILESYNC_SYNC_TYPE_SLOW;
+	mobilesync_error_t err = mobilesync_start(client, store->data_class, anchors, computer_data_class_version, &type, device_data_class_version, error_description);
+	mobilesync_anchors_free(anchors);
+	if (err != MOBILESYNC_E_SUCCESS) {
+		return err;
+	}
+
+	if (type != MOBILESYNC_SYNC_TYPE_FAST) {
+		debug_info("device requested a %s sync, stored records will be compared against all records", (type == MOBILESYNC_SYNC_TYPE_SLOW) ? "slow" : "reset");
+		/* remember what the device still has to find records it removed */
+		store->seen = plist_new_dict();
+	}
+	if (client->device_anchor) {
+		store->new_device_anchor = strdup(client->device_anchor);
+	}
+	store->new_computer_anchor = strdup(computer_anchor);
+	store->sync_type = type;
+	store->started = 1;
+
+	if (sync_type) {
+		*sync_type = type;
+	}
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_record_changed(mobilesync_store_t store, const char *record_id, plist_t record, uint8_t *changed)
+{
+	if (!store || !record_id || !record || !changed)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	if (store->seen) {
+		plist_dict_set_item(store->seen, record_id, plist_new_bool(1));
+	}
+
+	uint64_t hash = mobilesync_record_hash(record);
+	uint64_t stored = 0;
+	plist_t node = plist_dict_get_item(store->records, record_id);
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &stored);
+		if (stored == hash) {
+			*changed = 0;
+			return MOBILESYNC_E_SUCCESS;
+		}
+	}
+
+	plist_dict_set_item(store->records, record_id, plist_new_uint(hash));
+	*changed = 1;
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_remove_record(mobilesync_store_t store, const char *record_id)
+{
+	if (!store || !record_id)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	if (plist_dict_get_item(store->records, record_id)) {
+		plist_dict_remove_item(store->records, record_id);
+	}
+	if (store->seen && plist_dict_get_item(store->seen, record_id)) {
+		plist_dict_remove_item(store->seen, record_id);
+	}
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_get_removed(mobilesync_store_t store, plist_t *removed)
+{
+	if (!store || !removed)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	*removed = plist_new_array();
+	if (!store->seen) {
+		return MOBILESYNC_E_SUCCESS;
+	}
+
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(store->records, &iter);
+	if (iter) {
+		char *record_id = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(store->records, iter, &record_id, &node);
+		while (node) {
+			if (!plist_dict_get_item(store->seen, record_id)) {
+				plist_array_append_item(*removed, plist_new_string(record_id));
+			}
+			free(record_id);
+			record_id = NULL;
+			node = NULL;
+			plist_dict_next_item(store->records, iter, &record_id, &node);
+		}
+		free(record_id);
+		free(iter);
+	}
+
+	return MOBILESYNC_E_SUCCESS;
+}
+
+struct mobilesync_store_filter {
+	mobilesync_store_t store;
+	mobilesync_record_cb_t callback;
+	void *user_data;
+};
+
+static int mobilesync_store_filter_record(const char *record_id, plist_t record, plist_t actions, void *user_data)
+{
+	struct mobilesync_store_filter *filter = (struct mobilesync_store_filter*)user_data;
+
+	if (plist_get_node_type(record) != PLIST_DICT) {
+		/* not a record but a deletion, always passed on */
+		mobilesync_store_remove_record(filter->store, record_id);
+		return filter->callback(record_id, record, actions, filter->user_data);
+	}
+
+	uint8_t changed = 1;
+	mobilesync_store_record_changed(filter->store, record_id, record, &changed);
+	if (!changed) {
+		return 0;
+	}
+
+	return filter->callback(record_id, record, actions, filter->user_data);
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_receive_changes_with_store(mobilesync_client_t client, mobilesync_store_t store, uint32_t flags, mobilesync_record_cb_t callback, void *user_data)
+{
+	if (!client || !store || !store->started || !callback)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	struct mobilesync_store_filter filter = { store, callback, user_data };
+
+	return mobilesync_receive_changes_with_callback(client, flags, mobilesync_store_filter_record, &filter);
+}
+
+LIBIMOBILEDEVICE_API mobilesync_error_t mobilesync_store_commit(mobilesync_store_t store)
+{
+	if (!store || !store->started)
+		return MOBILESYNC_E_INVALID_ARG;
+
+	/* drop the records the device no longer has */
+	if (store->seen) {
+		plist_t removed = NULL;
+		mobilesync_store_get_removed(store, &removed);
+		uint32_t i;
+		for (i = 0; i < plist_array_get_size(removed); i++) {
+			char *record_id = NULL;
+			plist_get_string_val(plist_array_get_item(removed, i), &record_id);
+			if (record_id) {
+				plist_dict_remove_item(store->records, record_id);
+				free(record_id);
+			}
+		}
+		plist_free(removed);
+	}
+
+	free(store->device_anchor);
+	store->device_anchor = store->new_device_anchor;
+	store->new_device_anchor = NULL;
+	free(store->computer_anchor);
+	store->computer_anchor = store->new_computer_anchor;
+	store->new_computer_anchor = NULL;
+
+	plist_t entry = plist_new_dict();
+	if (store->device_anchor) {
+		plist_dict_set_item(entry, "DeviceAnchor", plist_new_string(store->device_anchor));
+	}
+	if (store->computer_anchor) {
+		plist_dict_set_item(entry, "ComputerAnchor", plist_new_string(store->computer_anchor));
+	}
+	plist_dict_set_item(entry, "Records", plist_copy(store->records));
+	plist_dict_set_item(store->root, store->data_class, entry);
+
+	mobilesync_store_reset(store);
+
+	/* write to a temporary file first so a crash never leaves a truncated store */
+	char *tmppath = string_concat(store->filename, ".tmp", NULL);
+	if (plist_write_to_filename(store->root, tmppath, PLIST_FORMAT_BINARY) == 0) {
+		debug_info("could not write sync store file %s", tmppath);
+		free(tmppath);
+		return MOBILESYNC_E_UNKNOWN_ERROR;
+	}
+	if (rename(tmppath, store->filename) != 0) {
+		debug_info("could not replace sync store file %s", store->filename);
+		remove(tmppath);
+		free(tmppath);
+		return MOBILESYNC_E_UNKNOWN_ERROR;
+	}
+	free(tmppath);
+
+	return MOBILESYNC_E_SUCCESS;
+}
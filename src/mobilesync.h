@@ -35,6 +35,21 @@ struct mobilesync_client_private {
 	device_link_service_client_t parent;
 	mobilesync_sync_direction_t direction;
 	char *data_class;
+	char *device_anchor;
+};
+
+struct mobilesync_store_private {
+	char *filename;
+	char *data_class;
+	plist_t root;
+	plist_t records;
+	plist_t seen;
+	char *device_anchor;
+	char *computer_anchor;
+	char *new_device_anchor;
+	char *new_computer_anchor;
+	mobilesync_sync_type_t sync_type;
+	int started;
 };
 
 #endif
@@ -30,11 +30,8 @@
 #include "property_list_service.h"
 #include "common/debug.h"
 
-#ifdef WIN32
-#define sleep(x) Sleep(x*1000)
-#else
-#include <unistd.h>
-#endif
+/* how often the notifier thread checks whether it should stop while idle */
+#define NP_NOTIFIER_STOP_CHECK_INTERVAL 500
 
 struct np_thread {
 	np_client_t client;
@@ -102,7 +99,8 @@ LIBIMOBILEDEVICE_API np_error_t np_client_new(idevice_t device, lockdownd_servic
 	client_loc->parent = plistclient;
 
 	mutex_init(&client_loc->mutex);
-	client_loc->notifier = THREAD_T_NULL;
+	client_loc->notifier = NULL;
+	client_loc->delivery = NULL;
 
 	*client = client_loc;
 	return NP_E_SUCCESS;
@@ -134,9 +132,9 @@ LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 
 	if (client->notifier) {
 		debug_info("joining np callback");
-		thread_join(client->notifier);
-		thread_free(client->notifier);
-		client->notifier = THREAD_T_NULL;
+		thread_future_wait(client->notifier);
+		thread_future_free(client->notifier);
+		client->notifier = NULL;
 	} else {
 		dict = NULL;
 		property_list_service_receive_plist(parent, &dict);
@@ -163,6 +161,7 @@ LIBIMOBILEDEVICE_API np_error_t np_client_free(np_client_t client)
 
 	property_list_service_client_free(parent);
 
+	delivery_queue_free(client->delivery);
 	mutex_destroy(&client->mutex);
 	free(client);
 
@@ -218,7 +217,8 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notification( np_client_t client, con
 
 LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, const char **notification_spec)
 {
-	int i = 0;
+	uint32_t i;
+	uint32_t count = 0;
 	np_error_t res = NP_E_UNKNOWN_ERROR;
 	const char **notifications = notification_spec;
 
@@ -230,15 +230,35 @@ LIBIMOBILEDEVICE_API np_error_t np_observe_notifications(np_client_t client, con
 		return NP_E_INVALID_ARG;
 	}
 
-	np_lock(client);
-	while (notifications[i]) {
-		res = internal_np_observe_notification(client, notifications[i]);
-		if (res != NP_E_SUCCESS) {
-			break;
-		}
-		i++;
+	while (notifications[count]) {
+		count++;
+	}
+	if (count == 0) {
+		return res;
+	}
+
+	plist_t *requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!requests) {
+		return NP_E_UNKNOWN_ERROR;
 	}
+	for (i = 0; i < count; i++) {
+		requests[i] = plist_new_dict();
+		plist_dict_set_item(requests[i], "Command", plist_new_string("ObserveNotification"));
+		plist_dict_set_item(requests[i], "Name", plist_new_string(notifications[i]));
+	}
+
+	/* the device does not answer these, so all of them go out in one write */
+	np_lock(client);
+	res = np_error(property_list_service_send_plists(client->parent, requests, count, 0));
 	np_unlock(client);
+	if (res != NP_E_SUCCESS) {
+		debug_info("Error sending XML plists to device!");
+	}
+
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
 
 	return res;
 }
@@ -261,11 +281,16 @@ static int np_get_notification(np_client_t client, char **notification)
 	int res = 0;
 	plist_t dict = NULL;
 
-	if (!client || !client->parent || *notification)
+	if (!client || *notification)
 		return -1;
 
 	np_lock(client);
 
+	if (!client->parent) {
+		np_unlock(client);
+		return -1;
+	}
+
 	property_list_service_error_t perr = property_list_service_receive_plist_with_timeout(client->parent, &dict, 500);
 	if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
 		debug_info("NotificationProxy: no notification received!");
@@ -317,6 +342,16 @@ static int np_get_notification(np_client_t client, char **notification)
 	return res;
 }
 
+/**
+ * Invokes the callback with a notification queued by np_notifier(), on the
+ * callback thread.
+ */
+static void np_deliver(void *entry, void *user_data)
+{
+	struct np_thread *npt = (struct np_thread*)user_data;
+	npt->cbfunc((const char*)entry, npt->user_data);
+}
+
 /**
  * Internally used thread function.
  */
@@ -327,22 +362,51 @@ void* np_notifier( void* arg )
 
 	if (!npt) return NULL;
 
+	delivery_queue_t queue = npt->client->delivery;
+
 	debug_info("starting callback.");
 	while (npt->client->parent) {
-		if (np_get_notification(npt->client, &notification) < 0) {
-			npt->cbfunc("", npt->user_data);
+		/* wait for data without holding the client lock so that other
+		 * requests can be sent in the meantime */
+		property_list_service_client_t parent = npt->client->parent;
+		if (!parent) {
+			break;
+		}
+		property_list_service_error_t perr = property_list_service_wait_readable(parent, NP_NOTIFIER_STOP_CHECK_INTERVAL);
+		if (perr == PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT) {
+			continue;
+		}
+		if (!npt->client->parent) {
+			/* np_client_free() or np_set_notify_callback() asked us to stop */
+			break;
+		}
+		if (perr != PROPERTY_LIST_SERVICE_E_SUCCESS || np_get_notification(npt->client, &notification) < 0) {
+			if (npt->client->parent) {
+				if (queue) {
+					char *empty = strdup("");
+					if (empty) {
+						delivery_queue_push(queue, empty);
+					}
+				} else {
+					npt->cbfunc("", npt->user_data);
+				}
+			}
 			break;
 		}
 		if (notification) {
-			npt->cbfunc(notification, npt->user_data);
-			free(notification);
+			if (queue) {
+				/* the queue frees it after delivery */
+				delivery_queue_push(queue, notification);
+			} else {
+				npt->cbfunc(notification, npt->user_data);
+				free(notification);
+			}
 			notification = NULL;
 		}
-		sleep(1);
-	}
-	if (npt) {
-		free(npt);
 	}
+	/* the callback thread uses npt until everything queued is delivered */
+	delivery_queue_stop(queue);
+	free(npt);
 
 	return NULL;
 }
@@ -359,9 +423,12 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 		debug_info("callback already set, removing");
 		property_list_service_client_t parent = client->parent;
 		client->parent = NULL;
-		thread_join(client->notifier);
-		thread_free(client->notifier);
-		client->notifier = THREAD_T_NULL;
+		/* the notifier thread needs the lock to finish a pending receive */
+		np_unlock(client);
+		thread_future_wait(client->notifier);
+		np_lock(client);
+		thread_future_free(client->notifier);
+		client->notifier = NULL;
 		client->parent = parent;
 	}
 
@@ -372,8 +439,19 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 			npt->cbfunc = notify_cb;
 			npt->user_data = user_data;
 
-			if (thread_new(&client->notifier, np_notifier, npt) == 0) {
+			if (client->delivery && delivery_queue_start(client->delivery, np_deliver, npt) < 0) {
+				debug_info("could not start the callback thread");
+				free(npt);
+				np_unlock(client);
+				return res;
+			}
+
+			client->notifier = threadpool_submit(threadpool_shared(), np_notifier, npt);
+			if (client->notifier) {
 				res = NP_E_SUCCESS;
+			} else {
+				delivery_queue_stop(client->delivery);
+				free(npt);
 			}
 		}
 	} else {
@@ -383,3 +461,36 @@ LIBIMOBILEDEVICE_API np_error_t np_set_notify_callback( np_client_t client, np_n
 
 	return res;
 }
+
+LIBIMOBILEDEVICE_API np_error_t np_set_delivery(np_client_t client, uint32_t capacity, enum idevice_delivery_policy policy)
+{
+	delivery_queue_t queue = NULL;
+	np_error_t res = NP_E_SUCCESS;
+
+	if (!client || (policy != IDEVICE_DELIVERY_DROP_OLDEST && policy != IDEVICE_DELIVERY_BLOCK))
+		return NP_E_INVALID_ARG;
+
+	np_lock(client);
+	if (client->notifier) {
+		debug_info("cannot change the delivery while a callback is set");
+		res = NP_E_UNKNOWN_ERROR;
+	} else if (capacity > 0 && delivery_queue_new(&queue, capacity, policy, free) < 0) {
+		res = NP_E_UNKNOWN_ERROR;
+	} else {
+		delivery_queue_free(client->delivery);
+		client->delivery = queue;
+	}
+	np_unlock(client);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API np_error_t np_get_dropped(np_client_t client, uint64_t *dropped)
+{
+	if (!client || !dropped)
+		return NP_E_INVALID_ARG;
+
+	*dropped = delivery_queue_get_dropped(client->delivery);
+
+	return NP_E_SUCCESS;
+}
@@ -24,12 +24,15 @@
 
 #include "libimobiledevice/notification_proxy.h"
 #include "property_list_service.h"
+#include "delivery.h"
 #include "common/thread.h"
 
 struct np_client_private {
 	property_list_service_client_t parent;
 	mutex_t mutex;
-	THREAD_T notifier;
+	thread_future_t notifier;
+	/* set with np_set_delivery() to call back on another thread */
+	delivery_queue_t delivery;
 };
 
 void* np_notifier(void* arg);
@@ -30,6 +30,15 @@
 #include "lockdown.h"
 #include "common/debug.h"
 
+static thread_once_t preboard_once = THREAD_ONCE_INIT;
+static mutex_t preboard_mutex;
+static idevice_event_loop_t shared_loop = NULL;
+
+static void preboard_init(void)
+{
+	mutex_init(&preboard_mutex);
+}
+
 /**
  * Convert a property_list_service_error_t value to a preboard_error_t value.
  * Used internally to get correct error codes.
@@ -82,7 +91,9 @@ LIBIMOBILEDEVICE_API preboard_error_t preboard_client_new(idevice_t device, lock
 
 	preboard_client_t client_loc = (preboard_client_t) malloc(sizeof(struct preboard_client_private));
 	client_loc->parent = plclient;
-	client_loc->receive_status_thread = THREAD_T_NULL;
+	client_loc->loop = NULL;
+	client_loc->status_cb = NULL;
+	client_loc->user_data = NULL;
 
 	*client = client_loc;
 
@@ -102,14 +113,19 @@ LIBIMOBILEDEVICE_API preboard_error_t preboard_client_free(preboard_client_t cli
 	if (!client)
 		return PREBOARD_E_INVALID_ARG;
 
+	thread_once(&preboard_once, preboard_init);
+	mutex_lock(&preboard_mutex);
+	idevice_event_loop_t loop = client->loop;
+	mutex_unlock(&preboard_mutex);
+	if (loop) {
+		/* waits for a running status callback to return */
+		debug_info("stopping status loop");
+		idevice_event_loop_remove(loop, client->parent->parent->connection);
+		client->loop = NULL;
+	}
+
 	property_list_service_client_t parent = client->parent;
 	client->parent = NULL;
-	if (client->receive_status_thread) {
-		debug_info("joining receive_status_thread");
-		thread_join(client->receive_status_thread);
-		thread_free(client->receive_status_thread);
-		client->receive_status_thread = THREAD_T_NULL;
-	}
 	preboard_error_t err = preboard_error(property_list_service_client_free(parent));
 	free(client);
 
@@ -146,42 +162,30 @@ LIBIMOBILEDEVICE_API preboard_error_t preboard_receive(preboard_client_t client,
 	return preboard_receive_with_timeout(client, plist, 5000);
 }
 
-struct preboard_status_data {
-	preboard_client_t client;
-	preboard_status_cb_t cbfunc;
-	void *user_data;
-};
-
-static void* preboard_receive_status_loop_thread(void* arg)
+static int preboard_status_loop_cb(idevice_connection_t connection, void* user_data)
 {
-	struct preboard_status_data *data = (struct preboard_status_data*)arg;
+	preboard_client_t client = (preboard_client_t)user_data;
+	plist_t pl = NULL;
 
-	/* run until the service disconnects or an error occurs */
-	while (data->client && data->client->parent) {
-		plist_t pl = NULL;
-		preboard_error_t perr = preboard_receive_with_timeout(data->client, &pl, 1000);
-		if (perr == PREBOARD_E_TIMEOUT) {
-			continue;
-		} else if (perr == PREBOARD_E_SUCCESS) {
-			data->cbfunc(pl, data->user_data);
-		}
+	preboard_error_t perr = preboard_receive_with_timeout(client, &pl, PREBOARD_STATUS_RECEIVE_TIMEOUT);
+	if (perr == PREBOARD_E_TIMEOUT) {
+		return 0;
+	}
+	if (perr == PREBOARD_E_SUCCESS) {
+		client->status_cb(pl, client->user_data);
 		plist_free(pl);
-		if (perr != PREBOARD_E_SUCCESS) {
-			data->cbfunc(NULL, data->user_data);
-			break;
-		}
+		return 0;
 	}
 
-	/* cleanup */
+	/* the service disconnected or an error occurred */
 	debug_info("done, cleaning up.");
+	client->status_cb(NULL, client->user_data);
+	mutex_lock(&preboard_mutex);
+	client->loop = NULL;
+	mutex_unlock(&preboard_mutex);
 
-	if (data->client->receive_status_thread) {
-		thread_free(data->client->receive_status_thread);
-		data->client->receive_status_thread = THREAD_T_NULL;
-	}
-	free(data);
-
-	return NULL;
+	/* the client is removed from the loop */
+	return 1;
 }
 
 static preboard_error_t preboard_receive_status_loop_with_callback(preboard_client_t client, preboard_status_cb_t status_cb, void *user_data)
@@ -190,22 +194,33 @@ static preboard_error_t preboard_receive_status_loop_with_callback(preboard_clie
 		return PREBOARD_E_INVALID_ARG;
 	}
 
-	if (client->receive_status_thread) {
+	thread_once(&preboard_once, preboard_init);
+	mutex_lock(&preboard_mutex);
+	if (client->loop) {
+		mutex_unlock(&preboard_mutex);
 		return PREBOARD_E_OP_IN_PROGRESS;
 	}
+	if (!shared_loop && idevice_event_loop_new(&shared_loop, PREBOARD_EVENT_LOOP_THREADS) != IDEVICE_E_SUCCESS) {
+		shared_loop = NULL;
+	}
+	idevice_event_loop_t loop = shared_loop;
+	client->loop = loop;
+	client->status_cb = status_cb;
+	client->user_data = user_data;
+	mutex_unlock(&preboard_mutex);
+	if (!loop) {
+		debug_info("could not create event loop");
+		return PREBOARD_E_UNKNOWN_ERROR;
+	}
 
-	preboard_error_t res = PREBOARD_E_UNKNOWN_ERROR;
-	struct preboard_status_data *data = (struct preboard_status_data*)malloc(sizeof(struct preboard_status_data));
-	if (data) {
-		data->client = client;
-		data->cbfunc = status_cb;
-		data->user_data = user_data;
-		if (thread_new(&client->receive_status_thread, preboard_receive_status_loop_thread, data) == 0) {
-			res = PREBOARD_E_SUCCESS;
-		}
+	if (idevice_event_loop_add(loop, client->parent->parent->connection, preboard_status_loop_cb, client) != IDEVICE_E_SUCCESS) {
+		mutex_lock(&preboard_mutex);
+		client->loop = NULL;
+		mutex_unlock(&preboard_mutex);
+		return PREBOARD_E_UNKNOWN_ERROR;
 	}
 
-	return res;
+	return PREBOARD_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API preboard_error_t preboard_create_stashbag(preboard_client_t client, plist_t manifest, preboard_status_cb_t status_cb, void *user_data)
@@ -253,3 +268,128 @@ LIBIMOBILEDEVICE_API preboard_error_t preboard_commit_stashbag(preboard_client_t
 
 	return preboard_receive_status_loop_with_callback(client, status_cb, user_data);
 }
+
+struct preboard_batch_job {
+	const char *udid;
+	plist_t manifest;
+	preboard_batch_cb_t callback;
+	void *user_data;
+};
+
+/**
+ * Follows the status messages of a CreateStashbag command until the device
+ * hides the passcode dialog.
+ */
+static preboard_error_t preboard_batch_wait_stashbag(preboard_client_t client, plist_t *message)
+{
+	preboard_error_t res = PREBOARD_E_SUCCESS;
+
+	while (1) {
+		plist_t pl = NULL;
+		preboard_error_t perr = preboard_receive_with_timeout(client, &pl, PREBOARD_BATCH_RECEIVE_TIMEOUT);
+		if (perr != PREBOARD_E_SUCCESS) {
+			plist_free(pl);
+			return perr;
+		}
+		if (!PLIST_IS_DICT(pl)) {
+			plist_free(pl);
+			return PREBOARD_E_PLIST_ERROR;
+		}
+		if (plist_dict_get_item(pl, "Error")) {
+			res = PREBOARD_E_OP_FAILED;
+			plist_free(*message);
+			*message = plist_copy(pl);
+		} else if (plist_dict_get_item(pl, "Timeout")) {
+			res = PREBOARD_E_TIMEOUT;
+			plist_free(*message);
+			*message = plist_copy(pl);
+		}
+		/* the device always ends with HideDialog, after an error or timeout too */
+		int done = (plist_dict_get_item(pl, "HideDialog") != NULL);
+		plist_free(pl);
+		if (done) {
+			break;
+		}
+	}
+
+	return res;
+}
+
+static void* preboard_batch_job_run(void *arg)
+{
+	struct preboard_batch_job *job = (struct preboard_batch_job*)arg;
+	idevice_t device = NULL;
+	preboard_client_t client = NULL;
+	plist_t message = NULL;
+	preboard_error_t res = PREBOARD_E_MUX_ERROR;
+
+	if (idevice_new_with_options(&device, job->udid, IDEVICE_LOOKUP_USBMUX | IDEVICE_LOOKUP_NETWORK) == IDEVICE_E_SUCCESS) {
+		res = preboard_client_start_service(device, &client, "libimobiledevice");
+		if (res == PREBOARD_E_SUCCESS) {
+			res = preboard_create_stashbag(client, job->manifest, NULL, NULL);
+			if (res == PREBOARD_E_SUCCESS) {
+				res = preboard_batch_wait_stashbag(client, &message);
+			}
+			preboard_client_free(client);
+		}
+		idevice_free(device);
+	} else {
+		debug_info("could not connect to device %s", job->udid);
+	}
+
+	job->callback(job->udid, res, message, job->user_data);
+	plist_free(message);
+	free(job);
+
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API preboard_error_t preboard_create_stashbag_batch(const char **udids, uint32_t count, plist_t manifest, uint32_t max_concurrent, preboard_batch_cb_t callback, void *user_data)
+{
+	threadpool_t pool = NULL;
+	uint32_t i;
+
+	if ((count > 0 && !udids) || !callback) {
+		return PREBOARD_E_INVALID_ARG;
+	}
+	for (i = 0; i < count; i++) {
+		if (!udids[i]) {
+			return PREBOARD_E_INVALID_ARG;
+		}
+	}
+	if (count == 0) {
+		return PREBOARD_E_SUCCESS;
+	}
+
+	/* the pool size bounds the number of devices handled at the same time */
+	if (max_concurrent == 0) {
+		max_concurrent = PREBOARD_BATCH_DEFAULT_CONCURRENCY;
+	}
+	if (threadpool_new(&pool, (max_concurrent < count) ? max_concurrent : count, THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+		debug_info("could not create thread pool");
+		return PREBOARD_E_UNKNOWN_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		struct preboard_batch_job *job = (struct preboard_batch_job*)malloc(sizeof(struct preboard_batch_job));
+		thread_future_t future = NULL;
+		if (job) {
+			job->udid = udids[i];
+			job->manifest = manifest;
+			job->callback = callback;
+			job->user_data = user_data;
+			future = threadpool_submit(pool, preboard_batch_job_run, job);
+		}
+		if (!future) {
+			free(job);
+			callback(udids[i], PREBOARD_E_UNKNOWN_ERROR, NULL, user_data);
+			continue;
+		}
+		thread_future_free(future);
+	}
+
+	/* waits for all devices to complete */
+	threadpool_free(pool);
+
+	return PREBOARD_E_SUCCESS;
+}
@@ -26,9 +26,21 @@
 #include "property_list_service.h"
 #include "common/thread.h"
 
+/* status messages of all clients are received on one shared loop thread */
+#define PREBOARD_EVENT_LOOP_THREADS 1
+#define PREBOARD_STATUS_RECEIVE_TIMEOUT 5000
+
+/* devices handled at once by preboard_create_stashbag_batch() by default */
+#define PREBOARD_BATCH_DEFAULT_CONCURRENCY 8
+/* longer than the 2 minutes the device waits for the passcode */
+#define PREBOARD_BATCH_RECEIVE_TIMEOUT 150000
+
 struct preboard_client_private {
 	property_list_service_client_t parent;
-	THREAD_T receive_status_thread;
+	/* set while the status loop is registered with it */
+	idevice_event_loop_t loop;
+	preboard_status_cb_t status_cb;
+	void *user_data;
 };
 
 #endif
@@ -25,6 +25,7 @@
 #include <string.h>
 
 #include "property_list_service.h"
+#include "idevice.h"
 #include "common/debug.h"
 #include "endianness.h"
 
@@ -72,6 +73,14 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 	/* create client object */
 	property_list_service_client_t client_loc = (property_list_service_client_t)malloc(sizeof(struct property_list_service_client_private));
 	client_loc->parent = parent;
+	client_loc->recv_buffer = NULL;
+	client_loc->recv_buffer_size = 0;
+	client_loc->recv_buffer_hold = 0;
+	client_loc->max_message_size = PROPERTY_LIST_SERVICE_DEFAULT_MAX_MESSAGE_SIZE;
+	client_loc->recv_reserved = 0;
+
+	/* messages are read as length and payload, serve both from one receive */
+	idevice_connection_set_read_ahead(parent->connection, IDEVICE_READ_AHEAD_DEFAULT_SIZE);
 
 	/* all done, return success */
 	*client = client_loc;
@@ -83,14 +92,45 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_client_
 	if (!client)
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 
+	if (client->recv_reserved > 0) {
+		idevice_receive_memory_release(client->parent->connection, client->recv_reserved);
+	}
 	property_list_service_error_t err = service_to_property_list_service_error(service_client_free(client->parent));
 
+	free(client->recv_buffer);
 	free(client);
 	client = NULL;
 
 	return err;
 }
 
+/**
+ * Makes sure the receive buffer of the client can hold at least length bytes.
+ * The buffer is kept across messages so that receiving a plist does not need
+ * a fresh allocation every time.
+ *
+ * @return 0 on success, -1 if the buffer could not be enlarged.
+ */
+static int internal_check_recv_buffer(property_list_service_client_t client, uint32_t length)
+{
+	if (length > client->recv_buffer_size) {
+		uint32_t newsize = (client->recv_buffer_size) ? client->recv_buffer_size : 4096;
+		while (newsize < length && newsize < 0x80000000) {
+			newsize <<= 1;
+		}
+		if (newsize < length) {
+			newsize = length;
+		}
+		char* newbuf = (char*)realloc(client->recv_buffer, newsize);
+		if (!newbuf) {
+			return -1;
+		}
+		client->recv_buffer = newbuf;
+		client->recv_buffer_size = newsize;
+	}
+	return 0;
+}
+
 /**
  * Sends a plist using the given property list service client.
  * Internally used generic plist send function.
@@ -111,8 +151,6 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 	char *content = NULL;
 	uint32_t length = 0;
-	uint32_t nlen = 0;
-	uint32_t bytes = 0;
 
 	if (!client || (client && !client->parent) || !plist) {
 		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
@@ -128,19 +166,52 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 		return PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
 	}
 
+	res = property_list_service_send_message(client, content, length);
+	if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		debug_plist(plist);
+	}
+
+	free(content);
+	return res;
+}
+
+/**
+ * Sends an already serialized plist with its length prefix.
+ *
+ * @param client The property list service client to use for sending.
+ * @param content The serialized plist.
+ * @param length Length of the serialized plist.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when one or more parameters are
+ *      invalid, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a communication error
+ *      occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when not all data
+ *      could be sent.
+ */
+property_list_service_error_t property_list_service_send_message(property_list_service_client_t client, const char *content, uint32_t length)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	uint32_t nlen = 0;
+	uint32_t bytes = 0;
+
+	if (!client || !client->parent || !content || length == 0) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
 	nlen = htobe32(length);
+	idevice_iovec_t iov[2];
+	iov[0].data = (const char*)&nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = content;
+	iov[1].length = length;
 	debug_info("sending %d bytes", length);
-	service_send(client->parent, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (bytes == sizeof(nlen)) {
-		service_send(client->parent, content, length, &bytes);
-		if (bytes > 0) {
-			debug_info("sent %d bytes", bytes);
-			debug_plist(plist);
-			if (bytes == length) {
-				res = PROPERTY_LIST_SERVICE_E_SUCCESS;
-			} else {
-				debug_info("ERROR: Could not send all data (%d of %d)!", bytes, length);
-			}
+	service_sendv(client->parent, iov, 2, &bytes);
+	if (bytes > 0) {
+		debug_info("sent %d bytes", bytes);
+		if (bytes == sizeof(nlen) + length) {
+			res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+		} else {
+			debug_info("ERROR: Could not send all data (%d of %d)!", bytes, (int)(sizeof(nlen) + length));
 		}
 	}
 	if (bytes <= 0) {
@@ -148,7 +219,85 @@ static property_list_service_error_t internal_plist_send(property_list_service_c
 		res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
 	}
 
-	free(content);
+	return res;
+}
+
+/* plists serialized and written together by property_list_service_send_plists() */
+#define PLIST_SEND_BATCH 32
+
+/**
+ * Sends several plists with as few writes as possible, each one is framed
+ * like a single plist so the receiving side does not see a difference.
+ *
+ * @param client The property list service client to use for sending.
+ * @param plists The plists to send.
+ * @param count Number of plists.
+ * @param binary 1 = send binary plists, 0 = send xml plists
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or an error as
+ *      returned by property_list_service_send_xml_plist().
+ */
+property_list_service_error_t property_list_service_send_plists(property_list_service_client_t client, plist_t *plists, uint32_t count, int binary)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	char *content[PLIST_SEND_BATCH];
+	uint32_t nlen[PLIST_SEND_BATCH];
+	idevice_iovec_t iov[PLIST_SEND_BATCH * 2];
+	uint32_t done = 0;
+
+	if (!client || !client->parent || (count > 0 && !plists)) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	}
+
+	while (done < count && res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		uint32_t num = count - done;
+		uint32_t total = 0;
+		uint32_t bytes = 0;
+		uint32_t i;
+
+		if (num > PLIST_SEND_BATCH) {
+			num = PLIST_SEND_BATCH;
+		}
+		memset(content, '\0', sizeof(content));
+		for (i = 0; i < num; i++) {
+			uint32_t length = 0;
+			if (binary) {
+				plist_to_bin(plists[done + i], &content[i], &length);
+			} else {
+				plist_to_xml(plists[done + i], &content[i], &length);
+			}
+			if (!content[i] || length == 0) {
+				res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
+				break;
+			}
+			nlen[i] = htobe32(length);
+			iov[i*2].data = (const char*)&nlen[i];
+			iov[i*2].length = sizeof(nlen[i]);
+			iov[i*2+1].data = content[i];
+			iov[i*2+1].length = length;
+			total += sizeof(nlen[i]) + length;
+		}
+		if (res == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			debug_info("sending %u plists with %u bytes", num, total);
+			service_sendv(client->parent, iov, num * 2, &bytes);
+			if (bytes == 0) {
+				debug_info("ERROR: sending to device failed.");
+				res = PROPERTY_LIST_SERVICE_E_MUX_ERROR;
+			} else if (bytes != total) {
+				debug_info("ERROR: Could not send all data (%u of %u)!", bytes, total);
+				res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+			} else {
+				for (i = 0; i < num; i++) {
+					debug_plist(plists[done + i]);
+				}
+			}
+		}
+		for (i = 0; i < num; i++) {
+			free(content[i]);
+		}
+		done += num;
+	}
+
 	return res;
 }
 
@@ -163,34 +312,33 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_bi
 }
 
 /**
- * Receives a plist using the given property list service client.
- * Internally used generic plist receive function.
+ * Receives the length prefix and the body of a single message.
+ * Internally used by the plist receive functions.
  *
  * @param client The property list service client to use for receiving
- * @param plist pointer to a plist_t that will point to the received plist
- *      upon successful return
+ * @param content Pointer that will be set to the received message. If
+ *      allocate is 0 the message is stored in the receive buffer of the
+ *      client and is only valid until the next receive operation, otherwise
+ *      it is newly allocated and must be freed by the caller.
+ * @param length Pointer that will be set to the length of the message.
  * @param timeout Maximum time in milliseconds to wait for data.
+ * @param allocate 1 to receive into a newly allocated buffer, 0 to use the
+ *      receive buffer of the client.
  *
  * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
- *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
- *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
- *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
- *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
- *      converted to a plist, PROPERTY_LIST_SERVICE_E_MUX_ERROR when a
- *      communication error occurs, or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR
- *      when an unspecified error occurs.
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE when the announced length
+ *      exceeds the maximum message size or the receive memory budget,
+ *      PROPERTY_LIST_SERVICE_E_MUX_ERROR when a communication error occurs,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error
+ *      occurs.
  */
-static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+static property_list_service_error_t internal_message_receive(property_list_service_client_t client, char **content, uint32_t *length, unsigned int timeout, int allocate)
 {
 	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
 	uint32_t pktlen = 0;
 	uint32_t bytes = 0;
 
-	if (!client || (client && !client->parent) || !plist) {
-		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
-	}
-
-	*plist = NULL;
 	service_error_t serr = service_receive_with_timeout(client->parent, (char*)&pktlen, sizeof(pktlen), &bytes, timeout);
 	if (serr != SERVICE_E_SUCCESS) {
 		debug_info("initial read failed!");
@@ -205,18 +353,44 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 	debug_info("initial read=%i", bytes);
 
 	uint32_t curlen = 0;
-	char *content = NULL;
+	char *buf = NULL;
 
 	pktlen = be32toh(pktlen);
 	debug_info("%d bytes following", pktlen);
-	content = (char*)malloc(pktlen);
-	if (!content) {
-		debug_info("out of memory when allocating %d bytes", pktlen);
-		return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	if (client->max_message_size > 0 && pktlen > client->max_message_size) {
+		debug_info("ERROR: message of %u bytes exceeds maximum message size of %u bytes", pktlen, client->max_message_size);
+		return PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE;
+	}
+
+	/* a message that is parsed from the receive buffer also needs room for the plist */
+	property_list_service_message_done(client);
+	uint64_t reserve = (allocate) ? pktlen : (uint64_t)pktlen * 2;
+	int rres = idevice_receive_memory_reserve(client->parent->connection, reserve, timeout);
+	if (rres == -1) {
+		return PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE;
+	} else if (rres < 0) {
+		debug_info("ERROR: no memory became available for a message of %u bytes", pktlen);
+		return PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT;
+	}
+
+	if (allocate) {
+		buf = (char*)malloc((pktlen > 0) ? pktlen : 1);
+		if (!buf) {
+			debug_info("out of memory when allocating %d bytes", pktlen);
+			idevice_receive_memory_release(client->parent->connection, reserve);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+	} else {
+		if (internal_check_recv_buffer(client, pktlen) < 0) {
+			debug_info("out of memory when allocating %d bytes", pktlen);
+			idevice_receive_memory_release(client->parent->connection, reserve);
+			return PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+		}
+		buf = client->recv_buffer;
 	}
 
 	while (curlen < pktlen) {
-		serr = service_receive(client->parent, content+curlen, pktlen-curlen, &bytes);
+		serr = service_receive(client->parent, buf+curlen, pktlen-curlen, &bytes);
 		if (serr != SERVICE_E_SUCCESS) {
 			res = service_to_property_list_service_error(serr);
 			break;
@@ -229,26 +403,95 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 		debug_info("received incomplete packet (%d of %d bytes)", curlen, pktlen);
 		if (curlen > 0) {
 			debug_info("incomplete packet following:");
-			debug_buffer(content, curlen);
+			debug_buffer(buf, curlen);
 		}
-		free(content);
+		if (allocate)
+			free(buf);
+		idevice_receive_memory_release(client->parent->connection, reserve);
 		return res;
 	}
 
-	if ((pktlen > 8) && !memcmp(content, "bplist00", 8)) {
-		plist_from_bin(content, pktlen, plist);
-	} else if ((pktlen > 5) && !memcmp(content, "<?xml", 5)) {
+	if (allocate) {
+		/* the buffer belongs to the caller now */
+		idevice_receive_memory_release(client->parent->connection, reserve);
+	} else {
+		client->recv_reserved = reserve;
+	}
+
+	*content = buf;
+	*length = pktlen;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+/**
+ * Converts a received message to a plist.
+ *
+ * @param content The received message. XML messages are modified in place.
+ * @param length Length of the message.
+ * @param plist Pointer that will be set to the plist, or NULL if the message
+ *      could not be converted.
+ */
+void property_list_service_message_to_plist(char *content, uint32_t length, plist_t *plist)
+{
+	uint32_t i = 0;
+
+	*plist = NULL;
+	if ((length > 8) && !memcmp(content, "bplist00", 8)) {
+		plist_from_bin(content, length, plist);
+	} else if ((length > 5) && !memcmp(content, "<?xml", 5)) {
 		/* iOS 4.3+ hack: plist data might contain invalid characters, thus we convert those to spaces */
-		for (bytes = 0; bytes < pktlen-1; bytes++) {
-			if ((content[bytes] >= 0) && (content[bytes] < 0x20) && (content[bytes] != 0x09) && (content[bytes] != 0x0a) && (content[bytes] != 0x0d))
-				content[bytes] = 0x20;
+		for (i = 0; i < length-1; i++) {
+			if ((content[i] >= 0) && (content[i] < 0x20) && (content[i] != 0x09) && (content[i] != 0x0a) && (content[i] != 0x0d))
+				content[i] = 0x20;
 		}
-		plist_from_xml(content, pktlen, plist);
+		plist_from_xml(content, length, plist);
 	} else {
 		debug_info("WARNING: received unexpected non-plist content");
-		debug_buffer(content, pktlen);
+		debug_buffer(content, length);
+	}
+}
+
+/**
+ * Receives a plist using the given property list service client.
+ * Internally used generic plist receive function.
+ *
+ * @param client The property list service client to use for receiving
+ * @param plist pointer to a plist_t that will point to the received plist
+ *      upon successful return
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client or *plist is NULL,
+ *      PROPERTY_LIST_SERVICE_E_NOT_ENOUGH_DATA when not enough data
+ *      received, PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the connection times out,
+ *      PROPERTY_LIST_SERVICE_E_PLIST_ERROR when the received data cannot be
+ *      converted to a plist, PROPERTY_LIST_SERVICE_E_MESSAGE_TOO_LARGE when
+ *      the message exceeds the maximum message size,
+ *      PROPERTY_LIST_SERVICE_E_MUX_ERROR when a communication error occurs,
+ *      or PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR when an unspecified error
+ *      occurs.
+ */
+static property_list_service_error_t internal_plist_receive_timeout(property_list_service_client_t client, plist_t *plist, unsigned int timeout)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR;
+	char *content = NULL;
+	uint32_t pktlen = 0;
+
+	if (!client || (client && !client->parent) || !plist) {
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
 	}
 
+	*plist = NULL;
+	res = internal_message_receive(client, &content, &pktlen, timeout, 0);
+	if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		return res;
+	}
+
+	property_list_service_message_to_plist(content, pktlen, plist);
+
+	property_list_service_message_done(client);
+
 	if (*plist) {
 		debug_plist(*plist);
 		res = PROPERTY_LIST_SERVICE_E_SUCCESS;
@@ -256,9 +499,6 @@ static property_list_service_error_t internal_plist_receive_timeout(property_lis
 		res = PROPERTY_LIST_SERVICE_E_PLIST_ERROR;
 	}
 
-	free(content);
-	content = NULL;
-
 	return res;
 }
 
@@ -272,6 +512,151 @@ LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive
 	return internal_plist_receive_timeout(client, plist, 30000);
 }
 
+/**
+ * Receives a message without converting it to a plist.
+ *
+ * @param client The property list service client to use for receiving
+ * @param content Pointer that will be set to the message in the receive
+ *      buffer of the client. It may be modified by the caller and is valid
+ *      until property_list_service_message_done() is called.
+ * @param length Pointer that will be set to the length of the message.
+ * @param timeout Maximum time in milliseconds to wait for data.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS on success or an error value
+ *      like the plist receive functions return it.
+ */
+property_list_service_error_t property_list_service_receive_message(property_list_service_client_t client, char **content, uint32_t *length, unsigned int timeout)
+{
+	if (!client || !client->parent || !content || !length)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	*content = NULL;
+	*length = 0;
+
+	return internal_message_receive(client, content, length, timeout, 0);
+}
+
+/**
+ * Ends the use of a message received with property_list_service_receive_message().
+ *
+ * @param client The property list service client the message was received with
+ */
+void property_list_service_message_done(property_list_service_client_t client)
+{
+	if (client->recv_reserved > 0) {
+		idevice_receive_memory_release(client->parent->connection, client->recv_reserved);
+		client->recv_reserved = 0;
+	}
+	/* don't keep the memory of an exceptionally large message around */
+	if (!client->recv_buffer_hold && client->recv_buffer_size > PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE) {
+		free(client->recv_buffer);
+		client->recv_buffer = NULL;
+		client->recv_buffer_size = 0;
+	}
+}
+
+/**
+ * Keeps the receive buffer of the client even if it grew beyond
+ * PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE, for a series of large messages.
+ * Releasing the hold trims the buffer again.
+ *
+ * @param client The property list service client
+ * @param hold 1 to keep the buffer, 0 to release it
+ */
+void property_list_service_hold_recv_buffer(property_list_service_client_t client, int hold)
+{
+	client->recv_buffer_hold = hold;
+	if (!hold) {
+		property_list_service_message_done(client);
+	}
+}
+
+/**
+ * Waits until a message can be received on the given client.
+ *
+ * @param client The property list service client to wait on.
+ * @param timeout Maximum time in milliseconds to wait.
+ *
+ * @return PROPERTY_LIST_SERVICE_E_SUCCESS when data is available,
+ *      PROPERTY_LIST_SERVICE_E_RECEIVE_TIMEOUT when the timeout expired,
+ *      PROPERTY_LIST_SERVICE_E_INVALID_ARG when client is invalid, or
+ *      PROPERTY_LIST_SERVICE_E_UNKNOWN_ERROR on error.
+ */
+property_list_service_error_t property_list_service_wait_readable(property_list_service_client_t client, unsigned int timeout)
+{
+	if (!client || !client->parent)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+	return service_to_property_list_service_error(service_wait_readable(client->parent, timeout));
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_receive_raw_plist(property_list_service_client_t client, char **data, uint32_t *length, unsigned int timeout)
+{
+	if (!client || !client->parent || !data || !length)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	*data = NULL;
+	*length = 0;
+
+	return internal_message_receive(client, data, length, timeout, 1);
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_set_max_message_size(property_list_service_client_t client, uint32_t max_size)
+{
+	if (!client)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	client->max_message_size = max_size;
+
+	return PROPERTY_LIST_SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_send_receive_pipelined(property_list_service_client_t client, plist_t *requests, uint32_t count, int binary, uint32_t window, property_list_service_reply_cb_t callback, void *user_data)
+{
+	property_list_service_error_t res = PROPERTY_LIST_SERVICE_E_SUCCESS;
+	uint32_t sent = 0;
+	uint32_t received = 0;
+
+	if (!client || !client->parent || (count > 0 && !requests) || !callback)
+		return PROPERTY_LIST_SERVICE_E_INVALID_ARG;
+
+	if (window == 0 || window > count)
+		window = count;
+
+	while (received < count) {
+		/* fill the window */
+		while (res == PROPERTY_LIST_SERVICE_E_SUCCESS && sent < count && sent - received < window) {
+			res = internal_plist_send(client, requests[sent], binary);
+			if (res != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+				debug_info("ERROR: could not send request %u: %d", sent, res);
+				break;
+			}
+			sent++;
+		}
+		if (res != PROPERTY_LIST_SERVICE_E_SUCCESS && sent == received)
+			break;
+
+		/* drain the oldest outstanding reply */
+		plist_t reply = NULL;
+		property_list_service_error_t rerr = internal_plist_receive_timeout(client, &reply, 30000);
+		if (rerr != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			debug_info("ERROR: could not receive reply for request %u: %d", received, rerr);
+			res = rerr;
+			break;
+		}
+		callback(received, reply, PROPERTY_LIST_SERVICE_E_SUCCESS, user_data);
+		plist_free(reply);
+		received++;
+	}
+
+	/* the stream is out of sync now, fail all remaining requests */
+	while (received < count) {
+		callback(received, NULL, res, user_data);
+		received++;
+	}
+
+	return res;
+}
+
 LIBIMOBILEDEVICE_API property_list_service_error_t property_list_service_enable_ssl(property_list_service_client_t client)
 {
 	if (!client || !client->parent)
@@ -25,8 +25,29 @@
 #include "libimobiledevice/property_list_service.h"
 #include "service.h"
 
+/* default limit for the size of a single received message */
+#define PROPERTY_LIST_SERVICE_DEFAULT_MAX_MESSAGE_SIZE (64*1024*1024)
+
+/* the receive buffer is released after a message larger than this */
+#define PROPERTY_LIST_SERVICE_RECV_BUFFER_KEEP_SIZE (1024*1024)
+
 struct property_list_service_client_private {
 	service_client_t parent;
+	char *recv_buffer;
+	uint32_t recv_buffer_size;
+	/* keeps a large receive buffer around until released again */
+	int recv_buffer_hold;
+	uint32_t max_message_size;
+	/* reserved from the receive memory budget until the message is done */
+	uint64_t recv_reserved;
 };
 
+property_list_service_error_t property_list_service_wait_readable(property_list_service_client_t client, unsigned int timeout);
+property_list_service_error_t property_list_service_send_message(property_list_service_client_t client, const char *content, uint32_t length);
+property_list_service_error_t property_list_service_send_plists(property_list_service_client_t client, plist_t *plists, uint32_t count, int binary);
+property_list_service_error_t property_list_service_receive_message(property_list_service_client_t client, char **content, uint32_t *length, unsigned int timeout);
+void property_list_service_message_done(property_list_service_client_t client);
+void property_list_service_hold_recv_buffer(property_list_service_client_t client, int hold);
+void property_list_service_message_to_plist(char *content, uint32_t length, plist_t *plist);
+
 #endif
@@ -0,0 +1,576 @@
+/*
+ * replay.c
+ * Recording and replaying of device connections
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef WIN32
+#include <windows.h>
+#endif
+
+#include <plist/plist.h>
+
+#include "replay.h"
+#include "common/debug.h"
+#include "common/thread.h"
+#include "common/userpref.h"
+#include "common/utils.h"
+#include "endianness.h"
+
+#define REPLAY_MODE_OFF 0
+#define REPLAY_MODE_RECORD 1
+#define REPLAY_MODE_REPLAY 2
+
+/* placeholders handed to lockdownd instead of the real pair record, the
+   session is never actually established while replaying */
+#define REPLAY_HOST_ID "00000000-0000-0000-0000-000000000000"
+#define REPLAY_SYSTEM_BUID "00000000-0000-0000-0000-000000000000"
+
+/* data the device sent for one receive call, or its result if it failed */
+struct replay_chunk {
+	idevice_error_t result;
+	uint64_t delay_usec;
+	char *data;
+	uint32_t length;
+};
+
+struct replay_connection {
+	uint32_t id;
+	uint16_t port;
+	int claimed;
+	struct replay_chunk *chunks;
+	uint32_t num_chunks;
+	uint32_t max_chunks;
+	/* time of the last recorded event while loading */
+	uint64_t last_timestamp;
+	/* replay position and the time of the last send or receive */
+	uint32_t current;
+	uint32_t offset;
+	int started;
+	uint64_t last_event;
+	struct replay_connection *next;
+};
+
+static int replay_mode = REPLAY_MODE_OFF;
+static mutex_t replay_mutex;
+
+static FILE *record_file = NULL;
+static uint64_t record_start = 0;
+static uint32_t record_next_id = 0;
+
+static double replay_speed = 1.0;
+static usbmuxd_device_info_t *replay_devices = NULL;
+static int replay_num_devices = 0;
+static struct replay_connection *replay_connections = NULL;
+static struct replay_connection *replay_connections_tail = NULL;
+
+static void replay_sleep_usec(uint64_t usec)
+{
+#ifdef WIN32
+	Sleep((DWORD)(usec / 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+static void replay_write_event(uint32_t type, uint32_t connection_id, int32_t value, const void *data, uint32_t length)
+{
+	struct replay_event_header hdr;
+
+	mutex_lock(&replay_mutex);
+	if (!record_file) {
+		mutex_unlock(&replay_mutex);
+		return;
+	}
+	hdr.type = htole32(type);
+	hdr.connection_id = htole32(connection_id);
+	hdr.timestamp_usec = htole64(time_monotonic_usec() - record_start);
+	hdr.value = (int32_t)htole32((uint32_t)value);
+	hdr.length = htole32(length);
+	if (fwrite(&hdr, sizeof(hdr), 1, record_file) != 1 || (length > 0 && fwrite(data, 1, length, record_file) != length)) {
+		fprintf(stderr, "[replay] Failed to write capture, recording stopped\n");
+		fclose(record_file);
+		record_file = NULL;
+	}
+	mutex_unlock(&replay_mutex);
+}
+
+static int replay_record_open(const char *path)
+{
+	uint32_t version = htole32(REPLAY_FILE_VERSION);
+
+	record_file = fopen(path, "wb");
+	if (!record_file) {
+		return -1;
+	}
+	if (fwrite(REPLAY_FILE_MAGIC, 1, REPLAY_FILE_MAGIC_LEN, record_file) != REPLAY_FILE_MAGIC_LEN || fwrite(&version, sizeof(version), 1, record_file) != 1) {
+		fclose(record_file);
+		record_file = NULL;
+		return -1;
+	}
+	record_start = time_monotonic_usec();
+	return 0;
+}
+
+static struct replay_connection *replay_find_connection(uint32_t id)
+{
+	struct replay_connection *rc;
+	for (rc = replay_connections; rc; rc = rc->next) {
+		if (rc->id == id) {
+			return rc;
+		}
+	}
+	return NULL;
+}
+
+static int replay_add_chunk(struct replay_connection *rc, idevice_error_t result, uint64_t timestamp, char *data, uint32_t length)
+{
+	if (rc->num_chunks == rc->max_chunks) {
+		uint32_t max = (rc->max_chunks) ? rc->max_chunks * 2 : 64;
+		struct replay_chunk *chunks = (struct replay_chunk*)realloc(rc->chunks, max * sizeof(struct replay_chunk));
+		if (!chunks) {
+			return -1;
+		}
+		rc->chunks = chunks;
+		rc->max_chunks = max;
+	}
+	struct replay_chunk *chunk = &rc->chunks[rc->num_chunks++];
+	chunk->result = result;
+	chunk->delay_usec = (timestamp > rc->last_timestamp) ? timestamp - rc->last_timestamp : 0;
+	chunk->data = data;
+	chunk->length = length;
+	rc->last_timestamp = timestamp;
+	return 0;
+}
+
+static void replay_add_device(uint32_t handle, const char *udid, uint32_t length)
+{
+	int i;
+	if (length == 0 || length >= sizeof(replay_devices[0].udid)) {
+		return;
+	}
+	for (i = 0; i < replay_num_devices; i++) {
+		if (strlen(replay_devices[i].udid) == length && !memcmp(replay_devices[i].udid, udid, length)) {
+			return;
+		}
+	}
+	usbmuxd_device_info_t *devices = (usbmuxd_device_info_t*)realloc(replay_devices, (replay_num_devices + 1) * sizeof(usbmuxd_device_info_t));
+	if (!devices) {
+		return;
+	}
+	replay_devices = devices;
+	/* replayed devices are always presented as USB devices */
+	memset(&replay_devices[replay_num_devices], 0, sizeof(usbmuxd_device_info_t));
+	replay_devices[replay_num_devices].handle = handle;
+	replay_devices[replay_num_devices].conn_type = CONNECTION_TYPE_USB;
+	memcpy(replay_devices[replay_num_devices].udid, udid, length);
+	replay_num_devices++;
+}
+
+static void replay_free_connections(void)
+{
+	while (replay_connections) {
+		struct replay_connection *rc = replay_connections;
+		uint32_t i;
+		replay_connections = rc->next;
+		for (i = 0; i < rc->num_chunks; i++) {
+			free(rc->chunks[i].data);
+		}
+		free(rc->chunks);
+		free(rc);
+	}
+	replay_connections_tail = NULL;
+	free(replay_devices);
+	replay_devices = NULL;
+	replay_num_devices = 0;
+}
+
+static int replay_load(const char *path)
+{
+	char magic[REPLAY_FILE_MAGIC_LEN];
+	uint32_t version = 0;
+	struct replay_event_header hdr;
+	int res = 0;
+
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		return -1;
+	}
+	if (fread(magic, 1, sizeof(magic), f) != sizeof(magic) || memcmp(magic, REPLAY_FILE_MAGIC, REPLAY_FILE_MAGIC_LEN) != 0
+	    || fread(&version, sizeof(version), 1, f) != 1 || le32toh(version) != REPLAY_FILE_VERSION) {
+		fclose(f);
+		return -1;
+	}
+
+	while (fread(&hdr, sizeof(hdr), 1, f) == 1) {
+		uint32_t type = le32toh(hdr.type);
+		uint32_t id = le32toh(hdr.connection_id);
+		uint64_t timestamp = le64toh(hdr.timestamp_usec);
+		int32_t value = (int32_t)le32toh((uint32_t)hdr.value);
+		uint32_t length = le32toh(hdr.length);
+		char *data = NULL;
+
+		if (length > 0) {
+			data = (char*)malloc(length);
+			if (!data || fread(data, 1, length, f) != length) {
+				/* a truncated capture, e.g. of a crashed process, is used up to here */
+				free(data);
+				break;
+			}
+		}
+
+		struct replay_connection *rc = NULL;
+		switch (type) {
+		case REPLAY_EVENT_DEVICE:
+			replay_add_device(id, data, length);
+			break;
+		case REPLAY_EVENT_CONNECT:
+			rc = (struct replay_connection*)calloc(1, sizeof(struct replay_connection));
+			if (!rc) {
+				res = -1;
+				break;
+			}
+			rc->id = id;
+			rc->port = (uint16_t)value;
+			rc->last_timestamp = timestamp;
+			if (replay_connections_tail) {
+				replay_connections_tail->next = rc;
+			} else {
+				replay_connections = rc;
+			}
+			replay_connections_tail = rc;
+			break;
+		case REPLAY_EVENT_RECEIVE:
+			rc = replay_find_connection(id);
+			if (rc && replay_add_chunk(rc, (idevice_error_t)value, timestamp, data, length) == 0) {
+				data = NULL;
+			}
+			break;
+		case REPLAY_EVENT_SEND:
+		case REPLAY_EVENT_SSL:
+			rc = replay_find_connection(id);
+			if (rc) {
+				rc->last_timestamp = timestamp;
+			}
+			break;
+		default:
+			break;
+		}
+		free(data);
+		if (res < 0) {
+			break;
+		}
+	}
+	fclose(f);
+
+	if (res < 0) {
+		replay_free_connections();
+	}
+	return res;
+}
+
+void replay_init(void)
+{
+	const char *path;
+
+	mutex_init(&replay_mutex);
+
+	path = getenv(REPLAY_ENV_REPLAY);
+	if (path && *path) {
+		if (replay_load(path) < 0) {
+			fprintf(stderr, "[replay] Could not load capture %s\n", path);
+			return;
+		}
+		const char *speed = getenv(REPLAY_ENV_SPEED);
+		if (speed && *speed) {
+			replay_speed = strtod(speed, NULL);
+			if (replay_speed < 0) {
+				replay_speed = 1.0;
+			}
+		}
+		/* lockdownd wants a pair record even though nothing is verified */
+		plist_t pair_record = plist_new_dict();
+		plist_dict_set_item(pair_record, USERPREF_HOST_ID_KEY, plist_new_string(REPLAY_HOST_ID));
+		plist_dict_set_item(pair_record, USERPREF_SYSTEM_BUID_KEY, plist_new_string(REPLAY_SYSTEM_BUID));
+		plist_dict_set_item(pair_record, USERPREF_ESCROW_BAG_KEY, plist_new_data("", 0));
+		userpref_set_fixed_records(pair_record, REPLAY_SYSTEM_BUID);
+		plist_free(pair_record);
+		replay_mode = REPLAY_MODE_REPLAY;
+		return;
+	}
+
+	path = getenv(REPLAY_ENV_RECORD);
+	if (path && *path) {
+		if (replay_record_open(path) < 0) {
+			fprintf(stderr, "[replay] Could not create capture %s\n", path);
+			return;
+		}
+		replay_mode = REPLAY_MODE_RECORD;
+	}
+}
+
+void replay_deinit(void)
+{
+	if (replay_mode == REPLAY_MODE_REPLAY) {
+		userpref_set_fixed_records(NULL, NULL);
+		replay_free_connections();
+	}
+	mutex_lock(&replay_mutex);
+	if (record_file) {
+		fclose(record_file);
+		record_file = NULL;
+	}
+	mutex_unlock(&replay_mutex);
+	replay_mode = REPLAY_MODE_OFF;
+	mutex_destroy(&replay_mutex);
+}
+
+int replay_is_recording(void)
+{
+	return replay_mode == REPLAY_MODE_RECORD;
+}
+
+int replay_is_replaying(void)
+{
+	return replay_mode == REPLAY_MODE_REPLAY;
+}
+
+void replay_record_device(const usbmuxd_device_info_t *info)
+{
+	replay_write_event(REPLAY_EVENT_DEVICE, info->handle, info->conn_type, info->udid, strlen(info->udid));
+}
+
+void replay_record_connect(idevice_connection_t connection)
+{
+	const char *udid = (connection->device && connection->device->udid) ? connection->device->udid : "";
+
+	mutex_lock(&replay_mutex);
+	connection->record_id = ++record_next_id;
+	mutex_unlock(&replay_mutex);
+	replay_write_event(REPLAY_EVENT_CONNECT, connection->record_id, connection->port, udid, strlen(udid));
+}
+
+void replay_record_send(idevice_connection_t connection, uint32_t length)
+{
+	if (connection->record_id == 0 || length == 0) {
+		return;
+	}
+	/* only the amount is kept, replaying does not depend on what was sent */
+	replay_write_event(REPLAY_EVENT_SEND, connection->record_id, (int32_t)length, NULL, 0);
+}
+
+void replay_record_receive(idevice_connection_t connection, idevice_error_t result, const char *data, uint32_t length)
+{
+	if (connection->record_id == 0) {
+		return;
+	}
+	if (length > 0) {
+		replay_write_event(REPLAY_EVENT_RECEIVE, connection->record_id, IDEVICE_E_SUCCESS, data, length);
+	}
+	if (result != IDEVICE_E_SUCCESS) {
+		replay_write_event(REPLAY_EVENT_RECEIVE, connection->record_id, result, NULL, 0);
+	}
+}
+
+void replay_record_ssl(idevice_connection_t connection, int enabled)
+{
+	if (connection->record_id == 0) {
+		return;
+	}
+	replay_write_event(REPLAY_EVENT_SSL, connection->record_id, enabled, NULL, 0);
+}
+
+void replay_record_disconnect(idevice_connection_t connection)
+{
+	if (connection->record_id == 0) {
+		return;
+	}
+	replay_write_event(REPLAY_EVENT_DISCONNECT, connection->record_id, 0, NULL, 0);
+	mutex_lock(&replay_mutex);
+	if (record_file) {
+		fflush(record_file);
+	}
+	mutex_unlock(&replay_mutex);
+}
+
+int replay_lookup_device(const char *udid, usbmuxd_device_info_t *info)
+{
+	int i;
+	for (i = 0; i < replay_num_devices; i++) {
+		if (!udid || !strcmp(replay_devices[i].udid, udid)) {
+			memcpy(info, &replay_devices[i], sizeof(usbmuxd_device_info_t));
+			return 1;
+		}
+	}
+	return 0;
+}
+
+int replay_get_device_list(usbmuxd_device_info_t **dev_list)
+{
+	/* usbmuxd_device_list_free() frees the array with free() */
+	usbmuxd_device_info_t *list = (usbmuxd_device_info_t*)calloc(replay_num_devices + 1, sizeof(usbmuxd_device_info_t));
+	if (!list) {
+		return -1;
+	}
+	if (replay_num_devices > 0) {
+		memcpy(list, replay_devices, replay_num_devices * sizeof(usbmuxd_device_info_t));
+	}
+	*dev_list = list;
+	return replay_num_devices;
+}
+
+idevice_error_t replay_connect(idevice_connection_t connection, uint16_t port)
+{
+	struct replay_connection *rc;
+
+	/* connections to the same port are handed out in recorded order */
+	mutex_lock(&replay_mutex);
+	for (rc = replay_connections; rc; rc = rc->next) {
+		if (!rc->claimed && rc->port == port) {
+			rc->claimed = 1;
+			break;
+		}
+	}
+	mutex_unlock(&replay_mutex);
+	if (!rc) {
+		debug_info("no more recorded connections to port %u", port);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	rc->last_event = time_monotonic_usec();
+	connection->replay = rc;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t replay_send(idevice_connection_t connection, uint32_t length, uint32_t *sent_bytes)
+{
+	connection->replay->last_event = time_monotonic_usec();
+	*sent_bytes = length;
+	return IDEVICE_E_SUCCESS;
+}
+
+/**
+ * Waits until the current chunk is due, i.e. until as much time has passed
+ * since the last send or receive as did while recording, scaled by the
+ * replay speed.
+ *
+ * @return IDEVICE_E_SUCCESS when the chunk is due, or IDEVICE_E_TIMEOUT if
+ *     the timeout expired before.
+ */
+static idevice_error_t replay_wait_chunk(struct replay_connection *rc, unsigned int timeout)
+{
+	struct replay_chunk *chunk = &rc->chunks[rc->current];
+	uint64_t delay = (replay_speed > 0) ? (uint64_t)((double)chunk->delay_usec / replay_speed) : 0;
+	uint64_t now = time_monotonic_usec();
+
+	if (rc->started) {
+		return IDEVICE_E_SUCCESS;
+	}
+	if (rc->last_event + delay > now) {
+		uint64_t wait = rc->last_event + delay - now;
+		if (timeout > 0 && wait > (uint64_t)timeout * 1000) {
+			replay_sleep_usec((uint64_t)timeout * 1000);
+			/* a recorded timeout is due when the caller's timeout is, too */
+			if (chunk->result != IDEVICE_E_TIMEOUT) {
+				return IDEVICE_E_TIMEOUT;
+			}
+		} else {
+			replay_sleep_usec(wait);
+		}
+	}
+	rc->started = 1;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t replay_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout)
+{
+	struct replay_connection *rc = connection->replay;
+
+	*recv_bytes = 0;
+	if (rc->current >= rc->num_chunks) {
+		/* the capture ends here, as if the device closed the connection */
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	if (replay_wait_chunk(rc, timeout) == IDEVICE_E_TIMEOUT) {
+		return IDEVICE_E_TIMEOUT;
+	}
+	struct replay_chunk *chunk = &rc->chunks[rc->current];
+	rc->last_event = time_monotonic_usec();
+	if (chunk->length == 0) {
+		rc->current++;
+		rc->started = 0;
+		return chunk->result;
+	}
+	/* callers ask for what they asked for while recording, so a chunk
+	   is normally handed out at once */
+	uint32_t n = chunk->length - rc->offset;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(data, chunk->data + rc->offset, n);
+	rc->offset += n;
+	if (rc->offset == chunk->length) {
+		rc->current++;
+		rc->offset = 0;
+		rc->started = 0;
+	}
+	*recv_bytes = n;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t replay_wait_readable(idevice_connection_t connection, unsigned int timeout)
+{
+	struct replay_connection *rc = connection->replay;
+
+	if (rc->current >= rc->num_chunks) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	if (replay_wait_chunk(rc, timeout) == IDEVICE_E_TIMEOUT) {
+		return IDEVICE_E_TIMEOUT;
+	}
+	struct replay_chunk *chunk = &rc->chunks[rc->current];
+	if (chunk->length == 0 && chunk->result == IDEVICE_E_TIMEOUT) {
+		/* consume it here, otherwise the caller would wait for it forever */
+		rc->current++;
+		rc->started = 0;
+		rc->last_event = time_monotonic_usec();
+		return IDEVICE_E_TIMEOUT;
+	}
+	return IDEVICE_E_SUCCESS;
+}
+
+int replay_has_pending_data(idevice_connection_t connection)
+{
+	struct replay_connection *rc = connection->replay;
+	return (rc->current < rc->num_chunks && rc->started);
+}
+
+void replay_disconnect(idevice_connection_t connection)
+{
+	connection->replay = NULL;
+}
@@ -0,0 +1,79 @@
+/*
+ * replay.h
+ * Definitions for recording and replaying device connections
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __REPLAY_H
+#define __REPLAY_H
+
+#include <stdint.h>
+#include <usbmuxd.h>
+
+#include "idevice.h"
+
+/* environment variables that enable recording or replaying */
+#define REPLAY_ENV_RECORD "IMOBILEDEVICE_RECORD"
+#define REPLAY_ENV_REPLAY "IMOBILEDEVICE_REPLAY"
+#define REPLAY_ENV_SPEED "IMOBILEDEVICE_REPLAY_SPEED"
+
+#define REPLAY_FILE_MAGIC "IDEVCAP\0"
+#define REPLAY_FILE_MAGIC_LEN 8
+#define REPLAY_FILE_VERSION 1
+
+/* event types in a capture file */
+#define REPLAY_EVENT_DEVICE 1
+#define REPLAY_EVENT_CONNECT 2
+#define REPLAY_EVENT_SEND 3
+#define REPLAY_EVENT_RECEIVE 4
+#define REPLAY_EVENT_SSL 5
+#define REPLAY_EVENT_DISCONNECT 6
+
+/* every event starts with this header, all fields are little endian */
+struct replay_event_header {
+	uint32_t type;
+	uint32_t connection_id;
+	uint64_t timestamp_usec;
+	int32_t value;
+	uint32_t length;
+};
+
+struct replay_connection;
+
+void replay_init(void);
+void replay_deinit(void);
+int replay_is_recording(void);
+int replay_is_replaying(void);
+
+void replay_record_device(const usbmuxd_device_info_t *info);
+void replay_record_connect(idevice_connection_t connection);
+void replay_record_send(idevice_connection_t connection, uint32_t length);
+void replay_record_receive(idevice_connection_t connection, idevice_error_t result, const char *data, uint32_t length);
+void replay_record_ssl(idevice_connection_t connection, int enabled);
+void replay_record_disconnect(idevice_connection_t connection);
+
+int replay_lookup_device(const char *udid, usbmuxd_device_info_t *info);
+int replay_get_device_list(usbmuxd_device_info_t **dev_list);
+idevice_error_t replay_connect(idevice_connection_t connection, uint16_t port);
+idevice_error_t replay_send(idevice_connection_t connection, uint32_t length, uint32_t *sent_bytes);
+idevice_error_t replay_receive(idevice_connection_t connection, char *data, uint32_t len, uint32_t *recv_bytes, unsigned int timeout);
+idevice_error_t replay_wait_readable(idevice_connection_t connection, unsigned int timeout);
+int replay_has_pending_data(idevice_connection_t connection);
+void replay_disconnect(idevice_connection_t connection);
+
+#endif
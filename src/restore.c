@@ -31,10 +31,36 @@
 #include "restore.h"
 #include "idevice.h"
 #include "common/debug.h"
+#include "common/thread.h"
+#include "common/utils.h"
 
 #define RESULT_SUCCESS 0
 #define RESULT_FAILURE 1
 
+/* number of QueryValue requests kept outstanding by restored_query_values() */
+#define RESTORED_QUERY_VALUES_WINDOW 16
+
+/* how long a new device is probed while restored is not accepting connections yet */
+#define RESTORED_PROBE_TIMEOUT 5000
+#define RESTORED_PROBE_INTERVAL 200
+
+#define RESTORED_TYPE "com.apple.mobile.restored"
+
+struct restored_subscription_context {
+	idevice_subscription_context_t subscription;
+	restored_event_cb_t callback;
+	void *user_data;
+	mutex_t mutex;
+	cond_t cond;
+	unsigned int num_probes;
+	int stopping;
+};
+
+struct restored_probe {
+	struct restored_subscription_context *context;
+	char *udid;
+};
+
 /**
  * Internally used function for checking the result from restore's answer
  * plist to a previously sent request.
@@ -266,6 +292,75 @@ LIBIMOBILEDEVICE_API restored_error_t restored_query_value(restored_client_t cli
 	return ret;
 }
 
+struct restored_query_values_state {
+	const char **keys;
+	plist_t *values;
+};
+
+static void restored_query_values_cb(uint32_t index, plist_t reply, property_list_service_error_t status, void *user_data)
+{
+	struct restored_query_values_state *state = (struct restored_query_values_state*)user_data;
+
+	if (!reply) {
+		return;
+	}
+	plist_t value_node = plist_dict_get_item(reply, state->keys[index]);
+	if (value_node) {
+		state->values[index] = plist_copy(value_node);
+	} else {
+		debug_info("QueryValue for %s returned no value", state->keys[index]);
+	}
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_query_values(restored_client_t client, const char **keys, uint32_t count, plist_t *values)
+{
+	if (!client || !values || (count > 0 && !keys))
+		return RESTORE_E_INVALID_ARG;
+
+	restored_error_t ret = RESTORE_E_SUCCESS;
+	struct restored_query_values_state state;
+	plist_t *requests = NULL;
+	uint32_t i;
+
+	for (i = 0; i < count; i++) {
+		if (!keys[i])
+			return RESTORE_E_INVALID_ARG;
+		values[i] = NULL;
+	}
+	if (count == 0)
+		return RESTORE_E_SUCCESS;
+
+	requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	if (!requests)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	for (i = 0; i < count; i++) {
+		requests[i] = plist_new_dict();
+		plist_dict_add_label(requests[i], client->label);
+		plist_dict_set_item(requests[i], "QueryKey", plist_new_string(keys[i]));
+		plist_dict_set_item(requests[i], "Request", plist_new_string("QueryValue"));
+	}
+
+	state.keys = keys;
+	state.values = values;
+	ret = restored_error(property_list_service_send_receive_pipelined(client->parent, requests, count, 0, RESTORED_QUERY_VALUES_WINDOW, restored_query_values_cb, &state));
+
+	for (i = 0; i < count; i++) {
+		plist_free(requests[i]);
+	}
+	free(requests);
+
+	if (ret != RESTORE_E_SUCCESS) {
+		/* the connection is out of sync, don't return partial results */
+		for (i = 0; i < count; i++) {
+			plist_free(values[i]);
+			values[i] = NULL;
+		}
+	}
+
+	return ret;
+}
+
 LIBIMOBILEDEVICE_API restored_error_t restored_get_value(restored_client_t client, const char *key, plist_t *value)
 {
 	if (!client || !value || (value && *value))
@@ -424,3 +519,142 @@ LIBIMOBILEDEVICE_API restored_error_t restored_reboot(restored_client_t client)
 	dict = NULL;
 	return ret;
 }
+
+/**
+ * Checks whether the device runs restored. Retries while restored does not
+ * accept connections yet, right after the device appeared.
+ */
+static void* restored_probe_run(void *arg)
+{
+	struct restored_probe *probe = (struct restored_probe*)arg;
+	struct restored_subscription_context *context = probe->context;
+	uint64_t deadline = time_monotonic_usec() + RESTORED_PROBE_TIMEOUT * 1000ULL;
+	int found = 0;
+	uint64_t version = 0;
+
+	while (1) {
+		idevice_t device = NULL;
+		restored_client_t client = NULL;
+		int connected = 0;
+
+		if (idevice_new_with_options(&device, probe->udid, IDEVICE_LOOKUP_USBMUX) == IDEVICE_E_SUCCESS) {
+			if (restored_client_new(device, &client, "libimobiledevice") == RESTORE_E_SUCCESS) {
+				char *type = NULL;
+				if (restored_query_type(client, &type, &version) == RESTORE_E_SUCCESS) {
+					connected = 1;
+					found = (type && !strcmp(type, RESTORED_TYPE));
+				}
+				free(type);
+				restored_client_free(client);
+			}
+			idevice_free(device);
+		}
+		if (connected || time_monotonic_usec() >= deadline) {
+			break;
+		}
+
+		mutex_lock(&context->mutex);
+		if (!context->stopping) {
+			cond_wait_timeout(&context->cond, &context->mutex, RESTORED_PROBE_INTERVAL);
+		}
+		int stopping = context->stopping;
+		mutex_unlock(&context->mutex);
+		if (stopping) {
+			break;
+		}
+	}
+
+	if (found) {
+		debug_info("device %s is in restore mode (protocol version %llu)", probe->udid, (unsigned long long)version);
+		context->callback(probe->udid, version, context->user_data);
+	}
+
+	free(probe->udid);
+	free(probe);
+
+	mutex_lock(&context->mutex);
+	context->num_probes--;
+	cond_broadcast(&context->cond);
+	mutex_unlock(&context->mutex);
+
+	return NULL;
+}
+
+static void restored_device_event_cb(const idevice_event_t *event, void *user_data)
+{
+	struct restored_subscription_context *context = (struct restored_subscription_context*)user_data;
+
+	/* restore mode is only reachable via USB */
+	if (event->event != IDEVICE_DEVICE_ADD || event->conn_type != CONNECTION_USBMUXD) {
+		return;
+	}
+
+	struct restored_probe *probe = (struct restored_probe*)malloc(sizeof(struct restored_probe));
+	if (!probe) {
+		return;
+	}
+	probe->context = context;
+	probe->udid = strdup(event->udid);
+
+	/* probing takes a round trip, don't block the event thread with it */
+	mutex_lock(&context->mutex);
+	thread_future_t future = (context->stopping || !probe->udid) ? NULL : threadpool_submit(threadpool_shared(), restored_probe_run, probe);
+	if (future) {
+		context->num_probes++;
+		thread_future_free(future);
+	}
+	mutex_unlock(&context->mutex);
+	if (!future) {
+		free(probe->udid);
+		free(probe);
+	}
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_event_subscribe(restored_subscription_context_t *context, restored_event_cb_t callback, void *user_data)
+{
+	if (!context || !callback)
+		return RESTORE_E_INVALID_ARG;
+
+	struct restored_subscription_context *ctx = (struct restored_subscription_context*)calloc(1, sizeof(struct restored_subscription_context));
+	if (!ctx)
+		return RESTORE_E_UNKNOWN_ERROR;
+
+	ctx->callback = callback;
+	ctx->user_data = user_data;
+	mutex_init(&ctx->mutex);
+	cond_init(&ctx->cond);
+
+	if (idevice_events_subscribe(&ctx->subscription, restored_device_event_cb, ctx) != IDEVICE_E_SUCCESS) {
+		debug_info("could not subscribe to device events");
+		cond_destroy(&ctx->cond);
+		mutex_destroy(&ctx->mutex);
+		free(ctx);
+		return RESTORE_E_MUX_ERROR;
+	}
+
+	*context = ctx;
+	return RESTORE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API restored_error_t restored_event_unsubscribe(restored_subscription_context_t context)
+{
+	if (!context)
+		return RESTORE_E_INVALID_ARG;
+
+	/* no new probes once the device events stopped */
+	idevice_events_unsubscribe(context->subscription);
+
+	mutex_lock(&context->mutex);
+	context->stopping = 1;
+	cond_broadcast(&context->cond);
+	while (context->num_probes > 0) {
+		cond_wait(&context->cond, &context->mutex);
+	}
+	mutex_unlock(&context->mutex);
+
+	cond_destroy(&context->cond);
+	mutex_destroy(&context->mutex);
+	free(context);
+
+	return RESTORE_E_SUCCESS;
+}
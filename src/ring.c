@@ -0,0 +1,320 @@
+/*
+ * ring.c
+ * Submission/completion ring for batched operations on many connections
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+
+#include "ring.h"
+#include "idevice.h"
+#include "common/debug.h"
+#include "common/utils.h"
+
+/**
+ * Runs the operation of a slot, called without holding the mutex.
+ */
+static void ring_run(struct ring_slot *slot)
+{
+	const idevice_ring_sqe_t *sqe = &slot->sqe;
+	idevice_ring_cqe_t *cqe = &slot->cqe;
+
+	cqe->user_data = sqe->user_data;
+	cqe->op = sqe->op;
+	cqe->result = 0;
+	cqe->bytes = 0;
+	cqe->plist = NULL;
+
+	switch (sqe->op) {
+	case IDEVICE_RING_OP_NOP:
+		break;
+	case IDEVICE_RING_OP_AFC_READ:
+		cqe->result = afc_file_read((afc_client_t)sqe->client, sqe->args.afc_rw.handle, sqe->args.afc_rw.data, sqe->args.afc_rw.length, &cqe->bytes);
+		break;
+	case IDEVICE_RING_OP_AFC_WRITE:
+		cqe->result = afc_file_write((afc_client_t)sqe->client, sqe->args.afc_rw.handle, sqe->args.afc_rw.data, sqe->args.afc_rw.length, &cqe->bytes);
+		break;
+	case IDEVICE_RING_OP_AFC_STAT:
+		cqe->result = afc_get_file_info_struct((afc_client_t)sqe->client, sqe->args.afc_stat.path, sqe->args.afc_stat.info);
+		break;
+	case IDEVICE_RING_OP_LOCKDOWN_GET_VALUE:
+		cqe->result = lockdownd_get_value((lockdownd_client_t)sqe->client, sqe->args.get_value.domain, sqe->args.get_value.key, &cqe->plist);
+		break;
+	case IDEVICE_RING_OP_PLIST_REQUEST:
+		cqe->result = property_list_service_send_binary_plist((property_list_service_client_t)sqe->client, sqe->args.plist.request);
+		if (cqe->result == PROPERTY_LIST_SERVICE_E_SUCCESS) {
+			cqe->result = property_list_service_receive_plist((property_list_service_client_t)sqe->client, &cqe->plist);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Takes the first pending operation whose client has no operation running.
+ * A later operation on the same client is skipped along with it, which
+ * keeps the operations of a client in submission order. Must be called
+ * with the mutex held.
+ *
+ * @return The slot index, or RING_SLOT_NONE if nothing can run right now.
+ */
+static uint32_t ring_take_pending(idevice_ring_t ring)
+{
+	uint32_t prev = RING_SLOT_NONE;
+	uint32_t idx = ring->pending_head;
+	while (idx != RING_SLOT_NONE) {
+		void *client = ring->slots[idx].sqe.client;
+		int busy = 0;
+		unsigned int i;
+		if (client) {
+			for (i = 0; i < ring->num_workers; i++) {
+				if (ring->workers[i].busy == client) {
+					busy = 1;
+					break;
+				}
+			}
+		}
+		if (!busy) {
+			if (prev == RING_SLOT_NONE) {
+				ring->pending_head = ring->slots[idx].next;
+			} else {
+				ring->slots[prev].next = ring->slots[idx].next;
+			}
+			if (ring->pending_tail == idx) {
+				ring->pending_tail = prev;
+			}
+			return idx;
+		}
+		prev = idx;
+		idx = ring->slots[idx].next;
+	}
+	return RING_SLOT_NONE;
+}
+
+static void* ring_worker_thread(void *data)
+{
+	struct ring_worker *worker = (struct ring_worker*)data;
+	idevice_ring_t ring = worker->ring;
+
+	mutex_lock(&ring->mutex);
+	while (!ring->stopping) {
+		uint32_t idx = ring_take_pending(ring);
+		if (idx == RING_SLOT_NONE) {
+			cond_wait(&ring->work_cond, &ring->mutex);
+			continue;
+		}
+		struct ring_slot *slot = &ring->slots[idx];
+		worker->busy = slot->sqe.client;
+		mutex_unlock(&ring->mutex);
+
+		ring_run(slot);
+
+		mutex_lock(&ring->mutex);
+		worker->busy = NULL;
+		ring->completed[(ring->completed_head + ring->completed_count) % ring->entries] = idx;
+		ring->completed_count++;
+		cond_broadcast(&ring->done_cond);
+		if (ring->pending_head != RING_SLOT_NONE && slot->sqe.client) {
+			/* operations on this client may be waiting */
+			cond_broadcast(&ring->work_cond);
+		}
+	}
+	mutex_unlock(&ring->mutex);
+
+	return NULL;
+}
+
+static void ring_shutdown(idevice_ring_t ring)
+{
+	unsigned int i;
+
+	mutex_lock(&ring->mutex);
+	ring->stopping = 1;
+	cond_broadcast(&ring->work_cond);
+	mutex_unlock(&ring->mutex);
+
+	for (i = 0; i < ring->num_workers; i++) {
+		thread_join(ring->workers[i].thread);
+		thread_free(ring->workers[i].thread);
+	}
+
+	if (ring->slots) {
+		while (ring->completed_count > 0) {
+			plist_free(ring->slots[ring->completed[ring->completed_head]].cqe.plist);
+			ring->completed_head = (ring->completed_head + 1) % ring->entries;
+			ring->completed_count--;
+		}
+	}
+
+	cond_destroy(&ring->done_cond);
+	cond_destroy(&ring->work_cond);
+	mutex_destroy(&ring->mutex);
+	free(ring->workers);
+	free(ring->completed);
+	free(ring->slots);
+	free(ring);
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_ring_new(idevice_ring_t *ring, uint32_t entries, unsigned int num_threads)
+{
+	if (!ring || entries == 0)
+		return IDEVICE_E_INVALID_ARG;
+
+	if (entries > RING_MAX_ENTRIES)
+		entries = RING_MAX_ENTRIES;
+	if (num_threads == 0)
+		num_threads = RING_DEFAULT_THREADS;
+
+	idevice_ring_t ring_loc = (idevice_ring_t)calloc(1, sizeof(struct idevice_ring_private));
+	if (!ring_loc)
+		return IDEVICE_E_UNKNOWN_ERROR;
+
+	mutex_init(&ring_loc->mutex);
+	cond_init(&ring_loc->work_cond);
+	cond_init(&ring_loc->done_cond);
+	ring_loc->entries = entries;
+	ring_loc->pending_head = RING_SLOT_NONE;
+	ring_loc->pending_tail = RING_SLOT_NONE;
+	ring_loc->slots = (struct ring_slot*)calloc(entries, sizeof(struct ring_slot));
+	ring_loc->completed = (uint32_t*)calloc(entries, sizeof(uint32_t));
+	ring_loc->workers = (struct ring_worker*)calloc(num_threads, sizeof(struct ring_worker));
+	if (!ring_loc->slots || !ring_loc->completed || !ring_loc->workers) {
+		ring_shutdown(ring_loc);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	uint32_t i;
+	for (i = 0; i < entries; i++) {
+		ring_loc->slots[i].next = (i + 1 < entries) ? i + 1 : RING_SLOT_NONE;
+	}
+	ring_loc->free_head = 0;
+
+	for (i = 0; i < num_threads; i++) {
+		ring_loc->workers[i].ring = ring_loc;
+		if (thread_new(&ring_loc->workers[i].thread, ring_worker_thread, &ring_loc->workers[i]) != 0) {
+			debug_info("ERROR: could not start ring worker thread");
+			ring_shutdown(ring_loc);
+			return IDEVICE_E_UNKNOWN_ERROR;
+		}
+		ring_loc->num_workers++;
+	}
+
+	*ring = ring_loc;
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_ring_free(idevice_ring_t ring)
+{
+	if (!ring)
+		return IDEVICE_E_INVALID_ARG;
+
+	ring_shutdown(ring);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_ring_submit(idevice_ring_t ring, const idevice_ring_sqe_t *sqes, uint32_t count, uint32_t *submitted)
+{
+	if (submitted)
+		*submitted = 0;
+	if (!ring || (!sqes && count > 0))
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	uint32_t done = 0;
+
+	mutex_lock(&ring->mutex);
+	while (done < count && ring->free_head != RING_SLOT_NONE) {
+		const idevice_ring_sqe_t *sqe = &sqes[done];
+		if (sqe->op > IDEVICE_RING_OP_PLIST_REQUEST || (sqe->op != IDEVICE_RING_OP_NOP && !sqe->client)) {
+			res = IDEVICE_E_INVALID_ARG;
+			break;
+		}
+		uint32_t idx = ring->free_head;
+		struct ring_slot *slot = &ring->slots[idx];
+		ring->free_head = slot->next;
+		slot->sqe = *sqe;
+		slot->next = RING_SLOT_NONE;
+		if (ring->pending_tail == RING_SLOT_NONE) {
+			ring->pending_head = idx;
+		} else {
+			ring->slots[ring->pending_tail].next = idx;
+		}
+		ring->pending_tail = idx;
+		ring->outstanding++;
+		done++;
+	}
+	if (done > 0) {
+		cond_broadcast(&ring->work_cond);
+	}
+	mutex_unlock(&ring->mutex);
+
+	if (submitted)
+		*submitted = done;
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API idevice_error_t idevice_ring_reap(idevice_ring_t ring, idevice_ring_cqe_t *cqes, uint32_t count, uint32_t min_complete, unsigned int timeout, uint32_t *reaped)
+{
+	if (reaped)
+		*reaped = 0;
+	if (!ring || !cqes || count == 0 || min_complete > count)
+		return IDEVICE_E_INVALID_ARG;
+
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	uint64_t deadline = (timeout > 0) ? time_monotonic_usec() + (uint64_t)timeout * 1000 : 0;
+
+	mutex_lock(&ring->mutex);
+	/* can't wait for more than what is in flight */
+	if (min_complete > ring->outstanding)
+		min_complete = ring->outstanding;
+	while (ring->completed_count < min_complete) {
+		if (deadline == 0) {
+			cond_wait(&ring->done_cond, &ring->mutex);
+			continue;
+		}
+		uint64_t now = time_monotonic_usec();
+		if (now >= deadline) {
+			res = IDEVICE_E_TIMEOUT;
+			break;
+		}
+		cond_wait_timeout(&ring->done_cond, &ring->mutex, (unsigned int)((deadline - now + 999) / 1000));
+	}
+	uint32_t n = 0;
+	while (n < count && ring->completed_count > 0) {
+		uint32_t idx = ring->completed[ring->completed_head];
+		ring->completed_head = (ring->completed_head + 1) % ring->entries;
+		ring->completed_count--;
+		cqes[n++] = ring->slots[idx].cqe;
+		ring->slots[idx].next = ring->free_head;
+		ring->free_head = idx;
+		ring->outstanding--;
+	}
+	mutex_unlock(&ring->mutex);
+
+	if (reaped)
+		*reaped = n;
+
+	return res;
+}
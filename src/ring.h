@@ -0,0 +1,74 @@
+/*
+ * ring.h
+ * Definitions for the submission/completion ring
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __RING_H
+#define __RING_H
+
+#include <stdint.h>
+
+#include "libimobiledevice/ring.h"
+#include "common/thread.h"
+
+#define RING_DEFAULT_THREADS 4
+#define RING_MAX_ENTRIES 65536
+
+/* terminates the slot lists */
+#define RING_SLOT_NONE UINT32_MAX
+
+struct ring_slot {
+	idevice_ring_sqe_t sqe;
+	idevice_ring_cqe_t cqe;
+	/* next slot in the free or the pending list */
+	uint32_t next;
+};
+
+struct ring_worker {
+	struct idevice_ring_private *ring;
+	THREAD_T thread;
+	/* client of the running operation, protected by the ring's mutex */
+	void *busy;
+};
+
+struct idevice_ring_private {
+	mutex_t mutex;
+	/* signalled when operations were submitted or a client became idle */
+	cond_t work_cond;
+	/* signalled when operations completed */
+	cond_t done_cond;
+	struct ring_slot *slots;
+	uint32_t entries;
+	/* all of the following are protected by mutex */
+	uint32_t free_head;
+	/* submitted operations that did not start yet, in submission order */
+	uint32_t pending_head;
+	uint32_t pending_tail;
+	/* circular buffer of completed slots in completion order */
+	uint32_t *completed;
+	uint32_t completed_head;
+	uint32_t completed_count;
+	/* slots not on the free list */
+	uint32_t outstanding;
+	struct ring_worker *workers;
+	unsigned int num_workers;
+	int stopping;
+};
+
+#endif
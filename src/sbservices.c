@@ -24,11 +24,13 @@
 #endif
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 #include <plist/plist.h>
 
 #include "sbservices.h"
 #include "property_list_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 /**
  * Locks an sbservices client, used for thread safety.
@@ -217,6 +219,166 @@ leave_unlock:
 	return res;
 }
 
+/**
+ * Builds the path of the cache file for the icon of the given app version.
+ * Characters that are not safe in file names are replaced with '_'.
+ *
+ * @param cache_dir The cache directory.
+ * @param bundle_id The bundle identifier of the app.
+ * @param version The version of the app.
+ *
+ * @return A newly allocated path string that has to be freed by the caller.
+ */
+static char *sbservices_icon_cache_path(const char *cache_dir, const char *bundle_id, const char *version)
+{
+	char *name = string_concat(bundle_id, "-", version, ".png", NULL);
+	char *p;
+	for (p = name; *p; p++) {
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '.' || *p == '-')) {
+			*p = '_';
+		}
+	}
+	char *path = string_build_path(cache_dir, name, NULL);
+	free(name);
+	return path;
+}
+
+/**
+ * Writes icon data to the cache. The data is written to a temporary file
+ * first so a concurrent reader never sees a partially written icon.
+ */
+static void sbservices_icon_cache_store(const char *path, const char *pngdata, uint64_t pngsize)
+{
+	char *tmppath = string_concat(path, ".tmp", NULL);
+	FILE *f = fopen(tmppath, "wb");
+	if (!f) {
+		debug_info("could not write icon cache file %s", tmppath);
+		free(tmppath);
+		return;
+	}
+	size_t written = fwrite(pngdata, 1, pngsize, f);
+	if (fclose(f) != 0 || written != pngsize) {
+		remove(tmppath);
+		free(tmppath);
+		return;
+	}
+#ifdef WIN32
+	remove(path);
+#endif
+	if (rename(tmppath, path) != 0) {
+		remove(tmppath);
+	}
+	free(tmppath);
+}
+
+struct sbservices_icon_batch {
+	const char **bundle_ids;
+	const char **versions;
+	const char *cache_dir;
+	/* maps request index to bundle_ids index */
+	uint32_t *pending;
+	sbservices_icon_cb_t callback;
+	void *user_data;
+};
+
+static void sbservices_icon_reply_cb(uint32_t index, plist_t reply, property_list_service_error_t status, void *user_data)
+{
+	struct sbservices_icon_batch *batch = (struct sbservices_icon_batch*)user_data;
+	uint32_t n = batch->pending[index];
+	const char *bundle_id = batch->bundle_ids[n];
+
+	if (status != PROPERTY_LIST_SERVICE_E_SUCCESS) {
+		batch->callback(bundle_id, NULL, 0, sbservices_error(status), batch->user_data);
+		return;
+	}
+
+	plist_t node = plist_dict_get_item(reply, "pngData");
+	if (!node || plist_get_node_type(node) != PLIST_DATA) {
+		debug_info("no icon data for %s", bundle_id);
+		batch->callback(bundle_id, NULL, 0, SBSERVICES_E_PLIST_ERROR, batch->user_data);
+		return;
+	}
+
+	uint64_t pngsize = 0;
+	const char *pngdata = plist_get_data_ptr(node, &pngsize);
+	if (batch->cache_dir && batch->versions && batch->versions[n] && pngsize > 0) {
+		char *path = sbservices_icon_cache_path(batch->cache_dir, bundle_id, batch->versions[n]);
+		sbservices_icon_cache_store(path, pngdata, pngsize);
+		free(path);
+	}
+	batch->callback(bundle_id, pngdata, pngsize, SBSERVICES_E_SUCCESS, batch->user_data);
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icons_pngdata_cached(sbservices_client_t client, const char **bundle_ids, const char **versions, const char *cache_dir, sbservices_icon_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !bundle_ids || !callback)
+		return SBSERVICES_E_INVALID_ARG;
+
+	uint32_t count = 0;
+	while (bundle_ids[count])
+		count++;
+	if (count == 0)
+		return SBSERVICES_E_SUCCESS;
+
+	plist_t *requests = (plist_t*)malloc(sizeof(plist_t) * count);
+	uint32_t *pending = (uint32_t*)malloc(sizeof(uint32_t) * count);
+	if (!requests || !pending) {
+		free(requests);
+		free(pending);
+		return SBSERVICES_E_UNKNOWN_ERROR;
+	}
+
+	uint32_t num_requests = 0;
+	uint32_t i;
+	for (i = 0; i < count; i++) {
+		if (cache_dir && versions && versions[i]) {
+			char *path = sbservices_icon_cache_path(cache_dir, bundle_ids[i], versions[i]);
+			char *pngdata = NULL;
+			uint64_t pngsize = 0;
+			buffer_read_from_filename(path, &pngdata, &pngsize);
+			free(path);
+			if (pngdata && pngsize > 0) {
+				debug_info("using cached icon for %s", bundle_ids[i]);
+				callback(bundle_ids[i], pngdata, pngsize, SBSERVICES_E_SUCCESS, user_data);
+				free(pngdata);
+				continue;
+			}
+			free(pngdata);
+		}
+		plist_t dict = plist_new_dict();
+		plist_dict_set_item(dict, "command", plist_new_string("getIconPNGData"));
+		plist_dict_set_item(dict, "bundleId", plist_new_string(bundle_ids[i]));
+		requests[num_requests] = dict;
+		pending[num_requests] = i;
+		num_requests++;
+	}
+
+	sbservices_error_t res = SBSERVICES_E_SUCCESS;
+	if (num_requests > 0) {
+		struct sbservices_icon_batch batch = { bundle_ids, versions, cache_dir, pending, callback, user_data };
+
+		sbservices_lock(client);
+		res = sbservices_error(property_list_service_send_receive_pipelined(client->parent, requests, num_requests, 1, SBSERVICES_ICON_PIPELINE_WINDOW, sbservices_icon_reply_cb, &batch));
+		sbservices_unlock(client);
+		if (res != SBSERVICES_E_SUCCESS) {
+			debug_info("could not fetch icons, error %d", res);
+		}
+
+		for (i = 0; i < num_requests; i++) {
+			plist_free(requests[i]);
+		}
+	}
+	free(requests);
+	free(pending);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_icons_pngdata(sbservices_client_t client, const char **bundle_ids, sbservices_icon_cb_t callback, void *user_data)
+{
+	return sbservices_get_icons_pngdata_cached(client, bundle_ids, NULL, NULL, callback, user_data);
+}
+
 LIBIMOBILEDEVICE_API sbservices_error_t sbservices_get_interface_orientation(sbservices_client_t client, sbservices_interface_orientation_t* interface_orientation)
 {
 	if (!client || !client->parent || !interface_orientation)
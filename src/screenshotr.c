@@ -25,10 +25,22 @@
 #include <plist/plist.h>
 #include <string.h>
 #include <stdlib.h>
+#ifdef WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 #include "screenshotr.h"
 #include "device_link_service.h"
 #include "common/debug.h"
+#include "common/utils.h"
 
 #define SCREENSHOTR_VERSION_INT1 400
 #define SCREENSHOTR_VERSION_INT2 0
@@ -110,33 +122,46 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_client_free(screenshotr_cli
 	return err;
 }
 
-LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+static screenshotr_error_t screenshotr_send_request(screenshotr_client_t client)
 {
-	if (!client || !client->parent || !imgdata)
-		return SCREENSHOTR_E_INVALID_ARG;
-
-	screenshotr_error_t res = SCREENSHOTR_E_UNKNOWN_ERROR;
-
 	plist_t dict = plist_new_dict();
 	plist_dict_set_item(dict, "MessageType", plist_new_string("ScreenShotRequest"));
 
-	res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
+	screenshotr_error_t res = screenshotr_error(device_link_service_send_process_message(client->parent, dict));
 	plist_free(dict);
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not send plist, error %d", res);
-		return res;
 	}
 
-	dict = NULL;
-	res = screenshotr_error(device_link_service_receive_process_message(client->parent, &dict));
+	return res;
+}
+
+/**
+ * Receives a ScreenShotReply message.
+ *
+ * @param client The screenshotr client
+ * @param reply Pointer that will be set to the received message, to be
+ *     freed by the caller.
+ * @param imgdata Pointer that will be set to the image data inside of the
+ *     message.
+ * @param imgsize Pointer that will be set to the size of the image data.
+ *
+ * @return SCREENSHOTR_E_SUCCESS on success or an SCREENSHOTR_E_* error code.
+ */
+static screenshotr_error_t screenshotr_receive_reply(screenshotr_client_t client, plist_t *reply, const char **imgdata, uint64_t *imgsize)
+{
+	plist_t dict = NULL;
+	screenshotr_error_t res = screenshotr_error(device_link_service_receive_process_message(client->parent, &dict));
+
+	*reply = NULL;
+
 	if (res != SCREENSHOTR_E_SUCCESS) {
 		debug_info("could not get screenshot data, error %d", res);
-		goto leave;
+		return res;
 	}
 	if (!dict) {
 		debug_info("did not receive screenshot data!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		return SCREENSHOTR_E_PLIST_ERROR;
 	}
 
 	plist_t node = plist_dict_get_item(dict, "MessageType");
@@ -144,26 +169,500 @@ LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr
 	plist_get_string_val(node, &strval);
 	if (!strval || strcmp(strval, "ScreenShotReply")) {
 		debug_info("invalid screenshot data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		free(strval);
+		plist_free(dict);
+		return SCREENSHOTR_E_PLIST_ERROR;
 	}
+	free(strval);
 	node = plist_dict_get_item(dict, "ScreenShotData");
 	if (!node || plist_get_node_type(node) != PLIST_DATA) {
 		debug_info("no PNG data received!");
-		res = SCREENSHOTR_E_PLIST_ERROR;
-		goto leave;
+		plist_free(dict);
+		return SCREENSHOTR_E_PLIST_ERROR;
 	}
 
-	plist_get_data_val(node, imgdata, imgsize);
-	res = SCREENSHOTR_E_SUCCESS;
+	*imgdata = plist_get_data_ptr(node, imgsize);
+	*reply = dict;
 
-leave:
-	if (dict)
-		plist_free(dict);
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_take_screenshot(screenshotr_client_t client, char **imgdata, uint64_t *imgsize)
+{
+	if (!client || !client->parent || !imgdata)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	plist_t reply = NULL;
+	const char *data = NULL;
+	uint64_t size = 0;
+	res = screenshotr_receive_reply(client, &reply, &data, &size);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+
+	*imgdata = (char*)malloc(size);
+	if (!*imgdata) {
+		plist_free(reply);
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+	memcpy(*imgdata, data, size);
+	if (imgsize)
+		*imgsize = size;
+	plist_free(reply);
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+static void screenshotr_sleep_usec(uint64_t usec)
+{
+#ifdef WIN32
+	Sleep((DWORD)(usec / 1000));
+#else
+	struct timespec ts;
+	ts.tv_sec = usec / 1000000;
+	ts.tv_nsec = (usec % 1000000) * 1000;
+	nanosleep(&ts, NULL);
+#endif
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_start_stream(screenshotr_client_t client, unsigned int interval, screenshotr_frame_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !callback)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	uint64_t interval_usec = (uint64_t)interval * 1000;
+	uint64_t requested = time_monotonic_usec();
+	int pending = 0;
+	int stop = 0;
+
+	screenshotr_error_t res = screenshotr_send_request(client);
+	if (res != SCREENSHOTR_E_SUCCESS) {
+		return res;
+	}
+	pending = 1;
+
+	while (pending) {
+		plist_t reply = NULL;
+		const char *imgdata = NULL;
+		uint64_t imgsize = 0;
+
+		res = screenshotr_receive_reply(client, &reply, &imgdata, &imgsize);
+		pending = 0;
+		if (res != SCREENSHOTR_E_SUCCESS) {
+			break;
+		}
+
+		if (stop) {
+			/* reply to the request that was sent before the callback asked to stop */
+			plist_free(reply);
+			break;
+		}
+
+		/* request the next frame while this one is handled, unless it is not due yet */
+		if (time_monotonic_usec() - requested >= interval_usec) {
+			requested = time_monotonic_usec();
+			res = screenshotr_send_request(client);
+			if (res != SCREENSHOTR_E_SUCCESS) {
+				plist_free(reply);
+				break;
+			}
+			pending = 1;
+		}
+
+		stop = callback(imgdata, imgsize, user_data);
+		plist_free(reply);
+
+		if (!pending && !stop) {
+			uint64_t elapsed = time_monotonic_usec() - requested;
+			if (elapsed < interval_usec) {
+				screenshotr_sleep_usec(interval_usec - elapsed);
+			}
+			requested = time_monotonic_usec();
+			res = screenshotr_send_request(client);
+			if (res != SCREENSHOTR_E_SUCCESS) {
+				break;
+			}
+			pending = 1;
+		}
+	}
 
 	return res;
 }
 
+#define SCREENSHOTR_PNG_DEFAULT_LEVEL 1
+
+static const unsigned char png_signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+
+#ifdef HAVE_ZLIB
+struct tiff_image {
+	int be;
+	uint32_t width;
+	uint32_t height;
+	uint32_t samples;
+	uint32_t rows_per_strip;
+	uint32_t extra_samples;
+	uint16_t offsets_type;
+	uint32_t offsets_count;
+	const unsigned char *offsets_field;
+};
+
+static uint32_t tiff_get16(const unsigned char *p, int be)
+{
+	return (be) ? ((uint32_t)p[0] << 8) | p[1] : ((uint32_t)p[1] << 8) | p[0];
+}
+
+static uint32_t tiff_get32(const unsigned char *p, int be)
+{
+	return (be) ? ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]
+		: ((uint32_t)p[3] << 24) | ((uint32_t)p[2] << 16) | ((uint32_t)p[1] << 8) | p[0];
+}
+
+/**
+ * Gets the value at index of a SHORT or LONG field of a TIFF directory
+ * entry, which is stored in the entry itself if it fits.
+ *
+ * @return 0 on success, or -1 if the field has another type or is out of
+ *     bounds.
+ */
+static int tiff_get_value(const unsigned char *data, uint64_t size, int be, uint16_t type, uint32_t count, const unsigned char *field, uint32_t index, uint32_t *value)
+{
+	uint32_t elsize = (type == 3) ? 2 : (type == 4) ? 4 : 0;
+	if (elsize == 0 || index >= count) {
+		return -1;
+	}
+	const unsigned char *p = field;
+	if ((uint64_t)count * elsize > 4) {
+		uint64_t offset = tiff_get32(field, be);
+		if (offset + (uint64_t)count * elsize > size) {
+			return -1;
+		}
+		p = data + offset;
+	}
+	p += (size_t)index * elsize;
+	*value = (elsize == 2) ? tiff_get16(p, be) : tiff_get32(p, be);
+	return 0;
+}
+
+/**
+ * Reads the first directory of a TIFF image and checks that it is an
+ * uncompressed, chunky 8 bit RGB or RGBA image.
+ */
+static int tiff_parse(const unsigned char *data, uint64_t size, struct tiff_image *tiff)
+{
+	uint32_t bits = 0;
+	uint32_t compression = 1;
+	uint32_t photometric = 0;
+	uint32_t planar = 1;
+	uint32_t i;
+
+	memset(tiff, '\0', sizeof(struct tiff_image));
+	if (size < 8) {
+		return -1;
+	}
+	if (memcmp(data, "MM\x00*", 4) == 0) {
+		tiff->be = 1;
+	} else if (memcmp(data, "II*\x00", 4) != 0) {
+		return -1;
+	}
+	uint64_t ifd = tiff_get32(data + 4, tiff->be);
+	if (ifd + 2 > size) {
+		return -1;
+	}
+	uint32_t num_entries = tiff_get16(data + ifd, tiff->be);
+	if (ifd + 2 + (uint64_t)num_entries * 12 > size) {
+		return -1;
+	}
+
+	tiff->rows_per_strip = UINT32_MAX;
+	for (i = 0; i < num_entries; i++) {
+		const unsigned char *entry = data + ifd + 2 + i * 12;
+		uint16_t tag = tiff_get16(entry, tiff->be);
+		uint16_t type = tiff_get16(entry + 2, tiff->be);
+		uint32_t count = tiff_get32(entry + 4, tiff->be);
+		const unsigned char *field = entry + 8;
+		uint32_t value = 0;
+		int res = 0;
+		switch (tag) {
+			case 256:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &tiff->width);
+				break;
+			case 257:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &tiff->height);
+				break;
+			case 258:
+				/* one entry per sample, all of them have to be 8 bit */
+				for (bits = 8, value = 0; value < count && res == 0; value++) {
+					uint32_t b = 0;
+					res = tiff_get_value(data, size, tiff->be, type, count, field, value, &b);
+					if (b != 8)
+						bits = b;
+				}
+				break;
+			case 259:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &compression);
+				break;
+			case 262:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &photometric);
+				break;
+			case 273:
+				tiff->offsets_type = type;
+				tiff->offsets_count = count;
+				tiff->offsets_field = field;
+				break;
+			case 277:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &tiff->samples);
+				break;
+			case 278:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &tiff->rows_per_strip);
+				break;
+			case 284:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &planar);
+				break;
+			case 338:
+				res = tiff_get_value(data, size, tiff->be, type, count, field, 0, &tiff->extra_samples);
+				break;
+			default:
+				break;
+		}
+		if (res < 0) {
+			debug_info("invalid TIFF tag %u", tag);
+			return -1;
+		}
+	}
+
+	if (tiff->width == 0 || tiff->height == 0 || !tiff->offsets_field) {
+		return -1;
+	}
+	if (bits != 8 || compression != 1 || photometric != 2 || planar != 1 || (tiff->samples != 3 && tiff->samples != 4)) {
+		debug_info("unsupported TIFF layout: %u bits, compression %u, photometric %u, planar %u, %u samples", bits, compression, photometric, planar, tiff->samples);
+		return -1;
+	}
+	if (tiff->rows_per_strip == 0 || tiff->rows_per_strip > tiff->height) {
+		tiff->rows_per_strip = tiff->height;
+	}
+	if (tiff->offsets_count < (tiff->height + tiff->rows_per_strip - 1) / tiff->rows_per_strip) {
+		return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Drops the unused fourth byte of RGBX pixels.
+ */
+static void screenshotr_pack_rgb(unsigned char *dst, const unsigned char *src, uint32_t pixels)
+{
+	uint32_t i = 0;
+#ifdef __SSSE3__
+	const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	/* 16 bytes are stored for every 12, the row buffer has room for the tail */
+	for (; i + 4 <= pixels; i += 4) {
+		__m128i px = _mm_loadu_si128((const __m128i*)(src + i * 4));
+		_mm_storeu_si128((__m128i*)(dst + i * 3), _mm_shuffle_epi8(px, mask));
+	}
+#endif
+	for (; i < pixels; i++) {
+		dst[i * 3] = src[i * 4];
+		dst[i * 3 + 1] = src[i * 4 + 1];
+		dst[i * 3 + 2] = src[i * 4 + 2];
+	}
+}
+
+static void png_put32(unsigned char *p, uint32_t value)
+{
+	p[0] = (unsigned char)(value >> 24);
+	p[1] = (unsigned char)(value >> 16);
+	p[2] = (unsigned char)(value >> 8);
+	p[3] = (unsigned char)value;
+}
+
+/**
+ * Writes the CRC of the chunk whose length field is at p, right after its
+ * data, and returns the position following it.
+ */
+static unsigned char *png_finish_chunk(unsigned char *p, uint32_t length)
+{
+	uint32_t crc = (uint32_t)crc32(0, p + 4, length + 4);
+	png_put32(p + 8 + length, crc);
+	return p + 12 + length;
+}
+#endif
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_png_encoder_new(int level, screenshotr_png_encoder_t *encoder)
+{
+	if (!encoder || level < -1 || level > 9)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+#ifdef HAVE_ZLIB
+	screenshotr_png_encoder_t encoder_loc = (screenshotr_png_encoder_t)calloc(1, sizeof(struct screenshotr_png_encoder_private));
+	if (!encoder_loc)
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	encoder_loc->level = (level < 0) ? SCREENSHOTR_PNG_DEFAULT_LEVEL : level;
+
+	z_stream *zs = (z_stream*)calloc(1, sizeof(z_stream));
+	if (!zs || deflateInit(zs, encoder_loc->level) != Z_OK) {
+		free(zs);
+		free(encoder_loc);
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+	encoder_loc->zs = zs;
+
+	*encoder = encoder_loc;
+	return SCREENSHOTR_E_SUCCESS;
+#else
+	debug_info("built without zlib, PNG encoding is not available");
+	return SCREENSHOTR_E_UNKNOWN_ERROR;
+#endif
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_png_encoder_free(screenshotr_png_encoder_t encoder)
+{
+	if (!encoder)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+#ifdef HAVE_ZLIB
+	if (encoder->zs) {
+		deflateEnd((z_stream*)encoder->zs);
+		free(encoder->zs);
+	}
+#endif
+	free(encoder->row);
+	free(encoder->out);
+	free(encoder);
+
+	return SCREENSHOTR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_convert_to_png(screenshotr_png_encoder_t encoder, const char *imgdata, uint64_t imgsize, const char **pngdata, uint64_t *pngsize)
+{
+	if (!encoder || !imgdata || !pngdata || !pngsize)
+		return SCREENSHOTR_E_INVALID_ARG;
+
+	if (imgsize >= sizeof(png_signature) && memcmp(imgdata, png_signature, sizeof(png_signature)) == 0) {
+		*pngdata = imgdata;
+		*pngsize = imgsize;
+		return SCREENSHOTR_E_SUCCESS;
+	}
+
+#ifdef HAVE_ZLIB
+	const unsigned char *data = (const unsigned char*)imgdata;
+	struct tiff_image tiff;
+	if (tiff_parse(data, imgsize, &tiff) < 0) {
+		debug_info("not a supported TIFF image");
+		return SCREENSHOTR_E_IMAGE_ERROR;
+	}
+
+	/* without an alpha channel the fourth sample is padding and is dropped */
+	int keep_alpha = (tiff.samples == 4 && tiff.extra_samples != 0);
+	uint32_t channels = (keep_alpha) ? 4 : 3;
+	uint64_t in_stride = (uint64_t)tiff.width * tiff.samples;
+	uint64_t out_stride = 1 + (uint64_t)tiff.width * channels;
+	if (out_stride * tiff.height > INT32_MAX) {
+		debug_info("image too large");
+		return SCREENSHOTR_E_IMAGE_ERROR;
+	}
+
+	if (encoder->row_size < out_stride + 16) {
+		unsigned char *row = (unsigned char*)realloc(encoder->row, out_stride + 16);
+		if (!row)
+			return SCREENSHOTR_E_UNKNOWN_ERROR;
+		encoder->row = row;
+		encoder->row_size = out_stride + 16;
+	}
+
+	z_stream *zs = (z_stream*)encoder->zs;
+	if (deflateReset(zs) != Z_OK) {
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+	uLong bound = deflateBound(zs, (uLong)(out_stride * tiff.height));
+	/* signature, IHDR, IDAT header and CRC, IEND */
+	size_t needed = sizeof(png_signature) + 25 + 12 + bound + 12;
+	if (encoder->out_size < needed) {
+		unsigned char *out = (unsigned char*)realloc(encoder->out, needed);
+		if (!out)
+			return SCREENSHOTR_E_UNKNOWN_ERROR;
+		encoder->out = out;
+		encoder->out_size = needed;
+	}
+
+	unsigned char *p = encoder->out;
+	memcpy(p, png_signature, sizeof(png_signature));
+	p += sizeof(png_signature);
+	png_put32(p, 13);
+	memcpy(p + 4, "IHDR", 4);
+	png_put32(p + 8, tiff.width);
+	png_put32(p + 12, tiff.height);
+	p[16] = 8;
+	p[17] = (keep_alpha) ? 6 : 2;
+	p[18] = 0;
+	p[19] = 0;
+	p[20] = 0;
+	p = png_finish_chunk(p, 13);
+
+	unsigned char *idat = p;
+	memcpy(idat + 4, "IDAT", 4);
+	zs->next_out = idat + 8;
+	zs->avail_out = (uInt)bound;
+
+	/* every row is read from its strip, filtered (type None) and compressed right away */
+	const unsigned char *strip = NULL;
+	uint32_t y;
+	int zres = Z_OK;
+	for (y = 0; y < tiff.height; y++) {
+		uint32_t row_in_strip = y % tiff.rows_per_strip;
+		if (row_in_strip == 0) {
+			uint32_t offset = 0;
+			uint32_t rows = tiff.height - y;
+			if (rows > tiff.rows_per_strip)
+				rows = tiff.rows_per_strip;
+			if (tiff_get_value(data, imgsize, tiff.be, tiff.offsets_type, tiff.offsets_count, tiff.offsets_field, y / tiff.rows_per_strip, &offset) < 0
+			    || (uint64_t)offset + in_stride * rows > imgsize) {
+				debug_info("strip %u is out of bounds", y / tiff.rows_per_strip);
+				return SCREENSHOTR_E_IMAGE_ERROR;
+			}
+			strip = data + offset;
+		}
+		const unsigned char *src = strip + in_stride * row_in_strip;
+		encoder->row[0] = 0;
+		if (tiff.samples == 4 && !keep_alpha) {
+			screenshotr_pack_rgb(encoder->row + 1, src, tiff.width);
+		} else {
+			memcpy(encoder->row + 1, src, (size_t)in_stride);
+		}
+		zs->next_in = encoder->row;
+		zs->avail_in = (uInt)out_stride;
+		zres = deflate(zs, (y + 1 == tiff.height) ? Z_FINISH : Z_NO_FLUSH);
+		if (zres != Z_OK && zres != Z_STREAM_END) {
+			break;
+		}
+	}
+	if (zres != Z_STREAM_END) {
+		debug_info("deflate failed, error %d", zres);
+		return SCREENSHOTR_E_UNKNOWN_ERROR;
+	}
+
+	uint32_t idat_len = (uint32_t)(bound - zs->avail_out);
+	png_put32(idat, idat_len);
+	p = png_finish_chunk(idat, idat_len);
+
+	png_put32(p, 0);
+	memcpy(p + 4, "IEND", 4);
+	p = png_finish_chunk(p, 0);
+
+	*pngdata = (const char*)encoder->out;
+	*pngsize = (uint64_t)(p - encoder->out);
+
+	return SCREENSHOTR_E_SUCCESS;
+#else
+	return SCREENSHOTR_E_UNKNOWN_ERROR;
+#endif
+}
+
 LIBIMOBILEDEVICE_API screenshotr_error_t screenshotr_screenshot_free(char **imgdata)
 {
     free(imgdata);
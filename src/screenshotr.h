@@ -29,4 +29,13 @@ struct screenshotr_client_private {
 	device_link_service_client_t parent;
 };
 
+struct screenshotr_png_encoder_private {
+	int level;
+	unsigned char *row;
+	size_t row_size;
+	unsigned char *out;
+	size_t out_size;
+	void *zs;
+};
+
 #endif
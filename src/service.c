@@ -23,10 +23,16 @@
 #endif
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 
 #include "service.h"
 #include "idevice.h"
+#include "event_loop.h"
+#include "lockdown.h"
+#include "trace.h"
 #include "common/debug.h"
+#include "common/utils.h"
+#include "common/thread.h"
 
 /**
  * Convert an idevice_error_t value to an service_error_t value.
@@ -56,6 +62,279 @@ static service_error_t idevice_to_service_error(idevice_error_t err)
 	return SERVICE_E_UNKNOWN_ERROR;
 }
 
+/* default classification, names also match when followed by a dot */
+static const struct {
+	const char *name;
+	uint32_t weight;
+} service_sched_classes[] = {
+	{ "com.apple.mobilebackup2", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobilebackup", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobilesync", SERVICE_WEIGHT_BULK },
+	{ "com.apple.afc", SERVICE_WEIGHT_BULK },
+	{ "com.apple.afc2", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobile.house_arrest", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobile.mobile_image_mounter", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobile.file_relay", SERVICE_WEIGHT_BULK },
+	{ "com.apple.crashreportcopymobile", SERVICE_WEIGHT_BULK },
+	{ "com.apple.mobile.lockdown", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.debugserver", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.syslog_relay", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.os_trace_relay", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.mobile.notification_proxy", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.mobile.insecure_notification_proxy", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.mobile.heartbeat", SERVICE_WEIGHT_INTERACTIVE },
+	{ "com.apple.webinspector", SERVICE_WEIGHT_INTERACTIVE },
+	{ NULL, 0 }
+};
+
+static mutex_t service_sched_mutex;
+static thread_once_t service_sched_once = THREAD_ONCE_INIT;
+
+static void service_sched_init(void)
+{
+	mutex_init(&service_sched_mutex);
+}
+
+static int service_sched_name_matches(const char *name, const char *service_name)
+{
+	size_t len = strlen(name);
+	return (strncmp(name, service_name, len) == 0 && (service_name[len] == '\0' || service_name[len] == '.'));
+}
+
+/**
+ * Returns the scheduler of a device with a reference taken, creating it on
+ * first use. The device itself holds another reference.
+ */
+static struct service_scheduler* service_scheduler_get(idevice_t device)
+{
+	thread_once(&service_sched_once, service_sched_init);
+
+	mutex_lock(&service_sched_mutex);
+	struct service_scheduler *sched = device->scheduler;
+	if (!sched) {
+		sched = (struct service_scheduler*)calloc(1, sizeof(struct service_scheduler));
+		if (!sched) {
+			mutex_unlock(&service_sched_mutex);
+			return NULL;
+		}
+		mutex_init(&sched->mutex);
+		cond_init(&sched->cond);
+		sched->refs = 1;
+		device->scheduler = sched;
+	}
+	mutex_lock(&sched->mutex);
+	sched->refs++;
+	mutex_unlock(&sched->mutex);
+	mutex_unlock(&service_sched_mutex);
+
+	return sched;
+}
+
+void service_scheduler_release(struct service_scheduler *sched)
+{
+	if (!sched)
+		return;
+
+	mutex_lock(&sched->mutex);
+	unsigned int refs = --sched->refs;
+	mutex_unlock(&sched->mutex);
+	if (refs > 0)
+		return;
+
+	while (sched->overrides) {
+		struct service_sched_override *next = sched->overrides->next;
+		free(sched->overrides->service_name);
+		free(sched->overrides);
+		sched->overrides = next;
+	}
+	cond_destroy(&sched->cond);
+	mutex_destroy(&sched->mutex);
+	free(sched);
+}
+
+/**
+ * Remembers the weight and rate cap for the port a service was started on,
+ * so service_client_new() can apply them to the connection. Called by
+ * lockdownd once it started a service.
+ */
+void service_scheduler_hint(idevice_t device, const char *service_name, uint16_t port)
+{
+	if (!device || !service_name || port == 0)
+		return;
+
+	struct service_scheduler *sched = service_scheduler_get(device);
+	if (!sched)
+		return;
+
+	uint32_t weight = SERVICE_WEIGHT_NORMAL;
+	uint64_t rate_limit = 0;
+	int i;
+	for (i = 0; service_sched_classes[i].name; i++) {
+		if (service_sched_name_matches(service_sched_classes[i].name, service_name)) {
+			weight = service_sched_classes[i].weight;
+			break;
+		}
+	}
+
+	mutex_lock(&sched->mutex);
+	struct service_sched_override *ovr;
+	for (ovr = sched->overrides; ovr; ovr = ovr->next) {
+		if (service_sched_name_matches(ovr->service_name, service_name)) {
+			weight = ovr->weight;
+			rate_limit = ovr->rate_limit;
+			break;
+		}
+	}
+	struct service_sched_hint *hint = NULL;
+	for (i = 0; i < SERVICE_SCHED_HINTS; i++) {
+		if (sched->hints[i].port == port) {
+			hint = &sched->hints[i];
+			break;
+		}
+	}
+	if (!hint) {
+		hint = &sched->hints[sched->next_hint];
+		sched->next_hint = (sched->next_hint + 1) % SERVICE_SCHED_HINTS;
+	}
+	hint->port = port;
+	hint->weight = weight;
+	hint->rate_limit = rate_limit;
+	mutex_unlock(&sched->mutex);
+
+	service_scheduler_release(sched);
+}
+
+static void service_sched_attach(idevice_t device, uint16_t port, service_client_t client)
+{
+	client->scheduler = service_scheduler_get(device);
+	if (!client->scheduler)
+		return;
+
+	struct service_scheduler *sched = client->scheduler;
+	struct service_sched_flow *flow = &client->flow;
+	flow->weight = SERVICE_WEIGHT_NORMAL;
+	flow->rate_limit = 0;
+	flow->tokens = 0;
+	flow->refilled = time_monotonic_usec();
+
+	mutex_lock(&sched->mutex);
+	int i;
+	for (i = 0; i < SERVICE_SCHED_HINTS; i++) {
+		if (sched->hints[i].port == port) {
+			flow->weight = sched->hints[i].weight;
+			flow->rate_limit = sched->hints[i].rate_limit;
+			break;
+		}
+	}
+	flow->finish = sched->vtime;
+	sched->flows++;
+	mutex_unlock(&sched->mutex);
+}
+
+static void service_sched_detach(service_client_t client)
+{
+	struct service_scheduler *sched = client->scheduler;
+	if (!sched)
+		return;
+
+	mutex_lock(&sched->mutex);
+	sched->flows--;
+	mutex_unlock(&sched->mutex);
+
+	service_scheduler_release(sched);
+	client->scheduler = NULL;
+}
+
+/**
+ * Waits until the client may send and returns how many of len bytes it may
+ * send now. Connections take turns in the order of their finish tags, so
+ * each gets a share of the link proportional to its weight (self-clocked
+ * fair queuing). Must be followed by service_sched_release().
+ */
+static uint32_t service_sched_acquire(service_client_t client, uint32_t len)
+{
+	struct service_scheduler *sched = client->scheduler;
+	struct service_sched_flow *flow = &client->flow;
+	if (!sched)
+		return len;
+
+	mutex_lock(&sched->mutex);
+	if (sched->flows <= 1 && flow->rate_limit == 0) {
+		/* nothing to share the link with */
+		sched->active++;
+		mutex_unlock(&sched->mutex);
+		return len;
+	}
+	if (len > SERVICE_SCHED_QUANTUM)
+		len = SERVICE_SCHED_QUANTUM;
+
+	/* token bucket holding up to a tenth of a second worth of data */
+	while (flow->rate_limit > 0) {
+		uint64_t burst = flow->rate_limit / 10;
+		if (burst < SERVICE_SCHED_QUANTUM)
+			burst = SERVICE_SCHED_QUANTUM;
+		uint64_t now = time_monotonic_usec();
+		uint64_t elapsed = now - flow->refilled;
+		if (elapsed > 1000000)
+			elapsed = 1000000;
+		flow->tokens += elapsed * flow->rate_limit / 1000000;
+		if (flow->tokens > burst)
+			flow->tokens = burst;
+		flow->refilled = now;
+		if (flow->tokens >= len) {
+			flow->tokens -= len;
+			break;
+		}
+		uint64_t wait = ((len - flow->tokens) * 1000 + flow->rate_limit - 1) / flow->rate_limit;
+		cond_wait_timeout(&sched->cond, &sched->mutex, (wait > 0) ? (unsigned int)wait : 1);
+	}
+
+	uint64_t start = (flow->finish > sched->vtime) ? flow->finish : sched->vtime;
+	flow->finish = start + (uint64_t)len * SERVICE_SCHED_SCALE / flow->weight;
+
+	if (sched->active > 0 || sched->waiting) {
+		struct service_sched_ticket ticket;
+		ticket.finish = flow->finish;
+		struct service_sched_ticket **p = &sched->waiting;
+		while (*p && (*p)->finish <= ticket.finish)
+			p = &(*p)->next;
+		ticket.next = *p;
+		*p = &ticket;
+
+		uint64_t deadline = time_monotonic_usec() + SERVICE_SCHED_MAX_WAIT * 1000;
+		while (sched->active > 0 || sched->waiting != &ticket) {
+			uint64_t now = time_monotonic_usec();
+			if (now >= deadline) {
+				debug_info("send waited %d ms for its turn, going ahead", SERVICE_SCHED_MAX_WAIT);
+				break;
+			}
+			cond_wait_timeout(&sched->cond, &sched->mutex, (unsigned int)((deadline - now + 999) / 1000));
+		}
+
+		for (p = &sched->waiting; *p != &ticket; p = &(*p)->next);
+		*p = ticket.next;
+	}
+	if (flow->finish > sched->vtime)
+		sched->vtime = flow->finish;
+	sched->active++;
+	mutex_unlock(&sched->mutex);
+
+	return len;
+}
+
+static void service_sched_release(service_client_t client)
+{
+	struct service_scheduler *sched = client->scheduler;
+	if (!sched)
+		return;
+
+	mutex_lock(&sched->mutex);
+	sched->active--;
+	if (sched->waiting)
+		cond_broadcast(&sched->cond);
+	mutex_unlock(&sched->mutex);
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_new(idevice_t device, lockdownd_service_descriptor_t service, service_client_t *client)
 {
 	if (!device || !service || service->port == 0 || !client || *client)
@@ -70,10 +349,14 @@ LIBIMOBILEDEVICE_API service_error_t service_client_new(idevice_t device, lockdo
 	/* create client object */
 	service_client_t client_loc = (service_client_t)malloc(sizeof(struct service_client_private));
 	client_loc->connection = connection;
+	service_sched_attach(device, service->port, client_loc);
 
-	/* enable SSL if requested */
-	if (service->ssl_enabled == 1)
+	/* enable SSL if requested, such services stay encrypted so the kernel
+	   may take over the records */
+	if (service->ssl_enabled == 1) {
+		idevice_connection_allow_ktls(connection);
 		service_enable_ssl(client_loc);
+	}
 
 	/* all done, return success */
 	*client = client_loc;
@@ -84,18 +367,34 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 {
 	*client = NULL;
 
-	lockdownd_client_t lckd = NULL;
-	if (LOCKDOWN_E_SUCCESS != lockdownd_client_new_with_handshake(device, &lckd, label)) {
-		debug_info("Could not create a lockdown client.");
-		return SERVICE_E_START_SERVICE_ERROR;
-	}
+	uint64_t trace_start = trace_begin();
 
+	lockdownd_client_t lckd = NULL;
 	lockdownd_service_descriptor_t service = NULL;
-	lockdownd_start_service(lckd, service_name, &service);
-	lockdownd_client_free(lckd);
+	int attempt;
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (LOCKDOWN_E_SUCCESS != lockdownd_client_acquire(device, &lckd, label)) {
+			debug_info("Could not create a lockdown client.");
+			return SERVICE_E_START_SERVICE_ERROR;
+		}
+
+		lockdownd_error_t lerr = lockdownd_start_service(lckd, service_name, &service);
+		if (lerr == LOCKDOWN_E_MUX_ERROR || lerr == LOCKDOWN_E_SSL_ERROR || lerr == LOCKDOWN_E_RECEIVE_TIMEOUT
+		    || lerr == LOCKDOWN_E_PLIST_ERROR || lerr == LOCKDOWN_E_SESSION_INACTIVE || lerr == LOCKDOWN_E_INVALID_SESSION_ID) {
+			/* the session is not usable anymore, retry with a new one */
+			debug_info("lockdownd session went stale (%d)", lerr);
+			lockdownd_client_invalidate(lckd);
+			lockdownd_client_release(lckd);
+			lckd = NULL;
+			continue;
+		}
+		lockdownd_client_release(lckd);
+		break;
+	}
 
 	if (!service || service->port == 0) {
 		debug_info("Could not start service %s!", service_name);
+		trace_end("service", service_name, trace_start);
 		return SERVICE_E_START_SERVICE_ERROR;
 	}
 
@@ -116,15 +415,438 @@ LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service(idevic
 	lockdownd_service_descriptor_free(service);
 	service = NULL;
 
+	trace_end("service", service_name, trace_start);
+
 	return (ec == SERVICE_E_SUCCESS) ? SERVICE_E_SUCCESS : SERVICE_E_START_SERVICE_ERROR;
 }
 
+struct service_connect_job {
+	idevice_t device;
+	lockdownd_service_descriptor_t service;
+	service_constructor_func_t constructor_func;
+	void *client;
+	int32_t error_code;
+};
+
+static void* service_connect_job_run(void *data)
+{
+	struct service_connect_job *job = (struct service_connect_job*)data;
+	if (job->constructor_func) {
+		job->error_code = job->constructor_func(job->device, job->service, &job->client);
+	} else {
+		job->error_code = service_client_new(job->device, job->service, (service_client_t*)&job->client);
+	}
+	return NULL;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_services(idevice_t device, const char **service_names, void **clients, const char* label, const service_constructor_func_t *constructor_funcs, int32_t *error_codes)
+{
+	if (!device || !service_names || !clients)
+		return SERVICE_E_INVALID_ARG;
+
+	uint32_t count = 0;
+	uint32_t i;
+	while (service_names[count]) {
+		clients[count] = NULL;
+		if (error_codes) {
+			error_codes[count] = SERVICE_E_START_SERVICE_ERROR;
+		}
+		count++;
+	}
+	if (count == 0)
+		return SERVICE_E_SUCCESS;
+
+	uint64_t trace_start = trace_begin();
+
+	lockdownd_service_descriptor_t *services = (lockdownd_service_descriptor_t*)calloc(count, sizeof(lockdownd_service_descriptor_t));
+	struct service_connect_job *jobs = (struct service_connect_job*)calloc(count, sizeof(struct service_connect_job));
+	thread_future_t *futures = (thread_future_t*)calloc(count, sizeof(thread_future_t));
+	if (!services || !jobs || !futures) {
+		free(services);
+		free(jobs);
+		free(futures);
+		return SERVICE_E_UNKNOWN_ERROR;
+	}
+
+	lockdownd_client_t lckd = NULL;
+	int attempt;
+	for (attempt = 0; attempt < 2; attempt++) {
+		if (LOCKDOWN_E_SUCCESS != lockdownd_client_acquire(device, &lckd, label)) {
+			debug_info("Could not create a lockdown client.");
+			break;
+		}
+
+		lockdownd_error_t lerr = lockdownd_start_services(lckd, service_names, services);
+		if (lerr == LOCKDOWN_E_MUX_ERROR || lerr == LOCKDOWN_E_SSL_ERROR || lerr == LOCKDOWN_E_RECEIVE_TIMEOUT
+		    || lerr == LOCKDOWN_E_PLIST_ERROR || lerr == LOCKDOWN_E_SESSION_INACTIVE || lerr == LOCKDOWN_E_INVALID_SESSION_ID) {
+			/* the session is not usable anymore, retry with a new one */
+			debug_info("lockdownd session went stale (%d)", lerr);
+			lockdownd_client_invalidate(lckd);
+			lockdownd_client_release(lckd);
+			lckd = NULL;
+			continue;
+		}
+		lockdownd_client_release(lckd);
+		break;
+	}
+
+	/* connect to all services at the same time */
+	threadpool_t pool = NULL;
+	if (threadpool_new(&pool, count, THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+		pool = NULL;
+	}
+	for (i = 0; i < count; i++) {
+		if (!services[i] || services[i]->port == 0) {
+			debug_info("Could not start service %s!", service_names[i]);
+			continue;
+		}
+		jobs[i].device = device;
+		jobs[i].service = services[i];
+		jobs[i].constructor_func = (constructor_funcs) ? constructor_funcs[i] : NULL;
+		jobs[i].error_code = SERVICE_E_UNKNOWN_ERROR;
+		futures[i] = (pool) ? threadpool_submit(pool, service_connect_job_run, &jobs[i]) : NULL;
+		if (!futures[i]) {
+			service_connect_job_run(&jobs[i]);
+		}
+	}
+
+	service_error_t res = SERVICE_E_SUCCESS;
+	for (i = 0; i < count; i++) {
+		if (futures[i]) {
+			thread_future_wait(futures[i]);
+			thread_future_free(futures[i]);
+		}
+		if (!jobs[i].service) {
+			res = SERVICE_E_START_SERVICE_ERROR;
+			continue;
+		}
+		if (error_codes) {
+			error_codes[i] = jobs[i].error_code;
+		}
+		if (jobs[i].error_code != SERVICE_E_SUCCESS) {
+			debug_info("Could not connect to service %s! Port: %i, error: %i", service_names[i], services[i]->port, jobs[i].error_code);
+			res = SERVICE_E_START_SERVICE_ERROR;
+		} else {
+			clients[i] = jobs[i].client;
+		}
+		lockdownd_service_descriptor_free(services[i]);
+	}
+	if (pool) {
+		threadpool_free(pool);
+	}
+
+	free(services);
+	free(jobs);
+	free(futures);
+
+	trace_end("service", "start_services", trace_start);
+
+	return res;
+}
+
+struct service_start_job {
+	idevice_t device;
+	char *service_name;
+	char *label;
+	int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**);
+	service_client_factory_cb_t callback;
+	void *user_data;
+};
+
+/**
+ * Internally used event loop job for
+ * service_client_factory_start_service_async().
+ */
+static void service_start_job_run(void *data, int cancelled)
+{
+	struct service_start_job *job = (struct service_start_job*)data;
+	void *client = NULL;
+	int32_t ec = SERVICE_E_UNKNOWN_ERROR;
+	service_error_t res = SERVICE_E_START_SERVICE_ERROR;
+
+	if (!cancelled) {
+		res = service_client_factory_start_service(job->device, job->service_name, &client, job->label, job->constructor_func, &ec);
+	}
+	job->callback(job->device, (res == SERVICE_E_SUCCESS) ? client : NULL, res, ec, job->user_data);
+
+	free(job->service_name);
+	free(job->label);
+	free(job);
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_factory_start_service_async(idevice_event_loop_t loop, idevice_t device, const char* service_name, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), service_client_factory_cb_t callback, void *user_data)
+{
+	if (!loop || !device || !service_name || !callback)
+		return SERVICE_E_INVALID_ARG;
+
+	struct service_start_job *job = (struct service_start_job*)calloc(1, sizeof(struct service_start_job));
+	if (!job)
+		return SERVICE_E_UNKNOWN_ERROR;
+
+	job->device = device;
+	job->service_name = strdup(service_name);
+	job->label = (label) ? strdup(label) : NULL;
+	job->constructor_func = constructor_func;
+	job->callback = callback;
+	job->user_data = user_data;
+
+	if (!job->service_name || (label && !job->label) || event_loop_submit(loop, service_start_job_run, job) < 0) {
+		free(job->service_name);
+		free(job->label);
+		free(job);
+		return SERVICE_E_UNKNOWN_ERROR;
+	}
+
+	return SERVICE_E_SUCCESS;
+}
+
+/**
+ * Returns the delay before the next attempt of a reconnecting service,
+ * with "equal jitter" so that several clients of a device that came back
+ * do not retry in lockstep. Called with reconnect->mutex held.
+ */
+static uint64_t service_reconnect_backoff(service_reconnect_t reconnect)
+{
+	uint64_t delay = SERVICE_RECONNECT_BACKOFF_MIN;
+	unsigned int i;
+	for (i = 1; i < reconnect->attempts && delay < SERVICE_RECONNECT_BACKOFF_MAX; i++) {
+		delay *= 2;
+	}
+	if (delay > SERVICE_RECONNECT_BACKOFF_MAX) {
+		delay = SERVICE_RECONNECT_BACKOFF_MAX;
+	}
+	/* xorshift32 */
+	uint32_t x = reconnect->jitter_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	reconnect->jitter_state = x;
+	return (delay / 2 + x % (delay / 2 + 1)) * 1000;
+}
+
+/**
+ * Creates the device and the client of a reconnecting service, called
+ * without holding the mutex.
+ *
+ * @return 0 on success, -2 if the device is not there, -1 otherwise.
+ */
+static int service_reconnect_attempt(service_reconnect_t reconnect, const char *udid, idevice_t *device, void **client)
+{
+	int32_t error_code = 0;
+
+	if (idevice_new_with_options(device, udid, reconnect->options) != IDEVICE_E_SUCCESS) {
+		debug_info("device %s not found", (udid) ? udid : "(any)");
+		return -2;
+	}
+	service_error_t err = service_client_factory_start_service(*device, reconnect->service_name, client, reconnect->label, reconnect->constructor_func, &error_code);
+	if (err != SERVICE_E_SUCCESS || !*client) {
+		debug_info("could not start %s: %d (%d)", reconnect->service_name, err, error_code);
+		idevice_free(*device);
+		*device = NULL;
+		return -1;
+	}
+	if (reconnect->connect_cb(*device, *client, reconnect->user_data) != 0) {
+		debug_info("setting up %s failed", reconnect->service_name);
+		reconnect->disconnect_cb(*client, reconnect->user_data);
+		*client = NULL;
+		idevice_free(*device);
+		*device = NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/* called with reconnect->mutex held, unlocks it while the callback runs */
+static void service_reconnect_drop(service_reconnect_t reconnect)
+{
+	idevice_t device = reconnect->device;
+	void *client = reconnect->client;
+	reconnect->device = NULL;
+	reconnect->client = NULL;
+	if (!client) {
+		return;
+	}
+	mutex_unlock(&reconnect->mutex);
+	reconnect->disconnect_cb(client, reconnect->user_data);
+	idevice_free(device);
+	mutex_lock(&reconnect->mutex);
+}
+
+static void* service_reconnect_thread(void *data)
+{
+	service_reconnect_t reconnect = (service_reconnect_t)data;
+
+	mutex_lock(&reconnect->mutex);
+	while (!reconnect->quit) {
+		if (reconnect->lost) {
+			debug_info("%s lost its connection", reconnect->service_name);
+			service_reconnect_drop(reconnect);
+			/* the next attempt is counted as a retry */
+			reconnect->lost = 0;
+			reconnect->attempts++;
+			reconnect->next_attempt = time_monotonic_usec() + service_reconnect_backoff(reconnect);
+			continue;
+		}
+		if (reconnect->client || !reconnect->present) {
+			/* connected, or waiting for the device to come back */
+			cond_wait(&reconnect->cond, &reconnect->mutex);
+			continue;
+		}
+		uint64_t now = time_monotonic_usec();
+		if (now < reconnect->next_attempt) {
+			cond_wait_timeout(&reconnect->cond, &reconnect->mutex, (unsigned int)((reconnect->next_attempt - now + 999) / 1000));
+			continue;
+		}
+
+		char *udid = (reconnect->udid) ? strdup(reconnect->udid) : NULL;
+		unsigned int added = reconnect->added;
+		idevice_t device = NULL;
+		void *client = NULL;
+		mutex_unlock(&reconnect->mutex);
+		int res = service_reconnect_attempt(reconnect, udid, &device, &client);
+		free(udid);
+		mutex_lock(&reconnect->mutex);
+
+		if (res == 0) {
+			debug_info("%s connected", reconnect->service_name);
+			if (!reconnect->udid) {
+				/* stick to this device from now on */
+				idevice_get_udid(device, &reconnect->udid);
+			}
+			reconnect->device = device;
+			reconnect->client = client;
+			reconnect->attempts = 0;
+		} else if (res == -2 && added == reconnect->added) {
+			/* nothing to retry until the device shows up again */
+			reconnect->present = 0;
+		} else {
+			reconnect->attempts++;
+			reconnect->next_attempt = time_monotonic_usec() + service_reconnect_backoff(reconnect);
+		}
+	}
+	service_reconnect_drop(reconnect);
+	mutex_unlock(&reconnect->mutex);
+
+	return NULL;
+}
+
+static void service_reconnect_event_cb(const idevice_event_t *event, void *user_data)
+{
+	service_reconnect_t reconnect = (service_reconnect_t)user_data;
+
+	mutex_lock(&reconnect->mutex);
+	if (!reconnect->udid || !strcmp(event->udid, reconnect->udid)) {
+		if (event->event == IDEVICE_DEVICE_ADD) {
+			/* retry right away instead of waiting out the backoff */
+			reconnect->present = 1;
+			reconnect->added++;
+			reconnect->attempts = 0;
+			reconnect->next_attempt = 0;
+			cond_signal(&reconnect->cond);
+		} else if (event->event == IDEVICE_DEVICE_REMOVE && reconnect->client
+		    && (event->conn_type == reconnect->device->conn_type || reconnect->device->race)) {
+			/* if the device is still there over the other transport, the
+			   next attempt finds it, otherwise we wait for it to be added */
+			reconnect->lost = 1;
+			cond_signal(&reconnect->cond);
+		}
+	}
+	mutex_unlock(&reconnect->mutex);
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_reconnect_new(const char *udid, enum idevice_options options, const char* service_name, const char* label, int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**), service_reconnect_connect_cb_t connect_cb, service_reconnect_disconnect_cb_t disconnect_cb, void *user_data, service_reconnect_t *reconnect)
+{
+	if (!service_name || !connect_cb || !disconnect_cb || !reconnect)
+		return SERVICE_E_INVALID_ARG;
+
+	service_reconnect_t rc = (service_reconnect_t)calloc(1, sizeof(struct service_reconnect_private));
+	if (!rc)
+		return SERVICE_E_UNKNOWN_ERROR;
+
+	rc->udid = (udid) ? strdup(udid) : NULL;
+	rc->options = options;
+	rc->service_name = strdup(service_name);
+	rc->label = (label) ? strdup(label) : NULL;
+	rc->constructor_func = constructor_func;
+	rc->connect_cb = connect_cb;
+	rc->disconnect_cb = disconnect_cb;
+	rc->user_data = user_data;
+	rc->present = 1;
+	rc->jitter_state = (uint32_t)(time_monotonic_usec() ^ (uintptr_t)rc) | 1;
+	mutex_init(&rc->mutex);
+	cond_init(&rc->cond);
+
+	if (!rc->service_name || (udid && !rc->udid) || (label && !rc->label)) {
+		goto error;
+	}
+	if (idevice_events_subscribe(&rc->events, service_reconnect_event_cb, rc) != IDEVICE_E_SUCCESS) {
+		debug_info("could not subscribe to device events");
+		rc->events = NULL;
+		goto error;
+	}
+	if (thread_new(&rc->thread, service_reconnect_thread, rc) != 0) {
+		idevice_events_unsubscribe(rc->events);
+		goto error;
+	}
+
+	*reconnect = rc;
+	return SERVICE_E_SUCCESS;
+
+error:
+	cond_destroy(&rc->cond);
+	mutex_destroy(&rc->mutex);
+	free(rc->udid);
+	free(rc->service_name);
+	free(rc->label);
+	free(rc);
+	return SERVICE_E_UNKNOWN_ERROR;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_reconnect_lost(service_reconnect_t reconnect)
+{
+	if (!reconnect)
+		return SERVICE_E_INVALID_ARG;
+
+	mutex_lock(&reconnect->mutex);
+	reconnect->lost = 1;
+	cond_signal(&reconnect->cond);
+	mutex_unlock(&reconnect->mutex);
+
+	return SERVICE_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_reconnect_free(service_reconnect_t reconnect)
+{
+	if (!reconnect)
+		return SERVICE_E_INVALID_ARG;
+
+	/* waits for a running event callback */
+	idevice_events_unsubscribe(reconnect->events);
+
+	mutex_lock(&reconnect->mutex);
+	reconnect->quit = 1;
+	cond_signal(&reconnect->cond);
+	mutex_unlock(&reconnect->mutex);
+	thread_join(reconnect->thread);
+	thread_free(reconnect->thread);
+
+	cond_destroy(&reconnect->cond);
+	mutex_destroy(&reconnect->mutex);
+	free(reconnect->udid);
+	free(reconnect->service_name);
+	free(reconnect->label);
+	free(reconnect);
+
+	return SERVICE_E_SUCCESS;
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_client_free(service_client_t client)
 {
 	if (!client)
 		return SERVICE_E_INVALID_ARG;
 
 	service_error_t err = idevice_to_service_error(idevice_disconnect(client->connection));
+	service_sched_detach(client);
 
 	free(client);
 	client = NULL;
@@ -142,7 +864,111 @@ LIBIMOBILEDEVICE_API service_error_t service_send(service_client_t client, const
 	}
 
 	debug_info("sending %d bytes", size);
-	res = idevice_to_service_error(idevice_connection_send(client->connection, data, size, &bytes));
+	uint64_t start = time_monotonic_usec();
+	do {
+		uint32_t len = service_sched_acquire(client, size - bytes);
+		uint32_t done = 0;
+		res = idevice_to_service_error(idevice_connection_send(client->connection, data + bytes, len, &done));
+		service_sched_release(client);
+		bytes += done;
+		if (done < len)
+			break;
+	} while (res == SERVICE_E_SUCCESS && bytes < size);
+	idevice_stats_record_latency(client->connection->stats.send_latency, time_monotonic_usec() - start);
+	if (res != SERVICE_E_SUCCESS) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_sendv(service_client_t client, const idevice_iovec_t *iov, uint32_t iovcnt, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || !iov || (iovcnt == 0)) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	uint64_t size = 0;
+	uint32_t i;
+	for (i = 0; i < iovcnt; i++) {
+		size += iov[i].length;
+	}
+
+	debug_info("sending %d buffers", iovcnt);
+	uint64_t start = time_monotonic_usec();
+	uint32_t len = service_sched_acquire(client, (size > UINT32_MAX) ? UINT32_MAX : (uint32_t)size);
+	if (len == size) {
+		res = idevice_to_service_error(idevice_connection_sendv(client->connection, iov, iovcnt, &bytes));
+		service_sched_release(client);
+	} else {
+		/* send the buffers one quantum at a time */
+		idevice_iovec_t part[16];
+		uint32_t cur = 0;
+		uint32_t cur_off = 0;
+		for (;;) {
+			uint32_t n = 0;
+			uint32_t total = 0;
+			while (cur < iovcnt && n < 16 && total < len) {
+				uint32_t take = iov[cur].length - cur_off;
+				if (take > len - total)
+					take = len - total;
+				part[n].data = iov[cur].data + cur_off;
+				part[n].length = take;
+				n++;
+				total += take;
+				cur_off += take;
+				if (cur_off == iov[cur].length) {
+					cur++;
+					cur_off = 0;
+				}
+			}
+			uint32_t done = 0;
+			res = idevice_to_service_error(idevice_connection_sendv(client->connection, part, n, &done));
+			service_sched_release(client);
+			bytes += done;
+			if (res != SERVICE_E_SUCCESS || done < total || bytes == size)
+				break;
+			len = service_sched_acquire(client, (size - bytes > UINT32_MAX) ? UINT32_MAX : (uint32_t)(size - bytes));
+		}
+	}
+	idevice_stats_record_latency(client->connection->stats.send_latency, time_monotonic_usec() - start);
+	if (res != SERVICE_E_SUCCESS) {
+		debug_info("ERROR: sending to device failed.");
+	}
+	if (sent) {
+		*sent = bytes;
+	}
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_send_file(service_client_t client, int fd, uint64_t offset, uint32_t length, uint32_t *sent)
+{
+	service_error_t res = SERVICE_E_UNKNOWN_ERROR;
+	uint32_t bytes = 0;
+
+	if (!client || (client && !client->connection) || fd < 0) {
+		return SERVICE_E_INVALID_ARG;
+	}
+
+	debug_info("sending %d bytes from file", length);
+	uint64_t start = time_monotonic_usec();
+	do {
+		uint32_t len = service_sched_acquire(client, length - bytes);
+		uint32_t done = 0;
+		res = idevice_to_service_error(idevice_connection_send_file(client->connection, fd, offset + bytes, len, &done));
+		service_sched_release(client);
+		bytes += done;
+		if (done < len)
+			break;
+	} while (res == SERVICE_E_SUCCESS && bytes < length);
+	idevice_stats_record_latency(client->connection->stats.send_latency, time_monotonic_usec() - start);
 	if (res != SERVICE_E_SUCCESS) {
 		debug_info("ERROR: sending to device failed.");
 	}
@@ -162,7 +988,12 @@ LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client
 		return SERVICE_E_INVALID_ARG;
 	}
 
+	uint64_t start = time_monotonic_usec();
 	res = idevice_to_service_error(idevice_connection_receive_timeout(client->connection, data, size, &bytes, timeout));
+	if (res == SERVICE_E_SUCCESS) {
+		/* timeouts just measure idle time, leave them out */
+		idevice_stats_record_latency(client->connection->stats.receive_latency, time_monotonic_usec() - start);
+	}
 	if (res != SERVICE_E_SUCCESS && res != SERVICE_E_TIMEOUT) {
 		debug_info("could not read data");
 		return res;
@@ -174,6 +1005,23 @@ LIBIMOBILEDEVICE_API service_error_t service_receive_with_timeout(service_client
 	return res;
 }
 
+/**
+ * Waits until data can be received on the given service client.
+ *
+ * @param client The service client to wait on.
+ * @param timeout Maximum time in milliseconds to wait.
+ *
+ * @return SERVICE_E_SUCCESS when data is available, SERVICE_E_TIMEOUT when
+ *     the timeout expired, SERVICE_E_INVALID_ARG when client is invalid, or
+ *     SERVICE_E_UNKNOWN_ERROR on error.
+ */
+service_error_t service_wait_readable(service_client_t client, unsigned int timeout)
+{
+	if (!client || !client->connection)
+		return SERVICE_E_INVALID_ARG;
+	return idevice_to_service_error(idevice_connection_wait_readable(client->connection, timeout));
+}
+
 LIBIMOBILEDEVICE_API service_error_t service_receive(service_client_t client, char* data, uint32_t size, uint32_t *received)
 {
 	return service_receive_with_timeout(client, data, size, received, 30000);
@@ -198,3 +1046,74 @@ LIBIMOBILEDEVICE_API service_error_t service_disable_bypass_ssl(service_client_t
 	return idevice_to_service_error(idevice_connection_disable_bypass_ssl(client->connection, sslBypass));
 }
 
+
+LIBIMOBILEDEVICE_API service_error_t service_set_priority(idevice_t device, const char *service_name, uint32_t weight, uint64_t rate_limit)
+{
+	if (!device || !service_name)
+		return SERVICE_E_INVALID_ARG;
+
+	struct service_scheduler *sched = service_scheduler_get(device);
+	if (!sched)
+		return SERVICE_E_UNKNOWN_ERROR;
+
+	service_error_t res = SERVICE_E_SUCCESS;
+	mutex_lock(&sched->mutex);
+	struct service_sched_override **p = &sched->overrides;
+	while (*p && strcmp((*p)->service_name, service_name) != 0)
+		p = &(*p)->next;
+	if (weight == 0) {
+		if (*p) {
+			struct service_sched_override *ovr = *p;
+			*p = ovr->next;
+			free(ovr->service_name);
+			free(ovr);
+		}
+	} else {
+		if (!*p) {
+			struct service_sched_override *ovr = (struct service_sched_override*)calloc(1, sizeof(struct service_sched_override));
+			if (ovr)
+				ovr->service_name = strdup(service_name);
+			if (!ovr || !ovr->service_name) {
+				free(ovr);
+				res = SERVICE_E_UNKNOWN_ERROR;
+			} else {
+				*p = ovr;
+			}
+		}
+		if (*p) {
+			(*p)->weight = weight;
+			(*p)->rate_limit = rate_limit;
+		}
+	}
+	mutex_unlock(&sched->mutex);
+
+	service_scheduler_release(sched);
+
+	return res;
+}
+
+LIBIMOBILEDEVICE_API service_error_t service_client_set_priority(service_client_t client, uint32_t weight, uint64_t rate_limit)
+{
+	if (!client || weight == 0)
+		return SERVICE_E_INVALID_ARG;
+
+	struct service_scheduler *sched = client->scheduler;
+	if (!sched) {
+		/* not scheduled, sends go out unthrottled anyway */
+		client->flow.weight = weight;
+		client->flow.rate_limit = rate_limit;
+		return SERVICE_E_SUCCESS;
+	}
+
+	mutex_lock(&sched->mutex);
+	client->flow.weight = weight;
+	if (client->flow.rate_limit != rate_limit) {
+		client->flow.rate_limit = rate_limit;
+		client->flow.tokens = 0;
+		client->flow.refilled = time_monotonic_usec();
+	}
+	cond_broadcast(&sched->cond);
+	mutex_unlock(&sched->mutex);
+
+	return SERVICE_E_SUCCESS;
+}
@@ -24,9 +24,100 @@
 #include "libimobiledevice/service.h"
 #include "libimobiledevice/lockdown.h"
 #include "idevice.h"
+#include "common/thread.h"
+
+/* sends are split into quanta of this size while several connections of a
+   device compete for the link */
+#define SERVICE_SCHED_QUANTUM 65536
+/* longest a send waits for its turn in milliseconds, so a send blocked by a
+   stalled service cannot hold up the others */
+#define SERVICE_SCHED_MAX_WAIT 100
+/* weights are scaled so small sends still advance the virtual time */
+#define SERVICE_SCHED_SCALE 65536
+/* remembered ports of started services, see service_scheduler_hint() */
+#define SERVICE_SCHED_HINTS 16
+
+struct service_sched_ticket {
+	uint64_t finish;
+	struct service_sched_ticket *next;
+};
+
+struct service_sched_override {
+	char *service_name;
+	uint32_t weight;
+	uint64_t rate_limit;
+	struct service_sched_override *next;
+};
+
+struct service_sched_hint {
+	uint16_t port;
+	uint32_t weight;
+	uint64_t rate_limit;
+};
+
+/* per device, shared by all service connections of the device */
+struct service_scheduler {
+	mutex_t mutex;
+	cond_t cond;
+	/* all of the following are protected by mutex */
+	unsigned int refs;
+	unsigned int flows;
+	unsigned int active;
+	uint64_t vtime;
+	/* sorted by finish tag */
+	struct service_sched_ticket *waiting;
+	struct service_sched_override *overrides;
+	struct service_sched_hint hints[SERVICE_SCHED_HINTS];
+	unsigned int next_hint;
+};
+
+/* protected by the mutex of the scheduler */
+struct service_sched_flow {
+	uint32_t weight;
+	uint64_t rate_limit;
+	uint64_t finish;
+	uint64_t tokens;
+	uint64_t refilled;
+};
 
 struct service_client_private {
 	idevice_connection_t connection;
+	struct service_scheduler *scheduler;
+	struct service_sched_flow flow;
 };
 
+/* delay before retrying a reconnecting service, doubled per failed attempt */
+#define SERVICE_RECONNECT_BACKOFF_MIN 250
+#define SERVICE_RECONNECT_BACKOFF_MAX 30000
+
+struct service_reconnect_private {
+	char *udid;
+	enum idevice_options options;
+	char *service_name;
+	char *label;
+	int32_t (*constructor_func)(idevice_t, lockdownd_service_descriptor_t, void**);
+	service_reconnect_connect_cb_t connect_cb;
+	service_reconnect_disconnect_cb_t disconnect_cb;
+	void *user_data;
+	idevice_subscription_context_t events;
+	THREAD_T thread;
+	mutex_t mutex;
+	cond_t cond;
+	/* all of the following are protected by mutex */
+	idevice_t device;
+	void *client;
+	int present;
+	/* counts IDEVICE_DEVICE_ADD events */
+	unsigned int added;
+	int lost;
+	int quit;
+	unsigned int attempts;
+	uint64_t next_attempt;
+	uint32_t jitter_state;
+};
+
+service_error_t service_wait_readable(service_client_t client, unsigned int timeout);
+void service_scheduler_hint(idevice_t device, const char *service_name, uint16_t port);
+void service_scheduler_release(struct service_scheduler *scheduler);
+
 #endif
@@ -30,13 +30,22 @@
 #include "lockdown.h"
 #include "common/debug.h"
 
+#define SYSLOG_RELAY_RECV_BUFFER_SIZE 4096
+
 struct syslog_relay_worker_thread {
 	syslog_relay_client_t client;
 	syslog_relay_receive_cb_t cbfunc;
+	syslog_relay_receive_lines_cb_t lines_cbfunc;
 	void *user_data;
 	int is_raw;
 };
 
+/* a line or chunk of received data queued for the callback thread */
+struct syslog_relay_entry {
+	uint32_t length;
+	char data[];
+};
+
 /**
  * Convert a service_error_t value to a syslog_relay_error_t value.
  * Used internally to get correct error codes.
@@ -87,7 +96,13 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_new(idevice_t devi
 
 	syslog_relay_client_t client_loc = (syslog_relay_client_t) malloc(sizeof(struct syslog_relay_client_private));
 	client_loc->parent = parent;
-	client_loc->worker = THREAD_T_NULL;
+	client_loc->worker = NULL;
+	client_loc->recv_buffer = NULL;
+	client_loc->loop = NULL;
+	client_loc->loop_cbfunc = NULL;
+	client_loc->loop_user_data = NULL;
+	memset(&client_loc->loop_line, 0, sizeof(struct syslog_relay_line_buffer));
+	client_loc->delivery = NULL;
 
 	*client = client_loc;
 
@@ -108,6 +123,9 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_client_free(syslog_relay_
 		return SYSLOG_RELAY_E_INVALID_ARG;
 	syslog_relay_stop_capture(client);
 	syslog_relay_error_t err = syslog_relay_error(service_client_free(client->parent));
+	free(client->recv_buffer);
+	free(client->loop_line.data);
+	delivery_queue_free(client->delivery);
 	free(client);
 
 	return err;
@@ -138,112 +156,299 @@ LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_receive_with_timeout(sysl
 	return res;
 }
 
+/**
+ * Splits received data at the NUL bytes terminating each log message and
+ * invokes the callback for every complete line. Incomplete data is kept in
+ * the line buffer until the rest arrives.
+ *
+ * @return 0 on success or -1 if memory could not be allocated.
+ */
+static int syslog_relay_feed_lines(struct syslog_relay_line_buffer *lb, const char *data, uint32_t bytes, syslog_relay_receive_lines_cb_t callback, void *user_data)
+{
+	const char *p = data;
+	const char *end = p + bytes;
+	while (p < end) {
+		const char *nul = memchr(p, '\0', end - p);
+		uint32_t chunk = (nul) ? (uint32_t)(nul - p) : (uint32_t)(end - p);
+		if (lb->len + chunk + 1 > lb->size) {
+			uint32_t new_size = (lb->size) ? lb->size : 1024;
+			while (new_size < lb->len + chunk + 1) {
+				new_size <<= 1;
+			}
+			char *new_line = (char*)realloc(lb->data, new_size);
+			if (!new_line) {
+				debug_info("Out of memory");
+				return -1;
+			}
+			lb->data = new_line;
+			lb->size = new_size;
+		}
+		memcpy(lb->data + lb->len, p, chunk);
+		lb->len += chunk;
+		if (!nul) {
+			break;
+		}
+		lb->data[lb->len] = '\0';
+		callback(lb->data, lb->len, user_data);
+		lb->len = 0;
+		p = nul + 1;
+	}
+	return 0;
+}
+
+static void syslog_relay_deliver_chars(struct syslog_relay_worker_thread *srwt, const char *data, uint32_t bytes)
+{
+	uint32_t i;
+	for (i = 0; i < bytes; i++) {
+		if (srwt->is_raw || data[i] != 0) {
+			srwt->cbfunc(data[i], srwt->user_data);
+		}
+	}
+}
+
+static void syslog_relay_queue_data(const char *data, uint32_t length, void *user_data)
+{
+	delivery_queue_t queue = (delivery_queue_t)user_data;
+	struct syslog_relay_entry *entry = (struct syslog_relay_entry*)malloc(sizeof(struct syslog_relay_entry) + length + 1);
+	if (!entry) {
+		debug_info("Out of memory, dropping %u bytes", length);
+		return;
+	}
+	entry->length = length;
+	memcpy(entry->data, data, length);
+	entry->data[length] = '\0';
+	delivery_queue_push(queue, entry);
+}
+
+/* invoked on the callback thread for every queued entry */
+static void syslog_relay_deliver(void *entry, void *user_data)
+{
+	struct syslog_relay_entry *e = (struct syslog_relay_entry*)entry;
+	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)user_data;
+
+	if (srwt->lines_cbfunc) {
+		srwt->lines_cbfunc(e->data, e->length, srwt->user_data);
+	} else {
+		syslog_relay_deliver_chars(srwt, e->data, e->length);
+	}
+}
+
 void *syslog_relay_worker(void *arg)
 {
 	syslog_relay_error_t ret = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)arg;
+	struct syslog_relay_line_buffer lb = { NULL, 0, 0 };
 
 	if (!srwt)
 		return NULL;
 
 	debug_info("Running");
 
+	delivery_queue_t queue = srwt->client->delivery;
+
 	while (srwt->client->parent) {
-		char c;
 		uint32_t bytes = 0;
-		ret = syslog_relay_receive_with_timeout(srwt->client, &c, 1, &bytes, 100);
-		if (ret == SYSLOG_RELAY_E_TIMEOUT || ret == SYSLOG_RELAY_E_NOT_ENOUGH_DATA || ((bytes == 0) && (ret == SYSLOG_RELAY_E_SUCCESS))) {
-			continue;
-		} else if (ret < 0) {
+		ret = syslog_relay_receive_with_timeout(srwt->client, srwt->client->recv_buffer, SYSLOG_RELAY_RECV_BUFFER_SIZE, &bytes, 100);
+		if (ret != SYSLOG_RELAY_E_SUCCESS && ret != SYSLOG_RELAY_E_TIMEOUT && ret != SYSLOG_RELAY_E_NOT_ENOUGH_DATA) {
 			debug_info("Connection to syslog relay interrupted");
 			break;
 		}
-		if (srwt->is_raw) {
-			srwt->cbfunc(c, srwt->user_data);
-		} else {
-			if (c != 0) {
-				srwt->cbfunc(c, srwt->user_data);
+		if (bytes == 0) {
+			continue;
+		}
+		if (srwt->lines_cbfunc) {
+			if (queue) {
+				if (syslog_relay_feed_lines(&lb, srwt->client->recv_buffer, bytes, syslog_relay_queue_data, queue) < 0) {
+					break;
+				}
+			} else if (syslog_relay_feed_lines(&lb, srwt->client->recv_buffer, bytes, srwt->lines_cbfunc, srwt->user_data) < 0) {
+				break;
 			}
+		} else if (queue) {
+			syslog_relay_queue_data(srwt->client->recv_buffer, bytes, queue);
+		} else {
+			syslog_relay_deliver_chars(srwt, srwt->client->recv_buffer, bytes);
 		}
 	}
 
-	if (srwt) {
-		free(srwt);
-	}
+	/* the callback thread uses srwt until everything queued is delivered */
+	delivery_queue_stop(queue);
+	free(lb.data);
+	free(srwt);
 
 	debug_info("Exiting");
 
 	return NULL;
 }
 
-LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+/**
+ * Internally used function to start the syslog capture worker thread.
+ */
+static syslog_relay_error_t syslog_relay_start_worker(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, syslog_relay_receive_lines_cb_t lines_callback, int is_raw, void* user_data)
 {
-	if (!client || !callback)
-		return SYSLOG_RELAY_E_INVALID_ARG;
-
 	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
 
-	if (client->worker) {
+	if (client->worker || client->loop) {
 		debug_info("Another syslog capture thread appears to be running already.");
 		return res;
 	}
 
+	if (!client->recv_buffer) {
+		client->recv_buffer = (char*)malloc(SYSLOG_RELAY_RECV_BUFFER_SIZE);
+		if (!client->recv_buffer) {
+			return res;
+		}
+	}
+
 	/* start worker thread */
 	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
 	if (srwt) {
 		srwt->client = client;
 		srwt->cbfunc = callback;
+		srwt->lines_cbfunc = lines_callback;
 		srwt->user_data = user_data;
-		srwt->is_raw = 0;
+		srwt->is_raw = is_raw;
 
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
+		if (client->delivery && delivery_queue_start(client->delivery, syslog_relay_deliver, srwt) < 0) {
+			debug_info("Could not start the callback thread");
+			free(srwt);
+			return res;
+		}
+
+		client->worker = threadpool_submit(threadpool_shared(), syslog_relay_worker, srwt);
+		if (client->worker) {
 			res = SYSLOG_RELAY_E_SUCCESS;
+		} else {
+			delivery_queue_stop(client->delivery);
+			free(srwt);
 		}
 	}
 
 	return res;
 }
 
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_worker(client, callback, NULL, 0, user_data);
+}
+
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_raw(syslog_relay_client_t client, syslog_relay_receive_cb_t callback, void* user_data)
 {
 	if (!client || !callback)
 		return SYSLOG_RELAY_E_INVALID_ARG;
 
-	syslog_relay_error_t res = SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	return syslog_relay_start_worker(client, callback, NULL, 1, user_data);
+}
 
-	if (client->worker) {
-		debug_info("Another syslog capture thread appears to be running already.");
-		return res;
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines(syslog_relay_client_t client, syslog_relay_receive_lines_cb_t callback, void* user_data)
+{
+	if (!client || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	return syslog_relay_start_worker(client, NULL, callback, 0, user_data);
+}
+
+static int syslog_relay_loop_cb(idevice_connection_t connection, void *user_data)
+{
+	syslog_relay_client_t client = (syslog_relay_client_t)user_data;
+	uint32_t bytes = 0;
+
+	syslog_relay_error_t ret = syslog_relay_receive_with_timeout(client, client->recv_buffer, SYSLOG_RELAY_RECV_BUFFER_SIZE, &bytes, 1);
+	if (ret != SYSLOG_RELAY_E_SUCCESS && ret != SYSLOG_RELAY_E_TIMEOUT && ret != SYSLOG_RELAY_E_NOT_ENOUGH_DATA) {
+		debug_info("Connection to syslog relay interrupted");
+		goto interrupted;
 	}
+	if (bytes > 0 && syslog_relay_feed_lines(&client->loop_line, client->recv_buffer, bytes, client->loop_cbfunc, client->loop_user_data) < 0) {
+		goto interrupted;
+	}
+	return 0;
 
-	/* start worker thread */
-	struct syslog_relay_worker_thread *srwt = (struct syslog_relay_worker_thread*)malloc(sizeof(struct syslog_relay_worker_thread));
-	if (srwt) {
-		srwt->client = client;
-		srwt->cbfunc = callback;
-		srwt->user_data = user_data;
-		srwt->is_raw = 1;
+interrupted:
+	client->loop_cbfunc(NULL, 0, client->loop_user_data);
+	/* the client is removed from the loop */
+	client->loop = NULL;
+	return 1;
+}
 
-		if (thread_new(&client->worker, syslog_relay_worker, srwt) == 0) {
-			res = SYSLOG_RELAY_E_SUCCESS;
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_start_capture_lines_with_loop(syslog_relay_client_t client, idevice_event_loop_t loop, syslog_relay_receive_lines_cb_t callback, void* user_data)
+{
+	if (!client || !client->parent || !loop || !callback)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (client->worker || client->loop) {
+		debug_info("Another syslog capture appears to be running already.");
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	if (!client->recv_buffer) {
+		client->recv_buffer = (char*)malloc(SYSLOG_RELAY_RECV_BUFFER_SIZE);
+		if (!client->recv_buffer) {
+			return SYSLOG_RELAY_E_UNKNOWN_ERROR;
 		}
 	}
 
-	return res;
+	client->loop_cbfunc = callback;
+	client->loop_user_data = user_data;
+	client->loop_line.len = 0;
+	client->loop = loop;
+	if (idevice_event_loop_add(loop, client->parent->connection, syslog_relay_loop_cb, client) != IDEVICE_E_SUCCESS) {
+		client->loop = NULL;
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	return SYSLOG_RELAY_E_SUCCESS;
 }
 
 LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_stop_capture(syslog_relay_client_t client)
 {
+	if (client->loop) {
+		idevice_event_loop_remove(client->loop, client->parent->connection);
+		client->loop = NULL;
+	}
 	if (client->worker) {
 		/* notify thread to finish */
 		service_client_t parent = client->parent;
 		client->parent = NULL;
-		/* join thread to make it exit */
-		thread_join(client->worker);
-		thread_free(client->worker);
-		client->worker = THREAD_T_NULL;
+		/* wait for the worker to exit */
+		thread_future_wait(client->worker);
+		thread_future_free(client->worker);
+		client->worker = NULL;
 		client->parent = parent;
 	}
 
 	return SYSLOG_RELAY_E_SUCCESS;
 }
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_set_delivery(syslog_relay_client_t client, uint32_t capacity, enum idevice_delivery_policy policy)
+{
+	delivery_queue_t queue = NULL;
+
+	if (!client || (policy != IDEVICE_DELIVERY_DROP_OLDEST && policy != IDEVICE_DELIVERY_BLOCK))
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	if (client->worker || client->loop) {
+		debug_info("Cannot change the delivery while a syslog capture is running.");
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+
+	if (capacity > 0 && delivery_queue_new(&queue, capacity, policy, free) < 0) {
+		return SYSLOG_RELAY_E_UNKNOWN_ERROR;
+	}
+	delivery_queue_free(client->delivery);
+	client->delivery = queue;
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API syslog_relay_error_t syslog_relay_get_dropped(syslog_relay_client_t client, uint64_t *dropped)
+{
+	if (!client || !dropped)
+		return SYSLOG_RELAY_E_INVALID_ARG;
+
+	*dropped = delivery_queue_get_dropped(client->delivery);
+
+	return SYSLOG_RELAY_E_SUCCESS;
+}
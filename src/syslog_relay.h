@@ -24,11 +24,27 @@
 
 #include "libimobiledevice/syslog_relay.h"
 #include "service.h"
+#include "delivery.h"
 #include "common/thread.h"
 
+/* collects the bytes of a log line until its terminating NUL arrives */
+struct syslog_relay_line_buffer {
+	char *data;
+	uint32_t size;
+	uint32_t len;
+};
+
 struct syslog_relay_client_private {
 	service_client_t parent;
-	THREAD_T worker;
+	thread_future_t worker;
+	char *recv_buffer;
+	/* set while lines are captured on an event loop */
+	idevice_event_loop_t loop;
+	syslog_relay_receive_lines_cb_t loop_cbfunc;
+	void *loop_user_data;
+	struct syslog_relay_line_buffer loop_line;
+	/* set with syslog_relay_set_delivery() to call back on another thread */
+	delivery_queue_t delivery;
 };
 
 void *syslog_relay_worker(void *arg);
@@ -0,0 +1,252 @@
+/*
+ * trace.c
+ * Tracing of hot paths into per-thread buffers
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#ifdef WIN32
+#include <windows.h>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+#include "trace.h"
+#include "common/thread.h"
+
+#define TRACE_BLOCK_EVENTS 4096
+/* at most this many blocks are kept per thread, later spans are dropped */
+#define TRACE_MAX_BLOCKS 256
+#define TRACE_NAME_LEN 48
+
+#if defined(_MSC_VER)
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL __thread
+#endif
+
+#if defined(__GNUC__)
+#define trace_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define trace_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#else
+#define trace_store_release(p, v) do { MemoryBarrier(); *(p) = (v); } while (0)
+#define trace_load_acquire(p) trace_load_acquire_real(p)
+static uint32_t trace_load_acquire_real(volatile uint32_t *p)
+{
+	uint32_t v = *p;
+	MemoryBarrier();
+	return v;
+}
+#endif
+
+struct trace_event {
+	uint64_t start;
+	uint64_t duration;
+	const char *category;
+	char name[TRACE_NAME_LEN];
+};
+
+struct trace_block {
+	struct trace_block *next;
+	/* only written by the owning thread, published with release semantics */
+	volatile uint32_t count;
+	struct trace_event events[TRACE_BLOCK_EVENTS];
+};
+
+struct trace_buffer {
+	struct trace_buffer *next;
+	uint32_t tid;
+	uint32_t num_blocks;
+	uint64_t dropped;
+	struct trace_block *first;
+	struct trace_block *current;
+};
+
+int internal_trace_enabled = 0;
+
+static char *trace_path = NULL;
+static uint64_t trace_start = 0;
+static mutex_t trace_mutex;
+static struct trace_buffer *trace_buffers = NULL;
+static uint32_t trace_next_tid = 0;
+static TRACE_THREAD_LOCAL struct trace_buffer *trace_thread_buffer = NULL;
+
+void trace_init(void)
+{
+	const char *path = getenv(TRACE_ENV);
+
+	mutex_init(&trace_mutex);
+	if (!path || !*path) {
+		return;
+	}
+	trace_path = strdup(path);
+	trace_start = time_monotonic_usec();
+	internal_trace_enabled = (trace_path != NULL);
+}
+
+/**
+ * Returns the trace buffer of the calling thread. Registering a new thread
+ * takes a lock, recording into the buffer later on does not.
+ */
+static struct trace_buffer *trace_get_buffer(void)
+{
+	struct trace_buffer *buf = trace_thread_buffer;
+	if (buf) {
+		return buf;
+	}
+	buf = (struct trace_buffer*)calloc(1, sizeof(struct trace_buffer));
+	if (!buf) {
+		return NULL;
+	}
+	buf->first = (struct trace_block*)calloc(1, sizeof(struct trace_block));
+	if (!buf->first) {
+		free(buf);
+		return NULL;
+	}
+	buf->current = buf->first;
+	buf->num_blocks = 1;
+	mutex_lock(&trace_mutex);
+	buf->tid = ++trace_next_tid;
+	buf->next = trace_buffers;
+	trace_buffers = buf;
+	mutex_unlock(&trace_mutex);
+	trace_thread_buffer = buf;
+	return buf;
+}
+
+void trace_span_real(const char *category, const char *name, uint64_t start, uint64_t end)
+{
+	if (!internal_trace_enabled) {
+		return;
+	}
+	struct trace_buffer *buf = trace_get_buffer();
+	if (!buf) {
+		return;
+	}
+	struct trace_block *block = buf->current;
+	uint32_t count = block->count;
+	if (count == TRACE_BLOCK_EVENTS) {
+		if (buf->num_blocks >= TRACE_MAX_BLOCKS) {
+			buf->dropped++;
+			return;
+		}
+		struct trace_block *next = (struct trace_block*)calloc(1, sizeof(struct trace_block));
+		if (!next) {
+			buf->dropped++;
+			return;
+		}
+		block->next = next;
+		buf->current = next;
+		buf->num_blocks++;
+		block = next;
+		count = 0;
+	}
+	struct trace_event *ev = &block->events[count];
+	ev->start = start;
+	ev->duration = (end > start) ? end - start : 0;
+	ev->category = category;
+	if (name) {
+		strncpy(ev->name, name, TRACE_NAME_LEN-1);
+		ev->name[TRACE_NAME_LEN-1] = '\0';
+	} else {
+		ev->name[0] = '\0';
+	}
+	trace_store_release(&block->count, count + 1);
+}
+
+static void trace_write_string(FILE *f, const char *s)
+{
+	fputc('"', f);
+	for (; *s; s++) {
+		unsigned char c = (unsigned char)*s;
+		if (c == '"' || c == '\\') {
+			fputc('\\', f);
+			fputc(c, f);
+		} else if (c < 0x20) {
+			fprintf(f, "\\u%04x", c);
+		} else {
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+/**
+ * Writes all recorded spans as Chrome trace JSON.
+ */
+static void trace_flush(void)
+{
+	struct trace_buffer *buf;
+	int first = 1;
+	int pid = (int)getpid();
+
+	FILE *f = fopen(trace_path, "w");
+	if (!f) {
+		fprintf(stderr, "[trace] Could not create %s\n", trace_path);
+		return;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	mutex_lock(&trace_mutex);
+	for (buf = trace_buffers; buf; buf = buf->next) {
+		struct trace_block *block;
+		for (block = buf->first; block; block = block->next) {
+			uint32_t count = trace_load_acquire(&block->count);
+			uint32_t i;
+			for (i = 0; i < count; i++) {
+				struct trace_event *ev = &block->events[i];
+				fprintf(f, "%s\n{\"ph\":\"X\",\"pid\":%d,\"tid\":%u,\"ts\":%" PRIu64 ",\"dur\":%" PRIu64 ",\"cat\":", (first) ? "" : ",", pid, buf->tid, ev->start - trace_start, ev->duration);
+				trace_write_string(f, ev->category);
+				fprintf(f, ",\"name\":");
+				trace_write_string(f, ev->name);
+				fputc('}', f);
+				first = 0;
+			}
+			if (count < TRACE_BLOCK_EVENTS) {
+				break;
+			}
+		}
+		if (buf->dropped > 0) {
+			fprintf(stderr, "[trace] Dropped %" PRIu64 " spans of thread %u\n", buf->dropped, buf->tid);
+		}
+	}
+	mutex_unlock(&trace_mutex);
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+void trace_deinit(void)
+{
+	if (internal_trace_enabled) {
+		internal_trace_enabled = 0;
+		trace_flush();
+	}
+	/* other threads might still be about to record, so their buffers are
+	   left to be released with the process */
+	free(trace_path);
+	trace_path = NULL;
+	mutex_destroy(&trace_mutex);
+}
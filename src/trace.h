@@ -0,0 +1,65 @@
+/*
+ * trace.h
+ * Definitions for tracing of hot paths
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef __TRACE_H
+#define __TRACE_H
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+#include <stdint.h>
+
+#include "common/utils.h"
+
+/* file to write a Chrome trace (chrome://tracing, Perfetto) to */
+#define TRACE_ENV "IMOBILEDEVICE_TRACE"
+
+/* checked at the call site so nothing is evaluated when tracing is off */
+extern int internal_trace_enabled;
+
+#if defined(__GNUC__) && __GNUC__ >= 3
+#define trace_enabled() __builtin_expect(internal_trace_enabled, 0)
+#else
+#define trace_enabled() (internal_trace_enabled)
+#endif
+
+/* start of a span, 0 if tracing is off */
+#define trace_begin() (trace_enabled() ? time_monotonic_usec() : 0)
+/* records the span started by trace_begin(), name is copied */
+#define trace_end(category, name, start) do { if (start) trace_span_real(category, name, start, time_monotonic_usec()); } while (0)
+
+void trace_init(void);
+void trace_deinit(void);
+void trace_span_real(const char *category, const char *name, uint64_t start, uint64_t end);
+
+/* USDT probes for bpftrace, perf and DTrace, a nop until a tracer attaches */
+#ifdef HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#define TRACE_PROBE1(name, a) DTRACE_PROBE1(libimobiledevice, name, a)
+#define TRACE_PROBE2(name, a, b) DTRACE_PROBE2(libimobiledevice, name, a, b)
+#define TRACE_PROBE3(name, a, b, c) DTRACE_PROBE3(libimobiledevice, name, a, b, c)
+#else
+#define TRACE_PROBE1(name, a)
+#define TRACE_PROBE2(name, a, b)
+#define TRACE_PROBE3(name, a, b, c)
+#endif
+
+#endif
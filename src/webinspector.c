@@ -28,6 +28,7 @@
 
 #include "webinspector.h"
 #include "lockdown.h"
+#include "idevice.h"
 #include "common/debug.h"
 
 /**
@@ -80,7 +81,7 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_new(idevice_t devi
 		return ret;
 	}
 
-	webinspector_client_t client_loc = (webinspector_client_t) malloc(sizeof(struct webinspector_client_private));
+	webinspector_client_t client_loc = (webinspector_client_t) calloc(1, sizeof(struct webinspector_client_private));
 	client_loc->parent = plclient;
 
 	*client = client_loc;
@@ -101,7 +102,10 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_client_free(webinspector_
 	if (!client)
 		return WEBINSPECTOR_E_INVALID_ARG;
 
+	webinspector_stop_pump(client);
+
 	webinspector_error_t err = webinspector_error(property_list_service_client_free(client->parent));
+	free(client->packet);
 	free(client);
 
 	return err;
@@ -169,95 +173,177 @@ LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive(webinspector_clie
 	return webinspector_receive_with_timeout(client, plist, 5000);
 }
 
-LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms)
+/**
+ * Releases the reassembly buffer if a large message made it grow beyond
+ * WEBINSPECTOR_PACKET_BUFFER_KEEP_SIZE, otherwise keeps it for the next one.
+ */
+static void webinspector_packet_reset(webinspector_client_t client)
 {
-	webinspector_error_t res = WEBINSPECTOR_E_UNKNOWN_ERROR;
-	plist_t message = NULL;
-	plist_t key = NULL;
+	client->packet_length = 0;
+	if (client->packet_capacity > WEBINSPECTOR_PACKET_BUFFER_KEEP_SIZE) {
+		free(client->packet);
+		client->packet = NULL;
+		client->packet_capacity = 0;
+	}
+}
 
+/**
+ * Receives a single partial or final message and appends its payload to the
+ * reassembly buffer of the client.
+ *
+ * @param client The webinspector client
+ * @param timeout_ms Maximum time in milliseconds to wait for data
+ * @param plist Set to the reassembled plist if the message was the final
+ *     one, NULL otherwise.
+ *
+ * @return WEBINSPECTOR_E_SUCCESS on success, or an error code. The partial
+ *     data received so far is discarded on error.
+ */
+static webinspector_error_t webinspector_receive_chunk(webinspector_client_t client, uint32_t timeout_ms, plist_t *plist)
+{
+	char *content = NULL;
+	uint32_t content_length = 0;
+	plist_t message = NULL;
 	int is_final_message = 1;
 
-	char* buffer = NULL;
-	uint64_t length = 0;
+	*plist = NULL;
 
-	char* packet = NULL;
-	char* newpacket = NULL;
-	uint64_t packet_length = 0;
-
-	debug_info("Receiving webinspector message...");
+	/* receive message */
+	webinspector_error_t res = webinspector_error(property_list_service_receive_message(client->parent, &content, &content_length, timeout_ms));
+	if (res != WEBINSPECTOR_E_SUCCESS) {
+		debug_info("Could not receive message, error %d", res);
+		webinspector_packet_reset(client);
+		return WEBINSPECTOR_E_MUX_ERROR;
+	}
+	property_list_service_message_to_plist(content, content_length, &message);
+	property_list_service_message_done(client->parent);
+	if (!message) {
+		webinspector_packet_reset(client);
+		return WEBINSPECTOR_E_MUX_ERROR;
+	}
 
-	do {
-		/* receive message */
-		res = webinspector_error(property_list_service_receive_plist_with_timeout(client->parent, &message, timeout_ms));
-		if (res != WEBINSPECTOR_E_SUCCESS || !message) {
-			debug_info("Could not receive message, error %d", res);
+	/* get message key */
+	plist_t key = plist_dict_get_item(message, "WIRFinalMessageKey");
+	if (!key) {
+		key = plist_dict_get_item(message, "WIRPartialMessageKey");
+		if (!key) {
+			debug_info("ERROR: Unable to read message key.");
 			plist_free(message);
-			return WEBINSPECTOR_E_MUX_ERROR;
+			webinspector_packet_reset(client);
+			return WEBINSPECTOR_E_PLIST_ERROR;
 		}
+		is_final_message = 0;
+	}
 
-		/* get message key */
-		key = plist_dict_get_item(message, "WIRFinalMessageKey");
-		if (!key) {
-			key = plist_dict_get_item(message, "WIRPartialMessageKey");
-			if (!key) {
-				debug_info("ERROR: Unable to read message key.");
-				plist_free(message);
-				return WEBINSPECTOR_E_PLIST_ERROR;
-			}
-			is_final_message = 0;
-		} else {
-			is_final_message = 1;
+	/* append partial data to the packet without copying it out of the plist first */
+	uint64_t length = 0;
+	const char *buffer = (plist_get_node_type(key) == PLIST_DATA) ? plist_get_data_ptr(key, &length) : NULL;
+	if (!buffer || length == 0 || length > 0xFFFFFFFF - client->packet_length) {
+		debug_info("ERROR: Unable to get the inner plist binary data.");
+		plist_free(message);
+		webinspector_packet_reset(client);
+		return WEBINSPECTOR_E_PLIST_ERROR;
+	}
+	if (client->packet_length + length > client->packet_capacity) {
+		uint64_t newcap = (client->packet_capacity) ? client->packet_capacity : WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE;
+		while (newcap < client->packet_length + length) {
+			newcap *= 2;
 		}
-
-		/* read partial data */
-		plist_get_data_val(key, &buffer, &length);
-		if (!buffer || length == 0 || length > 0xFFFFFFFF) {
-			debug_info("ERROR: Unable to get the inner plist binary data.");
-			free(packet);
-			free(buffer);
-			return WEBINSPECTOR_E_PLIST_ERROR;
+		if (newcap > 0xFFFFFFFF) {
+			newcap = 0xFFFFFFFF;
 		}
-
-		/* (re)allocate packet data */
-		if (!packet) {
-			packet = (char*)malloc(length * sizeof(char));
-		} else {
-			newpacket = (char*)realloc(packet, (packet_length + length) * sizeof(char));
-			packet = newpacket;
+		char *newpacket = (char*)realloc(client->packet, newcap);
+		if (!newpacket) {
+			debug_info("ERROR: Out of memory");
+			plist_free(message);
+			webinspector_packet_reset(client);
+			return WEBINSPECTOR_E_UNKNOWN_ERROR;
 		}
+		client->packet = newpacket;
+		client->packet_capacity = (uint32_t)newcap;
+	}
+	memcpy(client->packet + client->packet_length, buffer, length);
+	client->packet_length += (uint32_t)length;
+	plist_free(message);
 
-		/* copy partial data into final packet data */
-		memcpy(packet + packet_length, buffer, length);
+	if (!is_final_message) {
+		return WEBINSPECTOR_E_SUCCESS;
+	}
 
-		/* cleanup buffer */
-		free(buffer);
-		buffer = NULL;
+	/* read final message */
+	plist_from_bin(client->packet, client->packet_length, plist);
+	webinspector_packet_reset(client);
+	if (!*plist) {
+		debug_info("Error restoring the final plist.");
+		return WEBINSPECTOR_E_PLIST_ERROR;
+	}
+	debug_plist(*plist);
 
-		if (message) {
-			plist_free(message);
-			message = NULL;
-		}
+	return WEBINSPECTOR_E_SUCCESS;
+}
 
-		/* adjust packet length */
-		packet_length += length;
-		length = 0;
-	} while(!is_final_message);
+LIBIMOBILEDEVICE_API webinspector_error_t webinspector_receive_with_timeout(webinspector_client_t client, plist_t * plist, uint32_t timeout_ms)
+{
+	if (!client || !client->parent || !plist)
+		return WEBINSPECTOR_E_INVALID_ARG;
 
-	/* read final message */
-	if (packet_length) {
-		plist_from_bin(packet, (uint32_t)packet_length, plist);
-		if (!*plist) {
-			debug_info("Error restoring the final plist.");
-			free(packet);
-			return WEBINSPECTOR_E_PLIST_ERROR;
-		}
+	webinspector_error_t res = WEBINSPECTOR_E_SUCCESS;
 
-		debug_plist(*plist);
-	}
+	debug_info("Receiving webinspector message...");
 
-	if (packet) {
-		free(packet);
+	*plist = NULL;
+	while (res == WEBINSPECTOR_E_SUCCESS && !*plist) {
+		res = webinspector_receive_chunk(client, timeout_ms, plist);
 	}
 
 	return res;
 }
+
+static int webinspector_pump_cb(idevice_connection_t connection, void *user_data)
+{
+	webinspector_client_t client = (webinspector_client_t)user_data;
+	plist_t message = NULL;
+
+	webinspector_error_t res = webinspector_receive_chunk(client, WEBINSPECTOR_PUMP_RECEIVE_TIMEOUT, &message);
+	if (res != WEBINSPECTOR_E_SUCCESS) {
+		client->callback(client, NULL, res, client->user_data);
+		/* the client is removed from the loop */
+		client->loop = NULL;
+		return 1;
+	}
+	if (message) {
+		client->callback(client, message, WEBINSPECTOR_E_SUCCESS, client->user_data);
+	}
+
+	return 0;
+}
+
+LIBIMOBILEDEVICE_API webinspector_error_t webinspector_start_pump(webinspector_client_t client, idevice_event_loop_t loop, webinspector_message_cb_t callback, void *user_data)
+{
+	if (!client || !client->parent || !loop || !callback || client->loop)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
+	client->callback = callback;
+	client->user_data = user_data;
+	client->loop = loop;
+	if (idevice_event_loop_add(loop, client->parent->parent->connection, webinspector_pump_cb, client) != IDEVICE_E_SUCCESS) {
+		client->loop = NULL;
+		return WEBINSPECTOR_E_UNKNOWN_ERROR;
+	}
+
+	return WEBINSPECTOR_E_SUCCESS;
+}
+
+LIBIMOBILEDEVICE_API webinspector_error_t webinspector_stop_pump(webinspector_client_t client)
+{
+	if (!client || !client->parent)
+		return WEBINSPECTOR_E_INVALID_ARG;
+
+	idevice_event_loop_t loop = client->loop;
+	if (loop) {
+		idevice_event_loop_remove(loop, client->parent->parent->connection);
+		client->loop = NULL;
+	}
+
+	return WEBINSPECTOR_E_SUCCESS;
+}
@@ -27,8 +27,22 @@
 
 #define WEBINSPECTOR_PARTIAL_PACKET_CHUNK_SIZE 8096
 
+/* the reassembly buffer is released after a message larger than this */
+#define WEBINSPECTOR_PACKET_BUFFER_KEEP_SIZE (4*1024*1024)
+
+/* time to wait for the rest of a message once the pump saw data */
+#define WEBINSPECTOR_PUMP_RECEIVE_TIMEOUT 5000
+
 struct webinspector_client_private {
 	property_list_service_client_t parent;
+	/* reassembly buffer for partial messages, reused across messages */
+	char *packet;
+	uint32_t packet_length;
+	uint32_t packet_capacity;
+	/* message pump */
+	idevice_event_loop_t loop;
+	webinspector_message_cb_t callback;
+	void *user_data;
 };
 
 #endif
@@ -48,6 +48,7 @@
 #include <libimobiledevice/notification_proxy.h>
 #include <libimobiledevice/afc.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #ifdef _MSC_VER
 void usleep(DWORD waitTime) {
@@ -125,18 +126,16 @@ static void compute_datahash(const char *path, const char *destpath, uint8_t gre
 	}
 	gcry_md_reset(hd);
 #endif
-	FILE *f = fopen(path, "rb");
-	if (f) {
-		unsigned char buf[16384];
-		size_t len;
-		while ((len = fread(buf, 1, 16384, f)) > 0) {
+	struct file_buffer fb;
+	if (buffer_map_from_filename(path, &fb) == 0) {
+		if (fb.length > 0) {
 #ifdef HAVE_OPENSSL
-			SHA1_Update(&sha1, buf, len);
+			SHA1_Update(&sha1, fb.data, (size_t)fb.length);
 #else
-			gcry_md_write(hd, buf, len);
+			gcry_md_write(hd, fb.data, (size_t)fb.length);
 #endif
 		}
-		fclose(f);
+		buffer_unmap(&fb);
 #ifdef HAVE_OPENSSL
 		SHA1_Update(&sha1, destpath, strlen(destpath));
 		SHA1_Update(&sha1, ";", 1);
@@ -231,11 +230,209 @@ static void print_hash(const unsigned char *hash, int len)
 	}
 }
 
+/* woken up through the notification proxy when another sync is done with the lock */
+static mutex_t sync_lock_mutex;
+static cond_t sync_lock_cond;
+static int sync_lock_released = 0;
+
+static void wait_for_sync_lock(unsigned int timeout_ms)
+{
+	mutex_lock(&sync_lock_mutex);
+	if (!sync_lock_released) {
+		cond_wait_timeout(&sync_lock_cond, &sync_lock_mutex, timeout_ms);
+	}
+	sync_lock_released = 0;
+	mutex_unlock(&sync_lock_mutex);
+}
+
+/* received hunks are written to disk by a separate thread, so the protocol
+ * thread can go on receiving while the disk catches up */
+#define FILE_WRITER_MAX_PENDING 8
+
+struct file_write_job {
+	/* the DLSendFile message the hunk came with, owned by the job */
+	plist_t message;
+	char *mddata_path;
+	/* set if the .mdinfo is written with this hunk */
+	char *mdinfo_path;
+	/* set to move the file into place after its last hunk */
+	char *rename_path;
+	int first_hunk;
+	int last_hunk;
+	struct file_write_job *next;
+};
+
+struct file_writer {
+	mutex_t mutex;
+	cond_t cond;
+	THREAD_T thread;
+	int started;
+	int stopping;
+	int pending;
+	struct file_write_job *head;
+	struct file_write_job *tail;
+	FILE *f;
+};
+
+static struct file_writer writer;
+
+static void file_writer_execute(struct file_write_job *job)
+{
+	char *data = NULL;
+	uint64_t length = 0;
+	struct stat st;
+
+	if (job->mdinfo_path) {
+		plist_t info = plist_dict_get_item(plist_array_get_item(job->message, 2), "BackupFileInfo");
+		if (stat(job->mdinfo_path, &st) == 0)
+			remove(job->mdinfo_path);
+		if (!plist_write_to_filename(info, job->mdinfo_path, PLIST_FORMAT_BINARY)) {
+			printf("ERROR: could not write %s\n", job->mdinfo_path);
+		}
+	}
+
+	if (job->first_hunk) {
+		if (writer.f) {
+			fclose(writer.f);
+		}
+		if (stat(job->mddata_path, &st) == 0)
+			remove(job->mddata_path);
+		writer.f = fopen(job->mddata_path, "wb");
+		if (!writer.f) {
+			printf("ERROR: could not open %s: %s\n", job->mddata_path, strerror(errno));
+		}
+	}
+
+	plist_t node = plist_array_get_item(job->message, 1);
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		data = (char*)plist_get_data_ptr(node, &length);
+	}
+	if (writer.f && data && length > 0 && fwrite(data, 1, length, writer.f) != length) {
+		printf("ERROR: could not write %s: %s\n", job->mddata_path, strerror(errno));
+	}
+
+	if (job->last_hunk && writer.f) {
+		fclose(writer.f);
+		writer.f = NULL;
+		if (job->rename_path) {
+			rename(job->mddata_path, job->rename_path);
+		}
+	}
+}
+
+static void file_write_job_free(struct file_write_job *job)
+{
+	plist_free(job->message);
+	free(job->mddata_path);
+	free(job->mdinfo_path);
+	free(job->rename_path);
+	free(job);
+}
+
+static void* file_writer_thread(void *arg)
+{
+	while (1) {
+		mutex_lock(&writer.mutex);
+		while (!writer.head && !writer.stopping) {
+			cond_wait(&writer.cond, &writer.mutex);
+		}
+		struct file_write_job *job = writer.head;
+		if (!job) {
+			mutex_unlock(&writer.mutex);
+			break;
+		}
+		writer.head = job->next;
+		if (!writer.head) {
+			writer.tail = NULL;
+		}
+		mutex_unlock(&writer.mutex);
+
+		file_writer_execute(job);
+		file_write_job_free(job);
+
+		mutex_lock(&writer.mutex);
+		writer.pending--;
+		cond_broadcast(&writer.cond);
+		mutex_unlock(&writer.mutex);
+	}
+	return NULL;
+}
+
+static void file_writer_start(void)
+{
+	memset(&writer, '\0', sizeof(writer));
+	mutex_init(&writer.mutex);
+	cond_init(&writer.cond);
+	if (thread_new(&writer.thread, file_writer_thread, NULL) == 0) {
+		writer.started = 1;
+	} else {
+		printf("Could not start file writer thread, writing files synchronously\n");
+	}
+}
+
+/* blocks while too many hunks are waiting to be written */
+static void file_writer_submit(struct file_write_job *job)
+{
+	if (!writer.started) {
+		file_writer_execute(job);
+		file_write_job_free(job);
+		return;
+	}
+	mutex_lock(&writer.mutex);
+	while (writer.pending >= FILE_WRITER_MAX_PENDING) {
+		cond_wait(&writer.cond, &writer.mutex);
+	}
+	if (writer.tail) {
+		writer.tail->next = job;
+	} else {
+		writer.head = job;
+	}
+	writer.tail = job;
+	writer.pending++;
+	cond_broadcast(&writer.cond);
+	mutex_unlock(&writer.mutex);
+}
+
+/* waits until all submitted hunks are on disk */
+static void file_writer_flush(void)
+{
+	mutex_lock(&writer.mutex);
+	while (writer.pending > 0) {
+		cond_wait(&writer.cond, &writer.mutex);
+	}
+	mutex_unlock(&writer.mutex);
+}
+
+/* writes everything still queued before returning */
+static void file_writer_stop(void)
+{
+	mutex_lock(&writer.mutex);
+	writer.stopping = 1;
+	cond_broadcast(&writer.cond);
+	mutex_unlock(&writer.mutex);
+	if (writer.started) {
+		thread_join(writer.thread);
+		thread_free(writer.thread);
+		writer.started = 0;
+	}
+	if (writer.f) {
+		fclose(writer.f);
+		writer.f = NULL;
+	}
+	cond_destroy(&writer.cond);
+	mutex_destroy(&writer.mutex);
+}
+
 static void notify_cb(const char *notification, void *userdata)
 {
 	if (!strcmp(notification, NP_SYNC_CANCEL_REQUEST)) {
 		printf("User has aborted on-device\n");
 		quit_flag++;
+	} else if (!strcmp(notification, NP_SYNC_DID_FINISH)) {
+		mutex_lock(&sync_lock_mutex);
+		sync_lock_released = 1;
+		cond_signal(&sync_lock_cond);
+		mutex_unlock(&sync_lock_mutex);
 	} else {
 		printf("unhandled notification '%s' (TODO: implement)\n", notification);
 	}
@@ -841,17 +1038,21 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	mutex_init(&sync_lock_mutex);
+	cond_init(&sync_lock_cond);
+
 	/* start notification_proxy */
 	np_client_t np = NULL;
 	ldret = lockdownd_start_service(client, NP_SERVICE_NAME, &service);
 	if ((ldret == LOCKDOWN_E_SUCCESS) && service && service->port) {
 		np_client_new(device, service, &np);
 		np_set_notify_callback(np, notify_cb, NULL);
-		const char *noties[5] = {
+		const char *noties[6] = {
 			NP_SYNC_CANCEL_REQUEST,
 			NP_SYNC_SUSPEND_REQUEST,
 			NP_SYNC_RESUME_REQUEST,
 			NP_BACKUP_DOMAIN_CHANGED,
+			NP_SYNC_DID_FINISH,
 			NULL
 		};
 		np_observe_notifications(np, noties);
@@ -940,7 +1141,8 @@ int main(int argc, char *argv[])
 					do_post_notification(NP_SYNC_DID_START);
 					break;
 				} else if (aerr == AFC_E_OP_WOULD_BLOCK) {
-					usleep(LOCK_WAIT);
+					/* try again once the holder announces that its sync finished */
+					wait_for_sync_lock(LOCK_WAIT / 1000);
 					continue;
 				} else {
 					fprintf(stderr, "ERROR: could not lock file! error code: %d\n", aerr);
@@ -1037,13 +1239,13 @@ int main(int argc, char *argv[])
 			int hunk_index = 0;
 			uint64_t backup_real_size = 0;
 			char *file_ext = NULL;
-			char *filename_mdinfo = NULL;
-			char *filename_mddata = NULL;
 			char *filename_source = NULL;
 			char *format_size = NULL;
 			int is_manifest = 0;
 			uint8_t b = 0;
 
+			file_writer_start();
+
 			/* process series of DLSendFile messages */
 			do {
 				mobilebackup_receive(mobilebackup, &message);
@@ -1114,56 +1316,37 @@ int main(int argc, char *argv[])
 
 				/* check if we completed a file */
 				if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (!is_manifest)) {
-					/* save <hash>.mdinfo */
-					node = plist_dict_get_item(node_tmp, "BackupFileInfo");
-					if (node) {
-						node = plist_dict_get_item(node_tmp, "DLFileDest");
-						plist_get_string_val(node, &file_path);
-
-						filename_mdinfo = mobilebackup_build_path(backup_directory, file_path, ".mdinfo");
-
-						/* remove any existing file */
-						if (stat(filename_mdinfo, &st) == 0)
-							remove(filename_mdinfo);
-
-						node = plist_dict_get_item(node_tmp, "BackupFileInfo");
-						plist_write_to_filename(node, filename_mdinfo, PLIST_FORMAT_BINARY);
-
-						free(filename_mdinfo);
-					}
-
 					file_index++;
 				}
 
-				/* save <hash>.mddata */
-				node = plist_dict_get_item(node_tmp, "BackupFileInfo");
-				if (node_tmp) {
+				/* save <hash>.mddata and <hash>.mdinfo, the writer takes over the message */
+				struct file_write_job *job = (node_tmp) ? (struct file_write_job*)calloc(1, sizeof(struct file_write_job)) : NULL;
+				if (job) {
 					node = plist_dict_get_item(node_tmp, "DLFileDest");
 					plist_get_string_val(node, &file_path);
 
-					filename_mddata = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
-
-					/* if this is the first hunk, remove any existing file */
-					if ((hunk_index == 0) && (stat(filename_mddata, &st) == 0))
-						remove(filename_mddata);
-
-					/* get file data hunk */
-					node_tmp = plist_array_get_item(message, 1);
-					plist_get_data_val(node_tmp, &buffer, &length);
-
-					buffer_write_to_filename(filename_mddata, buffer, length);
-					if (!is_manifest)
-						file_size_current += length;
-
+					job->mddata_path = mobilebackup_build_path(backup_directory, file_path, is_manifest ? NULL: ".mddata");
+					if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (!is_manifest) && plist_dict_get_item(node_tmp, "BackupFileInfo")) {
+						job->mdinfo_path = mobilebackup_build_path(backup_directory, file_path, ".mdinfo");
+					}
 					/* activate currently sent manifest */
 					if ((file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK) && (is_manifest)) {
-						rename(filename_mddata, manifest_path);
+						job->rename_path = strdup(manifest_path);
 					}
+					job->first_hunk = (hunk_index == 0);
+					job->last_hunk = (file_status == DEVICE_LINK_FILE_STATUS_LAST_HUNK);
+					free(file_path);
+					file_path = NULL;
 
-					free(buffer);
-					buffer = NULL;
+					/* get file data hunk */
+					length = 0;
+					plist_get_data_ptr(plist_array_get_item(message, 1), &length);
+					if (!is_manifest)
+						file_size_current += length;
 
-					free(filename_mddata);
+					job->message = message;
+					message = NULL;
+					file_writer_submit(job);
 				}
 
 				if ((!is_manifest)) {
@@ -1200,6 +1383,7 @@ files_out:
 					mobilebackup_send_error(mobilebackup, "Cancelling DLSendFile");
 
 					/* remove any atomic Manifest.plist.tmp */
+					file_writer_flush();
 					if (manifest_path)
 						free(manifest_path);
 
@@ -1210,6 +1394,8 @@ files_out:
 				}
 			} while (1);
 
+			file_writer_stop();
+
 			printf("Received %d files from device.\n", file_index);
 
 			if (!quit_flag && !plist_strcmp(node, "DLMessageProcessMessage")) {
@@ -1634,6 +1820,9 @@ files_out:
 	if (np)
 		np_client_free(np);
 
+	cond_destroy(&sync_lock_cond);
+	mutex_destroy(&sync_lock_mutex);
+
 	if (mobilebackup)
 		mobilebackup_client_free(mobilebackup);
 
@@ -26,6 +26,9 @@
 
 #define TOOL_NAME "idevicebackup2"
 
+/* for copy_file_range */
+#define _GNU_SOURCE 1
+
 #ifdef WIN32
 #include <windows.h>
 #endif
@@ -39,9 +42,19 @@
 #include <unistd.h>	
 #endif
 #include <dirent.h>
+#include <fcntl.h>
 #include <libgen.h>
 #include <ctype.h>
 #include <time.h>
+#include <inttypes.h>
+#ifdef HAVE_OPENSSL
+#include <openssl/sha.h>
+#else
+#include <gcrypt.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -52,6 +65,7 @@
 #include <libimobiledevice/sbservices.h>
 #include <libimobiledevice/diagnostics_relay.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <endianness.h>
 
@@ -64,6 +78,21 @@
 #else
 #include <termios.h>
 #include <sys/statvfs.h>
+#include <sys/wait.h>
+#ifdef HAVE_LINUX_FS_H
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_CLONEFILE_H
+#include <sys/clonefile.h>
+#endif
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#define MB2_MULTI_DEVICE 1
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+#endif
 #endif
 #include <sys/stat.h>
 
@@ -113,7 +142,10 @@ enum cmd_flags {
 	CMD_FLAG_FORCE_FULL_BACKUP          = (1 << 9),
 	CMD_FLAG_CLOUD_ENABLE               = (1 << 10),
 	CMD_FLAG_CLOUD_DISABLE              = (1 << 11),
-	CMD_FLAG_RESTORE_SKIP_APPS          = (1 << 12)
+	CMD_FLAG_RESTORE_SKIP_APPS          = (1 << 12),
+	CMD_FLAG_DEDUP                      = (1 << 13),
+	CMD_FLAG_COMPRESS                   = (1 << 14),
+	CMD_FLAG_DIGESTS                    = (1 << 15)
 };
 
 static int backup_domain_changed = 0;
@@ -271,61 +303,325 @@ static int remove_directory(const char* path)
 	return e;
 }
 
+/* filesystem work that can run in parallel is handed to these threads,
+ * the protocol thread only waits for the results it has to report */
+#define MB2_FS_THREADS 4
+/* number of directory listings kept from prefetching */
+#define MB2_DIR_CACHE_SIZE 64
+/* subdirectories prefetched per listing the device asks for */
+#define MB2_DIR_PREFETCH_MAX 16
+
+typedef void (*mb2_fs_job_func_t)(void *data);
+
+struct mb2_fs_job {
+	mb2_fs_job_func_t func;
+	void *data;
+	struct mb2_fs_job *next;
+};
+
+/* a set of jobs the submitter waits for, with the first error of them */
+struct mb2_fs_group {
+	int pending;
+	int error;
+};
+
+struct mb2_fs_pool {
+	mutex_t mutex;
+	cond_t cond;
+	struct mb2_fs_job *head;
+	struct mb2_fs_job *tail;
+	int stopping;
+	THREAD_T threads[MB2_FS_THREADS];
+	int num_threads;
+	/* path -> prefetched listing, dropped when anything is modified */
+	plist_t dir_cache;
+	unsigned int dir_cache_generation;
+};
+
+static struct mb2_fs_pool *fs_pool = NULL;
+
+static void* mb2_fs_pool_thread(void *arg)
+{
+	struct mb2_fs_pool *pool = (struct mb2_fs_pool*)arg;
+
+	while (1) {
+		mutex_lock(&pool->mutex);
+		while (!pool->head && !pool->stopping) {
+			cond_wait(&pool->cond, &pool->mutex);
+		}
+		struct mb2_fs_job *job = pool->head;
+		if (!job) {
+			mutex_unlock(&pool->mutex);
+			break;
+		}
+		pool->head = job->next;
+		if (!pool->head) {
+			pool->tail = NULL;
+		}
+		mutex_unlock(&pool->mutex);
+
+		job->func(job->data);
+		free(job);
+	}
+
+	return NULL;
+}
+
+static struct mb2_fs_pool* mb2_fs_pool_get(void)
+{
+	int i;
+
+	if (fs_pool) {
+		return fs_pool;
+	}
+	fs_pool = (struct mb2_fs_pool*)calloc(1, sizeof(struct mb2_fs_pool));
+	if (!fs_pool) {
+		return NULL;
+	}
+	mutex_init(&fs_pool->mutex);
+	cond_init(&fs_pool->cond);
+	fs_pool->dir_cache = plist_new_dict();
+	for (i = 0; i < MB2_FS_THREADS; i++) {
+		if (thread_new(&fs_pool->threads[fs_pool->num_threads], mb2_fs_pool_thread, fs_pool) != 0) {
+			break;
+		}
+		fs_pool->num_threads++;
+	}
+	return fs_pool;
+}
+
+static void mb2_fs_pool_free(void)
+{
+	int i;
+
+	if (!fs_pool) {
+		return;
+	}
+	mutex_lock(&fs_pool->mutex);
+	fs_pool->stopping = 1;
+	cond_broadcast(&fs_pool->cond);
+	mutex_unlock(&fs_pool->mutex);
+	for (i = 0; i < fs_pool->num_threads; i++) {
+		thread_join(fs_pool->threads[i]);
+		thread_free(fs_pool->threads[i]);
+	}
+	plist_free(fs_pool->dir_cache);
+	cond_destroy(&fs_pool->cond);
+	mutex_destroy(&fs_pool->mutex);
+	free(fs_pool);
+	fs_pool = NULL;
+}
+
+/* runs func on a pool thread, or right away if there is none */
+static void mb2_fs_pool_submit(mb2_fs_job_func_t func, void *data)
+{
+	struct mb2_fs_pool *pool = mb2_fs_pool_get();
+	struct mb2_fs_job *job = NULL;
+
+	if (pool && pool->num_threads > 0) {
+		job = (struct mb2_fs_job*)malloc(sizeof(struct mb2_fs_job));
+	}
+	if (!job) {
+		func(data);
+		return;
+	}
+	job->func = func;
+	job->data = data;
+	job->next = NULL;
+	mutex_lock(&pool->mutex);
+	if (pool->tail) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	cond_signal(&pool->cond);
+	mutex_unlock(&pool->mutex);
+}
+
+static void mb2_fs_group_add(struct mb2_fs_group *group)
+{
+	struct mb2_fs_pool *pool = mb2_fs_pool_get();
+	if (pool) mutex_lock(&pool->mutex);
+	group->pending++;
+	if (pool) mutex_unlock(&pool->mutex);
+}
+
+static void mb2_fs_group_done(struct mb2_fs_group *group, int error)
+{
+	struct mb2_fs_pool *pool = mb2_fs_pool_get();
+	if (pool) mutex_lock(&pool->mutex);
+	if (error && !group->error) {
+		group->error = error;
+	}
+	group->pending--;
+	if (pool) {
+		cond_broadcast(&pool->cond);
+		mutex_unlock(&pool->mutex);
+	}
+}
+
+/* must not be called from a pool thread */
+static int mb2_fs_group_wait(struct mb2_fs_group *group)
+{
+	struct mb2_fs_pool *pool = mb2_fs_pool_get();
+	if (!pool) {
+		return group->error;
+	}
+	mutex_lock(&pool->mutex);
+	while (group->pending > 0) {
+		cond_wait(&pool->cond, &pool->mutex);
+	}
+	mutex_unlock(&pool->mutex);
+	return group->error;
+}
+
 struct entry {
 	char *name;
 	struct entry *next;
 };
 
+static struct entry* entry_new(char *name, struct entry *next)
+{
+	struct entry *ent = malloc(sizeof(struct entry));
+	if (!ent) return NULL;
+	ent->name = name;
+	ent->next = next;
+	return ent;
+}
+
+/* Collects all files and directories below path without recursing.
+ * A directory is added to *directories before anything below it, so
+ * walking the lists from the head visits children before their parents. */
 static void scan_directory(const char *path, struct entry **files, struct entry **directories)
 {
-	DIR* cur_dir = opendir(path);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
-			}
-			char *fpath = string_build_path(path, ep->d_name, NULL);
-			if (fpath) {
+	struct entry *pending = entry_new(strdup(path), NULL);
+
+	while (pending) {
+		struct entry *cur = pending;
+		pending = cur->next;
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT)
+		int dfd = open(cur->name, O_RDONLY | O_DIRECTORY);
+		DIR *cur_dir = (dfd < 0) ? NULL : fdopendir(dfd);
+		if (!cur_dir && dfd >= 0) {
+			close(dfd);
+		}
+#else
+		DIR *cur_dir = opendir(cur->name);
+#endif
+		if (cur_dir) {
+			struct dirent* ep;
+			while ((ep = readdir(cur_dir))) {
+				if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+					continue;
+				}
+				char *fpath = string_build_path(cur->name, ep->d_name, NULL);
+				if (!fpath) {
+					continue;
+				}
+				int is_dir = 0;
 #ifdef HAVE_DIRENT_D_TYPE
-				if (ep->d_type & DT_DIR) {
+				if (ep->d_type != DT_UNKNOWN) {
+					is_dir = (ep->d_type == DT_DIR);
+				} else
+#endif
+				{
+					struct stat st;
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT)
+					int sres = fstatat(dirfd(cur_dir), ep->d_name, &st, AT_SYMLINK_NOFOLLOW);
 #else
-				struct stat st;
-				if (stat(fpath, &st) != 0) return;
-				if (S_ISDIR(st.st_mode)) {
-#endif
-					struct entry *ent = malloc(sizeof(struct entry));
-					if (!ent) return;
-					ent->name = fpath;
-					ent->next = *directories;
+					/* the entry keeps fpath, so stat it instead of building the path twice */
+					int sres = stat(fpath, &st);
+#endif
+					if (sres != 0) {
+						free(fpath);
+						continue;
+					}
+					is_dir = S_ISDIR(st.st_mode);
+				}
+				if (is_dir) {
+					struct entry *ent = entry_new(fpath, *directories);
+					if (!ent) {
+						free(fpath);
+						continue;
+					}
 					*directories = ent;
-					scan_directory(fpath, files, directories);
-					fpath = NULL;
+					ent = entry_new(strdup(fpath), pending);
+					if (ent) {
+						pending = ent;
+					}
 				} else {
-					struct entry *ent = malloc(sizeof(struct entry));
-					if (!ent) return;
-					ent->name = fpath;
-					ent->next = *files;
+					struct entry *ent = entry_new(fpath, *files);
+					if (!ent) {
+						free(fpath);
+						continue;
+					}
 					*files = ent;
-					fpath = NULL;
 				}
 			}
+			closedir(cur_dir);
 		}
-		closedir(cur_dir);
+		free(cur->name);
+		free(cur);
 	}
 }
 
-static int rmdir_recursive(const char* path)
+struct mb2_remove_job {
+	char *path;
+	struct mb2_fs_group *group;
+};
+
+static void mb2_remove_file_job(void *data)
+{
+	struct mb2_remove_job *job = (struct mb2_remove_job*)data;
+	int res = remove_file(job->path);
+	mb2_fs_group_done(job->group, (res == ENOENT) ? 0 : res);
+	free(job->path);
+	free(job);
+}
+
+static int rmdir_recursive(const char* path, int parallel);
+
+struct mb2_remove_item_job {
+	char *path;
+	int suppress_warning;
+	struct mb2_fs_group *group;
+};
+
+static void mb2_remove_item_job(void *data)
+{
+	struct mb2_remove_item_job *job = (struct mb2_remove_item_job*)data;
+	struct stat st;
+	int res;
+
+	if ((stat(job->path, &st) == 0) && S_ISDIR(st.st_mode)) {
+		res = rmdir_recursive(job->path, 0);
+	} else {
+		res = remove_file(job->path);
+	}
+	if (res == ENOENT) {
+		res = 0;
+	}
+	if (res != 0 && !job->suppress_warning) {
+		printf("Could not remove '%s': %s (%d)\n", job->path, strerror(res), res);
+	}
+	mb2_fs_group_done(job->group, res);
+	free(job->path);
+	free(job);
+}
+
+/* with parallel set the files are removed on the pool threads */
+static int rmdir_recursive(const char* path, int parallel)
 {
 	int res = 0;
 	struct entry *files = NULL;
 	struct entry *directories = NULL;
 	struct entry *ent;
+	struct mb2_fs_group group = { 0, 0 };
 
-	ent = malloc(sizeof(struct entry));
+	ent = entry_new(strdup(path), NULL);
 	if (!ent) return ENOMEM;
-	ent->name = strdup(path);
-	ent->next = NULL;
 	directories = ent;
 
 	scan_directory(path, &files, &directories);
@@ -333,11 +629,23 @@ static int rmdir_recursive(const char* path)
 	ent = files;
 	while (ent) {
 		struct entry *del = ent;
-		res = remove_file(ent->name);
-		free(ent->name);
+		struct mb2_remove_job *job = (parallel) ? (struct mb2_remove_job*)malloc(sizeof(struct mb2_remove_job)) : NULL;
+		if (job) {
+			job->path = ent->name;
+			job->group = &group;
+			mb2_fs_group_add(&group);
+			mb2_fs_pool_submit(mb2_remove_file_job, job);
+		} else {
+			res = remove_file(ent->name);
+			free(ent->name);
+		}
 		ent = ent->next;
 		free(del);
 	}
+	if (parallel) {
+		int gres = mb2_fs_group_wait(&group);
+		if (gres) res = gres;
+	}
 	ent = directories;
 	while (ent) {
 		struct entry *del = ent;
@@ -383,14 +691,14 @@ static plist_t mobilebackup_factory_info_plist_new(const char* udid, idevice_t d
 
 	plist_t ret = plist_new_dict();
 
-	/* get basic device information in one go */
-	lockdownd_get_value(lockdown, NULL, NULL, &root_node);
-
-	/* get iTunes settings */
-	lockdownd_get_value(lockdown, "com.apple.iTunes", NULL, &itunes_settings);
-
-	/* get minimum iTunes version */
-	lockdownd_get_value(lockdown, "com.apple.mobile.iTunes", "MinITunesVersion", &min_itunes_version);
+	/* get basic device information, iTunes settings and minimum iTunes version in one go */
+	const char *domains[3] = { NULL, "com.apple.iTunes", "com.apple.mobile.iTunes" };
+	const char *keys[3] = { NULL, NULL, "MinITunesVersion" };
+	plist_t values[3] = { NULL, NULL, NULL };
+	lockdownd_get_values(lockdown, domains, keys, 3, values);
+	root_node = values[0];
+	itunes_settings = values[1];
+	min_itunes_version = values[2];
 
 	lockdownd_client_free(lockdown);
 
@@ -627,16 +935,17 @@ leave:
 static int mb2_status_check_snapshot_state(const char *path, const char *udid, const char *matches)
 {
 	int ret = 0;
-	plist_t status_plist = NULL;
+	plist_t node = NULL;
+	struct stat st;
 	char *file_path = string_build_path(path, udid, "Status.plist", NULL);
 
-	plist_read_from_filename(&status_plist, file_path);
-	free(file_path);
-	if (!status_plist) {
+	/* only parse the one key instead of the whole file */
+	if (!plist_read_key_from_filename(&node, file_path, "SnapshotState") && stat(file_path, &st) != 0) {
+		free(file_path);
 		printf("Could not read Status.plist!\n");
 		return ret;
 	}
-	plist_t node = plist_dict_get_item(status_plist, "SnapshotState");
+	free(file_path);
 	if (node && (plist_get_node_type(node) == PLIST_STRING)) {
 		char* sval = NULL;
 		plist_get_string_val(node, &sval);
@@ -647,7 +956,7 @@ static int mb2_status_check_snapshot_state(const char *path, const char *udid, c
 	} else {
 		printf("%s: ERROR could not get SnapshotState key from Status.plist!\n", __func__);
 	}
-	plist_free(status_plist);
+	plist_free(node);
 	return ret;
 }
 
@@ -726,10 +1035,18 @@ static void print_progress(uint64_t current, uint64_t total)
 
 static double overall_progress = 0;
 
+#ifdef MB2_MULTI_DEVICE
+static void mb2_shared_set_progress(double progress);
+#endif
+
 static void mb2_set_overall_progress(double progress)
 {
-	if (progress > 0.0)
+	if (progress > 0.0) {
 		overall_progress = progress;
+#ifdef MB2_MULTI_DEVICE
+		mb2_shared_set_progress(progress);
+#endif
+	}
 }
 
 static void mb2_set_overall_progress_from_message(plist_t message, char* identifier)
@@ -774,13 +1091,168 @@ static int errno_to_device_error(int errno_value)
 	}
 }
 
-static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char *backup_dir, const char *path, plist_t *errplist)
+/* content files are the ones in the subdirectories of the device directory,
+ * returns their path relative to it, or NULL for anything else */
+static const char* mb2_content_relative_path(const char *device_dir, const char *path)
+{
+	size_t len;
+
+	if (!device_dir) {
+		return NULL;
+	}
+	len = strlen(device_dir);
+	if (strncmp(path, device_dir, len) != 0 || (path[len] != '/' && path[len] != '\\')) {
+		return NULL;
+	}
+	if (!strchr(path + len + 1, '/') && !strchr(path + len + 1, '\\')) {
+		return NULL;
+	}
+	return path + len + 1;
+}
+
+/* content files stored compressed (see --compress) start with this magic, followed by a zstd frame */
+#define MB2_COMPRESS_MAGIC "MB2ZSTD1"
+#define MB2_COMPRESS_MAGIC_LEN 8
+#define MB2_COMPRESS_DEFAULT_LEVEL 3
+/* the start of each file is test compressed, files that don't shrink below
+ * MB2_COMPRESS_MAX_RATIO percent of it are stored as-is */
+#define MB2_COMPRESS_PROBE_SIZE (128*1024)
+#define MB2_COMPRESS_MAX_RATIO 90
+/* zstd worker threads per writer thread, ignored if libzstd is single threaded */
+#define MB2_COMPRESS_WORKERS 2
+
+static int compress_level = 0;
+static char *compress_device_dir = NULL;
+
+/* like deduplication, compression is limited to content files */
+static int mb2_compress_path(const char *path)
+{
+	return (mb2_content_relative_path(compress_device_dir, path) != NULL);
+}
+
+static void mb2_compress_init(const char *backup_directory, const char *udid, int level)
+{
+#ifdef HAVE_ZSTD
+	if (level < ZSTD_minCLevel() || level > ZSTD_maxCLevel()) {
+		printf("WARNING: Invalid compression level %d, using %d\n", level, MB2_COMPRESS_DEFAULT_LEVEL);
+		level = MB2_COMPRESS_DEFAULT_LEVEL;
+	}
+	compress_level = level;
+	compress_device_dir = string_build_path(backup_directory, udid, NULL);
+#else
+	printf("WARNING: This build has no zstd support, not compressing files\n");
+#endif
+}
+
+static void mb2_compress_finish(void)
+{
+	free(compress_device_dir);
+	compress_device_dir = NULL;
+}
+
+static int mb2_send_file_chunk(mobilebackup2_client_t mobilebackup2, const char *data, uint32_t length)
+{
+	uint32_t nlen = htobe32(length+1);
+	uint32_t bytes = 0;
+	char hdr[5];
+	idevice_iovec_t iov[2];
+
+	memcpy(hdr, &nlen, sizeof(nlen));
+	hdr[4] = CODE_FILE_DATA;
+	iov[0].data = hdr;
+	iov[0].length = sizeof(hdr);
+	iov[1].data = data;
+	iov[1].length = length;
+	if (mobilebackup2_send_rawv(mobilebackup2, iov, 2, &bytes) != MOBILEBACKUP2_E_SUCCESS || bytes != sizeof(hdr) + length) {
+		return -1;
+	}
+	return 0;
+}
+
+/* sends the decompressed contents of f, which is positioned after the magic.
+ * Returns -1 if the stream to the device broke, otherwise 0 with errcode set. */
+static int mb2_send_compressed_file(mobilebackup2_client_t mobilebackup2, FILE *f, uint32_t chunk_size, int *errcode)
+{
+#ifdef HAVE_ZSTD
+	int result = 0;
+	size_t ret = 1;
+	size_t rd;
+	size_t in_size = ZSTD_DStreamInSize();
+	ZSTD_DCtx *dctx = ZSTD_createDCtx();
+	char *inbuf = (char*)malloc(in_size);
+	char *outbuf = (char*)malloc(chunk_size);
+	ZSTD_outBuffer out = { outbuf, chunk_size, 0 };
+
+	*errcode = 0;
+	if (!dctx || !inbuf || !outbuf) {
+		*errcode = ENOMEM;
+		goto leave;
+	}
+	while ((rd = fread(inbuf, 1, in_size, f)) > 0) {
+		ZSTD_inBuffer in = { inbuf, rd, 0 };
+		while (in.pos < in.size) {
+			ret = ZSTD_decompressStream(dctx, &out, &in);
+			if (ZSTD_isError(ret)) {
+				*errcode = EIO;
+				goto leave;
+			}
+			if (out.pos == out.size) {
+				if (mb2_send_file_chunk(mobilebackup2, outbuf, (uint32_t)out.pos) < 0) {
+					result = -1;
+					goto leave;
+				}
+				out.pos = 0;
+			}
+		}
+	}
+	if (ferror(f)) {
+		*errcode = errno;
+		goto leave;
+	}
+	/* the decoder can hold back output when the buffer ran full at the end */
+	while (ret != 0) {
+		ZSTD_inBuffer in = { inbuf, 0, 0 };
+		size_t before = out.pos;
+		ret = ZSTD_decompressStream(dctx, &out, &in);
+		if (ZSTD_isError(ret) || (ret != 0 && out.pos == before && out.pos < out.size)) {
+			/* truncated frame */
+			*errcode = EIO;
+			goto leave;
+		}
+		if (out.pos == out.size) {
+			if (mb2_send_file_chunk(mobilebackup2, outbuf, (uint32_t)out.pos) < 0) {
+				result = -1;
+				goto leave;
+			}
+			out.pos = 0;
+		}
+	}
+	if (out.pos > 0 && mb2_send_file_chunk(mobilebackup2, outbuf, (uint32_t)out.pos) < 0) {
+		result = -1;
+	}
+
+leave:
+	ZSTD_freeDCtx(dctx);
+	free(inbuf);
+	free(outbuf);
+	return result;
+#else
+	printf("ERROR: File was stored compressed, but this build has no zstd support\n");
+	*errcode = EIO;
+	return 0;
+#endif
+}
+
+static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, struct path_builder *paths, const char *path, plist_t *errplist)
 {
 	uint32_t nlen = 0;
 	uint32_t pathlen = strlen(path);
 	uint32_t bytes = 0;
-	char *localfile = string_build_path(backup_dir, path, NULL);
+	const char *localfile = path_builder_build(paths, path, NULL);
 	char buf[32768];
+	uint32_t chunk_size = 0;
+	char hdr[5];
+	idevice_iovec_t iov[2];
 #ifdef WIN32
 	struct _stati64 fst;
 #else
@@ -802,23 +1274,17 @@ static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char
 
 	mobilebackup2_error_t err;
 
-	/* send path length */
+	/* send path length and path */
 	nlen = htobe32(pathlen);
-	err = mobilebackup2_send_raw(mobilebackup2, (const char*)&nlen, sizeof(nlen), &bytes);
-	if (err != MOBILEBACKUP2_E_SUCCESS) {
-		goto leave_proto_err;
-	}
-	if (bytes != (uint32_t)sizeof(nlen)) {
-		err = MOBILEBACKUP2_E_MUX_ERROR;
-		goto leave_proto_err;
-	}
-
-	/* send path */
-	err = mobilebackup2_send_raw(mobilebackup2, path, pathlen, &bytes);
+	iov[0].data = (const char*)&nlen;
+	iov[0].length = sizeof(nlen);
+	iov[1].data = path;
+	iov[1].length = pathlen;
+	err = mobilebackup2_send_rawv(mobilebackup2, iov, 2, &bytes);
 	if (err != MOBILEBACKUP2_E_SUCCESS) {
 		goto leave_proto_err;
 	}
-	if (bytes != pathlen) {
+	if (bytes != (uint32_t)sizeof(nlen) + pathlen) {
 		err = MOBILEBACKUP2_E_MUX_ERROR;
 		goto leave_proto_err;
 	}
@@ -853,37 +1319,50 @@ static int mb2_handle_send_file(mobilebackup2_client_t mobilebackup2, const char
 		goto leave;
 	}
 
+	/* send in chunks the size the link currently handles well */
+	mobilebackup2_get_chunk_size(mobilebackup2, &chunk_size);
+	if (chunk_size < sizeof(buf)) {
+		chunk_size = sizeof(buf);
+	}
+
+	if (total >= MB2_COMPRESS_MAGIC_LEN) {
+		char magic[MB2_COMPRESS_MAGIC_LEN];
+		if (fread(magic, 1, sizeof(magic), f) == sizeof(magic) && memcmp(magic, MB2_COMPRESS_MAGIC, MB2_COMPRESS_MAGIC_LEN) == 0) {
+			if (mb2_send_compressed_file(mobilebackup2, f, chunk_size, &errcode) < 0) {
+				goto leave_proto_err;
+			}
+			fclose(f);
+			f = NULL;
+			goto leave;
+		}
+	}
+
 	sent = 0;
 	do {
-		length = ((total-sent) < (long long)sizeof(buf)) ? (uint32_t)total-sent : (uint32_t)sizeof(buf);
-		/* send data size (file size + 1) */
+		length = ((total-sent) < (long long)chunk_size) ? (uint32_t)total-sent : chunk_size;
+
+		/* send data size (chunk size + 1), then the chunk straight from the file */
 		nlen = htobe32(length+1);
-		memcpy(buf, &nlen, sizeof(nlen));
-		buf[4] = CODE_FILE_DATA;
-		err = mobilebackup2_send_raw(mobilebackup2, (const char*)buf, 5, &bytes);
+		memcpy(hdr, &nlen, sizeof(nlen));
+		hdr[4] = CODE_FILE_DATA;
+		err = mobilebackup2_send_raw(mobilebackup2, hdr, sizeof(hdr), &bytes);
 		if (err != MOBILEBACKUP2_E_SUCCESS) {
 			goto leave_proto_err;
 		}
-		if (bytes != 5) {
+		if (bytes != sizeof(hdr)) {
+			printf("Error: sent only %d of %d bytes\n", bytes, (int)sizeof(hdr));
 			goto leave_proto_err;
 		}
-
-		/* send file contents */
-		size_t r = fread(buf, 1, sizeof(buf), f);
-		if (r <= 0) {
-			printf("%s: read error\n", __func__);
-			errcode = errno;
-			goto leave;
-		}
-		err = mobilebackup2_send_raw(mobilebackup2, buf, r, &bytes);
+		err = mobilebackup2_send_file(mobilebackup2, fileno(f), (uint64_t)sent, length, &bytes);
 		if (err != MOBILEBACKUP2_E_SUCCESS) {
 			goto leave_proto_err;
 		}
-		if (bytes != (uint32_t)r) {
-			printf("Error: sent only %d of %d bytes\n", bytes, (int)r);
+		if (bytes != length) {
+			/* the header is out already, so this can't be recovered from */
+			printf("Error: sent only %d of %d bytes of '%s'\n", bytes, length, localfile);
 			goto leave_proto_err;
 		}
-		sent += r;
+		sent += length;
 	} while (sent < total);
 	fclose(f);
 	f = NULL;
@@ -923,7 +1402,6 @@ leave:
 leave_proto_err:
 	if (f)
 		fclose(f);
-	free(localfile);
 	return result;
 }
 
@@ -933,11 +1411,13 @@ static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t
 	uint32_t i = 0;
 	uint32_t sent;
 	plist_t errplist = NULL;
+	struct path_builder paths;
 
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || (plist_array_get_size(message) < 2) || !backup_dir) return;
 
 	plist_t files = plist_array_get_item(message, 1);
 	cnt = plist_array_get_size(files);
+	path_builder_init(&paths, backup_dir, PATH_SEPARATOR);
 
 	for (i = 0; i < cnt; i++) {
 		plist_t val = plist_array_get_item(files, i);
@@ -949,7 +1429,7 @@ static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t
 		if (!str)
 			continue;
 
-		if (mb2_handle_send_file(mobilebackup2, backup_dir, str, &errplist) < 0) {
+		if (mb2_handle_send_file(mobilebackup2, &paths, str, &errplist) < 0) {
 			free(str);
 			//printf("Error when sending file '%s' to device\n", str);
 			// TODO: perhaps we can continue, we've got a multi status response?!
@@ -957,6 +1437,7 @@ static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t
 		}
 		free(str);
 	}
+	path_builder_free(&paths);
 
 	/* send terminating 0 dword */
 	uint32_t zero = 0;
@@ -972,75 +1453,1187 @@ static void mb2_handle_send_files(mobilebackup2_client_t mobilebackup2, plist_t
 	}
 }
 
-static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
-{
-	uint32_t nlen = 0;
-	uint32_t rlen = 0;
+/* files received from the device are written to disk by these threads so
+ * that disk stalls don't stall the stream from the device */
+#define MB2_WRITER_THREADS 2
+#define MB2_WRITER_BUFFERS 16
+#define MB2_WRITER_BUFFER_SIZE (1024*1024)
+
+enum mb2_write_op_type {
+	MB2_WRITE_OPEN,
+	MB2_WRITE_DATA,
+	MB2_WRITE_CLOSE,
+	/* closes and removes a file that was not received completely */
+	MB2_WRITE_DISCARD
+};
 
-	do {
-		nlen = 0;
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
-		nlen = be32toh(nlen);
+struct mb2_write_op {
+	enum mb2_write_op_type type;
+	char *path;
+	char *data;
+	uint32_t length;
+	struct mb2_write_op *next;
+};
 
-		if ((nlen == 0) && (rlen == 4)) {
-			// a zero length means no more files to receive
-			return 0;
-		} else if(rlen == 0) {
-			// device needs more time, waiting...
-			continue;
-		} else if (nlen > 4096) {
-			// filename length is too large
-			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
-			return 0;
-		}
+#ifdef MB2_MULTI_DEVICE
+/* state shared by the sessions of a multi device backup, lives in memory mapped before forking */
+#define MB2_MULTI_MAX_DEVICES 64
+#define MB2_MULTI_MAX_BUFFERS (MB2_WRITER_BUFFERS * 4)
+/* one session may not hold more than this many buffers of the shared pool */
+#define MB2_MULTI_BUFFERS_PER_DEVICE (MB2_WRITER_BUFFERS * 2)
+
+enum mb2_device_state {
+	MB2_DEVICE_QUEUED = 0,
+	MB2_DEVICE_RUNNING,
+	MB2_DEVICE_DONE
+};
 
-		if (*filename != NULL) {
-			free(*filename);
-			*filename = NULL;
-		}
+struct mb2_shared_device {
+	char udid[64];
+	pid_t pid;
+	int state;
+	int status;
+	double progress;
+	unsigned int buffers_held;
+};
 
-		*filename = (char*)malloc(nlen+1);
+struct mb2_shared {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	/* disk write limit in bytes per second, 0 if unlimited */
+	uint64_t rate;
+	double tokens;
+	uint64_t last_refill;
+	/* buffer pool, the free list holds indexes into the buffer area */
+	char *buffer_area;
+	unsigned int num_buffers;
+	unsigned int num_free;
+	unsigned int free_list[MB2_MULTI_MAX_BUFFERS];
+	unsigned int num_devices;
+	struct mb2_shared_device devices[MB2_MULTI_MAX_DEVICES];
+};
 
-		rlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
-		if (rlen != nlen) {
-			printf("ERROR: %s: could not read filename\n", __func__);
-			return 0;
-		}
+static struct mb2_shared *shared = NULL;
+/* index of the device this process backs up, -1 in the parent */
+static int shared_slot = -1;
 
-		char* p = *filename;
-		p[rlen] = 0;
+static struct mb2_shared* mb2_shared_new(unsigned int num_buffers, uint64_t rate)
+{
+	pthread_mutexattr_t mattr;
+	pthread_condattr_t cattr;
+	unsigned int i;
 
-		break;
-	} while(1 && !quit_flag);
+	struct mb2_shared *sh = (struct mb2_shared*)mmap(NULL, sizeof(struct mb2_shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh == MAP_FAILED) {
+		return NULL;
+	}
+	memset(sh, '\0', sizeof(struct mb2_shared));
+	sh->buffer_area = (char*)mmap(NULL, (size_t)num_buffers * MB2_WRITER_BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (sh->buffer_area == MAP_FAILED) {
+		munmap(sh, sizeof(struct mb2_shared));
+		return NULL;
+	}
+	sh->num_buffers = num_buffers;
+	for (i = 0; i < num_buffers; i++) {
+		sh->free_list[sh->num_free++] = i;
+	}
+	sh->rate = rate;
+	sh->last_refill = time_monotonic_usec();
+
+	pthread_mutexattr_init(&mattr);
+	pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+	pthread_mutex_init(&sh->mutex, &mattr);
+	pthread_mutexattr_destroy(&mattr);
+	pthread_condattr_init(&cattr);
+	pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+	pthread_cond_init(&sh->cond, &cattr);
+	pthread_condattr_destroy(&cattr);
+
+	return sh;
+}
 
-	return nlen;
+static void mb2_shared_free(struct mb2_shared *sh)
+{
+	if (!sh) {
+		return;
+	}
+	pthread_cond_destroy(&sh->cond);
+	pthread_mutex_destroy(&sh->mutex);
+	munmap(sh->buffer_area, (size_t)sh->num_buffers * MB2_WRITER_BUFFER_SIZE);
+	munmap(sh, sizeof(struct mb2_shared));
 }
 
-static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+static char* mb2_shared_get_buffer(void)
 {
-	uint64_t backup_real_size = 0;
-	uint64_t backup_total_size = 0;
-	uint32_t blocksize;
-	uint32_t bdone;
-	uint32_t rlen;
-	uint32_t nlen = 0;
-	uint32_t r;
-	char buf[32768];
+	struct mb2_shared_device *dev = &shared->devices[shared_slot];
+
+	pthread_mutex_lock(&shared->mutex);
+	while (shared->num_free == 0 || dev->buffers_held >= MB2_MULTI_BUFFERS_PER_DEVICE) {
+		pthread_cond_wait(&shared->cond, &shared->mutex);
+	}
+	unsigned int idx = shared->free_list[--shared->num_free];
+	dev->buffers_held++;
+	pthread_mutex_unlock(&shared->mutex);
+
+	return shared->buffer_area + (size_t)idx * MB2_WRITER_BUFFER_SIZE;
+}
+
+static void mb2_shared_put_buffer(char *buf)
+{
+	pthread_mutex_lock(&shared->mutex);
+	shared->free_list[shared->num_free++] = (unsigned int)((buf - shared->buffer_area) / MB2_WRITER_BUFFER_SIZE);
+	shared->devices[shared_slot].buffers_held--;
+	pthread_cond_broadcast(&shared->cond);
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+static void mb2_shared_set_progress(double progress)
+{
+	if (!shared || shared_slot < 0) {
+		return;
+	}
+	pthread_mutex_lock(&shared->mutex);
+	shared->devices[shared_slot].progress = progress;
+	pthread_mutex_unlock(&shared->mutex);
+}
+
+/* token bucket over all sessions, the caller reserves its bytes and sleeps off any debt */
+static void mb2_shared_throttle(uint32_t length)
+{
+	if (!shared || shared->rate == 0) {
+		return;
+	}
+	pthread_mutex_lock(&shared->mutex);
+	uint64_t now = time_monotonic_usec();
+	shared->tokens += (double)(now - shared->last_refill) * shared->rate / 1000000.0;
+	if (shared->tokens > (double)shared->rate) {
+		/* allow bursts of up to one second */
+		shared->tokens = (double)shared->rate;
+	}
+	shared->last_refill = now;
+	shared->tokens -= length;
+	uint64_t wait = (shared->tokens < 0) ? (uint64_t)(-shared->tokens * 1000000.0 / shared->rate) : 0;
+	pthread_mutex_unlock(&shared->mutex);
+
+	if (wait > 0) {
+		usleep(wait);
+	}
+}
+#endif
+
+/* with --dedup received files are hashed and hardlinked to a content
+ * store shared by all devices in the backup directory */
+#define MB2_DEDUP_STORE_DIR "ContentStore"
+#define MB2_DEDUP_MIN_SIZE 4096
+
+static char *dedup_store = NULL;
+static char *dedup_device_dir = NULL;
+static char *dedup_index_path = NULL;
+/* path relative to the device directory -> SHA-256 of the content */
+static plist_t dedup_index = NULL;
+static unsigned int dedup_linked_files = 0;
+static uint64_t dedup_saved_bytes = 0;
+
+/* with --digests the SHA-1 of each received content file is computed while
+ * it is written and kept in this index in the device directory, so the backup
+ * can be checked against the manifest without reading it again */
+#define MB2_DIGEST_INDEX_FILE "Digests.plist"
+
+static char *digest_device_dir = NULL;
+static char *digest_index_path = NULL;
+/* path relative to the device directory -> dict with SHA1 and Size */
+static plist_t digest_index = NULL;
+static mutex_t digest_mutex;
+
+/* received files are recorded in a journal in the device directory. It is
+ * removed once the backup finished, after an interrupted backup it tells
+ * which files were received completely */
+#define MB2_CHECKPOINT_FILE "Checkpoint.journal"
+
+static FILE *checkpoint_file = NULL;
+static char *checkpoint_path = NULL;
+static char *checkpoint_device_dir = NULL;
+static mutex_t checkpoint_mutex;
+static int checkpoint_complete = 0;
+
+static const char* mb2_checkpoint_relative_path(const char *path)
+{
+	size_t len = strlen(checkpoint_device_dir);
+	if (strncmp(path, checkpoint_device_dir, len) == 0 && (path[len] == '/' || path[len] == '\\')) {
+		return path + len + 1;
+	}
+	return path;
+}
+
+static void mb2_checkpoint_open(const char *backup_directory, const char *udid)
+{
+	char line[1024];
+	unsigned int num_complete = 0;
+	unsigned int num_partial = 0;
+
+	checkpoint_device_dir = string_build_path(backup_directory, udid, NULL);
+	checkpoint_path = string_build_path(checkpoint_device_dir, MB2_CHECKPOINT_FILE, NULL);
+
+	FILE *f = fopen(checkpoint_path, "r");
+	if (f) {
+		while (fgets(line, sizeof(line), f)) {
+			if (line[0] == 'F') {
+				num_complete++;
+			} else if (line[0] == 'P') {
+				num_partial++;
+			}
+		}
+		fclose(f);
+		PRINT_VERBOSE(1, "Resuming interrupted backup, %u files were received completely before", num_complete);
+		if (num_partial > 0) {
+			PRINT_VERBOSE(1, " and %u partially received files were discarded", num_partial);
+		}
+		PRINT_VERBOSE(1, ".\n");
+	}
+
+	checkpoint_file = fopen(checkpoint_path, "a");
+	if (!checkpoint_file) {
+		printf("WARNING: Could not open checkpoint journal '%s'\n", checkpoint_path);
+		free(checkpoint_path);
+		checkpoint_path = NULL;
+		free(checkpoint_device_dir);
+		checkpoint_device_dir = NULL;
+		return;
+	}
+	mutex_init(&checkpoint_mutex);
+}
+
+/* type is 'F' for a complete file or 'P' for a partial one and its received size */
+static void mb2_checkpoint_add(char type, const char *path, uint64_t size)
+{
+	if (!checkpoint_file) {
+		return;
+	}
+	mutex_lock(&checkpoint_mutex);
+	fprintf(checkpoint_file, "%c %" PRIu64 " %s\n", type, size, mb2_checkpoint_relative_path(path));
+	fflush(checkpoint_file);
+	mutex_unlock(&checkpoint_mutex);
+}
+
+static void mb2_checkpoint_close(void)
+{
+	if (!checkpoint_file) {
+		return;
+	}
+	fclose(checkpoint_file);
+	checkpoint_file = NULL;
+	mutex_destroy(&checkpoint_mutex);
+	if (checkpoint_complete) {
+		remove_file(checkpoint_path);
+	}
+	free(checkpoint_path);
+	checkpoint_path = NULL;
+	free(checkpoint_device_dir);
+	checkpoint_device_dir = NULL;
+}
+
+struct mb2_file_writer;
+
+struct mb2_writer_thread {
+	struct mb2_file_writer *writer;
+	THREAD_T thread;
+	int started;
+	struct mb2_write_op *head;
+	struct mb2_write_op *tail;
+	FILE *f;
+	char *path;
+	/* index key of the current file if it is hashed, NULL otherwise */
+	const char *dedup_key;
+	uint64_t size;
+#ifdef HAVE_OPENSSL
+	SHA256_CTX sha256;
+#else
+	gcry_md_hd_t sha256;
+#endif
+	/* index key of the current file if its digest is recorded, NULL otherwise */
+	const char *digest_key;
+#ifdef HAVE_OPENSSL
+	SHA_CTX sha1;
+#else
+	gcry_md_hd_t sha1;
+#endif
+	/* MB2_COMPRESS_* state of the current file */
+	int compress;
+#ifdef HAVE_ZSTD
+	ZSTD_CCtx *zctx;
+	char *zbuf;
+	size_t zbuf_size;
+#endif
+};
+
+struct mb2_file_writer {
+	mutex_t mutex;
+	cond_t cond;
+	char *free_buffers[MB2_WRITER_BUFFERS];
+	int num_free;
+	int pending_ops;
+	int stopping;
+	int error;
+	char *error_path;
+	struct mb2_writer_thread threads[MB2_WRITER_THREADS];
+};
+
+static struct mb2_file_writer *file_writer = NULL;
+
+static void mb2_file_writer_set_error(struct mb2_file_writer *writer, int err, const char *path)
+{
+	mutex_lock(&writer->mutex);
+	if (!writer->error) {
+		writer->error = err;
+		writer->error_path = strdup(path);
+	}
+	mutex_unlock(&writer->mutex);
+}
+
+static int mb2_link_file(const char *existing, const char *newpath)
+{
+#ifdef WIN32
+	if (!CreateHardLinkA(newpath, existing, NULL)) {
+		errno = win32err_to_errno(GetLastError());
+		return -1;
+	}
+	return 0;
+#else
+	return link(existing, newpath);
+#endif
+}
+
+/* only content files in the subdirectories of the device directory are
+ * deduplicated, the plists directly in it are rewritten in place */
+static const char* mb2_dedup_key_for_path(const char *path)
+{
+	if (!dedup_store) {
+		return NULL;
+	}
+	return mb2_content_relative_path(dedup_device_dir, path);
+}
+
+static void mb2_dedup_hash_init(struct mb2_writer_thread *wt)
+{
+#ifdef HAVE_OPENSSL
+	SHA256_Init(&wt->sha256);
+#else
+	if (!wt->sha256) {
+		gcry_md_open(&wt->sha256, GCRY_MD_SHA256, 0);
+	} else {
+		gcry_md_reset(wt->sha256);
+	}
+	if (!wt->sha256) {
+		wt->dedup_key = NULL;
+	}
+#endif
+}
+
+static void mb2_dedup_hash_update(struct mb2_writer_thread *wt, const char *data, uint32_t length)
+{
+#ifdef HAVE_OPENSSL
+	SHA256_Update(&wt->sha256, data, length);
+#else
+	gcry_md_write(wt->sha256, data, length);
+#endif
+}
+
+static void mb2_dedup_hash_final(struct mb2_writer_thread *wt, char *hex)
+{
+	unsigned char hash[32];
+	int i;
+#ifdef HAVE_OPENSSL
+	SHA256_Final(hash, &wt->sha256);
+#else
+	memcpy(hash, gcry_md_read(wt->sha256, GCRY_MD_SHA256), sizeof(hash));
+#endif
+	for (i = 0; i < (int)sizeof(hash); i++) {
+		sprintf(hex + i*2, "%02x", hash[i]);
+	}
+}
+
+/* replaces the file just written with a hardlink to the stored copy of
+ * the same content, or adds it to the store if there is none yet */
+static void mb2_dedup_file(struct mb2_writer_thread *wt)
+{
+	struct mb2_file_writer *writer = wt->writer;
+	char hex[65];
+	char subdir[3];
+	int linked = 0;
+
+	mb2_dedup_hash_final(wt, hex);
+
+	subdir[0] = hex[0];
+	subdir[1] = hex[1];
+	subdir[2] = '\0';
+	char *dir = string_build_path(dedup_store, subdir, NULL);
+	mkdir_with_parents(dir, 0755);
+	char *stored = string_build_path(dir, hex, NULL);
+	free(dir);
+
+	if (mb2_link_file(wt->path, stored) < 0 && errno == EEXIST) {
+		char *tmp = string_concat(wt->path, ".dedup", NULL);
+		remove_file(tmp);
+		if (mb2_link_file(stored, tmp) == 0) {
+#ifdef WIN32
+			remove_file(wt->path);
+#endif
+			if (rename(tmp, wt->path) == 0) {
+				linked = 1;
+			} else {
+				remove_file(tmp);
+			}
+		}
+		free(tmp);
+	}
+	free(stored);
+
+	mutex_lock(&writer->mutex);
+	plist_dict_set_item(dedup_index, wt->dedup_key, plist_new_string(hex));
+	if (linked) {
+		dedup_linked_files++;
+		dedup_saved_bytes += wt->size;
+	}
+	mutex_unlock(&writer->mutex);
+}
+
+static void mb2_digest_begin(struct mb2_writer_thread *wt)
+{
+	wt->digest_key = (digest_index) ? mb2_content_relative_path(digest_device_dir, wt->path) : NULL;
+	if (!wt->digest_key) {
+		return;
+	}
+	/* the old entry is stale from here on */
+	mutex_lock(&digest_mutex);
+	plist_dict_remove_item(digest_index, wt->digest_key);
+	mutex_unlock(&digest_mutex);
+#ifdef HAVE_OPENSSL
+	SHA1_Init(&wt->sha1);
+#else
+	if (!wt->sha1) {
+		gcry_md_open(&wt->sha1, GCRY_MD_SHA1, 0);
+	} else {
+		gcry_md_reset(wt->sha1);
+	}
+	if (!wt->sha1) {
+		wt->digest_key = NULL;
+	}
+#endif
+}
+
+static void mb2_digest_update(struct mb2_writer_thread *wt, const char *data, uint32_t length)
+{
+	if (!wt->digest_key) {
+		return;
+	}
+#ifdef HAVE_OPENSSL
+	SHA1_Update(&wt->sha1, data, length);
+#else
+	gcry_md_write(wt->sha1, data, length);
+#endif
+}
+
+static void mb2_digest_end(struct mb2_writer_thread *wt)
+{
+	unsigned char hash[20];
+
+	if (!wt->digest_key) {
+		return;
+	}
+#ifdef HAVE_OPENSSL
+	SHA1_Final(hash, &wt->sha1);
+#else
+	memcpy(hash, gcry_md_read(wt->sha1, GCRY_MD_SHA1), sizeof(hash));
+#endif
+	plist_t entry = plist_new_dict();
+	plist_dict_set_item(entry, "SHA1", plist_new_data((const char*)hash, sizeof(hash)));
+	plist_dict_set_item(entry, "Size", plist_new_uint(wt->size));
+	mutex_lock(&digest_mutex);
+	plist_dict_set_item(digest_index, wt->digest_key, entry);
+	mutex_unlock(&digest_mutex);
+	wt->digest_key = NULL;
+}
+
+enum {
+	MB2_COMPRESS_OFF,
+	/* waiting for the first data to decide */
+	MB2_COMPRESS_PROBE,
+	MB2_COMPRESS_ON
+};
+
+#ifdef HAVE_ZSTD
+static int mb2_compress_stream(struct mb2_writer_thread *wt, const char *data, uint32_t length, ZSTD_EndDirective mode)
+{
+	ZSTD_inBuffer in = { data, length, 0 };
+	size_t remaining;
+
+	do {
+		ZSTD_outBuffer out = { wt->zbuf, wt->zbuf_size, 0 };
+		remaining = ZSTD_compressStream2(wt->zctx, &out, &in, mode);
+		if (ZSTD_isError(remaining)) {
+			errno = EIO;
+			return -1;
+		}
+		if (out.pos > 0 && fwrite(wt->zbuf, 1, out.pos, wt->f) != out.pos) {
+			return -1;
+		}
+	} while ((mode == ZSTD_e_end) ? (remaining > 0) : (in.pos < in.size));
+	return 0;
+}
+
+/* compresses the start of the file quickly to see if it is worth it */
+static int mb2_compress_probe(struct mb2_writer_thread *wt, const char *data, uint32_t length)
+{
+	if (!wt->zctx) {
+		wt->zbuf_size = ZSTD_CStreamOutSize();
+		if (wt->zbuf_size < ZSTD_compressBound(MB2_COMPRESS_PROBE_SIZE)) {
+			wt->zbuf_size = ZSTD_compressBound(MB2_COMPRESS_PROBE_SIZE);
+		}
+		wt->zbuf = (char*)malloc(wt->zbuf_size);
+		wt->zctx = ZSTD_createCCtx();
+		if (!wt->zbuf || !wt->zctx) {
+			free(wt->zbuf);
+			wt->zbuf = NULL;
+			ZSTD_freeCCtx(wt->zctx);
+			wt->zctx = NULL;
+			return 0;
+		}
+	}
+	if (length > MB2_COMPRESS_PROBE_SIZE) {
+		length = MB2_COMPRESS_PROBE_SIZE;
+	}
+	size_t size = ZSTD_compress(wt->zbuf, wt->zbuf_size, data, length, 1);
+	if (ZSTD_isError(size) || size + MB2_COMPRESS_MAGIC_LEN >= (size_t)length * MB2_COMPRESS_MAX_RATIO / 100) {
+		return 0;
+	}
+
+	ZSTD_CCtx_reset(wt->zctx, ZSTD_reset_session_and_parameters);
+	ZSTD_CCtx_setParameter(wt->zctx, ZSTD_c_compressionLevel, compress_level);
+	ZSTD_CCtx_setParameter(wt->zctx, ZSTD_c_nbWorkers, MB2_COMPRESS_WORKERS);
+	return 1;
+}
+#endif
+
+/* writes file data, compressing it if the file is stored compressed */
+static int mb2_file_writer_write(struct mb2_writer_thread *wt, const char *data, uint32_t length)
+{
+#ifdef HAVE_ZSTD
+	if (wt->compress == MB2_COMPRESS_PROBE) {
+		wt->compress = (mb2_compress_probe(wt, data, length)) ? MB2_COMPRESS_ON : MB2_COMPRESS_OFF;
+		if (wt->compress == MB2_COMPRESS_ON && fwrite(MB2_COMPRESS_MAGIC, 1, MB2_COMPRESS_MAGIC_LEN, wt->f) != MB2_COMPRESS_MAGIC_LEN) {
+			return -1;
+		}
+	}
+	if (wt->compress == MB2_COMPRESS_ON) {
+		return mb2_compress_stream(wt, data, length, ZSTD_e_continue);
+	}
+#endif
+	return (fwrite(data, 1, length, wt->f) == length) ? 0 : -1;
+}
+
+/* ends the compressed frame of the current file */
+static int mb2_file_writer_finish(struct mb2_writer_thread *wt)
+{
+#ifdef HAVE_ZSTD
+	if (wt->compress == MB2_COMPRESS_ON) {
+		wt->compress = MB2_COMPRESS_OFF;
+		return mb2_compress_stream(wt, NULL, 0, ZSTD_e_end);
+	}
+#endif
+	return 0;
+}
+
+/* a file that is still open was cut off by the end of the stream, don't leave it truncated */
+static void mb2_file_writer_discard_partial(struct mb2_writer_thread *wt)
+{
+	if (wt->f) {
+		fclose(wt->f);
+		wt->f = NULL;
+		mb2_checkpoint_add('P', wt->path, wt->size);
+		remove_file(wt->path);
+	}
+#ifdef HAVE_ZSTD
+	if (wt->compress == MB2_COMPRESS_ON) {
+		ZSTD_CCtx_reset(wt->zctx, ZSTD_reset_session_only);
+	}
+#endif
+	wt->compress = MB2_COMPRESS_OFF;
+	free(wt->path);
+	wt->path = NULL;
+	wt->dedup_key = NULL;
+	wt->digest_key = NULL;
+}
+
+static void mb2_file_writer_execute(struct mb2_writer_thread *wt, struct mb2_write_op *op)
+{
+	switch (op->type) {
+	case MB2_WRITE_OPEN:
+		free(wt->path);
+		wt->path = op->path;
+		op->path = NULL;
+		wt->size = 0;
+		wt->dedup_key = mb2_dedup_key_for_path(wt->path);
+		if (wt->dedup_key) {
+			/* the old entry is stale from here on */
+			mutex_lock(&wt->writer->mutex);
+			plist_dict_remove_item(dedup_index, wt->dedup_key);
+			mutex_unlock(&wt->writer->mutex);
+			mb2_dedup_hash_init(wt);
+		}
+		remove_file(wt->path);
+		wt->f = fopen(wt->path, "wb");
+		if (!wt->f) {
+			mb2_file_writer_set_error(wt->writer, errno, wt->path);
+		}
+		wt->compress = (mb2_compress_path(wt->path)) ? MB2_COMPRESS_PROBE : MB2_COMPRESS_OFF;
+		mb2_digest_begin(wt);
+		break;
+	case MB2_WRITE_DATA:
+#ifdef MB2_MULTI_DEVICE
+		if (wt->f) {
+			mb2_shared_throttle(op->length);
+		}
+#endif
+		if (wt->f && mb2_file_writer_write(wt, op->data, op->length) < 0) {
+			mb2_file_writer_set_error(wt->writer, errno, wt->path);
+			fclose(wt->f);
+			wt->f = NULL;
+		}
+		if (wt->f) {
+			wt->size += op->length;
+			if (wt->dedup_key) {
+				mb2_dedup_hash_update(wt, op->data, op->length);
+			}
+			mb2_digest_update(wt, op->data, op->length);
+		}
+		break;
+	case MB2_WRITE_CLOSE:
+		if (wt->f) {
+			if (mb2_file_writer_finish(wt) < 0) {
+				mb2_file_writer_set_error(wt->writer, errno, wt->path);
+				fclose(wt->f);
+			} else if (fclose(wt->f) != 0) {
+				mb2_file_writer_set_error(wt->writer, errno, wt->path);
+			} else {
+				if (wt->dedup_key && wt->size >= MB2_DEDUP_MIN_SIZE) {
+					mb2_dedup_file(wt);
+				}
+				mb2_digest_end(wt);
+				mb2_checkpoint_add('F', wt->path, wt->size);
+			}
+			wt->f = NULL;
+		}
+		break;
+	case MB2_WRITE_DISCARD:
+		mb2_file_writer_discard_partial(wt);
+		break;
+	default:
+		break;
+	}
+}
+
+static void* mb2_file_writer_thread(void *arg)
+{
+	struct mb2_writer_thread *wt = (struct mb2_writer_thread*)arg;
+	struct mb2_file_writer *writer = wt->writer;
+
+	while (1) {
+		mutex_lock(&writer->mutex);
+		while (!wt->head && !writer->stopping) {
+			cond_wait(&writer->cond, &writer->mutex);
+		}
+		struct mb2_write_op *op = wt->head;
+		if (!op) {
+			mutex_unlock(&writer->mutex);
+			break;
+		}
+		wt->head = op->next;
+		if (!wt->head) {
+			wt->tail = NULL;
+		}
+		mutex_unlock(&writer->mutex);
+
+		mb2_file_writer_execute(wt, op);
+
+#ifdef MB2_MULTI_DEVICE
+		if (op->data && shared) {
+			mb2_shared_put_buffer(op->data);
+			op->data = NULL;
+		}
+#endif
+		mutex_lock(&writer->mutex);
+		if (op->data) {
+			writer->free_buffers[writer->num_free++] = op->data;
+		}
+		writer->pending_ops--;
+		cond_broadcast(&writer->cond);
+		mutex_unlock(&writer->mutex);
+
+		free(op->path);
+		free(op);
+	}
+
+	mb2_file_writer_discard_partial(wt);
+
+	return NULL;
+}
+
+static int mb2_file_writer_uses_shared_pool(void)
+{
+#ifdef MB2_MULTI_DEVICE
+	return (shared != NULL);
+#else
+	return 0;
+#endif
+}
+
+static struct mb2_file_writer* mb2_file_writer_new(void)
+{
+	int i;
+	struct mb2_file_writer *writer = (struct mb2_file_writer*)calloc(1, sizeof(struct mb2_file_writer));
+	if (!writer) {
+		return NULL;
+	}
+	mutex_init(&writer->mutex);
+	cond_init(&writer->cond);
+	/* sessions of a multi device backup take their buffers from the shared pool */
+	for (i = 0; i < MB2_WRITER_BUFFERS && !mb2_file_writer_uses_shared_pool(); i++) {
+		char *buf = (char*)malloc(MB2_WRITER_BUFFER_SIZE);
+		if (!buf) {
+			break;
+		}
+		writer->free_buffers[writer->num_free++] = buf;
+	}
+	if (writer->num_free == 0 && !mb2_file_writer_uses_shared_pool()) {
+		cond_destroy(&writer->cond);
+		mutex_destroy(&writer->mutex);
+		free(writer);
+		return NULL;
+	}
+	/* ops for a thread that could not be started are executed inline */
+	for (i = 0; i < MB2_WRITER_THREADS; i++) {
+		writer->threads[i].writer = writer;
+		if (thread_new(&writer->threads[i].thread, mb2_file_writer_thread, &writer->threads[i]) == 0) {
+			writer->threads[i].started = 1;
+		} else {
+			PRINT_VERBOSE(1, "Could not start file writer thread, writing files synchronously\n");
+		}
+	}
+	return writer;
+}
+
+static void mb2_file_writer_free(struct mb2_file_writer *writer)
+{
+	int i;
+
+	if (!writer) {
+		return;
+	}
+	mutex_lock(&writer->mutex);
+	writer->stopping = 1;
+	cond_broadcast(&writer->cond);
+	mutex_unlock(&writer->mutex);
+
+	for (i = 0; i < MB2_WRITER_THREADS; i++) {
+		struct mb2_writer_thread *wt = &writer->threads[i];
+		if (wt->started) {
+			thread_join(wt->thread);
+			thread_free(wt->thread);
+		} else {
+			mb2_file_writer_discard_partial(wt);
+		}
+#ifndef HAVE_OPENSSL
+		if (wt->sha256) {
+			gcry_md_close(wt->sha256);
+		}
+		if (wt->sha1) {
+			gcry_md_close(wt->sha1);
+		}
+#endif
+#ifdef HAVE_ZSTD
+		ZSTD_freeCCtx(wt->zctx);
+		free(wt->zbuf);
+#endif
+	}
+	while (writer->num_free > 0) {
+		free(writer->free_buffers[--writer->num_free]);
+	}
+	free(writer->error_path);
+	cond_destroy(&writer->cond);
+	mutex_destroy(&writer->mutex);
+	free(writer);
+}
+
+/* blocks until a buffer is free, limiting how far the stream can get ahead of the disk */
+static char* mb2_file_writer_get_buffer(struct mb2_file_writer *writer)
+{
+#ifdef MB2_MULTI_DEVICE
+	if (shared) {
+		return mb2_shared_get_buffer();
+	}
+#endif
+	mutex_lock(&writer->mutex);
+	while (writer->num_free == 0) {
+		cond_wait(&writer->cond, &writer->mutex);
+	}
+	char *buf = writer->free_buffers[--writer->num_free];
+	mutex_unlock(&writer->mutex);
+	return buf;
+}
+
+static void mb2_file_writer_put_buffer(struct mb2_file_writer *writer, char *buf)
+{
+#ifdef MB2_MULTI_DEVICE
+	if (shared) {
+		mb2_shared_put_buffer(buf);
+		return;
+	}
+#endif
+	mutex_lock(&writer->mutex);
+	writer->free_buffers[writer->num_free++] = buf;
+	cond_broadcast(&writer->cond);
+	mutex_unlock(&writer->mutex);
+}
+
+static void mb2_file_writer_submit(struct mb2_file_writer *writer, int thread_idx, enum mb2_write_op_type type, char *path, char *data, uint32_t length)
+{
+	struct mb2_write_op *op = (struct mb2_write_op*)calloc(1, sizeof(struct mb2_write_op));
+	if (!op) {
+		mb2_file_writer_set_error(writer, ENOMEM, (path) ? path : "");
+		free(path);
+		if (data) {
+			mb2_file_writer_put_buffer(writer, data);
+		}
+		return;
+	}
+	op->type = type;
+	op->path = path;
+	op->data = data;
+	op->length = length;
+
+	struct mb2_writer_thread *wt = &writer->threads[thread_idx];
+	if (!wt->started) {
+		mb2_file_writer_execute(wt, op);
+		if (op->data) {
+			mb2_file_writer_put_buffer(writer, op->data);
+		}
+		free(op->path);
+		free(op);
+		return;
+	}
+	mutex_lock(&writer->mutex);
+	if (wt->tail) {
+		wt->tail->next = op;
+	} else {
+		wt->head = op;
+	}
+	wt->tail = op;
+	writer->pending_ops++;
+	cond_broadcast(&writer->cond);
+	mutex_unlock(&writer->mutex);
+}
+
+/* waits until everything submitted so far has been written */
+static void mb2_file_writer_flush(struct mb2_file_writer *writer)
+{
+	mutex_lock(&writer->mutex);
+	while (writer->pending_ops > 0) {
+		cond_wait(&writer->cond, &writer->mutex);
+	}
+	mutex_unlock(&writer->mutex);
+}
+
+/* returns the first write error (an errno value) and clears it */
+static int mb2_file_writer_take_error(struct mb2_file_writer *writer, char **path)
+{
+	mutex_lock(&writer->mutex);
+	int err = writer->error;
+	*path = writer->error_path;
+	writer->error = 0;
+	writer->error_path = NULL;
+	mutex_unlock(&writer->mutex);
+	return err;
+}
+
+static void mb2_dedup_init(const char *backup_directory, const char *udid)
+{
+	dedup_store = string_build_path(backup_directory, MB2_DEDUP_STORE_DIR, NULL);
+	if (mkdir_with_parents(dedup_store, 0755) < 0) {
+		printf("WARNING: Could not create content store '%s', not deduplicating files\n", dedup_store);
+		free(dedup_store);
+		dedup_store = NULL;
+		return;
+	}
+	dedup_device_dir = string_build_path(backup_directory, udid, NULL);
+	char *index_name = string_concat(udid, ".plist", NULL);
+	dedup_index_path = string_build_path(dedup_store, index_name, NULL);
+	free(index_name);
+
+	plist_read_from_filename(&dedup_index, dedup_index_path);
+	if (dedup_index && plist_get_node_type(dedup_index) != PLIST_DICT) {
+		plist_free(dedup_index);
+		dedup_index = NULL;
+	}
+	if (!dedup_index) {
+		dedup_index = plist_new_dict();
+	}
+}
+
+static void mb2_dedup_finish(void)
+{
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+	plist_t stale = NULL;
+	struct stat st;
+	uint32_t i;
+
+	if (!dedup_store) {
+		return;
+	}
+
+	/* drop entries of files the device removed or moved away */
+	stale = plist_new_array();
+	plist_dict_new_iter(dedup_index, &iter);
+	if (iter) {
+		plist_dict_next_item(dedup_index, iter, &key, &node);
+		while (node) {
+			char *path = string_build_path(dedup_device_dir, key, NULL);
+			if (stat(path, &st) != 0) {
+				plist_array_append_item(stale, plist_new_string(key));
+			}
+			free(path);
+			free(key);
+			key = NULL;
+			node = NULL;
+			plist_dict_next_item(dedup_index, iter, &key, &node);
+		}
+		free(iter);
+	}
+	for (i = 0; i < plist_array_get_size(stale); i++) {
+		char *skey = NULL;
+		plist_get_string_val(plist_array_get_item(stale, i), &skey);
+		plist_dict_remove_item(dedup_index, skey);
+		free(skey);
+	}
+	plist_free(stale);
+
+	if (!plist_write_to_filename(dedup_index, dedup_index_path, PLIST_FORMAT_BINARY)) {
+		printf("WARNING: Could not write content index '%s'\n", dedup_index_path);
+	}
+
+	if (dedup_linked_files > 0) {
+		char *format_size = string_format_size(dedup_saved_bytes);
+		PRINT_VERBOSE(1, "Deduplicated %u files, saving %s.\n", dedup_linked_files, format_size);
+		free(format_size);
+	}
+
+	plist_free(dedup_index);
+	dedup_index = NULL;
+	free(dedup_index_path);
+	dedup_index_path = NULL;
+	free(dedup_device_dir);
+	dedup_device_dir = NULL;
+	free(dedup_store);
+	dedup_store = NULL;
+}
+
+static void mb2_digest_init(const char *backup_directory, const char *udid)
+{
+	digest_device_dir = string_build_path(backup_directory, udid, NULL);
+	digest_index_path = string_build_path(digest_device_dir, MB2_DIGEST_INDEX_FILE, NULL);
+
+	/* files not sent again by an incremental backup keep their entries */
+	plist_read_from_filename(&digest_index, digest_index_path);
+	if (digest_index && plist_get_node_type(digest_index) != PLIST_DICT) {
+		plist_free(digest_index);
+		digest_index = NULL;
+	}
+	if (!digest_index) {
+		digest_index = plist_new_dict();
+	}
+	mutex_init(&digest_mutex);
+}
+
+/* keeps the entries of moved files and directories */
+static void mb2_digest_move(const char *oldpath, const char *newpath)
+{
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+	plist_t moved = NULL;
+	size_t len;
+	uint32_t i;
+
+	if (!digest_index) {
+		return;
+	}
+	len = strlen(digest_device_dir);
+	if (strncmp(oldpath, digest_device_dir, len) != 0 || strncmp(newpath, digest_device_dir, len) != 0 || !oldpath[len] || !oldpath[len+1] || !newpath[len] || !newpath[len+1]) {
+		return;
+	}
+	const char *oldrel = oldpath + len + 1;
+	const char *newrel = newpath + len + 1;
+	size_t oldlen = strlen(oldrel);
+
+	mutex_lock(&digest_mutex);
+	moved = plist_new_array();
+	plist_dict_new_iter(digest_index, &iter);
+	if (iter) {
+		plist_dict_next_item(digest_index, iter, &key, &node);
+		while (node) {
+			if (strncmp(key, oldrel, oldlen) == 0 && (key[oldlen] == '\0' || key[oldlen] == '/' || key[oldlen] == '\\')) {
+				plist_array_append_item(moved, plist_new_string(key));
+			}
+			free(key);
+			key = NULL;
+			node = NULL;
+			plist_dict_next_item(digest_index, iter, &key, &node);
+		}
+		free(iter);
+	}
+	for (i = 0; i < plist_array_get_size(moved); i++) {
+		char *mkey = NULL;
+		plist_get_string_val(plist_array_get_item(moved, i), &mkey);
+		char *nkey = string_concat(newrel, mkey + oldlen, NULL);
+		plist_dict_set_item(digest_index, nkey, plist_copy(plist_dict_get_item(digest_index, mkey)));
+		plist_dict_remove_item(digest_index, mkey);
+		free(nkey);
+		free(mkey);
+	}
+	plist_free(moved);
+	mutex_unlock(&digest_mutex);
+}
+
+static void mb2_digest_finish(void)
+{
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+	plist_t stale = NULL;
+	struct stat st;
+	uint32_t i;
+
+	if (!digest_index) {
+		return;
+	}
+
+	/* drop entries of files the device removed */
+	stale = plist_new_array();
+	plist_dict_new_iter(digest_index, &iter);
+	if (iter) {
+		plist_dict_next_item(digest_index, iter, &key, &node);
+		while (node) {
+			char *path = string_build_path(digest_device_dir, key, NULL);
+			if (stat(path, &st) != 0) {
+				plist_array_append_item(stale, plist_new_string(key));
+			}
+			free(path);
+			free(key);
+			key = NULL;
+			node = NULL;
+			plist_dict_next_item(digest_index, iter, &key, &node);
+		}
+		free(iter);
+	}
+	for (i = 0; i < plist_array_get_size(stale); i++) {
+		char *skey = NULL;
+		plist_get_string_val(plist_array_get_item(stale, i), &skey);
+		plist_dict_remove_item(digest_index, skey);
+		free(skey);
+	}
+	plist_free(stale);
+
+	if (!plist_write_to_filename(digest_index, digest_index_path, PLIST_FORMAT_BINARY)) {
+		printf("WARNING: Could not write digest index '%s'\n", digest_index_path);
+	}
+
+	plist_free(digest_index);
+	digest_index = NULL;
+	mutex_destroy(&digest_mutex);
+	free(digest_index_path);
+	digest_index_path = NULL;
+	free(digest_device_dir);
+	digest_device_dir = NULL;
+}
+
+static int mb2_receive_filename(mobilebackup2_client_t mobilebackup2, char** filename)
+{
+	uint32_t nlen = 0;
+	uint32_t rlen = 0;
+
+	do {
+		nlen = 0;
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &rlen);
+		nlen = be32toh(nlen);
+
+		if ((nlen == 0) && (rlen == 4)) {
+			// a zero length means no more files to receive
+			return 0;
+		} else if(rlen == 0) {
+			// device needs more time, waiting...
+			continue;
+		} else if (nlen > 4096) {
+			// filename length is too large
+			printf("ERROR: %s: too large filename length (%d)!\n", __func__, nlen);
+			return 0;
+		}
+
+		if (*filename != NULL) {
+			free(*filename);
+			*filename = NULL;
+		}
+
+		*filename = (char*)malloc(nlen+1);
+
+		rlen = 0;
+		mobilebackup2_receive_raw(mobilebackup2, *filename, nlen, &rlen);
+		if (rlen != nlen) {
+			printf("ERROR: %s: could not read filename\n", __func__);
+			return 0;
+		}
+
+		char* p = *filename;
+		p[rlen] = 0;
+
+		break;
+	} while(1 && !quit_flag);
+
+	return nlen;
+}
+
+static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
+{
+	uint64_t backup_real_size = 0;
+	uint64_t backup_total_size = 0;
+	uint32_t blen = 0;
+	uint32_t nlen = 0;
+	uint32_t done;
+	uint32_t rlen;
+	char *data = NULL;
+	char *buf = NULL;
+	uint32_t buf_used = 0;
+	int writer_idx = 0;
+	int write_err = 0;
+	char *write_err_path = NULL;
+	int partial = 0;
 	char *fname = NULL;
 	char *dname = NULL;
-	char *bname = NULL;
+	const char *bname = NULL;
+	struct path_builder paths;
 	char code = 0;
 	char last_code = 0;
 	plist_t node = NULL;
-	FILE *f = NULL;
 	unsigned int file_count = 0;
 	int errcode = 0;
 	char *errdesc = NULL;
+	mobilebackup2_error_t err;
 
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 4 || !backup_dir) return 0;
 
+	path_builder_init(&paths, backup_dir, PATH_SEPARATOR);
+
 	node = plist_array_get_item(message, 3);
 	if (plist_get_node_type(node) == PLIST_UINT) {
 		plist_get_uint_val(node, &backup_total_size);
@@ -1049,6 +2642,16 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 		PRINT_VERBOSE(1, "Receiving files\n");
 	}
 
+	if (!file_writer) {
+		file_writer = mb2_file_writer_new();
+	}
+	if (!file_writer) {
+		printf("ERROR: %s: could not allocate file buffers\n", __func__);
+		errcode = errno_to_device_error(ENOMEM);
+		errdesc = strerror(ENOMEM);
+		goto leave;
+	}
+
 	do {
 		if (quit_flag)
 			break;
@@ -1063,33 +2666,23 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 			break;
 		}
 
-		if (bname != NULL) {
-			free(bname);
-			bname = NULL;
-		}
-
-		bname = string_build_path(backup_dir, fname, NULL);
+		bname = path_builder_build(&paths, fname, NULL);
 
 		if (fname != NULL) {
 			free(fname);
 			fname = NULL;
 		}
-
-		r = 0;
-		nlen = 0;
-		mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-		if (r != 4) {
-			printf("ERROR: %s: could not receive code length!\n", __func__);
+		if (!bname) {
 			break;
 		}
-		nlen = be32toh(nlen);
 
 		last_code = code;
-		code = 0;
-
-		mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-		if (r != 1) {
-			printf("ERROR: %s: could not receive code!\n", __func__);
+		err = mobilebackup2_receive_block(mobilebackup2, NULL, 0, &data, &blen, &code);
+		if (err != MOBILEBACKUP2_E_SUCCESS) {
+			printf("ERROR: %s: could not receive file data (%d)!\n", __func__, err);
+			break;
+		}
+		if (!data) {
 			break;
 		}
 
@@ -1098,85 +2691,100 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 			PRINT_VERBOSE(1, "Found new flag %02x\n", code);
 		}
 
-		remove_file(bname);
-		f = fopen(bname, "wb");
-		while (f && (code == CODE_FILE_DATA)) {
-			blocksize = nlen-1;
-			bdone = 0;
-			rlen = 0;
-			while (bdone < blocksize) {
-				if ((blocksize - bdone) < sizeof(buf)) {
-					rlen = blocksize - bdone;
-				} else {
-					rlen = sizeof(buf);
+		/* report open and write failures of earlier files before starting the next one */
+		write_err = mb2_file_writer_take_error(file_writer, &write_err_path);
+		if (write_err) {
+			break;
+		}
+
+		/* consecutive files go to different writer threads, the ops of one file stay in order */
+		writer_idx = (writer_idx + 1) % MB2_WRITER_THREADS;
+		mb2_file_writer_submit(file_writer, writer_idx, MB2_WRITE_OPEN, strdup(bname), NULL, 0);
+		partial = 1;
+		while (code == CODE_FILE_DATA) {
+			done = 0;
+			while (done < blen) {
+				if (!buf) {
+					buf = mb2_file_writer_get_buffer(file_writer);
+					buf_used = 0;
 				}
-				mobilebackup2_receive_raw(mobilebackup2, buf, rlen, &r);
-				if ((int)r <= 0) {
-					break;
+				rlen = blen - done;
+				if (rlen > MB2_WRITER_BUFFER_SIZE - buf_used) {
+					rlen = MB2_WRITER_BUFFER_SIZE - buf_used;
+				}
+				memcpy(buf + buf_used, data + done, rlen);
+				buf_used += rlen;
+				done += rlen;
+				if (buf_used == MB2_WRITER_BUFFER_SIZE) {
+					mb2_file_writer_submit(file_writer, writer_idx, MB2_WRITE_DATA, NULL, buf, buf_used);
+					buf = NULL;
 				}
-				fwrite(buf, 1, r, f);
-				bdone += r;
-			}
-			if (bdone == blocksize) {
-				backup_real_size += blocksize;
 			}
+			backup_real_size += blen;
 			if (backup_total_size > 0) {
 				print_progress(backup_real_size, backup_total_size);
 			}
 			if (quit_flag)
 				break;
-			nlen = 0;
-			mobilebackup2_receive_raw(mobilebackup2, (char*)&nlen, 4, &r);
-			nlen = be32toh(nlen);
-			if (nlen > 0) {
-				last_code = code;
-				mobilebackup2_receive_raw(mobilebackup2, &code, 1, &r);
-			} else {
+			last_code = code;
+			err = mobilebackup2_receive_block(mobilebackup2, NULL, 0, &data, &blen, &code);
+			if (err != MOBILEBACKUP2_E_SUCCESS) {
+				printf("ERROR: %s: could not receive file data (%d)!\n", __func__, err);
+				data = NULL;
+			}
+			if (!data) {
 				break;
 			}
 		}
-		if (f) {
-			fclose(f);
-			file_count++;
-		} else {
-			errcode = errno_to_device_error(errno);
-			errdesc = strerror(errno);
-			printf("Error opening '%s' for writing: %s\n", bname, errdesc);
-			break;
+		if (buf) {
+			if (buf_used > 0) {
+				mb2_file_writer_submit(file_writer, writer_idx, MB2_WRITE_DATA, NULL, buf, buf_used);
+			} else {
+				mb2_file_writer_put_buffer(file_writer, buf);
+			}
+			buf = NULL;
 		}
-		if (nlen == 0) {
+		/* the file is only complete if its terminating block arrived */
+		partial = (code == CODE_FILE_DATA || !data);
+		mb2_file_writer_submit(file_writer, writer_idx, (partial) ? MB2_WRITE_DISCARD : MB2_WRITE_CLOSE, NULL, NULL, 0);
+		if (partial) {
 			break;
 		}
+		file_count++;
 
 		/* check if an error message was received */
 		if (code == CODE_ERROR_REMOTE) {
-			/* error message */
-			char *msg = (char*)malloc(nlen);
-			mobilebackup2_receive_raw(mobilebackup2, msg, nlen-1, &r);
-			msg[r] = 0;
 			/* If sent using CODE_FILE_DATA, end marker will be CODE_ERROR_REMOTE which is not an error! */
 			if (last_code != CODE_FILE_DATA) {
-				fprintf(stdout, "\nReceived an error message from device: %s\n", msg);
+				fprintf(stdout, "\nReceived an error message from device: %.*s\n", (int)blen, data);
 			}
-			free(msg);
 		}
 	} while (1);
 
 	if (fname != NULL)
 		free(fname);
 
-	/* if there are leftovers to read, finish up cleanly */
-	if ((int)nlen-1 > 0) {
-		PRINT_VERBOSE(1, "\nDiscarding current data hunk.\n");
-		fname = (char*)malloc(nlen-1);
-		mobilebackup2_receive_raw(mobilebackup2, fname, nlen-1, &r);
-		free(fname);
-		remove_file(bname);
+	/* everything has to be on disk before the device is told about the result */
+	mb2_file_writer_flush(file_writer);
+	if (!write_err) {
+		write_err = mb2_file_writer_take_error(file_writer, &write_err_path);
+	}
+	if (write_err) {
+		errcode = errno_to_device_error(write_err);
+		errdesc = strerror(write_err);
+		printf("Error writing '%s': %s\n", (write_err_path) ? write_err_path : "", errdesc);
+		file_count--;
+		free(write_err_path);
+	}
+
+	/* the writer removed the partially received file */
+	if (partial) {
+		PRINT_VERBOSE(1, "\nDiscarded incomplete file.\n");
 	}
 
+leave:
 	/* clean up */
-	if (bname != NULL)
-		free(bname);
+	path_builder_free(&paths);
 
 	if (dname != NULL)
 		free(dname);
@@ -1188,6 +2796,166 @@ static int mb2_handle_receive_files(mobilebackup2_client_t mobilebackup2, plist_
 	return file_count;
 }
 
+static plist_t mb2_list_directory(const char *path)
+{
+	plist_t dirlist = plist_new_dict();
+
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT)
+	int dfd = open(path, O_RDONLY | O_DIRECTORY);
+	DIR *cur_dir = (dfd < 0) ? NULL : fdopendir(dfd);
+	if (!cur_dir && dfd >= 0) {
+		close(dfd);
+	}
+#else
+	DIR *cur_dir = opendir(path);
+	struct path_builder paths;
+	path_builder_init(&paths, path, PATH_SEPARATOR);
+#endif
+	if (cur_dir) {
+		struct dirent* ep;
+		while ((ep = readdir(cur_dir))) {
+			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
+				continue;
+			}
+			plist_t fdict = plist_new_dict();
+			struct stat st;
+			memset(&st, '\0', sizeof(st));
+#if defined(HAVE_FDOPENDIR) && defined(HAVE_FSTATAT)
+			fstatat(dirfd(cur_dir), ep->d_name, &st, 0);
+#else
+			const char *fpath = path_builder_build(&paths, ep->d_name, NULL);
+			if (fpath) {
+				stat(fpath, &st);
+			}
+#endif
+			const char *ftype = "DLFileTypeUnknown";
+			if (S_ISDIR(st.st_mode)) {
+				ftype = "DLFileTypeDirectory";
+			} else if (S_ISREG(st.st_mode)) {
+				ftype = "DLFileTypeRegular";
+			}
+			plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
+			plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
+			plist_dict_set_item(fdict, "DLFileModificationDate",
+					    plist_new_date(st.st_mtime - MAC_EPOCH, 0));
+
+			plist_dict_set_item(dirlist, ep->d_name, fdict);
+		}
+		closedir(cur_dir);
+	}
+#if !defined(HAVE_FDOPENDIR) || !defined(HAVE_FSTATAT)
+	path_builder_free(&paths);
+#endif
+
+	return dirlist;
+}
+
+/* drops all prefetched listings, called before anything is modified */
+static void mb2_dir_cache_invalidate(void)
+{
+	if (!fs_pool) {
+		return;
+	}
+	mutex_lock(&fs_pool->mutex);
+	fs_pool->dir_cache_generation++;
+	if (plist_dict_get_size(fs_pool->dir_cache) > 0) {
+		plist_free(fs_pool->dir_cache);
+		fs_pool->dir_cache = plist_new_dict();
+	}
+	mutex_unlock(&fs_pool->mutex);
+}
+
+static plist_t mb2_dir_cache_take(const char *path)
+{
+	plist_t listing = NULL;
+
+	if (!fs_pool) {
+		return NULL;
+	}
+	mutex_lock(&fs_pool->mutex);
+	plist_t node = plist_dict_get_item(fs_pool->dir_cache, path);
+	if (node) {
+		listing = plist_copy(node);
+		plist_dict_remove_item(fs_pool->dir_cache, path);
+	}
+	mutex_unlock(&fs_pool->mutex);
+
+	return listing;
+}
+
+struct mb2_prefetch_job {
+	char *path;
+	unsigned int generation;
+};
+
+static void mb2_prefetch_job(void *data)
+{
+	struct mb2_prefetch_job *job = (struct mb2_prefetch_job*)data;
+	struct mb2_fs_pool *pool = fs_pool;
+	plist_t listing = NULL;
+
+	mutex_lock(&pool->mutex);
+	int wanted = (job->generation == pool->dir_cache_generation)
+		&& (plist_dict_get_size(pool->dir_cache) < MB2_DIR_CACHE_SIZE)
+		&& !plist_dict_get_item(pool->dir_cache, job->path);
+	mutex_unlock(&pool->mutex);
+
+	if (wanted) {
+		listing = mb2_list_directory(job->path);
+		mutex_lock(&pool->mutex);
+		/* a modification since the job was queued makes the listing stale */
+		if (job->generation == pool->dir_cache_generation && !plist_dict_get_item(pool->dir_cache, job->path)) {
+			plist_dict_set_item(pool->dir_cache, job->path, listing);
+			listing = NULL;
+		}
+		mutex_unlock(&pool->mutex);
+		plist_free(listing);
+	}
+	free(job->path);
+	free(job);
+}
+
+/* the device tends to walk down the tree, so list the subdirectories ahead */
+static void mb2_dir_prefetch_subdirectories(const char *path, plist_t dirlist)
+{
+	struct mb2_fs_pool *pool = mb2_fs_pool_get();
+	plist_dict_iter iter = NULL;
+	char *key = NULL;
+	plist_t node = NULL;
+	int count = 0;
+
+	if (!pool || pool->num_threads == 0) {
+		return;
+	}
+	plist_dict_new_iter(dirlist, &iter);
+	if (!iter) {
+		return;
+	}
+	plist_dict_next_item(dirlist, iter, &key, &node);
+	while (node && count < MB2_DIR_PREFETCH_MAX) {
+		char *ftype = NULL;
+		plist_get_string_val(plist_dict_get_item(node, "DLFileType"), &ftype);
+		if (ftype && !strcmp(ftype, "DLFileTypeDirectory")) {
+			struct mb2_prefetch_job *job = (struct mb2_prefetch_job*)malloc(sizeof(struct mb2_prefetch_job));
+			if (job) {
+				job->path = string_build_path(path, key, NULL);
+				mutex_lock(&pool->mutex);
+				job->generation = pool->dir_cache_generation;
+				mutex_unlock(&pool->mutex);
+				mb2_fs_pool_submit(mb2_prefetch_job, job);
+				count++;
+			}
+		}
+		free(ftype);
+		free(key);
+		key = NULL;
+		node = NULL;
+		plist_dict_next_item(dirlist, iter, &key, &node);
+	}
+	free(key);
+	free(iter);
+}
+
 static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
 {
 	if (!message || (plist_get_node_type(message) != PLIST_ARRAY) || plist_array_get_size(message) < 2 || !backup_dir) return;
@@ -1206,45 +2974,20 @@ static void mb2_handle_list_directory(mobilebackup2_client_t mobilebackup2, plis
 	char *path = string_build_path(backup_dir, str, NULL);
 	free(str);
 
-	plist_t dirlist = plist_new_dict();
-
-	DIR* cur_dir = opendir(path);
-	if (cur_dir) {
-		struct dirent* ep;
-		while ((ep = readdir(cur_dir))) {
-			if ((strcmp(ep->d_name, ".") == 0) || (strcmp(ep->d_name, "..") == 0)) {
-				continue;
-			}
-			char *fpath = string_build_path(path, ep->d_name, NULL);
-			if (fpath) {
-				plist_t fdict = plist_new_dict();
-				struct stat st;
-				stat(fpath, &st);
-				const char *ftype = "DLFileTypeUnknown";
-				if (S_ISDIR(st.st_mode)) {
-					ftype = "DLFileTypeDirectory";
-				} else if (S_ISREG(st.st_mode)) {
-					ftype = "DLFileTypeRegular";
-				}
-				plist_dict_set_item(fdict, "DLFileType", plist_new_string(ftype));
-				plist_dict_set_item(fdict, "DLFileSize", plist_new_uint(st.st_size));
-				plist_dict_set_item(fdict, "DLFileModificationDate",
-						    plist_new_date(st.st_mtime - MAC_EPOCH, 0));
-
-				plist_dict_set_item(dirlist, ep->d_name, fdict);
-				free(fpath);
-			}
-		}
-		closedir(cur_dir);
+	plist_t dirlist = mb2_dir_cache_take(path);
+	if (!dirlist) {
+		dirlist = mb2_list_directory(path);
 	}
-	free(path);
 
 	/* TODO error handling */
 	mobilebackup2_error_t err = mobilebackup2_send_status_response(mobilebackup2, 0, NULL, dirlist);
-	plist_free(dirlist);
 	if (err != MOBILEBACKUP2_E_SUCCESS) {
 		printf("Could not send status response, error %d\n", err);
+	} else {
+		mb2_dir_prefetch_subdirectories(path, dirlist);
 	}
+	plist_free(dirlist);
+	free(path);
 }
 
 static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plist_t message, const char *backup_dir)
@@ -1274,19 +3017,61 @@ static void mb2_handle_make_directory(mobilebackup2_client_t mobilebackup2, plis
 	}
 }
 
+/* lets the file system share or copy the data without passing it through
+ * user space, returns 0 if the whole file was copied */
+static int mb2_copy_file_fast(FILE *from, FILE *to)
+{
+#if defined(FICLONE) || defined(HAVE_COPY_FILE_RANGE)
+	int in_fd = fileno(from);
+	int out_fd = fileno(to);
+#endif
+#ifdef FICLONE
+	/* btrfs and xfs share the extents, which makes the copy free */
+	if (ioctl(out_fd, FICLONE, in_fd) == 0) {
+		return 0;
+	}
+#endif
+#ifdef HAVE_COPY_FILE_RANGE
+	struct stat st;
+	if (fstat(in_fd, &st) < 0) {
+		return -1;
+	}
+	off_t left = st.st_size;
+	while (left > 0) {
+		ssize_t r = copy_file_range(in_fd, NULL, out_fd, NULL, (size_t)left, 0);
+		if (r <= 0) {
+			/* nothing was copied yet, so the caller can start over */
+			return (left == st.st_size) ? -1 : -2;
+		}
+		left -= r;
+	}
+	return 0;
+#else
+	return -1;
+#endif
+}
+
 static void mb2_copy_file_by_path(const char *src, const char *dst)
 {
 	FILE *from, *to;
 	char buf[BUFSIZ];
 	size_t length;
 
+	/* open destination file, a new one so hardlinked content stays untouched */
+	remove_file(dst);
+#ifdef HAVE_CLONEFILE
+	/* APFS copy on write clone */
+	if (clonefile(src, dst, 0) == 0) {
+		return;
+	}
+#endif
+
 	/* open source file */
 	if ((from = fopen(src, "rb")) == NULL) {
 		printf("Cannot open source path '%s'.\n", src);
 		return;
 	}
 
-	/* open destination file */
 	if ((to = fopen(dst, "wb")) == NULL) {
 		printf("Cannot open destination file '%s'.\n", dst);
 		fclose(from);
@@ -1294,8 +3079,13 @@ static void mb2_copy_file_by_path(const char *src, const char *dst)
 	}
 
 	/* copy the file */
-	while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
-		fwrite(buf, 1, length, to);
+	int res = mb2_copy_file_fast(from, to);
+	if (res == -2) {
+		printf("Error copying '%s'.\n", src);
+	} else if (res < 0) {
+		while ((length = fread(buf, 1, BUFSIZ, from)) != 0) {
+			fwrite(buf, 1, length, to);
+		}
 	}
 
 	if(fclose(from) == EOF) {
@@ -1307,20 +3097,27 @@ static void mb2_copy_file_by_path(const char *src, const char *dst)
 	}
 }
 
-static void mb2_copy_directory_by_path(const char *src, const char *dst)
+struct mb2_copy_job {
+	char *src;
+	char *dst;
+	struct mb2_fs_group *group;
+};
+
+static void mb2_copy_file_job(void *data)
 {
-	if (!src || !dst) {
-		return;
-	}
+	struct mb2_copy_job *job = (struct mb2_copy_job*)data;
+	mb2_copy_file_by_path(job->src, job->dst);
+	mb2_fs_group_done(job->group, 0);
+	free(job->src);
+	free(job->dst);
+	free(job);
+}
 
+/* walks the tree on the calling thread, files are copied on the pool threads */
+static void mb2_copy_directory_recursive(const char *src, const char *dst, struct mb2_fs_group *group)
+{
 	struct stat st;
 
-	/* if src does not exist */
-	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
-		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
-		return;
-	}
-
 	/* if dst directory does not exist */
 	if ((stat(dst, &st) < 0) || !S_ISDIR(st.st_mode)) {
 		/* create it */
@@ -1340,20 +3137,74 @@ static void mb2_copy_directory_by_path(const char *src, const char *dst)
 			}
 			char *srcpath = string_build_path(src, ep->d_name, NULL);
 			char *dstpath = string_build_path(dst, ep->d_name, NULL);
-			if (srcpath && dstpath) {
-				/* copy file */
-				mb2_copy_file_by_path(srcpath, dstpath);
+			struct mb2_copy_job *job = NULL;
+			int is_dir = 0;
+#ifdef HAVE_DIRENT_D_TYPE
+			if (ep->d_type != DT_UNKNOWN) {
+				is_dir = (ep->d_type == DT_DIR);
+			} else
+#endif
+			if (srcpath && stat(srcpath, &st) == 0) {
+				is_dir = S_ISDIR(st.st_mode);
 			}
-
-			if (srcpath)
+			if (srcpath && dstpath && is_dir) {
+				mb2_copy_directory_recursive(srcpath, dstpath, group);
 				free(srcpath);
-			if (dstpath)
 				free(dstpath);
+				continue;
+			}
+			if (srcpath && dstpath) {
+				job = (struct mb2_copy_job*)malloc(sizeof(struct mb2_copy_job));
+			}
+			if (job) {
+				/* copy file on a pool thread */
+				job->src = srcpath;
+				job->dst = dstpath;
+				job->group = group;
+				mb2_fs_group_add(group);
+				mb2_fs_pool_submit(mb2_copy_file_job, job);
+			} else {
+				if (srcpath && dstpath) {
+					/* copy file */
+					mb2_copy_file_by_path(srcpath, dstpath);
+				}
+				if (srcpath)
+					free(srcpath);
+				if (dstpath)
+					free(dstpath);
+			}
 		}
 		closedir(cur_dir);
 	}
 }
 
+static void mb2_copy_directory_by_path(const char *src, const char *dst)
+{
+	struct mb2_fs_group group = { 0, 0 };
+
+	if (!src || !dst) {
+		return;
+	}
+
+	struct stat st;
+
+	/* if src does not exist */
+	if ((stat(src, &st) < 0) || !S_ISDIR(st.st_mode)) {
+		printf("ERROR: Source directory does not exist '%s': %s (%d)\n", src, strerror(errno), errno);
+		return;
+	}
+
+#ifdef HAVE_CLONEFILE
+	/* a new destination can be cloned as a whole */
+	if ((stat(dst, &st) < 0) && (errno == ENOENT) && (clonefile(src, dst, 0) == 0)) {
+		return;
+	}
+#endif
+
+	mb2_copy_directory_recursive(src, dst, &group);
+	mb2_fs_group_wait(&group);
+}
+
 #ifdef WIN32
 #define BS_CC '\b'
 #define my_getch getch
@@ -1440,6 +3291,13 @@ static void print_usage(int argc, char **argv)
 	printf("CMD:\n");
 	printf("  backup\tcreate backup for the device\n");
 	printf("    --full\t\tforce full backup from device.\n");
+	printf("    --dedup\t\tstore identical files only once, shared by all devices\n");
+	printf("    --digests\t\trecord the SHA-1 of received files in " MB2_DIGEST_INDEX_FILE "\n");
+	printf("    --compress[=LEVEL]\tstore files zstd compressed (default level %d)\n", MB2_COMPRESS_DEFAULT_LEVEL);
+	printf("    --devices LIST\tback up the comma separated UDIDs in LIST at once\n");
+	printf("    --all\t\tback up all connected devices at once\n");
+	printf("    --jobs N\t\tback up at most N devices at the same time\n");
+	printf("    --max-disk-rate MB\tlimit disk writes of all devices to MB per second\n");
 	printf("  restore\trestore last backup to the device\n");
 	printf("    --system\t\trestore system files, too.\n");
 	printf("    --no-reboot\t\tdo NOT reboot the device when done (default: yes).\n");
@@ -1470,6 +3328,137 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
+#ifdef MB2_MULTI_DEVICE
+static int mb2_multi_add_udid(char ***udids, unsigned int *num_udids, const char *udid)
+{
+	unsigned int i;
+	for (i = 0; i < *num_udids; i++) {
+		if (!strcmp((*udids)[i], udid)) {
+			return 0;
+		}
+	}
+	char **newlist = (char**)realloc(*udids, sizeof(char*) * (*num_udids + 1));
+	if (!newlist) {
+		return -1;
+	}
+	newlist[*num_udids] = strdup(udid);
+	*udids = newlist;
+	(*num_udids)++;
+	return 0;
+}
+
+/* Backs up several devices from one invocation. The session state of this
+ * tool is global, so every device session runs in a forked process, while
+ * the disk bandwidth and the receive buffers are shared between all of them.
+ * Returns in the forked process with *slot set to the device to back up. */
+static int mb2_multi_backup(char **udids, unsigned int num_udids, unsigned int jobs, uint64_t rate, int *slot)
+{
+	unsigned int i;
+	unsigned int next = 0;
+	unsigned int running = 0;
+	unsigned int succeeded = 0;
+	int forwarded = 0;
+	double printed[MB2_MULTI_MAX_DEVICES];
+
+	*slot = -1;
+	if (num_udids > MB2_MULTI_MAX_DEVICES) {
+		printf("ERROR: Can't back up more than %d devices at once.\n", MB2_MULTI_MAX_DEVICES);
+		return -1;
+	}
+	if (jobs == 0 || jobs > num_udids) {
+		jobs = num_udids;
+	}
+
+	shared = mb2_shared_new(MB2_WRITER_BUFFERS * ((jobs < 4) ? jobs : 4), rate);
+	if (!shared) {
+		printf("ERROR: Could not set up shared memory for a multi device backup.\n");
+		return -1;
+	}
+	shared->num_devices = num_udids;
+	for (i = 0; i < num_udids; i++) {
+		strncpy(shared->devices[i].udid, udids[i], sizeof(shared->devices[i].udid) - 1);
+		printed[i] = 0;
+	}
+
+	while (next < num_udids || running > 0) {
+		while (!quit_flag && next < num_udids && running < jobs) {
+			struct mb2_shared_device *dev = &shared->devices[next];
+			fflush(stdout);
+			pid_t pid = fork();
+			if (pid == 0) {
+				/* the parent reports progress for all devices */
+				shared_slot = next;
+				*slot = next;
+				verbose = 0;
+				return 0;
+			}
+			if (pid < 0) {
+				printf("%s: ERROR: Could not start backup: %s\n", dev->udid, strerror(errno));
+				dev->state = MB2_DEVICE_DONE;
+				dev->status = -1;
+			} else {
+				printf("%s: Backup started\n", dev->udid);
+				dev->pid = pid;
+				dev->state = MB2_DEVICE_RUNNING;
+				running++;
+			}
+			next++;
+		}
+
+		if (quit_flag && !forwarded) {
+			for (i = 0; i < num_udids; i++) {
+				if (shared->devices[i].state == MB2_DEVICE_RUNNING) {
+					kill(shared->devices[i].pid, SIGINT);
+				}
+			}
+			forwarded = 1;
+			next = num_udids;
+		}
+
+		int status = 0;
+		pid_t pid = waitpid(-1, &status, WNOHANG);
+		if (pid > 0) {
+			for (i = 0; i < num_udids; i++) {
+				struct mb2_shared_device *dev = &shared->devices[i];
+				if (dev->pid != pid || dev->state != MB2_DEVICE_RUNNING) {
+					continue;
+				}
+				dev->state = MB2_DEVICE_DONE;
+				dev->status = (WIFEXITED(status)) ? WEXITSTATUS(status) : -1;
+				running--;
+				if (dev->status == 0) {
+					printf("%s: Backup Successful.\n", dev->udid);
+					succeeded++;
+				} else {
+					printf("%s: Backup Failed.\n", dev->udid);
+				}
+				break;
+			}
+			continue;
+		}
+
+		for (i = 0; i < num_udids; i++) {
+			struct mb2_shared_device *dev = &shared->devices[i];
+			pthread_mutex_lock(&shared->mutex);
+			double progress = dev->progress;
+			pthread_mutex_unlock(&shared->mutex);
+			if (dev->state == MB2_DEVICE_RUNNING && progress >= printed[i] + 5.0) {
+				printf("%s: %.0f%%\n", dev->udid, progress);
+				printed[i] = progress;
+			}
+		}
+		fflush(stdout);
+		usleep(250000);
+	}
+
+	printf("%u of %u backups completed successfully.\n", succeeded, num_udids);
+	mb2_shared_free(shared);
+	shared = NULL;
+
+	return (succeeded == num_udids) ? 0 : -1;
+}
+#endif
+
 #define DEVICE_VERSION(maj, min, patch) (((maj & 0xFF) << 16) | ((min & 0xFF) << 8) | (patch & 0xFF))
 
 int main(int argc, char *argv[])
@@ -1494,6 +3483,11 @@ int main(int argc, char *argv[])
 	plist_t info_plist = NULL;
 	plist_t opts = NULL;
 	mobilebackup2_error_t err;
+	char *devices_list = NULL;
+	int all_devices = 0;
+	unsigned int jobs = 0;
+	uint64_t max_disk_rate = 0;
+	int compression_level = MB2_COMPRESS_DEFAULT_LEVEL;
 
 	/* we need to exit cleanly on running backups and restores or we cause havok */
 	signal(SIGINT, clean_exit);
@@ -1601,6 +3595,48 @@ int main(int argc, char *argv[])
 		else if (!strcmp(argv[i], "--full")) {
 			cmd_flags |= CMD_FLAG_FORCE_FULL_BACKUP;
 		}
+		else if (!strcmp(argv[i], "--dedup")) {
+			cmd_flags |= CMD_FLAG_DEDUP;
+		}
+		else if (!strcmp(argv[i], "--digests")) {
+			cmd_flags |= CMD_FLAG_DIGESTS;
+		}
+		else if (!strncmp(argv[i], "--compress", 10) && (argv[i][10] == '\0' || argv[i][10] == '=')) {
+			cmd_flags |= CMD_FLAG_COMPRESS;
+			if (argv[i][10] == '=') {
+				compression_level = atoi(argv[i] + 11);
+			}
+		}
+		else if (!strcmp(argv[i], "--devices")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			devices_list = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "--all")) {
+			all_devices = 1;
+		}
+		else if (!strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			jobs = (unsigned int)atoi(argv[i]);
+			continue;
+		}
+		else if (!strcmp(argv[i], "--max-disk-rate")) {
+			i++;
+			if (!argv[i] || atoi(argv[i]) <= 0) {
+				print_usage(argc, argv);
+				return -1;
+			}
+			max_disk_rate = (uint64_t)atoi(argv[i]) * 1024 * 1024;
+			continue;
+		}
 		else if (!strcmp(argv[i], "info")) {
 			cmd = CMD_INFO;
 			verbose = 0;
@@ -1703,6 +3739,62 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (devices_list || all_devices || jobs || max_disk_rate) {
+#ifdef MB2_MULTI_DEVICE
+		char **udids = NULL;
+		unsigned int num_udids = 0;
+		int slot = -1;
+
+		if (cmd != CMD_BACKUP || udid || source_udid || (!devices_list && !all_devices)) {
+			printf("ERROR: Multi device backups need the backup command with --devices or --all, and can't be combined with --udid or --source.\n");
+			return -1;
+		}
+		if (devices_list) {
+			char *list = strdup(devices_list);
+			char *tok = strtok(list, ",");
+			while (tok) {
+				if (*tok) {
+					mb2_multi_add_udid(&udids, &num_udids, tok);
+				}
+				tok = strtok(NULL, ",");
+			}
+			free(list);
+		}
+		if (all_devices) {
+			idevice_info_t *devices = NULL;
+			int count = 0;
+			if (idevice_get_device_list_extended(&devices, &count) == IDEVICE_E_SUCCESS) {
+				for (i = 0; i < count; i++) {
+					if (devices[i]->conn_type == ((use_network) ? CONNECTION_NETWORK : CONNECTION_USBMUXD)) {
+						mb2_multi_add_udid(&udids, &num_udids, devices[i]->udid);
+					}
+				}
+				idevice_device_list_extended_free(devices);
+			}
+		}
+		if (num_udids == 0) {
+			printf("No device found.\n");
+			free(udids);
+			return -1;
+		}
+
+		int res = mb2_multi_backup(udids, num_udids, jobs, max_disk_rate, &slot);
+		if (slot >= 0) {
+			udid = strdup(udids[slot]);
+		}
+		for (i = 0; i < (int)num_udids; i++) {
+			free(udids[i]);
+		}
+		free(udids);
+		if (slot < 0) {
+			return res;
+		}
+#else
+		printf("ERROR: Backing up several devices at once is not supported on this platform.\n");
+		return -1;
+#endif
+	}
+
 	idevice_t device = NULL;
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
@@ -1744,20 +3836,20 @@ int main(int argc, char *argv[])
 			if (stat(manifest_path, &st) != 0) {
 				free(info_path);
 			}
-			plist_t manifest_plist = NULL;
-			plist_read_from_filename(&manifest_plist, manifest_path);
-			if (!manifest_plist) {
+			/* Manifest.plist can be huge, only look at the key we need */
+			node_tmp = NULL;
+			if (!plist_read_key_from_filename(&node_tmp, manifest_path, "IsEncrypted") && stat(manifest_path, &st) != 0) {
 				idevice_free(device);
 				free(info_path);
 				free(manifest_path);
 				printf("ERROR: Backup directory \"%s\" is invalid. No Manifest.plist found for UDID %s.\n", backup_directory, source_udid);
 				return -1;
 			}
-			node_tmp = plist_dict_get_item(manifest_plist, "IsEncrypted");
 			if (node_tmp && (plist_get_node_type(node_tmp) == PLIST_BOOLEAN)) {
 				plist_get_bool_val(node_tmp, &is_encrypted);
 			}
-			plist_free(manifest_plist);
+			plist_free(node_tmp);
+			node_tmp = NULL;
 			free(manifest_path);
 		}
 		PRINT_VERBOSE(1, "Backup directory is \"%s\"\n", backup_directory);
@@ -1891,7 +3983,12 @@ int main(int argc, char *argv[])
 		/* verify existing Info.plist */
 		if (info_path && (stat(info_path, &st) == 0) && cmd != CMD_CLOUD) {
 			PRINT_VERBOSE(1, "Reading Info.plist from backup.\n");
-			plist_read_from_filename(&info_plist, info_path);
+			if (cmd == CMD_RESTORE) {
+				plist_read_from_filename(&info_plist, info_path);
+			} else {
+				/* it gets replaced after the backup, only make sure it is valid */
+				plist_read_key_from_filename(&info_plist, info_path, "Target Identifier");
+			}
 
 			if (!info_plist) {
 				printf("Could not read Info.plist\n");
@@ -1983,6 +4080,17 @@ checkpoint:
 				info_path = string_build_path(backup_directory, udid, "Info.plist", NULL);
 			}
 
+			if (cmd_flags & CMD_FLAG_DEDUP) {
+				mb2_dedup_init(backup_directory, udid);
+			}
+			if (cmd_flags & CMD_FLAG_DIGESTS) {
+				mb2_digest_init(backup_directory, udid);
+			}
+			if (cmd_flags & CMD_FLAG_COMPRESS) {
+				mb2_compress_init(backup_directory, udid, compression_level);
+			}
+			mb2_checkpoint_open(backup_directory, udid);
+
 			/* TODO: check domain com.apple.mobile.backup key RequiresEncrypt and WillEncrypt with lockdown */
 			/* TODO: verify battery on AC enough battery remaining */
 
@@ -2251,6 +4359,11 @@ checkpoint:
 					goto files_out;
 				}
 
+				/* prefetched listings only stay valid while nothing is modified */
+				if (strcmp(dlmsg, "DLContentsOfDirectory") != 0 && strcmp(dlmsg, "DLMessageGetFreeDiskSpace") != 0) {
+					mb2_dir_cache_invalidate();
+				}
+
 				if (!strcmp(dlmsg, "DLMessageDownloadFiles")) {
 					/* device wants to download files from the computer */
 					mb2_set_overall_progress_from_message(message, dlmsg);
@@ -2308,7 +4421,7 @@ checkpoint:
 									char *oldpath = string_build_path(backup_directory, key, NULL);
 
 									if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode))
-										rmdir_recursive(newpath);
+										rmdir_recursive(newpath, 1);
 									else
 										remove_file(newpath);
 									if (rename(oldpath, newpath) < 0) {
@@ -2317,6 +4430,7 @@ checkpoint:
 										errdesc = strerror(errno);
 										break;
 									}
+									mb2_digest_move(oldpath, newpath);
 									free(oldpath);
 									free(newpath);
 								}
@@ -2342,6 +4456,7 @@ checkpoint:
 					uint32_t cnt = plist_array_get_size(removes);
 					PRINT_VERBOSE(1, "Removing %d file%s\n", cnt, (cnt == 1) ? "" : "s");
 					uint32_t ii = 0;
+					struct mb2_fs_group group = { 0, 0 };
 					errcode = 0;
 					errdesc = NULL;
 					for (ii = 0; ii < cnt; ii++) {
@@ -2357,24 +4472,27 @@ checkpoint:
 										suppress_warning = 1;
 									}
 								}
-								char *newpath = string_build_path(backup_directory, str, NULL);
-								free(str);
-								int res = 0;
-								if ((stat(newpath, &st) == 0) && S_ISDIR(st.st_mode)) {
-									res = rmdir_recursive(newpath);
+								/* items are removed on the pool threads, the status covers all of them */
+								struct mb2_remove_item_job *job = (struct mb2_remove_item_job*)malloc(sizeof(struct mb2_remove_item_job));
+								if (job) {
+									job->path = string_build_path(backup_directory, str, NULL);
+									job->suppress_warning = suppress_warning;
+									job->group = &group;
+									mb2_fs_group_add(&group);
+									mb2_fs_pool_submit(mb2_remove_item_job, job);
 								} else {
-									res = remove_file(newpath);
-								}
-								if (res != 0 && res != ENOENT) {
-									if (!suppress_warning)
-										printf("Could not remove '%s': %s (%d)\n", newpath, strerror(res), res);
-									errcode = errno_to_device_error(res);
-									errdesc = strerror(res);
+									mb2_fs_group_add(&group);
+									mb2_fs_group_done(&group, ENOMEM);
 								}
-								free(newpath);
+								free(str);
 							}
 						}
 					}
+					int res = mb2_fs_group_wait(&group);
+					if (res != 0) {
+						errcode = errno_to_device_error(res);
+						errdesc = strerror(res);
+					}
 					plist_t empty_dict = plist_new_dict();
 					err = mobilebackup2_send_status_response(mobilebackup2, errcode, errdesc, empty_dict);
 					plist_free(empty_dict);
@@ -2515,6 +4633,7 @@ files_out:
 					PRINT_VERBOSE(1, "Received %d files from device.\n", file_count);
 					if (operation_ok && mb2_status_check_snapshot_state(backup_directory, udid, "finished")) {
 						PRINT_VERBOSE(1, "Backup Successful.\n");
+						checkpoint_complete = 1;
 					} else {
 						if (quit_flag) {
 							PRINT_VERBOSE(1, "Backup Aborted.\n");
@@ -2599,6 +4718,19 @@ files_out:
 		lockdown = NULL;
 	}
 
+	if (file_writer) {
+		mb2_file_writer_free(file_writer);
+		file_writer = NULL;
+	}
+
+	mb2_fs_pool_free();
+
+	/* writes the content index, all files have been written at this point */
+	mb2_dedup_finish();
+	mb2_compress_finish();
+	mb2_digest_finish();
+	mb2_checkpoint_close();
+
 	if (mobilebackup2) {
 		mobilebackup2_client_free(mobilebackup2);
 		mobilebackup2 = NULL;
@@ -29,15 +29,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
 #ifdef _MSC_VER
 #include <direct.h>
+#include <sys/utime.h>
 #else
 #include <unistd.h>
+#include <utime.h>
 #endif
 #ifndef WIN32
 #include <signal.h>
 #endif
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -51,10 +56,20 @@
 #define S_IFSOCK S_IFREG
 #endif
 
-const char* target_directory = NULL;
+/* devices handled at the same time with --all */
+#define DEFAULT_JOBS 8
+
 static int extract_raw_crash_reports = 0;
 static int keep_crash_reports = 0;
 
+struct crash_ctx {
+	afc_client_t afc;
+	/* root of the copy, names are printed relative to it */
+	const char *target_directory;
+	/* prefix for printed lines, the UDID with --all */
+	const char *label;
+};
+
 static int file_exists(const char* path)
 {
 	struct stat tst;
@@ -65,6 +80,42 @@ static int file_exists(const char* path)
 #endif
 }
 
+/**
+ * Checks whether a crash report was copied before: the name, size and
+ * modification time of the local file match those on the device.
+ */
+static int file_is_up_to_date(const char* path, uint64_t size, time_t mtime)
+{
+	struct stat st;
+	if (stat(path, &st) != 0) {
+		return 0;
+	}
+	return (S_ISREG(st.st_mode) && (uint64_t)st.st_size == size && st.st_mtime == mtime);
+}
+
+static void set_file_mtime(const char* path, time_t mtime)
+{
+	struct utimbuf times;
+	times.actime = mtime;
+	times.modtime = mtime;
+	utime(path, &times);
+}
+
+struct copy_ctx {
+	FILE* output;
+	uint32_t bytes_total;
+};
+
+static int copy_chunk_cb(const char* data, uint32_t length, void* user_data)
+{
+	struct copy_ctx* ctx = (struct copy_ctx*)user_data;
+	if (fwrite(data, 1, length, ctx->output) != length) {
+		return -1;
+	}
+	ctx->bytes_total += length;
+	return 0;
+}
+
 static int extract_raw_crash_report(const char* filename)
 {
 	int res = 0;
@@ -104,130 +155,111 @@ static int extract_raw_crash_report(const char* filename)
 	return res;
 }
 
-static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char* device_directory, const char* host_directory)
+static int afc_client_copy_and_remove_crash_reports(struct crash_ctx* cctx, const char* device_directory, const char* host_directory)
 {
+	afc_client_t afc = cctx->afc;
 	afc_error_t afc_error;
 	int k;
 	int res = -1;
 	int crash_report_count = 0;
 	uint64_t handle;
-	char source_filename[512];
-	char target_filename[512];
+	struct path_builder source_paths;
+	struct path_builder target_paths;
 
 	if (!afc)
 		return res;
 
-	char** list = NULL;
-	afc_error = afc_read_directory(afc, device_directory, &list);
+	afc_directory_entry_t* list = NULL;
+	uint32_t count = 0;
+	afc_error = afc_read_directory_with_info(afc, device_directory, &list, &count);
 	if (afc_error != AFC_E_SUCCESS) {
-		fprintf(stderr, "ERROR: Could not read device directory '%s'\n", device_directory);
+		fprintf(stderr, "%sERROR: Could not read device directory '%s'\n", cctx->label, device_directory);
 		return res;
 	}
 
-	/* ensure we have a trailing slash */
-	strcpy(source_filename, device_directory);
-	if (source_filename[strlen(source_filename)-1] != '/') {
-		strcat(source_filename, "/");
-	}
-	int device_directory_length = strlen(source_filename);
-
-	/* ensure we have a trailing slash */
-	strcpy(target_filename, host_directory);
-	if (target_filename[strlen(target_filename)-1] != '/') {
-		strcat(target_filename, "/");
-	}
-	int host_directory_length = strlen(target_filename);
+	path_builder_init(&source_paths, device_directory, '/');
+	path_builder_init(&target_paths, host_directory, PATH_SEPARATOR);
 
 	/* loop over file entries */
-	for (k = 0; list[k]; k++) {
-		if (!strcmp(list[k], ".") || !strcmp(list[k], "..")) {
-			continue;
-		}
-
-		char **fileinfo = NULL;
+	for (k = 0; k < (int)count; k++) {
+		const char* name = list[k].name;
 		struct stat stbuf;
 		memset(&stbuf, '\0', sizeof(struct stat));
 
-		/* assemble absolute source filename */
-		strcpy(((char*)source_filename) + device_directory_length, list[k]);
+		/* assemble absolute source and target filenames */
+		char* source_filename = path_builder_build(&source_paths, name, NULL);
+		char* target_filename = path_builder_build(&target_paths, name, NULL);
+		if (!source_filename || !target_filename) {
+			fprintf(stderr, "%sOut of memory. Skipping '%s'...\n", cctx->label, name);
+			continue;
+		}
 
-		/* assemble absolute target filename */
-		char* p = strrchr(list[k], '.');
+		const char* p = strrchr(name, '.');
 		if (p != NULL && !strncmp(p, ".synced", 7)) {
 			/* make sure to strip ".synced" extension as seen on iOS 5 */
-			int newlen = strlen(list[k]) - 7;
-			strncpy(((char*)target_filename) + host_directory_length, list[k], newlen);
-			target_filename[host_directory_length + newlen] = '\0';
-		} else {
-			strcpy(((char*)target_filename) + host_directory_length, list[k]);
+			target_filename[strlen(target_filename) - 7] = '\0';
 		}
 
-		/* get file information */
-		afc_get_file_info(afc, source_filename, &fileinfo);
-		if (!fileinfo) {
-			printf("Failed to read information for '%s'. Skipping...\n", source_filename);
-			continue;
+		/* convert file information */
+		switch (list[k].type) {
+			case AFC_FILE_TYPE_REGULAR:
+				stbuf.st_mode = S_IFREG;
+				break;
+			case AFC_FILE_TYPE_DIRECTORY:
+				stbuf.st_mode = S_IFDIR;
+				break;
+			case AFC_FILE_TYPE_SYMLINK:
+				stbuf.st_mode = S_IFLNK;
+				break;
+			case AFC_FILE_TYPE_BLOCKDEV:
+				stbuf.st_mode = S_IFBLK;
+				break;
+			case AFC_FILE_TYPE_CHARDEV:
+				stbuf.st_mode = S_IFCHR;
+				break;
+			case AFC_FILE_TYPE_FIFO:
+				stbuf.st_mode = S_IFIFO;
+				break;
+			case AFC_FILE_TYPE_SOCKET:
+				stbuf.st_mode = S_IFSOCK;
+				break;
+			default:
+				printf("%sFailed to read information for '%s'. Skipping...\n", cctx->label, source_filename);
+				continue;
 		}
+		stbuf.st_size = list[k].size;
+		stbuf.st_mtime = (time_t)(list[k].mtime / 1000000000);
 
-		/* parse file information */
-		int i;
-		for (i = 0; fileinfo[i]; i+=2) {
-			if (!strcmp(fileinfo[i], "st_size")) {
-				stbuf.st_size = atoll(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_ifmt")) {
-				if (!strcmp(fileinfo[i+1], "S_IFREG")) {
-					stbuf.st_mode = S_IFREG;
-				} else if (!strcmp(fileinfo[i+1], "S_IFDIR")) {
-					stbuf.st_mode = S_IFDIR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFLNK")) {
-					stbuf.st_mode = S_IFLNK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFBLK")) {
-					stbuf.st_mode = S_IFBLK;
-				} else if (!strcmp(fileinfo[i+1], "S_IFCHR")) {
-					stbuf.st_mode = S_IFCHR;
-				} else if (!strcmp(fileinfo[i+1], "S_IFIFO")) {
-					stbuf.st_mode = S_IFIFO;
-				} else if (!strcmp(fileinfo[i+1], "S_IFSOCK")) {
-					stbuf.st_mode = S_IFSOCK;
-				}
-			} else if (!strcmp(fileinfo[i], "st_nlink")) {
-				stbuf.st_nlink = atoi(fileinfo[i+1]);
-			} else if (!strcmp(fileinfo[i], "st_mtime")) {
-				stbuf.st_mtime = (time_t)(atoll(fileinfo[i+1]) / 1000000000);
-			} else if (!strcmp(fileinfo[i], "LinkTarget")) {
-				/* report latest crash report filename */
-				printf("Link: %s\n", (char*)target_filename + strlen(target_directory));
-
-				/* remove any previous symlink */
-				if (file_exists(target_filename)) {
-					remove(target_filename);
-				}
+		if (list[k].link_target) {
+			/* report latest crash report filename */
+			printf("%sLink: %s\n", cctx->label, (char*)target_filename + strlen(cctx->target_directory));
+
+			/* remove any previous symlink */
+			if (file_exists(target_filename)) {
+				remove(target_filename);
+			}
 
 #ifndef WIN32
-				/* use relative filename */
-				char* b = strrchr(fileinfo[i+1], '/');
-				if (b == NULL) {
-					b = fileinfo[i+1];
-				} else {
-					b++;
-				}
+			/* use relative filename */
+			const char* b = strrchr(list[k].link_target, '/');
+			if (b == NULL) {
+				b = list[k].link_target;
+			} else {
+				b++;
+			}
 
-				/* create a symlink pointing to latest log */
-				if (symlink(b, target_filename) < 0) {
-					fprintf(stderr, "Can't create symlink to %s\n", b);
-				}
+			/* create a symlink pointing to latest log */
+			if (symlink(b, target_filename) < 0) {
+				fprintf(stderr, "%sCan't create symlink to %s\n", cctx->label, b);
+			}
 #endif
 
-				if (!keep_crash_reports)
-					afc_remove_path(afc, source_filename);
+			if (!keep_crash_reports)
+				afc_remove_path(afc, source_filename);
 
-				res = 0;
-			}
+			res = 0;
 		}
 
-		/* free file information */
-		afc_dictionary_free(fileinfo);
-
 		/* recurse into child directories */
 		if (S_ISDIR(stbuf.st_mode)) {
 #ifdef WIN32
@@ -235,49 +267,57 @@ static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char
 #else
 			mkdir(target_filename, 0755);
 #endif
-			res = afc_client_copy_and_remove_crash_reports(afc, source_filename, target_filename);
+			res = afc_client_copy_and_remove_crash_reports(cctx, source_filename, target_filename);
 
 			/* remove directory from device */
 			if (!keep_crash_reports)
 				afc_remove_path(afc, source_filename);
 		} else if (S_ISREG(stbuf.st_mode)) {
+			if (file_is_up_to_date(target_filename, list[k].size, stbuf.st_mtime)) {
+				/* copied by a previous run, but maybe kept on the device */
+				printf("%sSkip: %s\n", cctx->label, (char*)target_filename + strlen(cctx->target_directory));
+				if (!keep_crash_reports) {
+					afc_remove_path(afc, source_filename);
+				}
+				res = 0;
+				continue;
+			}
+
 			/* copy file to host */
 			afc_error = afc_file_open(afc, source_filename, AFC_FOPEN_RDONLY, &handle);
 			if(afc_error != AFC_E_SUCCESS) {
 				if (afc_error == AFC_E_OBJECT_NOT_FOUND) {
 					continue;
 				}
-				fprintf(stderr, "Unable to open device file '%s' (%d). Skipping...\n", source_filename, afc_error);
+				fprintf(stderr, "%sUnable to open device file '%s' (%d). Skipping...\n", cctx->label, source_filename, afc_error);
 				continue;
 			}
 
 			FILE* output = fopen(target_filename, "wb");
 			if(output == NULL) {
-				fprintf(stderr, "Unable to open local file '%s'. Skipping...\n", target_filename);
+				fprintf(stderr, "%sUnable to open local file '%s'. Skipping...\n", cctx->label, target_filename);
 				afc_file_close(afc, handle);
 				continue;
 			}
 
-			printf("%s: %s\n", (keep_crash_reports ? "Copy": "Move") , (char*)target_filename + strlen(target_directory));
+			printf("%s%s: %s\n", cctx->label, (keep_crash_reports ? "Copy": "Move") , (char*)target_filename + strlen(cctx->target_directory));
 
-			uint32_t bytes_read = 0;
-			uint32_t bytes_total = 0;
-			unsigned char data[0x1000];
+			struct copy_ctx ctx = { output, 0 };
 
-			afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			while(afc_error == AFC_E_SUCCESS && bytes_read > 0) {
-				fwrite(data, 1, bytes_read, output);
-				bytes_total += bytes_read;
-				afc_error = afc_file_read(afc, handle, (char*)data, 0x1000, &bytes_read);
-			}
+			afc_error = afc_file_read_pipelined(afc, handle, copy_chunk_cb, &ctx, 0, 0);
 			afc_file_close(afc, handle);
 			fclose(output);
 
-			if ((uint32_t)stbuf.st_size != bytes_total) {
-				fprintf(stderr, "File size mismatch. Skipping...\n");
+			if (afc_error != AFC_E_SUCCESS || (uint32_t)stbuf.st_size != ctx.bytes_total) {
+				fprintf(stderr, "%sFile size mismatch. Skipping...\n", cctx->label);
+				/* don't let a partial copy look up to date */
+				remove(target_filename);
 				continue;
 			}
 
+			/* lets the next run recognize the file */
+			set_file_mtime(target_filename, stbuf.st_mtime);
+
 			/* remove file from device */
 			if (!keep_crash_reports) {
 				afc_remove_path(afc, source_filename);
@@ -293,7 +333,9 @@ static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char
 			res = 0;
 		}
 	}
-	afc_dictionary_free(list);
+	afc_directory_entries_free(list);
+	path_builder_free(&source_paths);
+	path_builder_free(&target_paths);
 
 	/* no reports, no error */
 	if (crash_report_count == 0)
@@ -302,29 +344,12 @@ static int afc_client_copy_and_remove_crash_reports(afc_client_t afc, const char
 	return res;
 }
 
-static void print_usage(int argc, char **argv)
-{
-	char *name = NULL;
-
-	name = strrchr(argv[0], '/');
-	printf("Usage: %s [OPTIONS] DIRECTORY\n", (name ? name + 1: argv[0]));
-	printf("\n");
-	printf("Move crash reports from device to a local DIRECTORY.\n");
-	printf("\n");
-	printf("OPTIONS:\n");
-	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
-	printf("  -n, --network\t\tconnect to network device\n");
-	printf("  -e, --extract\t\textract raw crash report into separate '.crash' file\n");
-	printf("  -k, --keep\t\tcopy but do not remove crash reports from device\n");
-	printf("  -d, --debug\t\tenable communication debugging\n");
-	printf("  -h, --help\t\tprints usage information\n");
-	printf("  -v, --version\t\tprints version information\n");
-	printf("\n");
-	printf("Homepage:    <" PACKAGE_URL ">\n");
-	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
-}
-
-int main(int argc, char* argv[])
+/**
+ * Moves the crash reports of one device to the given directory.
+ *
+ * @return 0 on success, -1 on error.
+ */
+static int collect_crash_reports(const char* udid, enum idevice_options lookup, const char* target_directory, const char* label)
 {
 	idevice_t device = NULL;
 	lockdownd_client_t lockdownd = NULL;
@@ -334,72 +359,7 @@ int main(int argc, char* argv[])
 	lockdownd_error_t lockdownd_error = LOCKDOWN_E_SUCCESS;
 	afc_error_t afc_error = AFC_E_SUCCESS;
 
-	int i;
-	const char* udid = NULL;
-	int use_network = 0;
-
-#ifndef WIN32
-	signal(SIGPIPE, SIG_IGN);
-#endif
-	/* parse cmdline args */
-	for (i = 1; i < argc; i++) {
-		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
-			idevice_set_debug_level(1);
-			continue;
-		}
-		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
-			i++;
-			if (!argv[i] || !*argv[i]) {
-				print_usage(argc, argv);
-				return 0;
-			}
-			udid = argv[i];
-			continue;
-		}
-		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
-			use_network = 1;
-			continue;
-		}
-		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
-			print_usage(argc, argv);
-			return 0;
-		}
-		else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
-			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
-			return 0;
-		}
-		else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--extract")) {
-			extract_raw_crash_reports = 1;
-			continue;
-		}
-		else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep")) {
-			keep_crash_reports = 1;
-			continue;
-		}
-		else if (target_directory == NULL) {
-			target_directory = argv[i];
-			continue;
-		}
-		else {
-			print_usage(argc, argv);
-			return 0;
-		}
-	}
-
-	/* ensure a target directory was supplied */
-	if (!target_directory) {
-		print_usage(argc, argv);
-		return 0;
-	}
-
-	/* check if target directory exists */
-	if (!file_exists(target_directory)) {
-		fprintf(stderr, "ERROR: Directory '%s' does not exist.\n", target_directory);
-		print_usage(argc, argv);
-		return 0;
-	}
-
-	device_error = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+	device_error = idevice_new_with_options(&device, udid, lookup);
 	if (device_error != IDEVICE_E_SUCCESS) {
 		if (udid) {
 			printf("No device found with udid %s.\n", udid);
@@ -411,7 +371,7 @@ int main(int argc, char* argv[])
 
 	lockdownd_error = lockdownd_client_new_with_handshake(device, &lockdownd, TOOL_NAME);
 	if (lockdownd_error != LOCKDOWN_E_SUCCESS) {
-		fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", lockdownd_error);
+		fprintf(stderr, "%sERROR: Could not connect to lockdownd, error code %d\n", label, lockdownd_error);
 		idevice_free(device);
 		return -1;
 	}
@@ -447,7 +407,7 @@ int main(int argc, char* argv[])
 			attempts++;
 			continue;
 		} else {
-			fprintf(stderr, "ERROR: Crash logs could not be moved. Connection interrupted (%d).\n", service_error);
+			fprintf(stderr, "%sERROR: Crash logs could not be moved. Connection interrupted (%d).\n", label, service_error);
 			break;
 		}
 	}
@@ -455,7 +415,7 @@ int main(int argc, char* argv[])
 	free(ping);
 
 	if (device_error != IDEVICE_E_SUCCESS || attempts > 10) {
-		fprintf(stderr, "ERROR: Failed to receive ping message from crash report mover.\n");
+		fprintf(stderr, "%sERROR: Failed to receive ping message from crash report mover.\n", label);
 		lockdownd_client_free(lockdownd);
 		idevice_free(device);
 		return -1;
@@ -472,7 +432,7 @@ int main(int argc, char* argv[])
 	afc = NULL;
 	afc_error = afc_client_new(device, service, &afc);
 	if(afc_error != AFC_E_SUCCESS) {
-		lockdownd_client_free(lockdownd);
+		lockdownd_service_descriptor_free(service);
 		idevice_free(device);
 		return -1;
 	}
@@ -483,17 +443,253 @@ int main(int argc, char* argv[])
 	}
 
 	/* recursively copy crash reports from the device to a local directory */
-	if (afc_client_copy_and_remove_crash_reports(afc, ".", target_directory) < 0) {
-		fprintf(stderr, "ERROR: Failed to get crash reports from device.\n");
+	struct crash_ctx cctx = { afc, target_directory, label };
+	if (afc_client_copy_and_remove_crash_reports(&cctx, ".", target_directory) < 0) {
+		fprintf(stderr, "%sERROR: Failed to get crash reports from device.\n", label);
 		afc_client_free(afc);
 		idevice_free(device);
 		return -1;
 	}
 
-	printf("Done.\n");
-
 	afc_client_free(afc);
 	idevice_free(device);
 
 	return 0;
 }
+
+struct device_job {
+	char* udid;
+	enum idevice_options lookup;
+	char* target_directory;
+	char* label;
+	int result;
+};
+
+static void* device_job_run(void* arg)
+{
+	struct device_job* job = (struct device_job*)arg;
+	job->result = collect_crash_reports(job->udid, job->lookup, job->target_directory, job->label);
+	return NULL;
+}
+
+/**
+ * Collects the crash reports of all attached devices into one
+ * subdirectory per UDID, handling up to jobs devices at the same time.
+ */
+static int collect_all_crash_reports(const char* target_directory, int use_network, unsigned int jobs)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int num = 0;
+	int failed = 0;
+	int i, j;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return -1;
+	}
+
+	struct device_job* dj = (struct device_job*)calloc((count > 0) ? count : 1, sizeof(struct device_job));
+	thread_future_t* futures = (thread_future_t*)calloc((count > 0) ? count : 1, sizeof(thread_future_t));
+	if (!dj || !futures) {
+		free(dj);
+		free(futures);
+		idevice_device_list_extended_free(devices);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (devices[i]->conn_type == CONNECTION_NETWORK && !use_network) {
+			continue;
+		}
+		/* a device attached by USB and on the network is handled once */
+		for (j = 0; j < num; j++) {
+			if (!strcmp(dj[j].udid, devices[i]->udid)) {
+				break;
+			}
+		}
+		if (j < num) {
+			if (devices[i]->conn_type != CONNECTION_NETWORK) {
+				dj[j].lookup = IDEVICE_LOOKUP_USBMUX;
+			}
+			continue;
+		}
+		dj[num].udid = strdup(devices[i]->udid);
+		dj[num].lookup = (devices[i]->conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX;
+		dj[num].target_directory = string_build_path(target_directory, devices[i]->udid, NULL);
+		dj[num].label = string_concat(devices[i]->udid, ": ", NULL);
+		num++;
+	}
+	idevice_device_list_extended_free(devices);
+
+	if (num == 0) {
+		printf("No device found.\n");
+	}
+
+	threadpool_t pool = NULL;
+	if (threadpool_new(&pool, jobs, THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+		pool = NULL;
+	}
+	for (i = 0; i < num; i++) {
+		if (!dj[i].target_directory || !dj[i].label) {
+			dj[i].result = -1;
+			continue;
+		}
+#ifdef WIN32
+		if (_mkdir(dj[i].target_directory) < 0 && errno != EEXIST) {
+#else
+		if (mkdir(dj[i].target_directory, 0755) < 0 && errno != EEXIST) {
+#endif
+			fprintf(stderr, "%sERROR: Could not create directory '%s'\n", dj[i].label, dj[i].target_directory);
+			dj[i].result = -1;
+			continue;
+		}
+		futures[i] = (pool) ? threadpool_submit(pool, device_job_run, &dj[i]) : NULL;
+		if (!futures[i]) {
+			device_job_run(&dj[i]);
+		}
+	}
+	for (i = 0; i < num; i++) {
+		if (futures[i]) {
+			thread_future_wait(futures[i]);
+			thread_future_free(futures[i]);
+		}
+		if (dj[i].result < 0) {
+			failed++;
+		}
+		free(dj[i].udid);
+		free(dj[i].target_directory);
+		free(dj[i].label);
+	}
+	if (pool) {
+		threadpool_free(pool);
+	}
+	free(futures);
+	free(dj);
+
+	return (failed) ? -1 : 0;
+}
+
+static void print_usage(int argc, char **argv)
+{
+	char *name = NULL;
+
+	name = strrchr(argv[0], '/');
+	printf("Usage: %s [OPTIONS] DIRECTORY\n", (name ? name + 1: argv[0]));
+	printf("\n");
+	printf("Move crash reports from device to a local DIRECTORY.\n");
+	printf("Reports that are already present in DIRECTORY with the same size and\n");
+	printf("modification time are not copied again.\n");
+	printf("\n");
+	printf("OPTIONS:\n");
+	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
+	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -a, --all\t\tmove crash reports of all attached devices into\n");
+	printf("           \t\tDIRECTORY/UDID, -n includes network devices\n");
+	printf("  -j, --jobs N\t\thandle at most N devices at the same time with --all\n");
+	printf("              \t\t(default: %d)\n", DEFAULT_JOBS);
+	printf("  -e, --extract\t\textract raw crash report into separate '.crash' file\n");
+	printf("  -k, --keep\t\tcopy but do not remove crash reports from device\n");
+	printf("  -d, --debug\t\tenable communication debugging\n");
+	printf("  -h, --help\t\tprints usage information\n");
+	printf("  -v, --version\t\tprints version information\n");
+	printf("\n");
+	printf("Homepage:    <" PACKAGE_URL ">\n");
+	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
+}
+
+int main(int argc, char* argv[])
+{
+	int i;
+	const char* udid = NULL;
+	const char* target_directory = NULL;
+	int use_network = 0;
+	int all_devices = 0;
+	unsigned int jobs = DEFAULT_JOBS;
+
+#ifndef WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	/* parse cmdline args */
+	for (i = 1; i < argc; i++) {
+		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
+			idevice_set_debug_level(1);
+			continue;
+		}
+		else if (!strcmp(argv[i], "-u") || !strcmp(argv[i], "--udid")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			udid = argv[i];
+			continue;
+		}
+		else if (!strcmp(argv[i], "-n") || !strcmp(argv[i], "--network")) {
+			use_network = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			all_devices = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || (jobs = (unsigned int)strtoul(argv[i], NULL, 10)) == 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
+			print_usage(argc, argv);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		}
+		else if (!strcmp(argv[i], "-e") || !strcmp(argv[i], "--extract")) {
+			extract_raw_crash_reports = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-k") || !strcmp(argv[i], "--keep")) {
+			keep_crash_reports = 1;
+			continue;
+		}
+		else if (target_directory == NULL) {
+			target_directory = argv[i];
+			continue;
+		}
+		else {
+			print_usage(argc, argv);
+			return 0;
+		}
+	}
+
+	/* ensure a target directory was supplied */
+	if (!target_directory) {
+		print_usage(argc, argv);
+		return 0;
+	}
+
+	/* check if target directory exists */
+	if (!file_exists(target_directory)) {
+		fprintf(stderr, "ERROR: Directory '%s' does not exist.\n", target_directory);
+		print_usage(argc, argv);
+		return 0;
+	}
+
+	int res;
+	if (all_devices) {
+		res = collect_all_crash_reports(target_directory, use_network, jobs);
+	} else {
+		res = collect_crash_reports(udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX, target_directory, "");
+	}
+	if (res < 0) {
+		return -1;
+	}
+
+	printf("Done.\n");
+
+	return 0;
+}
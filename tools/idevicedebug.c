@@ -412,8 +412,17 @@ int main(int argc, char *argv[])
 				log_debug("Setting environment...");
 				for (environment_index = 0; environment_index < environment_count; environment_index++) {
 					log_debug("setting environment variable: %s", environment[environment_index]);
-					debugserver_client_set_environment_hex_encoded(debugserver_client, environment[environment_index], NULL);
 				}
+				if (environment_count > 1) {
+					/* without acks the variables can be sent in one go */
+					debugserver_command_new("QStartNoAckMode", 0, NULL, &command);
+					dres = debugserver_client_send_command(debugserver_client, command, &response, NULL);
+					debugserver_command_free(command);
+					command = NULL;
+					free(response);
+					response = NULL;
+				}
+				debugserver_client_set_environment(debugserver_client, environment_count, (const char**)environment, NULL);
 			}
 
 			/* set arguments and run app */
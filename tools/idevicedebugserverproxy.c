@@ -25,39 +25,59 @@
 
 #define TOOL_NAME "idevicedebugserverproxy"
 
+#ifdef HAVE_SPLICE
+#define _GNU_SOURCE 1
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 #include <signal.h>
+#ifdef WIN32
+#include <winsock2.h>
+#define poll WSAPoll
+#else
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/debugserver.h>
 
 #include "common/socket.h"
-#include "common/thread.h"
 
 #define info(...) fprintf(stdout, __VA_ARGS__); fflush(stdout)
 #define debug(...) if(debug_mode) fprintf(stdout, __VA_ARGS__)
 
+#define PROXY_BUFFER_SIZE 131072
+
 static int debug_mode = 0;
 static int quit_flag = 0;
 
-typedef struct {
+/* one proxied client connection */
+struct proxy_connection {
 	int client_fd;
-	idevice_t device;
-	debugserver_client_t debugserver_client;
-	volatile int stop_ctod;
-	volatile int stop_dtoc;
-} socket_info_t;
-
-struct thread_info {
-	THREAD_T th;
-	struct thread_info *next;
+	idevice_connection_t device_connection;
+	int device_fd;
+	int ssl;
+#ifdef HAVE_SPLICE
+	/* pipes to move data between the sockets without copying it */
+	int pipe_ctod[2];
+	int pipe_dtoc[2];
+#endif
+	struct proxy_connection *next;
 };
 
-typedef struct thread_info thread_info_t;
-
+static struct proxy_connection *connections = NULL;
+static idevice_event_loop_t event_loop = NULL;
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd = -1;
+#endif
 
 static void clean_exit(int sig)
 {
@@ -85,171 +105,338 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
-static void *thread_device_to_client(void *data)
+#ifdef HAVE_SPLICE
+/**
+ * Moves available data from one socket to another through a pipe.
+ *
+ * @return 1 if data was forwarded, 0 if there was nothing to forward,
+ *     or -1 if one of the sockets was closed or failed.
+ */
+static int splice_forward(int from, int to, int pipefd[2])
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
-
-	int recv_len;
-	int sent;
-	char buffer[131072];
-
-	debug("%s: started thread...\n", __func__);
-
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
-
-	while (!quit_flag && !socket_info->stop_dtoc && socket_info->client_fd > 0) {
-		debug("%s: receiving data from device...\n", __func__);
-
-		res = debugserver_client_receive_with_timeout(socket_info->debugserver_client, buffer, sizeof(buffer), (uint32_t*)&recv_len, 5000);
-
-		if (recv_len <= 0) {
-			if (recv_len == 0 && res == DEBUGSERVER_E_SUCCESS) {
-				// try again
+	ssize_t n = splice(from, NULL, pipefd[1], NULL, PROXY_BUFFER_SIZE, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+	if (n == 0) {
+		return -1;
+	}
+	if (n < 0) {
+		return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+	}
+	while (n > 0) {
+		ssize_t w = splice(pipefd[0], NULL, to, NULL, n, SPLICE_F_MOVE);
+		if (w <= 0) {
+			if (w < 0 && errno == EINTR)
 				continue;
-			} else {
-				fprintf(stderr, "recv failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* send to device */
-			debug("%s: sending data to client...\n", __func__);
-			sent = socket_send(socket_info->client_fd, buffer, recv_len);
-			if (sent < recv_len) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: pushed %d bytes to client\n", __func__, sent);
-			}
+			return -1;
 		}
+		n -= w;
 	}
+	return 1;
+}
+#endif
 
-	debug("%s: shutting down...\n", __func__);
-
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+/* called by the event loop whenever the device sent data */
+static int device_to_client_cb(idevice_connection_t connection, void *user_data)
+{
+	struct proxy_connection *pc = (struct proxy_connection*)user_data;
 
-	socket_info->client_fd = -1;
-	socket_info->stop_ctod = 1;
+#ifdef HAVE_SPLICE
+	if (!pc->ssl) {
+		int res = splice_forward(pc->device_fd, pc->client_fd, pc->pipe_dtoc);
+		if (res < 0) {
+			goto device_closed;
+		}
+		return 0;
+	}
+#endif
+	char buffer[PROXY_BUFFER_SIZE];
+	uint32_t recv_len = 0;
+	idevice_error_t err = idevice_connection_receive_timeout(connection, buffer, sizeof(buffer), &recv_len, 100);
+	if (recv_len == 0) {
+		if (err == IDEVICE_E_TIMEOUT || err == IDEVICE_E_SUCCESS) {
+			return 0;
+		}
+		goto device_closed;
+	}
+	debug("%s: sending %d bytes to client fd %d\n", __func__, recv_len, pc->client_fd);
+	if (socket_send(pc->client_fd, buffer, recv_len) < (int)recv_len) {
+		fprintf(stderr, "send to client failed: %s\n", strerror(errno));
+		goto device_closed;
+	}
+	return 0;
 
-	return NULL;
+device_closed:
+	debug("%s: device connection for client fd %d closed\n", __func__, pc->client_fd);
+	/* wakes up the main loop which cleans up the connection */
+	socket_shutdown(pc->client_fd, SHUT_RDWR);
+	return 1;
 }
 
-static void *thread_client_to_device(void *data)
+/* called from the main loop whenever the client sent data, returns -1 when the client went away */
+static int client_to_device(struct proxy_connection *pc)
 {
-	socket_info_t* socket_info = (socket_info_t*)data;
-	debugserver_error_t res = DEBUGSERVER_E_UNKNOWN_ERROR;
-
-	int recv_len;
-	int sent;
-	char buffer[131072];
-	THREAD_T dtoc;
+#ifdef HAVE_SPLICE
+	if (!pc->ssl) {
+		return (splice_forward(pc->client_fd, pc->device_fd, pc->pipe_ctod) < 0) ? -1 : 0;
+	}
+#endif
+	static char buffer[PROXY_BUFFER_SIZE];
+	uint32_t sent = 0;
+	/* the main loop saw the socket readable, so skip the extra select() */
+	int recv_len = socket_receive_try(pc->client_fd, buffer, sizeof(buffer), 0, 100);
+	if (recv_len <= 0) {
+		return (recv_len == -EAGAIN || recv_len == -ETIMEDOUT) ? 0 : -1;
+	}
+	debug("%s: sending %d bytes to device\n", __func__, recv_len);
+	if (idevice_connection_send(pc->device_connection, buffer, recv_len, &sent) != IDEVICE_E_SUCCESS || sent < (uint32_t)recv_len) {
+		fprintf(stderr, "send to device failed\n");
+		return -1;
+	}
+	return 0;
+}
 
-	debug("%s: started thread...\n", __func__);
+static void proxy_connection_free(struct proxy_connection *pc)
+{
+	debug("%s: closing client fd %d\n", __func__, pc->client_fd);
+	if (pc->device_connection) {
+		/* fails harmlessly if the callback removed it already */
+		idevice_event_loop_remove(event_loop, pc->device_connection);
+		idevice_disconnect(pc->device_connection);
+	}
+#ifdef HAVE_SPLICE
+	if (pc->pipe_ctod[0] >= 0) {
+		close(pc->pipe_ctod[0]);
+		close(pc->pipe_ctod[1]);
+	}
+	if (pc->pipe_dtoc[0] >= 0) {
+		close(pc->pipe_dtoc[0]);
+		close(pc->pipe_dtoc[1]);
+	}
+#endif
+	socket_shutdown(pc->client_fd, SHUT_RDWR);
+	socket_close(pc->client_fd);
+	free(pc);
+}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+static struct proxy_connection* proxy_connection_new(idevice_t device, int client_fd)
+{
+	lockdownd_client_t lockdown = NULL;
+	lockdownd_service_descriptor_t service = NULL;
+	struct proxy_connection *pc = NULL;
 
-	/* spawn server to client thread */
-	socket_info->stop_dtoc = 0;
-	if (thread_new(&dtoc, thread_device_to_client, data) != 0) {
-		fprintf(stderr, "Failed to start device to client thread...\n");
+	if (lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "Could not connect to lockdownd.\n");
+		return NULL;
+	}
+	lockdownd_start_service(lockdown, DEBUGSERVER_SERVICE_NAME, &service);
+	lockdownd_client_free(lockdown);
+	if (!service || service->port == 0) {
+		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
+		lockdownd_service_descriptor_free(service);
+		return NULL;
 	}
 
-	while (!quit_flag && !socket_info->stop_ctod && socket_info->client_fd > 0) {
-		debug("%s: receiving data from client...\n", __func__);
+	pc = (struct proxy_connection*)calloc(1, sizeof(struct proxy_connection));
+	if (!pc) {
+		lockdownd_service_descriptor_free(service);
+		return NULL;
+	}
+	pc->client_fd = client_fd;
+	pc->ssl = service->ssl_enabled;
+#ifdef HAVE_SPLICE
+	pc->pipe_ctod[0] = pc->pipe_ctod[1] = -1;
+	pc->pipe_dtoc[0] = pc->pipe_dtoc[1] = -1;
+#endif
 
-		/* attempt to read incoming data from client */
-		recv_len = socket_receive_timeout(socket_info->client_fd, buffer, sizeof(buffer), 0, 5000);
+	if (idevice_connect(device, service->port, &pc->device_connection) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not connect to debugserver.\n");
+		goto error;
+	}
+	if (pc->ssl && idevice_connection_enable_ssl(pc->device_connection) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not enable SSL for debugserver connection.\n");
+		goto error;
+	}
+	idevice_connection_get_fd(pc->device_connection, &pc->device_fd);
 
-		/* any data received? */
-		if (recv_len <= 0) {
-			if (recv_len == 0) {
-				/* try again */
-				continue;
-			} else {
-				fprintf(stderr, "Receive failed: %s\n", strerror(errno));
-				break;
-			}
-		} else {
-			/* forward data to device */
-			debug("%s: sending data to device...\n", __func__);
-			res = debugserver_client_send(socket_info->debugserver_client, buffer, recv_len, (uint32_t*)&sent);
-
-			if (sent < recv_len || res != DEBUGSERVER_E_SUCCESS) {
-				if (sent <= 0) {
-					fprintf(stderr, "send failed: %s\n", strerror(errno));
-					break;
-				} else {
-					fprintf(stderr, "only sent %d from %d bytes\n", sent, recv_len);
-				}
-			} else {
-				// sending succeeded, receive from device
-				debug("%s: sent %d bytes to device\n", __func__, sent);
-			}
-		}
+#ifdef HAVE_SPLICE
+	if (!pc->ssl && (pipe(pc->pipe_ctod) < 0 || pipe(pc->pipe_dtoc) < 0)) {
+		fprintf(stderr, "Could not create pipes: %s\n", strerror(errno));
+		goto error;
 	}
+#endif
 
-	debug("%s: shutting down...\n", __func__);
+	if (idevice_event_loop_add(event_loop, pc->device_connection, device_to_client_cb, pc) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not watch debugserver connection.\n");
+		goto error;
+	}
 
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	lockdownd_service_descriptor_free(service);
 
-	socket_info->client_fd = -1;
-	socket_info->stop_dtoc = 1;
+	debug("%s: client fd %d connected to debugserver%s\n", __func__, client_fd, (pc->ssl) ? " (SSL)" : "");
 
-	/* join other thread to allow it to stop */
-	thread_join(dtoc);
-	thread_free(dtoc);
+	return pc;
 
+error:
+	lockdownd_service_descriptor_free(service);
+	if (pc->device_connection) {
+		idevice_disconnect(pc->device_connection);
+		pc->device_connection = NULL;
+	}
+#ifdef HAVE_SPLICE
+	if (pc->pipe_ctod[0] >= 0) {
+		close(pc->pipe_ctod[0]);
+		close(pc->pipe_ctod[1]);
+	}
+	if (pc->pipe_dtoc[0] >= 0) {
+		close(pc->pipe_dtoc[0]);
+		close(pc->pipe_dtoc[1]);
+	}
+#endif
+	free(pc);
 	return NULL;
 }
 
-static void* connection_handler(void* data)
+static void proxy_connection_remove(struct proxy_connection *pc)
+{
+	struct proxy_connection **pp = &connections;
+	while (*pp) {
+		if (*pp == pc) {
+			*pp = pc->next;
+			break;
+		}
+		pp = &(*pp)->next;
+	}
+	proxy_connection_free(pc);
+}
+
+static void accept_client(idevice_t device, int server_fd, uint16_t local_port)
 {
-	debugserver_error_t derr = DEBUGSERVER_E_SUCCESS;
-	socket_info_t* socket_info = (socket_info_t*)data;
-	THREAD_T ctod;
+	int client_fd = socket_accept(server_fd, local_port);
+	if (client_fd < 0) {
+		return;
+	}
 
-	debug("%s: client_fd = %d\n", __func__, socket_info->client_fd);
+	debug("%s: Handling new client connection...\n", __func__);
 
-	derr = debugserver_client_start_service(socket_info->device, &socket_info->debugserver_client, TOOL_NAME);
-	if (derr != DEBUGSERVER_E_SUCCESS) {
-		fprintf(stderr, "Could not start debugserver on device!\nPlease make sure to mount a developer disk image first.\n");
-		return NULL;
+	struct proxy_connection *pc = proxy_connection_new(device, client_fd);
+	if (!pc) {
+		socket_shutdown(client_fd, SHUT_RDWR);
+		socket_close(client_fd);
+		return;
+	}
+	pc->next = connections;
+	connections = pc;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = pc;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) < 0) {
+		fprintf(stderr, "Could not watch client connection: %s\n", strerror(errno));
+		proxy_connection_remove(pc);
 	}
+#endif
+}
 
-	/* spawn client to device thread */
-	socket_info->stop_ctod = 0;
-	if (thread_new(&ctod, thread_client_to_device, data) != 0) {
-		fprintf(stderr, "Failed to start client to device thread...\n");
+/**
+ * Forwards data of all proxied connections and accepts new clients until
+ * the proxy is stopped. Data from the device is handled by the event loop.
+ */
+static int run_proxy(idevice_t device, int server_fd, uint16_t local_port)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[32];
+	struct epoll_event ev;
+	int i;
+
+	epoll_fd = epoll_create(32);
+	if (epoll_fd < 0) {
+		fprintf(stderr, "Could not create epoll instance: %s\n", strerror(errno));
+		return -1;
 	}
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_fd, &ev);
 
-	/* join the fun */
-	thread_join(ctod);
-	thread_free(ctod);
+	while (!quit_flag) {
+		int n = epoll_wait(epoll_fd, events, 32, 1000);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "epoll_wait failed: %s\n", strerror(errno));
+			break;
+		}
+		for (i = 0; i < n; i++) {
+			struct proxy_connection *pc = (struct proxy_connection*)events[i].data.ptr;
+			if (!pc) {
+				accept_client(device, server_fd, local_port);
+			} else if (client_to_device(pc) < 0) {
+				epoll_ctl(epoll_fd, EPOLL_CTL_DEL, pc->client_fd, NULL);
+				proxy_connection_remove(pc);
+			}
+		}
+	}
+
+	close(epoll_fd);
+	epoll_fd = -1;
+#else
+	struct pollfd *fds = NULL;
+	struct proxy_connection **pcs = NULL;
+	unsigned int capacity = 0;
+
+	while (!quit_flag) {
+		unsigned int count = 1;
+		unsigned int i;
+		struct proxy_connection *pc;
 
-	debug("%s: shutting down...\n", __func__);
+		for (pc = connections; pc; pc = pc->next) {
+			count++;
+		}
+		if (count > capacity) {
+			capacity = count + 8;
+			fds = (struct pollfd*)realloc(fds, sizeof(struct pollfd) * capacity);
+			pcs = (struct proxy_connection**)realloc(pcs, sizeof(struct proxy_connection*) * capacity);
+			if (!fds || !pcs) {
+				fprintf(stderr, "Out of memory\n");
+				break;
+			}
+		}
+		fds[0].fd = server_fd;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		pcs[0] = NULL;
+		for (i = 1, pc = connections; pc; pc = pc->next, i++) {
+			fds[i].fd = pc->client_fd;
+			fds[i].events = POLLIN;
+			fds[i].revents = 0;
+			pcs[i] = pc;
+		}
 
-	debugserver_client_free(socket_info->debugserver_client);
-	socket_info->debugserver_client = NULL;
+		int n = poll(fds, count, 1000);
+		if (n <= 0) {
+			continue;
+		}
+		for (i = 1; i < count; i++) {
+			if (fds[i].revents && client_to_device(pcs[i]) < 0) {
+				proxy_connection_remove(pcs[i]);
+			}
+		}
+		if (fds[0].revents) {
+			accept_client(device, server_fd, local_port);
+		}
+	}
 
-	/* shutdown client socket */
-	socket_shutdown(socket_info->client_fd, SHUT_RDWR);
-	socket_close(socket_info->client_fd);
+	free(fds);
+	free(pcs);
+#endif
 
-	return NULL;
+	return 0;
 }
 
 int main(int argc, char *argv[])
 {
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	idevice_t device = NULL;
-	thread_info_t *thread_list = NULL;
 	const char* udid = NULL;
 	int use_network = 0;
 	uint16_t local_port = 0;
@@ -345,56 +532,29 @@ int main(int argc, char *argv[])
 		goto leave_cleanup;
 	}
 
-	while (!quit_flag) {
-		debug("%s: Waiting for connection on local port %d\n", __func__, local_port);
-
-		/* wait for client */
-		int client_fd = socket_accept(server_fd, local_port);
-		if (client_fd < 0) {
-			continue;
-		}
-
-		debug("%s: Handling new client connection...\n", __func__);
-
-		thread_info_t *el = (thread_info_t*)malloc(sizeof(thread_info_t));
-		if (!el) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		el->next = NULL;
-
-		if (thread_list) {
-			thread_list->next = el;
-		} else {
-			thread_list = el;
-		}
+	if (idevice_event_loop_new(&event_loop, 0) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "Could not create event loop\n");
+		socket_close(server_fd);
+		result = EXIT_FAILURE;
+		goto leave_cleanup;
+	}
 
-		socket_info_t *sinfo = (socket_info_t*)malloc(sizeof(socket_info_t));
-		if (!sinfo) {
-			fprintf(stderr, "Out of memory\n");
-			exit(EXIT_FAILURE);
-		}
-		sinfo->client_fd = client_fd;
-		sinfo->device = device;
+	debug("%s: Waiting for connections on local port %d\n", __func__, local_port);
 
-		if (thread_new(&(el->th), connection_handler, (void*)sinfo) != 0) {
-			fprintf(stderr, "Could not start connection handler.\n");
-			socket_shutdown(server_fd, SHUT_RDWR);
-			socket_close(server_fd);
-			break;
-		}
+	if (run_proxy(device, server_fd, local_port) < 0) {
+		result = EXIT_FAILURE;
 	}
 
 	debug("%s: Shutting down debugserver proxy...\n", __func__);
 
-	/* join and clean up threads */
-	while (thread_list) {
-		thread_info_t *el = thread_list;
-		thread_join(el->th);
-		thread_free(el->th);
-		thread_list = el->next;
-		free(el);
+	while (connections) {
+		proxy_connection_remove(connections);
 	}
+	idevice_event_loop_free(event_loop);
+	event_loop = NULL;
+
+	socket_shutdown(server_fd, SHUT_RDWR);
+	socket_close(server_fd);
 
 leave_cleanup:
 	if (device) {
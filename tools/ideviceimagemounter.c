@@ -46,12 +46,22 @@
 #include <libimobiledevice/mobile_image_mounter.h>
 #include <asprintf.h>
 #include "common/utils.h"
+#include "common/thread.h"
+
+#define DEFAULT_JOBS 4
 
 static int list_mode = 0;
 static int use_network = 0;
 static int xml_mode = 0;
 static const char *udid = NULL;
 static const char *imagetype = NULL;
+static int all_mode = 0;
+static unsigned int jobs = DEFAULT_JOBS;
+static unsigned int per_group = 0;
+/* devices given with -u, with the optional group of each */
+static char **udids = NULL;
+static char **groups = NULL;
+static unsigned int num_udids = 0;
 
 static const char PKG_PATH[] = "PublicStaging";
 static const char PATH_PREFIX[] = "/private/var/mobile/Media";
@@ -71,7 +81,11 @@ static void print_usage(int argc, char **argv)
 	printf("Mounts the specified disk image on the device.\n");
 	printf("\n");
 	printf("OPTIONS:\n");
-	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
+	printf("  -u, --udid UDID[@GROUP]\ttarget specific device by UDID, can be given\n");
+	printf("  \t\t\tmultiple times. GROUP, e.g. the USB hub, is used for -g.\n");
+	printf("  -a, --all\t\tmount on all connected devices at once\n");
+	printf("  -j, --jobs N\t\tmount on at most N devices at a time (default 4)\n");
+	printf("  -g, --per-group N\tmount on at most N devices of a GROUP at a time\n");
 	printf("  -n, --network\t\tconnect to network device\n");
 	printf("  -l, --list\t\tList mount information\n");
 	printf("  -t, --imagetype\tImage type to use, default is 'Developer'\n");
@@ -84,11 +98,38 @@ static void print_usage(int argc, char **argv)
 	printf("Bug Reports: <" PACKAGE_BUGREPORT ">\n");
 }
 
+static int add_device(const char *arg, const char *group)
+{
+	char **new_udids = (char**)realloc(udids, sizeof(char*) * (num_udids + 1));
+	if (!new_udids)
+		return -1;
+	udids = new_udids;
+	char **new_groups = (char**)realloc(groups, sizeof(char*) * (num_udids + 1));
+	if (!new_groups)
+		return -1;
+	groups = new_groups;
+
+	char *dev_udid = strdup(arg);
+	char *sep = strchr(dev_udid, '@');
+	if (sep) {
+		*sep = '\0';
+		group = sep + 1;
+	}
+	udids[num_udids] = dev_udid;
+	groups[num_udids] = (group && *group) ? strdup(group) : NULL;
+	num_udids++;
+
+	return 0;
+}
+
 static void parse_opts(int argc, char **argv)
 {
 	static struct option longopts[] = {
 		{ "help",      no_argument,       NULL, 'h' },
 		{ "udid",      required_argument, NULL, 'u' },
+		{ "all",       no_argument,       NULL, 'a' },
+		{ "jobs",      required_argument, NULL, 'j' },
+		{ "per-group", required_argument, NULL, 'g' },
 		{ "network",   no_argument,       NULL, 'n' },
 		{ "list",      no_argument,       NULL, 'l' },
 		{ "imagetype", required_argument, NULL, 't' },
@@ -100,7 +141,7 @@ static void parse_opts(int argc, char **argv)
 	int c;
 
 	while (1) {
-		c = getopt_long(argc, argv, "hu:lt:xdnv", longopts, NULL);
+		c = getopt_long(argc, argv, "hu:aj:g:lt:xdnv", longopts, NULL);
 		if (c == -1) {
 			break;
 		}
@@ -110,12 +151,30 @@ static void parse_opts(int argc, char **argv)
 			print_usage(argc, argv);
 			exit(0);
 		case 'u':
-			if (!*optarg) {
+			if (!*optarg || *optarg == '@') {
 				fprintf(stderr, "ERROR: UDID must not be empty!\n");
 				print_usage(argc, argv);
 				exit(2);
 			}
-			udid = optarg;
+			if (add_device(optarg, NULL) < 0) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				exit(1);
+			}
+			udid = udids[num_udids - 1];
+			break;
+		case 'a':
+			all_mode = 1;
+			break;
+		case 'j':
+			jobs = (unsigned int)strtoul(optarg, NULL, 10);
+			if (jobs == 0) {
+				fprintf(stderr, "ERROR: Invalid number of jobs '%s'\n", optarg);
+				print_usage(argc, argv);
+				exit(2);
+			}
+			break;
+		case 'g':
+			per_group = (unsigned int)strtoul(optarg, NULL, 10);
 			break;
 		case 'n':
 			use_network = 1;
@@ -151,9 +210,335 @@ static void print_xml(plist_t node)
 		puts(xml);
 }
 
+struct upload_source {
+	const char *data;
+	size_t length;
+	size_t offset;
+};
+
 static ssize_t mim_upload_cb(void* buf, size_t size, void* userdata)
 {
-	return fread(buf, 1, size, (FILE*)userdata);
+	struct upload_source *src = (struct upload_source*)userdata;
+	if (size > src->length - src->offset) {
+		size = src->length - src->offset;
+	}
+	memcpy(buf, src->data + src->offset, size);
+	src->offset += size;
+	return size;
+}
+
+struct mount_job {
+	struct file_buffer *image;
+	struct file_buffer *sig;
+	/* group index of each device and number of active mounts per group */
+	unsigned int *group_of;
+	unsigned int *group_active;
+	/* 0 = pending, 1 = running, 2 = done */
+	int *state;
+	int *results;
+	unsigned int num_done;
+	/* bytes uploaded to all devices and the total to upload */
+	uint64_t uploaded;
+	uint64_t upload_total;
+	int last_percent;
+	mutex_t mutex;
+	cond_t cond;
+};
+
+struct mount_device {
+	struct mount_job *job;
+	const char *udid;
+	struct upload_source src;
+};
+
+/* prints one line for all devices whenever the overall percentage changes */
+static void mount_report_progress(struct mount_job *job)
+{
+	int percent = (job->upload_total > 0) ? (int)((job->uploaded * 100) / job->upload_total) : 100;
+	if (percent != job->last_percent) {
+		job->last_percent = percent;
+		printf("Uploaded %d%% (%u of %u devices done)\n", percent, job->num_done, num_udids);
+		fflush(stdout);
+	}
+}
+
+static ssize_t mount_upload_cb(void* buf, size_t size, void* userdata)
+{
+	struct mount_device *dev = (struct mount_device*)userdata;
+	ssize_t amount = mim_upload_cb(buf, size, &dev->src);
+
+	mutex_lock(&dev->job->mutex);
+	dev->job->uploaded += amount;
+	mount_report_progress(dev->job);
+	mutex_unlock(&dev->job->mutex);
+
+	return amount;
+}
+
+static void mount_device_status(struct mount_job *job, const char *dev_udid, const char *status)
+{
+	mutex_lock(&job->mutex);
+	printf("[%s] %s\n", dev_udid, status);
+	fflush(stdout);
+	mutex_unlock(&job->mutex);
+}
+
+/* lookup, upload if needed and mount on one device */
+static int mount_on_device(struct mount_job *job, const char *dev_udid)
+{
+	struct mount_device dev = { job, dev_udid, { job->image->data, (size_t)job->image->length, 0 } };
+	idevice_t device = NULL;
+	lockdownd_client_t lckd = NULL;
+	mobile_image_mounter_client_t mim = NULL;
+	int res = -1;
+
+	if (idevice_new_with_options(&device, dev_udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		mount_device_status(job, dev_udid, "ERROR: Device not found");
+		goto leave;
+	}
+
+	if (lockdownd_client_new_with_handshake(device, &lckd, TOOL_NAME) != LOCKDOWN_E_SUCCESS) {
+		mount_device_status(job, dev_udid, "ERROR: Could not connect to lockdown");
+		goto leave;
+	}
+	plist_t pver = NULL;
+	char *product_version = NULL;
+	int product_version_major = 0;
+	lockdownd_get_value(lckd, NULL, "ProductVersion", &pver);
+	if (pver && plist_get_node_type(pver) == PLIST_STRING) {
+		plist_get_string_val(pver, &product_version);
+	}
+	plist_free(pver);
+	if (product_version) {
+		sscanf(product_version, "%d.", &product_version_major);
+		free(product_version);
+	}
+	lockdownd_client_free(lckd);
+	lckd = NULL;
+	if (product_version_major < 7) {
+		mount_device_status(job, dev_udid, "ERROR: Mounting on all devices requires iOS 7 or later");
+		goto leave;
+	}
+
+	if (mobile_image_mounter_start_service(device, &mim, TOOL_NAME) != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		mount_device_status(job, dev_udid, "ERROR: Could not connect to mobile_image_mounter");
+		goto leave;
+	}
+
+	mount_device_status(job, dev_udid, "Mounting...");
+	int already_mounted = 0;
+	mobile_image_mounter_error_t err = mobile_image_mounter_ensure_mounted(mim, imagetype, (size_t)job->image->length, job->sig->data, (uint16_t)job->sig->length, mount_upload_cb, &dev, &already_mounted);
+	if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
+		mount_device_status(job, dev_udid, (already_mounted) ? "Image is already mounted." : "Done.");
+		res = 0;
+	} else if (err == MOBILE_IMAGE_MOUNTER_E_DEVICE_LOCKED) {
+		mount_device_status(job, dev_udid, "ERROR: Device is locked, can't mount. Unlock device and try again.");
+	} else {
+		char msg[64];
+		snprintf(msg, sizeof(msg), "ERROR: Mounting failed (%d)", err);
+		mount_device_status(job, dev_udid, msg);
+	}
+
+	mobile_image_mounter_hangup(mim);
+
+leave:
+	/* whatever was not uploaded to this device does not count anymore */
+	mutex_lock(&job->mutex);
+	job->upload_total -= dev.src.length - dev.src.offset;
+	mutex_unlock(&job->mutex);
+
+	if (mim)
+		mobile_image_mounter_free(mim);
+	if (lckd)
+		lockdownd_client_free(lckd);
+	if (device)
+		idevice_free(device);
+
+	return res;
+}
+
+static void* mount_worker(void *arg)
+{
+	struct mount_job *job = (struct mount_job*)arg;
+
+	mutex_lock(&job->mutex);
+	while (1) {
+		unsigned int i;
+		int pending = 0;
+		int next = -1;
+		for (i = 0; i < num_udids; i++) {
+			if (job->state[i] != 0)
+				continue;
+			pending = 1;
+			if (per_group == 0 || job->group_active[job->group_of[i]] < per_group) {
+				next = (int)i;
+				break;
+			}
+		}
+		if (!pending) {
+			break;
+		}
+		if (next < 0) {
+			/* all pending devices are in busy groups */
+			cond_wait(&job->cond, &job->mutex);
+			continue;
+		}
+		job->state[next] = 1;
+		job->group_active[job->group_of[next]]++;
+		mutex_unlock(&job->mutex);
+
+		int res = mount_on_device(job, udids[next]);
+
+		mutex_lock(&job->mutex);
+		job->results[next] = res;
+		job->state[next] = 2;
+		job->group_active[job->group_of[next]]--;
+		job->num_done++;
+		mount_report_progress(job);
+		cond_broadcast(&job->cond);
+	}
+	mutex_unlock(&job->mutex);
+
+	return NULL;
+}
+
+/* mounts the image on all given devices, the image and signature are mapped only once */
+static int mount_on_all_devices(const char *image_path, const char *image_sig_path)
+{
+	struct file_buffer image = { NULL, 0, NULL };
+	struct file_buffer sig = { NULL, 0, NULL };
+	struct mount_job job;
+	THREAD_T *threads = NULL;
+	unsigned int num_threads = 0;
+	unsigned int i, j;
+	int res = -1;
+
+	if (all_mode) {
+		idevice_info_t *devices = NULL;
+		int count = 0;
+		if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+			return -1;
+		}
+		for (i = 0; i < (unsigned int)count; i++) {
+			if (devices[i]->conn_type != ((use_network) ? CONNECTION_NETWORK : CONNECTION_USBMUXD))
+				continue;
+			for (j = 0; j < num_udids; j++) {
+				if (!strcmp(udids[j], devices[i]->udid))
+					break;
+			}
+			if (j == num_udids && add_device(devices[i]->udid, NULL) < 0) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
+			}
+		}
+		idevice_device_list_extended_free(devices);
+	}
+	if (num_udids == 0) {
+		printf("No device found.\n");
+		return -1;
+	}
+
+	if (buffer_map_from_filename(image_sig_path, &sig) < 0 || sig.length > UINT16_MAX) {
+		fprintf(stderr, "Could not read signature from file '%s'\n", image_sig_path);
+		buffer_unmap(&sig);
+		return -1;
+	}
+	if (buffer_map_from_filename(image_path, &image) < 0 || image.length == 0) {
+		fprintf(stderr, "Error opening image file '%s': %s\n", image_path, strerror(errno));
+		buffer_unmap(&sig);
+		return -1;
+	}
+
+	memset(&job, '\0', sizeof(job));
+	job.image = &image;
+	job.sig = &sig;
+	job.last_percent = -1;
+	job.upload_total = image.length * num_udids;
+	job.group_of = (unsigned int*)calloc(num_udids, sizeof(unsigned int));
+	job.group_active = (unsigned int*)calloc(num_udids, sizeof(unsigned int));
+	job.state = (int*)calloc(num_udids, sizeof(int));
+	job.results = (int*)calloc(num_udids, sizeof(int));
+	if (jobs > num_udids)
+		jobs = num_udids;
+	threads = (THREAD_T*)calloc(jobs, sizeof(THREAD_T));
+	if (!job.group_of || !job.group_active || !job.state || !job.results || !threads) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		goto leave;
+	}
+
+	/* devices without a group each get one of their own */
+	for (i = 0; i < num_udids; i++) {
+		job.group_of[i] = i;
+		job.results[i] = -1;
+		if (!groups[i])
+			continue;
+		for (j = 0; j < i; j++) {
+			if (groups[j] && !strcmp(groups[i], groups[j])) {
+				job.group_of[i] = job.group_of[j];
+				break;
+			}
+		}
+	}
+
+	mutex_init(&job.mutex);
+	cond_init(&job.cond);
+
+	printf("Mounting %s on %u device%s\n", image_path, num_udids, (num_udids == 1) ? "" : "s");
+	for (i = 0; i < jobs; i++) {
+		if (thread_new(&threads[num_threads], mount_worker, &job) != 0) {
+			break;
+		}
+		num_threads++;
+	}
+	if (num_threads == 0) {
+		/* do it without threads then */
+		mount_worker(&job);
+	}
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+
+	cond_destroy(&job.cond);
+	mutex_destroy(&job.mutex);
+
+	unsigned int failed = 0;
+	for (i = 0; i < num_udids; i++) {
+		if (job.results[i] != 0) {
+			printf("%s: FAILED\n", udids[i]);
+			failed++;
+		} else {
+			printf("%s: OK\n", udids[i]);
+		}
+	}
+	printf("Mounted on %u of %u device%s\n", num_udids - failed, num_udids, (num_udids == 1) ? "" : "s");
+	res = (failed == 0) ? 0 : -1;
+
+leave:
+	free(threads);
+	free(job.results);
+	free(job.state);
+	free(job.group_active);
+	free(job.group_of);
+	buffer_unmap(&image);
+	buffer_unmap(&sig);
+
+	return res;
+}
+
+static void free_devices(void)
+{
+	unsigned int i;
+	for (i = 0; i < num_udids; i++) {
+		free(udids[i]);
+		free(groups[i]);
+	}
+	free(udids);
+	free(groups);
+	udids = NULL;
+	groups = NULL;
+	num_udids = 0;
 }
 
 int main(int argc, char **argv)
@@ -168,6 +553,9 @@ int main(int argc, char **argv)
 	char *image_path = NULL;
 	size_t image_size = 0;
 	char *image_sig_path = NULL;
+	/* the image and its signature are mapped instead of read into memory */
+	struct file_buffer image = { NULL, 0, NULL };
+	struct file_buffer sig = { NULL, 0, NULL };
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -193,6 +581,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (!list_mode && (all_mode || num_udids > 1)) {
+		if (!imagetype) {
+			imagetype = "Developer";
+		}
+		res = mount_on_all_devices(image_path, image_sig_path);
+		free(image_path);
+		free(image_sig_path);
+		free_devices();
+		return res;
+	}
+
 	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
 		if (udid) {
 			printf("No device found with udid %s.\n", udid);
@@ -291,25 +690,28 @@ int main(int argc, char **argv)
 			printf("Error: lookup_image returned %d\n", err);
 		}
 	} else {
-		char sig[8192];
-		size_t sig_length = 0;
-		FILE *f = fopen(image_sig_path, "rb");
-		if (!f) {
-			fprintf(stderr, "Error opening signature file '%s': %s\n", image_sig_path, strerror(errno));
-			goto leave;
-		}
-		sig_length = fread(sig, 1, sizeof(sig), f);
-		fclose(f);
-		if (sig_length == 0) {
+		if (buffer_map_from_filename(image_sig_path, &sig) < 0 || sig.length > UINT16_MAX) {
 			fprintf(stderr, "Could not read signature from file '%s'\n", image_sig_path);
 			goto leave;
 		}
+		uint16_t sig_length = (uint16_t)sig.length;
 
-		f = fopen(image_path, "rb");
-		if (!f) {
+		if (!imagetype) {
+			imagetype = "Developer";
+		}
+
+		int mounted = 0;
+		if (mobile_image_mounter_is_image_mounted(mim, imagetype, sig.data, sig_length, &mounted) == MOBILE_IMAGE_MOUNTER_E_SUCCESS && mounted) {
+			printf("Image is already mounted.\n");
+			res = 0;
+			goto error_out;
+		}
+
+		if (buffer_map_from_filename(image_path, &image) < 0) {
 			fprintf(stderr, "Error opening image file '%s': %s\n", image_path, strerror(errno));
 			goto leave;
 		}
+		image_size = (size_t)image.length;
 
 		char *targetname = NULL;
 		if (asprintf(&targetname, "%s/%s", PKG_PATH, "staging.dimage") < 0) {
@@ -322,73 +724,63 @@ int main(int argc, char **argv)
 			goto leave;
 		}
 
-
-		if (!imagetype) {
-			imagetype = "Developer";
-		}
-
 		switch(disk_image_upload_type) {
 			case DISK_IMAGE_UPLOAD_TYPE_UPLOAD_IMAGE:
 				printf("Uploading %s\n", image_path);
-				err = mobile_image_mounter_upload_image(mim, imagetype, image_size, sig, sig_length, mim_upload_cb, f);
+				struct upload_source src = { image.data, image_size, 0 };
+				err = mobile_image_mounter_upload_image(mim, imagetype, image_size, sig.data, sig_length, mim_upload_cb, &src);
 				break;
 			case DISK_IMAGE_UPLOAD_TYPE_AFC:
 			default:
 				printf("Uploading %s --> afc:///%s\n", image_path, targetname);
-				char **strs = NULL;
-				if (afc_get_file_info(afc, PKG_PATH, &strs) != AFC_E_SUCCESS) {
+				afc_file_info_t info;
+				if (afc_get_file_info_struct(afc, PKG_PATH, &info) != AFC_E_SUCCESS) {
 					if (afc_make_directory(afc, PKG_PATH) != AFC_E_SUCCESS) {
 						fprintf(stderr, "WARNING: Could not create directory '%s' on device!\n", PKG_PATH);
 					}
 				}
-				if (strs) {
-					int i = 0;
-					while (strs[i]) {
-						free(strs[i]);
-						i++;
-					}
-					free(strs);
-				}
 
 				uint64_t af = 0;
 				if ((afc_file_open(afc, targetname, AFC_FOPEN_WRONLY, &af) !=
 					 AFC_E_SUCCESS) || !af) {
-					fclose(f);
 					fprintf(stderr, "afc_file_open on '%s' failed!\n", targetname);
 					goto leave;
 				}
 
-				char buf[8192];
-				size_t amount = 0;
-				do {
-					amount = fread(buf, 1, sizeof(buf), f);
-					if (amount > 0) {
-						uint32_t written, total = 0;
-						while (total < amount) {
-							written = 0;
-							if (afc_file_write(afc, af, buf + total, amount - total, &written) !=
-								AFC_E_SUCCESS) {
-								fprintf(stderr, "AFC Write error!\n");
-								break;
-							}
-							total += written;
-						}
-						if (total != amount) {
-							fprintf(stderr, "Error: wrote only %d of %d\n", total,
-									(unsigned int)amount);
-							afc_file_close(afc, af);
-							fclose(f);
-							goto leave;
+				/* written straight from the mapped image */
+				size_t offset = 0;
+				while (offset < image_size) {
+					size_t amount = image_size - offset;
+					if (amount > 8192) {
+						amount = 8192;
+					}
+					uint32_t written, total = 0;
+					while (total < amount) {
+						written = 0;
+						if (afc_file_write_async(afc, af, image.data + offset + total, amount - total, &written) !=
+							AFC_E_SUCCESS) {
+							fprintf(stderr, "AFC Write error!\n");
+							break;
 						}
+						total += written;
 					}
+					if (total != amount) {
+						fprintf(stderr, "Error: wrote only %d of %d\n", total,
+								(unsigned int)amount);
+						afc_file_close(afc, af);
+						goto leave;
+					}
+					offset += amount;
 				}
-				while (amount > 0);
 
-				afc_file_close(afc, af);
+				if (afc_file_close(afc, af) != AFC_E_SUCCESS) {
+					fprintf(stderr, "AFC Write error!\n");
+					goto leave;
+				}
 				break;
 		}
 
-		fclose(f);
+		buffer_unmap(&image);
 
 		if (err != MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 			if (err == MOBILE_IMAGE_MOUNTER_E_DEVICE_LOCKED) {
@@ -401,7 +793,7 @@ int main(int argc, char **argv)
 		printf("done.\n");
 
 		printf("Mounting...\n");
-		err = mobile_image_mounter_mount_image(mim, mountname, sig, sig_length, imagetype, &result);
+		err = mobile_image_mounter_mount_image(mim, mountname, sig.data, sig_length, imagetype, &result);
 		if (err == MOBILE_IMAGE_MOUNTER_E_SUCCESS) {
 			if (result) {
 				plist_t node = plist_dict_get_item(result, "Status");
@@ -479,10 +871,14 @@ leave:
 	}
 	idevice_free(device);
 
+	buffer_unmap(&image);
+	buffer_unmap(&sig);
+
 	if (image_path)
 			free(image_path);
 	if (image_sig_path)
 		free(image_sig_path);
+	free_devices();
 
 	return res;
 }
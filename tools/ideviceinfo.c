@@ -38,11 +38,16 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include "common/utils.h"
+#include "common/thread.h"
 
 #include <lusb0_usb.h>
 
 #define FORMAT_KEY_VALUE 1
 #define FORMAT_XML 2
+#define FORMAT_JSON 3
+
+/* devices queried at the same time with --all */
+#define DEFAULT_JOBS 16
 
 #define VID_APPLE 0x5ac
 
@@ -92,6 +97,200 @@ static int is_domain_known(const char *domain)
 	return 0;
 }
 
+/* what to query, shared by all workers */
+struct query {
+	const char *domain;
+	const char **keys;
+	uint32_t num_keys;
+	int simple;
+	int use_network;
+};
+
+struct device_query {
+	const struct query *query;
+	char *udid;
+	enum idevice_connection_type conn_type;
+	plist_t result;
+	char *error;
+};
+
+/**
+ * Queries the requested values. A single key, or none, is fetched with one
+ * GetValue request, several keys are fetched with pipelined requests and
+ * returned as a dictionary.
+ */
+static lockdownd_error_t query_values(lockdownd_client_t client, const struct query *query, plist_t *result)
+{
+	uint32_t i;
+
+	if (query->num_keys <= 1) {
+		return lockdownd_get_value(client, query->domain, (query->num_keys) ? query->keys[0] : NULL, result);
+	}
+
+	plist_t *values = (plist_t*)calloc(query->num_keys, sizeof(plist_t));
+	const char **query_domains = (const char**)calloc(query->num_keys, sizeof(const char*));
+	if (!values || !query_domains) {
+		free(values);
+		free(query_domains);
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	for (i = 0; i < query->num_keys; i++) {
+		query_domains[i] = query->domain;
+	}
+	lockdownd_error_t ldret = lockdownd_get_values(client, query_domains, query->keys, query->num_keys, values);
+	if (ldret == LOCKDOWN_E_SUCCESS) {
+		*result = plist_new_dict();
+		for (i = 0; i < query->num_keys; i++) {
+			if (values[i]) {
+				plist_dict_set_item(*result, query->keys[i], values[i]);
+			}
+		}
+	}
+	free(query_domains);
+	free(values);
+	return ldret;
+}
+
+static void* query_device_worker(void *arg)
+{
+	struct device_query *dq = (struct device_query*)arg;
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	lockdownd_error_t ldret;
+	char errbuf[128];
+
+	if (idevice_new_with_options(&device, dq->udid, (dq->conn_type == CONNECTION_NETWORK) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		dq->error = strdup("Device not found");
+		return NULL;
+	}
+	ldret = (dq->query->simple) ?
+		lockdownd_client_new(device, &client, TOOL_NAME) :
+		lockdownd_client_new_with_handshake(device, &client, TOOL_NAME);
+	if (ldret != LOCKDOWN_E_SUCCESS) {
+		snprintf(errbuf, sizeof(errbuf), "Could not connect to lockdownd: %s (%d)", lockdownd_strerror(ldret), ldret);
+		dq->error = strdup(errbuf);
+		idevice_free(device);
+		return NULL;
+	}
+	ldret = query_values(client, dq->query, &dq->result);
+	if (ldret != LOCKDOWN_E_SUCCESS) {
+		snprintf(errbuf, sizeof(errbuf), "Query failed: %s (%d)", lockdownd_strerror(ldret), ldret);
+		dq->error = strdup(errbuf);
+	}
+	lockdownd_client_free(client);
+	idevice_free(device);
+	return NULL;
+}
+
+static void print_result(plist_t node, int format)
+{
+	char *xml_doc = NULL;
+	uint32_t xml_length = 0;
+
+	switch (format) {
+	case FORMAT_XML:
+		plist_to_xml(node, &xml_doc, &xml_length);
+		printf("%s", xml_doc);
+		free(xml_doc);
+		break;
+	case FORMAT_JSON:
+		plist_print_json_to_stream(node, stdout);
+		break;
+	case FORMAT_KEY_VALUE:
+	default:
+		plist_print_to_stream(node, stdout);
+		break;
+	}
+}
+
+/**
+ * Queries all attached devices concurrently and prints one document with
+ * the results keyed by UDID.
+ */
+static int query_all_devices(const struct query *query, unsigned int jobs, int format)
+{
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	int num = 0;
+	int failed = 0;
+	int i, j;
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		return -1;
+	}
+
+	struct device_query *dqs = (struct device_query*)calloc((count > 0) ? count : 1, sizeof(struct device_query));
+	thread_future_t *futures = (thread_future_t*)calloc((count > 0) ? count : 1, sizeof(thread_future_t));
+	if (!dqs || !futures) {
+		free(dqs);
+		free(futures);
+		idevice_device_list_extended_free(devices);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (devices[i]->conn_type == CONNECTION_NETWORK && !query->use_network) {
+			continue;
+		}
+		/* a device attached by USB and on the network is queried once */
+		for (j = 0; j < num; j++) {
+			if (!strcmp(dqs[j].udid, devices[i]->udid)) {
+				break;
+			}
+		}
+		if (j < num) {
+			if (devices[i]->conn_type != CONNECTION_NETWORK) {
+				dqs[j].conn_type = devices[i]->conn_type;
+			}
+			continue;
+		}
+		dqs[num].query = query;
+		dqs[num].udid = strdup(devices[i]->udid);
+		dqs[num].conn_type = devices[i]->conn_type;
+		num++;
+	}
+	idevice_device_list_extended_free(devices);
+
+	threadpool_t pool = NULL;
+	if (threadpool_new(&pool, jobs, THREADPOOL_DEFAULT_IDLE_TIMEOUT) < 0) {
+		pool = NULL;
+	}
+	for (i = 0; i < num; i++) {
+		futures[i] = (pool) ? threadpool_submit(pool, query_device_worker, &dqs[i]) : NULL;
+		if (!futures[i]) {
+			query_device_worker(&dqs[i]);
+		}
+	}
+
+	plist_t output = plist_new_dict();
+	for (i = 0; i < num; i++) {
+		if (futures[i]) {
+			thread_future_wait(futures[i]);
+			thread_future_free(futures[i]);
+		}
+		if (dqs[i].error) {
+			plist_t err = plist_new_dict();
+			plist_dict_set_item(err, "Error", plist_new_string(dqs[i].error));
+			plist_dict_set_item(output, dqs[i].udid, err);
+			free(dqs[i].error);
+			failed++;
+		} else if (dqs[i].result) {
+			plist_dict_set_item(output, dqs[i].udid, dqs[i].result);
+		}
+		free(dqs[i].udid);
+	}
+	if (pool) {
+		threadpool_free(pool);
+	}
+	free(futures);
+	free(dqs);
+
+	print_result(output, format);
+	plist_free(output);
+
+	return (failed) ? 1 : 0;
+}
+
 static void find_driver(int pid, const char* udid) {
 	if (!udid) {
 		printf("FALSE");
@@ -107,46 +306,46 @@ static void find_driver(int pid, const char* udid) {
 		return;
 	}
 
-	usb_find_busses();
+	usb_find_busses();
 	usb_find_devices();
 
-	struct usb_bus *bus;
-	struct usb_device *dev;
-
+	struct usb_bus *bus;
+	struct usb_device *dev;
+
 	bus = usb_get_busses();
 
-	for (bus; bus; bus = bus->next)
-	{
-		for (dev = bus->devices; dev; dev = dev->next)
-		{
-			if (dev->descriptor.idVendor != VID_APPLE
-				|| dev->descriptor.idProduct != pid)
-			{
-				continue;
-			}
-
-			usb_dev_handle *handle = usb_open(dev);
-
-			if (handle) {
-				boolean result = FALSE;
-				char dev_serial[100];
-				int ret = usb_get_string_simple(handle, dev->descriptor.iSerialNumber, dev_serial, 100);
-				if (ret) {
-					//printf("find_driver dev_serial:%s \n", dev_serial);
-					if (strcmp(udid, dev_serial) == 0) {
-						result = TRUE;
-					}
-				}
-				usb_close(handle);
-
-				if (result) {
-					printf("TRUE");
-					return;
-				}
-			}
-		}
-	}
-	
+	for (bus; bus; bus = bus->next)
+	{
+		for (dev = bus->devices; dev; dev = dev->next)
+		{
+			if (dev->descriptor.idVendor != VID_APPLE
+				|| dev->descriptor.idProduct != pid)
+			{
+				continue;
+			}
+
+			usb_dev_handle *handle = usb_open(dev);
+
+			if (handle) {
+				boolean result = FALSE;
+				char dev_serial[100];
+				int ret = usb_get_string_simple(handle, dev->descriptor.iSerialNumber, dev_serial, 100);
+				if (ret) {
+					//printf("find_driver dev_serial:%s \n", dev_serial);
+					if (strcmp(udid, dev_serial) == 0) {
+						result = TRUE;
+					}
+				}
+				usb_close(handle);
+
+				if (result) {
+					printf("TRUE");
+					return;
+				}
+			}
+		}
+	}
+	
 	printf("FALSE");
 }
 
@@ -166,7 +365,13 @@ static void print_usage(int argc, char **argv, int is_error)
 		"  -s, --simple       use a simple connection to avoid auto-pairing with the device\n" \
 		"  -q, --domain NAME  set domain of query to NAME. Default: None\n" \
 		"  -k, --key NAME     only query key specified by NAME. Default: All keys.\n" \
+		"                     Can be given multiple times to query several keys.\n" \
 		"  -x, --xml          output information as xml plist instead of key/value pairs\n" \
+		"  --json             output information as JSON instead of key/value pairs\n" \
+		"  --all              query all attached devices at once, -n includes network\n" \
+		"                     devices, the output is keyed by UDID\n" \
+		"  -j, --jobs N       query at most N devices at the same time with --all\n" \
+		"                     (default: 16)\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -d, --debug        enable communication debugging\n" \
 		"  -v, --version      prints version information\n" \
@@ -200,9 +405,10 @@ int main(int argc, char *argv[])
 	int assistive_func = 0;
 	int assistive_enable = 0;
 	const char *domain = NULL;
-	const char *key = NULL;
-	char *xml_doc = NULL;
-	uint32_t xml_length;
+	const char **keys = NULL;
+	uint32_t num_keys = 0;
+	int query_all = 0;
+	unsigned int jobs = DEFAULT_JOBS;
 	plist_t node = NULL;
 
 	int c = 0;
@@ -220,6 +426,9 @@ int main(int argc, char *argv[])
 		{ "reset", no_argument, NULL, 'r' },
 		{ "get", no_argument, NULL, 'g' },
 		{ "find", required_argument, NULL, 'f' },
+		{ "json", no_argument, NULL, 'J' },
+		{ "all", no_argument, NULL, 'A' },
+		{ "jobs", required_argument, NULL, 'j' },
 		{ NULL, 0, NULL, 0}
 	};
 
@@ -227,7 +436,7 @@ int main(int argc, char *argv[])
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxvargf:", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nq:k:sxvargf:j:", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -257,11 +466,29 @@ int main(int argc, char *argv[])
 				print_usage(argc, argv, 1);
 				return 2;
 			}
-			key = optarg;
+			keys = (const char**)realloc(keys, (num_keys + 1) * sizeof(const char*));
+			if (!keys) {
+				return -1;
+			}
+			keys[num_keys++] = optarg;
 			break;
 		case 'x':
 			format = FORMAT_XML;
 			break;
+		case 'J':
+			format = FORMAT_JSON;
+			break;
+		case 'A':
+			query_all = 1;
+			break;
+		case 'j':
+			jobs = (unsigned int)strtoul(optarg, NULL, 10);
+			if (jobs == 0) {
+				fprintf(stderr, "ERROR: 'jobs' must be a positive number!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
 		case 's':
 			simple = 1;
 			break;
@@ -298,6 +525,19 @@ int main(int argc, char *argv[])
 	argc -= optind;
 	argv += optind;
 
+	struct query query;
+	query.domain = domain;
+	query.keys = keys;
+	query.num_keys = num_keys;
+	query.simple = simple;
+	query.use_network = use_network;
+
+	if (query_all) {
+		int res = query_all_devices(&query, jobs, format);
+		free(keys);
+		return res;
+	}
+
 	ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
 		if (udid) {
@@ -310,33 +550,33 @@ int main(int argc, char *argv[])
 
 	if (assistive_func == 1) {
 		ldret = lockdownd_client_new_with_handshake(device, &client, "oa");
-		if (ldret != LOCKDOWN_E_SUCCESS) {
-			printf("ERROR: Could not connect to lockdownd: %s (%d)\n", lockdownd_strerror(ldret), ldret);
-			idevice_free(device);
-			return -1;
+		if (ldret != LOCKDOWN_E_SUCCESS) {
+			printf("ERROR: Could not connect to lockdownd: %s (%d)\n", lockdownd_strerror(ldret), ldret);
+			idevice_free(device);
+			return -1;
 		}
 
 		if (assistive_enable == 10) {
 			ldret = lockdownd_get_value(client, "com.apple.Accessibility", "AssistiveTouchEnabledByiTunes", &node);
-			if (ldret == LOCKDOWN_E_SUCCESS) {
-				if (node) {
-					plist_print_to_stream(node, stdout);
-					plist_free(node);
-					node = NULL;
-				}
+			if (ldret == LOCKDOWN_E_SUCCESS) {
+				if (node) {
+					plist_print_to_stream(node, stdout);
+					plist_free(node);
+					node = NULL;
+				}
 			}
 		}
 		else {
 			node = plist_new_bool(assistive_enable != 0);
 			ldret = lockdownd_set_value(client, "com.apple.Accessibility", "AssistiveTouchEnabledByiTunes", node);
-			if (ldret == LOCKDOWN_E_SUCCESS) {
-				printf("1");
+			if (ldret == LOCKDOWN_E_SUCCESS) {
+				printf("1");
 			}
 		}
 
-		lockdownd_client_free(client);
-		idevice_free(device);
-
+		lockdownd_client_free(client);
+		idevice_free(device);
+
 		return 0;
 	}
 
@@ -349,22 +589,9 @@ int main(int argc, char *argv[])
 	}
 
 	/* run query and output information */
-	if(lockdownd_get_value(client, domain, key, &node) == LOCKDOWN_E_SUCCESS) {
+	if (query_values(client, &query, &node) == LOCKDOWN_E_SUCCESS) {
 		if (node) {
-			switch (format) {
-			case FORMAT_XML:
-				plist_to_xml(node, &xml_doc, &xml_length);
-				printf("%s", xml_doc);
-				free(xml_doc);
-				break;
-			case FORMAT_KEY_VALUE:
-				plist_print_to_stream(node, stdout);
-				break;
-			default:
-				if (key != NULL)
-					plist_print_to_stream(node, stdout);
-			break;
-			}
+			print_result(node, format);
 			plist_free(node);
 			node = NULL;
 		}
@@ -372,6 +599,7 @@ int main(int argc, char *argv[])
 
 	lockdownd_client_free(client);
 	idevice_free(device);
+	free(keys);
 
 	return 0;
 }
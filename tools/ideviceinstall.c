@@ -0,0 +1,237 @@
+/*
+ * ideviceinstall.c
+ * Install an application package on one or more devices
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "ideviceinstall"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/installation_proxy.h>
+
+#define DEFAULT_JOBS 4
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *bname = strrchr(argv[0], '/');
+	bname = (bname) ? bname + 1 : argv[0];
+
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] PACKAGE\n", bname);
+	fprintf(is_error ? stderr : stdout, "\n" \
+		"Install an application package (.ipa) on one or more devices at once.\n" \
+		"\n" \
+		"OPTIONS:\n" \
+		"  -u, --udid UDID[@GROUP]  install on device with UDID, can be given multiple\n" \
+		"                           times. GROUP, e.g. the USB hub, is used for -g.\n" \
+		"  -a, --all                install on all devices connected via USB\n" \
+		"  -j, --jobs N             install on at most N devices at a time (default 4)\n" \
+		"  -g, --per-group N        install on at most N devices of a GROUP at a time\n" \
+		"  -d, --debug              enable communication debugging\n" \
+		"  -h, --help               prints usage information\n" \
+		"  -v, --version            prints version information\n" \
+		"\n" \
+		"Homepage:    <" PACKAGE_URL ">\n" \
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+static void progress_cb(const char *udid, const char *status, int percent, void *user_data)
+{
+	if (percent >= 0) {
+		printf("[%s] %s (%d%%)\n", udid, status, percent);
+	} else {
+		printf("[%s] %s\n", udid, status);
+	}
+	fflush(stdout);
+}
+
+static int add_device(char ***udids, char ***groups, unsigned int *count, const char *arg)
+{
+	char **new_udids = (char**)realloc(*udids, sizeof(char*) * (*count + 1));
+	if (!new_udids)
+		return -1;
+	*udids = new_udids;
+	char **new_groups = (char**)realloc(*groups, sizeof(char*) * (*count + 1));
+	if (!new_groups)
+		return -1;
+	*groups = new_groups;
+
+	char *udid = strdup(arg);
+	char *group = strchr(udid, '@');
+	if (group) {
+		*group = '\0';
+		group++;
+	}
+	(*udids)[*count] = udid;
+	(*groups)[*count] = (group && *group) ? group : NULL;
+	(*count)++;
+
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	const struct option longopts[] = {
+		{ "udid",      required_argument, NULL, 'u' },
+		{ "all",       no_argument,       NULL, 'a' },
+		{ "jobs",      required_argument, NULL, 'j' },
+		{ "per-group", required_argument, NULL, 'g' },
+		{ "debug",     no_argument,       NULL, 'd' },
+		{ "help",      no_argument,       NULL, 'h' },
+		{ "version",   no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+	char **udids = NULL;
+	char **groups = NULL;
+	unsigned int num_devices = 0;
+	int all_devices = 0;
+	unsigned int jobs = DEFAULT_JOBS;
+	unsigned int per_group = 0;
+	unsigned int i;
+	int res = 1;
+
+	while ((c = getopt_long(argc, argv, "u:aj:g:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg || *optarg == '@') {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			if (add_device(&udids, &groups, &num_devices, optarg) < 0) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				return 1;
+			}
+			break;
+		case 'a':
+			all_devices = 1;
+			break;
+		case 'j':
+			jobs = (unsigned int)strtoul(optarg, NULL, 10);
+			if (jobs == 0) {
+				fprintf(stderr, "ERROR: Invalid number of jobs '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
+		case 'g':
+			per_group = (unsigned int)strtoul(optarg, NULL, 10);
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1) {
+		print_usage(argc+optind, argv-optind, 1);
+		return 2;
+	}
+	const char *package = argv[0];
+
+	if (all_devices) {
+		idevice_info_t *devices = NULL;
+		int count = 0;
+		if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+			return 1;
+		}
+		for (i = 0; i < (unsigned int)count; i++) {
+			if (devices[i]->conn_type != CONNECTION_USBMUXD)
+				continue;
+			if (add_device(&udids, &groups, &num_devices, devices[i]->udid) < 0) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				break;
+			}
+		}
+		idevice_device_list_extended_free(devices);
+	} else if (num_devices == 0) {
+		/* use the first device like the other tools do */
+		idevice_t device = NULL;
+		char *udid = NULL;
+		if (idevice_new(&device, NULL) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: No device found!\n");
+			return 1;
+		}
+		idevice_get_udid(device, &udid);
+		idevice_free(device);
+		if (udid) {
+			add_device(&udids, &groups, &num_devices, udid);
+			free(udid);
+		}
+	}
+
+	if (num_devices == 0) {
+		fprintf(stderr, "ERROR: No device found!\n");
+		goto leave;
+	}
+
+	instproxy_error_t *results = (instproxy_error_t*)calloc(num_devices, sizeof(instproxy_error_t));
+	if (!results) {
+		fprintf(stderr, "ERROR: Out of memory\n");
+		goto leave;
+	}
+
+	printf("Installing %s on %u device%s\n", package, num_devices, (num_devices == 1) ? "" : "s");
+	instproxy_error_t err = instproxy_install_on_devices(package, (const char**)udids, (const char**)groups, num_devices, NULL, jobs, per_group, progress_cb, NULL, results);
+	if (err == INSTPROXY_E_INVALID_ARG) {
+		fprintf(stderr, "ERROR: Could not read package %s\n", package);
+	} else {
+		unsigned int failed = 0;
+		for (i = 0; i < num_devices; i++) {
+			if (results[i] != INSTPROXY_E_SUCCESS) {
+				printf("%s: FAILED (%d)\n", udids[i], results[i]);
+				failed++;
+			} else {
+				printf("%s: OK\n", udids[i]);
+			}
+		}
+		printf("Installed on %u of %u device%s\n", num_devices - failed, num_devices, (num_devices == 1) ? "" : "s");
+		res = (failed == 0) ? 0 : 1;
+	}
+	free(results);
+
+leave:
+	for (i = 0; i < num_devices; i++) {
+		free(udids[i]);
+	}
+	free(udids);
+	free(groups);
+
+	return res;
+}
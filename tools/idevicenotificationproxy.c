@@ -30,6 +30,7 @@
 #include <errno.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <sys/time.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -41,6 +42,7 @@
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/notification_proxy.h>
+#include <libimobiledevice/service.h>
 
 enum cmd_mode {
 	CMD_NONE = 0,
@@ -49,6 +51,9 @@ enum cmd_mode {
 };
 
 static int quit_flag = 0;
+static service_reconnect_t reconnect = NULL;
+static int observe_timestamp = 0;
+static int observe_connects = 0;
 
 /**
  * signal handler function for cleaning up properly
@@ -75,6 +80,7 @@ static void print_usage(int argc, char **argv)
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -t, --timestamp\tprefix observed notifications with the time they were received\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
@@ -85,7 +91,56 @@ static void print_usage(int argc, char **argv)
 
 static void notify_cb(const char *notification, void *user_data)
 {
-	printf("> %s\n", notification);
+	int timestamp = (user_data != NULL);
+
+	if (!*notification) {
+		/* the connection to the device was lost */
+		if (reconnect) {
+			fprintf(stderr, "Lost connection to notification_proxy, reconnecting...\n");
+			service_reconnect_lost(reconnect);
+		} else {
+			fprintf(stderr, "ERROR: Lost connection to notification_proxy\n");
+			quit_flag++;
+		}
+		return;
+	}
+	if (timestamp) {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		printf("[%lld.%06ld] > %s\n", (long long)tv.tv_sec, (long)tv.tv_usec, notification);
+	} else {
+		printf("> %s\n", notification);
+	}
+	/* whoever reads our output should see the notification right away */
+	fflush(stdout);
+}
+
+static int observe_connect_cb(idevice_t device, void *client, void *user_data)
+{
+	np_client_t np = (np_client_t)client;
+	char **nspec = (char**)user_data;
+	int i;
+
+	/* any non-NULL pointer asks for timestamps */
+	np_set_notify_callback(np, notify_cb, (observe_timestamp) ? (void*)&observe_timestamp : NULL);
+	if (np_observe_notifications(np, (const char**)nspec) != NP_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Could not observe notifications\n");
+		return -1;
+	}
+	if (observe_connects++ == 0) {
+		for (i = 0; nspec[i] != NULL; i++) {
+			printf("! observing \"%s\"\n", nspec[i]);
+		}
+	} else {
+		printf("! reconnected\n");
+	}
+	fflush(stdout);
+	return 0;
+}
+
+static void observe_disconnect_cb(void *client, void *user_data)
+{
+	np_client_free((np_client_t)client);
 }
 
 int main(int argc, char *argv[])
@@ -100,6 +155,7 @@ int main(int argc, char *argv[])
 	int i;
 	const char* udid = NULL;
 	int use_network = 0;
+	int timestamp = 0;
 	int cmd = CMD_NONE;
 	char* cmd_arg = NULL;
 
@@ -139,6 +195,10 @@ int main(int argc, char *argv[])
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-t") || !strcmp(argv[i], "--timestamp")) {
+			timestamp = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--version")) {
 			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
 			result = 0;
@@ -200,6 +260,25 @@ int main(int argc, char *argv[])
 		goto cleanup;
 	}
 
+	if (cmd == CMD_OBSERVE) {
+		/* keep observing across disconnects of the device */
+		idevice_free(device);
+		device = NULL;
+		observe_timestamp = timestamp;
+		if (service_reconnect_new(udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX, NP_SERVICE_NAME, TOOL_NAME, SERVICE_CONSTRUCTOR(np_client_new), observe_connect_cb, observe_disconnect_cb, nspec, &reconnect) != SERVICE_E_SUCCESS) {
+			printf("Could not start notification_proxy service on device.\n");
+			goto cleanup;
+		}
+		/* just sleep and wait for notifications */
+		while (!quit_flag) {
+			sleep(1);
+		}
+		service_reconnect_free(reconnect);
+		reconnect = NULL;
+		result = EXIT_SUCCESS;
+		goto cleanup;
+	}
+
 	if (LOCKDOWN_E_SUCCESS != (ret = lockdownd_client_new_with_handshake(device, &client, TOOL_NAME))) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd, error code %d\n", ret);
 		goto cleanup;
@@ -214,7 +293,8 @@ int main(int argc, char *argv[])
 			printf("Could not connect to notification_proxy!\n");
 			result = -1;
 		} else {
-			np_set_notify_callback(gnp, notify_cb, NULL);
+			/* any non-NULL pointer asks for timestamps */
+			np_set_notify_callback(gnp, notify_cb, (timestamp) ? (void*)&timestamp : NULL);
 
 			switch (cmd) {
 				case CMD_POST:
@@ -225,20 +305,7 @@ int main(int argc, char *argv[])
 						i++;
 					}
 					break;
-				case CMD_OBSERVE:
 				default:
-					i = 0;
-					while(nspec[i] != NULL && i < (count+1)) {
-						printf("! observing \"%s\"\n", nspec[i]);
-						np_observe_notification(gnp, nspec[i]);
-						i++;
-					}
-
-					/* just sleep and wait for notifications */
-					while (!quit_flag) {
-						sleep(1);
-					}
-
 					break;
 			}
 
@@ -30,38 +30,333 @@
 #include <string.h>
 #include <stdlib.h>
 #include <getopt.h>
+#include <time.h>
 #ifndef WIN32
 #include <signal.h>
+#include <unistd.h>
+#else
+#include <windows.h>
+#define sleep(x) Sleep(x*1000)
 #endif
 #include "common/userpref.h"
+#include "common/utils.h"
+#include "common/thread.h"
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 
+/* how long --all keeps retrying while a device shows the trust dialog */
+#define PAIR_DIALOG_TIMEOUT 300
+
 static char *udid = NULL;
 
-static void print_error_message(lockdownd_error_t err)
+static void print_error_message(lockdownd_error_t err, const char *device_udid)
 {
 	switch (err) {
 		case LOCKDOWN_E_PASSWORD_PROTECTED:
-			printf("ERROR: Could not validate with device %s because a passcode is set. Please enter the passcode on the device and retry.\n", udid);
+			printf("ERROR: Could not validate with device %s because a passcode is set. Please enter the passcode on the device and retry.\n", device_udid);
 			break;
 		case LOCKDOWN_E_INVALID_CONF:
 		case LOCKDOWN_E_INVALID_HOST_ID:
-			printf("ERROR: Device %s is not paired with this host\n", udid);
+			printf("ERROR: Device %s is not paired with this host\n", device_udid);
 			break;
 		case LOCKDOWN_E_PAIRING_DIALOG_RESPONSE_PENDING:
-			printf("ERROR: Please accept the trust dialog on the screen of device %s, then attempt to pair again.\n", udid);
+			printf("ERROR: Please accept the trust dialog on the screen of device %s, then attempt to pair again.\n", device_udid);
 			break;
 		case LOCKDOWN_E_USER_DENIED_PAIRING:
-			printf("ERROR: Device %s said that the user denied the trust dialog.\n", udid);
+			printf("ERROR: Device %s said that the user denied the trust dialog.\n", device_udid);
 			break;
 		default:
-			printf("ERROR: Device %s returned unhandled error code %d\n", udid, err);
+			printf("ERROR: Device %s returned unhandled error code %d\n", device_udid, err);
 			break;
 	}
 }
 
+typedef enum {
+	OP_NONE = 0, OP_PAIR, OP_VALIDATE, OP_UNPAIR, OP_LIST, OP_HOSTID, OP_SYSTEMBUID
+} op_t;
+
+/* devices paired by one invocation share the HostID, root and host certificates */
+static plist_t host_identity = NULL;
+static mutex_t host_identity_mutex;
+
+static char *pair_record_get_pem(plist_t pair_record, const char *name)
+{
+	key_data_t pem = { NULL, 0 };
+	char *str;
+
+	if (pair_record_get_item_as_key_data(pair_record, name, &pem) != USERPREF_E_SUCCESS) {
+		return NULL;
+	}
+	str = (char*)realloc(pem.data, pem.size + 1);
+	if (!str) {
+		free(pem.data);
+		return NULL;
+	}
+	str[pem.size] = '\0';
+
+	return str;
+}
+
+/**
+ * Creates a new pair record for the device. The first record of this
+ * invocation generates the keys of the host identity, all later records
+ * reuse them and only get a new device certificate.
+ */
+static lockdownd_error_t pair_record_create(lockdownd_client_t client, plist_t *pair_record)
+{
+	plist_t node = NULL;
+	char *data = NULL;
+	uint64_t size = 0;
+	userpref_error_t uerr;
+
+	lockdownd_error_t lerr = lockdownd_get_value(client, NULL, "DevicePublicKey", &node);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		return lerr;
+	}
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		plist_get_data_val(node, &data, &size);
+	}
+	plist_free(node);
+	if (!data) {
+		return LOCKDOWN_E_PLIST_ERROR;
+	}
+
+	key_data_t public_key = { (unsigned char*)data, (unsigned int)size };
+
+	mutex_lock(&host_identity_mutex);
+	if (host_identity) {
+		*pair_record = plist_copy(host_identity);
+		uerr = pair_record_generate_device_certificate(*pair_record, public_key);
+	} else {
+		*pair_record = plist_new_dict();
+		uerr = pair_record_generate_keys_and_certs(*pair_record, public_key);
+		if (uerr == USERPREF_E_SUCCESS) {
+			char *system_buid = NULL;
+			char *host_id = generate_uuid();
+
+			userpref_read_system_buid(&system_buid);
+			if (system_buid) {
+				plist_dict_set_item(*pair_record, USERPREF_SYSTEM_BUID_KEY, plist_new_string(system_buid));
+				free(system_buid);
+			}
+			pair_record_set_host_id(*pair_record, host_id);
+			free(host_id);
+
+			host_identity = plist_copy(*pair_record);
+			plist_dict_remove_item(host_identity, USERPREF_DEVICE_CERTIFICATE_KEY);
+		}
+	}
+	mutex_unlock(&host_identity_mutex);
+	free(data);
+
+	if (uerr != USERPREF_E_SUCCESS) {
+		plist_free(*pair_record);
+		*pair_record = NULL;
+		return (uerr == USERPREF_E_INVALID_ARG) ? LOCKDOWN_E_INVALID_ARG : LOCKDOWN_E_SSL_ERROR;
+	}
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+/**
+ * Pairs the device using a record from pair_record_create() and saves
+ * the record with usbmuxd once the device accepted it.
+ */
+static lockdownd_error_t pair_device(idevice_t device, lockdownd_client_t client, const char *device_udid, plist_t pair_record)
+{
+	struct lockdownd_pair_record record;
+	plist_t node = NULL;
+	plist_t options = NULL;
+	plist_t response = NULL;
+	plist_t wifi_node = NULL;
+	uint32_t handle = 0;
+	lockdownd_error_t lerr = LOCKDOWN_E_INVALID_CONF;
+
+	memset(&record, '\0', sizeof(record));
+	record.device_certificate = pair_record_get_pem(pair_record, USERPREF_DEVICE_CERTIFICATE_KEY);
+	record.host_certificate = pair_record_get_pem(pair_record, USERPREF_HOST_CERTIFICATE_KEY);
+	record.root_certificate = pair_record_get_pem(pair_record, USERPREF_ROOT_CERTIFICATE_KEY);
+	pair_record_get_host_id(pair_record, &record.host_id);
+	node = plist_dict_get_item(pair_record, USERPREF_SYSTEM_BUID_KEY);
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &record.system_buid);
+	}
+	if (!record.device_certificate || !record.host_certificate || !record.root_certificate || !record.host_id || !record.system_buid) {
+		goto leave;
+	}
+
+	/* get wifi mac now, if we get it later we fail on iOS 7 which causes a reconnect */
+	lockdownd_get_value(client, NULL, "WiFiAddress", &wifi_node);
+
+	options = plist_new_dict();
+	plist_dict_set_item(options, "ExtendedPairingErrors", plist_new_bool(1));
+
+	lerr = lockdownd_pair_with_options(client, &record, options, &response);
+	if (lerr == LOCKDOWN_E_SUCCESS) {
+		node = plist_dict_get_item(response, USERPREF_ESCROW_BAG_KEY);
+		if (node && plist_get_node_type(node) == PLIST_DATA) {
+			plist_dict_set_item(pair_record, USERPREF_ESCROW_BAG_KEY, plist_copy(node));
+		}
+		if (wifi_node) {
+			plist_dict_set_item(pair_record, USERPREF_WIFI_MAC_ADDRESS_KEY, plist_copy(wifi_node));
+		}
+		idevice_get_handle(device, &handle);
+		if (userpref_save_pair_record(device_udid, handle, pair_record) != USERPREF_E_SUCCESS) {
+			printf("ERROR: Could not save pair record for device %s\n", device_udid);
+			lerr = LOCKDOWN_E_INVALID_CONF;
+		}
+	}
+
+leave:
+	plist_free(options);
+	plist_free(response);
+	plist_free(wifi_node);
+	free(record.device_certificate);
+	free(record.host_certificate);
+	free(record.root_certificate);
+	free(record.host_id);
+	free(record.system_buid);
+
+	return lerr;
+}
+
+struct device_job {
+	char *udid;
+	op_t op;
+	lockdownd_error_t result;
+	THREAD_T thread;
+	int started;
+};
+
+/**
+ * Pairs or validates one device of --all. Pairing is retried while the
+ * device waits for the trust dialog or its passcode and is validated with
+ * a new session afterwards.
+ */
+static void* device_job_run(void *arg)
+{
+	struct device_job *job = (struct device_job*)arg;
+	idevice_t device = NULL;
+	lockdownd_client_t client = NULL;
+	plist_t pair_record = NULL;
+	time_t deadline = time(NULL) + PAIR_DIALOG_TIMEOUT;
+	int waiting = 0;
+
+	if (idevice_new_with_options(&device, job->udid, IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		printf("ERROR: Device %s disappeared\n", job->udid);
+		job->result = LOCKDOWN_E_MUX_ERROR;
+		return NULL;
+	}
+
+	if (job->op == OP_PAIR) {
+		while (1) {
+			job->result = lockdownd_client_new(device, &client, TOOL_NAME);
+			if (job->result != LOCKDOWN_E_SUCCESS) {
+				break;
+			}
+			if (!pair_record) {
+				job->result = pair_record_create(client, &pair_record);
+				if (job->result != LOCKDOWN_E_SUCCESS) {
+					break;
+				}
+			}
+			job->result = pair_device(device, client, job->udid, pair_record);
+			if ((job->result != LOCKDOWN_E_PAIRING_DIALOG_RESPONSE_PENDING && job->result != LOCKDOWN_E_PASSWORD_PROTECTED) || time(NULL) >= deadline) {
+				break;
+			}
+			if (!waiting) {
+				printf("Waiting for the trust dialog to be accepted on device %s\n", job->udid);
+				waiting = 1;
+			}
+			lockdownd_client_free(client);
+			client = NULL;
+			sleep(1);
+		}
+		lockdownd_client_free(client);
+		client = NULL;
+	}
+	if (job->result == LOCKDOWN_E_SUCCESS) {
+		job->result = lockdownd_client_new_with_handshake(device, &client, TOOL_NAME);
+	}
+
+	if (job->result == LOCKDOWN_E_SUCCESS) {
+		printf("SUCCESS: %s device %s\n", (job->op == OP_PAIR) ? "Paired with" : "Validated pairing with", job->udid);
+	} else {
+		print_error_message(job->result, job->udid);
+	}
+
+	lockdownd_client_free(client);
+	idevice_free(device);
+	plist_free(pair_record);
+
+	return NULL;
+}
+
+/**
+ * Runs the given operation concurrently for every device attached via USB.
+ */
+static int run_all_devices(op_t op)
+{
+	idevice_info_t *devices = NULL;
+	struct device_job *jobs = NULL;
+	int count = 0;
+	int num_jobs = 0;
+	int failed = 0;
+	int i;
+
+	if (idevice_get_device_list_extended(&devices, &count) < 0) {
+		printf("ERROR: Unable to retrieve device list!\n");
+		return EXIT_FAILURE;
+	}
+	if (count > 0) {
+		jobs = (struct device_job*)calloc(count, sizeof(struct device_job));
+		if (!jobs) {
+			idevice_device_list_extended_free(devices);
+			return EXIT_FAILURE;
+		}
+	}
+	for (i = 0; i < count; i++) {
+		/* pairing requires a USB connection */
+		if (devices[i]->conn_type != CONNECTION_USBMUXD) {
+			continue;
+		}
+		jobs[num_jobs].udid = strdup(devices[i]->udid);
+		jobs[num_jobs].op = op;
+		jobs[num_jobs].result = LOCKDOWN_E_SUCCESS;
+		num_jobs++;
+	}
+	idevice_device_list_extended_free(devices);
+
+	if (num_jobs == 0) {
+		printf("No device found.\n");
+		free(jobs);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < num_jobs; i++) {
+		jobs[i].started = (thread_new(&jobs[i].thread, device_job_run, &jobs[i]) == 0);
+		if (!jobs[i].started) {
+			device_job_run(&jobs[i]);
+		}
+	}
+	for (i = 0; i < num_jobs; i++) {
+		if (jobs[i].started) {
+			thread_join(jobs[i].thread);
+			thread_free(jobs[i].thread);
+		}
+		if (jobs[i].result != LOCKDOWN_E_SUCCESS) {
+			failed++;
+		}
+		free(jobs[i].udid);
+	}
+	free(jobs);
+
+	printf("%s %d of %d devices\n", (op == OP_PAIR) ? "Paired" : "Validated", num_jobs - failed, num_jobs);
+
+	return (failed > 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
 static void print_usage(int argc, char **argv)
 {
 	char *name = NULL;
@@ -81,6 +376,7 @@ static void print_usage(int argc, char **argv)
 	printf("\n");
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID  target specific device by UDID\n");
+	printf("  -a, --all        pair or validate all devices attached via USB at once\n");
 	printf("  -d, --debug      enable communication debugging\n");
 	printf("  -h, --help       prints usage information\n");
 	printf("  -v, --version    prints version information\n");
@@ -95,24 +391,24 @@ int main(int argc, char **argv)
 	static struct option longopts[] = {
 		{ "help",    no_argument,       NULL, 'h' },
 		{ "udid",    required_argument, NULL, 'u' },
+		{ "all",     no_argument,       NULL, 'a' },
 		{ "debug",   no_argument,       NULL, 'd' },
 		{ "version", no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 	lockdownd_client_t client = NULL;
 	idevice_t device = NULL;
+	plist_t record = NULL;
 	idevice_error_t ret = IDEVICE_E_UNKNOWN_ERROR;
 	lockdownd_error_t lerr;
 	int result;
 
 	char *type = NULL;
 	char *cmd;
-	typedef enum {
-		OP_NONE = 0, OP_PAIR, OP_VALIDATE, OP_UNPAIR, OP_LIST, OP_HOSTID, OP_SYSTEMBUID
-	} op_t;
 	op_t op = OP_NONE;
+	int all_devices = 0;
 
-	while ((c = getopt_long(argc, argv, "hu:dv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "hu:adv", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'h':
 			print_usage(argc, argv);
@@ -127,6 +423,9 @@ int main(int argc, char **argv)
 			free(udid);
 			udid = strdup(optarg);
 			break;
+		case 'a':
+			all_devices = 1;
+			break;
 		case 'd':
 			idevice_set_debug_level(1);
 			break;
@@ -172,6 +471,25 @@ int main(int argc, char **argv)
 		exit(EXIT_FAILURE);
 	}
 
+	if (all_devices && ((op != OP_PAIR && op != OP_VALIDATE) || udid)) {
+		printf("ERROR: --all can only be used with the pair and validate commands and without --udid\n");
+		print_usage(argc, argv);
+		result = EXIT_FAILURE;
+		goto leave;
+	}
+
+	mutex_init(&host_identity_mutex);
+
+	if (op == OP_PAIR) {
+		/* generate both keys of the pair record while connecting */
+		userpref_key_pool_start(2, 0);
+	}
+
+	if (all_devices) {
+		result = run_all_devices(op);
+		goto leave;
+	}
+
 	if (op == OP_SYSTEMBUID) {
 		char *systembuid = NULL;
 		userpref_read_system_buid(&systembuid);
@@ -257,12 +575,15 @@ int main(int argc, char **argv)
 	switch(op) {
 		default:
 		case OP_PAIR:
-		lerr = lockdownd_pair(client, NULL);
+		lerr = pair_record_create(client, &record);
+		if (lerr == LOCKDOWN_E_SUCCESS) {
+			lerr = pair_device(device, client, udid, record);
+		}
 		if (lerr == LOCKDOWN_E_SUCCESS) {
 			printf("SUCCESS: Paired with device %s\n", udid);
 		} else {
 			result = EXIT_FAILURE;
-			print_error_message(lerr);
+			print_error_message(lerr, udid);
 		}
 		break;
 
@@ -274,7 +595,7 @@ int main(int argc, char **argv)
 			printf("SUCCESS: Validated pairing with device %s\n", udid);
 		} else {
 			result = EXIT_FAILURE;
-			print_error_message(lerr);
+			print_error_message(lerr, udid);
 		}
 		break;
 
@@ -284,7 +605,7 @@ int main(int argc, char **argv)
 			printf("SUCCESS: Unpaired with device %s\n", udid);
 		} else {
 			result = EXIT_FAILURE;
-			print_error_message(lerr);
+			print_error_message(lerr, udid);
 		}
 		break;
 	}
@@ -292,7 +613,12 @@ int main(int argc, char **argv)
 leave:
 	lockdownd_client_free(client);
 	idevice_free(device);
+	plist_free(record);
 	free(udid);
+	if (op == OP_PAIR) {
+		userpref_key_pool_stop();
+	}
+	plist_free(host_identity);
 
 	return result;
 }
@@ -45,6 +45,9 @@
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/misagent.h>
 #include "common/utils.h"
+#include "common/thread.h"
+
+#define DEFAULT_JOBS 4
 
 static void print_usage(int argc, char **argv)
 {
@@ -56,8 +59,8 @@ static void print_usage(int argc, char **argv)
 	printf("Manage provisioning profiles on a device.\n");
 	printf("\n");
 	printf("Where COMMAND is one of:\n");
-	printf("  install FILE\tInstalls the provisioning profile specified by FILE.\n");
-	printf("              \tA valid .mobileprovision file is expected.\n");
+	printf("  install FILE [FILE...]\tInstalls the provisioning profiles specified by\n");
+	printf("              \tFILE. A valid .mobileprovision file is expected.\n");
 	printf("  list\t\tGet a list of all provisioning profiles on the device.\n");
 	printf("  copy PATH\tRetrieves all provisioning profiles from the device and\n");
 	printf("           \tstores them into the existing directory specified by PATH.\n");
@@ -72,6 +75,11 @@ static void print_usage(int argc, char **argv)
 	printf("\n");
 	printf("The following OPTIONS are accepted:\n");
 	printf("  -u, --udid UDID  target specific device by UDID\n");
+	printf("  -a, --all        install on all connected devices at once, skipping\n");
+	printf("                   devices that already have a profile with the same UUID\n");
+	printf("  -j, --jobs N     install on at most N devices at a time (default 4)\n");
+	printf("  -c, --cache FILE keep the profiles seen on each device in FILE, so only\n");
+	printf("                   new profiles are decoded on the next run with --all\n");
 	printf("  -n, --network    connect to network device\n");
 	printf("  -x, --xml        print XML output when using the 'dump' command\n");
 	printf("  -d, --debug      enable communication debugging\n");
@@ -287,6 +295,305 @@ static int profile_read_from_file(const char* path, unsigned char **profile_data
 	return 0;
 }
 
+struct fleet_profile {
+	const char *path;
+	char *uuid;
+	plist_t data;
+};
+
+struct fleet_job {
+	struct fleet_profile *profiles;
+	int num_profiles;
+	char **udids;
+	unsigned int num_devices;
+	unsigned int next;
+	int use_network;
+	misagent_profile_cache_t cache;
+	/* per device: number of profiles installed, skipped and failed, or -1 if unreachable */
+	int *installed;
+	int *skipped;
+	int *failed;
+	mutex_t mutex;
+};
+
+/* checks if the cache lists a profile with the given UUID for the device */
+static int fleet_device_has_profile(plist_t state, const char *udid, const char *uuid)
+{
+	plist_t known = plist_dict_get_item(state, udid);
+	plist_dict_iter iter = NULL;
+	int found = 0;
+
+	if (!known || !uuid)
+		return 0;
+	plist_dict_new_iter(known, &iter);
+	if (!iter)
+		return 0;
+	do {
+		char *key = NULL;
+		plist_t entry = NULL;
+		plist_dict_next_item(known, iter, &key, &entry);
+		free(key);
+		if (!entry)
+			break;
+		plist_t node = plist_dict_get_item(entry, "UUID");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			char *p_uuid = NULL;
+			plist_get_string_val(node, &p_uuid);
+			found = (p_uuid && !strcmp(p_uuid, uuid));
+			free(p_uuid);
+		}
+	} while (!found);
+	free(iter);
+
+	return found;
+}
+
+static void fleet_install_device(struct fleet_job *job, unsigned int idx)
+{
+	const char *udid = job->udids[idx];
+	idevice_t device = NULL;
+	misagent_client_t mis = NULL;
+	plist_t state = NULL;
+	int i;
+
+	if (idevice_new_with_options(&device, udid, (job->use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS
+	    || misagent_client_start_service(device, &mis, TOOL_NAME) != MISAGENT_E_SUCCESS) {
+		mutex_lock(&job->mutex);
+		fprintf(stderr, "[%s] Could not connect to \"com.apple.misagent\"\n", udid);
+		job->installed[idx] = -1;
+		mutex_unlock(&job->mutex);
+		idevice_free(device);
+		return;
+	}
+
+	/* only profiles not seen on this device before are decoded */
+	plist_t added = NULL;
+	plist_t removed = NULL;
+	if (misagent_copy_all_changed(mis, job->cache, &added, &removed) == MISAGENT_E_SUCCESS) {
+		misagent_profile_cache_get_state(job->cache, &state);
+	}
+	plist_free(added);
+	plist_free(removed);
+
+	plist_t pdata = plist_new_array();
+	int *which = (int*)malloc(sizeof(int) * job->num_profiles);
+	int count = 0;
+	for (i = 0; i < job->num_profiles; i++) {
+		if (state && fleet_device_has_profile(state, udid, job->profiles[i].uuid)) {
+			job->skipped[idx]++;
+			continue;
+		}
+		plist_array_append_item(pdata, plist_copy(job->profiles[i].data));
+		which[count++] = i;
+	}
+	plist_free(state);
+
+	int *status_codes = NULL;
+	if (count > 0) {
+		status_codes = (int*)calloc(count, sizeof(int));
+		if (count == 1) {
+			if (misagent_install(mis, plist_array_get_item(pdata, 0)) != MISAGENT_E_SUCCESS) {
+				status_codes[0] = misagent_get_status_code(mis);
+				if (status_codes[0] == 0)
+					status_codes[0] = -1;
+			}
+		} else if (misagent_install_many(mis, pdata, status_codes) != MISAGENT_E_SUCCESS) {
+			for (i = 0; i < count; i++) {
+				if (status_codes[i] == 0)
+					status_codes[i] = -1;
+			}
+		}
+	}
+
+	mutex_lock(&job->mutex);
+	if (job->skipped[idx] > 0) {
+		printf("[%s] %d profile%s already installed\n", udid, job->skipped[idx], (job->skipped[idx] == 1) ? "" : "s");
+	}
+	for (i = 0; i < count; i++) {
+		if (status_codes[i] == 0) {
+			printf("[%s] Profile '%s' installed successfully.\n", udid, job->profiles[which[i]].path);
+			job->installed[idx]++;
+		} else {
+			fprintf(stderr, "[%s] Could not install profile '%s', status code: 0x%x\n", udid, job->profiles[which[i]].path, status_codes[i]);
+			job->failed[idx]++;
+		}
+	}
+	fflush(stdout);
+	mutex_unlock(&job->mutex);
+
+	free(status_codes);
+	free(which);
+	plist_free(pdata);
+	misagent_client_free(mis);
+	idevice_free(device);
+}
+
+static void* fleet_worker(void *arg)
+{
+	struct fleet_job *job = (struct fleet_job*)arg;
+
+	while (1) {
+		mutex_lock(&job->mutex);
+		unsigned int idx = job->next;
+		if (idx < job->num_devices)
+			job->next++;
+		mutex_unlock(&job->mutex);
+		if (idx >= job->num_devices)
+			break;
+		fleet_install_device(job, idx);
+	}
+
+	return NULL;
+}
+
+/* reads and decodes the profiles once and installs them on all devices */
+static int fleet_install(const char **files, int num_files, int use_network, unsigned int jobs, const char *cache_file)
+{
+	struct fleet_job job;
+	idevice_info_t *devices = NULL;
+	int count = 0;
+	THREAD_T *threads = NULL;
+	unsigned int num_threads = 0;
+	unsigned int i;
+	int res = -1;
+
+	memset(&job, '\0', sizeof(job));
+	job.use_network = use_network;
+
+	job.profiles = (struct fleet_profile*)calloc(num_files, sizeof(struct fleet_profile));
+	if (!job.profiles) {
+		fprintf(stderr, "Could not allocate memory...\n");
+		return -1;
+	}
+	for (i = 0; i < (unsigned int)num_files; i++) {
+		unsigned char* profile_data = NULL;
+		unsigned int profile_size = 0;
+		if (profile_read_from_file(files[i], &profile_data, &profile_size) != 0) {
+			goto leave;
+		}
+		struct fleet_profile *profile = &job.profiles[job.num_profiles++];
+		profile->path = files[i];
+		profile->data = plist_new_data((const char*)profile_data, profile_size);
+		free(profile_data);
+
+		plist_t pl = profile_get_embedded_plist(profile->data);
+		plist_t node = (pl && plist_get_node_type(pl) == PLIST_DICT) ? plist_dict_get_item(pl, "UUID") : NULL;
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &profile->uuid);
+		} else {
+			fprintf(stderr, "WARNING: Could not get the UUID of profile '%s', it will be installed on every device\n", files[i]);
+		}
+		plist_free(pl);
+	}
+
+	plist_t state = NULL;
+	if (cache_file) {
+		plist_read_from_filename(&state, cache_file);
+		if (state && plist_get_node_type(state) != PLIST_DICT) {
+			plist_free(state);
+			state = NULL;
+		}
+	}
+	misagent_profile_cache_new(state, &job.cache);
+	plist_free(state);
+	if (!job.cache) {
+		fprintf(stderr, "Could not allocate memory...\n");
+		goto leave;
+	}
+
+	if (idevice_get_device_list_extended(&devices, &count) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "ERROR: Unable to retrieve device list!\n");
+		goto leave;
+	}
+	job.udids = (char**)calloc(count + 1, sizeof(char*));
+	for (i = 0; job.udids && i < (unsigned int)count; i++) {
+		if (devices[i]->conn_type != ((use_network) ? CONNECTION_NETWORK : CONNECTION_USBMUXD))
+			continue;
+		job.udids[job.num_devices++] = strdup(devices[i]->udid);
+	}
+	idevice_device_list_extended_free(devices);
+	if (job.num_devices == 0) {
+		printf("No device found.\n");
+		goto leave;
+	}
+
+	job.installed = (int*)calloc(job.num_devices, sizeof(int));
+	job.skipped = (int*)calloc(job.num_devices, sizeof(int));
+	job.failed = (int*)calloc(job.num_devices, sizeof(int));
+	if (jobs > job.num_devices)
+		jobs = job.num_devices;
+	threads = (THREAD_T*)calloc(jobs, sizeof(THREAD_T));
+	if (!job.installed || !job.skipped || !job.failed || !threads) {
+		fprintf(stderr, "Could not allocate memory...\n");
+		goto leave;
+	}
+
+	mutex_init(&job.mutex);
+	printf("Installing %d profile%s on %u device%s\n", job.num_profiles, (job.num_profiles == 1) ? "" : "s", job.num_devices, (job.num_devices == 1) ? "" : "s");
+	for (i = 0; i < jobs; i++) {
+		if (thread_new(&threads[num_threads], fleet_worker, &job) != 0) {
+			break;
+		}
+		num_threads++;
+	}
+	if (num_threads == 0) {
+		/* do it without threads then */
+		fleet_worker(&job);
+	}
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	mutex_destroy(&job.mutex);
+
+	unsigned int num_failed = 0;
+	int total_installed = 0;
+	int total_skipped = 0;
+	printf("\nSummary:\n");
+	for (i = 0; i < job.num_devices; i++) {
+		if (job.installed[i] < 0) {
+			printf("%s: FAILED (could not connect)\n", job.udids[i]);
+			num_failed++;
+			continue;
+		}
+		printf("%s: %d installed, %d already installed, %d failed\n", job.udids[i], job.installed[i], job.skipped[i], job.failed[i]);
+		total_installed += job.installed[i];
+		total_skipped += job.skipped[i];
+		if (job.failed[i] > 0)
+			num_failed++;
+	}
+	printf("%d profile%s installed, %d skipped, %u of %u device%s failed\n", total_installed, (total_installed == 1) ? "" : "s", total_skipped, num_failed, job.num_devices, (job.num_devices == 1) ? "" : "s");
+	res = (num_failed == 0) ? 0 : -1;
+
+	if (cache_file) {
+		state = NULL;
+		misagent_profile_cache_get_state(job.cache, &state);
+		if (!state || !plist_write_to_filename(state, cache_file, PLIST_FORMAT_BINARY)) {
+			fprintf(stderr, "WARNING: Could not write profile cache '%s'\n", cache_file);
+		}
+		plist_free(state);
+	}
+
+leave:
+	free(threads);
+	free(job.installed);
+	free(job.skipped);
+	free(job.failed);
+	for (i = 0; i < job.num_devices; i++) {
+		free(job.udids[i]);
+	}
+	free(job.udids);
+	if (job.cache)
+		misagent_profile_cache_free(job.cache);
+	for (i = 0; i < (unsigned int)job.num_profiles; i++) {
+		free(job.profiles[i].uuid);
+		plist_free(job.profiles[i].data);
+	}
+	free(job.profiles);
+
+	return res;
+}
+
 int main(int argc, char *argv[])
 {
 	lockdownd_client_t client = NULL;
@@ -301,7 +608,12 @@ int main(int argc, char *argv[])
 	const char* udid = NULL;
 	const char* param = NULL;
 	const char* param2 = NULL;
+	const char** install_files = NULL;
+	int num_install_files = 0;
 	int use_network = 0;
+	int all_devices = 0;
+	unsigned int jobs = DEFAULT_JOBS;
+	const char* cache_file = NULL;
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
@@ -325,6 +637,27 @@ int main(int argc, char *argv[])
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-a") || !strcmp(argv[i], "--all")) {
+			all_devices = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-j") || !strcmp(argv[i], "--jobs")) {
+			i++;
+			if (!argv[i] || (jobs = (unsigned int)strtoul(argv[i], NULL, 10)) == 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			continue;
+		}
+		else if (!strcmp(argv[i], "-c") || !strcmp(argv[i], "--cache")) {
+			i++;
+			if (!argv[i] || !*argv[i]) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			cache_file = argv[i];
+			continue;
+		}
 		else if (!strcmp(argv[i], "install")) {
 			i++;
 			if (!argv[i] || (strlen(argv[i]) < 1)) {
@@ -333,6 +666,13 @@ int main(int argc, char *argv[])
 			}
 			param = argv[i];
 			op = OP_INSTALL;
+			/* any further non-option arguments are more profiles to install */
+			install_files = (const char**)&argv[i];
+			num_install_files = 1;
+			while (argv[i+1] && argv[i+1][0] != '-' && strlen(argv[i+1]) > 0) {
+				i++;
+				num_install_files++;
+			}
 			continue;
 		}
 		else if (!strcmp(argv[i], "list")) {
@@ -400,6 +740,14 @@ int main(int argc, char *argv[])
 		return 0;
 	}
 
+	if (all_devices) {
+		if (op != OP_INSTALL) {
+			fprintf(stderr, "ERROR: --all can only be used with the 'install' command\n");
+			return -1;
+		}
+		return fleet_install(install_files, num_install_files, use_network, jobs, cache_file);
+	}
+
 	if (op == OP_DUMP) {
 		unsigned char* profile_data = NULL;
 		unsigned int profile_size = 0;
@@ -505,7 +853,7 @@ int main(int argc, char *argv[])
 
 	switch (op) {
 		case OP_INSTALL:
-		{
+		if (num_install_files == 1) {
 			unsigned char* profile_data = NULL;
 			unsigned int profile_size = 0;
 			if (profile_read_from_file(param, &profile_data, &profile_size) != 0) {
@@ -522,6 +870,39 @@ int main(int argc, char *argv[])
 				int sc = misagent_get_status_code(mis);
 				fprintf(stderr, "Could not install profile '%s', status code: 0x%x\n", param, sc);
 			}
+			plist_free(pdata);
+		} else {
+			/* send all profiles in one batch */
+			plist_t pdata = plist_new_array();
+			const char** files = (const char**)malloc(sizeof(char*) * num_install_files);
+			int num_files = 0;
+			for (i = 0; i < num_install_files; i++) {
+				unsigned char* profile_data = NULL;
+				unsigned int profile_size = 0;
+				if (profile_read_from_file(install_files[i], &profile_data, &profile_size) != 0) {
+					res = -1;
+					continue;
+				}
+				plist_array_append_item(pdata, plist_new_data((const char*)profile_data, profile_size));
+				free(profile_data);
+				files[num_files++] = install_files[i];
+			}
+			if (num_files > 0) {
+				int* status_codes = (int*)malloc(sizeof(int) * num_files);
+				if (misagent_install_many(mis, pdata, status_codes) != MISAGENT_E_SUCCESS) {
+					res = -1;
+				}
+				for (i = 0; i < num_files; i++) {
+					if (status_codes[i] == 0) {
+						printf("Profile '%s' installed successfully.\n", files[i]);
+					} else {
+						fprintf(stderr, "Could not install profile '%s', status code: 0x%x\n", files[i], status_codes[i]);
+					}
+				}
+				free(status_codes);
+			}
+			free(files);
+			plist_free(pdata);
 		}
 			break;
 		case OP_LIST:
@@ -30,9 +30,7 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <time.h>
-#ifndef WIN32
 #include <signal.h>
-#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
@@ -40,6 +38,82 @@
 
 void print_usage(int argc, char **argv);
 
+static int quit_flag = 0;
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static const char *get_file_extension(const char *imgdata, uint64_t imgsize)
+{
+	if (imgsize >= 4 && memcmp(imgdata, "\x89PNG", 4) == 0) {
+		return ".png";
+	} else if (imgsize >= 4 && memcmp(imgdata, "MM\x00*", 4) == 0) {
+		return ".tiff";
+	}
+	printf("WARNING: screenshot data has unexpected image format.\n");
+	return ".dat";
+}
+
+static int save_image(const char *filename, const char *imgdata, uint64_t imgsize)
+{
+	int result = -1;
+	FILE *f = fopen(filename, "wb");
+	if (f) {
+		if (fwrite(imgdata, 1, (size_t)imgsize, f) == (size_t)imgsize) {
+			result = 0;
+		} else {
+			printf("Could not save screenshot to file %s!\n", filename);
+		}
+		fclose(f);
+	} else {
+		printf("Could not open %s for writing: %s\n", filename, strerror(errno));
+	}
+	return result;
+}
+
+/* converts imgdata to PNG in place if an encoder is given */
+static int convert_image(screenshotr_png_encoder_t encoder, const char **imgdata, uint64_t *imgsize)
+{
+	if (!encoder) {
+		return 0;
+	}
+	screenshotr_error_t err = screenshotr_convert_to_png(encoder, *imgdata, *imgsize, imgdata, imgsize);
+	if (err != SCREENSHOTR_E_SUCCESS) {
+		printf("Could not convert screenshot to PNG, error %d\n", err);
+		return -1;
+	}
+	return 0;
+}
+
+struct stream_info {
+	const char *prefix;
+	unsigned int frames;
+	int failed;
+	screenshotr_png_encoder_t encoder;
+};
+
+static int stream_frame_cb(const char *imgdata, uint64_t imgsize, void *user_data)
+{
+	struct stream_info *si = (struct stream_info*)user_data;
+	char filename[512];
+
+	if (convert_image(si->encoder, &imgdata, &imgsize) < 0) {
+		si->failed = 1;
+		return 1;
+	}
+	snprintf(filename, sizeof(filename), "%s-%06u%s", si->prefix, si->frames, get_file_extension(imgdata, imgsize));
+	if (save_image(filename, imgdata, imgsize) < 0) {
+		si->failed = 1;
+		return 1;
+	}
+	printf("Frame %u saved to %s\n", si->frames, filename);
+	si->frames++;
+
+	return quit_flag;
+}
+
 int main(int argc, char **argv)
 {
 	idevice_t device = NULL;
@@ -52,10 +126,17 @@ int main(int argc, char **argv)
 	const char *udid = NULL;
 	int use_network = 0;
 	char *filename = NULL;
+	int stream = 0;
+	int interval = 0;
+	int png = 0;
+	int png_level = -1;
+	screenshotr_png_encoder_t encoder = NULL;
 
 #ifndef WIN32
 	signal(SIGPIPE, SIG_IGN);
 #endif
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
 	/* parse cmdline args */
 	for (i = 1; i < argc; i++) {
 		if (!strcmp(argv[i], "-d") || !strcmp(argv[i], "--debug")) {
@@ -75,6 +156,33 @@ int main(int argc, char **argv)
 			use_network = 1;
 			continue;
 		}
+		else if (!strcmp(argv[i], "-s") || !strcmp(argv[i], "--stream")) {
+			stream = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-i") || !strcmp(argv[i], "--interval")) {
+			i++;
+			if (!argv[i] || (interval = atoi(argv[i])) <= 0) {
+				print_usage(argc, argv);
+				return 0;
+			}
+			stream = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-p") || !strcmp(argv[i], "--png")) {
+			png = 1;
+			continue;
+		}
+		else if (!strcmp(argv[i], "-l") || !strcmp(argv[i], "--level")) {
+			i++;
+			if (!argv[i] || argv[i][0] < '0' || argv[i][0] > '9' || argv[i][1] != '\0') {
+				print_usage(argc, argv);
+				return 0;
+			}
+			png_level = argv[i][0] - '0';
+			png = 1;
+			continue;
+		}
 		else if (!strcmp(argv[i], "-h") || !strcmp(argv[i], "--help")) {
 			print_usage(argc, argv);
 			return 0;
@@ -93,18 +201,28 @@ int main(int argc, char **argv)
 		}
 	}
 
+	if (png && screenshotr_png_encoder_new(png_level, &encoder) != SCREENSHOTR_E_SUCCESS) {
+		printf("ERROR: PNG conversion is not available.\n");
+		free(filename);
+		return -1;
+	}
+
 	if (IDEVICE_E_SUCCESS != idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX)) {
 		if (udid) {
 			printf("No device found with udid %s.\n", udid);
 		} else {
 			printf("No device found.\n");
 		}
+		if (encoder)
+			screenshotr_png_encoder_free(encoder);
 		return -1;
 	}
 
 	if (LOCKDOWN_E_SUCCESS != (ldret = lockdownd_client_new_with_handshake(device, &lckd, TOOL_NAME))) {
 		idevice_free(device);
 		printf("ERROR: Could not connect to lockdownd, error code %d\n", ldret);
+		if (encoder)
+			screenshotr_png_encoder_free(encoder);
 		return -1;
 	}
 
@@ -114,38 +232,46 @@ int main(int argc, char **argv)
 		if (screenshotr_client_new(device, service, &shotr) != SCREENSHOTR_E_SUCCESS) {
 			printf("Could not connect to screenshotr!\n");
 		} else {
-			char *imgdata = NULL;
-			uint64_t imgsize = 0;
-			if (screenshotr_take_screenshot(shotr, &imgdata, &imgsize) == SCREENSHOTR_E_SUCCESS) {
+			if (stream) {
+				struct stream_info si;
+				char prefix[36];
 				if (!filename) {
-					const char *fileext = NULL;
-					if (memcmp(imgdata, "\x89PNG", 4) == 0) {
-						fileext = ".png";
-					} else if (memcmp(imgdata, "MM\x00*", 4) == 0) {
-						fileext = ".tiff";
-					} else {
-						printf("WARNING: screenshot data has unexpected image format.\n");
-						fileext = ".dat";
-					}
 					time_t now = time(NULL);
-					filename = (char*)malloc(36);
-					size_t pos = strftime(filename, 36, "screenshot-%Y-%m-%d-%H-%M-%S", gmtime(&now));
-					sprintf(filename+pos, "%s", fileext);
+					strftime(prefix, sizeof(prefix), "screenshot-%Y-%m-%d-%H-%M-%S", gmtime(&now));
 				}
-				FILE *f = fopen(filename, "wb");
-				if (f) {
-					if (fwrite(imgdata, 1, (size_t)imgsize, f) == (size_t)imgsize) {
-						printf("Screenshot saved to %s\n", filename);
-						result = 0;
-					} else {
-						printf("Could not save screenshot to file %s!\n", filename);
+				si.prefix = (filename) ? filename : prefix;
+				si.frames = 0;
+				si.failed = 0;
+				si.encoder = encoder;
+				if (screenshotr_start_stream(shotr, (unsigned int)interval, stream_frame_cb, &si) == SCREENSHOTR_E_SUCCESS && !si.failed) {
+					printf("Saved %u frames\n", si.frames);
+					result = 0;
+				} else if (!si.failed) {
+					printf("Could not get screenshot!\n");
+				}
+			} else {
+				char *imgdata = NULL;
+				uint64_t imgsize = 0;
+				if (screenshotr_take_screenshot(shotr, &imgdata, &imgsize) == SCREENSHOTR_E_SUCCESS) {
+					const char *outdata = imgdata;
+					uint64_t outsize = imgsize;
+					if (convert_image(encoder, &outdata, &outsize) == 0) {
+						if (!filename) {
+							const char *fileext = get_file_extension(outdata, outsize);
+							time_t now = time(NULL);
+							filename = (char*)malloc(36);
+							size_t pos = strftime(filename, 36, "screenshot-%Y-%m-%d-%H-%M-%S", gmtime(&now));
+							sprintf(filename+pos, "%s", fileext);
+						}
+						if (save_image(filename, outdata, outsize) == 0) {
+							printf("Screenshot saved to %s\n", filename);
+							result = 0;
+						}
 					}
-					fclose(f);
 				} else {
-					printf("Could not open %s for writing: %s\n", filename, strerror(errno));
+					printf("Could not get screenshot!\n");
 				}
-			} else {
-				printf("Could not get screenshot!\n");
+				free(imgdata);
 			}
 			screenshotr_client_free(shotr);
 		}
@@ -158,6 +284,8 @@ int main(int argc, char **argv)
 
 	idevice_free(device);
 	free(filename);
+	if (encoder)
+		screenshotr_png_encoder_free(encoder);
 
 	return result;
 }
@@ -175,11 +303,20 @@ void print_usage(int argc, char **argv)
 	printf("where the default name is \"screenshot-DATE.tiff\", e.g.:\n");
 	printf("   ./screenshot-2013-12-31-23-59-59.tiff\n");
 	printf("\n");
+	printf("With --png, TIFF images are converted to PNG while they are received.\n");
+	printf("\n");
+	printf("With --stream, frames are saved as FILE-NUMBER.EXT until interrupted,\n");
+	printf("where FILE defaults to \"screenshot-DATE\".\n");
+	printf("\n");
 	printf("NOTE: A mounted developer disk image is required on the device, otherwise\n");
 	printf("the screenshotr service is not available.\n");
 	printf("\n");
 	printf("  -u, --udid UDID\ttarget specific device by UDID\n");
 	printf("  -n, --network\t\tconnect to network device\n");
+	printf("  -s, --stream\t\tcontinuously save screenshots until interrupted\n");
+	printf("  -i, --interval MS\tstream with at least MS milliseconds between frames\n");
+	printf("  -p, --png\t\tconvert TIFF screenshots to PNG\n");
+	printf("  -l, --level N\t\tPNG compression level from 0 to 9 (default 1)\n");
 	printf("  -d, --debug\t\tenable communication debugging\n");
 	printf("  -h, --help\t\tprints usage information\n");
 	printf("  -v, --version\t\tprints version information\n");
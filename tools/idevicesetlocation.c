@@ -29,13 +29,19 @@
 #include <stdint.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
+#include <time.h>
 #include <getopt.h>
+#ifdef WIN32
+#include <windows.h>
+#endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/service.h>
 
 #include <endianness.h>
+#include "common/utils.h"
 
 #define DT_SIMULATELOCATION_SERVICE "com.apple.dt.simulatelocation"
 
@@ -44,6 +50,322 @@ enum {
 	RESET_LOCATION = 1
 };
 
+#define STREAM_LINE_MAX 1024
+#define STREAM_MAX_RATE 1000.0
+
+enum stream_format {
+	STREAM_FORMAT_PLAIN = 0,
+	STREAM_FORMAT_NMEA,
+	STREAM_FORMAT_GPX
+};
+
+struct location_stream {
+	FILE *f;
+	enum stream_format format;
+	char line[STREAM_LINE_MAX];
+	/* NMEA: time of the last fix, RMC and GGA sentences report it twice */
+	char last_time[16];
+	/* GPX: the whole document and the points to read */
+	char *gpx;
+	char *gpx_pos;
+	const char *gpx_tag;
+};
+
+static int send_location(service_client_t service, double lat, double lon)
+{
+	char latstr[32];
+	char lonstr[32];
+	char buf[4 + 4 + sizeof(latstr) + 4 + sizeof(lonstr)];
+	uint32_t latlen = (uint32_t)snprintf(latstr, sizeof(latstr), "%.7f", lat);
+	uint32_t lonlen = (uint32_t)snprintf(lonstr, sizeof(lonstr), "%.7f", lon);
+	uint32_t len = 4 + 4 + latlen + 4 + lonlen;
+	uint32_t l;
+	uint32_t s = 0;
+
+	/* one write per point, the service reads mode and coordinates as a stream */
+	l = htobe32(SET_LOCATION);
+	memcpy(buf, &l, 4);
+	l = htobe32(latlen);
+	memcpy(buf+4, &l, 4);
+	memcpy(buf+8, latstr, latlen);
+	l = htobe32(lonlen);
+	memcpy(buf+8+latlen, &l, 4);
+	memcpy(buf+12+latlen, lonstr, lonlen);
+
+	if (service_send(service, buf, len, &s) != SERVICE_E_SUCCESS || s != len) {
+		return -1;
+	}
+	return 0;
+}
+
+static int gpx_get_attribute(const char *tag, const char *name, double *value)
+{
+	size_t len = strlen(name);
+	const char *p = tag;
+
+	while ((p = strstr(p, name)) != NULL) {
+		if (isspace((unsigned char)p[-1]) && p[len] == '=' && (p[len+1] == '"' || p[len+1] == '\'')) {
+			char *end = NULL;
+			*value = strtod(p + len + 2, &end);
+			return (end != p + len + 2);
+		}
+		p += len;
+	}
+	return 0;
+}
+
+static int gpx_next(struct location_stream *stream, double *lat, double *lon)
+{
+	size_t taglen = strlen(stream->gpx_tag);
+	char *p = stream->gpx_pos;
+
+	while (p && (p = strstr(p, stream->gpx_tag)) != NULL) {
+		char *end = strchr(p, '>');
+		if (!end) {
+			break;
+		}
+		if (isspace((unsigned char)p[taglen])) {
+			int found;
+			*end = '\0';
+			found = gpx_get_attribute(p, "lat", lat) && gpx_get_attribute(p, "lon", lon);
+			*end = '>';
+			if (found) {
+				stream->gpx_pos = end + 1;
+				return 1;
+			}
+		}
+		p = end + 1;
+	}
+	stream->gpx_pos = NULL;
+	return 0;
+}
+
+static double nmea_to_degrees(const char *value, const char *hemisphere)
+{
+	double v = strtod(value, NULL);
+	double deg = (double)(int)(v / 100);
+
+	/* ddmm.mmmm */
+	deg += (v - deg * 100) / 60.0;
+	if (*hemisphere == 'S' || *hemisphere == 'W') {
+		deg = -deg;
+	}
+	return deg;
+}
+
+static int nmea_parse(struct location_stream *stream, char *line, double *lat, double *lon)
+{
+	char *fields[16];
+	int num_fields = 0;
+	char *p = strchr(line, '*');
+	const char *fix_time;
+
+	if (p) {
+		*p = '\0';
+	}
+	p = line;
+	while (num_fields < 16) {
+		fields[num_fields++] = p;
+		p = strchr(p, ',');
+		if (!p) {
+			break;
+		}
+		*p++ = '\0';
+	}
+	if (strlen(fields[0]) != 6) {
+		return 0;
+	}
+
+	/* $xxRMC,time,status,lat,N/S,lon,E/W,... and $xxGGA,time,lat,N/S,lon,E/W,quality,... */
+	if (!strcmp(fields[0] + 3, "RMC") && num_fields > 6 && fields[2][0] == 'A') {
+		*lat = nmea_to_degrees(fields[3], fields[4]);
+		*lon = nmea_to_degrees(fields[5], fields[6]);
+	} else if (!strcmp(fields[0] + 3, "GGA") && num_fields > 6 && fields[6][0] != '\0' && fields[6][0] != '0') {
+		*lat = nmea_to_degrees(fields[2], fields[3]);
+		*lon = nmea_to_degrees(fields[4], fields[5]);
+	} else {
+		return 0;
+	}
+
+	fix_time = fields[1];
+	if (*fix_time && !strcmp(fix_time, stream->last_time)) {
+		return 0;
+	}
+	strncpy(stream->last_time, fix_time, sizeof(stream->last_time)-1);
+	stream->last_time[sizeof(stream->last_time)-1] = '\0';
+
+	return 1;
+}
+
+static int plain_parse(char *line, double *lat, double *lon)
+{
+	char *p = line;
+	char *end = NULL;
+
+	while (isspace((unsigned char)*p)) p++;
+	if (*p == '\0' || *p == '#') {
+		return 0;
+	}
+	*lat = strtod(p, &end);
+	if (end == p) {
+		return -1;
+	}
+	p = end;
+	while (isspace((unsigned char)*p) || *p == ',') p++;
+	*lon = strtod(p, &end);
+	if (end == p) {
+		return -1;
+	}
+	return 1;
+}
+
+/**
+ * Opens a file, or stdin for NULL or "-", with coordinates to stream.
+ * GPX documents are read completely, NMEA sentences and plain
+ * "LAT LONG" lines are read as they arrive.
+ */
+static int location_stream_open(struct location_stream *stream, const char *filename)
+{
+	int c;
+
+	memset(stream, '\0', sizeof(struct location_stream));
+	if (filename && strcmp(filename, "-") != 0) {
+		stream->f = fopen(filename, "rb");
+		if (!stream->f) {
+			fprintf(stderr, "ERROR: Could not open %s: %s\n", filename, strerror(errno));
+			return -1;
+		}
+	} else {
+		stream->f = stdin;
+	}
+
+	do {
+		c = fgetc(stream->f);
+	} while (c != EOF && (isspace(c) || c == 0xEF || c == 0xBB || c == 0xBF));
+	if (c == EOF) {
+		return 0;
+	}
+	ungetc(c, stream->f);
+
+	if (c == '$') {
+		stream->format = STREAM_FORMAT_NMEA;
+	} else if (c == '<') {
+		size_t size = 0;
+		size_t len = 0;
+		stream->format = STREAM_FORMAT_GPX;
+		while (1) {
+			if (size - len < STREAM_LINE_MAX) {
+				char *newbuf = (char*)realloc(stream->gpx, size + 65536);
+				if (!newbuf) {
+					fprintf(stderr, "ERROR: Out of memory\n");
+					return -1;
+				}
+				stream->gpx = newbuf;
+				size += 65536;
+			}
+			size_t r = fread(stream->gpx + len, 1, size - len - 1, stream->f);
+			if (r == 0) {
+				break;
+			}
+			len += r;
+		}
+		stream->gpx[len] = '\0';
+		/* follow the track if there is one, otherwise a route or the waypoints */
+		if (strstr(stream->gpx, "<trkpt")) {
+			stream->gpx_tag = "<trkpt";
+		} else if (strstr(stream->gpx, "<rtept")) {
+			stream->gpx_tag = "<rtept";
+		} else {
+			stream->gpx_tag = "<wpt";
+		}
+		stream->gpx_pos = stream->gpx;
+	} else {
+		stream->format = STREAM_FORMAT_PLAIN;
+	}
+
+	return 0;
+}
+
+static int location_stream_next(struct location_stream *stream, double *lat, double *lon)
+{
+	if (stream->format == STREAM_FORMAT_GPX) {
+		return gpx_next(stream, lat, lon);
+	}
+	while (fgets(stream->line, sizeof(stream->line), stream->f)) {
+		int res;
+		stream->line[strcspn(stream->line, "\r\n")] = '\0';
+		if (stream->format == STREAM_FORMAT_NMEA) {
+			res = nmea_parse(stream, stream->line, lat, lon);
+		} else {
+			res = plain_parse(stream->line, lat, lon);
+			if (res < 0) {
+				fprintf(stderr, "WARNING: Ignoring invalid line '%s'\n", stream->line);
+			}
+		}
+		if (res > 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void location_stream_close(struct location_stream *stream)
+{
+	if (stream->f && stream->f != stdin) {
+		fclose(stream->f);
+	}
+	free(stream->gpx);
+}
+
+static void sleep_until_usec(uint64_t deadline)
+{
+	uint64_t now = time_monotonic_usec();
+	if (deadline <= now) {
+		return;
+	}
+#ifdef WIN32
+	Sleep((DWORD)((deadline - now + 999) / 1000));
+#else
+	uint64_t delta = deadline - now;
+	struct timespec ts;
+	ts.tv_sec = (time_t)(delta / 1000000);
+	ts.tv_nsec = (long)((delta % 1000000) * 1000);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+#endif
+}
+
+/**
+ * Sends all points of the stream at the given rate. Points are scheduled
+ * against the start time so the rate does not drift, and the schedule
+ * restarts if the input falls behind, e.g. a live stream on stdin.
+ *
+ * @return the number of points sent or -1 if sending failed
+ */
+static int stream_locations(service_client_t service, struct location_stream *stream, double rate)
+{
+	uint64_t interval = (uint64_t)(1000000.0 / rate);
+	uint64_t next = 0;
+	int count = 0;
+	double lat = 0;
+	double lon = 0;
+
+	while (location_stream_next(stream, &lat, &lon)) {
+		uint64_t now = time_monotonic_usec();
+		if (next == 0 || now > next + interval) {
+			next = now;
+		} else {
+			sleep_until_usec(next);
+		}
+		if (send_location(service, lat, lon) < 0) {
+			fprintf(stderr, "ERROR: Could not send location, the connection was closed\n");
+			return -1;
+		}
+		count++;
+		next += interval;
+	}
+	return count;
+}
+
 static void print_usage(int argc, char **argv, int is_error)
 {
 	char *bname = strrchr(argv[0], '/');
@@ -51,10 +373,15 @@ static void print_usage(int argc, char **argv, int is_error)
 
 	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS] -- <LAT> <LONG>\n", bname);
 	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] reset\n", bname);
+	fprintf(is_error ? stderr : stdout, "       %s [OPTIONS] stream [FILE]\n", bname);
 	fprintf(is_error ? stderr : stdout, "\n" \
+		"The stream command keeps the connection open and sends the points of a\n" \
+		"GPX file, NMEA sentences or lines of 'LAT LONG' from FILE or stdin.\n" \
+		"\n" \
 		"OPTIONS:\n" \
 		"  -u, --udid UDID    target specific device by UDID\n" \
 		"  -n, --network      connect to network device\n" \
+		"  -r, --rate HZ      points per second to stream (default: 1)\n" \
 		"  -d, --debug        enable communication debugging\n" \
 		"  -h, --help         prints usage information\n" \
 		"  -v, --version      prints version information\n" \
@@ -72,14 +399,18 @@ int main(int argc, char **argv)
 		{ "udid",    required_argument, NULL, 'u' },
 		{ "debug",   no_argument,       NULL, 'd' },
 		{ "network", no_argument,       NULL, 'n' },
+		{ "rate",    required_argument, NULL, 'r' },
 		{ "version", no_argument,       NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 	uint32_t mode = 0;
 	const char *udid = NULL;
 	int use_network = 0;
+	int stream_mode = 0;
+	double rate = 1.0;
+	struct location_stream stream;
 
-	while ((c = getopt_long(argc, argv, "dhu:nv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nr:v", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -95,6 +426,14 @@ int main(int argc, char **argv)
 		case 'n':
 			use_network = 1;
 			break;
+		case 'r':
+			rate = strtod(optarg, NULL);
+			if (rate <= 0 || rate > STREAM_MAX_RATE) {
+				fprintf(stderr, "ERROR: Invalid rate '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
 		case 'h':
 			print_usage(argc, argv, 0);
 			return 0;
@@ -115,7 +454,14 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	if (argc == 2) {
+	if (strcmp(argv[0], "stream") == 0) {
+		stream_mode = 1;
+		mode = SET_LOCATION;
+		if (location_stream_open(&stream, (argc == 2) ? argv[1] : NULL) < 0) {
+			location_stream_close(&stream);
+			return -1;
+		}
+	} else if (argc == 2) {
 		mode = SET_LOCATION;
 	} else if (argc == 1) {
 		if (strcmp(argv[0], "reset") == 0) {
@@ -162,29 +508,42 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	uint32_t l;
-	uint32_t s = 0;
+	int res = 0;
+
+	if (stream_mode) {
+		int count = stream_locations(service, &stream, rate);
+		location_stream_close(&stream);
+		if (count < 0) {
+			res = -1;
+		} else {
+			printf("Sent %d locations\n", count);
+		}
+	} else {
+		uint32_t l;
+		uint32_t s = 0;
 
-	l = htobe32(mode);
-	service_send(service, (const char*)&l, 4, &s);
-	if (mode == SET_LOCATION) {
-		int len = 4 + strlen(argv[0]) + 4 + strlen(argv[1]);
-		char *buf = malloc(len);
-		uint32_t latlen;
-		latlen = strlen(argv[0]);
-		l = htobe32(latlen);
-		memcpy(buf, &l, 4);
-		memcpy(buf+4, argv[0], latlen);
-		uint32_t longlen = strlen(argv[1]);
-		l = htobe32(longlen);
-		memcpy(buf+4+latlen, &l, 4);
-		memcpy(buf+4+latlen+4, argv[1], longlen);
-
-		s = 0;
-		service_send(service, buf, len, &s);
+		l = htobe32(mode);
+		service_send(service, (const char*)&l, 4, &s);
+		if (mode == SET_LOCATION) {
+			int len = 4 + strlen(argv[0]) + 4 + strlen(argv[1]);
+			char *buf = malloc(len);
+			uint32_t latlen;
+			latlen = strlen(argv[0]);
+			l = htobe32(latlen);
+			memcpy(buf, &l, 4);
+			memcpy(buf+4, argv[0], latlen);
+			uint32_t longlen = strlen(argv[1]);
+			l = htobe32(longlen);
+			memcpy(buf+4+latlen, &l, 4);
+			memcpy(buf+4+latlen+4, argv[1], longlen);
+
+			s = 0;
+			service_send(service, buf, len, &s);
+		}
 	}
 
+	service_client_free(service);
 	idevice_free(device);
 
-	return 0;
+	return res;
 }
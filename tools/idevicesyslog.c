@@ -38,13 +38,17 @@
 
 #ifdef WIN32
 #include <windows.h>
-#define sleep(x) Sleep(x*1000)
+#else
+#include <sys/time.h>
 #endif
 
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/syslog_relay.h>
+#include "common/thread.h"
 
 static int quit_flag = 0;
+static mutex_t quit_mutex;
+static cond_t quit_cond;
 static int exit_on_disconnect = 0;
 static int use_colors = 0;
 static int show_device_name = 0;
@@ -66,16 +70,141 @@ static char** untrigger_filters = NULL;
 static int num_untrigger_filters = 0;
 static int triggered = 0;
 
-static idevice_t device = NULL;
-static syslog_relay_client_t syslog = NULL;
+/* message, trigger and untrigger filters are matched in a single pass */
+#define FILTER_MSG       (1 << 0)
+#define FILTER_TRIGGER   (1 << 1)
+#define FILTER_UNTRIGGER (1 << 2)
+
+/* Aho-Corasick automaton with all transitions resolved */
+struct filter_matcher {
+	int *next;
+	unsigned int *out;
+	int num_states;
+	int capacity;
+};
+static struct filter_matcher matcher = { NULL, NULL, 0, 0 };
+
+/* open addressing set of process names, the strings are not owned */
+struct name_set {
+	const char **slots;
+	unsigned int mask;
+};
+static struct name_set proc_set = { NULL, 0 };
+
+/* state of a device whose syslog is relayed */
+struct syslog_device {
+	char *udid;
+	idevice_t device;
+	syslog_relay_client_t syslog;
+	int triggered;
+	/* the line being formatted, it is written out as a whole */
+	char *line;
+	size_t line_len;
+	size_t line_capacity;
+	/* with --all, lines are queued here and written by the main thread */
+	mutex_t mutex;
+	char *queue;
+	char *spare;
+	size_t queue_len;
+	unsigned long dropped;
+	int pending;
+	int removed;
+	int disconnected;
+	struct syslog_device *next;
+};
+
+static struct syslog_device single_device;
+
+/* --all relays the syslog of every device on one event loop */
+#define DEVICE_QUEUE_SIZE (64 * 1024)
+#define DRAIN_INTERVAL 100
+static int all_devices = 0;
+static idevice_event_loop_t event_loop = NULL;
+static mutex_t devices_mutex;
+static struct syslog_device *devices = NULL;
 
 static const char QUIET_FILTER[] = "CircleJoinRequested|CommCenter|HeuristicInterpreter|MobileMail|PowerUIAgent|ProtectedCloudKeySyncing|SpringBoard|UserEventAgent|WirelessRadioManagerd|accessoryd|accountsd|aggregated|analyticsd|appstored|apsd|assetsd|assistant_service|backboardd|biometrickitd|bluetoothd|calaccessd|callservicesd|cloudd|com.apple.Safari.SafeBrowsing.Service|contextstored|corecaptured|coreduetd|corespeechd|cdpd|dasd|dataaccessd|distnoted|dprivacyd|duetexpertd|findmydeviced|fmfd|fmflocatord|gpsd|healthd|homed|identityservicesd|imagent|itunescloudd|itunesstored|kernel|locationd|maild|mDNSResponder|mediaremoted|mediaserverd|mobileassetd|nanoregistryd|nanotimekitcompaniond|navd|nsurlsessiond|passd|pasted|photoanalysisd|powerd|powerlogHelperd|ptpd|rapportd|remindd|routined|runningboardd|searchd|sharingd|suggestd|symptomsd|timed|thermalmonitord|useractivityd|vmd|wifid|wirelessproxd";
 
 static int use_network = 0;
 
-static char *line = NULL;
-static int line_buffer_size = 0;
-static int lp = 0;
+/* with --queue, lines of a single device are printed on a separate thread */
+static uint32_t queue_lines = 0;
+
+/* JSON and --all output is written through a large buffer that is flushed
+ * periodically instead of after each line */
+#define JSON_OUTPUT_BUFFER_SIZE (256 * 1024)
+static int output_json = 0;
+
+struct syslog_record {
+	const char *time;
+	const char *device;
+	int device_len;
+	const char *process;
+	int process_len;
+	const char *image;
+	int image_len;
+	int pid;
+	const char *level;
+	int level_len;
+};
+
+/* sets quit_flag and wakes up the main thread */
+static void request_quit(void)
+{
+	mutex_lock(&quit_mutex);
+	quit_flag++;
+	cond_broadcast(&quit_cond);
+	mutex_unlock(&quit_mutex);
+}
+
+/* waits up to timeout_ms for a quit request, returns quit_flag */
+static int wait_for_quit(unsigned int timeout_ms)
+{
+	mutex_lock(&quit_mutex);
+	if (!quit_flag) {
+		cond_wait_timeout(&quit_cond, &quit_mutex, timeout_ms);
+	}
+	int res = quit_flag;
+	mutex_unlock(&quit_mutex);
+	return res;
+}
+
+static void out_append(struct syslog_device *dev, const char* data, size_t len)
+{
+	if (dev->line_len + len > dev->line_capacity) {
+		size_t capacity = (dev->line_capacity) ? dev->line_capacity : 1024;
+		while (dev->line_len + len > capacity) {
+			capacity *= 2;
+		}
+		char *buf = realloc(dev->line, capacity);
+		if (!buf) {
+			fprintf(stderr, "ERROR: realloc() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		dev->line = buf;
+		dev->line_capacity = capacity;
+	}
+	memcpy(dev->line + dev->line_len, data, len);
+	dev->line_len += len;
+}
+
+/* writes the formatted line, or queues it if the syslog of all devices is relayed */
+static void out_commit(struct syslog_device *dev)
+{
+	if (!dev->queue) {
+		fwrite(dev->line, 1, dev->line_len, stdout);
+	} else {
+		mutex_lock(&dev->mutex);
+		if (dev->queue_len + dev->line_len <= DEVICE_QUEUE_SIZE) {
+			memcpy(dev->queue + dev->queue_len, dev->line, dev->line_len);
+			dev->queue_len += dev->line_len;
+		} else {
+			dev->dropped++;
+		}
+		mutex_unlock(&dev->mutex);
+	}
+	dev->line_len = 0;
+}
 
 #ifdef WIN32
 static WORD COLOR_RESET = 0;
@@ -99,9 +228,11 @@ static HANDLE h_stdout = INVALID_HANDLE_VALUE;
 #define COLOR_WHITE         FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE | FOREGROUND_INTENSITY
 #define COLOR_DARK_WHITE    FOREGROUND_RED | FOREGROUND_GREEN | FOREGROUND_BLUE
 
-static void TEXT_COLOR(WORD attr)
+static void TEXT_COLOR(struct syslog_device *dev, WORD attr)
 {
 	if (use_colors) {
+		/* colors are only used when writing to stdout directly */
+		out_commit(dev);
 		SetConsoleTextAttribute(h_stdout, attr);
 	}
 }
@@ -126,7 +257,7 @@ static void TEXT_COLOR(WORD attr)
 #define COLOR_WHITE         "\e[1;37m"
 #define COLOR_DARK_WHITE    "\e[0;37m"
 
-#define TEXT_COLOR(x) if (use_colors) { fwrite(x, 1, sizeof(x)-1, stdout); }
+#define TEXT_COLOR(dev, x) if (use_colors) { out_append(dev, x, sizeof(x)-1); }
 #endif
 
 static void add_filter(const char* filterstr)
@@ -173,7 +304,193 @@ static void add_filter(const char* filterstr)
 	}
 }
 
-static int find_char(char c, char** p, char* end)
+static int matcher_new_state(struct filter_matcher *m)
+{
+	if (m->num_states == m->capacity) {
+		int capacity = (m->capacity) ? m->capacity * 2 : 64;
+		int *next = realloc(m->next, sizeof(int) * 256 * capacity);
+		if (!next) {
+			fprintf(stderr, "ERROR: realloc() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		m->next = next;
+		unsigned int *out = realloc(m->out, sizeof(unsigned int) * capacity);
+		if (!out) {
+			fprintf(stderr, "ERROR: realloc() failed\n");
+			exit(EXIT_FAILURE);
+		}
+		m->out = out;
+		m->capacity = capacity;
+	}
+	int state = m->num_states++;
+	memset(&m->next[state * 256], 0xFF, sizeof(int) * 256);
+	m->out[state] = 0;
+	return state;
+}
+
+static void matcher_add(struct filter_matcher *m, const char* pattern, unsigned int group)
+{
+	const unsigned char* p = (const unsigned char*)pattern;
+	int state = 0;
+
+	if (m->num_states == 0) {
+		matcher_new_state(m);
+	}
+	while (*p) {
+		if (m->next[state * 256 + *p] < 0) {
+			int new_state = matcher_new_state(m);
+			m->next[state * 256 + *p] = new_state;
+		}
+		state = m->next[state * 256 + *p];
+		p++;
+	}
+	m->out[state] |= group;
+}
+
+static void matcher_compile(struct filter_matcher *m)
+{
+	if (m->num_states == 0) {
+		return;
+	}
+
+	int *fail = malloc(sizeof(int) * m->num_states);
+	int *queue = malloc(sizeof(int) * m->num_states);
+	if (!fail || !queue) {
+		fprintf(stderr, "ERROR: malloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	int head = 0;
+	int tail = 0;
+	int c;
+
+	for (c = 0; c < 256; c++) {
+		int t = m->next[c];
+		if (t < 0) {
+			m->next[c] = 0;
+		} else {
+			fail[t] = 0;
+			queue[tail++] = t;
+		}
+	}
+	/* breadth first, so the failure state of each state is resolved already */
+	while (head < tail) {
+		int state = queue[head++];
+		m->out[state] |= m->out[fail[state]];
+		for (c = 0; c < 256; c++) {
+			int t = m->next[state * 256 + c];
+			int f = m->next[fail[state] * 256 + c];
+			if (t < 0) {
+				m->next[state * 256 + c] = f;
+			} else {
+				fail[t] = f;
+				queue[tail++] = t;
+			}
+		}
+	}
+
+	free(queue);
+	free(fail);
+}
+
+static unsigned int matcher_scan(struct filter_matcher *m, const char* p, const char* end, unsigned int wanted)
+{
+	unsigned int found = 0;
+	int state = 0;
+
+	if (m->num_states == 0) {
+		return 0;
+	}
+	while (p < end && *p) {
+		state = m->next[state * 256 + (unsigned char)*p];
+		found |= m->out[state];
+		if ((found & wanted) == wanted) {
+			break;
+		}
+		p++;
+	}
+	return found & wanted;
+}
+
+static unsigned int name_hash(const char* name, size_t len)
+{
+	unsigned int hash = 2166136261u;
+	size_t i;
+	for (i = 0; i < len; i++) {
+		hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static void name_set_build(struct name_set *set, char** names, int count)
+{
+	unsigned int size = 16;
+	int i;
+
+	while (size < (unsigned int)count * 2) {
+		size <<= 1;
+	}
+	set->slots = calloc(size, sizeof(const char*));
+	if (!set->slots) {
+		fprintf(stderr, "ERROR: calloc() failed\n");
+		exit(EXIT_FAILURE);
+	}
+	set->mask = size - 1;
+
+	for (i = 0; i < count; i++) {
+		if (!names[i]) continue;
+		unsigned int slot = name_hash(names[i], strlen(names[i])) & set->mask;
+		while (set->slots[slot] && strcmp(set->slots[slot], names[i]) != 0) {
+			slot = (slot + 1) & set->mask;
+		}
+		set->slots[slot] = names[i];
+	}
+}
+
+static int name_set_contains(struct name_set *set, const char* name, size_t len)
+{
+	if (!set->slots) {
+		return 0;
+	}
+	unsigned int slot = name_hash(name, len) & set->mask;
+	while (set->slots[slot]) {
+		if (strncmp(set->slots[slot], name, len) == 0 && set->slots[slot][len] == '\0') {
+			return 1;
+		}
+		slot = (slot + 1) & set->mask;
+	}
+	return 0;
+}
+
+static int pid_compare(const void* a, const void* b)
+{
+	int pa = *(const int*)a;
+	int pb = *(const int*)b;
+	return (pa > pb) - (pa < pb);
+}
+
+static void compile_filters(void)
+{
+	int i;
+	for (i = 0; i < num_msg_filters; i++) {
+		matcher_add(&matcher, msg_filters[i], FILTER_MSG);
+	}
+	for (i = 0; i < num_trigger_filters; i++) {
+		matcher_add(&matcher, trigger_filters[i], FILTER_TRIGGER);
+	}
+	for (i = 0; i < num_untrigger_filters; i++) {
+		matcher_add(&matcher, untrigger_filters[i], FILTER_UNTRIGGER);
+	}
+	matcher_compile(&matcher);
+
+	if (num_proc_filters > 0) {
+		name_set_build(&proc_set, proc_filters, num_proc_filters);
+	}
+	if (num_pid_filters > 1) {
+		qsort(pid_filters, num_pid_filters, sizeof(int), pid_compare);
+	}
+}
+
+static int find_char(char c, const char** p, const char* end)
 {
 	while ((**p != c) && (*p < end)) {
 		(*p)++;
@@ -181,307 +498,599 @@ static int find_char(char c, char** p, char* end)
 	return (**p == c);
 }
 
-static void stop_logging(void);
+static uint64_t host_time_usec(void)
+{
+#ifdef WIN32
+	FILETIME ft;
+	GetSystemTimeAsFileTime(&ft);
+	/* 100 ns intervals since 1601-01-01 */
+	uint64_t t = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	return t / 10 - 11644473600000000ULL;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
 
-static void syslog_callback(char c, void *user_data)
+static void json_append_string(struct syslog_device *dev, const char* key, const char* str, size_t len)
 {
-	if (lp >= line_buffer_size-1) {
-		line_buffer_size+=1024;
-		char* _line = realloc(line, line_buffer_size);
-		if (!_line) {
-			fprintf(stderr, "ERROR: realloc failed\n");
-			exit(EXIT_FAILURE);
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+	size_t start = 0;
+
+	if (dev->line_len > 1) {
+		out_append(dev, ",\"", 2);
+	} else {
+		out_append(dev, "\"", 1);
+	}
+	out_append(dev, key, strlen(key));
+	out_append(dev, "\":\"", 3);
+	for (i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)str[i];
+		if (c >= 0x20 && c != '"' && c != '\\') {
+			continue;
 		}
-		line = _line;
+		out_append(dev, str + start, i - start);
+		start = i + 1;
+		if (c == '"' || c == '\\') {
+			char esc[2] = { '\\', (char)c };
+			out_append(dev, esc, 2);
+		} else if (c == '\t') {
+			out_append(dev, "\\t", 2);
+		} else {
+			char esc[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xF] };
+			out_append(dev, esc, 6);
+		}
+	}
+	out_append(dev, str + start, len - start);
+	out_append(dev, "\"", 1);
+}
+
+static void json_append_number(struct syslog_device *dev, const char* key, uint64_t value)
+{
+	char num[32];
+	if (dev->line_len > 1) {
+		out_append(dev, ",\"", 2);
+	} else {
+		out_append(dev, "\"", 1);
+	}
+	out_append(dev, key, strlen(key));
+	out_append(dev, "\":", 2);
+	out_append(dev, num, snprintf(num, sizeof(num), "%llu", (unsigned long long)value));
+}
+
+static void json_write_record(struct syslog_device *dev, uint64_t host_time, const struct syslog_record* rec, const char* message, int message_len)
+{
+	dev->line_len = 0;
+	out_append(dev, "{", 1);
+	json_append_number(dev, "host_time_us", host_time);
+	if (all_devices) {
+		json_append_string(dev, "udid", dev->udid, strlen(dev->udid));
+	}
+	if (rec->time) {
+		json_append_string(dev, "time", rec->time, 15);
+	}
+	if (rec->device) {
+		json_append_string(dev, "device", rec->device, rec->device_len);
+	}
+	if (rec->process) {
+		json_append_string(dev, "process", rec->process, rec->process_len);
+	}
+	if (rec->image) {
+		json_append_string(dev, "image", rec->image, rec->image_len);
+	}
+	if (rec->pid >= 0) {
+		json_append_number(dev, "pid", rec->pid);
+	}
+	if (rec->level) {
+		json_append_string(dev, "level", rec->level, rec->level_len);
+	}
+	/* the line terminator is implied by the record */
+	while (message_len > 0 && (message[message_len-1] == '\n' || message[message_len-1] == '\r')) {
+		message_len--;
+	}
+	json_append_string(dev, "message", message, message_len);
+	out_append(dev, "}\n", 2);
+	out_commit(dev);
+}
+
+static void write_event(struct syslog_device *dev, const char* event)
+{
+	dev->line_len = 0;
+	if (output_json) {
+		out_append(dev, "{", 1);
+		json_append_number(dev, "host_time_us", host_time_usec());
+		json_append_string(dev, "event", event, strlen(event));
+		json_append_string(dev, "udid", dev->udid, strlen(dev->udid));
+		out_append(dev, "}\n", 2);
+	} else {
+		out_append(dev, "[", 1);
+		out_append(dev, event, strlen(event));
+		out_append(dev, ":", 1);
+		out_append(dev, dev->udid, strlen(dev->udid));
+		out_append(dev, "]\n", 2);
 	}
-	line[lp++] = c;
-	if (c == '\0') {
-		int shall_print = 0;
-		int trigger_off = 0;
-		lp--;
-		char* linep = &line[0];
-		do {
-			if (lp < 16) {
+	out_commit(dev);
+	if (!dev->queue) {
+		fflush(stdout);
+	}
+}
+
+static void stop_logging(struct syslog_device *dev);
+
+static void syslog_callback(const char *line, uint32_t length, void *user_data)
+{
+	struct syslog_device *dev = (struct syslog_device*)user_data;
+	if (!line) {
+		/* the relay connection was interrupted */
+		mutex_lock(&dev->mutex);
+		dev->disconnected = 1;
+		mutex_unlock(&dev->mutex);
+		return;
+	}
+
+	int shall_print = 0;
+	int trigger_off = 0;
+	int lp = (int)length;
+	const char* linep = &line[0];
+	uint64_t host_time = 0;
+	struct syslog_record rec;
+	if (output_json) {
+		host_time = host_time_usec();
+		memset(&rec, 0, sizeof(rec));
+		rec.pid = -1;
+	} else if (all_devices) {
+		out_append(dev, "[", 1);
+		out_append(dev, dev->udid, strlen(dev->udid));
+		out_append(dev, "] ", 2);
+	}
+	do {
+		if (lp < 16) {
+			shall_print = 1;
+			TEXT_COLOR(dev, COLOR_WHITE);
+			break;
+		} else if (line[3] == ' ' && line[6] == ' ' && line[15] == ' ') {
+			const char* end = &line[lp];
+			const char* p = &line[16];
+
+			/* device name */
+			const char* device_name_start = p;
+			const char* device_name_end = p;
+			if (!find_char(' ', &p, end)) break;
+			device_name_end = p;
+			p++;
+
+			/* scan the message once for all message/trigger/untrigger filters */
+			unsigned int wanted = 0;
+			if (num_untrigger_filters > 0 && dev->triggered) {
+				wanted |= FILTER_UNTRIGGER;
+			} else if (num_trigger_filters > 0 && !dev->triggered) {
+				wanted |= FILTER_TRIGGER;
+			}
+			if (num_msg_filters > 0) {
+				wanted |= FILTER_MSG;
+			}
+			unsigned int found_filters = 0;
+			if (wanted) {
+				found_filters = matcher_scan(&matcher, device_name_end+1, end, wanted);
+			}
+
+			/* check if we have any triggers/untriggers */
+			if (num_untrigger_filters > 0 && dev->triggered) {
 				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
-				break;
-			} else if (line[3] == ' ' && line[6] == ' ' && line[15] == ' ') {
-				char* end = &line[lp];
-				char* p = &line[16];
-
-				/* device name */
-				char* device_name_start = p;
-				char* device_name_end = p;
-				if (!find_char(' ', &p, end)) break;
-				device_name_end = p;
-				p++;
-
-				/* check if we have any triggers/untriggers */
-				if (num_untrigger_filters > 0 && triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_untrigger_filters; i++) {
-						if (strstr(device_name_end+1, untrigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 1;
-					} else {
-						shall_print = 1;
-						trigger_off = 1;
-					}
-				} else if (num_trigger_filters > 0 && !triggered) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_trigger_filters; i++) {
-						if (strstr(device_name_end+1, trigger_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						triggered = 1;
-						shall_print = 1;
-					}
-				} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !triggered) {
+				if (found_filters & FILTER_UNTRIGGER) {
+					trigger_off = 1;
+				}
+			} else if (num_trigger_filters > 0 && !dev->triggered) {
+				if (!(found_filters & FILTER_TRIGGER)) {
 					shall_print = 0;
-					quit_flag++;
 					break;
+				} else {
+					dev->triggered = 1;
+					shall_print = 1;
 				}
+			} else if (num_trigger_filters == 0 && num_untrigger_filters > 0 && !dev->triggered) {
+				shall_print = 0;
+				request_quit();
+				break;
+			}
 
-				/* check message filters */
-				if (num_msg_filters > 0) {
-					int found = 0;
-					int i;
-					for (i = 0; i < num_msg_filters; i++) {
-						if (strstr(device_name_end+1, msg_filters[i])) {
-							found = 1;
-							break;
-						}
-					}
-					if (!found) {
-						shall_print = 0;
-						break;
-					} else {
-						shall_print = 1;
-					}
+			/* check message filters */
+			if (num_msg_filters > 0) {
+				if (!(found_filters & FILTER_MSG)) {
+					shall_print = 0;
+					break;
+				} else {
+					shall_print = 1;
 				}
+			}
 
-				/* process name */
-				char* proc_name_start = p;
-				char* proc_name_end = p;
-				if (!find_char('[', &p, end)) break;
-				char* process_name_start = proc_name_start;
-				char* process_name_end = p;
-				char* pid_start = p+1;
-				char* pp = process_name_start;
-				if (find_char('(', &pp, p)) {
-					process_name_end = pp;
-				}
-				if (!find_char(']', &p, end)) break;
-				p++;
-				if (*p != ' ') break;
-				proc_name_end = p;
-				p++;
-
-				int proc_matched = 0;
-				if (num_pid_filters > 0) {
-					char* endp = NULL;
-					int pid_value = (int)strtol(pid_start, &endp, 10);
-					if (endp && (*endp == ']')) {
-						int found = proc_filter_excluding;
-						int i = 0;
-						for (i = 0; i < num_pid_filters; i++) {
-							if (pid_value == pid_filters[i]) {
-								found = !proc_filter_excluding;
-								break;
-							}
-						}
-						if (found) {
-							proc_matched = 1;
-						}
-					}
-				}
-				if (num_proc_filters > 0 && !proc_matched) {
+			/* process name */
+			const char* proc_name_start = p;
+			const char* proc_name_end = p;
+			if (!find_char('[', &p, end)) break;
+			const char* process_name_start = proc_name_start;
+			const char* process_name_end = p;
+			const char* pid_start = p+1;
+			const char* pp = process_name_start;
+			if (find_char('(', &pp, p)) {
+				process_name_end = pp;
+			}
+			if (!find_char(']', &p, end)) break;
+			p++;
+			if (*p != ' ') break;
+			proc_name_end = p;
+			p++;
+
+			int proc_matched = 0;
+			if (num_pid_filters > 0) {
+				char* endp = NULL;
+				int pid_value = (int)strtol(pid_start, &endp, 10);
+				if (endp && (*endp == ']')) {
 					int found = proc_filter_excluding;
-					int i = 0;
-					for (i = 0; i < num_proc_filters; i++) {
-						if (!proc_filters[i]) continue;
-						if (strncmp(proc_filters[i], process_name_start, process_name_end-process_name_start) == 0) {
-							found = !proc_filter_excluding;
-							break;
-						}
+					if (bsearch(&pid_value, pid_filters, num_pid_filters, sizeof(int), pid_compare)) {
+						found = !proc_filter_excluding;
 					}
 					if (found) {
 						proc_matched = 1;
 					}
 				}
-				if (proc_matched) {
-					shall_print = 1;
-				} else {
-					if (num_pid_filters > 0 || num_proc_filters > 0) {
-						shall_print = 0;
-						break;
-					}
+			}
+			if (num_proc_filters > 0 && !proc_matched) {
+				int found = proc_filter_excluding;
+				if (name_set_contains(&proc_set, process_name_start, process_name_end-process_name_start)) {
+					found = !proc_filter_excluding;
+				}
+				if (found) {
+					proc_matched = 1;
+				}
+			}
+			if (proc_matched) {
+				shall_print = 1;
+			} else {
+				if (num_pid_filters > 0 || num_proc_filters > 0) {
+					shall_print = 0;
+					break;
 				}
+			}
 
-				/* log level */
-				char* level_start = p;
-				char* level_end = p;
+			/* log level */
+			const char* level_start = p;
+			const char* level_end = p;
 #ifdef WIN32
-				WORD level_color = COLOR_NORMAL;
+			WORD level_color = COLOR_NORMAL;
 #else
-				const char* level_color = NULL;
+			const char* level_color = NULL;
 #endif
-				if (!strncmp(p, "<Notice>:", 9)) {
-					level_end += 9;
-					level_color = COLOR_GREEN;
-				} else if (!strncmp(p, "<Error>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_RED;
-				} else if (!strncmp(p, "<Warning>:", 10)) {
-					level_end += 10;
-					level_color = COLOR_YELLOW;
-				} else if (!strncmp(p, "<Debug>:", 8)) {
-					level_end += 8;
-					level_color = COLOR_MAGENTA;
-				} else {
-					level_color = COLOR_WHITE;
-				}
-
-				/* write date and time */
-				TEXT_COLOR(COLOR_DARK_WHITE);
-				fwrite(line, 1, 16, stdout);
+			if (!strncmp(p, "<Notice>:", 9)) {
+				level_end += 9;
+				level_color = COLOR_GREEN;
+			} else if (!strncmp(p, "<Error>:", 8)) {
+				level_end += 8;
+				level_color = COLOR_RED;
+			} else if (!strncmp(p, "<Warning>:", 10)) {
+				level_end += 10;
+				level_color = COLOR_YELLOW;
+			} else if (!strncmp(p, "<Debug>:", 8)) {
+				level_end += 8;
+				level_color = COLOR_MAGENTA;
+			} else {
+				level_color = COLOR_WHITE;
+			}
 
-				if (show_device_name) {
-					/* write device name */
-					TEXT_COLOR(COLOR_DARK_YELLOW);
-					fwrite(device_name_start, 1, device_name_end-device_name_start+1, stdout);
-					TEXT_COLOR(COLOR_RESET);
+			if (output_json) {
+				rec.time = line;
+				rec.device = device_name_start;
+				rec.device_len = device_name_end-device_name_start;
+				rec.process = process_name_start;
+				rec.process_len = process_name_end-process_name_start;
+				if (*process_name_end == '(') {
+					const char* image_end = pid_start-1;
+					if (image_end > process_name_end+1 && *(image_end-1) == ')') {
+						image_end--;
+					}
+					rec.image = process_name_end+1;
+					rec.image_len = image_end-rec.image;
+				}
+				char* endp = NULL;
+				long pid_value = strtol(pid_start, &endp, 10);
+				if (endp && (*endp == ']')) {
+					rec.pid = (int)pid_value;
 				}
-
-				/* write process name */
-				TEXT_COLOR(COLOR_BRIGHT_CYAN);
-				fwrite(process_name_start, 1, process_name_end-process_name_start, stdout);
-				TEXT_COLOR(COLOR_CYAN);
-				fwrite(process_name_end, 1, proc_name_end-process_name_end+1, stdout);
-
-				/* write log level */
-				TEXT_COLOR(level_color);
 				if (level_end > level_start) {
-					fwrite(level_start, 1, level_end-level_start, stdout);
+					/* strip the angle brackets and the colon */
+					rec.level = level_start+1;
+					rec.level_len = level_end-level_start-3;
 					p = level_end;
 				}
-
+				if (*p == ' ') {
+					p++;
+				}
 				lp -= p - linep;
 				linep = p;
+				break;
+			}
 
-				TEXT_COLOR(COLOR_WHITE);
+			/* write date and time */
+			TEXT_COLOR(dev, COLOR_DARK_WHITE);
+			out_append(dev, line, 16);
 
-			} else {
-				shall_print = 1;
-				TEXT_COLOR(COLOR_WHITE);
+			if (show_device_name) {
+				/* write device name */
+				TEXT_COLOR(dev, COLOR_DARK_YELLOW);
+				out_append(dev, device_name_start, device_name_end-device_name_start+1);
+				TEXT_COLOR(dev, COLOR_RESET);
 			}
-		} while (0);
 
-		if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
-			fwrite(linep, 1, lp, stdout);
-			TEXT_COLOR(COLOR_RESET);
-			fflush(stdout);
+			/* write process name */
+			TEXT_COLOR(dev, COLOR_BRIGHT_CYAN);
+			out_append(dev, process_name_start, process_name_end-process_name_start);
+			TEXT_COLOR(dev, COLOR_CYAN);
+			out_append(dev, process_name_end, proc_name_end-process_name_end+1);
+
+			/* write log level */
+			TEXT_COLOR(dev, level_color);
+			if (level_end > level_start) {
+				out_append(dev, level_start, level_end-level_start);
+				p = level_end;
+			}
+
+			lp -= p - linep;
+			linep = p;
+
+			TEXT_COLOR(dev, COLOR_WHITE);
+
+		} else {
+			shall_print = 1;
+			TEXT_COLOR(dev, COLOR_WHITE);
+		}
+	} while (0);
+
+	if ((num_msg_filters == 0 && num_proc_filters == 0 && num_pid_filters == 0 && num_trigger_filters == 0 && num_untrigger_filters == 0) || shall_print) {
+		if (output_json) {
+			json_write_record(dev, host_time, &rec, linep, lp);
 			if (trigger_off) {
-				triggered = 0;
+				dev->triggered = 0;
 			}
+			return;
 		}
-		line[0] = '\0';
-		lp = 0;
-		return;
+		out_append(dev, linep, lp);
+		TEXT_COLOR(dev, COLOR_RESET);
+		out_commit(dev);
+		if (!dev->queue) {
+			fflush(stdout);
+		}
+		if (trigger_off) {
+			dev->triggered = 0;
+		}
+	} else {
+		dev->line_len = 0;
 	}
 }
 
-static int start_logging(void)
+static int start_logging(struct syslog_device *dev)
 {
-	idevice_error_t ret = idevice_new_with_options(&device, udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
+	idevice_error_t ret = idevice_new_with_options(&dev->device, dev->udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX);
 	if (ret != IDEVICE_E_SUCCESS) {
-		fprintf(stderr, "Device with udid %s not found!?\n", udid);
+		fprintf(stderr, "Device with udid %s not found!?\n", dev->udid);
 		return -1;
 	}
 
 	lockdownd_client_t lockdown = NULL;
-	lockdownd_error_t lerr = lockdownd_client_new_with_handshake(device, &lockdown, TOOL_NAME);
+	lockdownd_error_t lerr = lockdownd_client_new_with_handshake(dev->device, &lockdown, TOOL_NAME);
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %d\n", lerr);
-		idevice_free(device);
-		device = NULL;
+		idevice_free(dev->device);
+		dev->device = NULL;
 		return -1;
 	}
 
 	/* start syslog_relay service */
 	lockdownd_service_descriptor_t svc = NULL;
 	lerr = lockdownd_start_service(lockdown, SYSLOG_RELAY_SERVICE_NAME, &svc);
-	if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED) {
+	if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED && all_devices) {
+		/* do not hold up the other devices */
+		fprintf(stderr, "ERROR: Device %s is passcode protected\n", dev->udid);
+	} else if (lerr == LOCKDOWN_E_PASSWORD_PROTECTED) {
 		fprintf(stderr, "*** Device is passcode protected, enter passcode on the device to continue ***\n");
 		while (!quit_flag) {
 			lerr = lockdownd_start_service(lockdown, SYSLOG_RELAY_SERVICE_NAME, &svc);
 			if (lerr != LOCKDOWN_E_PASSWORD_PROTECTED) {
 				break;
 			}
-			sleep(1);
+			wait_for_quit(1000);
 		}
 	}
 	if (lerr != LOCKDOWN_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not connect to lockdownd: %d\n", lerr);
-		idevice_free(device);
-		device = NULL;
+		lockdownd_client_free(lockdown);
+		idevice_free(dev->device);
+		dev->device = NULL;
 		return -1;
 	}
 	lockdownd_client_free(lockdown);
 
 	/* connect to syslog_relay service */
 	syslog_relay_error_t serr = SYSLOG_RELAY_E_UNKNOWN_ERROR;
-	serr = syslog_relay_client_new(device, svc, &syslog);
+	serr = syslog_relay_client_new(dev->device, svc, &dev->syslog);
 	lockdownd_service_descriptor_free(svc);
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Could not start service com.apple.syslog_relay.\n");
-		idevice_free(device);
-		device = NULL;
+		idevice_free(dev->device);
+		dev->device = NULL;
 		return -1;
 	}
 
+	write_event(dev, "connected");
+
 	/* start capturing syslog */
-	serr = syslog_relay_start_capture_raw(syslog, syslog_callback, NULL);
+	if (all_devices) {
+		serr = syslog_relay_start_capture_lines_with_loop(dev->syslog, event_loop, syslog_callback, dev);
+	} else {
+		if (queue_lines > 0 && syslog_relay_set_delivery(dev->syslog, queue_lines, IDEVICE_DELIVERY_DROP_OLDEST) != SYSLOG_RELAY_E_SUCCESS) {
+			fprintf(stderr, "WARNING: Could not set up a queue of %u lines, printing directly.\n", queue_lines);
+		}
+		serr = syslog_relay_start_capture_lines(dev->syslog, syslog_callback, dev);
+	}
 	if (serr != SYSLOG_RELAY_E_SUCCESS) {
 		fprintf(stderr, "ERROR: Unable tot start capturing syslog.\n");
-		syslog_relay_client_free(syslog);
-		syslog = NULL;
-		idevice_free(device);
-		device = NULL;
+		syslog_relay_client_free(dev->syslog);
+		dev->syslog = NULL;
+		idevice_free(dev->device);
+		dev->device = NULL;
 		return -1;
 	}
 
-	fprintf(stdout, "[connected:%s]\n", udid);
-	fflush(stdout);
-
 	return 0;
 }
 
-static void stop_logging(void)
+static void stop_logging(struct syslog_device *dev)
 {
 	fflush(stdout);
 
-	if (syslog) {
-		syslog_relay_client_free(syslog);
-		syslog = NULL;
+	if (dev->syslog) {
+		uint64_t dropped = 0;
+		syslog_relay_stop_capture(dev->syslog);
+		if (syslog_relay_get_dropped(dev->syslog, &dropped) == SYSLOG_RELAY_E_SUCCESS && dropped > 0) {
+			fprintf(stderr, "NOTE: %llu lines were dropped because output could not keep up.\n", (unsigned long long)dropped);
+		}
+		syslog_relay_client_free(dev->syslog);
+		dev->syslog = NULL;
+	}
+
+	if (dev->device) {
+		idevice_free(dev->device);
+		dev->device = NULL;
+	}
+}
+
+/* must be called with devices_mutex held */
+static struct syslog_device* find_device(const char* device_udid)
+{
+	struct syslog_device *dev;
+	for (dev = devices; dev; dev = dev->next) {
+		if (!dev->removed && !strcmp(dev->udid, device_udid)) {
+			return dev;
+		}
+	}
+	return NULL;
+}
+
+static void add_device(const char* device_udid)
+{
+	mutex_lock(&devices_mutex);
+	if (!find_device(device_udid)) {
+		struct syslog_device *dev = calloc(1, sizeof(struct syslog_device));
+		if (dev) {
+			dev->udid = strdup(device_udid);
+			dev->triggered = triggered;
+			dev->queue = malloc(DEVICE_QUEUE_SIZE);
+			dev->spare = malloc(DEVICE_QUEUE_SIZE);
+			if (!dev->udid || !dev->queue || !dev->spare) {
+				fprintf(stderr, "ERROR: Out of memory\n");
+				free(dev->udid);
+				free(dev->queue);
+				free(dev->spare);
+				free(dev);
+			} else {
+				mutex_init(&dev->mutex);
+				/* connecting is left to the main thread */
+				dev->pending = 1;
+				dev->next = devices;
+				devices = dev;
+			}
+		}
+	}
+	mutex_unlock(&devices_mutex);
+}
+
+static void free_device(struct syslog_device *dev)
+{
+	mutex_destroy(&dev->mutex);
+	free(dev->udid);
+	free(dev->line);
+	free(dev->queue);
+	free(dev->spare);
+	free(dev);
+}
+
+/* writes out the lines queued for a device and reports dropped lines */
+static void drain_device(struct syslog_device *dev)
+{
+	mutex_lock(&dev->mutex);
+	char *data = dev->queue;
+	size_t len = dev->queue_len;
+	unsigned long dropped = dev->dropped;
+	dev->queue = dev->spare;
+	dev->spare = data;
+	dev->queue_len = 0;
+	dev->dropped = 0;
+	mutex_unlock(&dev->mutex);
+
+	if (len > 0) {
+		fwrite(data, 1, len, stdout);
+	}
+	if (dropped > 0) {
+		if (output_json) {
+			printf("{\"host_time_us\":%llu,\"event\":\"dropped\",\"udid\":\"%s\",\"count\":%lu}\n", (unsigned long long)host_time_usec(), dev->udid, dropped);
+		} else {
+			printf("[dropped:%s:%lu]\n", dev->udid, dropped);
+		}
 	}
+}
+
+/* connects new devices, writes out queued lines and cleans up disconnected devices */
+static void service_devices(void)
+{
+	struct syslog_device *dev;
+	struct syslog_device *next;
+
+	mutex_lock(&devices_mutex);
+	dev = devices;
+	mutex_unlock(&devices_mutex);
+
+	/* only this thread unlinks devices, new ones are added at the head */
+	for (; dev; dev = next) {
+		mutex_lock(&devices_mutex);
+		next = dev->next;
+		int pending = dev->pending;
+		int removed = dev->removed;
+		dev->pending = 0;
+		mutex_unlock(&devices_mutex);
+
+		mutex_lock(&dev->mutex);
+		int disconnected = dev->disconnected;
+		mutex_unlock(&dev->mutex);
+
+		if (pending && !removed && !quit_flag && start_logging(dev) != 0) {
+			fprintf(stderr, "Could not start logger for udid %s\n", dev->udid);
+			removed = 1;
+		}
+		drain_device(dev);
+		if (!removed && !disconnected && !quit_flag) {
+			continue;
+		}
 
-	if (device) {
-		idevice_free(device);
-		device = NULL;
+		if (dev->syslog) {
+			stop_logging(dev);
+			write_event(dev, "disconnected");
+			drain_device(dev);
+		}
+		if (!quit_flag) {
+			struct syslog_device **pdev;
+			mutex_lock(&devices_mutex);
+			for (pdev = &devices; *pdev; pdev = &(*pdev)->next) {
+				if (*pdev == dev) {
+					*pdev = dev->next;
+					break;
+				}
+			}
+			mutex_unlock(&devices_mutex);
+			free_device(dev);
+		}
 	}
+	fflush(stdout);
 }
 
 static void device_event_cb(const idevice_event_t* event, void* userdata)
@@ -491,23 +1100,37 @@ static void device_event_cb(const idevice_event_t* event, void* userdata)
 	} else if (!use_network && event->conn_type != CONNECTION_USBMUXD) {
 		return;
 	}
+	if (all_devices) {
+		if (event->event == IDEVICE_DEVICE_ADD) {
+			add_device(event->udid);
+		} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+			mutex_lock(&devices_mutex);
+			struct syslog_device *dev = find_device(event->udid);
+			if (dev) {
+				dev->removed = 1;
+			}
+			mutex_unlock(&devices_mutex);
+		}
+		return;
+	}
 	if (event->event == IDEVICE_DEVICE_ADD) {
-		if (!syslog) {
+		if (!single_device.syslog) {
 			if (!udid) {
 				udid = strdup(event->udid);
 			}
 			if (strcmp(udid, event->udid) == 0) {
-				if (start_logging() != 0) {
+				single_device.udid = udid;
+				if (start_logging(&single_device) != 0) {
 					fprintf(stderr, "Could not start logger for udid %s\n", udid);
 				}
 			}
 		}
 	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
-		if (syslog && (strcmp(udid, event->udid) == 0)) {
-			stop_logging();
-			fprintf(stdout, "[disconnected:%s]\n", udid);
+		if (single_device.syslog && (strcmp(udid, event->udid) == 0)) {
+			stop_logging(&single_device);
+			write_event(&single_device, "disconnected");
 			if (exit_on_disconnect) {
-				quit_flag++;
+				request_quit();
 			}
 		}
 	}
@@ -519,8 +1142,25 @@ static void device_event_cb(const idevice_event_t* event, void* userdata)
 static void clean_exit(int sig)
 {
 	fprintf(stderr, "\nExiting...\n");
-	quit_flag++;
+	request_quit();
+}
+
+#ifndef WIN32
+static sigset_t quit_signals;
+
+/**
+ * Handles the quit signals outside of signal context, so that waiting
+ * threads can be woken up right away.
+ */
+static void* signal_thread(void* arg)
+{
+	int sig = 0;
+	while (sigwait(&quit_signals, &sig) == 0) {
+		clean_exit(sig);
+	}
+	return NULL;
 }
+#endif
 
 static void print_usage(int argc, char **argv, int is_error)
 {
@@ -534,11 +1174,17 @@ static void print_usage(int argc, char **argv, int is_error)
 		"OPTIONS:\n" \
 		"  -u, --udid UDID  target specific device by UDID\n" \
 		"  -n, --network    connect to network device\n" \
+		"  -a, --all        relay the syslog of all devices, lines are prefixed\n" \
+		"                   by the device UDID\n" \
 		"  -x, --exit       exit when device disconnects\n" \
 		"  -h, --help       prints usage information\n" \
 		"  -d, --debug      enable communication debugging\n" \
 		"  -v, --version    prints version information\n" \
 		" --no-colors       disable colored output\n" \
+		"  -o, --output FORMAT  select output format: 'text' (default) or 'json'\n" \
+		"                   for one JSON object per line with host receive time\n" \
+		"  -Q, --queue LINES  print on a separate thread and drop the oldest\n" \
+		"                   lines when more than LINES are waiting\n" \
 		"\n" \
 		"FILTER OPTIONS:\n" \
 		"  -m, --match STRING      only print messages that contain STRING\n" \
@@ -591,18 +1237,33 @@ int main(int argc, char *argv[])
 		{ "no-kernel", no_argument, NULL, 'K' },
 		{ "quiet-list", no_argument, NULL, 1 },
 		{ "no-colors", no_argument, NULL, 2 },
+		{ "output", required_argument, NULL, 'o' },
+		{ "all", no_argument, NULL, 'a' },
+		{ "queue", required_argument, NULL, 'Q' },
 		{ "version", no_argument, NULL, 'v' },
 		{ NULL, 0, NULL, 0}
 	};
 
+	mutex_init(&quit_mutex);
+	cond_init(&quit_cond);
+#ifdef WIN32
 	signal(SIGINT, clean_exit);
 	signal(SIGTERM, clean_exit);
-#ifndef WIN32
-	signal(SIGQUIT, clean_exit);
+#else
+	/* blocked before any other thread is started so they inherit it */
+	sigemptyset(&quit_signals);
+	sigaddset(&quit_signals, SIGINT);
+	sigaddset(&quit_signals, SIGTERM);
+	sigaddset(&quit_signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &quit_signals, NULL);
+	THREAD_T sig_thread;
+	if (thread_new(&sig_thread, signal_thread, NULL) == 0) {
+		thread_detach(sig_thread);
+	}
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	while ((c = getopt_long(argc, argv, "dhu:nxt:T:m:e:p:qkKv", longopts, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "dhu:nxt:T:m:e:p:qkKo:aQ:v", longopts, NULL)) != -1) {
 		switch (c) {
 		case 'd':
 			idevice_set_debug_level(1);
@@ -704,6 +1365,28 @@ int main(int argc, char *argv[])
 		case 2:
 			no_colors = 1;
 			break;
+		case 'o':
+			if (!strcmp(optarg, "json")) {
+				output_json = 1;
+			} else if (!strcmp(optarg, "text")) {
+				output_json = 0;
+			} else {
+				fprintf(stderr, "ERROR: Unsupported output format '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
+		case 'a':
+			all_devices = 1;
+			break;
+		case 'Q':
+			queue_lines = (uint32_t)strtoul(optarg, NULL, 10);
+			if (queue_lines == 0) {
+				fprintf(stderr, "ERROR: Invalid queue size '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
 		case 'v':
 			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
 			return 0;
@@ -713,6 +1396,12 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (all_devices && udid) {
+		fprintf(stderr, "ERROR: -a and -u cannot be used together.\n");
+		print_usage(argc, argv, 1);
+		return 2;
+	}
+
 	if (include_kernel > 0 && exclude_kernel > 0) {
 		fprintf(stderr, "ERROR: -k and -K cannot be used together.\n");
 		print_usage(argc, argv, 1);
@@ -754,20 +1443,27 @@ int main(int argc, char *argv[])
 	if (num_untrigger_filters > 0 && num_trigger_filters == 0) {
 		triggered = 1;
 	}
+	single_device.triggered = triggered;
+
+	compile_filters();
 
 	argc -= optind;
 	argv += optind;
 
-	if (!no_colors && isatty(1)) {
+	if (output_json || all_devices) {
+		setvbuf(stdout, NULL, _IOFBF, JSON_OUTPUT_BUFFER_SIZE);
+	} else if (!no_colors && isatty(1)) {
 		use_colors = 1;
 	}
 
 	int num = 0;
-	idevice_info_t *devices = NULL;
-	idevice_get_device_list_extended(&devices, &num);
-	idevice_device_list_extended_free(devices);
+	idevice_info_t *device_list = NULL;
+	idevice_get_device_list_extended(&device_list, &num);
+	idevice_device_list_extended_free(device_list);
 	if (num == 0) {
-		if (!udid) {
+		if (all_devices) {
+			fprintf(stderr, "Waiting for devices to become available...\n");
+		} else if (!udid) {
 			fprintf(stderr, "No device found. Plug in a device or pass UDID with -u to wait for device to be available.\n");
 			return -1;
 		} else {
@@ -775,16 +1471,43 @@ int main(int argc, char *argv[])
 		}
 	}
 
-	line_buffer_size = 1024;
-	line = malloc(line_buffer_size);
+	if (all_devices) {
+		mutex_init(&devices_mutex);
+		if (idevice_event_loop_new(&event_loop, 0) != IDEVICE_E_SUCCESS) {
+			fprintf(stderr, "ERROR: Could not create event loop\n");
+			return 1;
+		}
+	}
 
 	idevice_event_subscribe(device_event_cb, NULL);
 
-	while (!quit_flag) {
-		sleep(1);
+	if (all_devices) {
+		while (!wait_for_quit(DRAIN_INTERVAL)) {
+			service_devices();
+		}
+	} else {
+		while (!wait_for_quit(1000)) {
+			if (output_json) {
+				fflush(stdout);
+			}
+		}
 	}
 	idevice_event_unsubscribe();
-	stop_logging();
+
+	if (all_devices) {
+		/* stops all devices since quit_flag is set */
+		service_devices();
+		while (devices) {
+			struct syslog_device *dev = devices;
+			devices = dev->next;
+			free_device(dev);
+		}
+		idevice_event_loop_free(event_loop);
+		mutex_destroy(&devices_mutex);
+	} else {
+		stop_logging(&single_device);
+		free(single_device.line);
+	}
 
 	if (num_proc_filters > 0) {
 		int i;
@@ -818,7 +1541,9 @@ int main(int argc, char *argv[])
 		free(untrigger_filters);
 	}
 
-	free(line);
+	free(matcher.next);
+	free(matcher.out);
+	free(proc_set.slots);
 
 	free(udid);
 
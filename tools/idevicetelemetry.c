@@ -0,0 +1,504 @@
+/*
+ * idevicetelemetry.c
+ * Periodically sample battery, disk and thermal data of attached devices
+ *
+ * Copyright (c) 2026 libimobiledevice contributors, All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#define TOOL_NAME "idevicetelemetry"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <getopt.h>
+#include <inttypes.h>
+#ifdef WIN32
+#include <windows.h>
+#define sleep(x) Sleep(x*1000)
+#else
+#include <unistd.h>
+#endif
+
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/diagnostics_relay.h>
+#include "common/utils.h"
+#include "common/thread.h"
+
+#define DEFAULT_INTERVAL 60
+
+/* IORegistry entry with battery and thermal data */
+#define POWER_SOURCE_CLASS "IOPMPowerSource"
+
+#define NUM_DOMAINS 2
+static const char *domains[NUM_DOMAINS] = {
+	"com.apple.mobile.battery",
+	"com.apple.disk_usage"
+};
+/* all keys of each domain are queried */
+static const char *domain_keys[NUM_DOMAINS] = {
+	NULL,
+	NULL
+};
+static const char *domain_measurements[NUM_DOMAINS] = {
+	"battery",
+	"disk"
+};
+
+struct telemetry_device {
+	char *udid;
+	idevice_t device;
+	lockdownd_client_t lockdown;
+	diagnostics_relay_client_t diag;
+	diagnostics_relay_sampler_t sampler;
+	/* domain values of the previous sample */
+	plist_t last[NUM_DOMAINS];
+	int removed;
+	struct telemetry_device *next;
+};
+
+static struct telemetry_device *devices = NULL;
+static mutex_t devices_mutex;
+static int quit_flag = 0;
+static int use_network = 0;
+static const char *filter_udid = NULL;
+
+/* line of the measurement that is currently sampled */
+static char *line = NULL;
+static size_t line_len = 0;
+static size_t line_size = 0;
+
+static void line_append(const char *str)
+{
+	size_t len = strlen(str);
+	if (line_len + len + 1 > line_size) {
+		size_t new_size = (line_size) ? line_size * 2 : 256;
+		while (new_size < line_len + len + 1)
+			new_size *= 2;
+		char *new_line = (char*)realloc(line, new_size);
+		if (!new_line)
+			return;
+		line = new_line;
+		line_size = new_size;
+	}
+	memcpy(line + line_len, str, len + 1);
+	line_len += len;
+}
+
+static void line_begin(const char *measurement, const char *udid)
+{
+	line_len = 0;
+	line_append(measurement);
+	line_append(",udid=");
+	line_append(udid);
+	line_append(" ");
+}
+
+/* adds a field to the current line if the value is numeric or boolean */
+static void line_add_field(const char *key, plist_t value)
+{
+	char buf[64];
+	switch (plist_get_node_type(value)) {
+	case PLIST_BOOLEAN: {
+		uint8_t b = 0;
+		plist_get_bool_val(value, &b);
+		snprintf(buf, sizeof(buf), "%s", (b) ? "true" : "false");
+	}
+		break;
+	case PLIST_UINT: {
+		uint64_t u = 0;
+		plist_get_uint_val(value, &u);
+		/* negative values are transferred as large unsigned integers */
+		snprintf(buf, sizeof(buf), "%" PRId64 "i", (int64_t)u);
+	}
+		break;
+	case PLIST_REAL: {
+		double d = 0;
+		plist_get_real_val(value, &d);
+		snprintf(buf, sizeof(buf), "%g", d);
+	}
+		break;
+	default:
+		return;
+	}
+
+	if (line[line_len-1] != ' ') {
+		line_append(",");
+	}
+	/* escape characters that separate keys in the line protocol */
+	const char *p;
+	char c[3] = { 0, 0, 0 };
+	for (p = key; *p; p++) {
+		if (*p == ' ' || *p == ',' || *p == '=') {
+			c[0] = '\\';
+			c[1] = *p;
+		} else {
+			c[0] = *p;
+			c[1] = 0;
+		}
+		line_append(c);
+	}
+	line_append("=");
+	line_append(buf);
+}
+
+/* prints the current line if it contains any fields */
+static void line_end(time_t now)
+{
+	if (line_len == 0 || line[line_len-1] == ' ')
+		return;
+	printf("%s %lld000000000\n", line, (long long)now);
+}
+
+static void print_event(const char *udid, const char *state, time_t now)
+{
+	printf("device,udid=%s state=\"%s\" %lld000000000\n", udid, state, (long long)now);
+}
+
+static void sample_cb(const char *source, const char *key, plist_t value, diagnostics_relay_error_t status, void *user_data)
+{
+	if (status != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		if (source) {
+			fprintf(stderr, "[%s] Could not query %s, error %d\n", (const char*)user_data, source, status);
+		}
+		return;
+	}
+	if (key && value) {
+		line_add_field(key, value);
+	}
+}
+
+static void device_free(struct telemetry_device *dev)
+{
+	int i;
+	diagnostics_relay_sampler_free(dev->sampler);
+	if (dev->diag) {
+		diagnostics_relay_goodbye(dev->diag);
+		diagnostics_relay_client_free(dev->diag);
+	}
+	lockdownd_client_free(dev->lockdown);
+	idevice_free(dev->device);
+	for (i = 0; i < NUM_DOMAINS; i++) {
+		plist_free(dev->last[i]);
+	}
+	free(dev->udid);
+	free(dev);
+}
+
+/* closes all connections of a device so it is connected again on the next sample */
+static void device_disconnect(struct telemetry_device *dev)
+{
+	int i;
+	diagnostics_relay_sampler_free(dev->sampler);
+	dev->sampler = NULL;
+	if (dev->diag) {
+		diagnostics_relay_client_free(dev->diag);
+		dev->diag = NULL;
+	}
+	lockdownd_client_free(dev->lockdown);
+	dev->lockdown = NULL;
+	idevice_free(dev->device);
+	dev->device = NULL;
+	for (i = 0; i < NUM_DOMAINS; i++) {
+		plist_free(dev->last[i]);
+		dev->last[i] = NULL;
+	}
+}
+
+static int device_connect(struct telemetry_device *dev)
+{
+	lockdownd_service_descriptor_t service = NULL;
+	lockdownd_error_t lerr;
+
+	if (idevice_new_with_options(&dev->device, dev->udid, (use_network) ? IDEVICE_LOOKUP_NETWORK : IDEVICE_LOOKUP_USBMUX) != IDEVICE_E_SUCCESS) {
+		fprintf(stderr, "[%s] Could not connect to device\n", dev->udid);
+		return -1;
+	}
+
+	lerr = lockdownd_client_new_with_handshake(dev->device, &dev->lockdown, TOOL_NAME);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		fprintf(stderr, "[%s] Could not connect to lockdownd, error code %d\n", dev->udid, lerr);
+		goto error;
+	}
+
+	lerr = lockdownd_start_service(dev->lockdown, DIAGNOSTICS_RELAY_SERVICE_NAME, &service);
+	if (lerr != LOCKDOWN_E_SUCCESS) {
+		/* attempt to use older diagnostics service */
+		lerr = lockdownd_start_service(dev->lockdown, "com.apple.iosdiagnostics.relay", &service);
+	}
+	if (lerr != LOCKDOWN_E_SUCCESS || !service || service->port == 0) {
+		fprintf(stderr, "[%s] Could not start diagnostics service, error code %d\n", dev->udid, lerr);
+		lockdownd_service_descriptor_free(service);
+		goto error;
+	}
+	diagnostics_relay_error_t derr = diagnostics_relay_client_new(dev->device, service, &dev->diag);
+	lockdownd_service_descriptor_free(service);
+	if (derr != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		fprintf(stderr, "[%s] Could not connect to diagnostics service, error code %d\n", dev->udid, derr);
+		goto error;
+	}
+
+	if (diagnostics_relay_sampler_new(dev->diag, &dev->sampler) != DIAGNOSTICS_RELAY_E_SUCCESS
+	    || diagnostics_relay_sampler_add_ioregistry_entry(dev->sampler, NULL, POWER_SOURCE_CLASS) != DIAGNOSTICS_RELAY_E_SUCCESS) {
+		goto error;
+	}
+
+	return 0;
+
+error:
+	device_disconnect(dev);
+	return -1;
+}
+
+static int device_sample(struct telemetry_device *dev, time_t now)
+{
+	plist_t results[NUM_DOMAINS];
+	int i;
+
+	/* all domains are queried with a single round trip */
+	if (lockdownd_get_values(dev->lockdown, domains, domain_keys, NUM_DOMAINS, results) != LOCKDOWN_E_SUCCESS) {
+		return -1;
+	}
+	for (i = 0; i < NUM_DOMAINS; i++) {
+		if (!results[i] || plist_get_node_type(results[i]) != PLIST_DICT) {
+			plist_free(results[i]);
+			continue;
+		}
+		line_begin(domain_measurements[i], dev->udid);
+		plist_dict_iter iter = NULL;
+		plist_dict_new_iter(results[i], &iter);
+		if (iter) {
+			char *key = NULL;
+			plist_t value = NULL;
+			do {
+				key = NULL;
+				value = NULL;
+				plist_dict_next_item(results[i], iter, &key, &value);
+				if (key) {
+					/* only report values that changed */
+					plist_t old = (dev->last[i]) ? plist_dict_get_item(dev->last[i], key) : NULL;
+					if (!old || plist_get_node_type(old) != plist_get_node_type(value) || !plist_compare_node_value(old, value)) {
+						line_add_field(key, value);
+					}
+				}
+				free(key);
+			} while (value);
+			free(iter);
+		}
+		line_end(now);
+		plist_free(dev->last[i]);
+		dev->last[i] = results[i];
+	}
+
+	line_begin("power", dev->udid);
+	diagnostics_relay_error_t derr = diagnostics_relay_sampler_sample(dev->sampler, sample_cb, dev->udid);
+	line_end(now);
+
+	return (derr == DIAGNOSTICS_RELAY_E_SUCCESS) ? 0 : -1;
+}
+
+static void device_event_cb(const idevice_event_t* event, void* userdata)
+{
+	if (use_network && event->conn_type != CONNECTION_NETWORK) {
+		return;
+	} else if (!use_network && event->conn_type != CONNECTION_USBMUXD) {
+		return;
+	}
+	if (filter_udid && strcmp(filter_udid, event->udid) != 0) {
+		return;
+	}
+
+	struct telemetry_device *dev;
+	mutex_lock(&devices_mutex);
+	for (dev = devices; dev; dev = dev->next) {
+		if (!strcmp(dev->udid, event->udid))
+			break;
+	}
+	if (event->event == IDEVICE_DEVICE_ADD) {
+		if (dev) {
+			dev->removed = 0;
+		} else {
+			/* connections are made by the sampling loop, not in the event thread */
+			dev = (struct telemetry_device*)calloc(1, sizeof(struct telemetry_device));
+			if (dev) {
+				dev->udid = strdup(event->udid);
+				dev->next = devices;
+				devices = dev;
+			}
+		}
+	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
+		if (dev) {
+			dev->removed = 1;
+		}
+	}
+	mutex_unlock(&devices_mutex);
+}
+
+static void clean_exit(int sig)
+{
+	quit_flag++;
+}
+
+static void print_usage(int argc, char **argv, int is_error)
+{
+	char *bname = strrchr(argv[0], '/');
+	bname = (bname) ? bname + 1 : argv[0];
+
+	fprintf(is_error ? stderr : stdout, "Usage: %s [OPTIONS]\n", bname);
+	fprintf(is_error ? stderr : stdout, "\n" \
+		"Periodically sample battery, disk usage and thermal data of all attached\n" \
+		"devices and print changed values in InfluxDB line protocol.\n" \
+		"\n" \
+		"OPTIONS:\n" \
+		"  -u, --udid UDID       only sample the device with UDID\n" \
+		"  -n, --network         sample network devices instead of USB devices\n" \
+		"  -i, --interval SECS   time between two samples (default 60)\n" \
+		"  -d, --debug           enable communication debugging\n" \
+		"  -h, --help            prints usage information\n" \
+		"  -v, --version         prints version information\n" \
+		"\n" \
+		"Homepage:    <" PACKAGE_URL ">\n" \
+		"Bug Reports: <" PACKAGE_BUGREPORT ">\n"
+	);
+}
+
+int main(int argc, char **argv)
+{
+	int c = 0;
+	const struct option longopts[] = {
+		{ "udid",     required_argument, NULL, 'u' },
+		{ "network",  no_argument,       NULL, 'n' },
+		{ "interval", required_argument, NULL, 'i' },
+		{ "debug",    no_argument,       NULL, 'd' },
+		{ "help",     no_argument,       NULL, 'h' },
+		{ "version",  no_argument,       NULL, 'v' },
+		{ NULL, 0, NULL, 0}
+	};
+	unsigned int interval = DEFAULT_INTERVAL;
+
+	signal(SIGINT, clean_exit);
+	signal(SIGTERM, clean_exit);
+#ifndef WIN32
+	signal(SIGQUIT, clean_exit);
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	while ((c = getopt_long(argc, argv, "u:ni:dhv", longopts, NULL)) != -1) {
+		switch (c) {
+		case 'u':
+			if (!*optarg) {
+				fprintf(stderr, "ERROR: UDID must not be empty!\n");
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			filter_udid = optarg;
+			break;
+		case 'n':
+			use_network = 1;
+			break;
+		case 'i':
+			interval = (unsigned int)strtoul(optarg, NULL, 10);
+			if (interval == 0) {
+				fprintf(stderr, "ERROR: Invalid interval '%s'\n", optarg);
+				print_usage(argc, argv, 1);
+				return 2;
+			}
+			break;
+		case 'd':
+			idevice_set_debug_level(1);
+			break;
+		case 'h':
+			print_usage(argc, argv, 0);
+			return 0;
+		case 'v':
+			printf("%s %s\n", TOOL_NAME, PACKAGE_VERSION);
+			return 0;
+		default:
+			print_usage(argc, argv, 1);
+			return 2;
+		}
+	}
+
+	mutex_init(&devices_mutex);
+	idevice_event_subscribe(device_event_cb, NULL);
+
+	while (!quit_flag) {
+		time_t now = time(NULL);
+		struct telemetry_device *dev;
+		struct telemetry_device *prev = NULL;
+
+		mutex_lock(&devices_mutex);
+		dev = devices;
+		while (dev) {
+			struct telemetry_device *next = dev->next;
+			if (dev->removed) {
+				if (prev) {
+					prev->next = next;
+				} else {
+					devices = next;
+				}
+				if (dev->device) {
+					print_event(dev->udid, "disconnected", now);
+				}
+				device_free(dev);
+				dev = next;
+				continue;
+			}
+			prev = dev;
+			dev = next;
+		}
+
+		/* the event thread only adds devices, so the list can be sampled unlocked */
+		dev = devices;
+		mutex_unlock(&devices_mutex);
+
+		for (; dev && !quit_flag; dev = dev->next) {
+			if (!dev->device) {
+				if (device_connect(dev) < 0)
+					continue;
+				print_event(dev->udid, "connected", now);
+			}
+			if (device_sample(dev, now) < 0) {
+				fprintf(stderr, "[%s] Sampling failed, reconnecting on next sample\n", dev->udid);
+				device_disconnect(dev);
+			}
+		}
+		fflush(stdout);
+
+		unsigned int slept;
+		for (slept = 0; slept < interval && !quit_flag; slept++) {
+			sleep(1);
+		}
+	}
+
+	idevice_event_unsubscribe();
+
+	while (devices) {
+		struct telemetry_device *next = devices->next;
+		device_free(devices);
+		devices = next;
+	}
+	free(line);
+	mutex_destroy(&devices_mutex);
+
+	return 0;
+}